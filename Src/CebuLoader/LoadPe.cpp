@@ -63,27 +63,153 @@ namespace FSecure::Loader
 #endif
 
 	/// Get address of detour function
-	/// @param dllName - name of dll to import function from
-	/// @param funcName - name of a function to import
+	/// @param funcName - name of a function imported from kernel32.dll, only its functions are detoured
 	/// @returns If function should be redirected - address of detour function, else nullptr
-	void* GetDetourAddress(const char* dllName, const char* funcName)
+	void* GetDetourAddress(const char* funcName)
 	{
 #if defined _M_AMD64
 		// detour RtlPcToFileHeader to return our Dll base address, std::eception throwing and exception_ptr creation use this address
-		if (_stricmp(dllName,"kernel32.dll") == 0 && strcmp(funcName, "RtlPcToFileHeader") == 0)
+		if (strcmp(funcName, "RtlPcToFileHeader") == 0)
 			return (void*)RtlPcToFileHeaderDetour;
 
 #elif defined _M_IX86
 		// detour GetModuleHandleExW because Windows thread pool tries to free our Dll on callback completion
 		// see msvcp140.dll.Concurrency::details::`anonymous namespace'::_Task_scheduler_callback
 		// see C:\Program Files (x86)\Microsoft Visual Studio\2017\Professional\VC\Tools\MSVC\14.16.27023\crt\src\stl\taskscheduler.cpp -> around line 147
-		if (_stricmp(dllName, "kernel32.dll") == 0 && strcmp(funcName, "GetModuleHandleExW") == 0)
+		if (strcmp(funcName, "GetModuleHandleExW") == 0)
 			return (void*)GetModuleHandleExWDetour;
 
 #endif
 		return nullptr;
 	}
 
+	/// Get memory protection of section
+	/// @param characteristics - flags of section
+	/// @returns page protection flags for VirtualProtect
+	DWORD GetSectionProtection(DWORD characteristics)
+	{
+		// determine protection flags based on characteristics
+		bool executable = (characteristics & IMAGE_SCN_MEM_EXECUTE) != 0;
+		bool readable = (characteristics & IMAGE_SCN_MEM_READ) != 0;
+		bool writeable = (characteristics & IMAGE_SCN_MEM_WRITE) != 0;
+
+		DWORD protect = 0;
+		if (!executable && !readable && !writeable)
+			protect = PAGE_NOACCESS;
+		else if (!executable && !readable && writeable)
+			protect = PAGE_WRITECOPY;
+		else if (!executable && readable && !writeable)
+			protect = PAGE_READONLY;
+		else if (!executable && readable && writeable)
+			protect = PAGE_READWRITE;
+		else if (executable && !readable && !writeable)
+			protect = PAGE_EXECUTE;
+		else if (executable && !readable && writeable)
+			protect = PAGE_EXECUTE_WRITECOPY;
+		else if (executable && readable && !writeable)
+			protect = PAGE_EXECUTE_READ;
+		else if (executable && readable && writeable)
+			protect = PAGE_EXECUTE_READWRITE;
+
+		if (characteristics & IMAGE_SCN_MEM_NOT_CACHED)
+			protect |= PAGE_NOCACHE;
+
+		return protect;
+	}
+
+	/// Resolves imports of loaded image
+	/// Every dll is loaded once, even if it is listed by many import descriptors. Its exports are indexed by name on the first import by name, instead of GetProcAddress walking them for every function
+	class ImportResolver
+	{
+	public:
+		/// Loaded dll
+		struct Module
+		{
+			HMODULE m_Handle = nullptr;
+			bool m_IsKernel32 = false;
+			bool m_IsIndexed = false;
+			std::unordered_map<std::string_view, DWORD> m_Exports;													///< RVAs of functions by name. Forwarded functions are left to GetProcAddress
+		};
+
+		/// Get dll, loading it on the first call
+		/// @param dllName - name of dll to import functions from
+		/// @returns loaded dll. Its handle is null if dll couldn't be loaded
+		Module& GetModule(const char* dllName)
+		{
+			std::string key = dllName;
+			std::transform(key.begin(), key.end(), key.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+			auto [module, isNew] = m_Modules.try_emplace(std::move(key));
+			if (isNew)
+			{
+				module->second.m_Handle = LoadLibraryA(dllName);
+				module->second.m_IsKernel32 = module->first == "kernel32.dll";
+			}
+
+			return module->second;
+		}
+
+		/// Resolve function imported by name
+		/// @param module - dll to import function from
+		/// @param funcName - name of a function to import
+		/// @returns address of function or its detour, nullptr if function was not found
+		void* Resolve(Module& module, const char* funcName)
+		{
+			// check if the function should be detoured by redirecting the imported function address
+			if (module.m_IsKernel32)
+				if (auto detour = GetDetourAddress(funcName))
+					return detour;
+
+			if (!module.m_Handle)
+				return nullptr;
+
+			if (!module.m_IsIndexed)
+				Index(module);
+
+			if (auto function = module.m_Exports.find(funcName); function != module.m_Exports.end())
+				return Rva2Va<void*>(module.m_Handle, function->second);
+
+			return GetProcAddress(module.m_Handle, funcName);
+		}
+
+		/// Resolve function imported by ordinal
+		/// @param module - dll to import function from
+		/// @param ordinal - ordinal of a function to import
+		/// @returns address of function, nullptr if function was not found
+		void* Resolve(Module& module, ULONG_PTR ordinal)
+		{
+			return module.m_Handle ? GetProcAddress(module.m_Handle, (LPCSTR)ordinal) : nullptr;
+		}
+
+	private:
+		/// Walk export directory of dll once and index its functions by name
+		/// @param module - dll to index
+		void Index(Module& module)
+		{
+			module.m_IsIndexed = true;
+			auto dllBase = (UINT_PTR)module.m_Handle;
+			auto dataDir = &GetNtHeaders(dllBase)->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+			if (!dataDir->Size)
+				return;
+
+			auto exportDir = Rva2Va<PIMAGE_EXPORT_DIRECTORY>(dllBase, dataDir->VirtualAddress);
+			auto names = Rva2Va<PDWORD>(dllBase, exportDir->AddressOfNames);
+			auto nameOrdinals = Rva2Va<PWORD>(dllBase, exportDir->AddressOfNameOrdinals);
+			auto functions = Rva2Va<PDWORD>(dllBase, exportDir->AddressOfFunctions);
+			module.m_Exports.reserve(exportDir->NumberOfNames);
+			for (DWORD i = 0; i < exportDir->NumberOfNames; i++)
+			{
+				// forwarded function points to "dll.function" string inside export directory
+				auto functionRva = functions[nameOrdinals[i]];
+				if (functionRva >= dataDir->VirtualAddress && functionRva < dataDir->VirtualAddress + dataDir->Size)
+					continue;
+
+				module.m_Exports.emplace(Rva2Va<const char*>(dllBase, names[i]), functionRva);
+			}
+		}
+
+		std::unordered_map<std::string, Module> m_Modules;																///< Loaded dlls by lowercase name
+	};
+
 	int LoadPe(void* dllData, std::string_view callExport)
 	{
 		// Loader code based on Shellcode Reflective DLL Injection by Nick Landers https://github.com/monoxgas/sRDI
@@ -160,23 +286,23 @@ namespace FSecure::Loader
 
 			auto relocation = Rva2Va<PIMAGE_BASE_RELOCATION>(baseAddress, dataDir->VirtualAddress);
 
+			// every block covers a single page, so all its entries are applied to one page before moving to the next one
 			while (relocation->VirtualAddress)
 			{
+				auto page = (PBYTE)baseAddress + relocation->VirtualAddress;
 				auto relocList = (PIMAGE_RELOC)(relocation + 1);
+				auto relocEnd = (PIMAGE_RELOC)((PBYTE)relocation + relocation->SizeOfBlock);
 
-				while ((PBYTE)relocList != (PBYTE)relocation + relocation->SizeOfBlock)
+				for (; relocList != relocEnd; relocList++)
 				{
-
-					if (relocList->type == IMAGE_REL_BASED_DIR64)
-						*(PULONG_PTR)((PBYTE)baseAddress + relocation->VirtualAddress + relocList->offset) += baseOffset;
-					else if (relocList->type == IMAGE_REL_BASED_HIGHLOW)
-						*(PULONG_PTR)((PBYTE)baseAddress + relocation->VirtualAddress + relocList->offset) += (DWORD)baseOffset;
-					else if (relocList->type == IMAGE_REL_BASED_HIGH)
-						*(PULONG_PTR)((PBYTE)baseAddress + relocation->VirtualAddress + relocList->offset) += HIWORD(baseOffset);
-					else if (relocList->type == IMAGE_REL_BASED_LOW)
-						*(PULONG_PTR)((PBYTE)baseAddress + relocation->VirtualAddress + relocList->offset) += LOWORD(baseOffset);
-
-					relocList++;
+					switch (relocList->type)
+					{
+					case IMAGE_REL_BASED_DIR64: *(PULONG_PTR)(page + relocList->offset) += baseOffset; break;
+					case IMAGE_REL_BASED_HIGHLOW: *(PULONG_PTR)(page + relocList->offset) += (DWORD)baseOffset; break;
+					case IMAGE_REL_BASED_HIGH: *(PULONG_PTR)(page + relocList->offset) += HIWORD(baseOffset); break;
+					case IMAGE_REL_BASED_LOW: *(PULONG_PTR)(page + relocList->offset) += LOWORD(baseOffset); break;
+					default: break; // IMAGE_REL_BASED_ABSOLUTE pads blocks
+					}
 				}
 				relocation = (PIMAGE_BASE_RELOCATION)relocList;
 			}
@@ -186,6 +312,7 @@ namespace FSecure::Loader
 		// STEP 5: process our import table
 		///
 
+		ImportResolver importResolver;
 		dataDir = &ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
 
 		if (dataDir->Size)
@@ -193,8 +320,7 @@ namespace FSecure::Loader
 			auto importDesc = Rva2Va<PIMAGE_IMPORT_DESCRIPTOR>(baseAddress, dataDir->VirtualAddress);
 			for (; importDesc->Name; importDesc++)
 			{
-				auto libName = (LPCSTR)(baseAddress + importDesc->Name);
-				auto libraryAddress = (PBYTE)LoadLibraryA(libName);
+				auto& module = importResolver.GetModule((LPCSTR)(baseAddress + importDesc->Name));
 				auto firstThunk = Rva2Va<PIMAGE_THUNK_DATA>(baseAddress, importDesc->FirstThunk);
 				auto origFirstThunk = Rva2Va<PIMAGE_THUNK_DATA>(baseAddress, importDesc->OriginalFirstThunk);
 
@@ -202,18 +328,9 @@ namespace FSecure::Loader
 				for (; origFirstThunk->u1.Function; firstThunk++, origFirstThunk++)
 				{
 					if (IMAGE_SNAP_BY_ORDINAL(origFirstThunk->u1.Ordinal))
-					{
-						firstThunk->u1.Function = (ULONG_PTR)GetProcAddress((HMODULE)libraryAddress, (LPCSTR)IMAGE_ORDINAL(origFirstThunk->u1.Ordinal));
-					}
+						firstThunk->u1.Function = (ULONG_PTR)importResolver.Resolve(module, IMAGE_ORDINAL(origFirstThunk->u1.Ordinal));
 					else
-					{
-						auto importByName = Rva2Va<PIMAGE_IMPORT_BY_NAME>(baseAddress, origFirstThunk->u1.AddressOfData);
-						// check if the function should be detoured by redirecting the imported function address
-						void* addr = GetDetourAddress(libName, importByName->Name);
-						if (!addr)
-							addr = GetProcAddress((HMODULE)libraryAddress, importByName->Name);
-						firstThunk->u1.Function = (ULONG_PTR)addr;
-					}
+						firstThunk->u1.Function = (ULONG_PTR)importResolver.Resolve(module, Rva2Va<PIMAGE_IMPORT_BY_NAME>(baseAddress, origFirstThunk->u1.AddressOfData)->Name);
 				}
 			}
 		}
@@ -230,8 +347,7 @@ namespace FSecure::Loader
 
 			for (; delayDesc->DllNameRVA; delayDesc++)
 			{
-				auto libName = (LPCSTR)(baseAddress + delayDesc->DllNameRVA);
-				auto libraryAddress = (PBYTE)LoadLibraryA(libName);
+				auto& module = importResolver.GetModule((LPCSTR)(baseAddress + delayDesc->DllNameRVA));
 				auto firstThunk = Rva2Va<PIMAGE_THUNK_DATA>(baseAddress, delayDesc->ImportAddressTableRVA);
 				auto origFirstThunk = Rva2Va<PIMAGE_THUNK_DATA>(baseAddress, delayDesc->ImportNameTableRVA);
 
@@ -239,17 +355,9 @@ namespace FSecure::Loader
 				for (; firstThunk->u1.Function; firstThunk++, origFirstThunk++)
 				{
 					if (IMAGE_SNAP_BY_ORDINAL(origFirstThunk->u1.Ordinal))
-					{
-						firstThunk->u1.Function = (ULONG_PTR)GetProcAddress((HMODULE)libraryAddress, (LPCSTR)IMAGE_ORDINAL(origFirstThunk->u1.Ordinal));
-					}
+						firstThunk->u1.Function = (ULONG_PTR)importResolver.Resolve(module, IMAGE_ORDINAL(origFirstThunk->u1.Ordinal));
 					else
-					{
-						auto importByName = Rva2Va<PIMAGE_IMPORT_BY_NAME>(baseAddress, origFirstThunk->u1.AddressOfData);
-						void* addr = GetDetourAddress(libName, importByName->Name);
-						if (!addr)
-							addr = GetProcAddress((HMODULE)libraryAddress, importByName->Name);
-						firstThunk->u1.Function = (ULONG_PTR)addr;
-					}
+						firstThunk->u1.Function = (ULONG_PTR)importResolver.Resolve(module, Rva2Va<PIMAGE_IMPORT_BY_NAME>(baseAddress, origFirstThunk->u1.AddressOfData)->Name);
 				}
 			}
 		}
@@ -257,45 +365,36 @@ namespace FSecure::Loader
 		///
 		// STEP 7: Finalize our sections. Set memory protections.
 		///
+		// neighbouring sections with the same flags are protected with a single call, their ranges are rounded up to pages anyway
 		sectionHeader = IMAGE_FIRST_SECTION(ntHeaders);
-
-		for (int i = 0; i < ntHeaders->FileHeader.NumberOfSections; i++, sectionHeader++)
+		DWORD rangeBegin = 0, rangeEnd = 0, rangeProtect = 0;
+		for (int i = 0; i <= ntHeaders->FileHeader.NumberOfSections; i++, sectionHeader++)
 		{
-			if (sectionHeader->SizeOfRawData)
+			auto isLast = i == ntHeaders->FileHeader.NumberOfSections;
+			if (!isLast && !sectionHeader->SizeOfRawData)
+				continue;
+
+			auto protect = isLast ? 0 : GetSectionProtection(sectionHeader->Characteristics);
+			if (!isLast && rangeEnd && protect == rangeProtect && sectionHeader->VirtualAddress <= rangeEnd)
 			{
-				// determine protection flags based on characteristics
-				bool executable = (sectionHeader->Characteristics & IMAGE_SCN_MEM_EXECUTE) != 0;
-				bool readable = (sectionHeader->Characteristics & IMAGE_SCN_MEM_READ) != 0;
-				bool writeable = (sectionHeader->Characteristics & IMAGE_SCN_MEM_WRITE) != 0;
-
-				DWORD protect = 0;
-				if (!executable && !readable && !writeable)
-					protect = PAGE_NOACCESS;
-				else if (!executable && !readable && writeable)
-					protect = PAGE_WRITECOPY;
-				else if (!executable && readable && !writeable)
-					protect = PAGE_READONLY;
-				else if (!executable && readable && writeable)
-					protect = PAGE_READWRITE;
-				else if (executable && !readable && !writeable)
-					protect = PAGE_EXECUTE;
-				else if (executable && !readable && writeable)
-					protect = PAGE_EXECUTE_WRITECOPY;
-				else if (executable && readable && !writeable)
-					protect = PAGE_EXECUTE_READ;
-				else if (executable && readable && writeable)
-					protect = PAGE_EXECUTE_READWRITE;
-
-				if (sectionHeader->Characteristics & IMAGE_SCN_MEM_NOT_CACHED)
-					protect |= PAGE_NOCACHE;
-
-				// change memory access flags
-				VirtualProtect(Rva2Va<LPVOID>(baseAddress, sectionHeader->VirtualAddress), sectionHeader->SizeOfRawData, protect, &protect);
+				rangeEnd = std::max<DWORD>(rangeEnd, (DWORD)AlignValueUp(sectionHeader->VirtualAddress + sectionHeader->SizeOfRawData, sysInfo.dwPageSize));
+				continue;
 			}
+
+			// change memory access flags
+			if (rangeEnd)
+				VirtualProtect(Rva2Va<LPVOID>(baseAddress, rangeBegin), rangeEnd - rangeBegin, rangeProtect, &rangeProtect);
+
+			if (isLast)
+				break;
+
+			rangeBegin = sectionHeader->VirtualAddress;
+			rangeEnd = (DWORD)AlignValueUp(sectionHeader->VirtualAddress + sectionHeader->SizeOfRawData, sysInfo.dwPageSize);
+			rangeProtect = protect;
 		}
 
 		// We must flush the instruction cache to avoid stale code being used
-		FlushInstructionCache((HANDLE)-1, nullptr, 0);
+		FlushInstructionCache((HANDLE)-1, (void*)baseAddress, alignedImageSize);
 
 		///
 		// STEP 7.1: Set static TLS values
@@ -8,6 +8,7 @@
 #include <ciso646>
 #include <string>
 #include <csetjmp>
+#include <unordered_map>
 
 // Custom includes
 #include "WindowsVersion.h"
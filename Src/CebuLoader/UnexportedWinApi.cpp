@@ -3,6 +3,10 @@
 #include "PeUtils.h"
 #include <algorithm>
 #include <string>
+#include <vector>
+#include <cstring>
+#include <intrin.h>
+#include <emmintrin.h>
 using namespace std::string_literals;
 
 // Based on Blackbone https://github.com/DarthTon/Blackbone
@@ -133,19 +137,58 @@ namespace FSecure::Loader::UnexportedWinApi
 #else
 #error Unsupported architecture
 #endif
-		void* Find(void* begin, void* end, std::pair<std::string, size_t> const& offsetData)
+		/// Finds all patterns in a single sweep of memory.
+		/// Every 16 bytes are compared at once with the first byte of each pattern that was not found yet. Only these candidates are compared byte by byte.
+		/// @param begin of memory to search
+		/// @param end of memory to search
+		/// @param offsetData patterns and offsets of symbols from the beginning of patterns
+		/// @returns address of the first match of each pattern moved back by its offset. Aborts if any pattern is not found
+		std::vector<void*> FindAll(void* begin, void* end, std::vector<std::pair<std::string, size_t>> const& offsetData)
 		{
-			auto match = std::search((char*)begin, (char*)end, offsetData.first.begin(), offsetData.first.end());
-			if (match == end)
+			auto current = (char const*)begin, last = (char const*)end;
+			std::vector<void*> found(offsetData.size(), nullptr);
+			auto remaining = offsetData.size();
+			auto verify = [&](char const* candidate, size_t index)
+			{
+				auto const& pattern = offsetData[index].first;
+				if ((size_t)(last - candidate) < pattern.size() || memcmp(candidate, pattern.data(), pattern.size()))
+					return;
+
+				found[index] = (void*)(candidate - offsetData[index].second);
+				--remaining;
+			};
+
+			for (; remaining && (size_t)(last - current) >= sizeof(__m128i); current += sizeof(__m128i))
+			{
+				auto block = _mm_loadu_si128((__m128i const*)current);
+				for (size_t i = 0; i < offsetData.size(); ++i)
+				{
+					auto candidates = (unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(offsetData[i].first.front())));
+					for (unsigned long bit; !found[i] && _BitScanForward(&bit, candidates); candidates &= candidates - 1)
+						verify(current + bit, i);
+				}
+			}
+
+			for (; remaining && current < last; ++current)
+				for (size_t i = 0; i < offsetData.size(); ++i)
+					if (!found[i] && *current == offsetData[i].first.front())
+						verify(current, i);
+
+			if (remaining)
 				QuietAbort();
-			return (void*)(match - offsetData.second);
+			return found;
 		}
 
-		void* FindInSection(std::wstring const& dll, std::string const& section, std::pair<std::string, size_t> const& offsetData)
+		void* Find(void* begin, void* end, std::pair<std::string, size_t> const& offsetData)
+		{
+			return FindAll(begin, end, { offsetData }).front();
+		}
+
+		std::vector<void*> FindAllInSection(std::wstring const& dll, std::string const& section, std::vector<std::pair<std::string, size_t>> const& offsetData)
 		{
 			auto dllBase = GetModuleHandleW(dll.c_str());
 			auto [begin, end] = GetSectionRange(dllBase, section);
-			return Find(begin, end, offsetData);
+			return FindAll(begin, end, offsetData);
 		}
 
 		void* FindSymbol(std::wstring const& dll, std::pair<std::string, size_t> const& offsetData)
@@ -156,40 +199,49 @@ namespace FSecure::Loader::UnexportedWinApi
 			return Find(dllBase, dllBase + dllSize, offsetData);
 		}
 
-		void* FindNtDllSymbol(std::pair<std::string, size_t> const& offsetData)
+		/// Private ntdll symbols used by the loader
+		struct NtDllSymbols
 		{
-			return FindInSection(L"ntdll.dll", ".text", offsetData);
-		}
-
+			void* m_LdrpHandleTlsData = nullptr;
 #if defined _M_IX86
-		void* g_RtlInsertInvertedFunctionTable = nullptr;
-		void* GetRtlInsertInvertedFunctionTable()
-		{
-			if (!g_RtlInsertInvertedFunctionTable)
-				g_RtlInsertInvertedFunctionTable = FindNtDllSymbol(GetRtlInsertInvertedFunctionTableOffset());
-			return g_RtlInsertInvertedFunctionTable;
-		}
+			void* m_RtlInsertInvertedFunctionTable = nullptr;
+			void* m_LdrpInvertedFunctionTable = nullptr;															///< Only Win7 requires it
+#endif // defined _M_IX86
+		};
 
-		void* g_LdrpInvertedFunctionTable = nullptr;
-		void* GetLdrpInvetedFunctionTable()
+		bool g_AreNtDllSymbolsResolved = false;
+		NtDllSymbols g_NtDllSymbols;
+
+		/// Resolves all symbols in one sweep of ntdll's .text on the first call. Windows version doesn't change, so the result is reused
+		/// @returns resolved symbols. Aborts if any of them cannot be found
+		NtDllSymbols const& GetNtDllSymbols()
 		{
-			if (!g_LdrpInvertedFunctionTable)
-				g_LdrpInvertedFunctionTable = *(void**)FindNtDllSymbol(GetLdrpInvertedFunctionTableOffset());
-			return g_LdrpInvertedFunctionTable;
-		}
+			if (g_AreNtDllSymbolsResolved)
+				return g_NtDllSymbols;
+
+			std::vector<std::pair<std::string, size_t>> offsetData{ GetLdrpHandleTlsOffsetData() };
+#if defined _M_IX86
+			offsetData.push_back(GetRtlInsertInvertedFunctionTableOffset());
+			if (!IsWindows8OrGreater())
+				offsetData.push_back(GetLdrpInvertedFunctionTableOffset());
 #endif // defined _M_IX86
-		void* g_LdrpHandleTlsData = nullptr;
-		void* GetLdrpHandleTlsData()
-		{
-			if (!g_LdrpHandleTlsData)
-				g_LdrpHandleTlsData = FindNtDllSymbol(GetLdrpHandleTlsOffsetData());
-			return g_LdrpHandleTlsData;
+
+			auto found = FindAllInSection(L"ntdll.dll", ".text", offsetData);
+			g_NtDllSymbols.m_LdrpHandleTlsData = found[0];
+#if defined _M_IX86
+			g_NtDllSymbols.m_RtlInsertInvertedFunctionTable = found[1];
+			if (found.size() > 2)
+				g_NtDllSymbols.m_LdrpInvertedFunctionTable = *(void**)found[2];
+#endif // defined _M_IX86
+
+			g_AreNtDllSymbolsResolved = true;
+			return g_NtDllSymbols;
 		}
 	} // namespace
 
 	DWORD LdrpHandleTlsData(void* baseAddress)
 	{
-		auto ldrpHandleTlsData = GetLdrpHandleTlsData();
+		auto ldrpHandleTlsData = GetNtDllSymbols().m_LdrpHandleTlsData;
 		LDR_DATA_TABLE_ENTRY ldrDataTableEntry{};
 		ldrDataTableEntry.DllBase = baseAddress;
 #if defined _M_X64
@@ -207,13 +259,14 @@ namespace FSecure::Loader::UnexportedWinApi
 #if defined _M_IX86
 	void RtlInsertInvertedFunctionTable(void* baseAddress, DWORD sizeOfImage)
 	{
-		auto rtlInsertInvertedFunctionTable = GetRtlInsertInvertedFunctionTable();
+		auto const& symbols = GetNtDllSymbols();
+		auto rtlInsertInvertedFunctionTable = symbols.m_RtlInsertInvertedFunctionTable;
 		if (IsWindows8Point1OrGreater())
 			((RtlInsertInvertedFunctionTableWin8Point1OrGreater)rtlInsertInvertedFunctionTable)(baseAddress, sizeOfImage);
 		else if (IsWindows8OrGreater())
 			((RtlInsertInvertedFunctionTableWin8OrGreater)rtlInsertInvertedFunctionTable)(baseAddress, sizeOfImage);
 		else
-			((RtlInsertInvertedFunctionTableWin7OrGreater)rtlInsertInvertedFunctionTable)(GetLdrpInvetedFunctionTable(), baseAddress, sizeOfImage);
+			((RtlInsertInvertedFunctionTableWin7OrGreater)rtlInsertInvertedFunctionTable)(symbols.m_LdrpInvertedFunctionTable, baseAddress, sizeOfImage);
 	}
 #endif // defined _M_IX86
 
@@ -4,13 +4,61 @@ namespace FSecure::C3::Linter
 {
 	using StringVector = std::vector<std::string>;
 
+	/// Helper struct that holds channel benchmark configuration
+	struct BenchmarkConfig
+	{
+		/// Size of benchmark packet and its weight in distribution of packet sizes
+		struct PacketSize
+		{
+			/// Size in bytes
+			size_t m_Size;
+
+			/// Relative probability of drawing this size
+			uint32_t m_Weight;
+		};
+
+		/// Distribution of packet sizes
+		std::vector<PacketSize> m_PacketSizes;
+
+		/// Number of packets to send
+		size_t m_PacketCount = 100;
+
+		/// Number of threads sending packets
+		size_t m_Concurrency = 1;
+
+		/// Path of file to write JSON report to. Report is printed to standard output if not set
+		std::optional<std::string> m_OutputPath;
+	};
+
+	/// Helper struct that holds channel soak test configuration
+	struct SoakConfig
+	{
+		/// How long packets are sent
+		std::chrono::minutes m_Duration{ 60 };
+
+		/// Number of complementary channel pairs used at once
+		size_t m_Pairs = 4;
+
+		/// Time between samples of throughput and resource usage
+		std::chrono::seconds m_SampleInterval{ 60 };
+
+		/// Path of file to write JSON report to. File is rewritten after every sample. Report is printed to standard output if not set
+		std::optional<std::string> m_OutputPath;
+	};
+
 	/// Helper struct that holds Channel linter configuration
 	struct AppConfig
 	{
 		/// @returns true if an instance of a channel should be created
 		bool ShouldCreateChannel() const
 		{
-			return m_ChannelArguments || m_Command || m_TestChannelIO;
+			return m_ChannelArguments || m_Command || m_TestChannelIO || m_Benchmark || m_Soak;
+		}
+
+		/// @returns true if a complementary channel should be created
+		bool ShouldCreateComplementaryChannel() const
+		{
+			return m_TestChannelIO || m_Benchmark;
 		}
 
 		/// Whether -h was set
@@ -33,5 +81,11 @@ namespace FSecure::C3::Linter
 
 		/// Command id and its arguments
 		std::optional<StringVector> m_Command;
+
+		/// Benchmark configuration. Set if -b was present
+		std::optional<BenchmarkConfig> m_Benchmark;
+
+		/// Soak test configuration. Set if -s was present
+		std::optional<SoakConfig> m_Soak;
 	};
 }
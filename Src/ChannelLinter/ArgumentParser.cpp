@@ -21,6 +21,13 @@ namespace FSecure::C3::Linter
 		m_ArgParser.addArgument("-c", "--complementary", '*');
 		m_ArgParser.addArgument("-i", "--test-io");
 		m_ArgParser.addArgument("-x", "--command", '+');
+		m_ArgParser.addArgument("-b", "--benchmark", '*');
+		m_ArgParser.addArgument("--packets", 1);
+		m_ArgParser.addArgument("--threads", 1);
+		m_ArgParser.addArgument("--output", 1);
+		m_ArgParser.addArgument("-s", "--soak", 1);
+		m_ArgParser.addArgument("--pairs", 1);
+		m_ArgParser.addArgument("--sample", 1);
 		m_ArgParser.useExceptions(true);
 	}
 
@@ -55,6 +62,28 @@ Options:
   -x <ID> [ARGS... ], --command <ID> [ARGS... ]
                         Execute a command with a given <ID> and arguments [ARGS...]
 
+  -b [SIZE[:WEIGHT]...], --benchmark [SIZE[:WEIGHT]...]
+                        Create a pair of channels like -i does and measure throughput, latency and
+                        number of channel calls per packet. Packet sizes are drawn from given SIZEs,
+                        with probability proportional to WEIGHTs (1 by default). Default sizes: 64 1024 65536.
+                        Prints a JSON report.
+
+  --packets <N>         Number of packets sent by benchmark. Default: 100.
+
+  --threads <N>         Number of threads sending benchmark packets. Default: 1.
+
+  --output <FILE>       Write benchmark or soak JSON report to <FILE> instead of standard output.
+
+  -s <MINUTES>, --soak <MINUTES>
+                        Create several pairs of channels and send packets through all of them for <MINUTES>.
+                        Packet sizes are randomized around QoS frame boundaries. Throughput, process memory,
+                        QoS receive queues and number of files in directories given in channel arguments
+                        are sampled periodically. Prints a JSON report with samples and detected regressions.
+
+  --pairs <N>           Number of channel pairs used by soak test. Default: 4.
+
+  --sample <SECONDS>    Time between soak test samples. Default: 60.
+
 Examples:
     1. Parse the json returned from GetCapability and validate it against C3 rules:
         ChannelLinter.exe -n UncShareFile
@@ -67,6 +96,12 @@ Examples:
 
      4. Execute channel command:
          ChannelLinter.exe -n UncShareFile --args inputId outputId C:\Temp\C3Store false -x 0
+
+     5. Benchmark channel with 1000 packets, mostly small ones, sent from 4 threads:
+         ChannelLinter.exe -n UncShareFile --args inputId outputId C:\Temp\C3Store false -b 64:8 65536:2 --packets 1000 --threads 4
+
+     6. Soak channel for 8 hours with 16 pairs of channels:
+         ChannelLinter.exe -n UncShareFile --args inputId outputId C:\Temp\C3Store false -s 480 --pairs 16 --output soak.json
 )";
 	}
 
@@ -88,6 +123,49 @@ Examples:
 
 		if (m_ArgParser.exists("command"))
 			m_Config.m_Command = m_ArgParser.retrieve<StringVector>("command");
+
+		if (m_ArgParser.exists("benchmark"))
+		{
+			BenchmarkConfig benchmark;
+			auto sizes = m_ArgParser.retrieve<StringVector>("benchmark");
+			if (sizes.empty())
+				sizes = { "64", "1024", "65536" };
+
+			for (auto const& size : sizes)
+			{
+				auto separator = size.find(':');
+				auto weight = separator == std::string::npos ? 1u : static_cast<uint32_t>(std::stoul(size.substr(separator + 1)));
+				benchmark.m_PacketSizes.push_back({ std::stoull(size.substr(0, separator)), weight });
+			}
+
+			if (m_ArgParser.exists("packets"))
+				benchmark.m_PacketCount = std::stoull(m_ArgParser.retrieve<std::string>("packets"));
+
+			if (m_ArgParser.exists("threads"))
+				benchmark.m_Concurrency = std::stoull(m_ArgParser.retrieve<std::string>("threads"));
+
+			if (m_ArgParser.exists("output"))
+				benchmark.m_OutputPath = m_ArgParser.retrieve<std::string>("output");
+
+			m_Config.m_Benchmark = std::move(benchmark);
+		}
+
+		if (m_ArgParser.exists("soak"))
+		{
+			SoakConfig soak;
+			soak.m_Duration = std::chrono::minutes{ std::stoull(m_ArgParser.retrieve<std::string>("soak")) };
+
+			if (m_ArgParser.exists("pairs"))
+				soak.m_Pairs = std::stoull(m_ArgParser.retrieve<std::string>("pairs"));
+
+			if (m_ArgParser.exists("sample"))
+				soak.m_SampleInterval = std::chrono::seconds{ std::stoull(m_ArgParser.retrieve<std::string>("sample")) };
+
+			if (m_ArgParser.exists("output"))
+				soak.m_OutputPath = m_ArgParser.retrieve<std::string>("output");
+
+			m_Config.m_Soak = std::move(soak);
+		}
 	}
 
 	void ArgumentParser::ValidateConfig() const
@@ -100,6 +178,38 @@ Examples:
 
 		if (m_Config.m_Command && !m_Config.m_ChannelArguments)
 			throw std::invalid_argument("Argument error: specified -x (--command) without -a (--args)");
+
+		if (m_Config.m_Benchmark)
+		{
+			if (!m_Config.m_ChannelArguments)
+				throw std::invalid_argument("Argument error: specified -b (--benchmark) without -a (--args)");
+
+			for (auto const& size : m_Config.m_Benchmark->m_PacketSizes)
+				if (size.m_Size < sizeof(uint32_t) || !size.m_Weight)
+					throw std::invalid_argument("Argument error: benchmark packet sizes must be at least 4 bytes and have positive weights");
+
+			if (!m_Config.m_Benchmark->m_PacketCount || !m_Config.m_Benchmark->m_Concurrency)
+				throw std::invalid_argument("Argument error: --packets and --threads must be positive");
+		}
+		else if (m_ArgParser.exists("packets") || m_ArgParser.exists("threads"))
+			throw std::invalid_argument("Argument error: specified --packets or --threads without -b (--benchmark)");
+
+		if (m_Config.m_Soak)
+		{
+			if (!m_Config.m_ChannelArguments)
+				throw std::invalid_argument("Argument error: specified -s (--soak) without -a (--args)");
+
+			if (m_Config.m_Benchmark && m_Config.m_Benchmark->m_OutputPath)
+				throw std::invalid_argument("Argument error: --output can't be used when both -b (--benchmark) and -s (--soak) are specified");
+
+			if (!m_Config.m_Soak->m_Duration.count() || !m_Config.m_Soak->m_Pairs || !m_Config.m_Soak->m_SampleInterval.count())
+				throw std::invalid_argument("Argument error: -s (--soak), --pairs and --sample must be positive");
+		}
+		else if (m_ArgParser.exists("pairs") || m_ArgParser.exists("sample"))
+			throw std::invalid_argument("Argument error: specified --pairs or --sample without -s (--soak)");
+
+		if (m_ArgParser.exists("output") && !m_Config.m_Benchmark && !m_Config.m_Soak)
+			throw std::invalid_argument("Argument error: specified --output without -b (--benchmark) or -s (--soak)");
 	}
 
 }
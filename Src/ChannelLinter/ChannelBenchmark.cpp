@@ -0,0 +1,195 @@
+#include "stdafx.h"
+#include "ChannelBenchmark.h"
+
+#include "Core/QualityOfService.h"
+
+namespace FSecure::C3::Linter
+{
+	namespace
+	{
+		/// Get value below which given fraction of sorted samples fall
+		/// @param sorted - samples in ascending order, must not be empty
+		/// @param fraction - requested fraction in range (0, 1]
+		/// @returns percentile in milliseconds
+		double Percentile(std::vector<double> const& sorted, double fraction)
+		{
+			auto rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+			return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+		}
+	}
+
+	ChannelBenchmark::ChannelBenchmark(BenchmarkConfig config) :
+		m_Config(std::move(config))
+	{
+		GeneratePackets();
+	}
+
+	json ChannelBenchmark::Run(std::shared_ptr<MockDeviceBridge> const& channel, std::shared_ptr<MockDeviceBridge> const& complementary)
+	{
+		assert(channel);
+		assert(complementary);
+
+		std::vector<std::thread> senders;
+		std::vector<std::exception_ptr> errors(m_Config.m_Concurrency);
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < m_Config.m_Concurrency; ++i)
+			senders.emplace_back([this, &channel, &error = errors[i]]
+			{
+				try
+				{
+					Send(channel);
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+					m_IsAborted = true;
+				}
+			});
+
+		std::exception_ptr receiveError;
+		try
+		{
+			Receive(complementary);
+		}
+		catch (...)
+		{
+			receiveError = std::current_exception();
+			m_IsAborted = true;
+		}
+
+		auto duration = std::chrono::steady_clock::now() - start;
+		for (auto& sender : senders)
+			sender.join();
+
+		// Sender failure is usually the reason of receiver stall, so report it first.
+		for (auto& error : errors)
+			if (error)
+				std::rethrow_exception(error);
+
+		if (receiveError)
+			std::rethrow_exception(receiveError);
+
+		return MakeReport(duration);
+	}
+
+	void ChannelBenchmark::GeneratePackets()
+	{
+		std::vector<uint32_t> weights;
+		for (auto const& size : m_Config.m_PacketSizes)
+			weights.push_back(size.m_Weight);
+
+		std::mt19937 generator{ std::random_device{}() };
+		std::discrete_distribution<size_t> distribution(weights.begin(), weights.end());
+		m_Packets.resize(m_Config.m_PacketCount);
+		for (size_t i = 0; i < m_Packets.size(); ++i)
+		{
+			auto size = m_Config.m_PacketSizes[distribution(generator)].m_Size;
+			m_Packets[i].m_Data.Write(static_cast<uint32_t>(i)).Concat(FSecure::Utils::GenerateRandomData(size - sizeof(uint32_t)));
+		}
+	}
+
+	void ChannelBenchmark::Send(std::shared_ptr<MockDeviceBridge> const& channel)
+	{
+		auto& device = *std::static_pointer_cast<AbstractChannel>(channel->GetDevice());
+		for (auto index = m_NextPacket++; index < m_Packets.size() && !m_IsAborted; index = m_NextPacket++)
+		{
+			auto lock = std::lock_guard<std::mutex>{ m_SendMutex };
+			m_Packets[index].m_SendTime = std::chrono::steady_clock::now();
+			SendPacket(device, static_cast<uint32_t>(index), m_Packets[index].m_Data);
+		}
+	}
+
+	void ChannelBenchmark::SendPacket(AbstractChannel& channel, uint32_t packetId, ByteView packet)
+	{
+		auto oryginalSize = static_cast<uint32_t>(packet.size());
+		uint32_t chunkId = 0u;
+		ByteVector buffer;
+		while (!packet.empty() && !m_IsAborted)
+		{
+			auto offered = std::min(packet.size(), m_SendFrameSize - QualityOfService::s_HeaderSize);
+			buffer.clear();
+			buffer.Write(packetId, chunkId, oryginalSize).Concat(packet.SubString(0, offered));
+			auto sent = channel.OnSendToChannelInternal(buffer);
+			++m_SendCalls;
+
+			if (sent >= QualityOfService::s_MinFrameSize || sent == buffer.size())
+			{
+				chunkId++;
+				packet.remove_prefix(sent - QualityOfService::s_HeaderSize);
+
+				if (sent < buffer.size())
+					m_SendFrameSize = sent;
+				else if (!packet.empty() && m_SendFrameSize < std::numeric_limits<size_t>::max() / 2)
+					m_SendFrameSize *= 2;
+			}
+		}
+	}
+
+	void ChannelBenchmark::Receive(std::shared_ptr<MockDeviceBridge> const& complementary)
+	{
+		auto device = std::static_pointer_cast<AbstractChannel>(complementary->GetDevice());
+		QualityOfService qos;
+		size_t received = 0;
+		auto lastProgress = std::chrono::steady_clock::now();
+		while (received != m_Packets.size() && !m_IsAborted)
+		{
+			auto frames = device->OnReceiveFromChannelInternal();
+			++m_ReceiveCalls;
+			auto now = std::chrono::steady_clock::now();
+			for (auto&& frame : frames)
+			{
+				qos.PushReceivedChunk(frame);
+				for (auto packet = qos.GetNextPacket(); !packet.empty(); packet = qos.GetNextPacket())
+				{
+					auto index = ByteView{ packet }.Read<uint32_t>();
+					if (index >= m_Packets.size() || m_Packets[index].m_Data != packet)
+						throw std::runtime_error("Data sent and received mismatch");
+
+					if (m_Packets[index].m_ReceiveTime)
+						throw std::runtime_error("Packet " + std::to_string(index) + " received twice");
+
+					m_Packets[index].m_ReceiveTime = now;
+					++received;
+					lastProgress = now;
+				}
+			}
+
+			if (now - lastProgress > s_StallTimeout)
+				throw std::runtime_error("No packet received for " + std::to_string(s_StallTimeout.count()) + " seconds. Received " + std::to_string(received) + " of " + std::to_string(m_Packets.size()) + " packets");
+
+			if (received != m_Packets.size())
+				std::this_thread::sleep_for(device->GetUpdateDelay());
+		}
+	}
+
+	json ChannelBenchmark::MakeReport(std::chrono::steady_clock::duration duration) const
+	{
+		size_t bytes = 0;
+		std::vector<double> latencies;
+		for (auto const& packet : m_Packets)
+		{
+			bytes += packet.m_Data.size();
+			latencies.push_back(std::chrono::duration<double, std::milli>(*packet.m_ReceiveTime - packet.m_SendTime).count());
+		}
+		std::sort(latencies.begin(), latencies.end());
+
+		auto seconds = std::chrono::duration<double>(duration).count();
+		json sizes = json::array();
+		for (auto const& size : m_Config.m_PacketSizes)
+			sizes.push_back({ { "size", size.m_Size }, { "weight", size.m_Weight } });
+
+		return
+		{
+			{ "packetSizes", sizes },
+			{ "packets", m_Packets.size() },
+			{ "bytes", bytes },
+			{ "concurrency", m_Config.m_Concurrency },
+			{ "durationMs", seconds * 1000 },
+			{ "bytesPerSecond", bytes / seconds },
+			{ "packetsPerSecond", m_Packets.size() / seconds },
+			{ "latencyMs", { { "p50", Percentile(latencies, 0.5) }, { "p99", Percentile(latencies, 0.99) }, { "max", latencies.back() } } },
+			{ "sendCallsPerPacket", static_cast<double>(m_SendCalls) / m_Packets.size() },
+			{ "receiveCallsPerPacket", static_cast<double>(m_ReceiveCalls) / m_Packets.size() },
+		};
+	}
+}
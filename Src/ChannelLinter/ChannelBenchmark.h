@@ -0,0 +1,83 @@
+#pragma once
+
+namespace FSecure::C3::Linter
+{
+	/// Measures throughput and latency of a pair of complementary channels
+	class ChannelBenchmark
+	{
+	public:
+		/// Create benchmark
+		/// @param config - benchmark configuration
+		ChannelBenchmark(BenchmarkConfig config);
+
+		/// Send packets through the channel and receive them on the complementary one
+		/// @param channel - channel used to send packets
+		/// @param complementary - channel used to receive packets
+		/// @returns JSON report
+		/// @throws std::runtime_error if packets are corrupted or channel stops delivering them, rethrows exceptions thrown by channels
+		json Run(std::shared_ptr<MockDeviceBridge> const& channel, std::shared_ptr<MockDeviceBridge> const& complementary);
+
+	private:
+		/// Benchmark fails if no packet arrives for this long
+		static constexpr std::chrono::seconds s_StallTimeout{ 60 };
+
+		/// Packet sent through the channel
+		struct Packet
+		{
+			/// Content of packet. Starts with packet index
+			ByteVector m_Data;
+
+			/// Time when first chunk of packet was sent
+			std::chrono::steady_clock::time_point m_SendTime;
+
+			/// Time when whole packet was received. Latency is computed after senders are joined, so that send time is not read concurrently
+			std::optional<std::chrono::steady_clock::time_point> m_ReceiveTime;
+		};
+
+		/// Draw packet sizes from configured distribution and generate packets
+		void GeneratePackets();
+
+		/// Sending thread body. Takes packets from common pool until all of them are sent
+		/// @param channel - channel used to send packets
+		void Send(std::shared_ptr<MockDeviceBridge> const& channel);
+
+		/// Split packet into chunks with QoS headers and send them, like DeviceBridge does
+		/// @param channel - channel used to send packets
+		/// @param packetId - QoS id of packet
+		/// @param packet - packet to send
+		void SendPacket(AbstractChannel& channel, uint32_t packetId, ByteView packet);
+
+		/// Receive and verify packets until all of them arrive
+		/// @param complementary - channel used to receive packets
+		void Receive(std::shared_ptr<MockDeviceBridge> const& complementary);
+
+		/// Build report from collected measurements
+		/// @param duration - time it took to deliver all packets
+		/// @returns JSON report
+		json MakeReport(std::chrono::steady_clock::duration duration) const;
+
+		/// Benchmark configuration
+		BenchmarkConfig m_Config;
+
+		/// Packets to send, indexed by their QoS id
+		std::vector<Packet> m_Packets;
+
+		/// Index of next packet to send
+		std::atomic<size_t> m_NextPacket = 0;
+
+		/// Serializes sending, channels are not expected to be used by many threads at once
+		std::mutex m_SendMutex;
+
+		/// Frame size accepted by channel last time. Guarded by m_SendMutex
+		size_t m_SendFrameSize = 1024 * 1024;
+
+		/// Number of OnSendToChannelInternal calls
+		std::atomic<size_t> m_SendCalls = 0;
+
+		/// Number of OnReceiveFromChannelInternal calls
+		size_t m_ReceiveCalls = 0;
+
+		/// Set when receiving has failed, so that senders stop early
+		std::atomic_bool m_IsAborted = false;
+	};
+}
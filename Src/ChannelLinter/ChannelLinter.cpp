@@ -107,16 +107,24 @@ namespace FSecure::C3::Linter
 			std::cout << "OK" << std::endl;
 		}
 
-		if (m_Config.m_TestChannelIO)
+		std::shared_ptr<MockDeviceBridge> complementaryChannel;
+		if (m_Config.ShouldCreateComplementaryChannel())
 		{
 			assert(channel); // First channel should already be created
 			std::cout << "Creating complementary channel ... " << std::flush;
 			auto complementaryArgs = GetComplementaryChannelArgs();
-			auto complementaryChannel = MakeChannel(complementaryArgs);
+			complementaryChannel = MakeChannel(complementaryArgs);
 			std::cout << "OK" << std::endl;
+		}
 
+		if (m_Config.m_TestChannelIO)
 			TestChannelIO(channel, complementaryChannel);
-		}
+
+		if (m_Config.m_Benchmark)
+			RunBenchmark(channel, complementaryChannel);
+
+		if (m_Config.m_Soak)
+			RunSoak();
 
 		if (m_Config.m_Command)
 		{
@@ -179,6 +187,58 @@ namespace FSecure::C3::Linter
 		}
 	}
 
+	void ChannelLinter::RunBenchmark(std::shared_ptr<MockDeviceBridge> const& channel, std::shared_ptr<MockDeviceBridge> const& complementary)
+	{
+		assert(m_Config.m_Benchmark);
+		std::cout << "Benchmarking channel with " << m_Config.m_Benchmark->m_PacketCount << " packets ... " << std::flush;
+		auto report = ChannelBenchmark{ *m_Config.m_Benchmark }.Run(channel, complementary);
+		std::cout << "OK" << std::endl;
+		std::cout << "Throughput: " << report["bytesPerSecond"].get<double>() << " B/s, " << report["packetsPerSecond"].get<double>() << " packets/s, latency p50: "
+			<< report["/latencyMs/p50"_json_pointer].get<double>() << " ms, p99: " << report["/latencyMs/p99"_json_pointer].get<double>() << " ms" << std::endl;
+
+		if (!m_Config.m_Benchmark->m_OutputPath)
+			return void(std::cout << report.dump(4) << std::endl);
+
+		std::ofstream output(*m_Config.m_Benchmark->m_OutputPath);
+		if (!(output << report.dump(4) << std::endl))
+			throw std::runtime_error("Failed to write benchmark report to " + *m_Config.m_Benchmark->m_OutputPath);
+	}
+
+	void ChannelLinter::RunSoak()
+	{
+		assert(m_Config.m_Soak);
+		Form form(m_ChannelCapability.at("/create/arguments"_json_pointer));
+		auto complementaryArgs = GetComplementaryChannelArgs();
+
+		// Argument groups are suffixed with pair number, so that pairs don't receive each other's packets.
+		std::cout << "Creating " << m_Config.m_Soak->m_Pairs << " channel pairs ... " << std::flush;
+		std::vector<ChannelSoak::ChannelPair> pairs;
+		for (size_t i = 0; i < m_Config.m_Soak->m_Pairs; ++i)
+		{
+			auto suffix = "Soak" + std::to_string(i);
+			pairs.emplace_back(MakeChannel(form.GetIsolatedArgs(*m_Config.m_ChannelArguments, suffix)), MakeChannel(form.GetIsolatedArgs(complementaryArgs, suffix)));
+		}
+		std::cout << "OK" << std::endl;
+
+		// Arguments naming existing directories are most likely shares used by channel. Leaked files are looked for there.
+		std::vector<std::filesystem::path> watchedDirectories;
+		for (auto const& argument : *m_Config.m_ChannelArguments)
+			if (std::error_code error; std::filesystem::is_directory(argument, error))
+				watchedDirectories.emplace_back(argument);
+
+		std::cout << "Soaking channel for " << m_Config.m_Soak->m_Duration.count() << " minutes ... " << std::endl;
+		auto report = ChannelSoak{ *m_Config.m_Soak, std::move(watchedDirectories) }.Run(pairs);
+		if (!m_Config.m_Soak->m_OutputPath)
+			std::cout << report.dump(4) << std::endl;
+
+		if (report.contains("error"))
+			throw std::runtime_error("Soak test aborted. " + report["error"].get<std::string>());
+
+		std::cout << "Soak test finished, regressions: " << report["regressions"].size() << std::endl;
+		for (auto const& regression : report["regressions"])
+			std::cout << "[Warning] " << regression.get<std::string>() << std::endl;
+	}
+
 	void ChannelLinter::TestCommand(std::shared_ptr<MockDeviceBridge> const& channel)
 	{
 		assert(m_Config.m_Command);
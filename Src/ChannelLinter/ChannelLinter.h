@@ -31,6 +31,16 @@ namespace FSecure::C3::Linter
 		/// @throws if Channel::OnSend or Channel::OnReceive throws
 		void TestChannelIO(std::shared_ptr<MockDeviceBridge> const& channel, std::shared_ptr<MockDeviceBridge> const& ch2);
 
+		/// Measure channel pair throughput and latency, print JSON report
+		/// @param first of complementary channels, used to send packets
+		/// @param second of complementary channels, used to receive packets
+		/// @throws std::runtime_error if data is corrupted, lost or report can't be written. Rethrows exceptions thrown by channels
+		void RunBenchmark(std::shared_ptr<MockDeviceBridge> const& channel, std::shared_ptr<MockDeviceBridge> const& complementary);
+
+		/// Create several isolated channel pairs, send packets through them for a long time and print JSON report
+		/// @throws std::runtime_error if soak test was aborted or report can't be written. Report is written before throwing
+		void RunSoak();
+
 		/// Create channel from string channel arguments
 		/// @param channel arguments
 		/// @returns Device bridge attached to channel
@@ -0,0 +1,359 @@
+#include "stdafx.h"
+#include "ChannelSoak.h"
+
+#include "Core/QualityOfService.h"
+#include <psapi.h>
+
+namespace FSecure::C3::Linter
+{
+	namespace
+	{
+		/// Get memory committed by this process
+		/// @returns private bytes, 0 if they can't be read
+		uint64_t GetPrivateBytes()
+		{
+			PROCESS_MEMORY_COUNTERS_EX counters{};
+			if (!GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters)))
+				return 0;
+
+			return counters.PrivateUsage;
+		}
+
+		/// Count files in directories and their subdirectories. Files removed while counting might be skipped
+		/// @param directories - directories to look into
+		/// @returns number of regular files
+		uint64_t CountFiles(std::vector<std::filesystem::path> const& directories)
+		{
+			uint64_t count = 0;
+			for (auto const& directory : directories)
+			{
+				std::error_code error;
+				for (auto it = std::filesystem::recursive_directory_iterator(directory, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error))
+					count += it->is_regular_file(error);
+			}
+
+			return count;
+		}
+
+		/// Get average of sample field over a range of samples
+		/// @param samples - JSON array of samples
+		/// @param field - name of averaged field
+		/// @param first - index of first averaged sample
+		/// @param last - index past the last averaged sample, must be greater than first
+		/// @returns average value
+		double Average(json const& samples, std::string const& field, size_t first, size_t last)
+		{
+			double sum = 0;
+			for (auto i = first; i < last; ++i)
+				sum += samples[i][field].get<double>();
+
+			return sum / (last - first);
+		}
+	}
+
+	ChannelSoak::ChannelSoak(SoakConfig config, std::vector<std::filesystem::path> watchedDirectories) :
+		m_Config(std::move(config)),
+		m_WatchedDirectories(std::move(watchedDirectories))
+	{
+	}
+
+	json ChannelSoak::Run(std::vector<ChannelPair> const& pairs)
+	{
+		std::vector<std::unique_ptr<Pair>> states;
+		for (size_t i = 0; i < pairs.size(); ++i)
+			states.push_back(std::make_unique<Pair>());
+
+		// Baseline is taken before any packet is sent.
+		auto start = std::chrono::steady_clock::now();
+		auto deadline = start + m_Config.m_Duration;
+		TakeSample(states, {});
+
+		std::vector<std::thread> threads;
+		std::vector<std::exception_ptr> errors(2 * pairs.size());
+		auto runGuarded = [this](std::exception_ptr& error, auto&& body)
+		{
+			try
+			{
+				body();
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+				m_IsAborted = true;
+				m_IsStopped = true;
+			}
+		};
+
+		for (size_t i = 0; i < pairs.size(); ++i)
+		{
+			auto& channel = *std::static_pointer_cast<AbstractChannel>(pairs[i].first->GetDevice());
+			auto& complementary = *std::static_pointer_cast<AbstractChannel>(pairs[i].second->GetDevice());
+			auto& pair = *states[i];
+			threads.emplace_back([&, &error = errors[2 * i]] { runGuarded(error, [&] { Send(channel, pair); }); });
+			threads.emplace_back([&, &error = errors[2 * i + 1]] { runGuarded(error, [&] { Receive(complementary, pair); }); });
+		}
+
+		for (auto nextSample = start + m_Config.m_SampleInterval; !m_IsAborted; nextSample += m_Config.m_SampleInterval)
+		{
+			// Sleep in short steps, so that failure of any thread is noticed soon.
+			for (auto now = std::chrono::steady_clock::now(); now < std::min(nextSample, deadline) && !m_IsAborted; now = std::chrono::steady_clock::now())
+				std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(1s, std::min(nextSample, deadline) - now));
+
+			if (m_IsAborted || std::chrono::steady_clock::now() >= deadline)
+				break;
+
+			auto sample = TakeSample(states, std::chrono::steady_clock::now() - start);
+			std::cout << "Soak " << sample["elapsedS"].get<double>() / 60 << " min: " << sample["bytesPerSecond"].get<double>() << " B/s, memory " << sample["memoryBytes"].get<uint64_t>()
+				<< " B, QoS queued packets " << sample["qosQueuedPackets"].get<uint64_t>() << ", files " << sample["files"].get<uint64_t>() << std::endl;
+			try
+			{
+				WriteReport(MakeReport({}));
+			}
+			catch (std::exception& e)
+			{
+				std::cout << "[Warning] " << e.what() << std::endl;
+			}
+		}
+
+		// Let receivers collect packets that are still on the way.
+		m_IsStopped = true;
+		for (auto& thread : threads)
+			thread.join();
+
+		TakeSample(states, std::chrono::steady_clock::now() - start);
+
+		std::string error;
+		for (auto& e : errors)
+			if (e && error.empty())
+				try
+				{
+					std::rethrow_exception(e);
+				}
+				catch (std::exception& exception)
+				{
+					error = exception.what();
+				}
+				catch (...)
+				{
+					error = "Unknown exception";
+				}
+
+		auto report = MakeReport(error);
+		WriteReport(report);
+		return report;
+	}
+
+	void ChannelSoak::Send(AbstractChannel& channel, Pair& pair)
+	{
+		while (!m_IsStopped)
+		{
+			auto isWindowFull = [&] { auto lock = std::lock_guard<std::mutex>{ pair.m_Mutex }; return pair.m_InFlight.size() >= s_Window; }();
+			if (isWindowFull)
+			{
+				std::this_thread::sleep_for(channel.GetUpdateDelay());
+				continue;
+			}
+
+			auto packetId = pair.m_NextPacketId++;
+			ByteVector packet;
+			packet.Write(packetId).Concat(FSecure::Utils::GenerateRandomData(DrawPacketSize(pair.m_SendFrameSize) - sizeof(uint32_t)));
+			{
+				auto lock = std::lock_guard<std::mutex>{ pair.m_Mutex };
+				pair.m_InFlight.emplace(packetId, packet);
+			}
+
+			SendPacket(channel, pair, packetId, packet);
+		}
+
+		pair.m_IsSendingDone = true;
+	}
+
+	void ChannelSoak::SendPacket(AbstractChannel& channel, Pair& pair, uint32_t packetId, ByteView packet)
+	{
+		auto oryginalSize = static_cast<uint32_t>(packet.size());
+		uint32_t chunkId = 0u;
+		ByteVector buffer;
+		while (!packet.empty() && !m_IsAborted)
+		{
+			auto offered = std::min(packet.size(), pair.m_SendFrameSize - QualityOfService::s_HeaderSize);
+			buffer.clear();
+			buffer.Write(packetId, chunkId, oryginalSize).Concat(packet.SubString(0, offered));
+			auto sent = channel.OnSendToChannelInternal(buffer);
+
+			if (sent >= QualityOfService::s_MinFrameSize || sent == buffer.size())
+			{
+				chunkId++;
+				packet.remove_prefix(sent - QualityOfService::s_HeaderSize);
+
+				if (sent < buffer.size())
+					pair.m_SendFrameSize = sent;
+				else if (!packet.empty() && pair.m_SendFrameSize < std::numeric_limits<size_t>::max() / 2)
+					pair.m_SendFrameSize *= 2;
+			}
+		}
+	}
+
+	void ChannelSoak::Receive(AbstractChannel& complementary, Pair& pair)
+	{
+		QualityOfService qos;
+		auto lastProgress = std::chrono::steady_clock::now();
+		while (!m_IsAborted)
+		{
+			// Sending thread adds packets to the window before it is done, so empty window after that is final.
+			auto isSendingDone = pair.m_IsSendingDone.load();
+			auto isIdle = [&] { auto lock = std::lock_guard<std::mutex>{ pair.m_Mutex }; return pair.m_InFlight.empty(); }();
+			if (isSendingDone && isIdle)
+				return;
+
+			auto frames = complementary.OnReceiveFromChannelInternal();
+			auto now = std::chrono::steady_clock::now();
+			if (isIdle)
+				lastProgress = now;
+
+			for (auto&& frame : frames)
+			{
+				qos.PushReceivedChunk(frame);
+				for (auto packet = qos.GetNextPacket(); !packet.empty(); packet = qos.GetNextPacket())
+				{
+					auto packetId = ByteView{ packet }.Read<uint32_t>();
+					auto lock = std::lock_guard<std::mutex>{ pair.m_Mutex };
+					auto it = pair.m_InFlight.find(packetId);
+					if (it == pair.m_InFlight.end())
+						throw std::runtime_error("Packet " + std::to_string(packetId) + " was received twice or never sent");
+
+					if (it->second != packet)
+						throw std::runtime_error("Data sent and received mismatch in packet " + std::to_string(packetId) + " of " + std::to_string(packet.size()) + " bytes");
+
+					pair.m_InFlight.erase(it);
+					++pair.m_ReceivedPackets;
+					pair.m_ReceivedBytes += packet.size();
+					lastProgress = now;
+				}
+			}
+
+			pair.m_PendingPackets = qos.GetStatistics().m_PendingPackets;
+			pair.m_QueuedPackets = qos.m_ReciveQueue.size();
+			if (now - lastProgress > s_StallTimeout)
+				throw std::runtime_error("No packet received for " + std::to_string(s_StallTimeout.count()) + " seconds after " + std::to_string(pair.m_ReceivedPackets) + " packets");
+
+			std::this_thread::sleep_for(complementary.GetUpdateDelay());
+		}
+	}
+
+	size_t ChannelSoak::DrawPacketSize(size_t frameSize)
+	{
+		auto jitter = FSecure::Utils::GenerateRandomValue<int64_t>(-2, 2);
+		auto body = static_cast<int64_t>(std::min(frameSize, s_MaxPacketSize) - QualityOfService::s_HeaderSize);
+		int64_t size = 0;
+		switch (FSecure::Utils::GenerateRandomValue(0, 3))
+		{
+		case 0:
+			size = QualityOfService::s_MinBodySize + jitter;
+			break;
+		case 1:
+			size = QualityOfService::s_MinFrameSize + jitter;
+			break;
+		case 2:
+			size = body * FSecure::Utils::GenerateRandomValue<int64_t>(1, 4) + jitter;
+			break;
+		default:
+			size = FSecure::Utils::GenerateRandomValue<int64_t>(sizeof(uint32_t), s_MaxPacketSize);
+			break;
+		}
+
+		return static_cast<size_t>(std::clamp<int64_t>(size, sizeof(uint32_t), s_MaxPacketSize));
+	}
+
+	json ChannelSoak::TakeSample(std::vector<std::unique_ptr<Pair>> const& pairs, std::chrono::steady_clock::duration elapsed)
+	{
+		uint64_t packets = 0, bytes = 0, pending = 0, queued = 0;
+		for (auto const& pair : pairs)
+		{
+			packets += pair->m_ReceivedPackets;
+			bytes += pair->m_ReceivedBytes;
+			pending += pair->m_PendingPackets;
+			queued += pair->m_QueuedPackets;
+		}
+
+		auto seconds = std::chrono::duration<double>(elapsed - m_PreviousElapsed).count();
+		json sample
+		{
+			{ "elapsedS", std::chrono::duration<double>(elapsed).count() },
+			{ "packets", packets },
+			{ "bytes", bytes },
+			{ "bytesPerSecond", seconds > 0 ? (bytes - m_PreviousTotals.second) / seconds : 0. },
+			{ "packetsPerSecond", seconds > 0 ? (packets - m_PreviousTotals.first) / seconds : 0. },
+			{ "qosPendingPackets", pending },
+			{ "qosQueuedPackets", queued },
+			{ "memoryBytes", GetPrivateBytes() },
+			{ "files", CountFiles(m_WatchedDirectories) },
+		};
+
+		m_PreviousTotals = { packets, bytes };
+		m_PreviousElapsed = elapsed;
+		m_Samples.push_back(sample);
+		return sample;
+	}
+
+	json ChannelSoak::MakeReport(std::string_view error) const
+	{
+		json report
+		{
+			{ "pairs", m_Config.m_Pairs },
+			{ "durationMinutes", m_Config.m_Duration.count() },
+			{ "sampleIntervalS", m_Config.m_SampleInterval.count() },
+			{ "samples", m_Samples },
+		};
+
+		json directories = json::array();
+		for (auto const& directory : m_WatchedDirectories)
+			directories.push_back(directory.string());
+		report["watchedDirectories"] = directories;
+
+		// First sample is a baseline taken before sending, so growth is measured from the second one, when channels are warmed up.
+		json regressions = json::array();
+		if (m_Samples.size() >= 3)
+		{
+			auto const& reference = m_Samples[1];
+			auto const& last = m_Samples.back();
+			auto memoryGrowth = static_cast<int64_t>(last["memoryBytes"].get<uint64_t>()) - static_cast<int64_t>(reference["memoryBytes"].get<uint64_t>());
+			auto fileGrowth = static_cast<int64_t>(last["files"].get<uint64_t>()) - static_cast<int64_t>(reference["files"].get<uint64_t>());
+			report["memoryGrowthBytes"] = memoryGrowth;
+			report["fileGrowth"] = fileGrowth;
+
+			if (memoryGrowth > s_MemoryGrowthThreshold * reference["memoryBytes"].get<uint64_t>())
+				regressions.push_back("Memory grew by " + std::to_string(memoryGrowth) + " bytes");
+
+			if (fileGrowth > 0)
+				regressions.push_back("Number of files in watched directories grew by " + std::to_string(fileGrowth));
+
+			if (last["qosPendingPackets"].get<uint64_t>())
+				regressions.push_back(std::to_string(last["qosPendingPackets"].get<uint64_t>()) + " incomplete packets left in QoS receive queues");
+
+			// Throughput of the first and the last quarter of samples is compared. The last sample is skipped, because in the final report it covers only draining.
+			auto throughputSamples = m_Samples.size() - 2;
+			auto quarter = std::max<size_t>(throughputSamples / 4, 1);
+			auto beginning = Average(m_Samples, "bytesPerSecond", 1, 1 + quarter);
+			auto end = Average(m_Samples, "bytesPerSecond", 1 + throughputSamples - quarter, 1 + throughputSamples);
+			report["throughputRatio"] = beginning > 0 ? end / beginning : 0.;
+			if (beginning > 0 && end / beginning < s_ThroughputDecayThreshold)
+				regressions.push_back("Throughput decayed from " + std::to_string(beginning) + " to " + std::to_string(end) + " B/s");
+		}
+		report["regressions"] = regressions;
+
+		if (!error.empty())
+			report["error"] = error;
+
+		return report;
+	}
+
+	void ChannelSoak::WriteReport(json const& report) const
+	{
+		if (!m_Config.m_OutputPath)
+			return;
+
+		std::ofstream output(*m_Config.m_OutputPath);
+		if (!(output << report.dump(4) << std::endl))
+			throw std::runtime_error("Failed to write soak report to " + *m_Config.m_OutputPath);
+	}
+}
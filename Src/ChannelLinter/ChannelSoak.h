@@ -0,0 +1,128 @@
+#pragma once
+
+namespace FSecure::C3::Linter
+{
+	/// Sends packets through many pairs of complementary channels for a long time and tracks throughput and resource usage
+	class ChannelSoak
+	{
+	public:
+		/// Channel used to send packets and complementary channel used to receive them
+		using ChannelPair = std::pair<std::shared_ptr<MockDeviceBridge>, std::shared_ptr<MockDeviceBridge>>;
+
+		/// Create soak test
+		/// @param config - soak test configuration
+		/// @param watchedDirectories - directories which number of files is sampled, e.g. shares used by channels
+		ChannelSoak(SoakConfig config, std::vector<std::filesystem::path> watchedDirectories);
+
+		/// Send packets through all pairs until configured duration passes
+		/// @param pairs - channel pairs, each of them is used by its own sending and receiving thread
+		/// @returns JSON report. Report contains an error if soak test was aborted
+		json Run(std::vector<ChannelPair> const& pairs);
+
+	private:
+		/// Soak test fails if no packet arrives through a pair for this long
+		static constexpr std::chrono::seconds s_StallTimeout{ 60 };
+
+		/// Maximal number of packets sent but not yet received through a single pair
+		static constexpr size_t s_Window = 16;
+
+		/// Largest randomized packet
+		static constexpr size_t s_MaxPacketSize = 64 * 1024;
+
+		/// Throughput at the end lower than this fraction of throughput at the beginning is reported as regression
+		static constexpr double s_ThroughputDecayThreshold = 0.8;
+
+		/// Memory growth larger than this fraction of memory used at the beginning is reported as regression
+		static constexpr double s_MemoryGrowthThreshold = 0.1;
+
+		/// State of a single channel pair
+		struct Pair
+		{
+			/// Packets sent but not yet received, indexed by their QoS id. Guarded by m_Mutex
+			std::map<uint32_t, ByteVector> m_InFlight;
+
+			/// Guards m_InFlight
+			std::mutex m_Mutex;
+
+			/// Frame size accepted by channel last time. Used only by sending thread
+			size_t m_SendFrameSize = 1024 * 1024;
+
+			/// QoS id of next packet. Used only by sending thread
+			uint32_t m_NextPacketId = 0;
+
+			/// Number of packets received
+			std::atomic<uint64_t> m_ReceivedPackets = 0;
+
+			/// Number of bytes received
+			std::atomic<uint64_t> m_ReceivedBytes = 0;
+
+			/// Number of incomplete packets in the receiving QoS
+			std::atomic<uint64_t> m_PendingPackets = 0;
+
+			/// Number of packets held by the receiving QoS queue, including ready ones
+			std::atomic<uint64_t> m_QueuedPackets = 0;
+
+			/// Set when sending thread stopped sending new packets
+			std::atomic_bool m_IsSendingDone = false;
+		};
+
+		/// Sending thread body. Sends packets of randomized size while there is room in the window
+		/// @param channel - channel used to send packets
+		/// @param pair - state of channel pair
+		void Send(AbstractChannel& channel, Pair& pair);
+
+		/// Split packet into chunks with QoS headers and send them, like DeviceBridge does
+		/// @param channel - channel used to send packets
+		/// @param pair - state of channel pair
+		/// @param packetId - QoS id of packet
+		/// @param packet - packet to send
+		void SendPacket(AbstractChannel& channel, Pair& pair, uint32_t packetId, ByteView packet);
+
+		/// Receiving thread body. Receives and verifies packets until sending thread is done and all packets arrived
+		/// @param complementary - channel used to receive packets
+		/// @param pair - state of channel pair
+		void Receive(AbstractChannel& complementary, Pair& pair);
+
+		/// Draw size of next packet. Sizes around QoS frame boundaries are preferred, as they are most likely to break channels
+		/// @param frameSize - frame size accepted by channel last time
+		/// @returns size of packet, at least 4 bytes
+		size_t DrawPacketSize(size_t frameSize);
+
+		/// Collect current throughput and resource usage
+		/// @param pairs - state of all pairs
+		/// @param elapsed - time since start of soak test
+		/// @returns JSON sample
+		json TakeSample(std::vector<std::unique_ptr<Pair>> const& pairs, std::chrono::steady_clock::duration elapsed);
+
+		/// Build report from collected samples
+		/// @param error - description of failure that aborted soak test, empty if there was none
+		/// @returns JSON report
+		json MakeReport(std::string_view error) const;
+
+		/// Write report to configured file, or do nothing if report is printed to standard output
+		/// @param report - report to write
+		/// @throws std::runtime_error if report can't be written
+		void WriteReport(json const& report) const;
+
+		/// Soak test configuration
+		SoakConfig m_Config;
+
+		/// Directories which number of files is sampled
+		std::vector<std::filesystem::path> m_WatchedDirectories;
+
+		/// Samples collected so far
+		json m_Samples = json::array();
+
+		/// Packets and bytes received until previous sample
+		std::pair<uint64_t, uint64_t> m_PreviousTotals;
+
+		/// Time of previous sample, since start of soak test
+		std::chrono::steady_clock::duration m_PreviousElapsed{};
+
+		/// Set after configured duration passed or when one of threads has failed
+		std::atomic_bool m_IsStopped = false;
+
+		/// Set when one of threads has failed, so that others stop early
+		std::atomic_bool m_IsAborted = false;
+	};
+}
@@ -67,4 +67,24 @@ namespace FSecure::C3::Linter
 		}
 		return input;
 	}
+
+	StringVector Form::GetIsolatedArgs(StringVector input, std::string_view suffix)
+	{
+		size_t currentOffset = 0;
+		for (auto const& arg : m_ArgumentsForm)
+		{
+			if (arg.is_array())
+			{
+				for (auto i = currentOffset; i < currentOffset + arg.size(); ++i)
+					input[i] += suffix;
+
+				currentOffset += arg.size();
+			}
+			else
+			{
+				++currentOffset;
+			}
+		}
+		return input;
+	}
 }
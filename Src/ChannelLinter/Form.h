@@ -31,6 +31,12 @@ namespace FSecure::C3::Linter
 		/// @returns Complementary arguments
 		StringVector GetComplementaryArgs(StringVector input);
 
+		/// Make arguments of a channel that won't interfere with channels created with other suffix (append suffix to argument groups)
+		/// @param string representation of arguments
+		/// @param suffix appended to every argument that is a part of argument group
+		/// @returns Isolated arguments. Complementary arguments of isolated ones are isolated with the same suffix
+		StringVector GetIsolatedArgs(StringVector input, std::string_view suffix);
+
 	private:
 		/// Internal store of json definition
 		json m_ArgumentsForm;
@@ -33,16 +33,31 @@ namespace FSecure::C3::Linter
 		throw std::logic_error("The method or operation is not implemented.");
 	}
 
+	void MockDeviceBridge::PassNetworkPackets(std::vector<ByteVector> const& packets)
+	{
+		throw std::logic_error("The method or operation is not implemented.");
+	}
+
 	void MockDeviceBridge::OnPassNetworkPacket(ByteView packet)
 	{
 		throw std::logic_error("The method or operation is not implemented.");
 	}
 
+	void MockDeviceBridge::RequestUpdate()
+	{
+		// Linter polls the Channel on its own schedule.
+	}
+
 	void MockDeviceBridge::PostCommandToConnector(ByteView command)
 	{
 		throw std::logic_error("The method or operation is not implemented.");
 	}
 
+	void MockDeviceBridge::PostCommandSegmentToConnector(ByteView segment, std::uint32_t commandSize, std::uint32_t offset)
+	{
+		throw std::logic_error("The method or operation is not implemented.");
+	}
+
 	void MockDeviceBridge::OnCommandFromConnector(ByteView command)
 	{
 		throw std::logic_error("The method or operation is not implemented.");
@@ -26,14 +26,27 @@ namespace FSecure::C3::Linter
 		/// @param packet full C3 packet.
 		void PassNetworkPacket(ByteView packet) override;
 
+		/// Fired by Channel when several C3 packets arrive at once.
+		/// @param packets full C3 packets in order of arrival.
+		void PassNetworkPackets(std::vector<ByteVector> const& packets) override;
+
 		/// Fired by Relay to pass provided C3 packet through the Channel Device.
 		/// @param packet full C3 packet.
 		void OnPassNetworkPacket(ByteView packet) override;
 
+		/// Called by Device, from any thread, when it has something to deliver, e.g. when an asynchronous receive completes.
+		void RequestUpdate() override;
+
 		/// Called whenever Peripheral wants to send a Command to its Connector Binder.
 		/// @param command full Command with arguments.
 		void PostCommandToConnector(ByteView command) override;
 
+		/// Called whenever Peripheral streams a long Command to its Connector Binder in parts.
+		/// @param segment part of the Command.
+		/// @param commandSize size of the whole Command.
+		/// @param offset position of segment in the Command.
+		void PostCommandSegmentToConnector(ByteView segment, std::uint32_t commandSize, std::uint32_t offset) override;
+
 		/// Fired by Relay to pass by provided Command from Connector.
 		/// @param command full Command with arguments.
 		void OnCommandFromConnector(ByteView command) override;
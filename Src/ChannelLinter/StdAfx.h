@@ -9,6 +9,7 @@
 #include <string_view>
 #include <charconv>
 #include <utility>
+#include <fstream>
 
 // C3 inclusion.
 #include "Common/FSecure/C3/Sdk.hpp"
@@ -24,4 +25,6 @@ using json = nlohmann::json;
 #include "FormElement.h"
 #include "Form.h"
 #include "MockDeviceBridge.h"
+#include "ChannelBenchmark.h"
+#include "ChannelSoak.h"
 #include "ChannelLinter.h"
@@ -105,4 +105,8 @@ namespace Obfuscator = andrivet::ADVobfuscator;
 #define OBF_STR(str) (std::basic_string<Obfuscator::PeelT<decltype(str)>>{ OBF(str) })
 #define OBF_SEC(str) (FSecure::BasicSecureString<Obfuscator::PeelT<decltype(str)>>{ OBF(str) })
 
+// Decrypted on first use into static secure storage, which is wiped at exit. For strings used on every packet, where OBF would decrypt them each time.
+// String stays decrypted in memory for the lifetime of the process, so don't use it for anything more sensitive than protocol constants.
+#define OBF_CACHED(str) ([]() -> Obfuscator::PeelT<decltype(str)> const* { static FSecure::BasicSecureString<Obfuscator::PeelT<decltype(str)>> const decrypted{ OBF(str) }; return decrypted.c_str(); }())
+
 #endif
@@ -0,0 +1,347 @@
+#include "StdAfx.h"
+#include "InMemory.h"
+
+#include <sddl.h>
+
+namespace
+{
+	/// Create security attributes allowing Relays running as other users to open the section.
+	/// @param attributes structure to fill.
+	/// @return true on success.
+	bool CreateFullAccessAttributes(SECURITY_ATTRIBUTES* attributes)
+	{
+		attributes->nLength = sizeof(SECURITY_ATTRIBUTES);
+		attributes->bInheritHandle = FALSE;
+		return ConvertStringSecurityDescriptorToSecurityDescriptorW(OBF(L"D:(A;;GA;;;WD)"), SDDL_REVISION_1, &attributes->lpSecurityDescriptor, nullptr);
+	}
+
+	std::unique_ptr<SECURITY_ATTRIBUTES, std::function<void(SECURITY_ATTRIBUTES*)>> g_FullAccessAttributes =
+	{
+		[]() { auto ptr = new SECURITY_ATTRIBUTES{}; CreateFullAccessAttributes(ptr); return ptr; }(),
+		[](SECURITY_ATTRIBUTES* ptr) { LocalFree(ptr->lpSecurityDescriptor); delete ptr; }
+	};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Interfaces::Channels::InMemory::Queue::Write(ByteView packet)
+{
+	{
+		std::scoped_lock lock(m_Mutex);
+		m_Packets.emplace_back(packet);
+	}
+
+	m_DataCondition.notify_one();
+	return packet.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::Interfaces::Channels::InMemory::Queue::ReadAll()
+{
+	std::scoped_lock lock(m_Mutex);
+	return std::exchange(m_Packets, {});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::InMemory::Queue::WaitForData(std::chrono::milliseconds timeout)
+{
+	std::unique_lock lock(m_Mutex);
+	m_DataCondition.wait_for(lock, timeout, [this] { return !m_Packets.empty(); });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Channels::InMemory::SharedRing::SharedRing(std::string const& name, uint32_t capacity)
+{
+	// Global namespace reaches Relays in other sessions, but creating sections there requires SeCreateGlobalPrivilege.
+	auto sectionSize = static_cast<uint64_t>(sizeof(Header)) + capacity;
+	std::string path;
+	for (auto const& prefix : { OBF_STR("Global\\"), OBF_STR("Local\\") })
+	{
+		path = prefix + name;
+		SetLastError(ERROR_SUCCESS);
+		m_Section.reset(CreateFileMappingA(INVALID_HANDLE_VALUE, g_FullAccessAttributes.get(), PAGE_READWRITE, static_cast<DWORD>(sectionSize >> 32), static_cast<DWORD>(sectionSize), path.c_str()));
+		if (m_Section)
+			break;
+	}
+
+	if (!m_Section)
+		throw std::runtime_error{ OBF("InMemory channel: failed to create shared memory section. Error: ") + std::to_string(GetLastError()) };
+
+	auto isCreated = GetLastError() != ERROR_ALREADY_EXISTS;
+	m_Header = static_cast<Header*>(MapViewOfFile(m_Section.get(), FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (!m_Header)
+		throw std::runtime_error{ OBF("InMemory channel: failed to map shared memory section. Error: ") + std::to_string(GetLastError()) };
+
+	// Events live in the same namespace as the section, but kernel object names are shared between object types, so they need their own suffix.
+	m_DataEvent.reset(CreateEventA(g_FullAccessAttributes.get(), FALSE, FALSE, (path + OBF("_d")).c_str()));
+	m_SpaceEvent.reset(CreateEventA(g_FullAccessAttributes.get(), FALSE, FALSE, (path + OBF("_s")).c_str()));
+	if (!m_DataEvent || !m_SpaceEvent)
+	{
+		UnmapViewOfFile(m_Header);
+		throw std::runtime_error{ OBF("InMemory channel: failed to create events. Error: ") + std::to_string(GetLastError()) };
+	}
+
+	m_Ring = reinterpret_cast<uint8_t*>(m_Header + 1);
+	if (isCreated)
+	{
+		// New pages are zeroed, so both positions and waiting flags already start at 0.
+		m_Header->m_Capacity = capacity;
+		m_Header->m_Magic.store(s_Magic, std::memory_order_release);
+		return;
+	}
+
+	// Section was created by the other side, which may still be initializing it.
+	for (auto deadline = std::chrono::steady_clock::now() + 1s; m_Header->m_Magic.load(std::memory_order_acquire) != s_Magic; std::this_thread::sleep_for(1ms))
+		if (std::chrono::steady_clock::now() > deadline)
+		{
+			UnmapViewOfFile(m_Header);
+			throw std::runtime_error{ OBF("InMemory channel: shared memory section was not initialized.") };
+		}
+
+	MEMORY_BASIC_INFORMATION region;
+	if (!VirtualQuery(m_Header, &region, sizeof(region)) || region.RegionSize < sizeof(Header) + m_Header->m_Capacity)
+	{
+		UnmapViewOfFile(m_Header);
+		throw std::runtime_error{ OBF("InMemory channel: shared memory section is too small.") };
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Channels::InMemory::SharedRing::~SharedRing()
+{
+	UnmapViewOfFile(m_Header);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Interfaces::Channels::InMemory::SharedRing::Write(ByteView packet)
+{
+	auto write = m_Header->m_WritePosition.load(std::memory_order_relaxed);
+	auto writableSize = [&]
+	{
+		auto free = m_Header->m_Capacity - (write - m_Header->m_ReadPosition.load(std::memory_order_acquire));
+		return static_cast<uint32_t>(std::min<uint64_t>(packet.size(), free > sizeof(uint32_t) ? free - sizeof(uint32_t) : 0));
+	};
+
+	auto isWritable = [&] { auto size = writableSize(); return size == packet.size() || size >= s_MinPartialWrite; };
+	if (!isWritable())
+	{
+		// Ring is full. Sleep until the reader makes space, instead of making the caller retry in a tight loop.
+		Wait(m_Header->m_IsWriterWaiting, m_SpaceEvent.get(), isWritable, s_FullRingTimeout);
+		if (!isWritable())
+			return 0;
+	}
+
+	auto size = writableSize();
+	CopyIn(write, ByteView{ reinterpret_cast<uint8_t const*>(&size), sizeof(size) });
+	CopyIn(write + sizeof(size), packet.SubString(0, size));
+	m_Header->m_WritePosition.store(write + sizeof(size) + size, std::memory_order_seq_cst);
+	Signal(m_Header->m_IsReaderWaiting, m_DataEvent.get());
+	return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<size_t> FSecure::C3::Interfaces::Channels::InMemory::SharedRing::GetMaxWriteSize() const
+{
+	return m_Header->m_Capacity - sizeof(uint32_t);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::Interfaces::Channels::InMemory::SharedRing::ReadAll()
+{
+	auto read = m_Header->m_ReadPosition.load(std::memory_order_relaxed);
+	auto write = m_Header->m_WritePosition.load(std::memory_order_acquire);
+
+	std::vector<ByteVector> packets;
+	while (read < write)
+	{
+		uint32_t size;
+		CopyOut(read, reinterpret_cast<uint8_t*>(&size), sizeof(size));
+		if (size > write - read - sizeof(size))
+			throw std::runtime_error{ OBF("InMemory channel: shared memory ring is corrupted.") };
+
+		auto& packet = packets.emplace_back(size);
+		CopyOut(read + sizeof(size), packet.data(), size);
+		read += sizeof(size) + size;
+	}
+
+	if (packets.empty())
+		return packets;
+
+	m_Header->m_ReadPosition.store(read, std::memory_order_seq_cst);
+	Signal(m_Header->m_IsWriterWaiting, m_SpaceEvent.get());
+	return packets;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::InMemory::SharedRing::WaitForData(std::chrono::milliseconds timeout)
+{
+	auto read = m_Header->m_ReadPosition.load(std::memory_order_relaxed);
+	Wait(m_Header->m_IsReaderWaiting, m_DataEvent.get(), [&] { return m_Header->m_WritePosition.load(std::memory_order_acquire) != read; }, timeout);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename Condition>
+void FSecure::C3::Interfaces::Channels::InMemory::SharedRing::Wait(std::atomic<uint32_t>& isWaiting, HANDLE event, Condition isReady, std::chrono::milliseconds timeout)
+{
+	// Flag is raised before the condition is checked again. Other side changes its position before it checks the flag, so either this check or the event sees the change.
+	isWaiting.store(1, std::memory_order_seq_cst);
+	if (!isReady())
+		WaitForSingleObject(event, static_cast<DWORD>(timeout.count()));
+
+	isWaiting.store(0, std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::InMemory::SharedRing::Signal(std::atomic<uint32_t>& isWaiting, HANDLE event)
+{
+	if (isWaiting.load(std::memory_order_seq_cst))
+		SetEvent(event);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::InMemory::SharedRing::CopyIn(uint64_t position, ByteView data)
+{
+	auto offset = static_cast<size_t>(position % m_Header->m_Capacity);
+	auto first = std::min<size_t>(data.size(), m_Header->m_Capacity - offset);
+	std::memcpy(m_Ring + offset, data.data(), first);
+	std::memcpy(m_Ring, data.data() + first, data.size() - first);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::InMemory::SharedRing::CopyOut(uint64_t position, uint8_t* data, size_t size) const
+{
+	auto offset = static_cast<size_t>(position % m_Header->m_Capacity);
+	auto first = std::min<size_t>(size, m_Header->m_Capacity - offset);
+	std::memcpy(data, m_Ring + offset, first);
+	std::memcpy(data + first, m_Ring, size - first);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Channels::InMemory::InMemory(ByteView arguments)
+{
+	auto [inputId, outputId, isShared, bufferSize, updateDelay, receiveWait] = arguments.Read<std::string, std::string, bool, uint16_t, uint16_t, uint16_t>();
+	m_ReceiveWait = std::chrono::milliseconds{ receiveWait };
+	if (isShared)
+	{
+		m_Input = std::make_shared<SharedRing>(inputId, bufferSize * 1024u);
+		m_Output = std::make_shared<SharedRing>(outputId, bufferSize * 1024u);
+	}
+	else
+	{
+		m_Input = GetQueue(inputId);
+		m_Output = GetQueue(outputId);
+	}
+
+	// Single argument overload doesn't enforce 30ms minimum, which protects external services from being flooded. There is no such service here.
+	SetUpdateDelay(std::chrono::milliseconds{ updateDelay });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Interfaces::Channels::InMemory::OnSendToChannel(ByteView blob)
+{
+	return m_Output->Write(blob);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::Interfaces::Channels::InMemory::OnReceiveFromChannel()
+{
+	auto packets = m_Input->ReadAll();
+	if (packets.empty() && m_ReceiveWait.count())
+	{
+		// Stays in the Channel's own update thread, only Relays that update every Device in separate threads should use it.
+		m_Input->WaitForData(m_ReceiveWait);
+		packets = m_Input->ReadAll();
+	}
+
+	return packets;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<size_t> FSecure::C3::Interfaces::Channels::InMemory::GetMaxFrameSize() const
+{
+	return m_Output->GetMaxWriteSize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Device::DeliveryGuarantees FSecure::C3::Interfaces::Channels::InMemory::GetDeliveryGuarantees() const
+{
+	// Only queues take packets of any size whole.
+	if (m_Output->GetMaxWriteSize())
+		return {};
+
+	return { true, true };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Interfaces::Channels::InMemory::Queue> FSecure::C3::Interfaces::Channels::InMemory::GetQueue(std::string const& id)
+{
+	// Queues live as long as any Channel uses them.
+	static std::mutex mutex;
+	static std::map<std::string, std::weak_ptr<Queue>> queues;
+
+	std::scoped_lock lock(mutex);
+	auto& entry = queues[id];
+	auto queue = entry.lock();
+	if (!queue)
+		entry = queue = std::make_shared<Queue>();
+
+	return queue;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+const char* FSecure::C3::Interfaces::Channels::InMemory::GetCapability()
+{
+	return R"(
+{
+	"create":
+	{
+		"arguments":
+		[
+			[
+				{
+					"type": "string",
+					"name": "Input ID",
+					"randomize": true,
+					"min": 4,
+					"description": "Name of the buffer read by the channel"
+				},
+				{
+					"type": "string",
+					"name": "Output ID",
+					"randomize": true,
+					"min": 4,
+					"description": "Name of the buffer written by the channel"
+				}
+			],
+			{
+				"type": "boolean",
+				"name": "Shared memory",
+				"defaultValue": true,
+				"description": "Use ring buffers in named shared memory, reachable by relays in other processes on this host. Otherwise packets are passed through queues within this process"
+			},
+			{
+				"type": "uint16",
+				"name": "Buffer size",
+				"min": 4,
+				"defaultValue": 1024,
+				"description": "Size of each shared memory ring in KiB. Ignored when the other side already created the ring"
+			},
+			{
+				"type": "uint16",
+				"name": "Update delay",
+				"min": 1,
+				"defaultValue": 1,
+				"description": "Milliseconds between reads of the input buffer"
+			},
+			{
+				"type": "uint16",
+				"name": "Receive wait",
+				"min": 0,
+				"defaultValue": 0,
+				"description": "Milliseconds for which each read blocks until the other side signals new packets. 0 disables waiting. Blocking holds the thread updating the channel, use only on relays running a thread per device"
+			}
+		]
+	},
+	"commands": []
+}
+)";
+}
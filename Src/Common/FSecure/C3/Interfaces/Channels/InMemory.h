@@ -0,0 +1,184 @@
+#pragma once
+
+#include "Common/FSecure/WinTools/UniqueHandle.h"
+
+namespace FSecure::C3::Interfaces::Channels
+{
+	/// Channel connecting Relays on the same host without external media.
+	/// Packets are passed through ring buffers in named shared memory, or through plain queues if both Relays run in one process.
+	class InMemory : public Channel<InMemory>
+	{
+	public:
+		/// Carries packets in one direction.
+		struct Buffer
+		{
+			/// Destructor.
+			virtual ~Buffer() = default;
+
+			/// Add packet to the buffer.
+			/// @param packet packet to add.
+			/// @return number of bytes written. Zero if buffer is full.
+			virtual size_t Write(ByteView packet) = 0;
+
+			/// Take all buffered packets.
+			/// @return packets in order of writing.
+			virtual std::vector<ByteVector> ReadAll() = 0;
+
+			/// Block until something is written to the buffer.
+			/// @param timeout maximal time to wait.
+			virtual void WaitForData(std::chrono::milliseconds timeout) = 0;
+
+			/// Get size of the biggest packet written whole.
+			/// @return maximum packet size, or nothing if buffer accepts packets of any size.
+			virtual std::optional<size_t> GetMaxWriteSize() const { return {}; }
+		};
+
+		/// Unbounded queue shared by Channels within one process.
+		class Queue : public Buffer
+		{
+		public:
+			/// Add packet at the end of the queue.
+			/// @param packet packet to add.
+			/// @return size of the packet. Queue never fills up.
+			size_t Write(ByteView packet) override;
+
+			/// Take all queued packets.
+			/// @return packets in order of writing.
+			std::vector<ByteVector> ReadAll() override;
+
+			/// Block until queue is not empty.
+			/// @param timeout maximal time to wait.
+			void WaitForData(std::chrono::milliseconds timeout) override;
+
+		private:
+			std::mutex m_Mutex;																							///< Guards m_Packets.
+			std::condition_variable m_DataCondition;																	///< Notified when a packet is written.
+			std::vector<ByteVector> m_Packets;																			///< Packets waiting to be read.
+		};
+
+		/// Ring buffer in named shared memory. Supports one writer and one reader, which may live in different processes.
+		/// Side that would have to wait for the other one blocks on a named event, which is signalled only if it announced waiting, so the fast path makes no system calls.
+		class SharedRing : public Buffer
+		{
+		public:
+			/// Create or open ring buffer.
+			/// @param name name of shared memory section.
+			/// @param capacity size of the ring in bytes. Ignored if the section already exists.
+			/// @throws std::runtime_error if section can't be created or opened.
+			SharedRing(std::string const& name, uint32_t capacity);
+
+			/// Destructor. Unmaps the section, which is destroyed when the other side unmaps it too.
+			~SharedRing();
+
+			/// Write packet preceded by its length. Packet is trimmed if it doesn't fit.
+			/// @param packet packet to add.
+			/// @return number of bytes written. Zero if less than s_MinPartialWrite bytes were free for s_FullRingTimeout.
+			size_t Write(ByteView packet) override;
+
+			/// Take all packets written so far.
+			/// @return packets in order of writing.
+			/// @throws std::runtime_error if ring content is corrupted.
+			std::vector<ByteVector> ReadAll() override;
+
+			/// Block until the writer publishes something.
+			/// @param timeout maximal time to wait.
+			void WaitForData(std::chrono::milliseconds timeout) override;
+
+			/// Get size of the biggest packet that fits in the empty ring.
+			/// @return ring capacity without length prefix.
+			std::optional<size_t> GetMaxWriteSize() const override;
+
+		private:
+			/// Beginning of the section.
+			struct Header
+			{
+				std::atomic<uint32_t> m_Magic;																			///< Set to s_Magic when the section is initialized.
+				uint32_t m_Capacity;																					///< Size of the ring following the Header.
+				alignas(64) std::atomic<uint64_t> m_WritePosition;														///< Total number of bytes written. Only the writer modifies it.
+				alignas(64) std::atomic<uint64_t> m_ReadPosition;														///< Total number of bytes read. Only the reader modifies it.
+				std::atomic<uint32_t> m_IsReaderWaiting;																///< Set by the reader before it waits for m_DataEvent.
+				std::atomic<uint32_t> m_IsWriterWaiting;																///< Set by the writer before it waits for m_SpaceEvent.
+			};
+
+			// Positions are shared between processes, so they must not be guarded by a process local lock.
+			static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free);
+
+			/// Copy data into the ring, wrapping around its end.
+			/// @param position total position to write at.
+			/// @param data data to copy.
+			void CopyIn(uint64_t position, ByteView data);
+
+			/// Copy data out of the ring, wrapping around its end.
+			/// @param position total position to read from.
+			/// @param data buffer to fill.
+			/// @param size number of bytes to copy.
+			void CopyOut(uint64_t position, uint8_t* data, size_t size) const;
+
+			/// Wait for the other side, unless condition is already met.
+			/// @param isWaiting flag announcing the wait to the other side.
+			/// @param event event signalled by the other side.
+			/// @param isReady condition to wait for. Checked after the flag is raised, so that no signal is lost.
+			/// @param timeout maximal time to wait.
+			template <typename Condition>
+			void Wait(std::atomic<uint32_t>& isWaiting, HANDLE event, Condition isReady, std::chrono::milliseconds timeout);
+
+			/// Wake up the other side if it is waiting.
+			/// @param isWaiting flag announcing the wait.
+			/// @param event event to signal.
+			static void Signal(std::atomic<uint32_t>& isWaiting, HANDLE event);
+
+			/// Marks initialized section.
+			static constexpr uint32_t s_Magic = 0xC3B0FFE5;
+
+			/// Relay accepts partial writes that carry at least that many bytes.
+			static constexpr size_t s_MinPartialWrite = 64;
+
+			/// Writer waits that long for the reader to make space, before it returns to the caller.
+			static constexpr std::chrono::milliseconds s_FullRingTimeout = 100ms;
+
+			WinTools::UniqueHandle m_Section;																			///< Shared memory section.
+			WinTools::UniqueHandle m_DataEvent;																			///< Signalled by the writer after publishing data.
+			WinTools::UniqueHandle m_SpaceEvent;																		///< Signalled by the reader after freeing space.
+			Header* m_Header = nullptr;																					///< Mapped beginning of the section.
+			uint8_t* m_Ring = nullptr;																					///< Mapped ring.
+		};
+
+		/// Public constructor.
+		/// @param arguments factory arguments.
+		InMemory(ByteView arguments);
+
+		/// Destructor
+		virtual ~InMemory() = default;
+
+		/// OnSend callback implementation.
+		/// @param blob data to send to Channel.
+		/// @returns size_t number of bytes successfully written.
+		size_t OnSendToChannel(ByteView blob);
+
+		/// Reads all packets buffered for this Channel. Waits for packets if receive wait is configured.
+		/// @return packets retrieved from Channel.
+		std::vector<ByteVector> OnReceiveFromChannel();
+
+		/// Tells the largest frame written whole to the output buffer.
+		/// @return capacity of the shared memory ring, or nothing for in-process queues.
+		std::optional<size_t> GetMaxFrameSize() const override;
+
+		/// Tells that in-process queues lose and reorder nothing, so that Relays pass packets through them without QoS.
+		/// @return reliable and ordered delivery for in-process queues, none for shared memory rings, which trim frames that don't fit.
+		DeliveryGuarantees GetDeliveryGuarantees() const override;
+
+		/// Find queue used by Channels of this process.
+		/// @param id Input or Output ID of the Channel.
+		/// @return queue, created if no Channel uses it yet.
+		static std::shared_ptr<Queue> GetQueue(std::string const& id);
+
+		/// Get channel capability.
+		/// @returns Channel capability in JSON format
+		static const char* GetCapability();
+
+	private:
+		std::shared_ptr<Buffer> m_Input;																				///< Buffer read by this Channel.
+		std::shared_ptr<Buffer> m_Output;																				///< Buffer written by this Channel.
+		std::chrono::milliseconds m_ReceiveWait;																		///< Time for which empty input is waited on. Zero if Channel only polls.
+	};
+}
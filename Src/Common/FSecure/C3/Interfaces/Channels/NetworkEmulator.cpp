@@ -0,0 +1,247 @@
+#include "StdAfx.h"
+#include "NetworkEmulator.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Channels::NetworkEmulator::Link::Link(std::string const& name)
+	: m_Random{ static_cast<std::mt19937::result_type>(std::hash<std::string>{}(name)) }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::NetworkEmulator::Link::SetConditions(Conditions const& conditions)
+{
+	std::scoped_lock lock(m_Mutex);
+	m_Conditions = conditions;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Interfaces::Channels::NetworkEmulator::Link::Write(ByteView packet)
+{
+	size_t size;
+	{
+		std::scoped_lock lock(m_Mutex);
+		size = m_Conditions.m_Mtu ? std::min<size_t>(packet.size(), m_Conditions.m_Mtu) : packet.size();
+
+		// Frames leave the sender one after another, so a slow link holds back the following ones too.
+		auto departure = std::chrono::steady_clock::now();
+		if (m_Conditions.m_Bandwidth)
+		{
+			m_LinkFree = std::max(m_LinkFree, departure) + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>{ static_cast<double>(size) / m_Conditions.m_Bandwidth });
+			departure = m_LinkFree;
+		}
+
+		// Lost frame still took its share of bandwidth. Sender never learns that it was lost.
+		if (Draw(m_Conditions.m_LossRate))
+			return size;
+
+		auto delivery = departure + m_Conditions.m_Latency + DrawJitter();
+		if (Draw(m_Conditions.m_ReorderRate))
+			delivery += m_Conditions.m_Latency + DrawJitter();
+		else
+			delivery = m_LastDelivery = std::max(delivery, m_LastDelivery);
+
+		// Frames due at the same time are delivered in order of writing.
+		m_Frames.emplace(delivery, packet.SubString(0, size));
+	}
+
+	m_DataCondition.notify_one();
+	return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::Interfaces::Channels::NetworkEmulator::Link::ReadAll()
+{
+	std::scoped_lock lock(m_Mutex);
+	std::vector<ByteVector> frames;
+	auto due = m_Frames.upper_bound(std::chrono::steady_clock::now());
+	for (auto it = m_Frames.begin(); it != due; ++it)
+		frames.push_back(std::move(it->second));
+
+	m_Frames.erase(m_Frames.begin(), due);
+	return frames;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::NetworkEmulator::Link::WaitForData(std::chrono::milliseconds timeout)
+{
+	std::unique_lock lock(m_Mutex);
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	for (auto now = std::chrono::steady_clock::now(); now < deadline; now = std::chrono::steady_clock::now())
+	{
+		if (!m_Frames.empty() && m_Frames.begin()->first <= now)
+			return;
+
+		m_DataCondition.wait_until(lock, m_Frames.empty() ? deadline : std::min(deadline, m_Frames.begin()->first));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<size_t> FSecure::C3::Interfaces::Channels::NetworkEmulator::Link::GetMaxWriteSize() const
+{
+	std::scoped_lock lock(m_Mutex);
+	if (!m_Conditions.m_Mtu)
+		return {};
+
+	return m_Conditions.m_Mtu;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::steady_clock::duration FSecure::C3::Interfaces::Channels::NetworkEmulator::Link::DrawJitter()
+{
+	if (!m_Conditions.m_Jitter.count())
+		return {};
+
+	return std::chrono::milliseconds{ std::uniform_int_distribution<std::chrono::milliseconds::rep>{ 0, m_Conditions.m_Jitter.count() }(m_Random) };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Interfaces::Channels::NetworkEmulator::Link::Draw(double probability)
+{
+	return probability > 0 && std::bernoulli_distribution{ std::min(probability, 1.0) }(m_Random);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Channels::NetworkEmulator::NetworkEmulator(ByteView arguments)
+{
+	auto [inputId, outputId, latency, jitter, lossPercent, reorderPercent, operationCost, mtu, bandwidth, updateDelay]
+		= arguments.Read<std::string, std::string, uint16_t, uint16_t, float, float, uint16_t, uint32_t, uint32_t, uint16_t>();
+
+	if (mtu && mtu < s_MinMtu)
+		throw std::invalid_argument{ OBF("MTU must be at least ") + std::to_string(s_MinMtu) + OBF(" bytes.") };
+
+	// Each side sets conditions of the direction it sends in.
+	m_Input = GetLink(inputId);
+	m_Output = GetLink(outputId);
+	m_OperationCost = std::chrono::milliseconds{ operationCost };
+	m_Output->SetConditions({ std::chrono::milliseconds{ latency }, std::chrono::milliseconds{ jitter }, lossPercent / 100.0, reorderPercent / 100.0, m_OperationCost, mtu, bandwidth * 1024u });
+
+	// Single argument overload doesn't enforce 30ms minimum, which protects external services from being flooded. There is no such service here.
+	SetUpdateDelay(std::chrono::milliseconds{ updateDelay });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Interfaces::Channels::NetworkEmulator::OnSendToChannel(ByteView blob)
+{
+	std::this_thread::sleep_for(m_OperationCost);
+	return m_Output->Write(blob);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::Interfaces::Channels::NetworkEmulator::OnReceiveFromChannel()
+{
+	// Polling an empty service costs as much as reading a full one.
+	std::this_thread::sleep_for(m_OperationCost);
+	return m_Input->ReadAll();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<size_t> FSecure::C3::Interfaces::Channels::NetworkEmulator::GetMaxFrameSize() const
+{
+	return m_Output->GetMaxWriteSize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Interfaces::Channels::NetworkEmulator::Link> FSecure::C3::Interfaces::Channels::NetworkEmulator::GetLink(std::string const& id)
+{
+	// Links live as long as any Channel uses them.
+	static std::mutex mutex;
+	static std::map<std::string, std::weak_ptr<Link>> links;
+
+	std::scoped_lock lock(mutex);
+	auto& entry = links[id];
+	auto link = entry.lock();
+	if (!link)
+		entry = link = std::make_shared<Link>(id);
+
+	return link;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+const char* FSecure::C3::Interfaces::Channels::NetworkEmulator::GetCapability()
+{
+	return R"(
+{
+	"create":
+	{
+		"arguments":
+		[
+			[
+				{
+					"type": "string",
+					"name": "Input ID",
+					"randomize": true,
+					"min": 4,
+					"description": "Name of the link read by the channel"
+				},
+				{
+					"type": "string",
+					"name": "Output ID",
+					"randomize": true,
+					"min": 4,
+					"description": "Name of the link written by the channel"
+				}
+			],
+			{
+				"type": "uint16",
+				"name": "Latency",
+				"min": 0,
+				"defaultValue": 0,
+				"description": "One-way delay of every frame in milliseconds"
+			},
+			{
+				"type": "uint16",
+				"name": "Jitter",
+				"min": 0,
+				"defaultValue": 0,
+				"description": "Upper bound of random delay added to every frame in milliseconds"
+			},
+			{
+				"type": "float",
+				"name": "Loss",
+				"min": 0,
+				"max": 100,
+				"defaultValue": 0,
+				"description": "Percentage of frames that are dropped"
+			},
+			{
+				"type": "float",
+				"name": "Reordering",
+				"min": 0,
+				"max": 100,
+				"defaultValue": 0,
+				"description": "Percentage of frames delayed by another latency and jitter, so that the following frames overtake them"
+			},
+			{
+				"type": "uint16",
+				"name": "Operation cost",
+				"min": 0,
+				"defaultValue": 0,
+				"description": "Milliseconds taken by every send and receive, like a call to an external service"
+			},
+			{
+				"type": "uint32",
+				"name": "MTU",
+				"min": 0,
+				"defaultValue": 0,
+				"description": "Largest frame in bytes, at least 64. Longer frames are trimmed. 0 for no limit"
+			},
+			{
+				"type": "uint32",
+				"name": "Bandwidth",
+				"min": 0,
+				"defaultValue": 0,
+				"description": "KiB per second passing through the link. 0 for no limit"
+			},
+			{
+				"type": "uint16",
+				"name": "Update delay",
+				"min": 1,
+				"defaultValue": 1,
+				"description": "Milliseconds between reads of the input link"
+			}
+		]
+	},
+	"commands": []
+}
+)";
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "InMemory.h"
+
+namespace FSecure::C3::Interfaces::Channels
+{
+	/// Channel connecting Relays within one process over an emulated bad network, to compare QoS features under controlled conditions.
+	/// Frames travel through in-process links that delay, drop, reorder and trim them. Every Channel call also takes a fixed time, like an API call or a file operation would.
+	class NetworkEmulator : public Channel<NetworkEmulator>
+	{
+	public:
+		/// Smallest MTU. Relays don't accept shorter frames.
+		static constexpr uint32_t s_MinMtu = 64;
+
+		/// Conditions of one direction of a link.
+		struct Conditions
+		{
+			std::chrono::milliseconds m_Latency{};																		///< One-way delay of every frame.
+			std::chrono::milliseconds m_Jitter{};																		///< Upper bound of random delay added to every frame.
+			double m_LossRate = 0;																						///< Share of frames that are dropped, from 0 to 1.
+			double m_ReorderRate = 0;																					///< Share of frames delayed by another latency and jitter, so that the following ones overtake them. Other frames keep their order.
+			std::chrono::milliseconds m_OperationCost{};																///< Time taken by every send and receive call of the Channel.
+			uint32_t m_Mtu = 0;																							///< Largest frame accepted whole. Longer frames are trimmed. 0 for no limit.
+			uint32_t m_Bandwidth = 0;																					///< Bytes per second passing through the link. 0 for no limit.
+		};
+
+		/// One direction of a link. Frames are delivered when their time comes. Random decisions are seeded with the link's name, so runs can be reproduced.
+		class Link : public InMemory::Buffer
+		{
+		public:
+			/// Create link.
+			/// @param name name of the link, used as a seed.
+			Link(std::string const& name);
+
+			/// Set conditions applied to frames written from now on.
+			/// @param conditions conditions of the link.
+			void SetConditions(Conditions const& conditions);
+
+			/// Schedule frame for delivery, unless it's lost. Frame is trimmed to MTU.
+			/// @param packet frame to send.
+			/// @return number of bytes accepted, including those of a lost frame.
+			size_t Write(ByteView packet) override;
+
+			/// Take frames whose delivery time has come.
+			/// @return frames in order of delivery.
+			std::vector<ByteVector> ReadAll() override;
+
+			/// Block until the next frame is due.
+			/// @param timeout maximal time to wait.
+			void WaitForData(std::chrono::milliseconds timeout) override;
+
+			/// Get MTU of the link.
+			/// @return MTU, or nothing if frames of any size are accepted whole.
+			std::optional<size_t> GetMaxWriteSize() const override;
+
+		private:
+			/// Draw a random delay from 0 to jitter.
+			/// @return delay. Must be called with m_Mutex taken.
+			std::chrono::steady_clock::duration DrawJitter();
+
+			/// Draw a random event.
+			/// @param probability chance of the event, from 0 to 1.
+			/// @return true if the event happened. Must be called with m_Mutex taken.
+			bool Draw(double probability);
+
+			mutable std::mutex m_Mutex;																					///< Guards members below.
+			std::condition_variable m_DataCondition;																	///< Notified when a frame is scheduled.
+			Conditions m_Conditions;																					///< Conditions of the link.
+			std::mt19937 m_Random;																						///< Seeded with the name of the link.
+			std::multimap<std::chrono::steady_clock::time_point, ByteVector> m_Frames;									///< Frames in flight by delivery time.
+			std::chrono::steady_clock::time_point m_LinkFree;															///< Time when previous frames leave the sender, if bandwidth is limited.
+			std::chrono::steady_clock::time_point m_LastDelivery;														///< Delivery time of the last frame that wasn't reordered.
+		};
+
+		/// Public constructor.
+		/// @param arguments factory arguments.
+		NetworkEmulator(ByteView arguments);
+
+		/// OnSend callback implementation.
+		/// @param blob data to send to Channel.
+		/// @returns size_t number of bytes successfully written.
+		size_t OnSendToChannel(ByteView blob);
+
+		/// Reads all frames delivered to this Channel.
+		/// @return packets retrieved from Channel.
+		std::vector<ByteVector> OnReceiveFromChannel();
+
+		/// Tells the largest frame accepted whole.
+		/// @return MTU of the output link, or nothing if it has no limit.
+		std::optional<size_t> GetMaxFrameSize() const override;
+
+		/// Find link used by Channels of this process.
+		/// @param id Input or Output ID of the Channel.
+		/// @return link, created if no Channel uses it yet.
+		static std::shared_ptr<Link> GetLink(std::string const& id);
+
+		/// Get channel capability.
+		/// @returns Channel capability in JSON format
+		static const char* GetCapability();
+
+	private:
+		std::shared_ptr<Link> m_Input;																					///< Link read by this Channel.
+		std::shared_ptr<Link> m_Output;																					///< Link written by this Channel.
+		std::chrono::milliseconds m_OperationCost;																		///< Time taken by every call.
+	};
+}
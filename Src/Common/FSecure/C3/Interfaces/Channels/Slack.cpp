@@ -1,86 +1,353 @@
 #include "Stdafx.h"
 #include "Slack.h"
 #include "Common/FSecure/Crypto/Base64.h"
+#include "Common/FSecure/Crypto/Base32k.h"
+
+namespace
+{
+	/// Number of characters Slack allows in a message.
+	constexpr size_t s_MaxMessageLength = 40'000;
+
+	/// Packets bigger than this are uploaded as files when framing is fixed.
+	constexpr size_t s_FileThreshold = 120'000;
+
+	/// Replies of one thread are all read with a single conversations.replies call.
+	constexpr size_t s_MaxRepliesPerThread = 8;
+
+	/// History is listed again this far back from the watermark, in case Slack shows a message of the other side with a delay.
+	constexpr std::chrono::seconds s_HistoryWatermarkMargin{ 60 };
+
+	/// Move Slack's message timestamp back in time.
+	/// @param ts - timestamp in Slack's "seconds.microseconds" format.
+	/// @param by - time to subtract.
+	/// @return - shifted timestamp.
+	std::string ShiftTimestampBack(std::string const& ts, std::chrono::seconds by)
+	{
+		auto dot = ts.find('.');
+		auto seconds = std::max(std::stoll(ts.substr(0, dot)) - by.count(), 0ll);
+		return std::to_string(seconds) + (dot == std::string::npos ? std::string{} : ts.substr(dot));
+	}
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Channels::Slack::Slack(ByteView arguments)
 	: m_inboundDirectionName{ arguments.Read<std::string>() }
 	, m_outboundDirectionName{ arguments.Read<std::string>() }
 {
-	auto [slackToken, channelName] = arguments.Read<std::string, std::string>();
-	m_slackObj = FSecure::Slack{ slackToken, channelName };
+	auto [slackTokens, channelNames, denseEncoding] = arguments.Read<std::string, std::string, uint8_t>();
+	m_denseEncoding = denseEncoding;
+
+	//Tokens and channel names are paired in order. A single token or channel name is paired with each of the others.
+	auto tokens = FSecure::Utils::SplitAndCopy(slackTokens, OBF(","));
+	auto channels = FSecure::Utils::SplitAndCopy(channelNames, OBF(","));
+	if (tokens.empty() || channels.empty() || (tokens.size() != channels.size() && tokens.size() != 1 && channels.size() != 1))
+		throw std::invalid_argument{ OBF("Numbers of Slack tokens and channel names don't match.") };
+
+	m_lanes.resize(std::max(tokens.size(), channels.size()));
+	for (size_t i = 0; i < m_lanes.size(); ++i)
+	{
+		m_lanes[i].m_Api = FSecure::Slack{ tokens[tokens.size() == 1 ? 0 : i], channels[channels.size() == 1 ? 0 : i] };
+		m_lanes[i].m_Poller = m_lanes[i].m_Api.CreatePoller();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Channels::Slack::~Slack()
+{
+	//Continuations of deletions use this object.
+	std::vector<pplx::task<void>> pendingDeletes;
+	{
+		std::scoped_lock lock(m_DeletingMutex);
+		pendingDeletes = std::move(m_PendingDeletes);
+	}
+
+	for (auto& task : pendingDeletes)
+		task.wait();
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 size_t FSecure::C3::Interfaces::Channels::Slack::OnSendToChannel(ByteView data)
 {
+	//Chunks of a packet are striped across lanes. QoS reassembles them in any order.
+	auto& lane = m_lanes[m_nextLane++ % m_lanes.size()];
+	auto& api = lane.m_Api;
+	auto framing = ChooseFraming(lane, data.size());
+
 	//Begin by creating a message where we can write the data to in a thread, both client and server ignore this message to prevent race conditions
-	std::string updateTs = m_slackObj.WriteMessage(m_outboundDirectionName + OBF(":writing"));
+	std::string updateTs = api.WriteMessage(m_outboundDirectionName + OBF(":writing"));
 
-	//this is more than 30 messages, send it as a file (we do this infrequently as file uploads restricted to 20 per minute).
+	//Big packets are sent as a file (we do this infrequently as file uploads restricted to 20 per minute).
 	//Using file upload for staging (~88 messages) is a huge improvement over sending actual replies.
-	size_t actualPacketSize = 0;
-	if (data.size() > 120'000)
+	if (!framing.m_Replies)
 	{
-		m_slackObj.UploadFile(cppcodec::base64_rfc4648::encode(data.data(), data.size()), updateTs);
-		actualPacketSize = data.size();
+		if (m_denseEncoding)
+			api.UploadFile(data, updateTs);
+		else
+			api.UploadFile(ByteView{ Base64::Encode(data) }, updateTs);
 	}
 	else
 	{
-		//Write the full data into the thread. This makes it alot easier to read in onRecieve as slack limits messages to 40k characters.
-		constexpr auto maxPacketSize = cppcodec::base64_rfc4648::decoded_max_size(40'000);
-		actualPacketSize = std::min(maxPacketSize, data.size());
-		auto sendData = data.SubString(0, actualPacketSize);
-
-		m_slackObj.WriteReply(cppcodec::base64_rfc4648::encode(sendData.data(), sendData.size()), updateTs);
+		//Write the data into the thread. Each reply is encoded separately, as slack limits messages to 40k characters.
+		auto replyCapacity = GetReplyCapacity();
+		for (size_t i = 0; i < framing.m_Replies; ++i)
+			api.WriteReply(Encode(data.SubString(i * replyCapacity, std::min(replyCapacity, framing.m_Size - i * replyCapacity))), updateTs);
 	}
 
 	//Update the original first message with "C2S||S2C:Done" - these messages will always be read in onRecieve.
 	std::string message = m_outboundDirectionName + OBF(":Done");
 
-	m_slackObj.UpdateMessage(message, updateTs);
-	return actualPacketSize;
+	api.UpdateMessage(message, updateTs);
+
+	std::scoped_lock lock(m_framingMutex);
+	m_lastFraming = framing;
+	return framing.m_Size;
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::milliseconds FSecure::C3::Interfaces::Channels::Slack::GetUpdateDelay() const
+{
+	//All lanes are polled at once, so the poll waits for the latest of their turns.
+	auto delay = Channel<Slack>::GetUpdateDelay();
+	std::chrono::steady_clock::duration turn = delay;
+	for (auto& lane : m_lanes)
+		if (lane.m_Poller)
+			turn = std::max(turn, lane.m_Poller->GetDelay(delay));
+
+	return std::chrono::ceil<std::chrono::milliseconds>(turn);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::vector<FSecure::ByteVector> FSecure::C3::Interfaces::Channels::Slack::OnReceiveFromChannel()
 {
-	auto messages = m_slackObj.GetMessagesByDirection(m_inboundDirectionName + OBF(":Done"));
+	//Lanes are received in parallel, the first one on this thread.
+	std::vector<std::future<std::vector<ByteVector>>> receptions;
+	for (size_t i = 1; i < m_lanes.size(); ++i)
+		receptions.push_back(std::async(std::launch::async, [this, &lane = m_lanes[i]] { return ReceiveFromLane(lane); }));
 
 	std::vector<ByteVector> ret;
-	//Read the messages in reverse order (which is actually from the oldest to newest)
-	//Avoids old messages being left behind.
-	for (std::vector<std::string>::reverse_iterator ts = messages.rbegin(); ts != messages.rend(); ++ts)
+	std::exception_ptr error;
+	auto merge = [&](auto&& receive)
+	{
+		try
+		{
+			for (auto& packet : receive())
+				ret.push_back(std::move(packet));
+		}
+		catch (...)
+		{
+			if (!error)
+				error = std::current_exception();
+		}
+	};
+
+	merge([this] { return ReceiveFromLane(m_lanes.front()); });
+	for (auto& reception : receptions)
+		merge([&reception] { return reception.get(); });
+
+	//Failing lane doesn't hold back packets of the others. Its error is reported once nothing else arrives.
+	if (error && ret.empty())
+		std::rethrow_exception(error);
+
+	return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::Interfaces::Channels::Slack::ReceiveFromLane(Lane& lane)
+{
+	//Only messages newer than the watermark are listed, so the cost of a poll doesn't grow with the channel's backlog.
+	//Messages are listed from the newest to the oldest.
+	auto done = m_inboundDirectionName + OBF(":Done"), writing = m_inboundDirectionName + OBF(":writing");
+	std::vector<std::string> messages;
+	std::optional<std::string> watermark;
+	for (auto& message : lane.m_Api.ListMessages(lane.m_HistoryWatermark))
 	{
+		if (!watermark)
+			watermark = message.m_Timestamp;
 
-		auto replies = m_slackObj.ReadReplies(*ts);
-		std::vector<std::string> repliesTs;
+		//Message being written is updated to "Done" later, but keeps its timestamp. It has to be listed again.
+		if (message.m_Text == done)
+			messages.push_back(std::move(message.m_Timestamp));
+		else if (message.m_Text == writing)
+			watermark = message.m_Timestamp;
+	}
+
+	//Skip messages that were already received, but are still being deleted.
+	{
+		std::scoped_lock lock(m_DeletingMutex);
+		messages.erase(std::remove_if(messages.begin(), messages.end(), [&lane](auto const& ts) { return lane.m_Deleting.count(ts); }), messages.end());
+		m_PendingDeletes.erase(std::remove_if(m_PendingDeletes.begin(), m_PendingDeletes.end(), [](auto const& task) { return task.is_done(); }), m_PendingDeletes.end());
+	}
 
-		std::string message;
+	//Read all threads at once, in reverse order (which is actually from the oldest to newest)
+	//Avoids old messages being left behind.
+	std::vector<pplx::task<std::vector<FSecure::Slack::Reply>>> reads;
+	for (auto ts = messages.rbegin(); ts != messages.rend(); ++ts)
+		reads.push_back(lane.m_Api.ReadRepliesAsync(*ts, !m_denseEncoding));
+
+	//Wait for every read before deciding anything, nothing can be deleted if one of them failed.
+	std::vector<std::vector<FSecure::Slack::Reply>> replies;
+	std::exception_ptr error;
+	for (auto& read : reads)
+		try
+		{
+			replies.push_back(read.get());
+		}
+		catch (...)
+		{
+			if (!error)
+				error = std::current_exception();
+		}
+
+	if (error)
+		std::rethrow_exception(error);
+
+	std::vector<ByteVector> ret;
+	std::vector<std::vector<std::string>> repliesTs;
+	for (auto& thread : replies)
+	{
+		ByteVector message;
+		repliesTs.emplace_back();
 
 		//Get all of the messages from the replies.
-		for (auto&& reply : replies)
+		for (auto&& reply : thread)
 		{
-			message.append(reply.second);
-			repliesTs.push_back(std::move(reply.first)); //get all of the timestamps for later deletion
+			message.Concat(Decode(reply));
+			repliesTs.back().push_back(std::move(reply.m_Timestamp)); //get all of the timestamps for later deletion
 		}
 
-		//Base64 decode the entire message
-		auto relayMsg = cppcodec::base64_rfc4648::decode(message);
-		m_slackObj.DeleteMessage(*ts);	//delete the message
-		DeleteReplies(repliesTs); //delete the replies.
-		ret.emplace_back(std::move(relayMsg));
+		ret.emplace_back(std::move(message));
 	}
+
+	for (size_t i = 0; i < repliesTs.size(); ++i)
+		DeleteThread(lane, messages[messages.size() - 1 - i], repliesTs[i]);
+
+	//Move the watermark only when all messages were received. Received ones are skipped until they are deleted.
+	if (watermark)
+		lane.m_HistoryWatermark = ShiftTimestampBack(*watermark, s_HistoryWatermarkMargin);
+
 	return ret;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Interfaces::Channels::Slack::DeleteReplies(std::vector<std::string> const &repliesTs)
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::Slack::DeleteThread(Lane& lane, std::string const& ts, std::vector<std::string> const& repliesTs)
 {
-	for (auto&& ts : repliesTs)
-		m_slackObj.DeleteMessage(ts);
+	std::vector<pplx::task<void>> deletes;
+	deletes.push_back(lane.m_Api.DeleteMessageAsync(ts));
+	for (auto&& replyTs : repliesTs)
+		deletes.push_back(lane.m_Api.DeleteMessageAsync(replyTs));
+
+	std::scoped_lock lock(m_DeletingMutex);
+	lane.m_Deleting.insert(ts);
+	m_PendingDeletes.push_back(pplx::when_all(deletes.begin(), deletes.end()).then([this, &lane, ts](pplx::task<void> result)
+	{
+		try
+		{
+			result.get();
+			std::scoped_lock lock(m_DeletingMutex);
+			lane.m_Deleting.erase(ts);
+		}
+		catch (...)
+		{
+			//Keep the message skipped. Receiving it again would duplicate the packet.
+		}
+	}));
 }
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Channels::Slack::Framing FSecure::C3::Interfaces::Channels::Slack::ChooseFraming(Lane& lane, size_t size)
+{
+	auto replyCapacity = GetReplyCapacity();
+	if (!m_adaptiveFraming)
+		return size > s_FileThreshold ? Framing{ size, 0, {} } : Framing{ std::min(size, replyCapacity), 1, {} };
+
+	//Pick framing with the best throughput. Estimates include latency and rate limit headroom of every API method, so framing follows workspace load.
+	auto& api = lane.m_Api;
+	auto update = api.EstimateCallTime(OBF("chat.update"), 1);
+	auto rate = [](Framing const& framing) { return framing.m_Size / std::max(std::chrono::duration<double>(framing.m_Estimate).count(), 0.001); };
+	std::optional<Framing> best;
+	auto consider = [&](Framing framing)
+	{
+		if (!best || rate(framing) > rate(*best))
+			best = framing;
+	};
+
+	//Thread starting message and all replies are posted one after another.
+	for (size_t replies = 1; replies <= s_MaxRepliesPerThread; ++replies)
+	{
+		consider({ std::min(size, replies * replyCapacity), replies, api.EstimateCallTime(OBF("chat.postMessage"), replies + 1) + update });
+		if (replies * replyCapacity >= size)
+			break;
+	}
+
+	if (size > replyCapacity)
+		consider({ size, 0, api.EstimateCallTime(OBF("chat.postMessage"), 1) + api.EstimateCallTime(OBF("files.upload"), 1) + update });
+
+	return *best;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Interfaces::Channels::Slack::GetReplyCapacity() const
+{
+	return m_denseEncoding ? Base32k::DecodedMaxSize(s_MaxMessageLength) : Base64::DecodedMaxSize(s_MaxMessageLength);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Interfaces::Channels::Slack::OnRunCommand(ByteView command)
+{
+	auto commandCopy = command; //each read moves ByteView. CommandCoppy is needed  for default.
+	switch (command.Read<uint16_t>())
+	{
+	case 0:
+		m_adaptiveFraming = command.Read<uint8_t>();
+		return {};
+	case 1:
+	{
+		std::optional<Framing> lastFraming;
+		{
+			std::scoped_lock lock(m_framingMutex);
+			lastFraming = m_lastFraming;
+		}
+
+		std::string report = m_adaptiveFraming ? OBF_STR("Adaptive framing. ") : OBF_STR("Fixed framing. ");
+		if (!lastFraming)
+			report += OBF("No packets sent yet");
+		else if (!lastFraming->m_Replies)
+			report += OBF_STR("Last packet: ") + std::to_string(lastFraming->m_Size) + OBF(" bytes uploaded as a file");
+		else
+			report += OBF_STR("Last packet: ") + std::to_string(lastFraming->m_Size) + OBF(" bytes in ") + std::to_string(lastFraming->m_Replies) + OBF(" replies of up to ") + std::to_string(GetReplyCapacity()) + OBF(" bytes");
+
+		if (lastFraming && lastFraming->m_Estimate.count())
+			report += OBF_STR(", expected to take ") + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(lastFraming->m_Estimate).count()) + OBF(" ms");
+
+		report += '.';
+		Log({ report, LogMessage::Severity::Information });
+		return ByteView{ report };
+	}
+	default:
+		return AbstractChannel::OnRunCommand(commandCopy);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::C3::Interfaces::Channels::Slack::Encode(ByteView data) const
+{
+	return m_denseEncoding ? Base32k::Encode(data) : Base64::Encode(data);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Interfaces::Channels::Slack::Decode(FSecure::Slack::Reply const& reply) const
+{
+	//Files are uploaded without encoding in dense mode. Otherwise they are decoded while they are downloaded.
+	if (reply.m_IsFile)
+		return ByteView{ reply.m_Text };
+
+	if (m_denseEncoding)
+		return Base32k::Decode(reply.m_Text);
+
+	return Base64::Decode(reply.m_Text);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 const char* FSecure::C3::Interfaces::Channels::Slack::GetCapability()
 {
 	return R"_(
@@ -109,18 +376,46 @@ const char* FSecure::C3::Interfaces::Channels::Slack::GetCapability()
 				"type": "string",
 				"name": "Slack token",
 				"min": 1,
-				"description": "This token is what channel needs to interact with Slack's API"
+				"description": "This token is what channel needs to interact with Slack's API. Separate many tokens with commas to stripe traffic across their rate limits"
 			},
 			{
 				"type": "string",
 				"name": "Channel name",
 				"min": 4,
 				"randomize": true,
-				"description": "Name of Slack's channel used by api"
+				"description": "Name of Slack's channel used by api. Many names separated with commas are paired with tokens in order. A single token or name is used with each of the others"
+			},
+			{
+				"type": "boolean",
+				"name": "Dense encoding",
+				"defaultValue": false,
+				"description": "Encode messages with Base32k and upload files without encoding. Sends more data with each API call"
 			}
 		]
 	},
-	"commands": []
+	"commands":
+	[
+		{
+			"name": "Set framing",
+			"id": 0,
+			"description": "Adaptive framing chooses between replies, many replies per thread and file uploads using observed latency and rate limits",
+			"arguments":
+			[
+				{
+					"type": "boolean",
+					"name": "Adaptive",
+					"defaultValue": true,
+					"description": "Use adaptive framing instead of fixed thresholds"
+				}
+			]
+		},
+		{
+			"name": "Show framing",
+			"id": 1,
+			"description": "Log framing used for the last packet",
+			"arguments": []
+		}
+	]
 }
 )_";
 }
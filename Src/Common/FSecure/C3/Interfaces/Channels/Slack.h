@@ -1,17 +1,20 @@
 #pragma once
+#include <optional>
+#include <unordered_set>
 #include "Common/FSecure/Slack/SlackApi.h"
 
 namespace FSecure::C3::Interfaces::Channels
 {
 	///Implementation of the Slack Channel.
+	///Traffic can be striped across many tokens and conversations, so that bandwidth isn't bound by rate limits of a single one.
 	struct Slack : public Channel<Slack>
 	{
 		/// Public constructor.
 		/// @param arguments factory arguments.
 		Slack(ByteView arguments);
 
-		/// Destructor
-		virtual ~Slack() = default;
+		/// Destructor. Waits for deletions that are still running.
+		virtual ~Slack();
 
 		/// OnSend callback implementation.
 		/// @param packet data to send to Channel.
@@ -22,6 +25,15 @@ namespace FSecure::C3::Interfaces::Channels
 		/// @return packet retrieved from Channel.
 		std::vector<ByteVector> OnReceiveFromChannel();
 
+		/// Gets update delay. Channel waits for its turn on every lane, so that Channels sharing a token don't poll at the same time.
+		/// @return own update delay, extended to the next turn of the slowest lane.
+		std::chrono::milliseconds GetUpdateDelay() const override;
+
+		/// Processes internal (C3 API) Command.
+		/// @param command a buffer containing whole command and it's parameters.
+		/// @return command result.
+		ByteVector OnRunCommand(ByteView command) override;
+
 		/// Get channel capability.
 		/// @returns Channel capability in JSON format
 		static const char* GetCapability();
@@ -37,12 +49,78 @@ namespace FSecure::C3::Interfaces::Channels
 		/// The outbound direction name, the opposite of m_inboundDirectionName
 		std::string m_outboundDirectionName;
 
+		/// Use Base32k for messages and binary files instead of Base64.
+		bool m_denseEncoding;
+
+		/// Choose framing from observed latency and rate limit headroom instead of fixed thresholds.
+		std::atomic_bool m_adaptiveFraming = false;
+
 	private:
-		/// An object encapsulating Slack's API, providing methods allowing the consumer to send and receive messages to slack, among other things.
-		FSecure::Slack m_slackObj;
+		/// Way of sending a packet.
+		struct Framing
+		{
+			size_t m_Size;																								///< Number of bytes sent.
+			size_t m_Replies;																							///< Number of replies in the thread. Zero if packet is uploaded as a file.
+			std::chrono::steady_clock::duration m_Estimate;																///< Expected time of sending. Zero for fixed framing.
+		};
+
+		/// Token and conversation carrying a share of the traffic.
+		struct Lane
+		{
+			FSecure::Slack m_Api;																						///< Slack's API bound to the token and conversation.
+			std::unordered_set<std::string> m_Deleting;																	///< Timestamps of received messages that are not deleted yet. Guarded by m_DeletingMutex.
+			std::string m_HistoryWatermark;																				///< Timestamp of the oldest message listed by OnReceiveFromChannel. Older messages are all received or don't belong to this direction.
+			std::unique_ptr<SlackRateLimiter::Poller> m_Poller;															///< Turns of the lane among all pollers of its token.
+		};
+
+		/// Choose how to send a packet.
+		/// @param lane - lane the packet is sent through.
+		/// @param size - size of the packet.
+		/// @return - framing to use.
+		Framing ChooseFraming(Lane& lane, size_t size);
+
+		/// Receive packets of one lane.
+		/// @param lane - lane to receive from.
+		/// @return - packets retrieved from the lane, from the oldest to the newest.
+		std::vector<ByteVector> ReceiveFromLane(Lane& lane);
+
+		/// Get number of bytes that fit in one reply.
+		/// @return - reply capacity for channel's encoding.
+		size_t GetReplyCapacity() const;
+
+		/// Guards m_lastFraming.
+		std::mutex m_framingMutex;
+
+		/// Framing of the last sent packet, reported by OnRunCommand.
+		std::optional<Framing> m_lastFraming;
+
+		/// Tokens and conversations used by the channel. Packets are sent through them in turns and received from all of them.
+		std::vector<Lane> m_lanes;
+
+		/// Index of the lane used by the next send.
+		std::atomic_size_t m_nextLane = 0;
+
+		/// Encode data for a reply.
+		/// @param data - data to be encoded.
+		/// @return - text using channel's encoding.
+		std::string Encode(ByteView data) const;
+
+		/// Decode data of a reply.
+		/// @param reply - text of the reply or content of the file attached to it.
+		/// @return - decoded data.
+		ByteVector Decode(FSecure::Slack::Reply const& reply) const;
+
+		/// Delete a message and all of its replies in the background, so that receiving doesn't wait for Slack.
+		/// Message is skipped by OnReceiveFromChannel until it is deleted, so that it is never delivered twice.
+		/// @param lane - lane the message was received from.
+		/// @param ts - timestamp of the message to be deleted.
+		/// @param repliesTs - an array of timestamps of replies to be deleted.
+		void DeleteThread(Lane& lane, std::string const& ts, std::vector<std::string> const& repliesTs);
+
+		/// Guards Lane::m_Deleting and m_PendingDeletes, which are changed by continuations of deletions.
+		std::mutex m_DeletingMutex;
 
-		/// Delete all the replies to a message.
-		/// @param repliesTs - an array of timestamps of messages to be deleted through DeleteMessage.
-		void DeleteReplies(std::vector<std::string> const& repliesTs);
+		/// Deletions started by OnReceiveFromChannel.
+		std::vector<pplx::task<void>> m_PendingDeletes;
 	};
 }
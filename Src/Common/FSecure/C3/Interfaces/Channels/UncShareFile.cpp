@@ -3,8 +3,9 @@
 #include "Common/FSecure/Crypto/Base64.h"
 #include <Common/FSecure/WinTools/UniqueHandle.h>
 #include <random>
-#include <fstream>
 #include <sstream>
+#include <iomanip>
+#include <cwctype>
 #include <sddl.h>
 
 namespace
@@ -36,6 +37,32 @@ namespace
 		[]() {auto ptr = new SECURITY_ATTRIBUTES; CreateDACL(ptr); return ptr; }(),
 		[](SECURITY_ATTRIBUTES* ptr) {FreeDACL(ptr);  delete ptr; }
 	};
+
+	/// Separates writer ID from sequence number in names of packet files.
+	constexpr char g_SequenceNumberSeparator = '_';
+
+	/// Written sequence numbers have this many hexadecimal digits, so that they have the same length.
+	constexpr size_t g_SequenceNumberDigits = 16;
+
+	/// Reads sequence number from name of a packet file.
+	/// @param path path or name of packet file.
+	/// @returns sequence number or nothing if name was chosen by an older writer.
+	std::optional<std::uint64_t> ParseSequenceNumber(std::filesystem::path const& path)
+	{
+		auto stem = path.stem().string();
+		auto separator = stem.find_last_of(g_SequenceNumberSeparator);
+		if (separator == std::string::npos || stem.size() - separator - 1 != g_SequenceNumberDigits)
+			return {};
+
+		try
+		{
+			return std::stoull(stem.substr(separator + 1), nullptr, 16);
+		}
+		catch (std::exception const&)
+		{
+			return {};
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -43,6 +70,9 @@ FSecure::C3::Interfaces::Channels::UncShareFile::UncShareFile(ByteView arguments
 	: m_InboundDirectionName{ arguments.Read<std::string>() }
 	, m_OutboundDirectionName{ arguments.Read<std::string>() }
 	, m_FilesystemPath{ arguments.Read<std::string>() }
+	, m_WriterId{ FSecure::Utils::GenerateRandomString(8) }
+	, m_NextSequenceNumber{ static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()) }
+	, m_LastReceive{ std::chrono::steady_clock::now() }
 {
 	// If path doesn't exist, create it
 	if (!std::filesystem::exists(m_FilesystemPath))
@@ -54,84 +84,285 @@ FSecure::C3::Interfaces::Channels::UncShareFile::UncShareFile(ByteView arguments
 		Log({ OBF("Removing all existing file tasks."), LogMessage::Severity::Information });
 		RemoveAllPackets();
 	}
+
+	// Watching directory makes receiving cost proportional to number of new files. Other Channels using the directory might have started watching it already.
+	m_Share = Share::Get(m_FilesystemPath);
+	if (arguments.Read<uint8_t>())
+		try
+		{
+			m_Share->Watch();
+		}
+		catch (std::exception& exception)
+		{
+			Log({ OBF_STR("Directory can't be watched, falling back to scanning it: ") + exception.what(), LogMessage::Severity::Warning });
+		}
+
+	// Batching writes many packets to one file, trading latency for fewer file operations.
+	if (auto batchInterval = arguments.Read<uint16_t>())
+		EnableOutboundBatching(std::chrono::milliseconds{ batchInterval }, s_MaxBatchSize);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 size_t FSecure::C3::Interfaces::Channels::UncShareFile::OnSendToChannel(ByteView data)
+{
+	Publish(data, {});
+	return data.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::UncShareFile::OnSendBatchToChannel(std::vector<ByteView> const& frames)
+{
+	// Every frame is prefixed with its size.
+	ByteVector batch;
+	for (auto frame : frames)
+		batch.Write(frame);
+
+	Publish(batch, OBF_CACHED(".batch"));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::UncShareFile::Publish(ByteView data, std::string const& extension)
 {
 	try
 	{
-		std::filesystem::path lockFilePath;
-		std::filesystem::path packetFilePath;
-		do
-		{
-			lockFilePath = m_FilesystemPath / (m_OutboundDirectionName + std::to_string(FSecure::Utils::GenerateRandomValue<int>(10000, 99999)) + OBF(".lock"));
-			packetFilePath = lockFilePath;
-			packetFilePath.replace_extension();
-		} while (std::filesystem::exists(packetFilePath) or std::filesystem::exists(lockFilePath));
+		// Names are unique to this writer, so they are never taken. Sequence number lets readers order packets without querying the share.
+		std::ostringstream name;
+		name << m_OutboundDirectionName << m_WriterId << g_SequenceNumberSeparator << std::hex << std::setfill('0') << std::setw(g_SequenceNumberDigits) << m_NextSequenceNumber++;
+
+		// Packet is written under a temporary name, which readers ignore, and published with a rename.
+		// Rename is atomic, so readers never see a partially written packet and no lock file is needed.
+		auto tempFilePath = m_FilesystemPath / (OBF_STR("~") + name.str() + OBF(".tmp"));
 
-		auto createFile = [](auto const& path)
+		// Create file with FullAccess to "Everyone" group
+		auto handle = CreateFileW(tempFilePath.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, g_FullAccessDACL.get(), CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (handle == INVALID_HANDLE_VALUE)
+			throw std::runtime_error(OBF_STR("UncShareFile channel: failed to create a file ") + tempFilePath.generic_string());
+
+		try
 		{
-			// Create file with FullAccess to "Everyone" group
-			auto file = WinTools::UniqueHandle(CreateFileA(path.generic_string().c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, g_FullAccessDACL.get(), CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr));
-			if (file.get() == INVALID_HANDLE_VALUE)
-				throw std::runtime_error(OBF_STR("UncShareFile channel: failed to create a file ") + path.generic_string());
-		};
-		createFile(lockFilePath);
-		createFile(packetFilePath);
+			// Write the contents of a file through the same handle.
+			{
+				auto file = WinTools::UniqueHandle(handle);
+				for (auto remaining = data; !remaining.empty();)
+				{
+					DWORD written;
+					if (!WriteFile(file.get(), remaining.data(), static_cast<DWORD>(std::min<size_t>(remaining.size(), std::numeric_limits<int32_t>::max())), &written, nullptr))
+						throw std::runtime_error(OBF_STR("UncShareFile channel: failed to write a file ") + tempFilePath.generic_string());
+
+					remaining.remove_prefix(written);
+				}
+			}
+
+			if (auto packetFilePath = m_FilesystemPath / (name.str() + extension); !MoveFileExW(tempFilePath.c_str(), packetFilePath.c_str(), 0))
+				throw std::runtime_error(OBF_STR("UncShareFile channel: failed to publish a file ") + packetFilePath.generic_string());
+		}
+		catch (...)
 		{
-			// Write the contents of a file
-			std::ofstream packetFile(packetFilePath, std::ios::trunc | std::ios::binary);
-			packetFile << std::string_view{ data };
+			RemoveFile(tempFilePath);
+			throw;
 		}
-		RemoveFile(lockFilePath);
-
-		return data.size();
 	}
 	catch (std::exception& exception)
 	{
 		throw std::runtime_error(OBF_STR("Caught a std::exception when writing to a file as part of OnSend: ") + exception.what());
-		return 0u;
 	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::vector<FSecure::ByteVector> FSecure::C3::Interfaces::Channels::UncShareFile::OnReceiveFromChannel()
 {
-	// Read a single packet from the oldest file that belongs to this channel
-
-	std::vector<std::filesystem::path> channelFiles;
-	for (auto&& directoryEntry : std::filesystem::directory_iterator(m_FilesystemPath))
-		if (BelongToChannel(directoryEntry.path()))
-			channelFiles.emplace_back(directoryEntry.path());
-
-
-	std::sort(channelFiles.begin(), channelFiles.end(), [](auto const& a, auto const& b) -> bool { return std::filesystem::last_write_time(a) < std::filesystem::last_write_time(b); });
+	// Read packets from files that belong to this channel, oldest first.
+	auto since = std::exchange(m_LastReceive, std::chrono::steady_clock::now());
+	auto channelFiles = m_Share->GetPackets(m_InboundDirectionName, since, [this](std::string const& error)
+	{
+		Log({ OBF_STR("Watching directory failed, falling back to scanning it: ") + error, LogMessage::Severity::Warning });
+	});
 
 	std::vector<ByteVector> ret;
-	ret.reserve(channelFiles.size());
+	size_t receivedBytes = 0;
 	for (auto&& file : channelFiles)
 	{
-		ByteVector packet;
+		// Backlog is drained a part on each update. Files not read yet stay on the share, and in the index.
+		if (receivedBytes >= s_MaxReceiveBytes)
+			break;
+
 		try
 		{
-			auto readFile = std::ifstream(file, std::ios::binary);
-			packet = ByteVector{ std::istreambuf_iterator<char>{readFile}, {} };
-			readFile.close();
-			RemoveFile(file);
+			auto packet = ReadAndRemoveFile(file);
+			m_Share->Forget(file);
+			if (!packet)
+				continue;
+
+			receivedBytes += packet->size();
+			if (file.extension() != OBF_CACHED(".batch"))
+			{
+				ret.push_back(std::move(*packet));
+				continue;
+			}
+
+			// Batch files hold many size prefixed packets.
+			for (auto batch = ByteView{ *packet }; !batch.empty();)
+				ret.push_back(batch.Read<ByteVector>());
 		}
 		catch (std::exception& exception)
 		{
 			Log({ OBF("Caught a std::exception when processing contents of filename: ") + file.generic_string() + OBF(" : ") + exception.what(), LogMessage::Severity::Error });
 			break;
 		}
+	}
+
+	return ret;
+}
 
-		ret.push_back(std::move(packet));
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Interfaces::Channels::UncShareFile::Share> FSecure::C3::Interfaces::Channels::UncShareFile::Share::Get(std::filesystem::path const& path)
+{
+	// Shares live as long as any Channel uses them.
+	static std::mutex mutex;
+	static std::map<std::wstring, std::weak_ptr<Share>> shares;
+
+	// Same directory can be spelled in many ways. Windows paths are case insensitive.
+	auto key = std::filesystem::absolute(path).lexically_normal().wstring();
+	std::transform(key.begin(), key.end(), key.begin(), [](wchar_t c) { return static_cast<wchar_t>(std::towlower(c)); });
+
+	std::scoped_lock lock(mutex);
+	auto& entry = shares[key];
+	auto share = entry.lock();
+	if (!share)
+		entry = share = std::make_shared<Share>(path);
+
+	return share;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Channels::UncShareFile::Share::Share(std::filesystem::path path)
+	: m_Path{ std::move(path) }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::UncShareFile::Share::Watch()
+{
+	std::scoped_lock lock(m_Mutex);
+	if (m_Watcher)
+		return;
+
+	// Watcher is started before the index is filled, so that no file is missed.
+	m_Watcher = std::make_unique<WinTools::DirectoryWatcher>(m_Path);
+	try
+	{
+		RebuildIndex();
+	}
+	catch (...)
+	{
+		m_Watcher.reset();
+		throw;
 	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<std::filesystem::path> FSecure::C3::Interfaces::Channels::UncShareFile::Share::GetPackets(std::string const& prefix, std::chrono::steady_clock::time_point since, std::function<void(std::string const&)> const& onWatchFailure)
+{
+	std::scoped_lock lock(m_Mutex);
+	if (m_Watcher)
+	{
+		try
+		{
+			if (auto changes = m_Watcher->GetChanges())
+				ApplyChanges(*changes);
+			else
+				RebuildIndex();
+		}
+		catch (std::exception& exception)
+		{
+			m_Watcher.reset();
+			onWatchFailure(exception.what());
+			RebuildIndex();
+		}
+	}
+	// Listing taken by another Channel is used, unless this Channel could have seen it on its previous receive. Number of listings is set by the most frequent receiver, not by number of Channels.
+	else if (m_IndexedAt < since)
+		RebuildIndex();
+
+	std::vector<std::filesystem::path> ret;
+	for (auto&& packet : m_IndexedPackets)
+		if (!packet.string().compare(0, prefix.size(), prefix) && !m_LockedPackets.count(packet))
+			ret.push_back(m_Path / packet);
 
 	return ret;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::UncShareFile::Share::Forget(std::filesystem::path const& path)
+{
+	std::scoped_lock lock(m_Mutex);
+	m_IndexedPackets.erase(std::remove(m_IndexedPackets.begin(), m_IndexedPackets.end(), path.filename()), m_IndexedPackets.end());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::UncShareFile::Share::ApplyChanges(std::vector<WinTools::DirectoryWatcher::Change> const& changes)
+{
+	if (changes.empty())
+		return;
+
+	for (auto&& change : changes)
+	{
+		if (auto packet = change.m_FileName; packet.extension() == OBF_CACHED(".lock"))
+		{
+			packet.replace_extension();
+			if (change.m_IsAdded)
+				m_LockedPackets.insert(std::move(packet));
+			else
+				m_LockedPackets.erase(packet);
+		}
+		else if (packet.extension() == OBF_CACHED(".tmp"))
+			continue;
+		else if (!change.m_IsAdded)
+			m_IndexedPackets.erase(std::remove(m_IndexedPackets.begin(), m_IndexedPackets.end(), packet), m_IndexedPackets.end());
+		else if (std::find(m_IndexedPackets.begin(), m_IndexedPackets.end(), packet) == m_IndexedPackets.end())
+			m_IndexedPackets.push_back(std::move(packet));
+	}
+
+	// Notifications of different writers can arrive out of order.
+	SortPackets(m_IndexedPackets);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::UncShareFile::Share::RebuildIndex()
+{
+	// Files created during listing might be missed, so the index is as old as the start of listing.
+	auto indexedAt = std::chrono::steady_clock::now();
+	std::vector<std::filesystem::path> packets;
+	std::set<std::filesystem::path> lockedPackets;
+	for (auto&& directoryEntry : std::filesystem::directory_iterator(m_Path))
+	{
+		auto filename = directoryEntry.path().filename();
+		if (filename.extension() == OBF_CACHED(".lock"))
+			lockedPackets.insert(filename.replace_extension());
+		else if (filename.extension() != OBF_CACHED(".tmp"))
+			packets.push_back(std::move(filename));
+	}
+
+	SortPackets(packets);
+	m_IndexedPackets = std::move(packets);
+	m_LockedPackets = std::move(lockedPackets);
+	m_IndexedAt = indexedAt;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Channels::UncShareFile::SortPackets(std::vector<std::filesystem::path>& packets)
+{
+	// Files of older writers have no sequence number and go first. Equal numbers of different writers are ordered by name, so that every reader sees the same order.
+	std::vector<std::pair<std::optional<std::uint64_t>, std::filesystem::path>> keyed;
+	keyed.reserve(packets.size());
+	for (auto&& packet : packets)
+		keyed.emplace_back(ParseSequenceNumber(packet), std::move(packet));
+
+	std::sort(keyed.begin(), keyed.end());
+	for (size_t i = 0; i < keyed.size(); ++i)
+		packets[i] = std::move(keyed[i].second);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Interfaces::Channels::UncShareFile::RemoveAllPackets()
 {
@@ -143,31 +374,36 @@ void FSecure::C3::Interfaces::Channels::UncShareFile::RemoveAllPackets()
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 bool FSecure::C3::Interfaces::Channels::UncShareFile::BelongToChannel(std::filesystem::path const& path) const
 {
-	auto filename = path.filename().string();
-	if (filename.size() < m_InboundDirectionName.size())
+	if (!IsInbound(path))
 		return false;
 
-	auto startsWith = std::string_view{ filename }.substr(0, m_InboundDirectionName.size());
-	if (startsWith != m_InboundDirectionName)
-		return false;
-
-	if (path.extension() == OBF(".lock"))
+	if (path.extension() == OBF_CACHED(".lock"))
 		return false;
 
 	// Check if file is still locked by it's writer
 	auto lockfile = path;
-	lockfile.replace_extension(OBF(".lock"));
+	lockfile.replace_extension(OBF_CACHED(".lock"));
 	return !std::filesystem::exists(lockfile);
 }
 
+bool FSecure::C3::Interfaces::Channels::UncShareFile::IsInbound(std::filesystem::path const& path) const
+{
+	auto filename = path.filename().string();
+	if (filename.size() < m_InboundDirectionName.size())
+		return false;
+
+	auto startsWith = std::string_view{ filename }.substr(0, m_InboundDirectionName.size());
+	return startsWith == m_InboundDirectionName;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Interfaces::Channels::UncShareFile::RemoveFile(std::filesystem::path const& path)
 {
 	for (auto i = 0; i < 10; ++i)
 		try
 		{
-			if (std::filesystem::exists(path))
-				std::filesystem::remove(path);
-
+			// Removing a file that doesn't exist is not an error.
+			std::filesystem::remove(path);
 			break;
 		}
 		catch (std::exception& exception)
@@ -177,6 +413,40 @@ void FSecure::C3::Interfaces::Channels::UncShareFile::RemoveFile(std::filesystem
 		}
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ByteVector> FSecure::C3::Interfaces::Channels::UncShareFile::ReadAndRemoveFile(std::filesystem::path const& path)
+{
+	// File is deleted when the handle is closed, which saves separate exists and remove calls to the share.
+	auto handle = CreateFileW(path.c_str(), GENERIC_READ | DELETE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		// Another reader took the file.
+		if (auto error = GetLastError(); error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND)
+			return {};
+
+		throw std::runtime_error(OBF_STR("UncShareFile channel: failed to open a file ") + path.generic_string());
+	}
+
+	auto file = WinTools::UniqueHandle(handle);
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file.get(), &size))
+		throw std::runtime_error(OBF_STR("UncShareFile channel: failed to get size of a file ") + path.generic_string());
+
+	ByteVector ret(static_cast<size_t>(size.QuadPart));
+	for (size_t offset = 0; offset < ret.size();)
+	{
+		DWORD read;
+		if (!ReadFile(file.get(), ret.data() + offset, static_cast<DWORD>(std::min<size_t>(ret.size() - offset, std::numeric_limits<int32_t>::max())), &read, nullptr))
+			throw std::runtime_error(OBF_STR("UncShareFile channel: failed to read a file ") + path.generic_string());
+
+		if (!read)
+			throw std::runtime_error(OBF_STR("UncShareFile channel: file was truncated while reading ") + path.generic_string());
+
+		offset += read;
+	}
+
+	return ret;
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Interfaces::Channels::UncShareFile::OnRunCommand(ByteView command)
@@ -229,6 +499,19 @@ const char* FSecure::C3::Interfaces::Channels::UncShareFile::GetCapability()
 				"name": "Clear",
 				"defaultValue": false,
 				"description": "Clearing old files before starting communication may increase bandwidth"
+			},
+			{
+				"type": "boolean",
+				"name": "Watch directory",
+				"defaultValue": true,
+				"description": "Track new files with change notifications instead of listing the whole directory on every receive"
+			},
+			{
+				"type": "uint16",
+				"name": "Batch interval",
+				"min": 0,
+				"defaultValue": 0,
+				"description": "Milliseconds for which outgoing packets are collected into one file. 0 writes every packet to a separate file"
 			}
 		]
 	},
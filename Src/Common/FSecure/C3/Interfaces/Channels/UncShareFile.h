@@ -1,5 +1,10 @@
 #pragma once
 
+#include <optional>
+#include <set>
+#include <atomic>
+#include "Common/FSecure/WinTools/DirectoryWatcher.h"
+
 namespace FSecure::C3::Interfaces::Channels
 {
 	/// Implementation of the FileSharing via UNC paths Channel.
@@ -18,8 +23,12 @@ namespace FSecure::C3::Interfaces::Channels
 		/// @returns size_t number of bytes successfully written.
 		size_t OnSendToChannel(ByteView blob);
 
-		/// Reads a single C3 packet from Channel.
-		/// @return packet retrieved from Channel.
+		/// Writes many packets to one batch file. Called when outbound batching is enabled.
+		/// @param frames packets to send to Channel.
+		void OnSendBatchToChannel(std::vector<ByteView> const& frames);
+
+		/// Reads C3 packets from Channel, oldest first, stopping after s_MaxReceiveBytes.
+		/// @return packets retrieved from Channel.
 		std::vector<ByteVector> OnReceiveFromChannel();
 
 		/// Get channel capability.
@@ -32,6 +41,50 @@ namespace FSecure::C3::Interfaces::Channels
 		ByteVector OnRunCommand(ByteView command) override;
 
 	protected:
+		/// Directory used by all Channels of the process that have the same path. It is listed or watched once for all of them, so that load of the share doesn't grow with number of Channels.
+		class Share
+		{
+		public:
+			/// Find share used by Channels of this process.
+			/// @param path path of the directory.
+			/// @return share, created if no Channel uses it yet.
+			static std::shared_ptr<Share> Get(std::filesystem::path const& path);
+
+			/// Create share. @see Get.
+			/// @param path path of the directory.
+			Share(std::filesystem::path path);
+
+			/// Track files with change notifications instead of listing the directory. Does nothing if directory is already watched.
+			/// @throws std::runtime_error if directory can't be watched, e.g. when share doesn't support change notifications.
+			void Watch();
+
+			/// Get files ready to be read by a Channel.
+			/// @param prefix inbound direction name of the Channel.
+			/// @param since directory is listed again if it wasn't listed since this time. Ignored while directory is watched.
+			/// @param onWatchFailure called with the reason if watching failed. Directory is listed from now on.
+			/// @returns paths of files, oldest first.
+			std::vector<std::filesystem::path> GetPackets(std::string const& prefix, std::chrono::steady_clock::time_point since, std::function<void(std::string const&)> const& onWatchFailure);
+
+			/// Remove a file from the index after it was read or turned out to be gone.
+			/// @param path path of the file.
+			void Forget(std::filesystem::path const& path);
+
+		private:
+			/// Fill the index by enumerating whole directory. Must be called with m_Mutex taken.
+			void RebuildIndex();
+
+			/// Update the index with changes reported by m_Watcher. Must be called with m_Mutex taken.
+			/// @param changes changes in order they happened.
+			void ApplyChanges(std::vector<WinTools::DirectoryWatcher::Change> const& changes);
+
+			std::mutex m_Mutex;																							///< Guards members below.
+			std::filesystem::path m_Path;																				///< Path of the directory.
+			std::unique_ptr<WinTools::DirectoryWatcher> m_Watcher;														///< Reports files created and removed in m_Path. Null if directory is listed when index gets older than a Channel's previous receive.
+			std::chrono::steady_clock::time_point m_IndexedAt;															///< Time when the last listing started.
+			std::vector<std::filesystem::path> m_IndexedPackets;														///< Names of packet files of all Channels, oldest first.
+			std::set<std::filesystem::path> m_LockedPackets;															///< Names of packet files which are still being written, because their lock files exist.
+		};
+
 		/// Removes all tasks from server.
 		void RemoveAllPackets();
 
@@ -40,14 +93,48 @@ namespace FSecure::C3::Interfaces::Channels
 		/// @returns true if channel instance should handle file, false otherwise.
 		bool BelongToChannel(std::filesystem::path const& path) const;
 
+		/// Check if file name starts with inbound direction name.
+		/// @param path to file to be checked.
+		/// @returns true if file is a packet or lock file sent to this channel.
+		bool IsInbound(std::filesystem::path const& path) const;
+
 		/// Removes file.
 		/// @param path to file to be removed.
 		void RemoveFile(std::filesystem::path const& path);
 
+		/// Reads file through a single handle that deletes it when closed.
+		/// @param path to file to be read.
+		/// @returns content of the file, or nothing if file was already taken by another reader.
+		std::optional<ByteVector> ReadAndRemoveFile(std::filesystem::path const& path);
+
+		/// Sorts packet files in order they were written, by their sequence numbers. No file is accessed.
+		/// @param packets paths or names of packet files.
+		static void SortPackets(std::vector<std::filesystem::path>& packets);
+
+		/// Writes data to a temporary file and renames it, so that the reader never sees a partial packet.
+		/// @param data content of the file.
+		/// @param extension appended to the name of the file.
+		void Publish(ByteView data, std::string const& extension);
+
+		/// Batch files are written before they grow above this size.
+		static constexpr size_t s_MaxBatchSize = 4 * 1024 * 1024;
+
 		/// Flow direction names.
 		std::string m_InboundDirectionName, m_OutboundDirectionName;
 
+		/// Put in names of written files after outbound direction name, so that files of different writers never collide.
+		std::string m_WriterId;
+
+		/// Put in names of written files after writer ID. Starts with the current time, so that files of a restarted writer are read after the old ones.
+		std::atomic<std::uint64_t> m_NextSequenceNumber;
+
 		/// Path of the directory to store the C2 messages.
 		std::filesystem::path m_FilesystemPath;
+
+		/// Index of m_FilesystemPath shared with other Channels using the same directory.
+		std::shared_ptr<Share> m_Share;
+
+		/// Start of the previous receive. Index of m_Share is refreshed if it is older, so that no receive sees a listing older than its predecessor did.
+		std::chrono::steady_clock::time_point m_LastReceive;
 	};
 }
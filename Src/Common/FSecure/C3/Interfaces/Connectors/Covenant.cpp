@@ -1,9 +1,12 @@
 #include "StdAfx.h"
+#include "Common/FSecure/Sockets/Socket.h"
+#include "Common/FSecure/Sockets/SocketReactor.h"
 #include "Common/FSecure/Sockets/SocketsException.h"
 #include "Common/json/json.hpp"
-#include "Common/CppRestSdk/include/cpprest/http_client.h"
+#include "Common/FSecure/CppTools/HttpClientPool.h"
 #include "Common/FSecure/Crypto/Base64.h"
 #include "Common/FSecure/CppTools/Compression.h"
+#include <future>
 
 using json = nlohmann::json;
 
@@ -59,33 +62,42 @@ namespace FSecure::C3::Interfaces::Connectors
 			/// @remarks throws FSecure::WinSocketsException on WinSockets error.
 			void Send(ByteView data);
 
-			/// Creates the receiving thread.
-			/// As long as connection is alive detached thread will pull available data Covenant.
-			void StartUpdatingInSeparateThread();
+			/// Registers connection in reactor of Covenant.
+			/// As long as connection is alive reactor will pull available data Covenant.
+			/// @param reactor reactor serving connections of Covenant.
+			void StartUpdating(SocketReactor& reactor);
 
 			/// Reads data from Socket.
 			/// @return heartbeat read data.
 			ByteVector Receive();
 
-			/// Indicates that receiving thread was already started.
-			/// @returns true if receiving thread was started, false otherwise.
-			bool SecondThreadStarted();
+			/// Indicates that connection is served by reactor.
+			/// @returns true if StartUpdating was called, false otherwise.
+			bool IsUpdating() const;
 
 		private:
+			/// Passes packet received from Covenant to Binder.
+			/// @param packet received data, as it was read from Socket.
+			void OnReceive(ByteVector packet);
+
+			/// Called by reactor when Bridge listener closed connection or it failed.
+			/// @param error exception that closed connection. Null if it was closed gracefully.
+			void OnClose(std::exception_ptr error);
+
 			/// Pointer to TeamServer instance.
 			std::weak_ptr<Covenant> m_Owner;
 
 			/// A socket object used in communication with the Bridge listener.
-			SOCKET m_Socket;
+			std::shared_ptr<ClientSocket> m_Socket;
 
 			/// RouteID in binary form. Address of beacon in network.
 			ByteVector m_Id;
 
-			/// Indicates that receiving thread was already started.
-			bool m_SecondThreadStarted = false;
+			/// Registration in reactor. Set when connection is served by reactor.
+			std::shared_ptr<SocketReactor::Registration> m_Registration;
 		};
 
-		/// Retrieves grunt payload from Covenant using the API.
+		/// Retrieves grunt payload from Covenant using the API. Launcher binary doesn't depend on the Grunt, so payloads are cached by their settings.
 		/// @param binderId address of beacon in network.
 		/// @param pipename name of pipe hosted by the SMB Grunt.
 		/// @param delay number of seconds for SMB grunt to block for
@@ -107,6 +119,22 @@ namespace FSecure::C3::Interfaces::Connectors
 		/// @return true if successful, otherwise WSAGetLastError might be called to retrieve specific error number.
 		static bool DeinitializeSockets();
 
+		/// Logs on to web API.
+		/// @return API token.
+		/// @throws std::exception if credentials are rejected.
+		std::string Logon();
+
+		/// Gets a valid API token, logging on again if the expired one is still in use.
+		/// @param expired token rejected by web API.
+		/// @return new token.
+		std::string RefreshToken(std::string const& expired);
+
+		/// Sends authorized request to web API without waiting for the response. If token has expired, logs on again and resends the request once.
+		/// @param path path of API endpoint.
+		/// @param makeRequest creates the request. Called again if request is resent.
+		/// @return task returning the response.
+		pplx::task<web::http::http_response> SendApiRequest(std::string const& path, std::function<web::http::http_request()> makeRequest);
+
 		/// IP Address of Bridge Listener.
 		std::string m_ListeningPostAddress;
 
@@ -125,12 +153,27 @@ namespace FSecure::C3::Interfaces::Connectors
 		///API token, generated on logon.
 		std::string m_token;
 
+		///Access mutex for m_token.
+		std::mutex m_TokenMutex;
+
+		///Covenant keeps one binary launcher, so setting its template and generating the payload can't be interleaved with other requests doing the same. Guards m_Payloads too.
+		std::mutex m_LauncherMutex;
+
+		///Generated payloads by pipe name, delay, jitter and connect attempts.
+		std::map<std::tuple<std::string, uint32_t, uint32_t, uint32_t>, FSecure::ByteVector> m_Payloads;
+
+		///Clients of web API, kept alive between requests.
+		HttpClientPool m_HttpClients;
+
 		///member for listener
 		int m_ListenerId;
 
 		/// Access mutex for m_ConnectionMap.
 		std::mutex m_ConnectionMapAccess;
 
+		/// Serves connections of all Grunts with one thread.
+		std::shared_ptr<SocketReactor> m_Reactor;
+
 		/// Access mutex for sending data to Covenant.
 		std::mutex  m_SendMutex;
 
@@ -143,23 +186,8 @@ namespace FSecure::C3::Interfaces::Connectors
 
 bool FSecure::C3::Interfaces::Connectors::Covenant::UpdateListenerId()
 {
-	std::string url = this->m_webHost + OBF("/api/listeners");
-	std::pair<std::string, uint16_t> data;
 	json response;
-
-	web::http::client::http_client_config config;
-	config.set_validate_certificates(false); //Covenant framework is unlikely to have a valid cert.
-
-	web::http::client::http_client webClient(utility::conversions::to_string_t(url), config);
-	web::http::http_request request;
-
-	request = web::http::http_request(web::http::methods::GET);
-
-	std::string authHeader = OBF("Bearer ") + this->m_token;
-	request.headers().add(OBF(L"Authorization"), utility::conversions::to_string_t(authHeader));
-	pplx::task<web::http::http_response> task = webClient.request(request);
-
-	web::http::http_response resp = task.get();
+	web::http::http_response resp = SendApiRequest(OBF("/api/listeners"), [] { return web::http::http_request(web::http::methods::GET); }).get();
 
 	if (resp.status_code() != web::http::status_codes::OK)
 		throw std::exception((OBF("[Covenant] Error getting Listeners, HTTP resp: ") + std::to_string(resp.status_code())).c_str());
@@ -186,54 +214,25 @@ bool FSecure::C3::Interfaces::Connectors::Covenant::UpdateListenerId()
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Connectors::Covenant::Covenant(ByteView arguments)
 {
-	json postData;
-	json response;
-
 	std::tie(m_ListeningPostPort, m_webHost, m_username, m_password) = arguments.Read<uint16_t, std::string, std::string, std::string>();
 
+	web::http::client::http_client_config config;
+	config.set_validate_certificates(false); //Covenant framework is unlikely to have a valid cert.
+	m_HttpClients = HttpClientPool{ config };
+
 	// if the last character is '/' remove it
 	if (this->m_webHost.back() == '/')
 		this->m_webHost.pop_back();
 
 
 	/***Authenticate to Web API ***/
-	std::string url = this->m_webHost + OBF("/api/users/login");
-
-	postData[OBF("username")] = this->m_username;
-	postData[OBF("password")] = this->m_password;
-
-	web::http::client::http_client_config config;
-	config.set_validate_certificates(false); //Covenant framework is unlikely to have a valid cert.
-
-	web::http::client::http_client webClient(utility::conversions::to_string_t(url), config);
-	web::http::http_request request;
-
-	request = web::http::http_request(web::http::methods::POST);
-	request.headers().set_content_type(utility::conversions::to_string_t(OBF("application/json")));
-	request.set_body(utility::conversions::to_string_t(postData.dump()));
-
-	pplx::task<web::http::http_response> task = webClient.request(request);
-	web::http::http_response resp = task.get();
-
-	if (resp.status_code() == web::http::status_codes::OK)
-	{
-		//Get the json response
-		auto respData = resp.extract_string();
-		response = json::parse(respData.get());
-	}
-	else
-		throw std::exception((OBF("[Covenant] Error authenticating to web app, HTTP resp: ") + std::to_string(resp.status_code())).c_str());
-
-	//Get the token to be used for all other requests.
-	if (response[OBF("success")])
-		this->m_token = response[OBF("covenantToken")].get<std::string>();
-	else
-		throw std::exception(OBF("[Covenant] Could not get token, invalid logon"));
+	this->m_token = Logon();
 
 	//If the listener doesn't already exist create it.
 	if (!UpdateListenerId())
 	{
 		//extract ip address from url
+		std::string url = this->m_webHost;
 		size_t start = 0, end = 0;
 		start = url.find("://") + 3;
 		end = url.find(":", start + 1);
@@ -244,21 +243,17 @@ FSecure::C3::Interfaces::Connectors::Covenant::Covenant(ByteView arguments)
 		this->m_ListeningPostAddress = url.substr(start, end - start);
 
 		///Create the bridge listener
-		url = this->m_webHost + OBF("/listener/createbridge");
-		web::http::client::http_client webClientBridge(utility::conversions::to_string_t(url), config);
-		request = web::http::http_request(web::http::methods::POST);
-		request.headers().set_content_type(utility::conversions::to_string_t(OBF("application/x-www-form-urlencoded")));
-
-		std::string authHeader = OBF("Bearer ") + this->m_token;
-		request.headers().add(OBF(L"Authorization"), utility::conversions::to_string_t(authHeader));
-
 		std::string createBridgeString = "Id=0&GUID=b85ea642f2&ListenerTypeId=2&Status=Active&CovenantToken=&Description=A+Bridge+for+custom+listeners.&Name=C3Bridge&BindAddress=0.0.0.0&BindPort=" + \
 			std::to_string(this->m_ListeningPostPort) + "&ConnectPort=" + std::to_string(this->m_ListeningPostPort) + "&ConnectAddresses%5B0%5D=" + \
 			this->m_ListeningPostAddress + "&ProfileId=3";
-		request.set_body(utility::conversions::to_string_t(createBridgeString));
 
-		task = webClientBridge.request(request);
-		resp = task.get();
+		auto resp = SendApiRequest(OBF("/listener/createbridge"), [&createBridgeString]
+		{
+			auto request = web::http::http_request(web::http::methods::POST);
+			request.headers().set_content_type(utility::conversions::to_string_t(OBF("application/x-www-form-urlencoded")));
+			request.set_body(utility::conversions::to_string_t(createBridgeString));
+			return request;
+		}).get();
 
 		if (resp.status_code() != web::http::status_codes::OK)
 			throw std::exception((OBF("[Covenant] Error setting up BridgeListener, HTTP resp: ") + std::to_string(resp.status_code())).c_str());
@@ -270,10 +265,12 @@ FSecure::C3::Interfaces::Connectors::Covenant::Covenant(ByteView arguments)
 	//Set the listening address to the C2-Bridge on localhost
 	this->m_ListeningPostAddress = "127.0.0.1";
 	InitializeSockets();
+	m_Reactor = SocketReactor::Create();
 }
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Connectors::Covenant::~Covenant()
 {
+	m_Reactor->Stop();
 	DeinitializeSockets();
 }
 
@@ -286,8 +283,8 @@ void FSecure::C3::Interfaces::Connectors::Covenant::OnCommandFromBinder(ByteView
 	if (it == m_ConnectionMap.end())
 		throw std::runtime_error{ OBF("Unknown connection") };
 
-	if (!(it->second->SecondThreadStarted()))
-		it->second->StartUpdatingInSeparateThread();
+	if (!it->second->IsUpdating())
+		it->second->StartUpdating(*m_Reactor);
 
 	it->second->Send(command);
 }
@@ -313,15 +310,8 @@ FSecure::ByteVector FSecure::C3::Interfaces::Connectors::Covenant::GeneratePaylo
 	if (binderId.empty() || pipename.empty())
 		throw std::runtime_error{ OBF("Wrong parameters, cannot create payload") };
 
-	std::string authHeader = OBF("Bearer ") + this->m_token;
-	std::string contentHeader = OBF("Content-Type: application/json");
 	std::string binary;
 
-	web::http::client::http_client_config config;
-	config.set_validate_certificates(false);
-	web::http::client::http_client webClient(utility::conversions::to_string_t(this->m_webHost + OBF("/api/launchers/binary")), config);
-	web::http::http_request request;
-
 	//The data to create an SMB Grunt
 	json postData;
 	postData[OBF("id")] = this->m_ListenerId;
@@ -335,40 +325,51 @@ FSecure::ByteVector FSecure::C3::Interfaces::Connectors::Covenant::GeneratePaylo
 	postData[OBF("jitterPercent")] = jitter;
 	postData[OBF("connectAttempts")] = connectAttempts;
 
-	//First we use a PUT to add our data as the template.
-	request = web::http::http_request(web::http::methods::PUT);
-	try
+	auto makeRequest = [body = utility::conversions::to_string_t(postData.dump())](web::http::method method)
 	{
+		auto request = web::http::http_request(method);
 		request.headers().set_content_type(utility::conversions::to_string_t("application/json"));
-		request.set_body(utility::conversions::to_string_t(postData.dump()));
-
-		request.headers().add(OBF(L"Authorization"), utility::conversions::to_string_t(authHeader));
-		pplx::task<web::http::http_response> task = webClient.request(request);
-		web::http::http_response resp = task.get();
+		request.set_body(body);
+		return request;
+	};
 
-		//If we get 200 OK, then we use a POST to request the generation of the payload. We can reuse the previous data here.
-		if (resp.status_code() == web::http::status_codes::OK)
+	try
+	{
+		//Connect to the Bridge listener while the payload is generated.
+		auto pendingConnection = std::async(std::launch::async, [this, binderId = std::string{ binderId }]
 		{
-			request.set_method(web::http::methods::POST);
-			task = webClient.request(request);
-			resp = task.get();
+			return std::make_shared<Connection>(m_ListeningPostAddress, m_ListeningPostPort, std::static_pointer_cast<Covenant>(shared_from_this()), binderId);
+		});
 
-			if (resp.status_code() == web::http::status_codes::OK)
+		FSecure::ByteVector payload;
+		{
+			std::scoped_lock<std::mutex> launcherLock(m_LauncherMutex);
+			auto settings = std::tuple{ pipename, delay, jitter, connectAttempts };
+			auto cached = m_Payloads.find(settings);
+			if (cached == m_Payloads.end())
 			{
+				//First we use a PUT to add our data as the template.
+				auto resp = SendApiRequest(OBF("/api/launchers/binary"), [&] { return makeRequest(web::http::methods::PUT); }).get();
+
+				//If we get 200 OK, then we use a POST to request the generation of the payload. We can reuse the previous data here.
+				if (resp.status_code() != web::http::status_codes::OK)
+					throw std::runtime_error(OBF("[Covenant] Non-200 HTTP code returned: ") + std::to_string(resp.status_code()));
+
+				resp = SendApiRequest(OBF("/api/launchers/binary"), [&] { return makeRequest(web::http::methods::POST); }).get();
+				if (resp.status_code() != web::http::status_codes::OK)
+					throw std::runtime_error(OBF("[Covenant] Non-200 HTTP code returned: ") + std::to_string(resp.status_code()));
+
 				auto respData = resp.extract_string();
-				json resp = json::parse(respData.get());
-				binary = resp[OBF("base64ILByteString")].get<std::string>(); //Contains the base64 encoded .NET assembly.
+				binary = json::parse(respData.get())[OBF("base64ILByteString")].get<std::string>(); //Contains the base64 encoded .NET assembly.
+				cached = m_Payloads.emplace(std::move(settings), cppcodec::base64_rfc4648::decode(binary)).first;
 			}
-			else
-				throw std::runtime_error(OBF("[Covenant] Non-200 HTTP code returned: ") + std::to_string(resp.status_code()));
-		}
-		else
-			throw std::runtime_error(OBF("[Covenant] Non-200 HTTP code returned: ") + std::to_string(resp.status_code()));
 
-		auto payload = cppcodec::base64_rfc4648::decode(binary);
+			payload = cached->second;
+		}
 
-		//Finally connect to the socket.
-		auto connection = std::make_shared<Connection>(m_ListeningPostAddress, m_ListeningPostPort, std::static_pointer_cast<Covenant>(shared_from_this()), binderId);
+		//Finally store the connection to the socket.
+		auto connection = pendingConnection.get();
+		std::scoped_lock<std::mutex> lock(m_ConnectionMapAccess);
 		m_ConnectionMap.emplace(std::string{ binderId }, std::move(connection));
 		return payload;
 	}
@@ -378,8 +379,64 @@ FSecure::ByteVector FSecure::C3::Interfaces::Connectors::Covenant::GeneratePaylo
 	}
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::C3::Interfaces::Connectors::Covenant::Logon()
+{
+	json postData;
+	postData[OBF("username")] = this->m_username;
+	postData[OBF("password")] = this->m_password;
+
+	web::http::http_request request(web::http::methods::POST);
+	request.headers().set_content_type(utility::conversions::to_string_t(OBF("application/json")));
+	request.set_body(utility::conversions::to_string_t(postData.dump()));
+
+	web::http::http_response resp = m_HttpClients.Request(this->m_webHost + OBF("/api/users/login"), request).get();
+	if (resp.status_code() != web::http::status_codes::OK)
+		throw std::exception((OBF("[Covenant] Error authenticating to web app, HTTP resp: ") + std::to_string(resp.status_code())).c_str());
+
+	//Get the token to be used for all other requests.
+	auto response = json::parse(resp.extract_string().get());
+	if (!response[OBF("success")])
+		throw std::exception(OBF("[Covenant] Could not get token, invalid logon"));
+
+	return response[OBF("covenantToken")].get<std::string>();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::C3::Interfaces::Connectors::Covenant::RefreshToken(std::string const& expired)
+{
+	//Requests rejected at the same time log on only once.
+	std::scoped_lock<std::mutex> lock(m_TokenMutex);
+	if (this->m_token == expired)
+		this->m_token = Logon();
+
+	return this->m_token;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+pplx::task<web::http::http_response> FSecure::C3::Interfaces::Connectors::Covenant::SendApiRequest(std::string const& path, std::function<web::http::http_request()> makeRequest)
+{
+	auto send = [this, url = this->m_webHost + path, makeRequest = std::move(makeRequest)](std::string const& token)
+	{
+		auto request = makeRequest();
+		request.headers().add(OBF(L"Authorization"), utility::conversions::to_string_t(OBF("Bearer ") + token));
+		return m_HttpClients.Request(url, request);
+	};
+
+	auto token = [this] { std::scoped_lock<std::mutex> lock(m_TokenMutex); return this->m_token; }();
+	return send(token).then([this, send, token](web::http::http_response resp)
+	{
+		if (resp.status_code() != web::http::status_codes::Unauthorized)
+			return pplx::task_from_result(resp);
+
+		return send(RefreshToken(token));
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Interfaces::Connectors::Covenant::CloseConnection(ByteView arguments)
 {
+	std::scoped_lock<std::mutex> lock(m_ConnectionMapAccess);
 	m_ConnectionMap.erase(arguments);
 	return {};
 }
@@ -460,34 +517,14 @@ const char* FSecure::C3::Interfaces::Connectors::Covenant::GetCapability()
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Connectors::Covenant::Connection::Connection(std::string_view listeningPostAddress, uint16_t listeningPostPort, std::weak_ptr<Covenant> owner, std::string_view id)
 	: m_Owner(owner)
+	, m_Socket(std::make_shared<ClientSocket>(listeningPostAddress, listeningPostPort))									//< C2Bridge frames are prefixed with big-endian length.
 	, m_Id(ByteView{ id })
 {
-
-	/*** Connect to C2Bridge ***/
-	sockaddr_in client;
-	client.sin_family = AF_INET;
-	client.sin_port = htons(listeningPostPort);
-	switch (InetPtonA(AF_INET, &listeningPostAddress.front(), &client.sin_addr.s_addr))									//< Mod to solve deprecation issue.
-	{
-	case 0:
-		throw std::invalid_argument(OBF("Provided Listening Post address in not a valid IPv4 dotted - decimal string or a valid IPv6 address."));
-	case -1:
-		throw FSecure::SocketsException(OBF("Couldn't convert standard text IPv4 or IPv6 address into its numeric binary form. Error code : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
-	}
-
-	// Attempt to connect.
-	if (INVALID_SOCKET == (m_Socket = socket(AF_INET, SOCK_STREAM, 0)))
-		throw FSecure::SocketsException(OBF("Couldn't create socket."), WSAGetLastError());
-
-	if (SOCKET_ERROR == connect(m_Socket, (struct sockaddr*) & client, sizeof(client)))
-		throw FSecure::SocketsException(OBF("Could not connect to ") + std::string{ listeningPostAddress } +OBF(":") + std::to_string(listeningPostPort) + OBF("."), WSAGetLastError());
-
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Connectors::Covenant::Connection::~Connection()
 {
-	closesocket(m_Socket);
 }
 
 
@@ -499,94 +536,84 @@ void FSecure::C3::Interfaces::Connectors::Covenant::Connection::Send(ByteView da
 		throw std::runtime_error(OBF("Could not lock pointer to owner "));
 
 	std::unique_lock<std::mutex> lock{ owner->m_SendMutex };
-
-	auto unpacked = Compression::Decompress<Compression::Deflate>(data);
-
-	//Format the length to match how it is read by Covenant.
-	DWORD length = static_cast<DWORD>(unpacked.size());
-	BYTE* bytes = (BYTE*)& length;
-	DWORD32 chunkLength = (bytes[0] << 24) + (bytes[1] << 16) + (bytes[2] << 8) + bytes[3];
-
-	// Write four bytes indicating the length of the next chunk of data.
-	if (SOCKET_ERROR == send(m_Socket, (char *)&chunkLength, 4, 0))
-		throw FSecure::SocketsException(OBF("Error sending to Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
-
-	// Write the chunk to socket.
-	send(m_Socket, (char *)&unpacked.front(), length, 0);
+	m_Socket->Send(Compression::Decompress<Compression::Deflate>(data));
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Interfaces::Connectors::Covenant::Connection::Receive()
 {
-	DWORD chunkLength = 0, bytesRead;
-	if (SOCKET_ERROR == (bytesRead = recv(m_Socket, reinterpret_cast<char*>(&chunkLength), 4, 0)))
-		throw FSecure::SocketsException(OBF("Error receiving from Socket : ") + std::to_string(WSAGetLastError()) + ("."), WSAGetLastError());
-
-	if (!bytesRead || !chunkLength)
+	auto buffer = m_Socket->Receive();
+	if (buffer.empty())
 		return {};																										//< The connection has been gracefully closed.
 
-	//Format the length to match how it is written by Covenant.
-	BYTE* bytes = (BYTE*)& chunkLength;
-	DWORD32 len = (bytes[0] << 24) + (bytes[1] << 16) + (bytes[2] << 8) + bytes[3];
+	return Compression::Compress<Compression::Deflate>(buffer);
+}
 
-	// Read in the result.
-	ByteVector buffer;
-	buffer.resize(len);
-	for (DWORD bytesReadTotal = 0; bytesReadTotal < len; bytesReadTotal += bytesRead)
-		switch (bytesRead = recv(m_Socket, reinterpret_cast<char*>(&buffer[bytesReadTotal]), len - bytesReadTotal, 0))
-		{
-		case 0:
-			return {};																									//< The connection has been gracefully closed.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Connectors::Covenant::Connection::StartUpdating(SocketReactor& reactor)
+{
+	// Callbacks don't keep connection alive. Reactor stops serving it when connection is removed from the map.
+	auto weak = weak_from_this();
+	m_Registration = reactor.Add(m_Socket,
+		[weak](ByteVector packet) { if (auto self = weak.lock()) self->OnReceive(std::move(packet)); },
+		[weak](std::exception_ptr error) { if (auto self = weak.lock()) self->OnClose(error); });
+}
 
-		case static_cast<DWORD>(SOCKET_ERROR):
-			throw FSecure::SocketsException(OBF("Error receiving from Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
-		}
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Connectors::Covenant::Connection::OnReceive(ByteVector packet)
+{
+	auto owner = m_Owner.lock();
+	if (!owner)
+		return;
 
-	return Compression::Compress<Compression::Deflate>(buffer);
+	auto bridge = owner->GetBridge();
+	try
+	{
+		// Post packet to Binder.
+		packet = Compression::Compress<Compression::Deflate>(packet);
+		if (packet.size() == 1u && packet[0] == 0u)
+			Send(packet);
+		else
+			bridge->PostCommandToBinder(ByteView{ m_Id }, packet);
+	}
+	catch (std::exception& e)
+	{
+		bridge->Log({ e.what(), LogMessage::Severity::Error });
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Interfaces::Connectors::Covenant::Connection::StartUpdatingInSeparateThread()
+void FSecure::C3::Interfaces::Connectors::Covenant::Connection::OnClose(std::exception_ptr error)
 {
-	m_SecondThreadStarted = true;
-	std::thread([this]()
-		{
-			// Lock pointers.
-			auto owner = m_Owner.lock();
-			auto bridge = owner->GetBridge();
-			auto self = shared_from_this();
-			while (bridge->IsAlive() && self.use_count() > 1)
-			{
-				try
-				{
-					// Read packet and post it to Binder.
-					if (auto packet = Receive(); !packet.empty())
-					{
-						if (packet.size() == 1u && packet[0] == 0u)
-							Send(packet);
-						else
-							bridge->PostCommandToBinder(ByteView{ m_Id }, packet);
-					}
-				}
-				catch (std::exception& e)
-				{
-					bridge->Log({ e.what(), LogMessage::Severity::Error });
-				}
-			}
-		}).detach();
+	auto owner = m_Owner.lock();
+	if (!owner)
+		return;
+
+	try
+	{
+		if (error)
+			std::rethrow_exception(error);
+
+		owner->GetBridge()->Log({ OBF("Covenant closed connection."), LogMessage::Severity::Warning });
+	}
+	catch (std::exception& e)
+	{
+		owner->GetBridge()->Log({ e.what(), LogMessage::Severity::Error });
+	}
 }
 
-bool FSecure::C3::Interfaces::Connectors::Covenant::Connection::SecondThreadStarted()
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Interfaces::Connectors::Covenant::Connection::IsUpdating() const
 {
-	return m_SecondThreadStarted;
+	return m_Registration != nullptr;
 }
 
 FSecure::ByteVector FSecure::C3::Interfaces::Connectors::Covenant::PeripheralCreationCommand(ByteView connectionId, ByteView data, bool isX64)
 {
-	auto [pipeName, delay, jitter, connectAttempts] = data.Read<std::string, uint32_t, uint32_t, uint32_t>();
+	auto [pipeName, delay, jitter, connectAttempts, isDuplex] = data.Read<std::string, uint32_t, uint32_t, uint32_t, uint8_t>();
 
 
-	return ByteVector{}.Write(pipeName, GeneratePayload(connectionId, pipeName, delay, jitter, connectAttempts), connectAttempts);
+	return ByteVector{}.Write(pipeName, GeneratePayload(connectionId, pipeName, delay, jitter, connectAttempts), connectAttempts, isDuplex);
 }
 
 
@@ -1,4 +1,5 @@
 #include "StdAfx.h"
+#include "Common/FSecure/C3/Interfaces/Peripherals/MockLoad.h"
 
 #ifdef _DEBUG
 
@@ -47,6 +48,15 @@ namespace FSecure::C3::Interfaces::Connectors
 		/// @returns ByteVector empty vector.
 		FSecure::ByteVector CloseConnection(ByteView connectionId) override;
 
+		/// Set load profile of all current and future connections.
+		/// @param arguments arguments of MockLoad::Configure.
+		/// @returns ByteVector empty vector.
+		ByteVector SetLoadProfile(ByteView arguments);
+
+		/// Log load statistics of every connection and reset them.
+		/// @returns ByteVector empty vector.
+		ByteVector LogLoadStatistics();
+
 		/// Represents a single connection with implant.
 		struct Connection : std::enable_shared_from_this<Connection>
 		{
@@ -56,9 +66,12 @@ namespace FSecure::C3::Interfaces::Connectors
 			Connection(std::weak_ptr<MockServer> owner, std::string_view id = ""sv);
 
 			/// Creates the receiving thread.
-			/// Thread will send packet every 3 seconds.
+			/// Thread will send packet every 3 seconds, or generate load if it is configured.
 			void StartUpdatingInSeparateThread();
 
+			/// Load generated on this connection.
+			MockLoad m_Load;
+
 		private:
 			/// Pointer to MockServer.
 			std::weak_ptr<MockServer> m_Owner;
@@ -72,6 +85,9 @@ namespace FSecure::C3::Interfaces::Connectors
 
 		/// Map of all connections.
 		std::unordered_map<std::string, std::shared_ptr<Connection>> m_ConnectionMap;
+
+		/// Last load profile, applied to new connections. Empty if none was set.
+		ByteVector m_LoadProfile;
 	};
 }
 
@@ -83,13 +99,30 @@ FSecure::C3::Interfaces::Connectors::MockServer::MockServer(ByteView)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Interfaces::Connectors::MockServer::OnCommandFromBinder(ByteView binderId, ByteView command)
 {
-	std::scoped_lock<std::mutex> lock(m_ConnectionMapAccess);
+	std::shared_ptr<Connection> connection;
+	{
+		std::scoped_lock<std::mutex> lock(m_ConnectionMapAccess);
+
+		auto it = m_ConnectionMap.find(binderId);
+		if (it == m_ConnectionMap.end())
+		{
+			it = m_ConnectionMap.emplace(binderId, std::make_unique<Connection>(std::static_pointer_cast<MockServer>(shared_from_this()), binderId)).first;
+			if (!m_LoadProfile.empty())
+				it->second->m_Load.Configure(m_LoadProfile);
+
+			it->second->StartUpdatingInSeparateThread();
+		}
 
-	auto it = m_ConnectionMap.find(binderId);
-	if (it == m_ConnectionMap.end())
+		connection = it->second;
+	}
+
+	// Load messages are answered without logging, not to flood the log.
+	if (auto reply = connection->m_Load.OnMessage(command); reply)
 	{
-		it = m_ConnectionMap.emplace(binderId, std::make_unique<Connection>(std::static_pointer_cast<MockServer>(shared_from_this()), binderId)).first;
-		it->second->StartUpdatingInSeparateThread();
+		if (!reply->empty())
+			GetBridge()->PostCommandToBinder(binderId, *reply);
+
+		return;
 	}
 
 	Log({ OBF("MockServer received: ") + std::string{ command.begin(), command.size() < 10 ? command.end() : command.begin() + 10 } + OBF("..."), LogMessage::Severity::DebugInformation });
@@ -113,6 +146,21 @@ void FSecure::C3::Interfaces::Connectors::MockServer::Connection::StartUpdatingI
 			auto self = shared_from_this();
 			while (bridge->IsAlive() && self.use_count() > 1)
 			{
+				// Generate load till next burst. Sleep is capped, so that changed profile is picked up soon.
+				if (m_Load.IsEnabled())
+				{
+					try
+					{
+						for (auto& message : m_Load.TakeDueMessages())
+							bridge->PostCommandToBinder(id, message);
+					}
+					catch (...)
+					{
+					}
+					std::this_thread::sleep_until(std::min(m_Load.GetNextBurstTime(), std::chrono::steady_clock::now() + 100ms));
+					continue;
+				}
+
 				// Post something to Binder and wait a little.
 				try
 				{
@@ -136,6 +184,10 @@ FSecure::ByteVector FSecure::C3::Interfaces::Connectors::MockServer::OnRunComman
 		return TestErrorCommand(command);
 	case 1:
 		return CloseConnection(command);
+	case 2:
+		return SetLoadProfile(command);
+	case 3:
+		return LogLoadStatistics();
 	default:
 		return AbstractConnector::OnRunCommand(commandCopy);
 	}
@@ -147,6 +199,30 @@ FSecure::ByteVector FSecure::C3::Interfaces::Connectors::MockServer::CloseConnec
 	return {};
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Interfaces::Connectors::MockServer::SetLoadProfile(ByteView arguments)
+{
+	// Validate before storing, so that a wrong profile doesn't reach new connections.
+	MockLoad{}.Configure(arguments);
+
+	std::scoped_lock<std::mutex> lock(m_ConnectionMapAccess);
+	m_LoadProfile = arguments;
+	for (auto& [id, connection] : m_ConnectionMap)
+		connection->m_Load.Configure(arguments);
+
+	return {};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Interfaces::Connectors::MockServer::LogLoadStatistics()
+{
+	std::scoped_lock<std::mutex> lock(m_ConnectionMapAccess);
+	for (auto& [id, connection] : m_ConnectionMap)
+		Log({ OBF("Connection ") + id + OBF(". ") + connection->m_Load.TakeStatistics(), LogMessage::Severity::Information });
+
+	return {};
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Interfaces::Connectors::MockServer::TestErrorCommand(ByteView arg)
 {
@@ -198,6 +274,51 @@ const char* FSecure::C3::Interfaces::Connectors::MockServer::GetCapability()
 					"description": "Id associated to beacon"
 				}
 			]
+		},
+		{
+			"name": "Set load profile",
+			"description": "Replace heart beat with generated load on all connections. Set rate to 0 to stop the load.",
+			"id": 2,
+			"arguments":
+			[
+				{
+					"type": "uint32",
+					"name": "Min size",
+					"defaultValue": 64,
+					"description": "Minimal size of message in bytes. Sizes are distributed uniformly between min and max."
+				},
+				{
+					"type": "uint32",
+					"name": "Max size",
+					"defaultValue": 1024,
+					"description": "Maximal size of message in bytes."
+				},
+				{
+					"type": "uint32",
+					"name": "Rate",
+					"defaultValue": 10,
+					"description": "Average number of messages per second on each connection."
+				},
+				{
+					"type": "uint16",
+					"name": "Burst size",
+					"min": 1,
+					"defaultValue": 1,
+					"description": "Number of messages sent at once. Bursts are spread to keep the average rate."
+				},
+				{
+					"type": "boolean",
+					"name": "Echo",
+					"defaultValue": true,
+					"description": "Ask Mock Peripherals to echo messages back to measure round trip and verify content."
+				}
+			]
+		},
+		{
+			"name": "Log load statistics",
+			"description": "Log messages counts, throughput and round trip of echoed messages of every connection since last statistics.",
+			"id": 3,
+			"arguments": []
 		}
     ]
 }
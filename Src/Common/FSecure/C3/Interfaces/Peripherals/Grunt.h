@@ -4,10 +4,12 @@
 +#warning("Compilation of Grunt peripheral is only supported with MSVC")
 #elif defined (_MSC_VER)
 
+#include <deque>
 #include <optional>
 #include <metahost.h>
 
 #include "Common/FSecure/WinTools/Pipe.h"
+#include "Common/FSecure/WinTools/ThreadpoolWait.h"
 
 /// Forward declaration of Connector associated with implant.
 /// Connectors implementation is only available on GateRelay, not NodeRelays.
@@ -24,6 +26,13 @@ namespace FSecure::C3::Interfaces::Peripherals
 		/// @param arguments view of arguments prepared by Connector.
 		Grunt(ByteView arguments);
 
+		/// Destructor. Stops serving duplex mode pipe.
+		virtual ~Grunt();
+
+		/// Starts serving duplex mode pipe.
+		/// @param bridge bridge to attach to.
+		void OnAttach(std::shared_ptr<AbstractDeviceBridge> const& bridge) override;
+
 		/// Sending callback implementation.
 		/// @param packet to send to the Implant.
 		void OnCommandFromConnector(ByteView packet) override;
@@ -41,12 +50,35 @@ namespace FSecure::C3::Interfaces::Peripherals
 		void Close() override;
 
 	private:
+		/// Called on a thread pool thread when a message from Grunt arrives in duplex mode. Posts it to Connector.
+		void OnGruntReadable();
+
+		/// Called on a thread pool thread when commands are queued in duplex mode. Writes them without waiting for Grunt's answers.
+		void OnCommandsQueued();
 
 		/// Object used to communicate with Grunt.
 		/// Optional is used to perform many trails of staging in constructor.
-		/// Must contain object if constructor call was successful.
+		/// Contains object if constructor call was successful and duplex mode is off.
 		std::optional<WinTools::AlternatingPipe> m_Pipe;
 
+		/// Object used to communicate with Grunt in duplex mode.
+		std::optional<WinTools::OverlappedPipe> m_DuplexPipe;
+
+		/// Commands from Connector waiting to be written in duplex mode.
+		std::deque<ByteVector> m_Commands;
+
+		/// Signaled while m_Commands is not empty.
+		WinTools::UniqueHandle m_CommandsEvent;
+
+		/// Waits for Grunt's messages in duplex mode on the system thread pool, so that many peripherals don't need a thread each.
+		WinTools::ThreadpoolWait m_ReadWait;
+
+		/// Waits for queued commands in duplex mode on the system thread pool.
+		WinTools::ThreadpoolWait m_WriteWait;
+
+		/// True if serving duplex mode pipe was started.
+		bool m_IsServing = false;
+
 		/// Used to synchronize access to underlying implant.
 		std::mutex m_Mutex;
 
@@ -13,6 +13,15 @@ FSecure::C3::Interfaces::Peripherals::Mock::Mock(ByteView)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Interfaces::Peripherals::Mock::OnCommandFromConnector(ByteView packet)
 {
+	// Load messages are answered without logging, not to flood the log.
+	if (auto reply = m_Load.OnMessage(packet); reply)
+	{
+		if (!reply->empty())
+			GetBridge()->PostCommandToConnector(*reply);
+
+		return;
+	}
+
 	// Construct a copy of received packet trimmed to 10 characters and add log it.
 	Log({ OBF("Mock received: ") + std::string{ packet.begin(), packet.size() < 10 ? packet.end() : packet.begin() + 10 } + OBF("..."), LogMessage::Severity::DebugInformation });
 }
@@ -20,6 +29,19 @@ void FSecure::C3::Interfaces::Peripherals::Mock::OnCommandFromConnector(ByteView
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Interfaces::Peripherals::Mock::OnReceiveFromPeripheral()
 {
+	// Whole burst is sent at once to keep its shape. Last message is returned as the Command of this update.
+	if (m_Load.IsEnabled())
+	{
+		auto messages = m_Load.TakeDueMessages();
+		if (messages.empty())
+			return {};
+
+		for (auto i = 0u; i + 1 < messages.size(); ++i)
+			GetBridge()->PostCommandToConnector(messages[i]);
+
+		return std::move(messages.back());
+	}
+
 	// Send heart beat every 5s.
 	if (m_NextMessageTime > std::chrono::high_resolution_clock::now())
 		return {};
@@ -35,6 +57,10 @@ FSecure::ByteVector FSecure::C3::Interfaces::Peripherals::Mock::OnRunCommand(Byt
 	{
 	case 0:
 		return TestErrorCommand(command);
+	case 1:
+		return SetLoadProfile(command);
+	case 2:
+		return LogLoadStatistics();
 	default:
 		return AbstractPeripheral::OnRunCommand(commandCopy);
 	}
@@ -46,6 +72,34 @@ FSecure::ByteVector FSecure::C3::Interfaces::Peripherals::Mock::TestErrorCommand
 	return {};
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Interfaces::Peripherals::Mock::SetLoadProfile(ByteView arg)
+{
+	m_Load.Configure(arg);
+	if (!m_Load.IsEnabled())
+	{
+		if (m_HeartBeatUpdateDelay)
+			SetUpdateDelay(*std::exchange(m_HeartBeatUpdateDelay, std::nullopt));
+
+		return LogLoadStatistics();
+	}
+
+	// Update often enough to start every burst on time.
+	if (!m_HeartBeatUpdateDelay)
+		m_HeartBeatUpdateDelay = GetUpdateDelay();
+
+	auto [minSize, maxSize, rate, burstSize] = arg.Read<uint32_t, uint32_t, uint32_t, uint16_t>();
+	SetUpdateDelay(std::clamp(std::chrono::milliseconds{ 1000 * burstSize / rate }, 1ms, 1000ms));
+	return {};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Interfaces::Peripherals::Mock::LogLoadStatistics()
+{
+	Log({ m_Load.TakeStatistics(), LogMessage::Severity::Information });
+	return {};
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 const char* FSecure::C3::Interfaces::Peripherals::Mock::GetCapability()
 {
@@ -68,6 +122,51 @@ const char* FSecure::C3::Interfaces::Peripherals::Mock::GetCapability()
 					"description": "Error set on connector. Send empty to clean up error"
 				}
 			]
+		},
+		{
+			"name": "Set load profile",
+			"description": "Replace heart beat with generated load. Set rate to 0 to stop the load and log its statistics.",
+			"id": 1,
+			"arguments":
+			[
+				{
+					"type": "uint32",
+					"name": "Min size",
+					"defaultValue": 64,
+					"description": "Minimal size of message in bytes. Sizes are distributed uniformly between min and max."
+				},
+				{
+					"type": "uint32",
+					"name": "Max size",
+					"defaultValue": 1024,
+					"description": "Maximal size of message in bytes."
+				},
+				{
+					"type": "uint32",
+					"name": "Rate",
+					"defaultValue": 10,
+					"description": "Average number of messages per second."
+				},
+				{
+					"type": "uint16",
+					"name": "Burst size",
+					"min": 1,
+					"defaultValue": 1,
+					"description": "Number of messages sent at once. Bursts are spread to keep the average rate."
+				},
+				{
+					"type": "boolean",
+					"name": "Echo",
+					"defaultValue": true,
+					"description": "Ask MockServer to echo messages back to measure round trip and verify content."
+				}
+			]
+		},
+		{
+			"name": "Log load statistics",
+			"description": "Log messages counts, throughput and round trip of echoed messages since last statistics.",
+			"id": 2,
+			"arguments": []
 		}
 	]
 }
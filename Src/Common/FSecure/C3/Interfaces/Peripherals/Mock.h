@@ -1,6 +1,7 @@
 #pragma once
 
 #ifdef _DEBUG
+#include "MockLoad.h"
 
 /// Forward declaration of Connector associated with implant.
 /// Connectors implementation is only available on GateRelay, not NodeRelays.
@@ -43,8 +44,23 @@ namespace FSecure::C3::Interfaces::Peripherals
 		/// @returns ByteVector response for command.
 		ByteVector TestErrorCommand(ByteView arg);
 
+		/// Set load profile. Heart beat is replaced with generated load until a profile with rate 0 is set.
+		/// @param arg arguments of MockLoad::Configure.
+		/// @returns ByteVector empty vector.
+		ByteVector SetLoadProfile(ByteView arg);
+
+		/// Log load statistics and reset them.
+		/// @returns ByteVector empty vector.
+		ByteVector LogLoadStatistics();
+
 		/// Used to delay receiving data from mock implementaion.
 		std::chrono::time_point<std::chrono::steady_clock> m_NextMessageTime;
+
+		/// Generated load.
+		MockLoad m_Load;
+
+		/// Update delay used before load was enabled.
+		std::optional<std::chrono::milliseconds> m_HeartBeatUpdateDelay;
 	};
 }
 #endif // _DEBUG
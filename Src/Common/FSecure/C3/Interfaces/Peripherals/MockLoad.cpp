@@ -0,0 +1,135 @@
+#include "StdAfx.h"
+#include "MockLoad.h"
+
+#ifdef _DEBUG
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::MockLoad::Configure(ByteView arguments)
+{
+	auto [minSize, maxSize, rate, burstSize, echo] = arguments.Read<uint32_t, uint32_t, uint32_t, uint16_t, bool>();
+	if (minSize > maxSize)
+		throw std::invalid_argument{ OBF("Minimal message size is greater than maximal one.") };
+
+	if (rate && !burstSize)
+		throw std::invalid_argument{ OBF("Burst size must be positive.") };
+
+	std::scoped_lock lock(m_Mutex);
+	m_MinSize = std::max<uint32_t>(minSize, s_HeaderSize);
+	m_MaxSize = std::max<uint32_t>(maxSize, s_HeaderSize);
+	m_Rate = rate;
+	m_BurstSize = burstSize;
+	m_Echo = echo;
+	m_NextBurst = std::chrono::steady_clock::now();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Interfaces::MockLoad::IsEnabled() const
+{
+	std::scoped_lock lock(m_Mutex);
+	return m_Rate != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::Interfaces::MockLoad::TakeDueMessages()
+{
+	std::scoped_lock lock(m_Mutex);
+	auto now = std::chrono::steady_clock::now();
+	if (!m_Rate || now < m_NextBurst)
+		return {};
+
+	// Bursts are spread so that average rate is kept. If sender fell behind more than a burst, the load is not caught up.
+	auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>{ static_cast<double>(m_BurstSize) / m_Rate });
+	m_NextBurst = std::max(m_NextBurst + period, now);
+
+	std::vector<ByteVector> messages;
+	messages.reserve(m_BurstSize);
+	for (auto i = 0u; i < m_BurstSize; ++i)
+		messages.push_back(MakeMessage());
+
+	return messages;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::steady_clock::time_point FSecure::C3::Interfaces::MockLoad::GetNextBurstTime() const
+{
+	std::scoped_lock lock(m_Mutex);
+	return m_NextBurst;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Interfaces::MockLoad::MakeMessage()
+{
+	// Padding content is derived from sequence number, so that echo can be verified without storing sent messages.
+	auto sequence = m_NextSequence++;
+	auto sentAt = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	auto message = ByteVector{}.Write(static_cast<uint8_t>(m_Echo ? Kind::EchoRequest : Kind::Plain), sequence, static_cast<uint64_t>(sentAt));
+	message.resize(FSecure::Utils::GenerateRandomValue(m_MinSize, m_MaxSize));
+	for (auto i = s_HeaderSize; i < message.size(); ++i)
+		message[i] = static_cast<uint8_t>(sequence + i);
+
+	++m_Sent;
+	return message;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ByteVector> FSecure::C3::Interfaces::MockLoad::OnMessage(ByteView message)
+{
+	if (message.size() < s_HeaderSize || message[0] < static_cast<uint8_t>(Kind::Plain) || message[0] > static_cast<uint8_t>(Kind::EchoReply))
+		return std::nullopt;
+
+	auto header = message;
+	auto [kind, sequence, sentAt] = header.Read<uint8_t, uint32_t, uint64_t>();
+
+	std::scoped_lock lock(m_Mutex);
+	++m_Received;
+	m_ReceivedBytes += message.size();
+	switch (static_cast<Kind>(kind))
+	{
+	case Kind::EchoRequest:
+	{
+		ByteVector reply{ message };
+		reply[0] = static_cast<uint8_t>(Kind::EchoReply);
+		return reply;
+	}
+
+	case Kind::EchoReply:
+	{
+		++m_Echoed;
+		for (auto i = s_HeaderSize; i < message.size(); ++i)
+			if (message[i] != static_cast<uint8_t>(sequence + i))
+			{
+				++m_Corrupted;
+				return ByteVector{};
+			}
+
+		auto now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch());
+		auto latency = now - std::chrono::microseconds{ sentAt };
+		m_LatencySum += latency;
+		m_LatencyMax = std::max(m_LatencyMax, latency);
+		return ByteVector{};
+	}
+
+	default:
+		return ByteVector{};
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::C3::Interfaces::MockLoad::TakeStatistics()
+{
+	std::scoped_lock lock(m_Mutex);
+	auto now = std::chrono::steady_clock::now();
+	auto seconds = std::max(std::chrono::duration<double>{ now - m_StatisticsSince }.count(), 0.001);
+	auto statistics = OBF_STR("Load in last ") + std::to_string(static_cast<uint64_t>(seconds)) + OBF("s: sent ") + std::to_string(m_Sent)
+		+ OBF(", received ") + std::to_string(m_Received) + OBF(" (") + std::to_string(static_cast<uint64_t>(m_ReceivedBytes / seconds)) + OBF(" B/s)")
+		+ OBF(", echoed ") + std::to_string(m_Echoed) + OBF(", corrupted ") + std::to_string(m_Corrupted);
+
+	if (auto verified = m_Echoed - m_Corrupted; verified)
+		statistics += OBF(", round trip avg ") + std::to_string(m_LatencySum.count() / verified / 1000) + OBF("ms, max ") + std::to_string(m_LatencyMax.count() / 1000) + OBF("ms");
+
+	m_Sent = m_Received = m_Echoed = m_Corrupted = m_ReceivedBytes = 0;
+	m_LatencySum = m_LatencyMax = {};
+	m_StatisticsSince = now;
+	return statistics + OBF(".");
+}
+#endif // _DEBUG
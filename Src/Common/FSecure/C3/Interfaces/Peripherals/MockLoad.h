@@ -0,0 +1,71 @@
+#pragma once
+
+#ifdef _DEBUG
+
+namespace FSecure::C3::Interfaces
+{
+	/// Load profile shared by MockServer and Mock Peripheral. Generates messages of random size at configured rate and measures round trip of echoed ones.
+	class MockLoad
+	{
+	public:
+		/// Message header size: [kind][sequence number][sending timestamp].
+		static constexpr size_t s_HeaderSize = sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint64_t);
+
+		/// Configure the profile.
+		/// @param arguments [min size][max size][messages per second][burst size][echo]. Rate of 0 disables the load.
+		/// @throws std::invalid_argument if arguments are inconsistent.
+		void Configure(ByteView arguments);
+
+		/// @return true if load is generated.
+		bool IsEnabled() const;
+
+		/// Get messages that should be sent till now.
+		/// @return messages to send. Empty if none is due.
+		std::vector<ByteVector> TakeDueMessages();
+
+		/// Get time of next burst.
+		/// @return time point, when TakeDueMessages returns messages again.
+		std::chrono::steady_clock::time_point GetNextBurstTime() const;
+
+		/// Handle a received message.
+		/// @param message received data.
+		/// @return reply that should be sent back. Empty if message didn't ask for an echo, std::nullopt if message wasn't generated by MockLoad.
+		std::optional<ByteVector> OnMessage(ByteView message);
+
+		/// Get human readable statistics and reset them.
+		/// @return statistics text.
+		std::string TakeStatistics();
+
+	private:
+		/// Kinds of generated messages.
+		enum class Kind : uint8_t
+		{
+			Plain = 0xA0,
+			EchoRequest,
+			EchoReply,
+		};
+
+		/// Generate a single message.
+		/// @return message of random size.
+		ByteVector MakeMessage();
+
+		mutable std::mutex m_Mutex;																						///< Guards all members.
+		uint32_t m_MinSize = 0;																							///< Minimal size of generated message.
+		uint32_t m_MaxSize = 0;																							///< Maximal size of generated message.
+		uint32_t m_Rate = 0;																							///< Messages per second. 0 if load is disabled.
+		uint16_t m_BurstSize = 1;																						///< Messages sent at once.
+		bool m_Echo = false;																							///< Whether generated messages ask for an echo.
+		std::chrono::steady_clock::time_point m_NextBurst;																///< Time of next burst.
+		uint32_t m_NextSequence = 0;																					///< Sequence number of next message.
+
+		uint64_t m_Sent = 0;																							///< Messages generated since last statistics.
+		uint64_t m_Received = 0;																						///< Load messages received since last statistics.
+		uint64_t m_Echoed = 0;																							///< Echo replies received since last statistics.
+		uint64_t m_Corrupted = 0;																						///< Echo replies which content didn't match.
+		uint64_t m_ReceivedBytes = 0;																					///< Size of received load messages.
+		std::chrono::microseconds m_LatencySum{};																		///< Sum of round trips of echo replies.
+		std::chrono::microseconds m_LatencyMax{};																		///< Longest round trip.
+		std::chrono::steady_clock::time_point m_StatisticsSince = std::chrono::steady_clock::now();						///< Beginning of statistics period.
+	};
+}
+#endif // _DEBUG
@@ -0,0 +1,106 @@
+#include "StdAfx.h"
+#include "AsyncChannel.h"
+
+/// State of AsyncReceiver.
+struct FSecure::C3::AsyncReceiver::State
+{
+	std::mutex m_Mutex;																									///< Guards members below.
+	bool m_IsStopped = false;																							///< Set by Stop.
+	std::uint64_t m_LastId = 0;																							///< Identifier of the last started receive.
+	bool m_IsInProgress = false;																						///< Set if receive m_LastId didn't complete yet.
+	std::vector<ByteVector> m_Packets;																					///< Packets received, but not taken yet.
+	std::exception_ptr m_Error;																							///< Failure of the last receive, not reported yet.
+	std::weak_ptr<AbstractDeviceBridge> m_Bridge;																		///< Bridge woken up by completions.
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::AsyncReceiver::Completion::Completion(std::shared_ptr<State> state, std::uint64_t id)
+	: m_State{ std::move(state) }
+	, m_Id{ id }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::AsyncReceiver::Completion::operator()(std::vector<ByteVector> packets) const
+{
+	std::shared_ptr<AbstractDeviceBridge> bridge;
+	{
+		std::scoped_lock lock(m_State->m_Mutex);
+		if (m_State->m_IsStopped || !m_State->m_IsInProgress || m_State->m_LastId != m_Id)
+			return;
+
+		m_State->m_IsInProgress = false;
+		if (packets.empty())
+			return;
+
+		std::move(packets.begin(), packets.end(), std::back_inserter(m_State->m_Packets));
+		bridge = m_State->m_Bridge.lock();
+	}
+
+	// Bridge is called outside of the lock, as it may update the Channel right away.
+	if (bridge)
+		bridge->RequestUpdate();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::AsyncReceiver::Completion::operator()(std::exception_ptr error) const
+{
+	// Failed receive is not retried before the next regular update, so that an unreachable backend isn't hammered.
+	std::scoped_lock lock(m_State->m_Mutex);
+	if (m_State->m_IsStopped || !m_State->m_IsInProgress || m_State->m_LastId != m_Id)
+		return;
+
+	m_State->m_IsInProgress = false;
+	m_State->m_Error = std::move(error);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::AsyncReceiver::AsyncReceiver()
+	: m_State{ std::make_shared<State>() }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::AsyncReceiver::~AsyncReceiver()
+{
+	Stop();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::AsyncReceiver::TakeAll(Begin const& begin, std::weak_ptr<AbstractDeviceBridge> bridge)
+{
+	std::optional<Completion> completion;
+	{
+		std::scoped_lock lock(m_State->m_Mutex);
+		m_State->m_Bridge = std::move(bridge);
+		if (!m_State->m_IsStopped && !m_State->m_IsInProgress)
+		{
+			m_State->m_IsInProgress = true;
+			completion = Completion{ m_State, ++m_State->m_LastId };
+		}
+	}
+
+	// Receive is started before packets are taken, so that packets stay for the next update if begin throws. Synchronous completion is taken right away.
+	if (completion)
+		try
+		{
+			begin(*completion);
+		}
+		catch (...)
+		{
+			(*completion)(std::current_exception());
+		}
+
+	std::scoped_lock lock(m_State->m_Mutex);
+	if (m_State->m_Packets.empty() && m_State->m_Error)
+		std::rethrow_exception(std::exchange(m_State->m_Error, nullptr));
+
+	return std::exchange(m_State->m_Packets, {});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::AsyncReceiver::Stop()
+{
+	std::scoped_lock lock(m_State->m_Mutex);
+	m_State->m_IsStopped = true;
+}
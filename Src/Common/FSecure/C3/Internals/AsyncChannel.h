@@ -0,0 +1,89 @@
+#pragma once
+
+#include "AutomaticRegistrator.h"
+
+namespace FSecure::C3
+{
+	/// Runs receives of Channels whose backends complete operations asynchronously, e.g. overlapped file reads or asynchronous HTTP requests, so that no thread waits for the backend.
+	/// Every update starts a receive, unless one is in progress, and takes packets of receives completed since the last update. Receive completed with packets brings the next update forward.
+	class AsyncReceiver
+	{
+		/// State shared with completions, which may outlive the receiver.
+		struct State;
+
+	public:
+		/// Finishes the receive it was passed to. Can be called from any thread, e.g. by a completion callback of the backend. Only the first call counts.
+		class Completion
+		{
+		public:
+			/// Report packets received by the operation.
+			/// @param packets packets in order of arrival, empty if backend had nothing to deliver.
+			void operator()(std::vector<ByteVector> packets) const;
+
+			/// Report failure of the operation.
+			/// @param error exception rethrown by the next update.
+			void operator()(std::exception_ptr error) const;
+
+		private:
+			friend class AsyncReceiver;
+
+			/// Private ctor. Completions are created by AsyncReceiver::TakeAll.
+			/// @param state state of the receiver.
+			/// @param id identifier of the receive.
+			Completion(std::shared_ptr<State> state, std::uint64_t id);
+
+			std::shared_ptr<State> m_State;																			///< State of the receiver.
+			std::uint64_t m_Id;																						///< Identifier of the receive.
+		};
+
+		/// Starts a receive. Must not wait for the backend, and must eventually call completion, e.g. after backend's timeout. Completion may be called before this function returns.
+		using Begin = std::function<void(Completion)>;
+
+		/// Public ctor.
+		AsyncReceiver();
+
+		/// Destructor. Ignores completion of the receive in progress.
+		~AsyncReceiver();
+
+		/// Start a receive, unless one is in progress, and take packets of completed receives.
+		/// @param begin function starting a receive.
+		/// @param bridge bridge whose update is brought forward when a receive completes with packets.
+		/// @return packets in order of arrival, empty if nothing arrived since the last call.
+		/// @throws exception thrown by begin, or reported by the last failed receive if no packets were received since then.
+		std::vector<ByteVector> TakeAll(Begin const& begin, std::weak_ptr<AbstractDeviceBridge> bridge);
+
+		/// Stop starting receives. Completion of the receive in progress is ignored, so Channel should cancel it at the backend.
+		void Stop();
+
+	private:
+		std::shared_ptr<State> m_State;																					///< State shared with completions.
+	};
+
+	namespace Interfaces
+	{
+		/// Base of Channels whose backends complete receives asynchronously. Updates only start receives and take what has already arrived, so many such Channels are multiplexed on the few Scheduler workers.
+		/// Types using AsyncChannel CRTP implement void OnReceiveFromChannelAsync(AsyncReceiver::Completion) instead of OnReceiveFromChannel.
+		/// They must call StopReceiving in their destructor and cancel the receive in progress, before members it uses are destroyed. Sends stay synchronous.
+		template <typename Iface>
+		class AsyncChannel : public Channel<Iface>
+		{
+		public:
+			/// Start a receive and take packets of receives completed since the last update. Never waits for the backend.
+			/// @return packets retrieved from Channel.
+			std::vector<ByteVector> OnReceiveFromChannel()
+			{
+				return m_AsyncReceiver.TakeAll([this](AsyncReceiver::Completion completion) { static_cast<Iface*>(this)->OnReceiveFromChannelAsync(std::move(completion)); }, this->GetBridge());
+			}
+
+		protected:
+			/// Stop starting receives. @see AsyncReceiver::Stop.
+			void StopReceiving()
+			{
+				m_AsyncReceiver.Stop();
+			}
+
+		private:
+			AsyncReceiver m_AsyncReceiver;																			///< Starts receives and collects their packets.
+		};
+	}
+}
@@ -101,6 +101,10 @@ namespace FSecure::C3
 			constexpr static std::chrono::milliseconds s_MinUpdateDelay = 30ms;
 			constexpr static std::chrono::milliseconds s_MaxUpdateDelay = 30ms;
 
+			/// Channels that can return many packets at once stop reading once they got this many bytes, and leave the rest for next updates. That way a backlog doesn't hold the update thread and isn't read into memory all at once.
+			/// Types using Channel CRTP may hide it with their own value. At least one packet is read on every update.
+			constexpr static size_t s_MaxReceiveBytes = 4 * 1024 * 1024;
+
 			/// Constructor setting default update frequency for channel
 			Channel()
 			{
@@ -131,6 +135,23 @@ namespace FSecure::C3
 				return self->OnSendToChannel(packet);
 			}
 
+			/// Called with frames collected by outbound batching.
+			/// Types using Channel CRTP that enable batching may implement void OnSendBatchToChannel(std::vector<ByteView> const&), which sends all frames or throws. Otherwise frames are sent one by one.
+			/// @param frames frames to send, oldest first.
+			/// @return number of frames sent.
+			size_t OnSendBatchToChannelInternal(std::vector<ByteView> const& frames) override final
+			{
+				if constexpr (CanSendBatch<std::vector<ByteView> const&>::value)
+				{
+					static_cast<Iface*>(this)->OnSendBatchToChannel(frames);
+					return frames.size();
+				}
+				else
+				{
+					return AbstractChannel::OnSendBatchToChannelInternal(frames);
+				}
+			}
+
 		private:
 			/// Alias to get result of OnReceiveFromChannel call.
 			/// Use in form ReceiveReturnType<Iface> to obtain type.
@@ -154,6 +175,14 @@ namespace FSecure::C3
 			template<class...Ts>
 			using CanSend = FSecure::Utils::CanApply<SendReturnType, Iface, Ts...>;
 
+			/// Alias to get result of OnSendBatchToChannel call.
+			template<class T, class...Ts>
+			using SendBatchReturnType = decltype(std::declval<T>().OnSendBatchToChannel(std::declval<Ts>()...));
+
+			/// Alias to test if OnSendBatchToChannel is implemented.
+			template<class...Ts>
+			using CanSendBatch = FSecure::Utils::CanApply<SendBatchReturnType, Iface, Ts...>;
+
 			/// Virtual OnSendToChannelInternal cannot be templated.
 			/// This function will be available for call if OnReceiveFromChannel returns ByteVector.
 			/// @returns std::vector<ByteVector> one packet pushed on collection if it is not empty..
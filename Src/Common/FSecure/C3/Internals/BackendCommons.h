@@ -48,6 +48,19 @@ namespace FSecure::C3
 		SetGRC = static_cast<std::uint16_t>(-5),
 		Ping = static_cast<std::uint16_t>(-6),
 		ClearNetwork = static_cast<std::uint16_t>(-7),
+		SetCommandTracing = static_cast<std::uint16_t>(-8),
+		SetMulticast = static_cast<std::uint16_t>(-9),
+		AddGRC = static_cast<std::uint16_t>(-10),
+		SetStriping = static_cast<std::uint16_t>(-11),
+		SetIdleTrimming = static_cast<std::uint16_t>(-12),
+		SetSpool = static_cast<std::uint16_t>(-13),
+		SetAggregation = static_cast<std::uint16_t>(-14),
+		SetCutThrough = static_cast<std::uint16_t>(-15),
+		SetRoutePreference = static_cast<std::uint16_t>(-16),
+		AddDeviceFromCache = static_cast<std::uint16_t>(-17),
+		SetCapture = static_cast<std::uint16_t>(-18),
+		SetCompoundCommands = static_cast<std::uint16_t>(-19),
+		SetResumptionToken = static_cast<std::uint16_t>(-20),
 	};
 
 	namespace Utils
@@ -64,9 +77,26 @@ namespace FSecure::C3
 		std::shared_ptr<Relay> CreateGatewayFromConfigurationFiles(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, std::filesystem::path const& keysFileName, std::filesystem::path const& configurationFileName);
 
 		/// Creates and starts a NodeRelay in a background thread.
-		/// @param callbackOnLog callback fired whenever a new Log entry is being added.
+		/// @param callbackOnLog callback fired whenever a new Log entry is being added. Pass null to disable logging, so that messages are not even built.
+		/// @param interfaceFactory reference to interface factory.
+		/// @param deviceWorkerThreads number of threads updating Channels. If 0, every Device is updated in its own thread.
+		std::shared_ptr<Relay> CreateNodeRelayFromImagePatch(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, ByteView buildId, ByteView gatewaySignature, ByteView broadcastKey, std::vector<ByteVector> const& gatewayInitialPackets, std::size_t deviceWorkerThreads = 4);
+
+		/// Creates and starts many NodeRelays of the same build, each with its own Agent ID and keys, e.g. to load a Gateway with virtual agents.
+		/// Relays share the threads updating Channels and creating Devices. Peripherals still get a thread each. Relays are started one after another, a Relay that fails to start is logged and skipped.
+		/// @param callbackOnLog callback fired whenever a new Log entry is being added. Pass null to disable logging, so that messages are not even built.
 		/// @param interfaceFactory reference to interface factory.
-		std::shared_ptr<Relay> CreateNodeRelayFromImagePatch(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, ByteView buildId, ByteView gatewaySignature, ByteView broadcastKey, std::vector<ByteVector> const& gatewayInitialPackets);
+		/// @param relayCount number of Relays to start.
+		/// @param deviceWorkerThreads number of threads updating Channels of all Relays. If 0, every Device is updated in its own thread.
+		/// @return started Relays.
+		std::vector<std::shared_ptr<Relay>> CreateNodeRelaySwarmFromImagePatch(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, ByteView buildId, ByteView gatewaySignature, ByteView broadcastKey,
+			std::vector<ByteVector> const& gatewayInitialPackets, std::size_t relayCount, std::size_t deviceWorkerThreads = 4);
+
+		/// Hosts a Connector if program was started by a Gateway running Connectors out of process.
+		/// @param argc number of program arguments.
+		/// @param argv vector of program arguments.
+		/// @return true if program was started as a Connector host and the Connector has finished, false if program should run normally.
+		bool RunConnectorHostIfRequested(int argc, char* argv[]);
 
 		/// Converts Relay's Log entry into single line of text, ready to be printed e.g. on console screen.
 		/// @param relayName name of the Relay.
@@ -98,14 +128,27 @@ namespace FSecure::C3
 		/// @param packet full C3 packet.
 		virtual void PassNetworkPacket(ByteView packet) = 0;
 
+		/// Fired by Channel when several C3 packets arrive at once.
+		/// @param packets full C3 packets in order of arrival.
+		virtual void PassNetworkPackets(std::vector<ByteVector> const& packets) = 0;
+
 		/// Fired by Relay to pass provided C3 packet through the Channel Device.
 		/// @param packet full C3 packet.
 		virtual void OnPassNetworkPacket(ByteView packet) = 0;
 
+		/// Called by Device, from any thread, when it has something to deliver, e.g. when an asynchronous receive completes. Next update happens as soon as possible.
+		virtual void RequestUpdate() = 0;
+
 		/// Called whenever Peripheral wants to send a Command to its Connector Binder.
 		/// @param command full Command with arguments.
 		virtual void PostCommandToConnector(ByteView command) = 0;
 
+		/// Called whenever Peripheral streams a long Command to its Connector Binder in parts. Connector receives the Command once all parts arrived.
+		/// @param segment part of the Command. Segments must be posted in order, starting at offset 0.
+		/// @param commandSize size of the whole Command.
+		/// @param offset position of segment in the Command.
+		virtual void PostCommandSegmentToConnector(ByteView segment, std::uint32_t commandSize, std::uint32_t offset) = 0;
+
 		/// Fired by Relay to pass by provided Command from Connector.
 		/// @param command full Command with arguments.
 		virtual void OnCommandFromConnector(ByteView command) = 0;
@@ -156,6 +199,11 @@ namespace FSecure::C3
 		/// @param command full Command with arguments.
 		virtual void PostCommandToBinder(ByteView binderId, ByteView command) = 0;
 
+		/// Checks whether Commands can be posted to a Binder without waiting for slow Channels on the Route. Connectors should stop reading Commands for the Binder until it returns true again.
+		/// @param binderId Identifier of Peripheral that receives the Commands.
+		/// @return true if Route to the Binder has credits.
+		virtual bool CanPostCommandToBinder(ByteView binderId) = 0;
+
 		/// Fired by Relay to pass by provided Command from Binder Peripheral.
 		/// @param binderId Identifier of Peripheral who sends the Command.
 		/// @param command full Command with arguments.
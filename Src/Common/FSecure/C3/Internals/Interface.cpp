@@ -5,16 +5,56 @@
 void FSecure::C3::AbstractPeripheral::OnReceive()
 {
 	if (auto bridge = GetBridge(); bridge)
-		if (auto command = OnReceiveFromPeripheral(); !command.empty())
-			bridge->PostCommandToConnector(command);
+	{
+		auto command = OnReceiveFromPeripheral();
+		if (command.empty())
+			return OnIdleUpdate();
+
+		OnTraffic();
+		bridge->PostCommandToConnector(command);
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::AbstractChannel::OnReceive()
 {
 	if (auto bridge = GetBridge(); bridge)
-		for (auto&& packet : OnReceiveFromChannelInternal())
-			bridge->PassNetworkPacket(packet);
+	{
+		auto packets = OnReceiveFromChannelInternal();
+		if (packets.empty())
+			return OnIdleUpdate();
+
+		// Frames hold ciphertext, which needs no zeroing when released.
+		for (auto& packet : packets)
+			packet.SetSensitive(false);
+
+		OnTraffic();
+		bridge->PassNetworkPackets(packets);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::C3::Device::BatchingSettings> FSecure::C3::AbstractChannel::GetBatchingSettings() const
+{
+	std::lock_guard<std::mutex> guard(m_BatchingMutex);
+	return m_Batching;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::AbstractChannel::EnableOutboundBatching(std::chrono::milliseconds linger, size_t maxBatchSize)
+{
+	std::lock_guard<std::mutex> guard(m_BatchingMutex);
+	m_Batching = BatchingSettings{ linger, maxBatchSize };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Device::OnSendBatchToChannelInternal(std::vector<ByteView> const& frames)
+{
+	for (size_t i = 0; i < frames.size(); ++i)
+		if (OnSendToChannelInternal(frames[i]) != frames[i].size())
+			return i;
+
+	return frames.size();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -29,6 +69,7 @@ void FSecure::C3::Device::SetUpdateDelay(std::chrono::milliseconds minUpdateDela
 	std::lock_guard<std::mutex> guard(m_UpdateDelayMutex);
 	m_MinUpdateDelay = minUpdateDelayInMs;
 	m_MaxUpdateDelay = maxUpdateDelayInMs;
+	m_AdaptiveUpdateDelay = m_MaxUpdateDelay;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -37,13 +78,60 @@ void FSecure::C3::Device::SetUpdateDelay(std::chrono::milliseconds frequencyInMs
 	std::lock_guard<std::mutex> guard(m_UpdateDelayMutex);
 	m_MinUpdateDelay = frequencyInMs;
 	m_MaxUpdateDelay = m_MinUpdateDelay;
+	m_AdaptiveUpdateDelay = m_MaxUpdateDelay;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::chrono::milliseconds FSecure::C3::Device::GetUpdateDelay() const
 {
 	std::lock_guard<std::mutex> guard(m_UpdateDelayMutex);
-	return m_MinUpdateDelay != m_MaxUpdateDelay ? FSecure::Utils::GenerateRandomValue(m_MinUpdateDelay, m_MaxUpdateDelay) : m_MinUpdateDelay;
+	if (m_MinUpdateDelay == m_MaxUpdateDelay || (m_ResponseWindow.count() && std::chrono::steady_clock::now() < m_ResponseDeadline))
+		return m_MinUpdateDelay;
+
+	if (!m_IsUpdateDelayAdaptive)
+		return FSecure::Utils::GenerateRandomValue(m_MinUpdateDelay, m_MaxUpdateDelay);
+
+	// Upper half of the current range, so that delay is still random but follows the traffic.
+	return FSecure::Utils::GenerateRandomValue(std::max(m_MinUpdateDelay, m_AdaptiveUpdateDelay / 2), m_AdaptiveUpdateDelay);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Device::SetAdaptiveUpdateDelay(bool isAdaptive)
+{
+	std::lock_guard<std::mutex> guard(m_UpdateDelayMutex);
+	m_IsUpdateDelayAdaptive = isAdaptive;
+	m_AdaptiveUpdateDelay = m_MaxUpdateDelay;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Device::SetResponseWindow(std::chrono::milliseconds window)
+{
+	std::lock_guard<std::mutex> guard(m_UpdateDelayMutex);
+	m_ResponseWindow = window;
+	m_ResponseDeadline = {};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::milliseconds FSecure::C3::Device::GetResponseWindow() const
+{
+	std::lock_guard<std::mutex> guard(m_UpdateDelayMutex);
+	return m_ResponseWindow;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Device::OnTraffic()
+{
+	std::lock_guard<std::mutex> guard(m_UpdateDelayMutex);
+	m_AdaptiveUpdateDelay = std::min(m_MaxUpdateDelay, 2 * m_MinUpdateDelay);
+	if (m_ResponseWindow.count())
+		m_ResponseDeadline = std::chrono::steady_clock::now() + m_ResponseWindow;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Device::OnIdleUpdate()
+{
+	std::lock_guard<std::mutex> guard(m_UpdateDelayMutex);
+	m_AdaptiveUpdateDelay = std::min(m_MaxUpdateDelay, 2 * m_AdaptiveUpdateDelay);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -56,7 +144,11 @@ FSecure::ByteVector FSecure::C3::Device::OnRunCommand(ByteView command)
 	case static_cast<uint16_t>(FSecure::C3::Command::UpdateJitter) :
 	{
 		auto [minVal, maxVal] = command.Read<float, float>();
-		return SetUpdateDelay(FSecure::Utils::ToMilliseconds(minVal), FSecure::Utils::ToMilliseconds(maxVal)), ByteVector{};
+		SetUpdateDelay(FSecure::Utils::ToMilliseconds(minVal), FSecure::Utils::ToMilliseconds(maxVal));
+
+		// Older Controllers don't send adaptive flag and response window.
+		SetAdaptiveUpdateDelay(!command.empty() && command.Read<uint8_t>());
+		return SetResponseWindow(command.empty() ? 0ms : FSecure::Utils::ToMilliseconds(command.Read<float>())), ByteVector{};
 	}
 	default:
 		throw std::runtime_error(OBF("Device received an unknown command"));
@@ -48,6 +48,39 @@ namespace FSecure::C3
 		/// @remarks this method is used only to pass internal (C3) packets through the C3 network, thus it won't be called for any other types of Devices than Channels.
 		virtual size_t  OnSendToChannelInternal(ByteView packet) = 0;
 
+		/// Called when DeviceBridge sends frames collected by outbound batching. By default sends them one by one with OnSendToChannelInternal.
+		/// @param frames frames to send, oldest first. Each of them must be sent whole.
+		/// @return number of frames sent, counting from the first one. Frames that were not sent are passed again with the next batch.
+		virtual size_t OnSendBatchToChannelInternal(std::vector<ByteView> const& frames);
+
+		/// Settings of outbound batching. @see AbstractChannel::EnableOutboundBatching.
+		struct BatchingSettings
+		{
+			std::chrono::milliseconds m_Linger;																			///< Time for which DeviceBridge collects frames before sending them together.
+			size_t m_MaxBatchSize;																						///< Number of collected bytes that are sent right away. Also the size limit of a single frame.
+		};
+
+		/// Tells whether DeviceBridge should collect outbound frames and pass them to OnSendBatchToChannelInternal together.
+		/// @return batching settings, or nothing if every frame should be sent right away.
+		virtual std::optional<BatchingSettings> GetBatchingSettings() const { return {}; }
+
+		/// Tells the largest frame Channel accepts in one OnSendToChannelInternal call, if it is known up front.
+		/// DeviceBridge splits packets into frames of that size, instead of learning it from partial sends. Negotiation packets bigger than that are rejected before they are sent.
+		/// @return maximum frame size in bytes, or nothing if Channel doesn't know it.
+		virtual std::optional<size_t> GetMaxFrameSize() const { return {}; }
+
+		/// Delivery guarantees of a Channel. @see GetDeliveryGuarantees.
+		struct DeliveryGuarantees
+		{
+			bool m_IsReliable = false;																				///< Every frame accepted by OnSendToChannelInternal arrives whole and exactly once.
+			bool m_IsOrdered = false;																				///< Frames arrive in order they were sent.
+		};
+
+		/// Tells what Channel guarantees about delivery of frames. Both sides of the Channel must tell the same.
+		/// Reliable and ordered Channels that don't declare GetMaxFrameSize are used without QoS: every packet is sent in one frame, without header, chunking and reassembly.
+		/// @return delivery guarantees. By default none.
+		virtual DeliveryGuarantees GetDeliveryGuarantees() const { return {}; }
+
 		/// Fired by Relay to pass by provided Command from Connector.
 		/// @param command full Command with arguments.
 		virtual void OnCommandFromConnector(ByteView command) = 0;
@@ -66,8 +99,26 @@ namespace FSecure::C3
 		virtual void SetUpdateDelay(std::chrono::milliseconds frequencyInMs);
 
 		/// Gets update frequency. If min and max variables have different values then generates random value in their range.
+		/// In adaptive mode the range shrinks towards min while there is traffic and grows back towards max when Device is idle.
 		virtual std::chrono::milliseconds GetUpdateDelay() const;
 
+		/// Turns adaptive update delay on or off. @see GetUpdateDelay.
+		/// @param isAdaptive true to poll faster while there is traffic.
+		virtual void SetAdaptiveUpdateDelay(bool isAdaptive);
+
+		/// Turns response expected mode on or off. For a while after each sent packet Device is updated at minimal delay, so that replies to interactive tasking don't wait for a full jitter interval.
+		/// @param window time after a send during which updates happen at minimal delay. Zero turns the mode off.
+		virtual void SetResponseWindow(std::chrono::milliseconds window);
+
+		/// Gets time after a send during which updates happen at minimal delay. @see SetResponseWindow.
+		std::chrono::milliseconds GetResponseWindow() const;
+
+		/// Tells adaptive update delay that packets passed through the Device. Next updates will happen close to minimal delay. Opens response window, if it is set.
+		void OnTraffic();
+
+		/// Tells adaptive update delay that an update found nothing to do. Delay grows exponentially towards maximal one.
+		void OnIdleUpdate();
+
 		/// Processes internal (C3 API) Command.
 		/// @param command a buffer containing whole command and it's parameters.
 		/// @return command result.
@@ -79,6 +130,10 @@ namespace FSecure::C3
 
 		mutable std::mutex m_UpdateDelayMutex;																		///< Mutex to synchronize changes in frequency update members.
 		std::chrono::milliseconds m_MinUpdateDelay, m_MaxUpdateDelay;											///< Receive loop moderator (if m_MaxUpdateDelayJitter != m_MinUpdateDelay. then update frequency is randomized in range between those values).
+		bool m_IsUpdateDelayAdaptive = false;																			///< Adaptive update delay mode. @see GetUpdateDelay.
+		std::chrono::milliseconds m_AdaptiveUpdateDelay{};																///< Upper bound of next update delay in adaptive mode.
+		std::chrono::milliseconds m_ResponseWindow{};																	///< Response expected mode. @see SetResponseWindow.
+		std::chrono::steady_clock::time_point m_ResponseDeadline;														///< End of the current response window.
 	};
 
 	/// An abstract structure representing all Channels.
@@ -91,10 +146,24 @@ namespace FSecure::C3
 		/// Tells that this Device type is a Channel.
 		bool IsChannel() const override { return true; }
 
+		/// Tells whether DeviceBridge should collect outbound frames. @see Device::GetBatchingSettings.
+		/// @return settings passed to EnableOutboundBatching, or nothing if it was not called.
+		std::optional<BatchingSettings> GetBatchingSettings() const override;
+
+	protected:
+		/// Make DeviceBridge collect outbound frames and pass them to OnSendBatchToChannelInternal together.
+		/// Frames are sent when linger time passes after the first one was collected, or right away if they exceed maxBatchSize. Channel must accept whole frames.
+		/// @param linger time for which frames are collected.
+		/// @param maxBatchSize number of bytes that are sent right away. Longer packets are split into frames of this size.
+		void EnableOutboundBatching(std::chrono::milliseconds linger, size_t maxBatchSize);
+
 	private:
 		/// Callback periodically fired by Relay for Device to update itself. Might be called from a separate thread. The Device should perform all necessary actions and leave as soon as possible.
 		void OnReceive() override final;
 
+		mutable std::mutex m_BatchingMutex;																				///< Guards m_Batching.
+		std::optional<BatchingSettings> m_Batching;																		///< Set by EnableOutboundBatching.
+
 		/// Fired by Relay to pass by provided Command from Connector, which is illegal for Channels (and that's why this method unconditionally throws std::logic_error).
 		/// @throw This method unconditionally throws std::logic_error.
 		void OnCommandFromConnector(ByteView) override final
@@ -110,6 +179,9 @@ namespace FSecure::C3
 		/// @return ByteVector that contains a single Command retrieved from Peripheral.
 		virtual ByteVector OnReceiveFromPeripheral() = 0;
 
+		/// Longer Commands are streamed to Connector in segments of this size. @see AbstractDeviceBridge::PostCommandSegmentToConnector.
+		static constexpr size_t s_MaxCommandSegmentSize = 1024 * 1024;
+
 	private:
 		/// Callback periodically fired by Relay for Device to update itself. Might be called from a separate thread. The Device should perform all necessary actions and leave as soon as possible.
 		void OnReceive() override final;
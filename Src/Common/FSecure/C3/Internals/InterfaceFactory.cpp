@@ -13,6 +13,16 @@ FSecure::C3::InterfaceFactory& FSecure::C3::InterfaceFactory::Instance()
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::string FSecure::C3::InterfaceFactory::GetCapability()
+{
+	std::lock_guard lock{ m_CapabilityMutex };
+	if (!m_Capability)
+		m_Capability = BuildCapability();
+
+	return *m_Capability;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::C3::InterfaceFactory::BuildCapability()
 {
 	json retValue;
 	auto populate = [&](auto* typePtr, std::string name)
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <optional>
+
 #include "Common/FSecure/CppTools/Hash.h"
 #include "Interface.h"
 
@@ -33,7 +35,23 @@ namespace FSecure::C3
 		template <typename T>
 		bool Register(HashT hash, InterfaceData<T> data)
 		{
-			return GetMap<T>().emplace(hash, std::move(data)).second; // second of pair of iterator and emplace result.
+			auto [it, isInserted] = GetMap<T>().emplace(hash, std::move(data));
+			if (!isInserted)
+				return false;
+
+			// Map nodes are never erased, so the index can refer to names stored in them.
+			GetNameIndex<T>().emplace(it->second.m_Name, hash);
+			std::lock_guard lock{ m_CapabilityMutex };
+			m_Capability.reset();
+			++m_Revision;
+			return true;
+		}
+
+		/// Get number of registered Interfaces. Changes whenever the capability document does, so callers can cache documents built from it.
+		/// @return revision of the Interface set.
+		std::size_t GetRevision() const noexcept
+		{
+			return m_Revision;
 		}
 
 		/// Return information about Interface for required hash.
@@ -67,12 +85,12 @@ namespace FSecure::C3
 		template<typename T, std::enable_if_t<std::is_same_v<T, AbstractChannel> or std::is_same_v<T, AbstractPeripheral> or std::is_same_v<T, AbstractConnector>, int> = 0>
 		auto Find(std::string_view name)
 		{
-			auto const& map = GetMap<T>();
-			auto it = std::find_if(std::cbegin(map), std::cend(map), [&name](auto const& el) { return el.second.m_Name == name; } );
-			if (it == std::cend(map))
+			auto const& index = GetNameIndex<T>();
+			auto it = index.find(name);
+			if (it == index.end())
 				throw std::runtime_error{ OBF("Requested Device was not registered: ") + std::string(name)};
 
-			return it;
+			return GetMap<T>().find(it->second);
 		}
 
 		/// Get proper map member for type T.
@@ -81,7 +99,7 @@ namespace FSecure::C3
 		template <> auto& GetMap<AbstractPeripheral>() { return m_Peripherals; }
 		template <> auto& GetMap<AbstractConnector>() { return m_Connectors; }
 
-		/// Return json string with capability;
+		/// Return json string with capability. Document is built once and rebuilt only if new Interface was registered since.
 		std::string GetCapability();
 
 	private:
@@ -89,10 +107,29 @@ namespace FSecure::C3
 		/// Only object of InterfaceFactory singleton must be accessed by Instance method.
 		InterfaceFactory() = default;
 
+		/// Build capability document of all registered Interfaces.
+		/// @return json string with capability.
+		std::string BuildCapability();
+
+		/// Get name to hash index for type T.
+		template <typename T> auto& GetNameIndex() = delete;
+		template <> auto& GetNameIndex<AbstractChannel>() { return m_ChannelNames; }
+		template <> auto& GetNameIndex<AbstractPeripheral>() { return m_PeripheralNames; }
+		template <> auto& GetNameIndex<AbstractConnector>() { return m_ConnectorNames; }
+
 		/// Separated maps for each interface type.
 		std::unordered_map<HashT, InterfaceData<AbstractChannel>> m_Channels;
 		std::unordered_map<HashT, InterfaceData<AbstractPeripheral>> m_Peripherals;
 		std::unordered_map<HashT, InterfaceData<AbstractConnector>> m_Connectors;
+
+		/// Interface hashes by name, one index for each interface type.
+		std::unordered_map<std::string_view, HashT> m_ChannelNames;
+		std::unordered_map<std::string_view, HashT> m_PeripheralNames;
+		std::unordered_map<std::string_view, HashT> m_ConnectorNames;
+
+		std::mutex m_CapabilityMutex;																					///< Guards m_Capability.
+		std::optional<std::string> m_Capability;																		///< Capability document. Empty until built.
+		std::atomic<std::size_t> m_Revision = 0;																		///< Incremented by every successful registration.
 	};
 
 	/// Use typeid to get text interface name.
@@ -0,0 +1,79 @@
+#include "StdAfx.h"
+#include "PushChannel.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::PushReceiver::~PushReceiver()
+{
+	Stop();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::PushReceiver::Start(Poll poll)
+{
+	std::scoped_lock lock(m_Mutex);
+	if (m_Thread.joinable())
+		throw std::logic_error{ OBF("PushReceiver is already started.") };
+
+	m_IsStopped = false;
+	m_Thread = std::thread{ [this, poll = std::move(poll)] { Run(poll); } };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::PushReceiver::Stop()
+{
+	{
+		std::scoped_lock lock(m_Mutex);
+		m_IsStopped = true;
+	}
+
+	m_StopCondition.notify_all();
+	if (m_Thread.joinable())
+		m_Thread.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::PushReceiver::Push(ByteVector packet)
+{
+	std::scoped_lock lock(m_Mutex);
+	m_Packets.push_back(std::move(packet));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::PushReceiver::TakeAll()
+{
+	std::scoped_lock lock(m_Mutex);
+	if (m_Packets.empty() && m_Error)
+		std::rethrow_exception(std::exchange(m_Error, nullptr));
+
+	return std::exchange(m_Packets, {});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::PushReceiver::Run(Poll const& poll)
+{
+	auto retryDelay = std::chrono::milliseconds{ s_MinRetryDelay };
+	while (true)
+	{
+		try
+		{
+			auto packets = poll();
+			retryDelay = s_MinRetryDelay;
+
+			std::scoped_lock lock(m_Mutex);
+			if (m_IsStopped)
+				return;
+
+			std::move(packets.begin(), packets.end(), std::back_inserter(m_Packets));
+		}
+		catch (...)
+		{
+			// Backend is unreachable or rejected the request. Don't hammer it, wait before the next attempt.
+			std::unique_lock lock(m_Mutex);
+			m_Error = std::current_exception();
+			if (m_StopCondition.wait_for(lock, retryDelay, [this] { return m_IsStopped; }))
+				return;
+
+			retryDelay = std::min<std::chrono::milliseconds>(2 * retryDelay, s_MaxRetryDelay);
+		}
+	}
+}
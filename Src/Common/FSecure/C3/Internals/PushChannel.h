@@ -0,0 +1,97 @@
+#pragma once
+
+#include <thread>
+#include <condition_variable>
+#include "AutomaticRegistrator.h"
+
+namespace FSecure::C3
+{
+	/// Receives packets pushed by a backend on a background thread, so that Channel updates only take what has already arrived.
+	class PushReceiver
+	{
+	public:
+		/// Blocking call waiting for packets, e.g. a long-poll HTTP request or a read from an open stream. Returns no packets if backend's wait timed out.
+		/// Exceptions are reported by the next TakeAll call and the call is retried after a growing delay.
+		using Poll = std::function<std::vector<ByteVector>()>;
+
+		/// Destructor. Stops the receiving thread.
+		~PushReceiver();
+
+		/// Start calling poll in a loop on a background thread.
+		/// @param poll call waiting for packets.
+		/// @throws std::logic_error if receiver is already started.
+		void Start(Poll poll);
+
+		/// Stop the receiving thread. Waits for the poll in progress to return, so it should be bounded by a timeout.
+		void Stop();
+
+		/// Add a packet from outside of the poll, e.g. from a callback of a backend's SDK.
+		/// @param packet packet to be returned by the next TakeAll call.
+		void Push(ByteVector packet);
+
+		/// Take packets received so far.
+		/// @return packets in order of arrival, empty if nothing arrived since the last call.
+		/// @throws the last exception thrown by poll, if no packets were received since then.
+		std::vector<ByteVector> TakeAll();
+
+	private:
+		/// Delay of the first retry of failed poll.
+		static constexpr std::chrono::seconds s_MinRetryDelay{ 1 };
+
+		/// Retry delay doubles with every failure up to this value.
+		static constexpr std::chrono::seconds s_MaxRetryDelay{ 60 };
+
+		/// Receiving thread body.
+		/// @param poll call waiting for packets.
+		void Run(Poll const& poll);
+
+		std::mutex m_Mutex;																								///< Guards members below.
+		std::condition_variable m_StopCondition;																		///< Notified by Stop, wakes up receiving thread waiting for a retry.
+		bool m_IsStopped = false;																						///< Set by Stop.
+		std::vector<ByteVector> m_Packets;																				///< Packets received, but not taken yet.
+		std::exception_ptr m_Error;																						///< Last exception thrown by poll, not reported yet.
+		std::thread m_Thread;																							///< Receiving thread.
+	};
+
+	namespace Interfaces
+	{
+		/// Base of Channels whose backends push packets instead of being polled, e.g. with long-poll HTTP requests.
+		/// OnReceiveFromChannel only takes packets already received by PushReceiver, so Channel can be updated often without calling the backend.
+		/// Types using PushChannel CRTP start receiving in their constructor and must call StopReceiving in their destructor, before members used by poll are destroyed.
+		template <typename Iface>
+		class PushChannel : public Channel<Iface>
+		{
+		public:
+			/// Take packets pushed since the last update.
+			/// @return packets retrieved from Channel.
+			std::vector<ByteVector> OnReceiveFromChannel()
+			{
+				return m_PushReceiver.TakeAll();
+			}
+
+		protected:
+			/// Start receiving packets on a background thread. @see PushReceiver::Poll.
+			/// @param poll call waiting for packets.
+			void StartReceiving(PushReceiver::Poll poll)
+			{
+				m_PushReceiver.Start(std::move(poll));
+			}
+
+			/// Stop receiving packets. Waits for the poll in progress to return.
+			void StopReceiving()
+			{
+				m_PushReceiver.Stop();
+			}
+
+			/// Add a packet delivered by a callback instead of the poll.
+			/// @param packet packet to be returned by the next update.
+			void Push(ByteVector packet)
+			{
+				m_PushReceiver.Push(std::move(packet));
+			}
+
+		private:
+			PushReceiver m_PushReceiver;																			///< Receives packets in the background.
+		};
+	}
+}
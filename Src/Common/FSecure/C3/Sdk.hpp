@@ -3,6 +3,8 @@
 #include "PrecompiledHeader.hpp"																						//< C3 Precompiled headers (if they weren't included in StdAfx.h)
 #include "Internals/BackendCommons.h"																					//< C3 back-back-end and C3 front-back-end common types and functions.
 #include "Internals/AutomaticRegistrator.h"																				//< For auto registering Interface factories.
+#include "Internals/PushChannel.h"																						//< Base of Channels receiving pushed packets.
+#include "Internals/AsyncChannel.h"																						//< Base of Channels receiving asynchronously.
 
 // C3 Core static library.
 #ifdef _WIN64
@@ -41,6 +41,24 @@ namespace FSecure
 			bv.remove_prefix(Size());
 			return ret;
 		}
+
+		/// Serialize arithmetic type to memory reserved by FixedLayout.
+		/// @param obj. Object to be serialized.
+		/// @param ptr. Destination with at least Size() bytes available.
+		static void ToRaw(T obj, std::uint8_t* ptr)
+		{
+			memcpy(ptr, &obj, Size());
+		}
+
+		/// Deserialize from memory already checked by FixedLayout.
+		/// @param ptr. Source with at least Size() bytes available.
+		/// @return arithmetic type.
+		static T FromRaw(std::uint8_t const* ptr)
+		{
+			T ret;
+			memcpy(&ret, ptr, Size());
+			return ret;
+		}
 	};
 
 	/// ByteConverter specialization for enum.
@@ -69,11 +87,27 @@ namespace FSecure
 		{
 			return static_cast<T>(bv.Read<std::underlying_type_t<T>>());
 		}
+
+		/// Serialize enum type to memory reserved by FixedLayout.
+		/// @param enumInstance. Object to be serialized.
+		/// @param ptr. Destination with at least Size() bytes available.
+		static void ToRaw(T enumInstance, std::uint8_t* ptr)
+		{
+			ByteConverter<std::underlying_type_t<T>>::ToRaw(static_cast<std::underlying_type_t<T>>(enumInstance), ptr);
+		}
+
+		/// Deserialize from memory already checked by FixedLayout.
+		/// @param ptr. Source with at least Size() bytes available.
+		/// @return enum.
+		static T FromRaw(std::uint8_t const* ptr)
+		{
+			return static_cast<T>(ByteConverter<std::underlying_type_t<T>>::FromRaw(ptr));
+		}
 	};
 
 	/// ByteConverter specialization for iterable types.
 	template <typename T>
-	struct ByteConverter<T, std::enable_if_t<Utils::Container::IsIterable<T>::value>>
+	struct ByteConverter<T, std::enable_if_t<Utils::Container::IsIterable<T>::value && !Utils::IsView<T>::value>>
 	{
 		/// Serialize iterable type to ByteVector.
 		/// @param obj. Object to be serialized.
@@ -114,7 +148,14 @@ namespace FSecure
 			if (sizeof(uint32_t) > bv.size())
 				throw std::out_of_range{ OBF(": Cannot read size from ByteView ") };
 
-			if constexpr (Utils::Container::GeneratorSignature<T>::value == Utils::Container::GeneratorSignature<T>::queuedAccess)
+			using Element = Utils::Container::StoredValue<T>;
+			if constexpr (std::is_arithmetic_v<Element> && std::is_constructible_v<T, Element const*, Element const*>)
+			{
+				// Contiguous data of simple types is copied at once instead of inserting elements one by one.
+				auto view = bv.Read<std::basic_string_view<Element>>();
+				return T(view.data(), view.data() + view.size());
+			}
+			else if constexpr (Utils::Container::GeneratorSignature<T>::value == Utils::Container::GeneratorSignature<T>::queuedAccess)
 			{
 				return Utils::Container::Generator<T>{}(bv.Read<uint32_t>(),  [&bv] { return bv.Read<Utils::Container::StoredValue<T>>(); } );
 			}
@@ -131,6 +172,46 @@ namespace FSecure
 		}
 	};
 
+	/// ByteConverter specialization for views (std::basic_string_view and ByteView).
+	/// Serialized form is the same as for owning containers, but reading returns a view on the source buffer instead of a copy.
+	/// Data viewed must outlive returned object.
+	template <typename T>
+	struct ByteConverter<T, std::enable_if_t<Utils::IsView<T>::value>>
+	{
+		/// Serialize view to ByteVector.
+		/// @param obj. Object to be serialized.
+		/// @param bv. ByteVector to be expanded.
+		static void To(T const& obj, ByteVector& bv)
+		{
+			if (obj.size() > std::numeric_limits<uint32_t>::max())
+				throw std::out_of_range{ OBF(": Cannot write size to ByteVector ") };
+
+			bv.Write(static_cast<uint32_t>(obj.size()));
+			bv.Concat(ByteView{ reinterpret_cast<const uint8_t*>(obj.data()), obj.size() * sizeof(typename T::value_type) });
+		}
+
+		/// Get size required after serialization.
+		/// @return size_t. Number of bytes used after serialization.
+		static size_t Size(T const& obj)
+		{
+			return sizeof(uint32_t) + obj.size() * sizeof(typename T::value_type);
+		}
+
+		/// Deserialize from ByteView.
+		/// @param bv. Buffer with serialized data.
+		/// @return view on data stored in bv.
+		static T From(ByteView& bv)
+		{
+			auto size = bv.Read<uint32_t>();
+			if (size > bv.size() / sizeof(typename T::value_type))
+				throw std::out_of_range{ OBF(": Cannot read data from ByteView") };
+
+			auto ret = T{ reinterpret_cast<typename T::value_type const*>(bv.data()), size };
+			bv.remove_prefix(size * sizeof(typename T::value_type));
+			return ret;
+		}
+	};
+
 	/// ByteConverter specialization for std::filesystem::path.
 	template <>
 	struct ByteConverter<std::filesystem::path>
@@ -195,6 +276,71 @@ namespace FSecure
 		}
 	};
 
+	/// Compile-time description of message built from fields with fixed size.
+	/// Offsets of all fields are computed by compiler, so that message is written with single resize and read after single bounds check.
+	/// Each of Ts must provide constexpr ByteConverter::Size() and raw access with ByteConverter::ToRaw and ByteConverter::FromRaw.
+	/// ByteVector::Write and ByteView::Read use FixedLayout implicitly, when all of their arguments meet these requirements.
+	/// @code using Header = FixedLayout<std::uint8_t, RouteId, std::int32_t>; auto [protocol, rid, timestamp] = Header::Read(someByteView); @endcode
+	template <typename ...Ts>
+	struct FixedLayout
+	{
+		static_assert(sizeof...(Ts) != 0, "FixedLayout must describe at least one field.");
+		static_assert(FixedLayoutCondition<Ts...>::value, "Each of FixedLayout fields must have constant size and raw access.");
+
+		/// Number of bytes used by whole message.
+		static constexpr size_t Size = ByteVector::ConstantSize<Ts...>();
+
+		/// Offset of each field from beginning of message.
+		static constexpr std::array<size_t, sizeof...(Ts)> Offsets = []()
+		{
+			constexpr size_t sizes[] = { ByteConverter<Ts>::Size()... };
+			auto offsets = std::array<size_t, sizeof...(Ts)>{};
+			for (size_t i = 1; i < sizeof...(Ts); ++i)
+				offsets[i] = offsets[i - 1] + sizes[i - 1];
+
+			return offsets;
+		}();
+
+		/// Append message to ByteVector.
+		/// @param bv. ByteVector to be expanded by Size bytes.
+		/// @param args. Fields of message.
+		static void Write(ByteVector& bv, Ts const& ...args)
+		{
+			auto oldSize = bv.size();
+			bv.resize(oldSize + Size);
+			WriteFields(bv.data() + oldSize, std::index_sequence_for<Ts...>{}, args...);
+		}
+
+		/// Read message from ByteView and move ByteView to position after it.
+		/// @param bv. Buffer with serialized data.
+		/// @return std::tuple with all fields.
+		/// @throws std::out_of_range if bv is shorter than Size. bv is not modified in that case.
+		static std::tuple<Ts...> Read(ByteView& bv)
+		{
+			if (Size > bv.size())
+				throw std::out_of_range{ OBF(": Cannot read data from ByteView") };
+
+			auto ret = ReadFields(bv.data(), std::index_sequence_for<Ts...>{});
+			bv.remove_prefix(Size);
+			return ret;
+		}
+
+	private:
+		/// Copy each field to its offset.
+		template <size_t ...Is>
+		static void WriteFields(std::uint8_t* ptr, std::index_sequence<Is...>, Ts const& ...args)
+		{
+			(ByteConverter<Ts>::ToRaw(args, ptr + Offsets[Is]), ...);
+		}
+
+		/// Copy each field from its offset.
+		template <size_t ...Is>
+		static std::tuple<Ts...> ReadFields(std::uint8_t const* ptr, std::index_sequence<Is...>)
+		{
+			return { ByteConverter<Ts>::FromRaw(ptr + Offsets[Is])... };
+		}
+	};
+
 	/// ByteConverter specialization for tuple.
 	template <typename T>
 	struct ByteConverter<T, std::enable_if_t<Utils::IsTuple<T>>>
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "Utils.h"
+#if defined BYTEVECTOR_POOLED_ALLOCATION
+#	include "PoolAllocator.h"
+#endif
 
 #include <limits>
 #include <string>
@@ -18,6 +21,10 @@ namespace FSecure
 	template <typename T, typename = void>
 	struct ByteConverter {};
 
+	/// Compile-time description of message built from fields with fixed size. Defined in ByteConverter.h.
+	template <typename ...Ts>
+	struct FixedLayout;
+
 	/// Class detecting specifics of ByteConverter specialization for given type.
 	template <typename T>
 	struct ConverterDeduction
@@ -44,6 +51,16 @@ namespace FSecure
 			enum { value = sizeof(test<T>(0)) };
 		};
 
+		class FunctionRaw
+		{
+			template <typename C> static uint16_t test(decltype(ByteConverter<C>::FromRaw(std::declval<std::uint8_t const*>()), ByteConverter<C>::ToRaw(std::declval<C>(), std::declval<std::uint8_t*>()))*);
+			template <typename C> static uint8_t test(...);
+
+		public:
+			enum { absent = 1, present = 2 };
+			enum { value = sizeof(test<T>(0)) };
+		};
+
 		static_assert(!((FunctionTo::value == FunctionTo::expandsContainer) && (FunctionSize::value == FunctionSize::absent)),
 			"ByteConverter::Size must be defined, if function ByteConverter::To expands already allocated container.");
 	};
@@ -55,17 +72,39 @@ namespace FSecure
 		static constexpr bool value = ((ConverterDeduction<Ts>::FunctionTo::value != ConverterDeduction<Ts>::FunctionTo::absent) && ...);
 	};
 
+	/// Checks if serialized size of all types is known at compile time.
+	template <typename ...Ts>
+	struct ConstantSizeCondition
+	{
+		static constexpr bool value = ((ConverterDeduction<Ts>::FunctionSize::value == ConverterDeduction<Ts>::FunctionSize::compileTime) && ...);
+	};
+
+	/// Checks if all types can be written and read directly from memory, without bounds checks of their own.
+	template <typename ...Ts>
+	struct FixedLayoutCondition
+	{
+		static constexpr bool value = ConstantSizeCondition<Ts...>::value && ((ConverterDeduction<Ts>::FunctionRaw::value == ConverterDeduction<Ts>::FunctionRaw::present) && ...);
+	};
+
+#if defined BYTEVECTOR_POOLED_ALLOCATION
+	/// Storage of ByteVector is recycled by BlockPool. Pool zeroes memory on every release, unless buffer holds public data. @see ByteVector::SetSensitive.
+	using ByteVectorStorage = std::vector<std::uint8_t, PoolAllocator<std::uint8_t>>;
+#else
+	/// Storage of ByteVector is allocated on the heap.
+	using ByteVectorStorage = std::vector<std::uint8_t>;
+#endif
+
 	/// An owning container.
-	class ByteVector : std::vector<std::uint8_t>
+	class ByteVector : ByteVectorStorage
 	{
 	public:
 		/// Privately inherited Type.
-		using Super = std::vector<std::uint8_t>;
+		using Super = ByteVectorStorage;
 
 		/// Type of stored values.
 		using ValueType = Super::value_type;
 
-#if defined BYTEVECTOR_ZERO_MEMORY_DESTRUCTION
+#if defined BYTEVECTOR_ZERO_MEMORY_DESTRUCTION && !defined BYTEVECTOR_POOLED_ALLOCATION
 		/// Destructor zeroing memory.
 		~ByteVector()
 		{
@@ -109,10 +148,17 @@ namespace FSecure
 		/// Create from std::vector.
 		/// @param other. Object to copy.
 		ByteVector(std::vector<uint8_t> other)
+#if defined BYTEVECTOR_POOLED_ALLOCATION
+			: Super(other.begin(), other.end())
+		{
+			Utils::SecureMemzero(other.data(), other.size());
+		}
+#else
 			: Super(std::move(other))
 		{
 
 		}
+#endif
 
 		// Enable methods.
 		using Super::vector;
@@ -161,18 +207,56 @@ namespace FSecure
 		friend inline bool operator==(ByteVector const& lhs, ByteVector const& rhs);
 		friend inline bool operator!=(ByteVector const& lhs, ByteVector const& rhs);
 
+		/// Choose whether memory is zeroed when it's released. Buffers are sensitive by default, and so are copies of any buffer.
+		/// Public or already encrypted data, e.g. Channel frames and ciphertext, can skip zeroing, which is a measurable share of CPU time of big transfers.
+		/// Buffer that is not sensitive must not hold plaintext or key material until it's released, e.g. after clear(). Without pooled allocation memory is always zeroed.
+		/// @param isSensitive false to release memory without zeroing it.
+		/// @return itself to allow chaining.
+		ByteVector& SetSensitive(bool isSensitive)
+		{
+#if defined BYTEVECTOR_POOLED_ALLOCATION
+			// All PoolAllocators are equal, so storage is taken over without copying. Move assignment propagates the allocator.
+			if (get_allocator().IsZeroing() != isSensitive)
+				static_cast<Super&>(*this) = Super(std::move(static_cast<Super&>(*this)), PoolAllocator<std::uint8_t>{ isSensitive });
+#endif
+			return *this;
+		}
+
+		/// @return true if memory is zeroed when it's released. @see SetSensitive.
+		bool IsSensitive() const
+		{
+#if defined BYTEVECTOR_POOLED_ALLOCATION
+			return get_allocator().IsZeroing();
+#else
+			return true;
+#endif
+		}
+
 		/// Write content of of provided objects.
 		/// Supports arithmetic types, and basic iterable types.
 		/// Include ByteConverter.h to add support for common types like enum, std::tuple and others.
 		/// Create specialization on ByteConverter for custom types or template types to expand existing serialization functionality.
+		/// Objects with fixed size are written with FixedLayout, which resizes buffer once and copies fields directly.
 		/// @param arg. Object to be stored.
 		/// @param args. Optional other objects to be stored.
 		/// @return itself to allow chaining.
 		template <typename T, typename ...Ts, typename std::enable_if_t<WriteCondition<T, Ts...>::value, int> = 0>
 		ByteVector& Write(T const& arg, Ts const& ...args)
 		{
-			reserve(size() + Size<T, Ts...>(arg, args...));
-			Store<T, Ts...>(arg, args...);
+			if constexpr (FixedLayoutCondition<T, Ts...>::value)
+			{
+				FixedLayout<T, Ts...>::Write(*this, arg, args...);
+			}
+			else
+			{
+				if constexpr (ConstantSizeCondition<T, Ts...>::value)
+					reserve(size() + ConstantSize<T, Ts...>());
+				else
+					reserve(size() + ReservationSize<T, Ts...>(arg, args...));
+
+				Store<T, Ts...>(arg, args...);
+			}
+
 			return *this;
 		}
 
@@ -227,7 +311,34 @@ namespace FSecure
 				return ByteConverter<T>::To(arg).size();
 		}
 
+		/// Calculate the size that arguments of given types will take in memory.
+		/// Available only for types with size known at compile time, e.g. arithmetic types, enums, identifiers or RouteId.
+		/// @return size_t number of bytes needed.
+		template<typename ...Ts, typename std::enable_if_t<ConstantSizeCondition<Ts...>::value, int> = 0>
+		static constexpr size_t ConstantSize()
+		{
+			return (ByteConverter<Ts>::Size() + ... + 0);
+		}
+
 	private:
+		/// Calculate number of bytes that should be reserved before storing arguments.
+		/// Unlike Size, does not serialize types without ByteConverter::Size, so their data is not produced twice.
+		/// @param arg. Argument to be stored.
+		/// @param args. Rest of arguments that will be handled with recursion.
+		/// @return size_t number of bytes to reserve.
+		template<typename T, typename ...Ts>
+		static size_t ReservationSize(T const& arg, Ts const& ...args)
+		{
+			auto ret = size_t{ 0 };
+			if constexpr (ConverterDeduction<T>::FunctionSize::value != ConverterDeduction<T>::FunctionSize::absent)
+				ret += Size(arg);
+
+			if constexpr (sizeof...(Ts) != 0)
+				ret += ReservationSize(args...);
+
+			return ret;
+		}
+
 		/// Store custom type.
 		/// @param arg. Object to be stored. There must exsist FSecure::ByteConverter<T>::To method avalible to store custom type.
 		/// @param args. Rest of objects that will be handled with recursion.
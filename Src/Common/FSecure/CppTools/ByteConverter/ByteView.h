@@ -164,8 +164,21 @@ namespace FSecure
 		/// @code auto [a, b, c] = someByteView.Read<int, float, std::string>(); @endcode
 		/// @note Returned types does not have to match exactly with Read template parameters list.
 		/// It is possible to create tags that will be used to retrieve different type.
+		/// Types with fixed size are read with FixedLayout, which checks bounds once for all of them.
 		template<typename T, typename ...Ts, typename = decltype(FSecure::ByteConverter<Utils::RemoveCVR<T>>::From(std::declval<ByteView&>()))>
 		auto Read()
+		{
+			if constexpr (sizeof...(Ts) != 0 && FixedLayoutCondition<Utils::RemoveCVR<T>, Utils::RemoveCVR<Ts>...>::value)
+				return FixedLayout<Utils::RemoveCVR<T>, Utils::RemoveCVR<Ts>...>::Read(*this);
+			else
+				return ReadEach<T, Ts...>();
+		}
+
+	private:
+		/// Read objects one by one, using ByteConverter of each type.
+		/// @see ByteView::Read.
+		template<typename T, typename ...Ts>
+		auto ReadEach()
 		{
 			auto copy = *this;
 			try
@@ -0,0 +1,357 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "Utils.h"
+
+namespace FSecure
+{
+#if defined BYTEVECTOR_PRIVATE_HEAP
+	namespace Utils
+	{
+		/// Allocate memory from heap used only by BlockPool, apart from allocations of the host process. Defined in Utils.cpp, because windows.h is included after this header.
+		/// @param bytes size of allocation.
+		/// @return pointer to memory block.
+		/// @throw std::bad_alloc if memory could not be allocated.
+		void* AllocateFromPrivateHeap(size_t bytes);
+
+		/// Return memory to the private heap.
+		/// @param ptr memory block returned by AllocateFromPrivateHeap.
+		void FreeToPrivateHeap(void* ptr) noexcept;
+
+		/// Coalesce free blocks of the private heap and return what it can to the system.
+		void CompactPrivateHeap() noexcept;
+	}
+#endif
+
+	/// Cache of memory blocks grouped in power of two size classes.
+	/// Every block is zeroed when it is released, no matter if it is cached or returned to the heap, unless it holds public data.
+	/// Each thread keeps a few blocks of each class for itself, so that threads don't compete for the shared cache in common case.
+	/// With BYTEVECTOR_PRIVATE_HEAP blocks come from a heap of their own, so they neither fragment the heap of the host process nor show up in it.
+	struct BlockPool
+	{
+		static constexpr size_t s_MinBlockSize = 64;																	///< Smaller allocations are rounded up to this size.
+		static constexpr size_t s_MaxBlockSize = 1024 * 1024;															///< Bigger allocations are not pooled.
+		static constexpr size_t s_SharedBytesPerClass = 4 * 1024 * 1024;												///< Upper limit of memory kept in shared cache for each class.
+		static constexpr size_t s_LocalBlocksPerClass = 4;																///< Number of blocks of each class cached by every thread.
+
+		/// Number of size classes.
+		static constexpr size_t s_ClassCount = []
+		{
+			size_t ret = 1;
+			for (auto size = s_MinBlockSize; size < s_MaxBlockSize; size *= 2)
+				++ret;
+
+			return ret;
+		}();
+
+		/// Gets memory block big enough to store requested number of bytes.
+		/// @param bytes requested size.
+		/// @return pointer to memory block.
+		/// @throw std::bad_alloc if memory could not be allocated.
+		static void* Allocate(size_t bytes)
+		{
+			auto sizeClass = GetClass(bytes);
+			if (sizeClass == s_ClassCount)
+				return AllocateBlock(bytes);
+
+			if (auto local = GetLocalCache(); local && !(*local)[sizeClass].empty())
+			{
+				auto ret = (*local)[sizeClass].back();
+				(*local)[sizeClass].pop_back();
+				return ret;
+			}
+
+			if (auto shared = GetSharedCache())
+			{
+				auto& blocks = (*shared)[sizeClass];
+				std::scoped_lock lock(blocks.m_Mutex);
+				if (!blocks.m_Blocks.empty())
+				{
+					auto ret = blocks.m_Blocks.back();
+					blocks.m_Blocks.pop_back();
+					return ret;
+				}
+			}
+
+			return AllocateBlock(GetClassSize(sizeClass));
+		}
+
+		/// Zeroes memory and keeps it for future allocations or returns it to the heap.
+		/// @param ptr memory block returned by Allocate.
+		/// @param bytes size passed to Allocate.
+		/// @param zero false if block holds only public data, e.g. ciphertext, so it is released as it is.
+		static void Release(void* ptr, size_t bytes, bool zero = true) noexcept
+		{
+			if (!ptr)
+				return;
+
+			if (zero)
+				Utils::SecureMemzero(ptr, bytes);
+
+			auto sizeClass = GetClass(bytes);
+			if (sizeClass == s_ClassCount)
+				return FreeBlock(ptr);
+
+			try
+			{
+				if (auto local = GetLocalCache(); local && (*local)[sizeClass].size() < s_LocalBlocksPerClass)
+					return (*local)[sizeClass].push_back(ptr);
+
+				if (auto shared = GetSharedCache())
+				{
+					auto& blocks = (*shared)[sizeClass];
+					std::scoped_lock lock(blocks.m_Mutex);
+					if (blocks.m_Blocks.size() < std::max(s_SharedBytesPerClass / GetClassSize(sizeClass), s_LocalBlocksPerClass))
+						return blocks.m_Blocks.push_back(ptr);
+				}
+			}
+			catch (...)
+			{
+				// Bookkeeping could not grow. Block is simply returned to the heap.
+			}
+
+			FreeBlock(ptr);
+		}
+
+		/// Returns cached blocks to the heap, e.g. when program is idle after a burst. Other threads return their own blocks on their next allocation or release.
+		static void Trim() noexcept
+		{
+			GetTrimGeneration().fetch_add(1, std::memory_order_relaxed);
+			GetLocalCache();
+			if (auto shared = GetSharedCache())
+				for (auto& blocks : *shared)
+				{
+					std::scoped_lock lock(blocks.m_Mutex);
+					blocks.m_Blocks.Free();
+				}
+		}
+
+		/// Returns free memory of the private heap to the system. Call after Trim, which frees cached blocks. Does nothing without BYTEVECTOR_PRIVATE_HEAP.
+		static void CompactHeap() noexcept
+		{
+#if defined BYTEVECTOR_PRIVATE_HEAP
+			Utils::CompactPrivateHeap();
+#endif
+		}
+
+	private:
+		/// List of free blocks of one size class. Blocks are freed with the list.
+		struct Blocks : std::vector<void*>
+		{
+			/// Destructor.
+			~Blocks()
+			{
+				Free();
+			}
+
+			/// Returns all blocks to the heap, along with memory of the list.
+			void Free() noexcept
+			{
+				for (auto block : *this)
+					FreeBlock(block);
+
+				clear();
+				shrink_to_fit();
+			}
+		};
+
+		/// Free blocks shared by all threads.
+		struct SharedBlocks
+		{
+			std::mutex m_Mutex;																							///< Access synchronization.
+			Blocks m_Blocks;																							///< Free blocks.
+		};
+
+		/// Cache of size classes that marks when it is destroyed, so buffers released later go straight to the heap.
+		/// @tparam BlocksType type of list of free blocks.
+		template <typename BlocksType>
+		struct Cache : std::array<BlocksType, s_ClassCount>
+		{
+			/// Public ctor.
+			/// @param destroyed flag set when cache is destroyed. Must be trivially destructible, to stay valid after cache destruction.
+			Cache(bool& destroyed) : m_Destroyed{ destroyed }
+			{
+			}
+
+			/// Destructor.
+			~Cache()
+			{
+				m_Destroyed = true;
+			}
+
+			size_t m_TrimGeneration = GetTrimGeneration().load(std::memory_order_relaxed);							///< Value of trim counter when cache was last trimmed.
+
+		private:
+			bool& m_Destroyed;																							///< Set on destruction.
+		};
+
+		/// Gets memory from the heap.
+		/// @param bytes size of allocation.
+		/// @return pointer to memory block.
+		/// @throw std::bad_alloc if memory could not be allocated.
+		static void* AllocateBlock(size_t bytes)
+		{
+#if defined BYTEVECTOR_PRIVATE_HEAP
+			return Utils::AllocateFromPrivateHeap(bytes);
+#else
+			return ::operator new(bytes);
+#endif
+		}
+
+		/// Returns memory to the heap.
+		/// @param ptr memory block returned by AllocateBlock.
+		static void FreeBlock(void* ptr) noexcept
+		{
+#if defined BYTEVECTOR_PRIVATE_HEAP
+			Utils::FreeToPrivateHeap(ptr);
+#else
+			::operator delete(ptr);
+#endif
+		}
+
+		/// Finds size class of allocation.
+		/// @param bytes size of allocation.
+		/// @return index of size class or s_ClassCount if allocation is too big to be pooled.
+		static size_t GetClass(size_t bytes) noexcept
+		{
+			size_t ret = 0;
+			for (auto size = s_MinBlockSize; size < bytes && ret < s_ClassCount; size *= 2)
+				++ret;
+
+			return ret;
+		}
+
+		/// @param sizeClass index of size class.
+		/// @return size of blocks in size class.
+		static constexpr size_t GetClassSize(size_t sizeClass) noexcept
+		{
+			return s_MinBlockSize << sizeClass;
+		}
+
+		/// @return blocks cached by the calling thread or null if thread is being destroyed.
+		static std::array<Blocks, s_ClassCount>* GetLocalCache()
+		{
+			thread_local bool destroyed = false;
+			if (destroyed)
+				return nullptr;
+
+			thread_local Cache<Blocks> cache{ destroyed };
+			if (auto generation = GetTrimGeneration().load(std::memory_order_relaxed); cache.m_TrimGeneration != generation)
+			{
+				cache.m_TrimGeneration = generation;
+				for (auto& blocks : cache)
+					blocks.Free();
+			}
+
+			return &cache;
+		}
+
+		/// @return blocks shared by all threads or null if program is being terminated.
+		static std::array<SharedBlocks, s_ClassCount>* GetSharedCache()
+		{
+			static bool destroyed = false;
+			if (destroyed)
+				return nullptr;
+
+			static Cache<SharedBlocks> cache{ destroyed };
+			return &cache;
+		}
+
+		/// @return counter incremented by every Trim call.
+		static std::atomic<size_t>& GetTrimGeneration() noexcept
+		{
+			static std::atomic<size_t> generation = 0;
+			return generation;
+		}
+	};
+
+	/// Allocator using BlockPool. Memory is zeroed on every release, including reallocations of growing containers, unless allocator was created for public data.
+	/// @tparam T type of allocated elements.
+	template <typename T>
+	struct PoolAllocator
+	{
+		/// Type of allocated elements.
+		using value_type = T;
+
+		/// All instances share one pool, so any of them can release memory allocated by other.
+		using is_always_equal = std::true_type;
+
+		/// Choice of zeroing follows the storage when containers are moved or swapped.
+		using propagate_on_container_move_assignment = std::true_type;
+		using propagate_on_container_swap = std::true_type;
+
+		/// Default ctor. Memory is zeroed on release.
+		PoolAllocator() noexcept = default;
+
+		/// Create allocator choosing whether memory is zeroed on release.
+		/// @param isZeroing false for public or already encrypted data.
+		explicit PoolAllocator(bool isZeroing) noexcept
+			: m_IsZeroing{ isZeroing }
+		{
+		}
+
+		/// Converting ctor.
+		template <typename U>
+		PoolAllocator(PoolAllocator<U> const& other) noexcept
+			: m_IsZeroing{ other.IsZeroing() }
+		{
+		}
+
+		/// Copies of containers are zeroed whatever their source is, as they may be modified to hold anything.
+		/// @return allocator zeroing memory.
+		PoolAllocator select_on_container_copy_construction() const noexcept
+		{
+			return {};
+		}
+
+		/// @return true if memory is zeroed on release.
+		bool IsZeroing() const noexcept
+		{
+			return m_IsZeroing;
+		}
+
+		/// Allocates storage for n elements.
+		/// @param n number of elements.
+		/// @return pointer to allocated storage.
+		/// @throw std::bad_alloc if memory could not be allocated.
+		T* allocate(size_t n)
+		{
+			if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+				throw std::bad_alloc{};
+
+			return static_cast<T*>(BlockPool::Allocate(n * sizeof(T)));
+		}
+
+		/// Zeroes and releases storage.
+		/// @param ptr pointer returned by allocate.
+		/// @param n number of elements passed to allocate.
+		void deallocate(T* ptr, size_t n) noexcept
+		{
+			BlockPool::Release(ptr, n * sizeof(T), m_IsZeroing);
+		}
+
+	private:
+		bool m_IsZeroing = true;																						///< Set unless allocator was created for public data.
+	};
+
+	/// All PoolAllocators are interchangeable.
+	template <typename T, typename U>
+	bool operator==(PoolAllocator<T> const&, PoolAllocator<U> const&) noexcept
+	{
+		return true;
+	}
+
+	/// All PoolAllocators are interchangeable.
+	template <typename T, typename U>
+	bool operator!=(PoolAllocator<T> const&, PoolAllocator<U> const&) noexcept
+	{
+		return false;
+	}
+}
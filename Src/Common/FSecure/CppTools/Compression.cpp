@@ -1,5 +1,7 @@
 #include "StdAfx.h"
+#include <cmath>
 #include "Compression.h"
+#include "Common/FSecure/CppTools/ScopeGuard.h"
 #include "Common/zlib/include/zlib.h"
 
 #if defined _WIN64
@@ -16,58 +18,204 @@
 
 #pragma comment(lib,  C3_SOLUTION_DIR "Common/zlib/lib/" Z_PLATFORM "zlib" Z_DEBUG ".lib")
 
-namespace FSecure::Compression
+namespace
 {
+	/// Size of buffer for intermediate results.
+	constexpr size_t s_ChunkSize = 16 * 1024;
+
+	/// Compression level of algorithm.
+	template <typename T>
+	constexpr int s_Level = Z_BEST_COMPRESSION;
+
+	/// Compression level of algorithm.
 	template <>
-	ByteVector Compress<Deflate>(ByteView data)
-	{
-		ByteVector ret;
-		ret.resize(data.size());
+	constexpr int s_Level<FSecure::Compression::DeflateFast> = Z_BEST_SPEED;
 
-		z_stream defstream;
-		defstream.zalloc = Z_NULL;
-		defstream.zfree = Z_NULL;
-		defstream.opaque = Z_NULL;
+	/// Number of bytes checked by IsCompressible. Longer data is sampled in s_EntropySampleBlocks blocks spread evenly across it.
+	constexpr size_t s_EntropySampleSize = 4 * 1024;
 
-		defstream.avail_in = (uInt) data.size();	// size of input
-		defstream.next_in = (Bytef*) data.data();	// input pointer
-		defstream.avail_out = (uInt) data.size();	// size of output
-		defstream.next_out = (Bytef*) ret.data();	// output pointer
+	/// Number of blocks sampled by IsCompressible, so that data made of parts of different kind is seen whole.
+	constexpr size_t s_EntropySampleBlocks = 8;
+
+	/// Bits of entropy per byte above which Deflate is not expected to gain anything. Compressed and encrypted data is close to 8, even when only 256 bytes are sampled. Text, base64 and code are below 7.
+	constexpr double s_MaxCompressibleEntropy = 7.2;
+
+	/// Create empty zlib stream.
+	std::unique_ptr<z_stream> CreateStream()
+	{
+		auto stream = std::make_unique<z_stream>();
+		stream->zalloc = Z_NULL;
+		stream->zfree = Z_NULL;
+		stream->opaque = Z_NULL;
+		return stream;
+	}
+
+	/// Run zlib on all input, collecting output.
+	/// @param stream zlib stream with input set.
+	/// @param process deflate or inflate.
+	/// @param flush flush mode.
+	/// @return produced output.
+	template <typename Process>
+	FSecure::ByteVector Run(z_stream& stream, Process process, int flush, FSecure::ByteView input)
+	{
+		FSecure::ByteVector ret;
+		uint8_t buffer[s_ChunkSize];
+		stream.avail_in = static_cast<uInt>(input.size());
+		stream.next_in = const_cast<Bytef*>(reinterpret_cast<Bytef const*>(input.data()));
+		do
+		{
+			stream.avail_out = static_cast<uInt>(sizeof(buffer));
+			stream.next_out = buffer;
+			auto result = process(&stream, flush);
+			if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+				throw std::runtime_error{ OBF("Compression failed: ") + std::to_string(result) + OBF(".") };
 
-		deflateInit2(&defstream,Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-		deflate(&defstream, Z_FINISH);
-		deflateEnd(&defstream);
+			ret.Concat(FSecure::ByteView{ buffer, sizeof(buffer) - stream.avail_out });
+			if (result == Z_STREAM_END)
+				break;
 
-		// Compression call consumed part of buffer. Compressed size is equal to difference between size of buffer available before and after compression.
-		ret.resize(data.size() - defstream.avail_out);
+		} while (stream.avail_out == 0 || stream.avail_in);		// Output buffer was consumed entirely or input is left, so there might be more to do.
 
 		return ret;
 	}
+}
 
-	template <>
-	ByteVector Decompress<Deflate>(ByteView data)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+FSecure::Compression::Compressor<T>::Compressor(ByteView dictionary)
+	: m_Stream{ CreateStream() }
+	, m_Dictionary{ dictionary }
+{
+	if (deflateInit2(m_Stream.get(), s_Level<T>, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error{ OBF("Couldn't initialize compression.") };
+
+	if (!m_Dictionary.empty())
+		deflateSetDictionary(m_Stream.get(), m_Dictionary.data(), static_cast<uInt>(m_Dictionary.size()));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+FSecure::Compression::Compressor<T>::~Compressor()
+{
+	deflateEnd(m_Stream.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+FSecure::ByteVector FSecure::Compression::Compressor<T>::Update(ByteView data)
+{
+	return Run(*m_Stream, deflate, Z_NO_FLUSH, data);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+FSecure::ByteVector FSecure::Compression::Compressor<T>::Finish()
+{
+	return Run(*m_Stream, deflate, Z_FINISH, {});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+void FSecure::Compression::Compressor<T>::Reset()
+{
+	// Reset keeps allocated state, unlike deflateEnd and deflateInit2.
+	deflateReset(m_Stream.get());
+	if (!m_Dictionary.empty())
+		deflateSetDictionary(m_Stream.get(), m_Dictionary.data(), static_cast<uInt>(m_Dictionary.size()));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+FSecure::ByteVector FSecure::Compression::Compressor<T>::Compress(ByteView data)
+{
+	SCOPE_GUARD( Reset(); );
+	return Update(data).Concat(Finish());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+FSecure::Compression::Decompressor<T>::Decompressor(ByteView dictionary)
+	: m_Stream{ CreateStream() }
+	, m_Dictionary{ dictionary }
+{
+	if (inflateInit2(m_Stream.get(), -15) != Z_OK)
+		throw std::runtime_error{ OBF("Couldn't initialize decompression.") };
+
+	// Raw streams don't ask for dictionary, so it has to be set up front.
+	if (!m_Dictionary.empty())
+		inflateSetDictionary(m_Stream.get(), m_Dictionary.data(), static_cast<uInt>(m_Dictionary.size()));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+FSecure::Compression::Decompressor<T>::~Decompressor()
+{
+	inflateEnd(m_Stream.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+FSecure::ByteVector FSecure::Compression::Decompressor<T>::Update(ByteView data)
+{
+	return Run(*m_Stream, inflate, Z_NO_FLUSH, data);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+void FSecure::Compression::Decompressor<T>::Reset()
+{
+	inflateReset(m_Stream.get());
+	if (!m_Dictionary.empty())
+		inflateSetDictionary(m_Stream.get(), m_Dictionary.data(), static_cast<uInt>(m_Dictionary.size()));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+FSecure::ByteVector FSecure::Compression::Decompressor<T>::Decompress(ByteView data)
+{
+	SCOPE_GUARD( Reset(); );
+	return Update(data);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::Compression::IsCompressible(ByteView data)
+{
+	if (data.empty())
+		return false;
+
+	size_t counts[256] = {};
+	size_t sampled = 0;
+	auto count = [&](ByteView block)
 	{
-		ByteVector ret;
-		uint8_t buffer[4096];
+		for (auto byte : block)
+			++counts[byte];
 
-		z_stream infstream;
-		infstream.zalloc = Z_NULL;
-		infstream.zfree = Z_NULL;
-		infstream.opaque = Z_NULL;
+		sampled += block.size();
+	};
 
-		infstream.avail_in = (uInt)data.size();		// size of input
-		infstream.next_in = (Bytef*)data.data();	// input pointer
-		inflateInit2(&infstream, -15);
-		do
+	if (data.size() <= s_EntropySampleSize)
+		count(data);
+	else
+		for (size_t i = 0, blockSize = s_EntropySampleSize / s_EntropySampleBlocks; i < s_EntropySampleBlocks; ++i)
+			count(data.SubString((data.size() - blockSize) * i / (s_EntropySampleBlocks - 1), blockSize));
+
+	// Small sample underestimates entropy, because most byte values are seen a few times at most. Miller-Madow correction adds the expected shortfall back.
+	auto entropy = 0.0;
+	size_t symbols = 0;
+	for (auto c : counts)
+		if (c)
 		{
-			infstream.avail_out = (uInt)sizeof(buffer);		// set size to use whole buffer
-			infstream.next_out = (Bytef*)buffer;			// store intermediate data in buffer
-			inflate(&infstream, Z_NO_FLUSH);				// intermediate call.
-			ret.Concat(ByteView{ buffer, sizeof(buffer) - infstream.avail_out });
+			auto p = static_cast<double>(c) / sampled;
+			entropy -= p * std::log2(p);
+			++symbols;
+		}
 
-		} while (infstream.avail_out == 0);					// inflate processed all of data if out buffer was not consumed entirely.
-		inflateEnd(&infstream);
+	entropy += (symbols - 1) / (2.0 * sampled * std::log(2.0));
+	return entropy <= s_MaxCompressibleEntropy;
+}
 
-		return ret;
-	}
-}
\ No newline at end of file
+// Both algorithms produce raw Deflate stream, so they differ only in compression level.
+template class FSecure::Compression::Compressor<FSecure::Compression::Deflate>;
+template class FSecure::Compression::Compressor<FSecure::Compression::DeflateFast>;
+template class FSecure::Compression::Decompressor<FSecure::Compression::Deflate>;
+template class FSecure::Compression::Decompressor<FSecure::Compression::DeflateFast>;
@@ -1,25 +1,114 @@
 #pragma once
 
+#include <memory>
 #include "ByteConverter/ByteView.h"
 
+/// Forward declaration of zlib stream state.
+struct z_stream_s;
+
 namespace FSecure::Compression
 {
 	namespace Algorithm
 	{
-		struct Deflate {};
+		struct Deflate {};				///< Raw Deflate with best compression. Use for slow channels.
+		struct DeflateFast {};			///< Raw Deflate with fastest compression. Output is decompressed like Deflate. Use on forwarding relays.
 	};
 
 	using namespace Algorithm;
 
+	/// Compresses data in parts, so big payloads don't have to be kept in memory along with their whole compressed copy.
+	/// Context can be reset and reused for many payloads, which is cheaper than creating a new one.
+	/// @tparam T compression algorithm.
 	template <typename T>
-	ByteVector Compress(ByteView data) = delete;
+	class Compressor
+	{
+	public:
+		/// Create compression context.
+		/// @param dictionary data that is likely to appear in compressed payloads. Decompressor must use the same dictionary.
+		/// @throws std::runtime_error if context couldn't be initialized.
+		Compressor(ByteView dictionary = {});
+
+		/// Destructor.
+		~Compressor();
+
+		/// Compress next part of data.
+		/// @param data part of data to compress.
+		/// @return compressed data produced so far. Might be empty.
+		ByteVector Update(ByteView data);
+
+		/// Finish compression. Call Reset before compressing next payload.
+		/// @return rest of compressed data.
+		ByteVector Finish();
+
+		/// Prepare context for next payload. Keeps the dictionary.
+		void Reset();
 
+		/// Compress whole payload and reset context.
+		/// @param data data to compress.
+		/// @return compressed data.
+		ByteVector Compress(ByteView data);
+
+	private:
+		std::unique_ptr<z_stream_s> m_Stream;																			///< zlib stream state.
+		ByteVector m_Dictionary;																						///< Dictionary set after each reset.
+	};
+
+	/// Decompresses data in parts.
+	/// @tparam T compression algorithm.
 	template <typename T>
-	ByteVector Decompress(ByteView data) = delete;
+	class Decompressor
+	{
+	public:
+		/// Create decompression context.
+		/// @param dictionary dictionary used by Compressor.
+		/// @throws std::runtime_error if context couldn't be initialized.
+		Decompressor(ByteView dictionary = {});
+
+		/// Destructor.
+		~Decompressor();
 
-	template <>
-	ByteVector Compress<Deflate>(ByteView data);
+		/// Decompress next part of data.
+		/// @param data part of compressed data.
+		/// @return decompressed data produced so far. Might be empty.
+		/// @throws std::runtime_error if data is corrupted.
+		ByteVector Update(ByteView data);
 
-	template <>
-	ByteVector Decompress<Deflate>(ByteView data);
+		/// Prepare context for next payload. Keeps the dictionary.
+		void Reset();
+
+		/// Decompress whole payload and reset context.
+		/// @param data compressed data.
+		/// @return decompressed data.
+		/// @throws std::runtime_error if data is corrupted.
+		ByteVector Decompress(ByteView data);
+
+	private:
+		std::unique_ptr<z_stream_s> m_Stream;																			///< zlib stream state.
+		ByteVector m_Dictionary;																						///< Dictionary set after each reset.
+	};
+
+	/// Tells if data is worth compressing, from entropy of bytes sampled across it. Checking is much cheaper than compressing data that doesn't get smaller, e.g. screenshots, archives or encrypted blobs.
+	/// @param data data to check.
+	/// @return false if sampled bytes look random.
+	bool IsCompressible(ByteView data);
+
+	/// Compress data at once.
+	/// @tparam T compression algorithm.
+	/// @param data data to compress.
+	/// @return compressed data.
+	template <typename T>
+	ByteVector Compress(ByteView data)
+	{
+		return Compressor<T>{}.Compress(data);
+	}
+
+	/// Decompress data at once.
+	/// @tparam T compression algorithm.
+	/// @param data compressed data.
+	/// @return decompressed data.
+	template <typename T>
+	ByteVector Decompress(ByteView data)
+	{
+		return Decompressor<T>{}.Decompress(data);
+	}
 }
@@ -0,0 +1,106 @@
+#include "StdAfx.h"
+#include "HttpClientPool.h"
+#include "Common/FSecure/WinTools/Proxy.h"
+#include <winhttp.h>
+
+// Defined by Windows SDK 10.0.14393 and later.
+#ifndef WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL
+#define WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL 133
+#define WINHTTP_PROTOCOL_FLAG_HTTP2 0x1
+#endif
+
+namespace
+{
+	/// Let WinHTTP offer HTTP/2 with ALPN. Servers that don't support it keep talking HTTP/1.1. Systems older than Windows 10 1607 reject the option, which leaves HTTP/1.1 as well.
+	/// @param session WinHTTP session handle of a client.
+	void EnableHttp2(web::http::client::native_handle session)
+	{
+		DWORD protocols = WINHTTP_PROTOCOL_FLAG_HTTP2;
+		WinHttpSetOption(session, WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL, &protocols, sizeof(protocols));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::HttpClientPool::HttpClientPool(web::http::client::http_client_config config)
+	: m_Config{ std::move(config) }
+{
+	// Options set by the caller are applied first.
+	m_Config.set_nativesessionhandle_options([userConfig = m_Config](web::http::client::native_handle session)
+	{
+		userConfig._invoke_nativesessionhandle_options(session);
+		EnableHttp2(session);
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::HttpClientPool::HttpClientPool(HttpClientPool&& other)
+{
+	*this = std::move(other);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::HttpClientPool& FSecure::HttpClientPool::operator=(HttpClientPool&& other)
+{
+	if (this != &other)
+	{
+		std::scoped_lock lock(m_AccessMutex, other.m_AccessMutex);
+		m_Config = std::move(other.m_Config);
+		m_Clients = std::move(other.m_Clients);
+	}
+
+	return *this;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+pplx::task<web::http::http_response> FSecure::HttpClientPool::Request(std::string const& url, web::http::http_request request)
+{
+	auto uri = web::uri{ utility::conversions::to_string_t(url) };
+	request.set_request_uri(uri.resource());
+	return GetClient(uri.authority())->request(std::move(request));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::HttpClientPool::Warm(std::string const& url)
+{
+	// Only the connection left open matters. If it can't be made, the first real request reports why.
+	Request(url, web::http::http_request{ web::http::methods::HEAD }).then([](pplx::task<web::http::http_response> response)
+	{
+		try
+		{
+			response.get();
+		}
+		catch (std::exception const&)
+		{
+		}
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<web::http::client::http_client> FSecure::HttpClientPool::GetClient(web::uri const& authority)
+{
+	auto key = authority.to_string();
+	std::wstring proxy;
+	bool isAutoDiscovery;
+	{
+		std::scoped_lock lock(m_AccessMutex);
+		isAutoDiscovery = m_Config.proxy().is_auto_discovery();
+	}
+
+	// Discovery is cached for the whole process and can block, so it is done without the lock. It replaces discovery done by cpprest on every request.
+	if (isAutoDiscovery)
+		proxy = WinTools::DiscoverProxy(utility::conversions::to_utf16string(key));
+
+	// Client is returned as shared pointer, so that requests don't hold the lock.
+	std::scoped_lock lock(m_AccessMutex);
+	auto& entry = m_Clients[key];
+	if (!entry.m_Client || entry.m_Proxy != proxy)
+	{
+		auto config = m_Config;
+		if (isAutoDiscovery)
+			config.set_proxy(proxy.empty() ? web::web_proxy{ web::web_proxy::disabled } : web::web_proxy{ utility::conversions::to_string_t(proxy) });
+
+		entry = { std::make_shared<web::http::client::http_client>(authority, config), std::move(proxy) };
+	}
+
+	return entry.m_Client;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Common/CppRestSdk/include/cpprest/http_client.h"
+
+namespace FSecure
+{
+	/// Keeps one cpprest http_client per host, so that their connections are kept alive and reused by following requests instead of paying TCP and TLS setup every time.
+	/// Clients negotiate HTTP/2 where the server supports it, so that requests sent at once share a single connection. New connections resume TLS sessions cached by the process.
+	class HttpClientPool
+	{
+	public:
+		/// Create a pool
+		/// @param config configuration of every client created by the pool, e.g. proxy settings. Proxy set to use_auto_discovery is discovered once per host with WinTools::DiscoverProxy.
+		HttpClientPool(web::http::client::http_client_config config = {});
+
+		/// Move constructor. Clients of the other pool are taken over.
+		HttpClientPool(HttpClientPool&& other);
+
+		/// Move assignment. Clients of the other pool are taken over.
+		HttpClientPool& operator=(HttpClientPool&& other);
+
+		/// Send request using client of url's host. Can be called from many threads.
+		/// @param url absolute url. Its path, query and fragment replace request URI.
+		/// @param request request to send.
+		/// @return task returning the response.
+		pplx::task<web::http::http_response> Request(std::string const& url, web::http::http_request request);
+
+		/// Open connection to url's host ahead of the first request. Does not wait for the server, but may block on proxy discovery.
+		/// @param url absolute url. HEAD request is sent to it and its response is ignored.
+		void Warm(std::string const& url);
+
+	private:
+		/// Client of a single host.
+		struct Entry
+		{
+			std::shared_ptr<web::http::client::http_client> m_Client;												///< Client connected to the host.
+			std::wstring m_Proxy;																					///< Discovered proxy client was created with.
+		};
+
+		/// Get client of host, creating it if needed. Client is created again if proxy discovered for the host has changed.
+		/// @param authority scheme, host and port of url.
+		/// @return client connected to the host.
+		std::shared_ptr<web::http::client::http_client> GetClient(web::uri const& authority);
+
+		std::mutex m_AccessMutex;																						///< Guards m_Clients.
+		web::http::client::http_client_config m_Config;																	///< Configuration of created clients.
+		std::unordered_map<utility::string_t, Entry> m_Clients;															///< Clients by scheme, host and port.
+	};
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+namespace FSecure
+{
+	/// Lock-free queue with many producers and one consumer.
+	/// Producers push nodes onto an intrusive stack. Consumer takes the whole stack at once and reverses it, so elements are moved out in order of pushing, never copied.
+	/// @tparam T type of elements.
+	template <typename T>
+	class MpscQueue
+	{
+	public:
+		/// Default ctor.
+		MpscQueue() = default;
+
+		/// Queue owns its nodes, so it can't be copied.
+		MpscQueue(MpscQueue const&) = delete;
+
+		/// Queue owns its nodes, so it can't be copied.
+		MpscQueue& operator=(MpscQueue const&) = delete;
+
+		/// Destructor. Destroys elements that were not taken.
+		~MpscQueue()
+		{
+			for (auto node = m_Head.exchange(nullptr); node;)
+				delete std::exchange(node, node->m_Next);
+		}
+
+		/// Adds element to the queue. Can be called from any thread.
+		/// @param value element to add.
+		/// @return true if queue was empty before, which means that consumer might have to be woken up.
+		bool Push(T value)
+		{
+			auto node = new Node{ std::move(value), m_Head.load(std::memory_order_relaxed) };
+			while (!m_Head.compare_exchange_weak(node->m_Next, node, std::memory_order_release, std::memory_order_relaxed));
+			return !node->m_Next;
+		}
+
+		/// Moves all elements out of the queue. Must be called from one thread at a time.
+		/// @return elements in order of pushing.
+		std::vector<T> PopAll()
+		{
+			auto node = m_Head.exchange(nullptr, std::memory_order_acquire);
+			std::vector<T> ret;
+			for (; node; delete std::exchange(node, node->m_Next))
+				ret.push_back(std::move(node->m_Value));
+
+			std::reverse(ret.begin(), ret.end());
+			return ret;
+		}
+
+		/// @return true if there are no elements in the queue. Might be outdated when returned if producers are running.
+		bool IsEmpty() const
+		{
+			return !m_Head.load(std::memory_order_acquire);
+		}
+
+	private:
+		/// Element of intrusive stack.
+		struct Node
+		{
+			T m_Value;																										///< Stored element.
+			Node* m_Next;																									///< Element pushed before this one.
+		};
+
+		std::atomic<Node*> m_Head = nullptr;																				///< Element pushed last.
+	};
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace FSecure
+{
+	/// Bounded lock-free ring with many producers and one consumer.
+	/// Every slot carries a sequence number telling whether it is free or filled for the current lap, so producers only compete for the write position and never wait for each other or for the consumer.
+	/// @tparam T type of elements.
+	template <typename T>
+	class MpscRing
+	{
+	public:
+		/// Create ring.
+		/// @param capacity maximal number of elements. Must be a power of two.
+		/// @throws std::invalid_argument if capacity is not a power of two.
+		explicit MpscRing(std::size_t capacity)
+			: m_Mask{ capacity - 1 }
+			, m_Slots{ capacity && !(capacity & (capacity - 1)) ? std::make_unique<Slot[]>(capacity) : throw std::invalid_argument{ "Capacity of MpscRing must be a power of two." } }
+		{
+			for (std::size_t i = 0; i < capacity; ++i)
+				m_Slots[i].m_Sequence.store(i, std::memory_order_relaxed);
+		}
+
+		/// Ring owns its elements, so it can't be copied.
+		MpscRing(MpscRing const&) = delete;
+
+		/// Ring owns its elements, so it can't be copied.
+		MpscRing& operator=(MpscRing const&) = delete;
+
+		/// Adds element to the ring. Can be called from any thread.
+		/// @param value element to add. It is not moved from if the ring is full.
+		/// @return false if the ring is full.
+		bool TryPush(T& value) noexcept(std::is_nothrow_move_constructible_v<T>)
+		{
+			auto position = m_WritePosition.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				auto& slot = m_Slots[position & m_Mask];
+				auto lap = static_cast<std::ptrdiff_t>(slot.m_Sequence.load(std::memory_order_acquire) - position);
+				if (lap < 0)
+					return false;
+
+				if (lap > 0)
+					position = m_WritePosition.load(std::memory_order_relaxed);
+				else if (m_WritePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					slot.m_Value.emplace(std::move(value));
+					slot.m_Sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+		}
+
+		/// Takes the oldest element. Must be called from one thread at a time.
+		/// @return element or std::nullopt if the ring is empty or the oldest element is still being written.
+		std::optional<T> TryPop()
+		{
+			auto& slot = m_Slots[m_ReadPosition & m_Mask];
+			if (slot.m_Sequence.load(std::memory_order_acquire) != m_ReadPosition + 1)
+				return std::nullopt;
+
+			auto ret = std::move(slot.m_Value);
+			slot.m_Value.reset();
+			slot.m_Sequence.store(m_ReadPosition + m_Mask + 1, std::memory_order_release);
+			++m_ReadPosition;
+			return ret;
+		}
+
+	private:
+		/// Storage of one element.
+		struct Slot
+		{
+			std::atomic<std::size_t> m_Sequence;																		///< Position of the element to be written next if slot is free, position + 1 if it is filled.
+			std::optional<T> m_Value;																					///< Stored element.
+		};
+
+		std::size_t m_Mask;																								///< Capacity - 1. Maps positions to slots.
+		std::unique_ptr<Slot[]> m_Slots;																				///< Storage of elements.
+		alignas(64) std::atomic<std::size_t> m_WritePosition = 0;														///< Total number of elements claimed by producers.
+		alignas(64) std::size_t m_ReadPosition = 0;																		///< Total number of elements taken by the consumer.
+	};
+}
@@ -1,4 +1,6 @@
 #pragma once
+#include <mutex>
+#include <optional>
 #include "ByteConverter/ByteConverter.h"
 #include "Encryption.h"
 
@@ -64,21 +66,24 @@ namespace FSecure
 		/// @param idx. Index of accessed element.
 		/// @returns ByteVector. Accessed element.
 		ByteVector operator[](uint32_t idx) const
+		{
+			return ByteVector{ View(idx) };
+		}
+
+		/// Access elements stored in payload without copying them.
+		/// Element is decrypted on first access and kept for the lifetime of the payload.
+		/// @param idx. Index of accessed element.
+		/// @returns ByteView. Accessed element.
+		ByteView View(uint32_t idx) const
 		{
 			if (idx >= Size())
 				throw std::out_of_range{OBF("Out of range access. Size: ") + std::to_string(Size()) + OBF(" Index: ") + std::to_string(idx)};
 
-			auto bv = ByteView{ reinterpret_cast<const uint8_t*>(m_Payload) + PrefixSize(), RawSize() - PrefixSize() };
-			for (uint32_t i = 0; i < Size(); ++i)
-			{
-				auto currentSize = bv.Read<uint32_t>();
-				if (i == idx)
-					return Encryption::RC4(bv.SubString(0, currentSize), Key());
-
-				bv.remove_prefix(currentSize);
-			}
+			std::lock_guard lock{ m_DecryptedMutex };
+			if (!m_Decrypted[idx])
+				m_Decrypted[idx] = Encryption::RC4(m_Elements[idx], Key());
 
-			throw std::logic_error{ OBF("Function should not reach end of the loop.") };
+			return *m_Decrypted[idx];
 		}
 
 		/// Find all elements for which unaryPredicate evaluates to true.
@@ -89,16 +94,9 @@ namespace FSecure
 		std::vector<ByteVector> FindMatching(uint32_t begin = 0, uint32_t end = Instance().Size(), std::function<bool(ByteView)> unaryPredicate = [](ByteView) {return true; })
 		{
 			std::vector<ByteVector> ret;
-			auto bv = ByteView{ reinterpret_cast<const uint8_t*>(m_Payload) + PrefixSize(), RawSize() - PrefixSize() };
-			for (uint32_t i = 0; i < std::min(end, Size()); ++i)
-			{
-				auto currentSize = bv.Read<uint32_t>();
-				if (i >= begin)
-					if (auto current = Encryption::RC4(bv.SubString(0, currentSize), Key()); unaryPredicate(current))
-						ret.push_back(std::move(current));
-
-				bv.remove_prefix(currentSize);
-			}
+			for (uint32_t i = begin; i < std::min(end, Size()); ++i)
+				if (auto current = View(i); unaryPredicate(current))
+					ret.emplace_back(current);
 
 			return ret;
 		}
@@ -111,10 +109,22 @@ namespace FSecure
 			// When m_Payload is used directly this `if` is optimized away (into branchless throw) in Release builds with enabled InlineFunctionExpansion
 			if (!payloadBuffer[PrefixSize() - 1]) // Ensure that payload was set before use.
 				throw std::logic_error{ OBF("Payload was declared but never set.") };
+
+			// Walk length-prefixed elements once, so that accessing any of them doesn't have to.
+			auto bv = ByteView{ reinterpret_cast<const uint8_t*>(m_Payload) + PrefixSize(), RawSize() - PrefixSize() };
+			m_Elements.reserve(Size());
+			for (uint32_t i = 0; i < Size(); ++i)
+				m_Elements.push_back(bv.Read<ByteView>());
+
+			m_Decrypted.resize(Size());
 		}
 
 		/// Underlying data.
 		constexpr static char m_Payload[sizeof(FSECURE_PAYLOAD_GUID) + N] = FSECURE_PAYLOAD_GUID;
+
+		std::vector<ByteView> m_Elements;																				///< Encrypted elements, pointing inside m_Payload.
+		mutable std::vector<std::optional<ByteVector>> m_Decrypted;														///< Elements decrypted so far.
+		mutable std::mutex m_DecryptedMutex;																			///< Guards m_Decrypted.
 	};
 }
 
@@ -8,6 +8,7 @@
 #include <functional>																									//< For std::function.
 #include <filesystem>																									//< For std::filesystem::path.
 #include <mutex>																										//< For std::mutex.
+#include <shared_mutex>																									//< For std::shared_mutex.
 #include <algorithm>																									//< For std:find, std:find_if, etc.
 #include <iso646.h>																										//< For alternative logical operators tokens.
 #include <random>																										//< For random values.
@@ -15,6 +16,8 @@
 #include "Common/ADVobfuscator/MetaString.h"
 
 #define BYTEVECTOR_ZERO_MEMORY_DESTRUCTION																				//< Increase OpSec by clearing memory when ByteVector is destructed.
+#define BYTEVECTOR_POOLED_ALLOCATION																					//< Recycle ByteVector buffers between threads. Pool clears memory whenever a buffer is released.
+#define BYTEVECTOR_PRIVATE_HEAP																							//< Take memory of pooled ByteVector buffers from a heap apart from the host process' allocations.
 #include "ByteConverter/ByteConverter.h"																				//< For ByteView, ByteVector and ByteConverter specializations for common types.
 #include "Utils.h"																										//< For common templates and helpers
 
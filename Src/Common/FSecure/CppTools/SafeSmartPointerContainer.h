@@ -3,15 +3,27 @@
 namespace FSecure
 {
 	/// Container with multi-threaded synchronization.
-	template<typename T>
+	/// Optimized for frequent reads: readers work on an immutable snapshot of the Container obtained with a single atomic load, so they never wait for writers and never allocate.
+	/// Writers are serialized, copy the snapshot, modify the copy and publish it.
+	/// @tparam WriteMutex mutex serializing writers, e.g. a profiled one to measure their contention.
+	template<typename T, typename WriteMutex = std::mutex>
 	struct SafeSmartPointerContainer
 	{
+		/// Create an empty container.
+		/// @param mutexArguments arguments of the writers' mutex constructor, e.g. name of its lock site.
+		template <typename... MutexArguments>
+		explicit SafeSmartPointerContainer(MutexArguments&&... mutexArguments)
+			: m_WriteMutex(std::forward<MutexArguments>(mutexArguments)...)
+		{
+		}
+
 		/// Enumerates over elements.
 		/// @param comparator function that returns true to keep iterate or false to stop.
-		void For(std::function<bool(T const&)> comparator) const
+		template<typename Comparator>
+		void For(Comparator comparator) const
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);																		// Request access to the underlying Container.
-			for (auto element : m_Container)
+			auto snapshot = GetSnapshot();
+			for (auto const& element : *snapshot)
 				if (!comparator(element))
 					return;
 		}
@@ -19,11 +31,12 @@ namespace FSecure
 		/// Finds Element using provided comparator.
 		/// @param comparator function that returns true for requested Element.
 		/// @return Element if existed, otherwise null.
-		T Find(std::function<bool(T const&)> comparator) const
+		template<typename Comparator>
+		T Find(Comparator comparator) const
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);																		// Request access to the underlying Container.
-			auto it = std::find_if(m_Container.begin(), m_Container.end(), comparator);									// Find specified Element...
-			return it == std::end(m_Container) ? T{} : *it;																// ...and return it (or null if it couldn't be found).
+			auto snapshot = GetSnapshot();
+			auto it = std::find_if(snapshot->begin(), snapshot->end(), comparator);										// Find specified Element...
+			return it == snapshot->end() ? T{} : *it;																	// ...and return it (or null if it couldn't be found).
 		}
 
 		/// Adds a new Element.
@@ -33,9 +46,11 @@ namespace FSecure
 		template <typename... Args>
 		T Add(Args&& ... args)
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);																		// Request access to the underlying Container.
-			m_Container.emplace_back(args...);																			// Add it at the end.
-			return m_Container.back();
+			return Modify([&](Container& container)
+				{
+					container.emplace_back(std::forward<Args>(args)...);												// Add it at the end.
+					return container.back();
+				});
 		}
 
 		/// Adds an Element, but throws if Element is already in the container.
@@ -44,31 +59,37 @@ namespace FSecure
 		/// @tparam args constructor arguments.
 		/// @return newly added Element.
 		/// @throw std::invalid_argument if Element is already stored.
-		template <typename... Args>
-		T TryAdd(std::function<bool(T const&)> comparator, Args&& ... args)
+		template <typename Comparator, typename... Args>
+		T TryAdd(Comparator comparator, Args&& ... args)
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);																		// Request access to the underlying Container.
-			if (auto it = std::find_if(m_Container.begin(), m_Container.end(), comparator); it != m_Container.end())	// Find element...
-				throw std::invalid_argument{ OBF("Tried to add an existing Element to the container.") };					// ...and throw.
+			return Modify([&](Container& container)
+				{
+					if (auto it = std::find_if(container.begin(), container.end(), comparator); it != container.end())	// Find element...
+						throw std::invalid_argument{ OBF("Tried to add an existing Element to the container.") };		// ...and throw.
 
-			m_Container.emplace_back(std::forward<Args>(args)...);														// Otherwise add it at the end.
-			return m_Container.back();
+					container.emplace_back(std::forward<Args>(args)...);												// Otherwise add it at the end.
+					return container.back();
+				});
 		}
 
 		/// Finds provided Element or adds it if not found.
 		/// @tparam Args constructor arguments.
 		/// @param comparator function that returns true for requested Element.
 		/// @tparam args constructor arguments.
-		/// @param element an element to be added.
-		template <typename... Args>
-		T Ensure(std::function<bool(T const&)> comparator, Args&& ... args)
+		template <typename Comparator, typename... Args>
+		T Ensure(Comparator comparator, Args&& ... args)
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);																		// Request access to the underlying Container.
-			if (auto it = std::find(m_Container.begin(), m_Container.end(), element); it != m_Container.end())			// Find element...
-				return *it;																								// ...and return it.
+			if (auto element = Find(comparator); element)
+				return element;
+
+			return Modify([&](Container& container)
+				{
+					if (auto it = std::find_if(container.begin(), container.end(), comparator); it != container.end())	// Find element...
+						return *it;																						// ...and return it.
 
-			m_Container.emplace_back(std::forward<Args>(args)...);														// Otherwise add it at the end.
-			return m_Container.back();
+					container.emplace_back(std::forward<Args>(args)...);												// Otherwise add it at the end.
+					return container.back();
+				});
 		}
 
 		/// Removes an Elements.
@@ -76,23 +97,28 @@ namespace FSecure
 		/// @throw std::invalid_argument on an attempt of removal of a non-existent Element.
 		void Remove(T const& element)
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);																		// Request access to the underlying Container.
-			if (auto it = std::find(m_Container.begin(), m_Container.end(), element); it != m_Container.end())			// Find element...
-				m_Container.erase(it);																					// ...and remove it.
-			else
-				throw std::invalid_argument{ OBF("Attempted to remove a non-existent Element.") };
+			Modify([&](Container& container)
+				{
+					if (auto it = std::find(container.begin(), container.end(), element); it != container.end())		// Find element...
+						container.erase(it);																			// ...and remove it.
+					else
+						throw std::invalid_argument{ OBF("Attempted to remove a non-existent Element.") };
+				});
 		}
 
 		/// Removes an Element using provided comparator.
 		/// @param comparator function that returns true for requested Element.
 		/// @throw std::invalid_argument on an attempt of removal of a non-existent Element.
-		void Remove(std::function<bool(T const&)> comparator)
+		template<typename Comparator, typename = std::enable_if_t<std::is_invocable_r_v<bool, Comparator, T const&>>>
+		void Remove(Comparator comparator)
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);																		// Request access to the underlying Container.
-			if (auto it = std::find_if(m_Container.begin(), m_Container.end(), comparator); it != m_Container.end())	// Find specified Element...
-				m_Container.erase(it);																					// ...and remove it.
-			else
-				throw std::invalid_argument{ OBF("Attempted to remove a non-existent Element.") };
+			Modify([&](Container& container)
+				{
+					if (auto it = std::find_if(container.begin(), container.end(), comparator); it != container.end())	// Find specified Element...
+						container.erase(it);																			// ...and remove it.
+					else
+						throw std::invalid_argument{ OBF("Attempted to remove a non-existent Element.") };
+				});
 		}
 
 		/// Removes all elements matching the predicate
@@ -100,50 +126,85 @@ namespace FSecure
 		template<typename Predicate>
 		void RemoveIf(Predicate predicate)
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);
-			m_Container.erase(std::remove_if(begin(m_Container), end(m_Container), predicate), end(m_Container));
+			Modify([&](Container& container)
+				{
+					container.erase(std::remove_if(begin(container), end(container), predicate), end(container));
+				});
 		}
 
 		/// Same as Remove, but returns the element removed from the container.
 		/// @param comparator function that returns true for requested Element.
 		/// @return Copy of the element that was requested to be removed.
 		/// @throw std::invalid_argument on an attempt of removal of a non-existent Element.
-		T Retrieve(std::function<bool(T const&)> comparator)
+		template<typename Comparator>
+		T Retrieve(Comparator comparator)
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);																		// Request access to the underlying Container.
-			if (auto it = std::find_if(m_Container.begin(), m_Container.end(), comparator); it != m_Container.end())	// Find specified Element...
-			{
-				auto element = std::move(*it);																			// ...move it...
-				m_Container.erase(it);																					// ...remove...
-				return std::move(element);																				// ...and return it.
-			}
-			else
-				throw std::invalid_argument{ OBF("Attempted to remove a non-existent Element.") };
+			return Modify([&](Container& container)
+				{
+					if (auto it = std::find_if(container.begin(), container.end(), comparator); it != container.end())	// Find specified Element...
+					{
+						auto element = std::move(*it);																	// ...move it...
+						container.erase(it);																			// ...remove...
+						return element;																					// ...and return it.
+					}
+					else
+						throw std::invalid_argument{ OBF("Attempted to remove a non-existent Element.") };
+				});
 		}
 
 		/// Gets element quantity.
 		/// @return number of elements in the container.
 		size_t GetSize() const
 		{
-			return m_Container.size();
+			return GetSnapshot()->size();
 		}
 
 		/// Checks if the container has any elements.
 		/// @return true if the container is empty.
 		bool IsEmpty() const
 		{
-			return m_Container.empty();
+			return GetSnapshot()->empty();
 		}
 
 		/// Clear whole container.
 		void Clear()
 		{
-			std::scoped_lock<std::mutex> lock(m_AccessMutex);
-			m_Container.clear();
+			Modify([](Container& container) { container.clear(); });
 		}
 
 	private:
-		mutable std::mutex m_AccessMutex;																				///< Mutex for synchronization.
-		std::vector<T> m_Container;																						///< Table of all Elements.
+		/// Underlying container type.
+		using Container = std::vector<T>;
+
+		/// Gets current state of the container.
+		/// @return immutable snapshot that stays valid even if the container is modified.
+		std::shared_ptr<const Container> GetSnapshot() const
+		{
+			return std::atomic_load(&m_Snapshot);
+		}
+
+		/// Applies modification to a copy of the current snapshot and publishes it. Nothing is published if modification throws.
+		/// @param modification function called with a copy of the container.
+		/// @return value returned by modification.
+		template<typename Modification>
+		auto Modify(Modification modification)
+		{
+			std::scoped_lock<WriteMutex> lock(m_WriteMutex);															// Serialize writers.
+			auto copy = std::make_shared<Container>(*m_Snapshot);
+			if constexpr (std::is_void_v<decltype(modification(*copy))>)
+			{
+				modification(*copy);
+				std::atomic_store(&m_Snapshot, std::shared_ptr<const Container>{ std::move(copy) });
+			}
+			else
+			{
+				auto ret = modification(*copy);
+				std::atomic_store(&m_Snapshot, std::shared_ptr<const Container>{ std::move(copy) });
+				return ret;
+			}
+		}
+
+		WriteMutex m_WriteMutex;																						///< Mutex for synchronization of writers.
+		std::shared_ptr<const Container> m_Snapshot = std::make_shared<Container>();									///< Current state of the Table of all Elements.
 	};
 }
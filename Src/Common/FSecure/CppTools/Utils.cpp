@@ -0,0 +1,53 @@
+#include "StdAfx.h"
+#include "Utils.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::Utils::GenerateSecureRandomData(void* buffer, size_t size)
+{
+	randombytes_buf(buffer, size);
+}
+
+#if defined BYTEVECTOR_PRIVATE_HEAP
+namespace
+{
+	/// @return heap used by BlockPool. Never destroyed, as blocks are released until the very end of the program.
+	HANDLE GetPrivateHeap()
+	{
+		static HANDLE heap = []
+		{
+			// Low-fragmentation front end suits many blocks of a few sizes. Process heap is used if a new one can't be created.
+			auto heap = HeapCreate(0, 0, 0);
+			if (!heap)
+				return GetProcessHeap();
+
+			ULONG lowFragmentation = 2;
+			HeapSetInformation(heap, HeapCompatibilityInformation, &lowFragmentation, sizeof(lowFragmentation));
+			return heap;
+		}();
+
+		return heap;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void* FSecure::Utils::AllocateFromPrivateHeap(size_t bytes)
+{
+	if (auto ptr = HeapAlloc(GetPrivateHeap(), 0, bytes ? bytes : 1))
+		return ptr;
+
+	throw std::bad_alloc{};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::Utils::FreeToPrivateHeap(void* ptr) noexcept
+{
+	if (ptr)
+		HeapFree(GetPrivateHeap(), 0, ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::Utils::CompactPrivateHeap() noexcept
+{
+	HeapCompact(GetPrivateHeap(), 0);
+}
+#endif
@@ -9,6 +9,10 @@
 #	define OBF(x) x
 #endif // !OBF
 
+#ifndef OBF_CACHED
+#	define OBF_CACHED(x) x
+#endif // !OBF_CACHED
+
 namespace FSecure::Utils
 {
 	/// Check if application is 64bit.
@@ -47,52 +51,54 @@ namespace FSecure::Utils
 		return (value + alignment - 1) & ~(alignment - 1);
 	}
 
-	/// Generate random string.
+	/// Fill buffer with bytes from libsodium's cryptographically secure generator. Defined in Utils.cpp, because libsodium is included after this header.
+	/// @param buffer to fill.
+	/// @param size of buffer in bytes.
+	void GenerateSecureRandomData(void* buffer, size_t size);
+
+	/// Generate random string from cryptographically secure generator.
 	/// @param size of returned string.
 	template <typename T = std::string, std::enable_if_t<std::is_same_v<T, std::string> || std::is_same_v<T, std::wstring>, int> = 0>
 	T GenerateRandomString(size_t size)
 	{
 		constexpr std::string_view charset = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
-		static std::random_device rd;
-		static std::mt19937 gen(rd());
-		static std::uniform_int_distribution<int> uni(0, static_cast<int>(charset.size() - 1));
 
+		// Bytes are drawn in bulk. Bytes past the highest multiple of charset size are skipped, so that every character is equally likely.
+		constexpr auto limit = 256 - 256 % charset.size();
 		T randomString;
-		randomString.resize(size);
-		for (auto& e : randomString)
-			e = static_cast<typename T::value_type>(charset[uni(gen)]);
+		randomString.reserve(size);
+		uint8_t buffer[64];
+		while (randomString.size() < size)
+		{
+			GenerateSecureRandomData(buffer, sizeof(buffer));
+			for (size_t i = 0; i < sizeof(buffer) && randomString.size() < size; ++i)
+				if (buffer[i] < limit)
+					randomString.push_back(static_cast<typename T::value_type>(charset[buffer[i] % charset.size()]));
+		}
 
 		return randomString;
 	}
 
-	/// Generate random data.
+	/// Generate random data from cryptographically secure generator.
 	/// @param size of returned string.
 	template <typename T = std::vector<uint8_t>, std::enable_if_t<std::is_same_v<T, std::string> || std::is_same_v<T, std::vector<uint8_t>>, int> = 0>
 	T GenerateRandomData(size_t size)
 	{
-		static std::random_device rd;
-		static std::mt19937_64 gen(rd());
-
 		T randomData;
-		auto alignedSize = AlignValueUp(size, sizeof(uint64_t));
-		randomData.resize(alignedSize);
-		for (size_t i = 0; i < alignedSize / sizeof(uint64_t); ++i)
-			reinterpret_cast<uint64_t&>(randomData[sizeof(uint64_t) * i]) = gen();
-
 		randomData.resize(size);
+		GenerateSecureRandomData(randomData.data(), randomData.size());
 		return randomData;
 	}
 
-	/// Generate random unsigned int value.
+	/// Generate random unsigned int value. Not suitable for secrets, use GenerateRandomData for them.
 	/// @param rangeFrom minimal allowed value.
 	/// @param rangeTo maximal allowed value.
 	/// @return random value.
 	template <typename T>
 	T GenerateRandomValue(T rangeFrom = std::numeric_limits<T>::min(), T rangeTo = std::numeric_limits<T>::max())
 	{
-		// Based on https://stackoverflow.com/a/7560564.
-		static std::random_device rd;																								//< Obtain a random number from hardware.
-		static std::mt19937 eng(rd());																								//< Seed the generator.
+		// Every thread has its own generator, so that values for jitter are cheap and need no locks.
+		static thread_local std::mt19937_64 eng(std::random_device{}());															//< Seed the generator.
 		std::uniform_int_distribution<T> distr(rangeFrom, rangeTo);																	//< Define the range.
 
 		return distr(eng);
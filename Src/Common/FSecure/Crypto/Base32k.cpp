@@ -0,0 +1,117 @@
+#include "StdAfx.h"
+#include "Base32k.h"
+
+namespace
+{
+	/// Ranges of code points used as digits, in order. Only characters assigned since Unicode 4.1 are used.
+	constexpr std::pair<char32_t, char32_t> s_Ranges[] = { { 0x3400, 0x4DB5 }, { 0x4E00, 0x9FA5 }, { 0xAC00, 0xD7A3 } };
+
+	/// Digits carrying full 15 bits. Following 128 digits are used for the last character carrying 7 bits or less.
+	constexpr uint32_t s_FullDigits = 1 << 15;
+
+	/// Get code point of a digit.
+	/// @param digit value in range [0, s_FullDigits + 128).
+	/// @return code point.
+	char32_t ToCodePoint(uint32_t digit)
+	{
+		for (auto [first, last] : s_Ranges)
+		{
+			if (digit <= last - first)
+				return first + digit;
+
+			digit -= last - first + 1;
+		}
+
+		throw std::logic_error{ OBF("Base32k digit out of range") };
+	}
+
+	/// Get digit of a code point.
+	/// @param codePoint decoded character.
+	/// @return digit.
+	/// @throws std::invalid_argument if character is not a digit.
+	uint32_t ToDigit(char32_t codePoint)
+	{
+		uint32_t offset = 0;
+		for (auto [first, last] : s_Ranges)
+		{
+			if (codePoint >= first && codePoint <= last)
+				return offset + codePoint - first;
+
+			offset += last - first + 1;
+		}
+
+		throw std::invalid_argument{ OBF("Invalid Base32k character") };
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::Base32k::Encode(ByteView data)
+{
+	std::string ret;
+	ret.reserve(EncodedSize(data.size()) * 3);
+	auto append = [&ret](uint32_t digit)
+	{
+		// All digits are in Basic Multilingual Plane above U+0800, so they take three bytes in UTF-8.
+		auto codePoint = ToCodePoint(digit);
+		ret.push_back(static_cast<char>(0xE0 | (codePoint >> 12)));
+		ret.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+		ret.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+	};
+
+	uint32_t buffer = 0, bits = 0;
+	for (auto byte : data)
+	{
+		buffer = (buffer << 8) | byte;
+		bits += 8;
+		if (bits >= 15)
+		{
+			bits -= 15;
+			append((buffer >> bits) & (s_FullDigits - 1));
+		}
+	}
+
+	if (bits > 7)
+		append((buffer << (15 - bits)) & (s_FullDigits - 1));
+	else if (bits)
+		append(s_FullDigits + ((buffer << (7 - bits)) & 0x7F));
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::Base32k::Decode(std::string_view text)
+{
+	ByteVector ret;
+	ret.reserve(DecodedMaxSize(text.size() / 3));
+
+	uint32_t buffer = 0, bits = 0;
+	for (size_t i = 0; i < text.size(); i += 3)
+	{
+		if (text.size() - i < 3 || (text[i] & 0xF0) != 0xE0 || (text[i + 1] & 0xC0) != 0x80 || (text[i + 2] & 0xC0) != 0x80)
+			throw std::invalid_argument{ OBF("Invalid Base32k character") };
+
+		auto digit = ToDigit(static_cast<char32_t>(((text[i] & 0x0F) << 12) | ((text[i + 1] & 0x3F) << 6) | (text[i + 2] & 0x3F)));
+		if (digit < s_FullDigits)
+		{
+			buffer = (buffer << 15) | digit;
+			bits += 15;
+		}
+		else if (digit < s_FullDigits + 0x80 && i + 3 == text.size())
+		{
+			buffer = (buffer << 7) | (digit - s_FullDigits);
+			bits += 7;
+		}
+		else
+		{
+			throw std::invalid_argument{ OBF("Invalid Base32k character") };
+		}
+
+		// Bits left over after the last character are padding.
+		for (; bits >= 8; bits -= 8)
+			ret.push_back(static_cast<uint8_t>(buffer >> (bits - 8)));
+
+		buffer &= (1 << bits) - 1;
+	}
+
+	return ret;
+}
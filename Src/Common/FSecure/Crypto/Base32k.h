@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Common/FSecure/CppTools/ByteConverter/ByteView.h"
+
+/// Text encoding storing 15 bits in every character, for channels limited by number of characters rather than bytes.
+/// Characters are CJK ideographs and Hangul syllables, which are letters for every text processor, so they are never escaped, normalized or turned into links.
+/// The last character comes from a separate set if it carries 7 bits or less, so that decoded size is known without padding.
+namespace FSecure::Base32k
+{
+	/// Get number of characters needed to encode data.
+	/// @param size number of bytes to encode.
+	/// @return number of characters of encoded text.
+	constexpr size_t EncodedSize(size_t size)
+	{
+		return (size * 8 + 14) / 15;
+	}
+
+	/// Get number of bytes that fit in text of given length.
+	/// @param size number of characters.
+	/// @return maximal number of bytes that can be encoded.
+	constexpr size_t DecodedMaxSize(size_t size)
+	{
+		return size * 15 / 8;
+	}
+
+	/// Encode data.
+	/// @param data bytes to encode.
+	/// @return UTF-8 text.
+	std::string Encode(ByteView data);
+
+	/// Decode text created by Encode.
+	/// @param text UTF-8 text.
+	/// @return decoded bytes.
+	/// @throws std::invalid_argument if text is not valid Base32k.
+	ByteVector Decode(std::string_view text);
+}
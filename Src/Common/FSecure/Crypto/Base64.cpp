@@ -0,0 +1,277 @@
+#include "StdAfx.h"
+#include "Base64.h"
+
+#include <intrin.h>
+#include <immintrin.h>
+
+namespace
+{
+	/// Digits in order of their values.
+	constexpr char s_Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	/// Marks characters outside of the alphabet in s_Values.
+	constexpr uint8_t s_Invalid = 0xFF;
+
+	/// Values of digits by character.
+	constexpr auto s_Values = []
+	{
+		std::array<uint8_t, 256> values{};
+		for (auto& value : values)
+			value = s_Invalid;
+
+		for (uint8_t i = 0; i < 64; ++i)
+			values[static_cast<uint8_t>(s_Alphabet[i])] = i;
+
+		return values;
+	}();
+
+	/// Spreads every 3 bytes over 4 bytes, in order suitable for multiplications that move 6 bit indices to their own bytes.
+	alignas(16) constexpr int8_t s_EncodeShuffle[16] = { 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 };
+
+	/// Offsets from index to character, for ranges of indices: a-z, 0-9 (10 entries), +, / and A-Z.
+	alignas(16) constexpr int8_t s_EncodeOffsets[16] = { 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0 };
+
+	/// Valid high nibbles of characters, as bits, by low nibble of character.
+	alignas(16) constexpr uint8_t s_DecodeMasks[16] = { 0xA8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF0, 0x54, 0x50, 0x50, 0x50, 0x54 };
+
+	/// Bit of high nibble in s_DecodeMasks. Characters above 0x7F have none, so they are never valid.
+	alignas(16) constexpr uint8_t s_DecodeBits[16] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+	/// Offsets from character to value by high nibble of character. Offset of '/' is corrected separately, because it shares high nibble with '+'.
+	alignas(16) constexpr int8_t s_DecodeOffsets[16] = { 0, 0, 62 - '+', 52 - '0', -'A', -'A', 26 - 'a', 26 - 'a', 0, 0, 0, 0, 0, 0, 0, 0 };
+
+	/// Packs 24 bit groups, stored in 32 bit little endian integers, into 12 bytes.
+	alignas(16) constexpr int8_t s_DecodePack[16] = { 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 };
+
+	/// Instruction sets used for long data.
+	enum class Isa
+	{
+		Scalar,
+		Ssse3,
+		Avx2,
+	};
+
+	/// Get the best instruction set supported by processor and operating system.
+	/// @return instruction set.
+	Isa DetectIsa()
+	{
+		int info[4];
+		__cpuid(info, 0);
+		auto maxLeaf = info[0];
+
+		__cpuid(info, 1);
+		if (!(info[2] & (1 << 9)))
+			return Isa::Scalar;
+
+		// AVX2 needs operating system to save YMM registers too.
+		if (maxLeaf >= 7 && (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6)
+		{
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5))
+				return Isa::Avx2;
+		}
+
+		return Isa::Ssse3;
+	}
+
+	/// Get instruction set detected on first use.
+	/// @return instruction set.
+	Isa GetIsa()
+	{
+		static auto const isa = DetectIsa();
+		return isa;
+	}
+
+	/// Load table to SSE register.
+	/// @param table 16 byte table.
+	/// @return register holding the table.
+	template <typename T>
+	__m128i Load(T const (&table)[16])
+	{
+		return _mm_load_si128(reinterpret_cast<__m128i const*>(table));
+	}
+
+	/// Load table to both lanes of AVX register.
+	/// @param table 16 byte table.
+	/// @return register holding the table twice.
+	template <typename T>
+	__m256i Broadcast(T const (&table)[16])
+	{
+		return _mm256_broadcastsi128_si256(Load(table));
+	}
+
+	/// Encode 12 bytes with SSSE3.
+	/// @param in data. 16 bytes are read.
+	/// @return 16 characters.
+	__m128i EncodeSsse3(uint8_t const* in)
+	{
+		auto bytes = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(in)), Load(s_EncodeShuffle));
+		auto indices = _mm_or_si128(_mm_mulhi_epu16(_mm_and_si128(bytes, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040)), _mm_mullo_epi16(_mm_and_si128(bytes, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010)));
+
+		// Indices are turned into numbers of ranges in s_EncodeOffsets: 0 for a-z, 1-10 for 0-9, 11 for +, 12 for / and 13 for A-Z.
+		auto ranges = _mm_or_si128(_mm_subs_epu8(indices, _mm_set1_epi8(51)), _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+		return _mm_add_epi8(indices, _mm_shuffle_epi8(Load(s_EncodeOffsets), ranges));
+	}
+
+	/// Encode 24 bytes with AVX2.
+	/// @param in data. 28 bytes are read.
+	/// @return 32 characters.
+	__m256i EncodeAvx2(uint8_t const* in)
+	{
+		// Every lane encodes 12 bytes, like EncodeSsse3.
+		auto bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const*>(in))), _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + 12)), 1);
+		bytes = _mm256_shuffle_epi8(bytes, Broadcast(s_EncodeShuffle));
+		auto indices = _mm256_or_si256(_mm256_mulhi_epu16(_mm256_and_si256(bytes, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040)), _mm256_mullo_epi16(_mm256_and_si256(bytes, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010)));
+		auto ranges = _mm256_or_si256(_mm256_subs_epu8(indices, _mm256_set1_epi8(51)), _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+		return _mm256_add_epi8(indices, _mm256_shuffle_epi8(Broadcast(s_EncodeOffsets), ranges));
+	}
+
+	/// Decode 16 characters with SSSE3.
+	/// @param in text.
+	/// @param out buffer for 12 bytes. 16 bytes are written.
+	/// @return false if text contains characters outside of the alphabet.
+	bool DecodeSsse3(char const* in, uint8_t* out)
+	{
+		auto chars = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in));
+		auto high = _mm_and_si128(_mm_srli_epi32(chars, 4), _mm_set1_epi8(0x0F));
+		auto low = _mm_and_si128(chars, _mm_set1_epi8(0x0F));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_shuffle_epi8(Load(s_DecodeMasks), low), _mm_shuffle_epi8(Load(s_DecodeBits), high)), _mm_setzero_si128())))
+			return false;
+
+		auto offsets = _mm_add_epi8(_mm_shuffle_epi8(Load(s_DecodeOffsets), high), _mm_and_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('/')), _mm_set1_epi8((63 - '/') - (62 - '+'))));
+		auto values = _mm_add_epi8(chars, offsets);
+
+		// Pairs of 6 bit values are merged into 12 bits, and pairs of those into 24 bit groups.
+		auto groups = _mm_madd_epi16(_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(groups, Load(s_DecodePack)));
+		return true;
+	}
+
+	/// Decode 32 characters with AVX2.
+	/// @param in text.
+	/// @param out buffer for 24 bytes. 32 bytes are written.
+	/// @return false if text contains characters outside of the alphabet.
+	bool DecodeAvx2(char const* in, uint8_t* out)
+	{
+		// Every lane decodes 16 characters, like DecodeSsse3.
+		auto chars = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(in));
+		auto high = _mm256_and_si256(_mm256_srli_epi32(chars, 4), _mm256_set1_epi8(0x0F));
+		auto low = _mm256_and_si256(chars, _mm256_set1_epi8(0x0F));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(_mm256_shuffle_epi8(Broadcast(s_DecodeMasks), low), _mm256_shuffle_epi8(Broadcast(s_DecodeBits), high)), _mm256_setzero_si256())))
+			return false;
+
+		auto offsets = _mm256_add_epi8(_mm256_shuffle_epi8(Broadcast(s_DecodeOffsets), high), _mm256_and_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('/')), _mm256_set1_epi8((63 - '/') - (62 - '+'))));
+		auto values = _mm256_add_epi8(chars, offsets);
+		auto groups = _mm256_madd_epi16(_mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+
+		// Lanes hold 12 bytes each, which are moved next to each other.
+		auto packed = _mm256_shuffle_epi8(groups, Broadcast(s_DecodePack));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7)));
+		return true;
+	}
+
+	/// Get value of a digit.
+	/// @param digit character of the alphabet.
+	/// @return 6 bit value.
+	/// @throws std::invalid_argument if character is not a digit.
+	uint32_t ToValue(char digit)
+	{
+		auto value = s_Values[static_cast<uint8_t>(digit)];
+		if (value == s_Invalid)
+			throw std::invalid_argument{ OBF("Invalid Base64 character") };
+
+		return value;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::Base64::Encode(ByteView data)
+{
+	std::string ret(EncodedSize(data.size()), '\0');
+	auto in = data.data();
+	auto size = data.size();
+	auto out = ret.data();
+
+	// Vector loops stop early enough to never read past data.
+	auto isa = GetIsa();
+	if (isa == Isa::Avx2)
+	{
+		for (; size >= 32; in += 24, size -= 24, out += 32)
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), EncodeAvx2(in));
+
+		_mm256_zeroupper();
+	}
+
+	if (isa != Isa::Scalar)
+		for (; size >= 16; in += 12, size -= 12, out += 16)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out), EncodeSsse3(in));
+
+	for (; size >= 3; in += 3, size -= 3, out += 4)
+	{
+		auto group = static_cast<uint32_t>(in[0] << 16 | in[1] << 8 | in[2]);
+		out[0] = s_Alphabet[group >> 18];
+		out[1] = s_Alphabet[(group >> 12) & 0x3F];
+		out[2] = s_Alphabet[(group >> 6) & 0x3F];
+		out[3] = s_Alphabet[group & 0x3F];
+	}
+
+	if (size)
+	{
+		auto group = static_cast<uint32_t>(in[0] << 16 | (size > 1 ? in[1] << 8 : 0));
+		out[0] = s_Alphabet[group >> 18];
+		out[1] = s_Alphabet[(group >> 12) & 0x3F];
+		out[2] = size > 1 ? s_Alphabet[(group >> 6) & 0x3F] : '=';
+		out[3] = '=';
+	}
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::Base64::Decode(std::string_view text)
+{
+	if (text.size() % 4)
+		throw std::invalid_argument{ OBF("Invalid Base64 length") };
+
+	ByteVector ret;
+	ret.resize(DecodedMaxSize(text.size()));
+	auto in = text.data();
+	auto end = text.data() + text.size();
+	auto out = ret.data();
+
+	// Vector loops leave the last group with padding to scalar code. They write past decoded bytes, so they stop early enough to stay within the buffer.
+	auto isa = GetIsa();
+	if (isa == Isa::Avx2)
+	{
+		for (; end - in >= 48; in += 32, out += 24)
+			if (!DecodeAvx2(in, out))
+				throw std::invalid_argument{ OBF("Invalid Base64 character") };
+
+		_mm256_zeroupper();
+	}
+
+	if (isa != Isa::Scalar)
+		for (; end - in >= 24; in += 16, out += 12)
+			if (!DecodeSsse3(in, out))
+				throw std::invalid_argument{ OBF("Invalid Base64 character") };
+
+	auto padding = text.empty() || text.back() != '=' ? 0 : text[text.size() - 2] == '=' ? 2 : 1;
+	for (end -= padding ? 4 : 0; in != end; in += 4, out += 3)
+	{
+		auto group = ToValue(in[0]) << 18 | ToValue(in[1]) << 12 | ToValue(in[2]) << 6 | ToValue(in[3]);
+		out[0] = static_cast<uint8_t>(group >> 16);
+		out[1] = static_cast<uint8_t>(group >> 8);
+		out[2] = static_cast<uint8_t>(group);
+	}
+
+	if (padding)
+	{
+		auto group = ToValue(in[0]) << 18 | ToValue(in[1]) << 12 | (padding == 1 ? ToValue(in[2]) << 6 : 0);
+		*out++ = static_cast<uint8_t>(group >> 16);
+		if (padding == 1)
+			*out++ = static_cast<uint8_t>(group >> 8);
+	}
+
+	ret.resize(out - ret.data());
+	return ret;
+}
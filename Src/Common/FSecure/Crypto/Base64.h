@@ -2,3 +2,36 @@
 
 // Using CppCodec.
 #include "Common/CppCodec/base64_default_rfc4648.hpp"
+#include "Common/FSecure/CppTools/ByteConverter/ByteView.h"
+
+/// RFC 4648 Base64 with padding, for channels that carry text. Output is the same as of cppcodec::base64_rfc4648.
+/// Long data is encoded and decoded with AVX2 or SSSE3 if processor supports them, otherwise with a scalar loop.
+namespace FSecure::Base64
+{
+	/// Get number of characters needed to encode data.
+	/// @param size number of bytes to encode.
+	/// @return number of characters of encoded text, including padding.
+	constexpr size_t EncodedSize(size_t size)
+	{
+		return (size + 2) / 3 * 4;
+	}
+
+	/// Get number of bytes that fit in text of given length.
+	/// @param size number of characters.
+	/// @return maximal number of bytes that can be encoded.
+	constexpr size_t DecodedMaxSize(size_t size)
+	{
+		return size / 4 * 3;
+	}
+
+	/// Encode data.
+	/// @param data bytes to encode.
+	/// @return padded Base64 text.
+	std::string Encode(ByteView data);
+
+	/// Decode text created by Encode.
+	/// @param text padded Base64 text.
+	/// @return decoded bytes.
+	/// @throws std::invalid_argument if text is not valid Base64.
+	ByteVector Decode(std::string_view text);
+}
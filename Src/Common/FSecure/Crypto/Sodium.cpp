@@ -1,6 +1,133 @@
 #include "StdAfx.h"
 #include "Sodium.h"
 
+namespace
+{
+	using FSecure::Crypto::AeadSuite;
+
+	/// Get size of nonce written after suite by tagged AEAD suite.
+	/// @param suite XChaCha20Poly1305 or Aes256Gcm.
+	/// @return number of bytes.
+	size_t GetNonceSize(AeadSuite suite)
+	{
+		return suite == AeadSuite::Aes256Gcm ? crypto_aead_aes256gcm_NPUBBYTES : crypto_aead_xchacha20poly1305_ietf_NPUBBYTES;
+	}
+
+	/// Get number of bytes that tagged AEAD suite adds to plaintext.
+	/// @param suite XChaCha20Poly1305 or Aes256Gcm.
+	/// @return size of suite, nonce and MAC.
+	size_t GetOverhead(AeadSuite suite)
+	{
+		return sizeof(AeadSuite) + GetNonceSize(suite) + (suite == AeadSuite::Aes256Gcm ? crypto_aead_aes256gcm_ABYTES : crypto_aead_xchacha20poly1305_ietf_ABYTES);
+	}
+
+	/// Encrypt with AEAD suite that tags ciphertext: [suite][nonce][ciphertext][MAC].
+	/// @param plaintext message to encrypt. Must not overlap with ciphertext buffer.
+	/// @param key 32 byte key.
+	/// @param suite XChaCha20Poly1305 or Aes256Gcm.
+	/// @param ciphertext buffer to store encrypted message. Previous content is overwritten.
+	/// @throws std::runtime_error if suite is not available or encryption failed.
+	void SealTagged(FSecure::ByteView plaintext, std::uint8_t const* key, AeadSuite suite, FSecure::ByteVector& ciphertext)
+	{
+		if (!FSecure::Crypto::IsAvailable(suite))
+			throw std::runtime_error{ OBF("Encryption suite is not available on this CPU.") };
+
+		ciphertext.resize(plaintext.size() + GetOverhead(suite));
+		ciphertext[0] = static_cast<std::uint8_t>(suite);
+		auto nonce = ciphertext.data() + sizeof(AeadSuite), output = nonce + GetNonceSize(suite);
+		randombytes_buf(nonce, GetNonceSize(suite));
+		auto failed = suite == AeadSuite::Aes256Gcm
+			? crypto_aead_aes256gcm_encrypt(output, nullptr, plaintext.data(), plaintext.size(), nullptr, 0, nullptr, nonce, key)
+			: crypto_aead_xchacha20poly1305_ietf_encrypt(output, nullptr, plaintext.data(), plaintext.size(), nullptr, 0, nullptr, nonce, key);
+
+		if (failed)
+			throw std::runtime_error{ OBF("Encryption failed.") };
+
+		ciphertext.SetSensitive(false);
+	}
+
+	/// Get suite that message is tagged with.
+	/// Untagged XSalsa20Poly1305 messages start with random nonce, so they can look tagged. Caller falls back to XSalsa20Poly1305 if MAC doesn't match.
+	/// @param message encrypted message.
+	/// @return suite or std::nullopt if message is not tagged with a suite available on this CPU.
+	std::optional<AeadSuite> GetTaggedSuite(FSecure::ByteView message)
+	{
+		if (message.empty())
+			return std::nullopt;
+
+		auto suite = static_cast<AeadSuite>(message[0]);
+		if ((suite != AeadSuite::XChaCha20Poly1305 && suite != AeadSuite::Aes256Gcm) || !FSecure::Crypto::IsAvailable(suite) || message.size() < GetOverhead(suite))
+			return std::nullopt;
+
+		return suite;
+	}
+
+	/// Decrypt message written by SealTagged.
+	/// @param message encrypted message. At least GetOverhead(suite) bytes long.
+	/// @param key 32 byte key.
+	/// @param suite suite returned by GetTaggedSuite.
+	/// @param plaintext destination for message.size() - GetOverhead(suite) bytes. Can point to ciphertext inside message. Zeroed if MAC doesn't match.
+	/// @return false if MAC doesn't match.
+	bool OpenTagged(FSecure::ByteView message, std::uint8_t const* key, AeadSuite suite, std::uint8_t* plaintext)
+	{
+		auto nonce = message.data() + sizeof(AeadSuite), ciphertext = nonce + GetNonceSize(suite);
+		auto size = message.size() - sizeof(AeadSuite) - GetNonceSize(suite);
+		return !(suite == AeadSuite::Aes256Gcm
+			? crypto_aead_aes256gcm_decrypt(plaintext, nullptr, nullptr, ciphertext, size, nullptr, 0, nonce, key)
+			: crypto_aead_xchacha20poly1305_ietf_decrypt(plaintext, nullptr, nullptr, ciphertext, size, nullptr, 0, nonce, key));
+	}
+
+	static_assert(crypto_aead_aes256gcm_KEYBYTES == crypto_secretbox_KEYBYTES && crypto_aead_xchacha20poly1305_ietf_KEYBYTES == crypto_secretbox_KEYBYTES
+		&& crypto_kx_SESSIONKEYBYTES == crypto_secretbox_KEYBYTES, "Symmetric and session keys must fit every AEAD suite.");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::Crypto::Sodium::IsAvailable(AeadSuite suite) noexcept
+{
+	// CPU features are detected by sodium_init. It is safe to call it many times.
+	static auto const isAes256GcmAvailable = sodium_init() >= 0 && crypto_aead_aes256gcm_is_available();
+	switch (suite)
+	{
+	case AeadSuite::XSalsa20Poly1305:
+	case AeadSuite::XChaCha20Poly1305:
+		return true;
+	case AeadSuite::Aes256Gcm:
+		return isAes256GcmAvailable;
+	default:
+		return false;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::Crypto::Sodium::AeadSuite FSecure::Crypto::Sodium::GetFastestAeadSuite() noexcept
+{
+	return IsAvailable(AeadSuite::Aes256Gcm) ? AeadSuite::Aes256Gcm : AeadSuite::XChaCha20Poly1305;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::Crypto::Sodium::GetName(AeadSuite suite)
+{
+	switch (suite)
+	{
+	case AeadSuite::XChaCha20Poly1305:
+		return OBF("xchacha20poly1305");
+	case AeadSuite::Aes256Gcm:
+		return OBF("aes256gcm");
+	default:
+		return OBF("xsalsa20poly1305");
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::Crypto::Sodium::AeadSuite FSecure::Crypto::Sodium::ParseAeadSuite(std::string_view name)
+{
+	for (auto suite : { AeadSuite::XSalsa20Poly1305, AeadSuite::XChaCha20Poly1305, AeadSuite::Aes256Gcm })
+		if (name == GetName(suite))
+			return suite;
+
+	throw std::invalid_argument{ OBF_STR("Unknown encryption suite: ") + std::string{ name } + OBF(".") };
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::Crypto::Sodium::AsymmetricKeys FSecure::Crypto::Sodium::GenerateAsymmetricKeys()
 {
@@ -32,33 +159,101 @@ FSecure::Crypto::Sodium::SymmetricKey FSecure::Crypto::Sodium::GenerateSymmetric
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::Crypto::Sodium::EncryptAnonymously(ByteView plaintext, SymmetricKey const& key)
 {
+	ByteVector encryptedMessage;
+	EncryptAnonymously(plaintext, key, encryptedMessage);
+	return encryptedMessage;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::Crypto::Sodium::DecryptFromAnonymous(ByteView message, SymmetricKey const& key)
+{
+	ByteVector decryptedMessage;
+	DecryptFromAnonymous(message, key, decryptedMessage);
+	return decryptedMessage;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::Crypto::Sodium::EncryptAnonymously(ByteView plaintext, SymmetricKey const& key, ByteVector& ciphertext, AeadSuite suite)
+{
+	if (suite != AeadSuite::XSalsa20Poly1305)
+		return SealTagged(plaintext, key.data(), suite, ciphertext);
+
 	Nonce<true> nonce;
-	ByteVector encryptedMessage(plaintext.size() + crypto_secretbox_MACBYTES + Nonce<true>::Size);
+	ciphertext.resize(Nonce<true>::Size + crypto_secretbox_MACBYTES + plaintext.size());
 
-	// Perpend ciphertext with nonce.
-	memcpy(encryptedMessage.data(), nonce, Nonce<true>::Size);
-	if (crypto_secretbox_easy(encryptedMessage.data() + Nonce<true>::Size, plaintext.data(), plaintext.size(), nonce, key.data()))
+	// Layout is the same as of crypto_secretbox_easy: [nonce][MAC][ciphertext].
+	memcpy(ciphertext.data(), nonce, Nonce<true>::Size);
+	auto mac = ciphertext.data() + Nonce<true>::Size;
+	if (crypto_secretbox_detached(mac + crypto_secretbox_MACBYTES, mac, plaintext.data(), plaintext.size(), nonce, key.data()))
 		throw std::runtime_error{ OBF("Encryption failed.") };
 
-	return encryptedMessage;
+	// Ciphertext is safe to leave in memory. Buffer is only marked after growing, so that memory it held before is still zeroed.
+	ciphertext.SetSensitive(false);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-FSecure::ByteVector FSecure::Crypto::Sodium::DecryptFromAnonymous(ByteView message, SymmetricKey const& key)
+FSecure::Crypto::Sodium::AeadSuite FSecure::Crypto::Sodium::DecryptFromAnonymous(ByteView message, SymmetricKey const& key, ByteVector& plaintext)
 {
-	// Sanity check.
+	if (auto suite = TryDecryptFromAnonymous(message, key, plaintext))
+		return *suite;
+
 	if (message.size() < Nonce<true>::Size + crypto_secretbox_MACBYTES)
 		throw std::invalid_argument{ OBF("Ciphertext too short.") };
 
-	// Retrieve nonce.
-	auto nonce = message.SubString(0, Nonce<true>::Size), ciphertext = message.SubString(Nonce<true>::Size);
+	throw std::runtime_error{ OBF("Message forged.") };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::Crypto::Sodium::AeadSuite> FSecure::Crypto::Sodium::TryDecryptFromAnonymous(ByteView message, SymmetricKey const& key, ByteVector& plaintext)
+{
+	if (auto suite = GetTaggedSuite(message))
+	{
+		plaintext.resize(message.size() - GetOverhead(*suite));
+		if (OpenTagged(message, key.data(), *suite, plaintext.data()))
+			return *suite;
+	}
+
+	// Sanity check.
+	if (message.size() < Nonce<true>::Size + crypto_secretbox_MACBYTES)
+		return {};
+
+	// Retrieve nonce and MAC.
+	auto nonce = message.data(), mac = nonce + Nonce<true>::Size, ciphertext = mac + crypto_secretbox_MACBYTES;
+	auto size = message.size() - Nonce<true>::Size - crypto_secretbox_MACBYTES;
 
 	// Decrypt.
-	ByteVector decryptedMessage(ciphertext.size() - crypto_secretbox_MACBYTES);
-	if (crypto_secretbox_open_easy(decryptedMessage.data(), ciphertext.data(), ciphertext.size(), nonce.data(), key.data()))
+	plaintext.resize(size);
+	if (crypto_secretbox_open_detached(plaintext.data(), ciphertext, mac, size, nonce, key.data()))
+		return {};
+
+	return AeadSuite::XSalsa20Poly1305;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteView FSecure::Crypto::Sodium::DecryptFromAnonymousInPlace(ByteVector& message, SymmetricKey const& key)
+{
+	// Sanity check.
+	auto suite = GetTaggedSuite(message);
+	if (!suite && message.size() < Nonce<true>::Size + crypto_secretbox_MACBYTES)
+		throw std::invalid_argument{ OBF("Ciphertext too short.") };
+
+	// Received ciphertext may skip zeroing, plaintext written over it may not.
+	message.SetSensitive(true);
+
+	// libsodium allows plaintext to be written over the ciphertext. XSalsa20Poly1305 is tried first, because it leaves ciphertext intact if MAC doesn't match, and AEAD suites zero it.
+	if (message.size() >= Nonce<true>::Size + crypto_secretbox_MACBYTES)
+	{
+		auto nonce = message.data(), mac = nonce + Nonce<true>::Size, ciphertext = mac + crypto_secretbox_MACBYTES;
+		auto size = message.size() - Nonce<true>::Size - crypto_secretbox_MACBYTES;
+		if (!crypto_secretbox_open_detached(ciphertext, ciphertext, mac, size, nonce, key.data()))
+			return ByteView{ message }.SubString(Nonce<true>::Size + crypto_secretbox_MACBYTES);
+	}
+
+	auto offset = suite ? sizeof(AeadSuite) + GetNonceSize(*suite) : 0;
+	if (!suite || !OpenTagged(message, key.data(), *suite, message.data() + offset))
 		throw std::runtime_error{ OBF("Message forged.") };
 
-	return decryptedMessage;
+	return ByteView{ message }.SubString(offset, message.size() - GetOverhead(*suite));
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -68,7 +263,7 @@ FSecure::ByteVector FSecure::Crypto::Sodium::EncryptAnonymously(ByteView plainte
 	if (crypto_box_seal(ciphertext.data(), plaintext.data(), plaintext.size(), encryptionKey.data()))
 		throw std::runtime_error{ OBF("Encryption failed.") };
 
-	return ciphertext;
+	return std::move(ciphertext.SetSensitive(false));
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -108,7 +303,7 @@ FSecure::ByteVector FSecure::Crypto::Sodium::EncryptAndAuthenticate(ByteView pla
 	if (crypto_box_easy(encryptedMessage.data() + Nonce<false>::Size, plaintext.data(), plaintext.size(), nonce, theirPublicKey.data(), myPrivateKey.data()))
 		throw std::runtime_error{ OBF("Encryption failed.") };
 
-	return encryptedMessage;
+	return std::move(encryptedMessage.SetSensitive(false));
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -129,6 +324,48 @@ FSecure::ByteVector FSecure::Crypto::Sodium::DecryptAndAuthenticate(ByteView mes
 	return decryptedMessage;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::Crypto::Sodium::SharedKey FSecure::Crypto::Sodium::PrecomputeSharedKey(PublicKey const& theirPublicKey, PrivateKey const& myPrivateKey)
+{
+	ByteVector sharedKey(SharedKey::Size);
+	if (crypto_box_beforenm(sharedKey.data(), theirPublicKey.data(), myPrivateKey.data()))
+		throw std::runtime_error{ OBF("Shared key computation failed.") };
+
+	return sharedKey;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::Crypto::Sodium::EncryptAndAuthenticate(ByteView plaintext, SharedKey const& sharedKey)
+{
+	Nonce<false> nonce;
+	ByteVector encryptedMessage(plaintext.size() + crypto_box_MACBYTES + Nonce<false>::Size);
+
+	// Perpend ciphertext with nonce.
+	memcpy(encryptedMessage.data(), nonce, Nonce<false>::Size);
+	if (crypto_box_easy_afternm(encryptedMessage.data() + Nonce<false>::Size, plaintext.data(), plaintext.size(), nonce, sharedKey.data()))
+		throw std::runtime_error{ OBF("Encryption failed.") };
+
+	return std::move(encryptedMessage.SetSensitive(false));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::Crypto::Sodium::DecryptAndAuthenticate(ByteView message, SharedKey const& sharedKey)
+{
+	// Sanity check.
+	if (message.size() < Nonce<false>::Size + crypto_box_MACBYTES)
+		throw std::invalid_argument{ OBF("Ciphertext too short.") };
+
+	// Retrieve nonce.
+	auto nonce = message.SubString(0, Nonce<false>::Size), ciphertext = message.SubString(Nonce<false>::Size);
+
+	// Decrypt.
+	ByteVector decryptedMessage(ciphertext.size() - crypto_box_MACBYTES);
+	if (crypto_box_open_easy_afternm(decryptedMessage.data(), ciphertext.data(), ciphertext.size(), nonce.data(), sharedKey.data()))
+		throw std::runtime_error{ OBF("Message forged.") };
+
+	return decryptedMessage;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::Crypto::Sodium::SignMessage(ByteView message, PrivateSignature const& signature)
 {
@@ -151,10 +388,30 @@ FSecure::ByteVector FSecure::Crypto::Sodium::VerifyMessage(ByteView signedMessag
 	if (crypto_sign_open(verifiedMessage.data(), nullptr, signedMessage.data(), signedMessage.size(), signature.data()))
 		throw std::runtime_error{ OBF("Signature verification failed.") };
 
-	// TODO: using crypto_sign_open_detached it could return a ByteView of signedMessage without copy.
 	return verifiedMessage;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteView FSecure::Crypto::Sodium::VerifyMessageInPlace(ByteView signedMessage, PublicSignature const& signature)
+{
+	// Combined form of signed message is [signature][message].
+	auto message = PeekSignedMessage(signedMessage);
+	if (crypto_sign_verify_detached(signedMessage.data(), message.data(), message.size(), signature.data()))
+		throw std::runtime_error{ OBF("Signature verification failed.") };
+
+	return message;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteView FSecure::Crypto::Sodium::PeekSignedMessage(ByteView signedMessage)
+{
+	// Sanity check.
+	if (signedMessage.size() < crypto_sign_BYTES)
+		throw std::invalid_argument{ OBF("Signed message too short.") };
+
+	return signedMessage.SubString(crypto_sign_BYTES);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::Crypto::Sodium::PublicKey FSecure::Crypto::Sodium::ConvertToKey(PublicSignature const& signature)
 {
@@ -185,6 +442,16 @@ FSecure::Crypto::Sodium::PublicSignature FSecure::Crypto::Sodium::ExtractPublic(
 	return publicSignature;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::Crypto::Sodium::Hash(ByteView data)
+{
+	ByteVector digest(HashSize);
+	if (crypto_generichash(digest.data(), digest.size(), data.data(), data.size(), nullptr, 0))
+		throw std::runtime_error{ OBF("Hashing failed.") };
+
+	return digest;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::Crypto::Sodium::ExchangeKeys FSecure::Crypto::Sodium::GenerateExchangeKeys()
 {
@@ -217,8 +484,15 @@ FSecure::Crypto::Sodium::SessionKeys FSecure::Crypto::Sodium::GenerateServerSess
 	return { rxKey, txKey };
 }
 
-FSecure::ByteVector FSecure::Crypto::Sodium::Encrypt(ByteView plaintext, SessionTxKey const& key)
+FSecure::ByteVector FSecure::Crypto::Sodium::Encrypt(ByteView plaintext, SessionTxKey const& key, AeadSuite suite)
 {
+	if (suite != AeadSuite::XSalsa20Poly1305)
+	{
+		ByteVector encryptedMessage;
+		SealTagged(plaintext, key.data(), suite, encryptedMessage);
+		return encryptedMessage;
+	}
+
 	Nonce<true> nonce;
 	ByteVector encryptedMessage(plaintext.size() + crypto_secretbox_MACBYTES + Nonce<true>::Size);
 
@@ -227,11 +501,15 @@ FSecure::ByteVector FSecure::Crypto::Sodium::Encrypt(ByteView plaintext, Session
 	if (crypto_secretbox_easy(encryptedMessage.data() + Nonce<true>::Size, plaintext.data(), plaintext.size(), nonce, key.data()))
 		throw std::runtime_error{ OBF("Encryption failed.") };
 
-	return encryptedMessage;
+	return std::move(encryptedMessage.SetSensitive(false));
 }
 
 FSecure::ByteVector FSecure::Crypto::Sodium::Decrypt(ByteView message, SessionRxKey const& key)
 {
+	if (auto suite = GetTaggedSuite(message))
+		if (ByteVector decryptedMessage(message.size() - GetOverhead(*suite)); OpenTagged(message, key.data(), *suite, decryptedMessage.data()))
+			return decryptedMessage;
+
 	// Sanity check.
 	if (message.size() < Nonce<true>::Size + crypto_secretbox_MACBYTES)
 		throw std::invalid_argument{ OBF("Ciphertext too short.") };
@@ -23,6 +23,35 @@ namespace FSecure::Crypto
 		using SessionTxKey = Key< crypto_kx_SESSIONKEYBYTES, struct SessionTxKeyTag>;
 		using SessionRxKey = Key< crypto_kx_SESSIONKEYBYTES, struct SessionRxKeyTag>;
 		using SessionKeys = std::pair<SessionRxKey, SessionTxKey>;
+		using SharedKey = Key<crypto_box_BEFORENMBYTES, struct SharedKeyTag>;
+
+		/// Authenticated encryption algorithms that can be used with symmetric and session keys. Values are written to ciphertext.
+		enum class AeadSuite : std::uint8_t
+		{
+			XSalsa20Poly1305 = 0,																					///< crypto_secretbox. Ciphertext is not tagged with suite, so that older builds can read it.
+			XChaCha20Poly1305 = 1,																					///< Fallback for CPUs without AES-NI. Ciphertext: [suite][nonce][ciphertext][MAC].
+			Aes256Gcm = 2,																							///< Requires AES-NI and CLMUL. Random 96-bit nonces limit a key to about 2^32 messages. Ciphertext: [suite][nonce][ciphertext][MAC].
+		};
+
+		/// Check if suite can be used on this CPU.
+		/// @param suite suite to check.
+		/// @return true if messages can be encrypted and decrypted with the suite.
+		bool IsAvailable(AeadSuite suite) noexcept;
+
+		/// Get suite that encrypts fastest on this CPU.
+		/// @return AES-256-GCM if CPU accelerates it, XChaCha20-Poly1305 otherwise.
+		AeadSuite GetFastestAeadSuite() noexcept;
+
+		/// Get name of suite used in configuration and by API bridge.
+		/// @param suite suite to name.
+		/// @return one of "xsalsa20poly1305", "xchacha20poly1305" or "aes256gcm".
+		std::string GetName(AeadSuite suite);
+
+		/// Get suite by its name.
+		/// @param name name returned by GetName.
+		/// @return suite with given name.
+		/// @throws std::invalid_argument if name is unknown.
+		AeadSuite ParseAeadSuite(std::string_view name);
 
 		/// Generate a key pair for asymmetric encryption.
 		/// @return a pair of encryption keys (public and private).
@@ -56,12 +85,13 @@ namespace FSecure::Crypto
 		/// Decrypt a message using provided SessionTx key.
 		/// @param plaintext message to encrypt.
 		/// @param key session tx key.
+		/// @param suite algorithm to use. Must be available on this CPU.
 		/// @returns Encrypted message prefixed with nonce.
 		/// @throws std::runtime_error.
-		ByteVector Encrypt(ByteView plaintext, SessionTxKey const& key);
+		ByteVector Encrypt(ByteView plaintext, SessionTxKey const& key, AeadSuite suite = AeadSuite::XSalsa20Poly1305);
 
 		/// Decrypt a message using provided SessionRx key.
-		/// @param ciphertext message to decrypt (must be prefixed with nonce used to encrypt that message).
+		/// @param ciphertext message to decrypt (must be prefixed with nonce used to encrypt that message). Suite is detected from the message.
 		/// @param key session rx key.
 		/// @returns Decrypted message.
 		/// @throws std::invalid_argument, std::runtime_error.
@@ -81,6 +111,37 @@ namespace FSecure::Crypto
 		/// @throws std::invalid_argument, std::runtime_error.
 		ByteVector DecryptFromAnonymous(ByteView message, SymmetricKey const& key);
 
+		/// Encrypt a message using provided symmetric key into provided buffer.
+		/// @param plaintext message to encrypt. Must not overlap with ciphertext buffer.
+		/// @param key symmetric key.
+		/// @param ciphertext buffer to store encrypted message prefixed with nonce. Previous content is overwritten, but allocated memory is reused.
+		/// @param suite algorithm to use. Must be available on this CPU.
+		/// @throws std::runtime_error.
+		void EncryptAnonymously(ByteView plaintext, SymmetricKey const& key, ByteVector& ciphertext, AeadSuite suite = AeadSuite::XSalsa20Poly1305);
+
+		/// Decrypt a message using provided symmetric key into provided buffer.
+		/// @param message message to decrypt (must be prefixed with nonce used to encrypt that message). Must not overlap with plaintext buffer. Suite is detected from the message.
+		/// @param key symmetric key.
+		/// @param plaintext buffer to store decrypted message. Previous content is overwritten, but allocated memory is reused.
+		/// @return suite that message was encrypted with.
+		/// @throws std::invalid_argument, std::runtime_error.
+		AeadSuite DecryptFromAnonymous(ByteView message, SymmetricKey const& key, ByteVector& plaintext);
+
+		/// Decrypt a message using provided symmetric key into provided buffer, without throwing if it's too short or forged.
+		/// Such messages are expected on lossy or shared Channels, where exceptions would be costly.
+		/// @param message message to decrypt (must be prefixed with nonce used to encrypt that message). Must not overlap with plaintext buffer. Suite is detected from the message.
+		/// @param key symmetric key.
+		/// @param plaintext buffer to store decrypted message. Previous content is overwritten, but allocated memory is reused.
+		/// @return suite that message was encrypted with, or nothing if message is too short or forged.
+		std::optional<AeadSuite> TryDecryptFromAnonymous(ByteView message, SymmetricKey const& key, ByteVector& plaintext);
+
+		/// Decrypt a message using provided symmetric key without copying it.
+		/// @param message message to decrypt (must be prefixed with nonce used to encrypt that message). Ciphertext is overwritten with plaintext. Suite is detected from the message.
+		/// @param key symmetric key.
+		/// @return view on decrypted message stored in message buffer.
+		/// @throws std::invalid_argument, std::runtime_error.
+		ByteView DecryptFromAnonymousInPlace(ByteVector& message, SymmetricKey const& key);
+
 		/// Encrypt a message anonymously.
 		/// @param plaintext message to encrypt.
 		/// @param key recipient public key.
@@ -126,6 +187,27 @@ namespace FSecure::Crypto
 		/// @throws std::invalid_argument, std::runtime_error.
 		ByteVector DecryptAndAuthenticate(ByteView message, PublicKey const& theirPublicKey, PrivateKey const& myPrivateKey);
 
+		/// Precomputes key shared by two parties, so that authenticated encryption doesn't repeat the key exchange for every message.
+		/// @param theirPublicKey other party's public key.
+		/// @param myPrivateKey own private key.
+		/// @return shared key.
+		/// @throws std::runtime_error.
+		SharedKey PrecomputeSharedKey(PublicKey const& theirPublicKey, PrivateKey const& myPrivateKey);
+
+		/// Encrypt a message and authenticates it.
+		/// @param plaintext message to encrypt.
+		/// @param sharedKey key precomputed from recipient's public key and sender's private key.
+		/// @return Encrypted message prefixed with a nonce.
+		/// @throws std::runtime_error.
+		ByteVector EncryptAndAuthenticate(ByteView plaintext, SharedKey const& sharedKey);
+
+		/// Decrypt a message and verifies identity of the sender.
+		/// @param message message to decrypt (must be prefixed with a nonce used to encrypt that message).
+		/// @param sharedKey key precomputed from sender's public key and recipient's private key.
+		/// @return Decrypted message.
+		/// @throws std::invalid_argument, std::runtime_error.
+		ByteVector DecryptAndAuthenticate(ByteView message, SharedKey const& sharedKey);
+
 		/// Signs a message.
 		/// @param message to sign.
 		/// @param signature private signature key.
@@ -140,6 +222,19 @@ namespace FSecure::Crypto
 		/// @throws std::invalid_argument, std::runtime_error.
 		ByteVector VerifyMessage(ByteView signedMessage, PublicSignature const& signature);
 
+		/// Verifies a signed message without copying it.
+		/// @param signedMessage message to check against signature.
+		/// @param signature public signature used to verify the message.
+		/// @return view on message without signature, stored in signedMessage buffer.
+		/// @throws std::invalid_argument, std::runtime_error.
+		ByteView VerifyMessageInPlace(ByteView signedMessage, PublicSignature const& signature);
+
+		/// Gets message from a signed message without verifying the signature.
+		/// @param signedMessage signed message.
+		/// @return view on message without signature, stored in signedMessage buffer. It must not be trusted until it is verified.
+		/// @throws std::invalid_argument.
+		ByteView PeekSignedMessage(ByteView signedMessage);
+
 		/// Converts a public signature key to a public encryption key.
 		/// @param signature public signature to convert.
 		/// @return converted public encryption key.
@@ -157,5 +252,13 @@ namespace FSecure::Crypto
 		/// @return converted public signature key.
 		/// @throws std::runtime_error.
 		PublicSignature ExtractPublic(PrivateSignature const& signature);
+
+		/// Size of digests computed by Hash.
+		constexpr size_t HashSize = crypto_generichash_BYTES;
+
+		/// Computes BLAKE2b digest of data, e.g. to address cached content.
+		/// @param data data to hash.
+		/// @return digest of HashSize bytes.
+		ByteVector Hash(ByteView data);
 	}
 }
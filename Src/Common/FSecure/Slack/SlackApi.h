@@ -1,7 +1,8 @@
 #pragma once
 
 #include "Common/json/json.hpp"
-#include "Common/CppRestSdk/include/cpprest/http_client.h"
+#include "Common/FSecure/CppTools/HttpClientPool.h"
+#include "SlackRateLimiter.h"
 
 using json = nlohmann::json; //for easy parsing of json API: https://github.com/nlohmann/json
 
@@ -10,6 +11,20 @@ namespace FSecure
 	class Slack
 	{
 	public:
+		/// Reply in a message thread.
+		struct Reply
+		{
+			std::string m_Timestamp;																					///< Timestamp of the reply, needed to delete it.
+			std::string m_Text;																							///< Text of the reply, or content of the file attached to it, decoded if requested.
+			bool m_IsFile = false;																						///< True if reply is a file.
+		};
+
+		/// Message of the channel.
+		struct Message
+		{
+			std::string m_Timestamp;																					///< Timestamp of the message, identifies its thread.
+			std::string m_Text;																							///< Text of the message.
+		};
 
 		/// Constructor for the Slack Api class.
 		/// @param token - the token generated by Slack when an "app" was installed to a workspace
@@ -39,17 +54,30 @@ namespace FSecure
 
 		/// Read the replies to a message
 		/// @param timestamp - the timestamp of the original message, from which we can gather the replies.
-		/// @return - an array of pairs containing the reply timestamp and reply text
-		std::vector<std::pair<std::string, std::string>> ReadReplies(std::string const& timestamp);
+		/// @param isFileBase64 - decode attached file from Base64 while it is downloaded.
+		/// @return - an array of replies
+		std::vector<Reply> ReadReplies(std::string const& timestamp, bool isFileBase64 = false);
+
+		/// Read the replies to a message without blocking. Many threads can be read at once, their files are downloaded concurrently.
+		/// @param timestamp - the timestamp of the original message, from which we can gather the replies.
+		/// @param isFileBase64 - decode attached file from Base64 while it is downloaded.
+		/// @return - task returning an array of replies
+		pplx::task<std::vector<Reply>> ReadRepliesAsync(std::string const& timestamp, bool isFileBase64 = false);
 
 		/// List all the channels in the workspace the object's token is tied to.
 		/// @return - a map of {channelName -> channelId}
 		std::map<std::string, std::string> ListChannels();
 
+		/// List messages of the channel, pages of conversations.history are read until the oldest requested message.
+		/// @param oldest - timestamp of the oldest message to list, inclusive. Empty to list the whole history.
+		/// @return - messages from the newest to the oldest.
+		std::vector<Message> ListMessages(std::string const& oldest = {});
+
 		/// Get all of the messages by a direction. This is a C3 specific method, used by a server relay to get client messages and vice versa.
 		/// @param direction - the direction to search for (eg. "S2C").
+		/// @param oldest - timestamp of the oldest message to search, inclusive. Empty to search the whole history.
 		/// @return - a vector of timestamps, where timestamp allows replies to be read later
-		std::vector<std::string> GetMessagesByDirection(std::string const& direction);
+		std::vector<std::string> GetMessagesByDirection(std::string const& direction, std::string const& oldest = {});
 
 		/// Edit a previously sent message.
 		/// @param message - the message to update to, this will overwrite the previous message.
@@ -63,14 +91,29 @@ namespace FSecure
 
 		/// Use Slack's file API to upload data as files. This is useful when a payload is large (for example during implant staging).
 		/// This function is called internally whenever a WriteReply is called with a payload of more than 120k characters.
-		/// @param data - the data to be sent.
+		/// @param data - the data to be sent. Uploaded as it is, so it can be binary.
 		/// @param ts - the timestamp, needed as this method is only used during WriteReply.
-		void UploadFile(std::string const& data, std::string const& ts);
+		void UploadFile(ByteView data, std::string const& ts);
 
 		/// Delete a message from the channel
 		/// @param timestamp - the timestamp of the message to delete.
 		void DeleteMessage(std::string const& timestamp);
 
+		/// Delete a message from the channel without blocking.
+		/// @param timestamp - the timestamp of the message to delete.
+		/// @return - task finished when the message is deleted.
+		pplx::task<void> DeleteMessageAsync(std::string const& timestamp);
+
+		/// Estimate how long consecutive calls of an API method would take now, including waiting for rate limits.
+		/// @param method - Web API method, e.g. chat.postMessage.
+		/// @param calls - number of calls.
+		/// @return - expected time of all calls.
+		std::chrono::steady_clock::duration EstimateCallTime(std::string const& method, size_t calls);
+
+		/// Take part in polling of the channel. Polls of ListMessages by all objects using the token are spread evenly within its rate limit.
+		/// @return - poller telling when this object's turn comes. Null if the token is not set.
+		std::unique_ptr<SlackRateLimiter::Poller> CreatePoller();
+
 	private:
 
 		/// The channel through which messages are sent and received, will be sent when the object is created.
@@ -79,19 +122,38 @@ namespace FSecure
 		/// The Slack API token that allows the object access to the workspace. Needs to be manually created as described in documentation.
 		std::string m_Token;
 
-		/// Hold proxy settings
-		web::http::client::http_client_config m_HttpConfig;
+		/// Clients with proxy settings, kept alive between requests.
+		HttpClientPool m_HttpClients;
+
+		/// Schedules requests within Slack's rate limits of the token.
+		std::shared_ptr<SlackRateLimiter> m_RateLimiter;
 
 		/// Send http request, uses preset token for authentication
 		std::string SendHttpRequest(std::string const& host, std::string const& contentType, std::string const& data);
 
+		/// Send http request without blocking, uses preset token for authentication
+		pplx::task<std::string> SendHttpRequestAsync(std::string const& host, std::string const& contentType, std::string const& data);
+
+		/// Send http request with binary body without blocking, uses preset token for authentication. Request is delayed to fit in rate limits and repeated after Retry-After if Slack rejects it anyway.
+		pplx::task<web::http::http_response> SendRequestAsync(std::string const& host, std::string const& contentType, std::string const& data);
+
 		/// Send http request with json data, uses preset token for authentication
 		json SendJsonRequest(std::string const& url, json const& data);
 
+		/// Send http request with json data without blocking, uses preset token for authentication
+		pplx::task<json> SendJsonRequestAsync(std::string const& url, json const& data);
+
 		/// Use Slack's File API to retrieve files.
 		/// @param url - the url where the file can be retrieved.
+		/// @param isBase64 - decode content from Base64.
 		/// @return - the data within the file.
-		std::string GetFile(std::string const& url);
+		std::string GetFile(std::string const& url, bool isBase64 = false);
+
+		/// Retrieve a file without blocking.
+		/// @param url - the url where the file can be retrieved.
+		/// @param isBase64 - decode content from Base64 chunk by chunk, as it arrives, so that decoding overlaps with the download.
+		/// @return - task returning the data within the file.
+		pplx::task<std::string> GetFileAsync(std::string const& url, bool isBase64 = false);
 
 	};
 
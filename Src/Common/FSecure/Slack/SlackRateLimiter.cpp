@@ -0,0 +1,162 @@
+#include "StdAfx.h"
+#include "SlackRateLimiter.h"
+
+namespace
+{
+	/// Calls per minute and burst size of Slack's tiers. https://api.slack.com/docs/rate-limits
+	struct Limit
+	{
+		uint32_t m_PerMinute;
+		uint32_t m_Burst;
+	};
+
+	constexpr Limit s_Tier2{ 20, 3 }, s_Tier3{ 50, 5 }, s_PostMessage{ 60, 3 };
+
+	/// Get limit of a method. Methods not listed are assumed to be Tier 3, which covers most of conversations and chat methods.
+	Limit GetLimit(std::string const& method)
+	{
+		if (method == OBF("conversations.list") || method == OBF("conversations.create") || method == OBF("files.upload"))
+			return s_Tier2;
+
+		// chat.postMessage has its own limit of one message per second per channel, with short bursts allowed.
+		if (method == OBF("chat.postMessage"))
+			return s_PostMessage;
+
+		return s_Tier3;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::SlackRateLimiter> FSecure::SlackRateLimiter::Get(std::string const& token)
+{
+	static std::mutex mutex;
+	static std::unordered_map<std::string, std::weak_ptr<SlackRateLimiter>> limiters;
+
+	std::scoped_lock lock(mutex);
+	auto& weak = limiters[token];
+	auto limiter = weak.lock();
+	if (!limiter)
+		weak = limiter = std::make_shared<SlackRateLimiter>();
+
+	return limiter;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::SlackRateLimiter::Poller::Poller(std::shared_ptr<SlackRateLimiter> limiter, std::string method)
+	: m_Limiter{ std::move(limiter) }
+	, m_Method{ std::move(method) }
+{
+	std::scoped_lock lock(m_Limiter->m_AccessMutex);
+	m_Limiter->m_Pollers[m_Method].push_back(this);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::SlackRateLimiter::Poller::~Poller()
+{
+	std::scoped_lock lock(m_Limiter->m_AccessMutex);
+	auto& pollers = m_Limiter->m_Pollers[m_Method];
+	pollers.erase(std::remove(pollers.begin(), pollers.end(), this), pollers.end());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::steady_clock::duration FSecure::SlackRateLimiter::Poller::GetDelay(std::chrono::steady_clock::duration minDelay) const
+{
+	auto now = std::chrono::steady_clock::now();
+	std::scoped_lock lock(m_Limiter->m_AccessMutex);
+	auto& bucket = m_Limiter->GetBucket(m_Method);
+	auto& pollers = m_Limiter->m_Pollers[m_Method];
+	auto turn = static_cast<std::chrono::steady_clock::duration::rep>(std::find(pollers.begin(), pollers.end(), this) - pollers.begin());
+
+	// Turns are counted from the clock's epoch, so every poller finds the same schedule without keeping any state.
+	// Each poller has one turn per round, so polls never come faster than the bucket refills, however many pollers there are.
+	auto round = bucket.m_Interval * static_cast<std::chrono::steady_clock::duration::rep>(pollers.size());
+	auto offset = bucket.m_Interval * turn;
+	auto rounds = (now.time_since_epoch() + minDelay - offset + round - std::chrono::steady_clock::duration{ 1 }) / round;
+	return std::chrono::steady_clock::time_point{ round * rounds + offset } - now;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::steady_clock::duration FSecure::SlackRateLimiter::Reserve(std::string const& url)
+{
+	auto method = GetMethod(url);
+	if (method.empty())
+		return {};
+
+	auto now = std::chrono::steady_clock::now();
+	std::scoped_lock lock(m_AccessMutex);
+	auto& bucket = GetBucket(method);
+
+	// Token is available when the bucket is at least one interval away from being full.
+	auto fullAt = std::max(bucket.m_FullAt, now);
+	auto allowedAt = std::max(fullAt - bucket.m_Tolerance, now);
+	bucket.m_FullAt = fullAt + bucket.m_Interval;
+	return allowedAt - now;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::SlackRateLimiter::Block(std::string const& url, std::chrono::seconds retryAfter)
+{
+	auto method = GetMethod(url);
+	if (method.empty())
+		return;
+
+	// Empty the bucket, so that the next call waits for Retry-After and following ones are spread at method's rate.
+	auto now = std::chrono::steady_clock::now();
+	std::scoped_lock lock(m_AccessMutex);
+	auto& bucket = GetBucket(method);
+	bucket.m_FullAt = std::max(bucket.m_FullAt, now + retryAfter + bucket.m_Tolerance);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::SlackRateLimiter::RecordLatency(std::string const& url, std::chrono::steady_clock::duration latency)
+{
+	auto method = GetMethod(url);
+	if (method.empty())
+		return;
+
+	// Average over last few calls, so that estimates follow changes of workspace load quickly.
+	std::scoped_lock lock(m_AccessMutex);
+	auto& bucket = GetBucket(method);
+	bucket.m_Latency = (bucket.m_Latency * 3 + latency) / 4;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::steady_clock::duration FSecure::SlackRateLimiter::Estimate(std::string const& method, size_t calls)
+{
+	auto now = std::chrono::steady_clock::now();
+	std::scoped_lock lock(m_AccessMutex);
+	auto& bucket = GetBucket(method);
+
+	// Every call starts when its slot is available and the previous call finished, same as in Reserve.
+	auto fullAt = std::max(bucket.m_FullAt, now);
+	auto finishedAt = now;
+	for (size_t i = 0; i < calls; ++i, fullAt += bucket.m_Interval)
+		finishedAt = std::max(finishedAt, fullAt - bucket.m_Tolerance) + bucket.m_Latency;
+
+	return finishedAt - now;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::SlackRateLimiter::GetMethod(std::string const& url)
+{
+	auto prefix = OBF_STR("https://slack.com/api/");
+	if (url.compare(0, prefix.size(), prefix))
+		return {};
+
+	auto end = url.find('?', prefix.size());
+	return url.substr(prefix.size(), end == std::string::npos ? end : end - prefix.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::SlackRateLimiter::Bucket& FSecure::SlackRateLimiter::GetBucket(std::string const& method)
+{
+	auto it = m_Buckets.find(method);
+	if (it == m_Buckets.end())
+	{
+		auto limit = GetLimit(method);
+		auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::minutes{ 1 }) / limit.m_PerMinute;
+		it = m_Buckets.emplace(method, Bucket{ interval, interval * (limit.m_Burst - 1), {}, s_DefaultLatency }).first;
+	}
+
+	return it->second;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+namespace FSecure
+{
+	/// Schedules Slack Web API calls within rate limits of their tiers.
+	/// Every API method has its own token bucket. Slack counts calls per workspace and app, so buckets are shared by all objects using the same token.
+	class SlackRateLimiter
+	{
+	public:
+		/// Registration of an object that polls a method, e.g. a Channel listing conversation history.
+		/// Turns of all pollers of a token follow one another at the method's rate, so together they use the whole budget of the method without bursts running into HTTP 429.
+		class Poller
+		{
+		public:
+			/// Register poller. It takes the last turn.
+			/// @param limiter limiter of the token used to poll.
+			/// @param method method name, e.g. conversations.history.
+			Poller(std::shared_ptr<SlackRateLimiter> limiter, std::string method);
+
+			/// Unregister poller. Pollers registered later move up one turn.
+			~Poller();
+
+			Poller(Poller const&) = delete;
+			Poller& operator=(Poller const&) = delete;
+
+			/// Get time until the poller's turn. Doesn't reserve anything, so it can be asked many times.
+			/// @param minDelay time the poller would wait on its own.
+			/// @return time until the first turn that is at least minDelay away.
+			std::chrono::steady_clock::duration GetDelay(std::chrono::steady_clock::duration minDelay) const;
+
+		private:
+			std::shared_ptr<SlackRateLimiter> m_Limiter;																///< Limiter this poller is registered in.
+			std::string m_Method;																						///< Polled method.
+		};
+
+		/// Get limiter of a token. It is created on first use and lives as long as someone uses it.
+		/// @param token Slack API token.
+		/// @return limiter shared with other users of the token.
+		static std::shared_ptr<SlackRateLimiter> Get(std::string const& token);
+
+		/// Take a slot for a call. Can be called from many threads.
+		/// @param url url of the request. Method name is taken from its path. Urls outside of Web API are not limited.
+		/// @return time to wait before sending the request.
+		std::chrono::steady_clock::duration Reserve(std::string const& url);
+
+		/// Hold back calls of a method after Slack rejected one with HTTP 429.
+		/// @param url url of the rejected request.
+		/// @param retryAfter value of Retry-After header.
+		void Block(std::string const& url, std::chrono::seconds retryAfter);
+
+		/// Remember how long Slack took to answer a request.
+		/// @param url url of the request.
+		/// @param latency time between sending the request and receiving response headers.
+		void RecordLatency(std::string const& url, std::chrono::steady_clock::duration latency);
+
+		/// Estimate how long consecutive calls of a method would take if they were started now. Doesn't reserve anything.
+		/// @param method method name, e.g. chat.postMessage.
+		/// @param calls number of calls, each one sent after the previous one finished.
+		/// @return expected time of all calls, including waiting for rate limit and latency.
+		std::chrono::steady_clock::duration Estimate(std::string const& method, size_t calls);
+
+	private:
+		/// Latency assumed for methods that were not called yet.
+		static constexpr std::chrono::milliseconds s_DefaultLatency{ 300 };
+
+		/// Token bucket stored as the time when it will be full again, which makes taking a token a single comparison.
+		struct Bucket
+		{
+			std::chrono::steady_clock::duration m_Interval;																///< Time needed to refill one token.
+			std::chrono::steady_clock::duration m_Tolerance;															///< Time needed to refill all tokens but one.
+			std::chrono::steady_clock::time_point m_FullAt;																///< Bucket refills completely at this time.
+			std::chrono::steady_clock::duration m_Latency;																///< Moving average of response latency.
+		};
+
+		/// Get method name from url.
+		/// @param url url of a request.
+		/// @return method name, e.g. chat.postMessage. Empty for urls outside of Web API.
+		static std::string GetMethod(std::string const& url);
+
+		/// Get bucket of a method. Must be called with m_AccessMutex locked.
+		/// @param method method name.
+		/// @return bucket created according to method's tier if needed.
+		Bucket& GetBucket(std::string const& method);
+
+		std::mutex m_AccessMutex;																							///< Guards m_Buckets and m_Pollers.
+		std::unordered_map<std::string, Bucket> m_Buckets;																	///< Buckets by method name.
+		std::unordered_map<std::string, std::vector<Poller const*>> m_Pollers;												///< Registered pollers by method name, in order of their turns.
+	};
+}
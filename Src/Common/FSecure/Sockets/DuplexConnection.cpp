@@ -5,6 +5,8 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::DuplexConnection::DuplexConnection(ClientSocket sock) : m_IsSending{ false }, m_IsReceiving{ false }, m_ClientSocket{ std::move(sock) }
 {
+	// Sending thread already writes everything queued with one call. Nagle's algorithm would only delay responses.
+	m_ClientSocket.SetNoDelay(true);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -14,6 +16,12 @@ FSecure::DuplexConnection::DuplexConnection(std::string_view addr, uint16_t port
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::DuplexConnection::~DuplexConnection()
+{
+	Close();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::DuplexConnection::Close()
 {
 	{
 		std::unique_lock lock(m_MessagesMutex);
@@ -27,25 +35,40 @@ FSecure::DuplexConnection::~DuplexConnection()
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::DuplexConnection::StartSending()
+void FSecure::DuplexConnection::StartSending(Encoder encoder)
 {
 	m_IsSending = true;
-	m_SendingThread = std::thread([this]
+	m_SendingThread = std::thread([this, encoder = std::move(encoder)]
 	{
 		try
 		{
+			// Frames of normal priority messages that are not sent yet.
+			std::deque<ByteVector> pendingFrames;
 			while (true)
 			{
-				ByteVector message;
+				if (!m_IsSending)
+					break;
+				auto [messages, priority] = GetMessages(!pendingFrames.empty());
+				if (messages.empty() && pendingFrames.empty())
+					break; // connection closed
+
+				if (!messages.empty())
 				{
-					std::unique_lock lock(m_MessagesMutex);
-					if (!m_IsSending)
-						break;
-					message = GetMessage(lock);
-					if (message.empty())
-						break; // connection closed
+					auto frames = encoder ? encoder(std::move(messages), priority) : std::move(messages);
+
+					// Everything of high priority that was queued in the meantime is written with one call.
+					if (priority == Priority::High)
+					{
+						m_ClientSocket.Send(frames);
+						continue;
+					}
+
+					std::move(frames.begin(), frames.end(), std::back_inserter(pendingFrames));
 				}
-				m_ClientSocket.Send(message);
+
+				// Check for high priority messages after every normal priority frame.
+				m_ClientSocket.Send(pendingFrames.front());
+				pendingFrames.pop_front();
 			}
 		}
 		catch (FSecure::SocketsException&)
@@ -71,11 +94,9 @@ void FSecure::DuplexConnection::StartReceiving(std::function<void(ByteVector)> c
 		{
 			while (true)
 			{
-				if (m_IsReceiving && !m_ClientSocket.HasReceivedData())
-				{
-					std::this_thread::sleep_for(10ms);
+				// Wait for data in kernel instead of sleeping, so messages are handled as soon as they arrive.
+				if (m_IsReceiving && !m_ClientSocket.HasReceivedData(s_StopCheckInterval))
 					continue;
-				}
 				if (!m_IsReceiving)
 					break;
 
@@ -105,38 +126,35 @@ bool FSecure::DuplexConnection::IsSending() const
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::DuplexConnection::Send(ByteVector message)
+void FSecure::DuplexConnection::Send(ByteVector message, Priority priority)
 {
+	// Sending thread drains whole queue when it wakes up, so it has to be notified only when the queue was empty. Mutex is taken after push, so notification can't be lost.
+	if (!m_Messages[static_cast<size_t>(priority)].Push(std::move(message)))
+		return;
+
 	std::scoped_lock lock(m_MessagesMutex);
-	m_Messages.emplace(std::move(message));
 	m_NewMessage.notify_one();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-FSecure::ByteVector FSecure::DuplexConnection::GetMessage(std::unique_lock<std::mutex>& lock)
+std::pair<std::vector<FSecure::ByteVector>, FSecure::DuplexConnection::Priority> FSecure::DuplexConnection::GetMessages(bool isBusy)
 {
-	auto popMessage = [this]
+	if (!isBusy && !HasMessages())
 	{
-		auto ret = m_Messages.front();
-		m_Messages.pop();
-		return ret;
-	};
-
-	if (!m_Messages.empty())
-	{
-		return popMessage();
-	}
-	else
-	{
-		while (true)
-		{
-			m_NewMessage.wait(lock);
-			if (!m_IsSending)
-				return {}; // stop requested
-			else if (!m_Messages.empty())
-				return popMessage();
-			else
-				continue; // condition_variable spuriously unlocked, go back to waiting
-		}
+		std::unique_lock lock(m_MessagesMutex);
+		m_NewMessage.wait(lock, [this] { return !m_IsSending || HasMessages(); });
+		if (!m_IsSending)
+			return {}; // stop requested
 	}
+
+	if (auto messages = m_Messages[static_cast<size_t>(Priority::High)].PopAll(); !messages.empty() || isBusy)
+		return { std::move(messages), Priority::High };
+
+	return { m_Messages[static_cast<size_t>(Priority::Normal)].PopAll(), Priority::Normal };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::DuplexConnection::HasMessages() const
+{
+	return std::any_of(m_Messages.begin(), m_Messages.end(), [](auto const& queue) { return !queue.IsEmpty(); });
 }
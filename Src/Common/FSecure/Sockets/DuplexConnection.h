@@ -2,12 +2,23 @@
 
 #include "Socket.h"
 #include "Common/FSecure/CppTools/ByteConverter/ByteConverter.h"
+#include "Common/FSecure/CppTools/MpscQueue.h"
 
 namespace FSecure
 {
 	class DuplexConnection
 	{
 	public:
+		/// Priority of a message. High priority messages are sent before frames of normal priority messages that are still waiting
+		enum class Priority
+		{
+			High,
+			Normal,
+		};
+
+		/// Converts all messages of one priority queued at once into frames written to socket
+		using Encoder = std::function<std::vector<ByteVector>(std::vector<ByteVector>, Priority)>;
+
 		/// Create a duplex connection with address and port
 		DuplexConnection(std::string_view addr, uint16_t port);
 
@@ -24,10 +35,14 @@ namespace FSecure
 		~DuplexConnection();
 
 		/// Start a sending thread
-		void StartSending();
+		/// @param encoder converts queued messages into frames. If not provided, every message is sent as it is
+		/// @remarks Frames of normal priority messages are written one by one. If encoder splits big messages into many frames, high priority messages are not blocked by them
+		void StartSending(Encoder encoder = {});
 
 		/// Send a message through connection
-		void Send(ByteVector message);
+		/// @param message message to send
+		/// @param priority priority of the message
+		void Send(ByteVector message, Priority priority = Priority::High);
 
 		/// Receive data from connection
 		ByteVector Receive();
@@ -38,12 +53,23 @@ namespace FSecure
 		/// Stop sending and receiving
 		void Stop();
 
+		/// Stop sending and receiving and wait until sending and receiving threads finish
+		void Close();
+
 		/// Check if sending is on
 		bool IsSending() const;
 
 	private:
-		/// Gets next message queued to send
-		ByteVector GetMessage(std::unique_lock<std::mutex>& lock);
+		/// Receiving thread blocks waiting for data at most this long, to notice that Stop was called.
+		static constexpr std::chrono::milliseconds s_StopCheckInterval{ 100 };
+
+		/// Gets all messages of one priority queued to send. High priority messages are returned first
+		/// @param isBusy if true, returns only high priority messages and doesn't wait for them
+		/// @return messages and their priority. Empty if there are none and isBusy is true, or if sending was stopped
+		std::pair<std::vector<ByteVector>, Priority> GetMessages(bool isBusy);
+
+		/// @return true if any message is queued
+		bool HasMessages() const;
 
 		std::atomic_bool m_IsSending;
 		std::atomic_bool m_IsReceiving;
@@ -51,8 +77,8 @@ namespace FSecure
 		std::thread m_ReceivingThread;
 		ClientSocket m_ClientSocket;
 
-		std::mutex m_MessagesMutex;
+		std::mutex m_MessagesMutex;																						///< Taken only to wait for and to notify about messages
 		std::condition_variable m_NewMessage;
-		std::queue<ByteVector> m_Messages;
+		std::array<MpscQueue<ByteVector>, 2> m_Messages;																///< Messages to send, one queue per Priority
 	};
 }
@@ -7,6 +7,7 @@
 #include <thread>
 #include <functional>
 #include <cstdint>
+#include <chrono>
 
 // Windows includes.
 #include <ws2tcpip.h>																									//< Windows Sockets.
@@ -3,7 +3,8 @@
 #include "SocketsException.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-FSecure::Socket::Socket(const AddrInfo& addrinfo)
+FSecure::Socket::Socket(const AddrInfo& addrinfo, LengthOrder lengthOrder)
+	: m_LengthOrder{ lengthOrder }
 {
 	if (m_Socket = socket(addrinfo->ai_family, addrinfo->ai_socktype, addrinfo->ai_protocol); m_Socket == INVALID_SOCKET)
 		throw SocketsException(OBF("Failed to create socket. Error: ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
@@ -19,8 +20,7 @@ FSecure::Socket::~Socket() noexcept
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::Socket::Socket(Socket&& other) noexcept
 {
-	m_Socket = other.m_Socket;
-	other.m_Socket = INVALID_SOCKET;
+	*this = std::move(other);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -28,6 +28,10 @@ FSecure::Socket& FSecure::Socket::operator=(Socket&& other) noexcept
 {
 	m_Socket = other.m_Socket;
 	other.m_Socket = INVALID_SOCKET;
+	m_LengthOrder = other.m_LengthOrder;
+	m_ReceiveBuffer = std::move(other.m_ReceiveBuffer);
+	m_ReceiveBegin = std::exchange(other.m_ReceiveBegin, 0);
+	m_ReceiveEnd = std::exchange(other.m_ReceiveEnd, 0);
 	return *this;
 }
 
@@ -38,44 +42,138 @@ FSecure::Socket::operator bool() const noexcept
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::Socket::Send(ByteVector const& data)
+void FSecure::Socket::Send(ByteView data)
+{
+	// Send the 4-byte length of chunk together with the chunk.
+	uint32_t size = ConvertLength(static_cast<uint32_t>(data.size()));
+	WSABUF buffers[] = { { sizeof(size), reinterpret_cast<CHAR*>(&size) }, { static_cast<ULONG>(data.size()), reinterpret_cast<CHAR*>(const_cast<uint8_t*>(data.data())) } };
+	Send(buffers, std::size(buffers));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::Socket::Send(std::vector<ByteVector> const& data)
 {
-	// First send the 4-byte (network order) length of chunk.
-	uint32_t size = htonl(static_cast<uint32_t>(data.size()));
-	if (SOCKET_ERROR == send(m_Socket, reinterpret_cast<const char*>(&size), sizeof(size), 0))
-		throw FSecure::SocketsException(OBF("Error sending to Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
+	// Gather lengths and chunks, so that all of them are written by a single call.
+	std::vector<uint32_t> sizes;
+	std::vector<WSABUF> buffers;
+	sizes.reserve(data.size());
+	buffers.reserve(2 * data.size());
+	for (auto const& chunk : data)
+	{
+		sizes.push_back(ConvertLength(static_cast<uint32_t>(chunk.size())));
+		buffers.push_back({ sizeof(uint32_t), reinterpret_cast<CHAR*>(&sizes.back()) });
+		buffers.push_back({ static_cast<ULONG>(chunk.size()), reinterpret_cast<CHAR*>(const_cast<uint8_t*>(chunk.data())) });
+	}
 
-	// Write the chunk to socket.
-	if (SOCKET_ERROR == send(m_Socket, reinterpret_cast<const char*>(data.data()), static_cast<int>(data.size()), 0))
-		throw FSecure::SocketsException(OBF("Error sending to Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
+	Send(buffers.data(), buffers.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::Socket::Send(WSABUF* buffers, size_t count)
+{
+	while (count)
+	{
+		DWORD sent = 0;
+		if (SOCKET_ERROR == WSASend(m_Socket, buffers, static_cast<DWORD>(count), &sent, 0, nullptr, nullptr))
+			throw FSecure::SocketsException(OBF("Error sending to Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
+
+		// Skip buffers that were sent entirely and the sent part of the next one.
+		for (; count && sent >= buffers->len; --count, ++buffers)
+			sent -= buffers->len;
+
+		if (count)
+		{
+			buffers->buf += sent;
+			buffers->len -= sent;
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::Socket::Receive()
 {
-	// First read the 4-byte (network order) length of chunk.
+	// First read the 4-byte length of chunk.
 	uint32_t chunkLength = 0;
-	int bytesRead;
-	if (bytesRead = recv(m_Socket, reinterpret_cast<char*>(&chunkLength), 4, 0); bytesRead == SOCKET_ERROR)
-		throw FSecure::SocketsException(OBF("Error receiving from Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
+	if (!Receive(reinterpret_cast<uint8_t*>(&chunkLength), sizeof(chunkLength)))
+		return {};															//< The connection has been gracefully closed.
 
-	uint32_t length = ntohl(chunkLength);
-	if (!bytesRead or !length)
+	uint32_t length = ConvertLength(chunkLength);
+	if (!length)
 		return {};															//< The connection has been gracefully closed.
 
 	// Read in the result.
 	ByteVector buffer;
 	buffer.resize(length);
-	for (DWORD bytesReadTotal = 0; bytesReadTotal < length; bytesReadTotal += bytesRead)
-		switch (bytesRead = recv(m_Socket, reinterpret_cast<char *>(&buffer[bytesReadTotal]), length - bytesReadTotal, 0))
+	if (!Receive(buffer.data(), buffer.size()))
+		return {};															//< The connection has been gracefully closed.
+
+	return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::Socket::Receive(uint8_t* data, size_t size)
+{
+	while (size)
+	{
+		// Use data left from previous reads.
+		if (m_ReceiveBegin != m_ReceiveEnd)
 		{
-		case 0:
-			return {};															//< The connection has been gracefully closed.
+			auto count = std::min(size, m_ReceiveEnd - m_ReceiveBegin);
+			std::copy_n(m_ReceiveBuffer.data() + m_ReceiveBegin, count, data);
+			m_ReceiveBegin += count;
+			data += count;
+			size -= count;
+			continue;
+		}
 
-		case SOCKET_ERROR:
+		// Big chunk is read directly into destination. Otherwise fill the buffer, to get following frames with the same call.
+		auto isDirect = size >= s_ReceiveBufferSize;
+		if (!isDirect && m_ReceiveBuffer.size() != s_ReceiveBufferSize)
+			m_ReceiveBuffer.resize(s_ReceiveBufferSize);
+
+		auto destination = isDirect ? data : m_ReceiveBuffer.data();
+		auto capacity = isDirect ? size : s_ReceiveBufferSize;
+		auto bytesRead = recv(m_Socket, reinterpret_cast<char*>(destination), static_cast<int>(std::min<size_t>(capacity, std::numeric_limits<int>::max())), 0);
+		if (bytesRead == SOCKET_ERROR)
 			throw FSecure::SocketsException(OBF("Error receiving from Socket : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
+
+		if (!bytesRead)
+			return false;
+
+		if (isDirect)
+		{
+			data += bytesRead;
+			size -= bytesRead;
 		}
-	return buffer;
+		else
+		{
+			m_ReceiveBegin = 0;
+			m_ReceiveEnd = bytesRead;
+		}
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint32_t FSecure::Socket::ConvertLength(uint32_t length) const
+{
+	return m_LengthOrder == LengthOrder::Network ? htonl(length) : length;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::Socket::SetNoDelay(bool noDelay)
+{
+	BOOL value = noDelay;
+	if (SOCKET_ERROR == setsockopt(m_Socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>(&value), sizeof(value)))
+		throw FSecure::SocketsException(OBF("Failed to set TCP_NODELAY. Error code : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::Socket::SetSendBufferSize(int bytes)
+{
+	if (SOCKET_ERROR == setsockopt(m_Socket, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<char const*>(&bytes), sizeof(bytes)))
+		throw FSecure::SocketsException(OBF("Failed to set SO_SNDBUF. Error code : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -102,7 +200,10 @@ void FSecure::Socket::Connect(std::string_view addr, uint16_t port)
 		throw FSecure::SocketsException(OBF("Couldn't convert standard text IPv4 address into its numeric binary form. Error code : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
 	}
 
-	// Attempt to connect.
+	// Attempt to connect. Socket created for different address family is replaced.
+	if (m_Socket != INVALID_SOCKET)
+		closesocket(m_Socket);
+
 	if (INVALID_SOCKET == (m_Socket = socket(AF_INET, SOCK_STREAM, 0)))
 		throw FSecure::SocketsException(OBF("Couldn't create socket. Error code : ") + std::to_string(WSAGetLastError()) + OBF("."), WSAGetLastError());
 
@@ -127,10 +228,13 @@ FSecure::Socket FSecure::Socket::Accept()
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-bool FSecure::Socket::HasReceivedData()
+bool FSecure::Socket::HasReceivedData(std::chrono::milliseconds timeout)
 {
+	if (m_ReceiveBegin != m_ReceiveEnd)
+		return true;
+
 	pollfd xx{ m_Socket, POLLRDNORM, 0};
-	auto ret = WSAPoll(&xx, /* one socket on list */ 1, /* return immediately*/ 0);
+	auto ret = WSAPoll(&xx, /* one socket on list */ 1, static_cast<INT>(timeout.count()));
 	if (ret == SOCKET_ERROR)
 	{
 		auto errCode = WSAGetLastError();
@@ -150,8 +254,53 @@ bool FSecure::Socket::HasReceivedData()
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-FSecure::ClientSocket::ClientSocket(std::string_view addr, uint16_t port)
-	: m_Socket{ AddrInfo{ addr, std::to_string(port).c_str() } }
+std::vector<size_t> FSecure::Socket::WaitForData(std::vector<Socket*> const& sockets, std::chrono::milliseconds timeout)
+{
+	// Data buffered by previous reads is available without waiting.
+	std::vector<size_t> ready;
+	std::vector<pollfd> fds;
+	fds.reserve(sockets.size());
+	for (size_t i = 0; i < sockets.size(); ++i)
+	{
+		if (sockets[i]->m_ReceiveBegin != sockets[i]->m_ReceiveEnd)
+			ready.push_back(i);
+
+		fds.push_back({ sockets[i]->m_Socket, POLLRDNORM, 0 });
+	}
+
+	if (fds.empty())
+		return ready;
+
+	auto ret = WSAPoll(fds.data(), static_cast<ULONG>(fds.size()), ready.empty() ? static_cast<INT>(timeout.count()) : 0);
+	if (ret == SOCKET_ERROR)
+	{
+		auto errCode = WSAGetLastError();
+		throw SocketsException(OBF("Failed to poll sockets. Error code: ") + std::to_string(errCode) + OBF("."), errCode);
+	}
+
+	// Closed and failed sockets are reported too. Receive on them returns immediately.
+	for (size_t i = 0; ret && i < fds.size(); ++i)
+		if (fds[i].revents & (POLLRDNORM | POLLHUP | POLLERR) && std::find(ready.begin(), ready.end(), i) == ready.end())
+			ready.push_back(i);
+
+	std::sort(ready.begin(), ready.end());
+	return ready;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<size_t> FSecure::ClientSocket::WaitForData(std::vector<ClientSocket*> const& sockets, std::chrono::milliseconds timeout)
+{
+	std::vector<Socket*> underlying;
+	underlying.reserve(sockets.size());
+	for (auto socket : sockets)
+		underlying.push_back(&socket->m_Socket);
+
+	return Socket::WaitForData(underlying, timeout);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ClientSocket::ClientSocket(std::string_view addr, uint16_t port, Socket::LengthOrder lengthOrder)
+	: m_Socket{ AddrInfo{ addr, std::to_string(port).c_str() }, lengthOrder }
 {
 	m_Socket.Connect(addr, port);
 }
@@ -9,12 +9,20 @@ namespace FSecure
 	/// @note user has to call WSAStartup;
 	struct Socket
 	{
+		/// Byte order of length prefix of sent and received data
+		enum class LengthOrder
+		{
+			Network,																									///< Big-endian
+			Host,																										///< Native byte order of the machine
+		};
+
 		/// Create an invalid socket
 		Socket() noexcept = default;
 
 		/// Create a socket with addrinfo
+		/// @param lengthOrder byte order of length prefixes
 		/// @throws WinSocketsException
-		Socket(const AddrInfo& addrinfo);
+		Socket(const AddrInfo& addrinfo, LengthOrder lengthOrder = LengthOrder::Network);
 
 		/// Close socket
 		~Socket() noexcept;
@@ -35,16 +43,31 @@ namespace FSecure
 		/// @return false if underlying SOCKET is in INVALID_SOCKET state
 		operator bool() const noexcept;
 
-		/// Send data through socket. Prefixes the data with its length (4 bytes, network order)
+		/// Send data through socket. Prefixes the data with its length (4 bytes)
 		/// @param data to send
 		/// @throws SocketsException
-		void Send(ByteVector const& data);
+		void Send(ByteView data);
+
+		/// Send multiple chunks of data through socket with one call. Prefixes each chunk with its length (4 bytes)
+		/// @param data chunks to send
+		/// @throws SocketsException
+		void Send(std::vector<ByteVector> const& data);
 
-		/// Receive data from socket. Data must be prefixed with its length (4 bytes, network order)
+		/// Receive data from socket. Data must be prefixed with its length (4 bytes)
 		/// @returns ByteVector - received data. Empty if connection has been closed gracefully.
 		/// @throws SocketsException
 		ByteVector Receive();
 
+		/// Enable or disable Nagle's algorithm (TCP_NODELAY)
+		/// @param noDelay - true to send small writes immediately
+		/// @throws SocketsException
+		void SetNoDelay(bool noDelay);
+
+		/// Set size of the kernel send buffer (SO_SNDBUF)
+		/// @param bytes - buffer size
+		/// @throws SocketsException
+		void SetSendBufferSize(int bytes);
+
 		/// bind wrapper
 		/// @param addrinfo to bind socket to
 		/// @throws SocketsException
@@ -67,16 +90,54 @@ namespace FSecure
 		Socket Accept();
 
 		/// Has socket received data
+		/// @param timeout - how long to wait for data. Returns immediately by default
 		/// @throws SocketsException
-		bool HasReceivedData();
+		bool HasReceivedData(std::chrono::milliseconds timeout = std::chrono::milliseconds::zero());
+
+		/// Wait until any of sockets has received data, with one WSAPoll call
+		/// @param sockets - sockets to check
+		/// @param timeout - how long to wait for data
+		/// @return indices of sockets that have data to read or were closed, so that next Receive won't block
+		/// @throws SocketsException
+		static std::vector<size_t> WaitForData(std::vector<Socket*> const& sockets, std::chrono::milliseconds timeout);
 
 	private:
+		/// Size of m_ReceiveBuffer. Data that doesn't fit is received directly into the result
+		static constexpr size_t s_ReceiveBufferSize = 64 * 1024;
+
 		/// Wrap and take ownership of given socket
 		/// @param socket - socket to wrap
 		Socket(SOCKET socket) : m_Socket(socket) {}
 
+		/// Read exactly size bytes, using data buffered by previous reads first
+		/// @param data - destination
+		/// @param size - number of bytes to read
+		/// @return false if connection has been closed gracefully
+		/// @throws SocketsException
+		bool Receive(uint8_t* data, size_t size);
+
+		/// Convert length prefix between m_LengthOrder and host order
+		/// @param length - value to convert
+		/// @return converted value
+		uint32_t ConvertLength(uint32_t length) const;
+
+		/// Write all buffers to socket, repeating WSASend if only a part of them was sent
+		/// @param buffers - buffers to send. Modified to track progress
+		/// @param count - number of buffers
+		/// @throws SocketsException
+		void Send(WSABUF* buffers, size_t count);
+
 		/// Underlying handle
 		SOCKET m_Socket = INVALID_SOCKET;
+
+		/// Byte order of length prefixes
+		LengthOrder m_LengthOrder = LengthOrder::Network;
+
+		/// Data read from socket but not returned yet. Reused by all reads, so that small frames don't need a recv call each
+		ByteVector m_ReceiveBuffer;
+
+		/// Range of m_ReceiveBuffer that holds data not returned yet
+		size_t m_ReceiveBegin = 0, m_ReceiveEnd = 0;
 	};
 
 
@@ -87,22 +148,46 @@ namespace FSecure
 		/// Create a TCP client socket
 		/// @param addr remote address to connect to
 		/// @param port remote port
+		/// @param lengthOrder byte order of length prefixes
 		/// @throws WinSocketsException
-		ClientSocket(std::string_view addr, uint16_t port);
+		ClientSocket(std::string_view addr, uint16_t port, Socket::LengthOrder lengthOrder = Socket::LengthOrder::Network);
 
-		/// Send data through socket. Prefixes the data with its length (4 bytes, network order)
+		/// Send data through socket. Prefixes the data with its length (4 bytes)
 		/// @param data to send
 		/// @throws WinSocketsException
-		void Send(ByteVector const& data) { m_Socket.Send(data); }
+		void Send(ByteView data) { m_Socket.Send(data); }
+
+		/// Send multiple chunks of data through socket with one call. Prefixes each chunk with its length (4 bytes)
+		/// @param data chunks to send
+		/// @throws WinSocketsException
+		void Send(std::vector<ByteVector> const& data) { m_Socket.Send(data); }
 
-		/// Receive data from socket. Data must be prefixed with its length (4 bytes, network order)
+		/// Receive data from socket. Data must be prefixed with its length (4 bytes)
 		/// @returns ByteVector - received data. Empty if connection has been closed gracefully.
 		/// @throws WinSocketsException
 		ByteVector Receive() { return m_Socket.Receive(); }
 
+		/// Enable or disable Nagle's algorithm (TCP_NODELAY)
+		/// @param noDelay - true to send small writes immediately
+		/// @throws WinSocketsException
+		void SetNoDelay(bool noDelay) { m_Socket.SetNoDelay(noDelay); }
+
+		/// Set size of the kernel send buffer (SO_SNDBUF)
+		/// @param bytes - buffer size
+		/// @throws WinSocketsException
+		void SetSendBufferSize(int bytes) { m_Socket.SetSendBufferSize(bytes); }
+
 		/// Has socket received data
+		/// @param timeout - how long to wait for data. Returns immediately by default
+		/// @throws SocketsException
+		bool HasReceivedData(std::chrono::milliseconds timeout = std::chrono::milliseconds::zero()) { return m_Socket.HasReceivedData(timeout); }
+
+		/// Wait until any of sockets has received data, with one WSAPoll call
+		/// @param sockets - sockets to check
+		/// @param timeout - how long to wait for data
+		/// @return indices of sockets that have data to read or were closed, so that next Receive won't block
 		/// @throws SocketsException
-		bool HasReceivedData() { return m_Socket.HasReceivedData(); }
+		static std::vector<size_t> WaitForData(std::vector<ClientSocket*> const& sockets, std::chrono::milliseconds timeout);
 
 	private:
 		Socket m_Socket;
@@ -0,0 +1,212 @@
+#include "StdAfx.h"
+#include "SocketReactor.h"
+#include "SocketsException.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::SocketReactor::Registration::Registration(std::shared_ptr<ClientSocket> socket, ReadCallback onRead, CloseCallback onClose)
+	: m_Socket{ std::move(socket) }
+	, m_OnRead{ std::move(onRead) }
+	, m_OnClose{ std::move(onClose) }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::SocketReactor::Registration::Pause()
+{
+	std::scoped_lock lock(m_ResumeMutex);
+	m_CanResume = nullptr;
+	m_IsPaused = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::SocketReactor::Registration::PauseUntil(std::function<bool()> canResume)
+{
+	std::scoped_lock lock(m_ResumeMutex);
+	m_CanResume = std::move(canResume);
+	m_IsPaused = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::SocketReactor::Registration::Resume()
+{
+	std::scoped_lock lock(m_ResumeMutex);
+	m_CanResume = nullptr;
+	m_IsPaused = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::SocketReactor::Registration::TryResume()
+{
+	std::function<bool()> canResume;
+	{
+		std::scoped_lock lock(m_ResumeMutex);
+		canResume = m_CanResume;
+	}
+
+	// Condition is called without locks, so it may take locks of the owner.
+	try
+	{
+		if (!canResume || !canResume())
+			return false;
+	}
+	catch (...)
+	{
+	}
+
+	Resume();
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::SocketReactor::Registration::IsClosed() const
+{
+	return m_IsClosed;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::SocketReactor> FSecure::SocketReactor::Create()
+{
+	auto reactor = std::shared_ptr<SocketReactor>{ new SocketReactor };
+
+	// Thread keeps the reactor alive, so the owner never has to join it.
+	std::thread{ [self = reactor]() { self->Run(); } }.detach();
+	return reactor;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::SocketReactor::Registration> FSecure::SocketReactor::Add(std::shared_ptr<ClientSocket> socket, ReadCallback onRead, CloseCallback onClose)
+{
+	auto registration = std::shared_ptr<Registration>{ new Registration{ std::move(socket), std::move(onRead), std::move(onClose) } };
+	{
+		std::scoped_lock lock(m_AccessMutex);
+		m_Registrations.push_back(registration);
+	}
+
+	m_NewRegistration.notify_one();
+	return registration;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::SocketReactor::Stop()
+{
+	{
+		std::scoped_lock lock(m_AccessMutex);
+		m_IsRunning = false;
+	}
+
+	m_NewRegistration.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<std::shared_ptr<FSecure::SocketReactor::Registration>> FSecure::SocketReactor::GetActiveRegistrations()
+{
+	std::unique_lock lock(m_AccessMutex);
+	m_NewRegistration.wait(lock, [this] { return !m_IsRunning || !m_Registrations.empty(); });
+	if (!m_IsRunning)
+		return {};
+
+	// Registrations released by their owners or closed are not needed anymore.
+	std::vector<std::shared_ptr<Registration>> ret, paused;
+	m_Registrations.erase(std::remove_if(m_Registrations.begin(), m_Registrations.end(), [&ret, &paused](auto const& weak)
+	{
+		auto registration = weak.lock();
+		if (!registration || registration->m_IsClosed)
+			return true;
+
+		(registration->m_IsPaused ? paused : ret).push_back(std::move(registration));
+		return false;
+	}), m_Registrations.end());
+
+	lock.unlock();
+	for (auto& registration : paused)
+		if (registration->TryResume())
+			ret.push_back(std::move(registration));
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::SocketReactor::Run()
+{
+	while (m_IsRunning)
+	{
+		auto registrations = GetActiveRegistrations();
+		if (registrations.empty())
+		{
+			// All sockets are paused or reactor is stopping.
+			if (m_IsRunning)
+				std::this_thread::sleep_for(s_PollInterval);
+
+			continue;
+		}
+
+		std::vector<ClientSocket*> sockets;
+		sockets.reserve(registrations.size());
+		for (auto& registration : registrations)
+			sockets.push_back(registration->m_Socket.get());
+
+		std::vector<size_t> ready;
+		try
+		{
+			ready = ClientSocket::WaitForData(sockets, s_PollInterval);
+		}
+		catch (SocketsException&)
+		{
+			// Poll fails if any of sockets is invalid. Check them one by one to find it.
+			for (size_t i = 0; i < registrations.size(); ++i)
+				try
+				{
+					if (sockets[i]->HasReceivedData())
+						ready.push_back(i);
+				}
+				catch (...)
+				{
+					Close(*registrations[i], std::current_exception());
+				}
+		}
+
+		// One frame per socket in each pass, so that a busy socket doesn't starve others.
+		for (auto i : ready)
+		{
+			auto& registration = *registrations[i];
+			if (!m_IsRunning)
+				break;
+
+			try
+			{
+				auto frame = registration.m_Socket->Receive();
+				if (frame.empty())
+				{
+					Close(registration, nullptr);
+					continue;
+				}
+
+				try
+				{
+					registration.m_OnRead(std::move(frame));
+				}
+				catch (...)
+				{
+				}
+			}
+			catch (...)
+			{
+				Close(registration, std::current_exception());
+			}
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::SocketReactor::Close(Registration& registration, std::exception_ptr error)
+{
+	registration.m_IsClosed = true;
+	try
+	{
+		if (registration.m_OnClose)
+			registration.m_OnClose(error);
+	}
+	catch (...)
+	{
+	}
+}
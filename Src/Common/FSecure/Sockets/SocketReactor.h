@@ -0,0 +1,93 @@
+#pragma once
+
+#include "Socket.h"
+
+namespace FSecure
+{
+	/// Serves many client sockets with one thread. Waits for data on all of them at once and passes received frames to their callbacks.
+	/// Connectors use it instead of starting a thread per connection.
+	class SocketReactor : public std::enable_shared_from_this<SocketReactor>
+	{
+	public:
+		/// Called on reactor thread with every frame received on a connection
+		using ReadCallback = std::function<void(ByteVector)>;
+
+		/// Called on reactor thread once, when connection was closed by peer or failed. Exception is null if connection was closed gracefully
+		using CloseCallback = std::function<void(std::exception_ptr)>;
+
+		/// Socket registered in reactor. Reactor stops serving it when the last reference to registration is released
+		class Registration
+		{
+		public:
+			/// Stop reading from socket until Resume is called. Unread data stays in kernel buffers, so TCP flow control slows the peer down
+			void Pause();
+
+			/// Stop reading from socket until condition is met. Reactor checks it on every pass, so at least every s_PollInterval
+			/// @param canResume called on reactor thread. Reading continues when it returns true or throws
+			void PauseUntil(std::function<bool()> canResume);
+
+			/// Continue reading from socket
+			void Resume();
+
+			/// Check if connection was closed by peer or failed
+			bool IsClosed() const;
+
+		private:
+			/// Only reactor creates registrations
+			friend class SocketReactor;
+
+			/// Create a registration
+			Registration(std::shared_ptr<ClientSocket> socket, ReadCallback onRead, CloseCallback onClose);
+
+			/// Resume registration paused with PauseUntil if its condition is met. Called on reactor thread
+			/// @return true if registration was resumed
+			bool TryResume();
+
+			std::shared_ptr<ClientSocket> m_Socket;																	///< Served socket
+			ReadCallback m_OnRead;																						///< Called with received frames
+			CloseCallback m_OnClose;																					///< Called when socket is closed
+			std::atomic_bool m_IsPaused = false;																		///< True between Pause and Resume
+			std::atomic_bool m_IsClosed = false;																		///< True after socket was closed
+			std::mutex m_ResumeMutex;																				///< Guards m_CanResume
+			std::function<bool()> m_CanResume;																		///< Condition of PauseUntil. Empty if registration is not paused or was paused with Pause
+		};
+
+		/// Create reactor and start its thread
+		/// @return newly created reactor
+		static std::shared_ptr<SocketReactor> Create();
+
+		/// Start serving a socket
+		/// @param socket socket to read from. Can still be used to send data
+		/// @param onRead called with every received frame. Exceptions thrown from it are swallowed
+		/// @param onClose called when socket was closed. Exceptions thrown from it are swallowed
+		/// @return registration that keeps socket served
+		std::shared_ptr<Registration> Add(std::shared_ptr<ClientSocket> socket, ReadCallback onRead, CloseCallback onClose = {});
+
+		/// Stop reactor thread. Does not wait for running callback, so it is safe to call from one
+		void Stop();
+
+	private:
+		/// Reactor thread waits for data at most this long, to notice new, resumed and released registrations
+		static constexpr std::chrono::milliseconds s_PollInterval{ 100 };
+
+		/// Private ctor. @see SocketReactor::Create
+		SocketReactor() = default;
+
+		/// Reactor thread body
+		void Run();
+
+		/// Get registrations that should be polled. Drops released ones. Waits if there are none
+		/// @return registrations to poll. Empty if reactor was stopped
+		std::vector<std::shared_ptr<Registration>> GetActiveRegistrations();
+
+		/// Mark registration closed and notify its owner
+		/// @param registration closed registration
+		/// @param error exception that closed the socket. Null if it was closed gracefully
+		void Close(Registration& registration, std::exception_ptr error);
+
+		std::mutex m_AccessMutex;																						///< Guards m_Registrations
+		std::condition_variable m_NewRegistration;																		///< Notified when registration is added or reactor stops
+		std::vector<std::weak_ptr<Registration>> m_Registrations;														///< Served sockets
+		std::atomic_bool m_IsRunning = true;																			///< False after Stop was called
+	};
+}
@@ -6,3 +6,4 @@
 #include "SocketsException.h"
 #include "InitializeSockets.h"
 #include "DuplexConnection.h"
+#include "SocketReactor.h"
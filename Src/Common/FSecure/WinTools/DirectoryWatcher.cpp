@@ -0,0 +1,86 @@
+#include "Stdafx.h"
+#include "DirectoryWatcher.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::WinTools::DirectoryWatcher::DirectoryWatcher(std::filesystem::path const& path)
+	: m_Directory{ CreateFileW(path.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr) }
+	, m_Event{ CreateEventW(nullptr, TRUE, FALSE, nullptr) }
+	, m_Overlapped{}
+	, m_Buffer(16 * 1024)																								// 64 KiB, the most that network shares accept.
+{
+	if (m_Directory.get() == INVALID_HANDLE_VALUE)
+	{
+		m_Directory.release();
+		throw std::runtime_error{ OBF("Failed to open directory for watching. Error: ") + std::to_string(GetLastError()) };
+	}
+
+	if (!m_Event)
+		throw std::runtime_error{ OBF("Failed to create event. Error: ") + std::to_string(GetLastError()) };
+
+	m_Overlapped.hEvent = m_Event.get();
+	Watch();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::WinTools::DirectoryWatcher::~DirectoryWatcher()
+{
+	// System writes to the buffer until the request is finished.
+	DWORD bytes;
+	if (CancelIoEx(m_Directory.get(), &m_Overlapped))
+		GetOverlappedResult(m_Directory.get(), &m_Overlapped, &bytes, TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<std::vector<FSecure::WinTools::DirectoryWatcher::Change>> FSecure::WinTools::DirectoryWatcher::GetChanges()
+{
+	std::vector<Change> ret;
+	while (true)
+	{
+		DWORD bytes;
+		if (!GetOverlappedResult(m_Directory.get(), &m_Overlapped, &bytes, FALSE))
+		{
+			auto error = GetLastError();
+			if (error == ERROR_IO_INCOMPLETE)
+				return ret;
+
+			Watch();
+			if (error == ERROR_NOTIFY_ENUM_DIR)
+				return {};
+
+			throw std::runtime_error{ OBF("Failed to read directory changes. Error: ") + std::to_string(error) };
+		}
+
+		// Nothing is written if changes didn't fit in the buffer.
+		if (!bytes)
+		{
+			Watch();
+			return {};
+		}
+
+		for (auto record = reinterpret_cast<uint8_t const*>(m_Buffer.data());;)
+		{
+			auto info = reinterpret_cast<FILE_NOTIFY_INFORMATION const*>(record);
+			auto fileName = std::filesystem::path{ std::wstring_view{ info->FileName, info->FileNameLength / sizeof(WCHAR) } };
+			if (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_RENAMED_NEW_NAME)
+				ret.push_back({ true, std::move(fileName) });
+			else if (info->Action == FILE_ACTION_REMOVED || info->Action == FILE_ACTION_RENAMED_OLD_NAME)
+				ret.push_back({ false, std::move(fileName) });
+
+			if (!info->NextEntryOffset)
+				break;
+
+			record += info->NextEntryOffset;
+		}
+
+		// Changes that happened in the meantime are queued by the system and returned by the next request at once.
+		Watch();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::WinTools::DirectoryWatcher::Watch()
+{
+	ResetEvent(m_Event.get());
+	if (!ReadDirectoryChangesW(m_Directory.get(), m_Buffer.data(), static_cast<DWORD>(m_Buffer.size() * sizeof(DWORD)), FALSE, FILE_NOTIFY_CHANGE_FILE_NAME, nullptr, &m_Overlapped, nullptr))
+		throw std::runtime_error{ OBF("Failed to watch directory. Error: ") + std::to_string(GetLastError()) };
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <optional>
+#include "UniqueHandle.h"
+
+namespace FSecure::WinTools
+{
+	/// Collects names of files created, removed and renamed in a directory, using ReadDirectoryChangesW.
+	/// Changes are gathered by the system between calls of GetChanges, so watching doesn't need a thread.
+	class DirectoryWatcher
+	{
+	public:
+		/// Change of a file.
+		struct Change
+		{
+			bool m_IsAdded;																								///< True if file was created or renamed to this name, false if it was removed or renamed from this name.
+			std::filesystem::path m_FileName;																			///< Name of the file, relative to watched directory.
+		};
+
+		/// Start watching a directory.
+		/// @param path directory to watch.
+		/// @throws std::runtime_error if directory can't be watched, e.g. when share doesn't support change notifications.
+		DirectoryWatcher(std::filesystem::path const& path);
+
+		/// Destructor. Cancels watching.
+		~DirectoryWatcher();
+
+		/// Watcher's buffer is used by the system, so it can't be moved or copied.
+		DirectoryWatcher(DirectoryWatcher const&) = delete;
+
+		/// Watcher's buffer is used by the system, so it can't be moved or copied.
+		DirectoryWatcher& operator=(DirectoryWatcher const&) = delete;
+
+		/// Get changes since previous call. Doesn't block.
+		/// @return changes in order they happened, or empty optional if the system lost some of them and directory has to be scanned again.
+		/// @throws std::runtime_error if watching failed.
+		std::optional<std::vector<Change>> GetChanges();
+
+	private:
+		/// Issue next ReadDirectoryChangesW.
+		/// @throws std::runtime_error on failure.
+		void Watch();
+
+		UniqueHandle m_Directory;																						///< Watched directory.
+		UniqueHandle m_Event;																							///< Signaled when changes are written to m_Buffer.
+		OVERLAPPED m_Overlapped;																						///< State of pending ReadDirectoryChangesW.
+		std::vector<DWORD> m_Buffer;																					///< Receives FILE_NOTIFY_INFORMATION records. DWORD aligned, as required by the system.
+	};
+}
@@ -3,6 +3,8 @@
 #include "Common/FSecure/CppTools/ScopeGuard.h"
 #include "Shlobj.h"
 #include "Lm.h"
+#include <Psapi.h>
+#include <TlHelp32.h>
 #include <sstream>
 
 namespace FSecure
@@ -118,4 +120,55 @@ namespace FSecure
 			{"IsElevated", hi.m_IsElevated},
 		};
 	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	ResourceUsage ResourceUsage::Gather()
+	{
+		ResourceUsage usage;
+		auto process = ::GetCurrentProcess();
+
+		PROCESS_MEMORY_COUNTERS_EX memoryCounters{ sizeof(memoryCounters) };
+		if (::GetProcessMemoryInfo(process, reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&memoryCounters), sizeof(memoryCounters)))
+		{
+			usage.m_PrivateBytes = memoryCounters.PrivateUsage;
+			usage.m_WorkingSetBytes = memoryCounters.WorkingSetSize;
+		}
+
+		if (DWORD handleCount; ::GetProcessHandleCount(process, &handleCount))
+			usage.m_HandleCount = handleCount;
+
+		// Times are reported in 100 ns units.
+		if (FILETIME creation, exit, kernel, user; ::GetProcessTimes(process, &creation, &exit, &kernel, &user))
+		{
+			auto toTicks = [](FILETIME const& time) { return (static_cast<std::uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+			usage.m_CpuTimeMs = (toTicks(kernel) + toTicks(user)) / 10'000;
+		}
+
+		// There is no direct query for own thread count. Process snapshot is much cheaper than a thread snapshot.
+		if (auto snapshot = ::CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0); snapshot != INVALID_HANDLE_VALUE)
+		{
+			SCOPE_GUARD( ::CloseHandle(snapshot); );
+			PROCESSENTRY32W entry{ sizeof(entry) };
+			for (auto found = ::Process32FirstW(snapshot, &entry); found; found = ::Process32NextW(snapshot, &entry))
+				if (entry.th32ProcessID == ::GetCurrentProcessId())
+				{
+					usage.m_ThreadCount = entry.cntThreads;
+					break;
+				}
+		}
+
+		return usage;
+	}
+
+	void to_json(json& j, const ResourceUsage& ru)
+	{
+		j = json
+		{
+			{"PrivateBytes", ru.m_PrivateBytes},
+			{"WorkingSetBytes", ru.m_WorkingSetBytes},
+			{"HandleCount", ru.m_HandleCount},
+			{"ThreadCount", ru.m_ThreadCount},
+			{"CpuTimeMs", ru.m_CpuTimeMs},
+		};
+	}
 }
@@ -34,6 +34,24 @@ namespace FSecure
 	/// @param host info to write
 	void to_json(json& j, const HostInfo& hi);
 
+	/// Holds resources used by the process.
+	struct ResourceUsage
+	{
+		std::uint64_t m_PrivateBytes = 0;										///< Committed memory that is not shared with other processes.
+		std::uint64_t m_WorkingSetBytes = 0;									///< Memory currently resident in RAM.
+		std::uint32_t m_HandleCount = 0;										///< Open handles.
+		std::uint32_t m_ThreadCount = 0;										///< Running threads.
+		std::uint64_t m_CpuTimeMs = 0;											///< User and kernel time of all threads, in milliseconds.
+
+		/// Gather usage of the current process.
+		static ResourceUsage Gather();
+	};
+
+	/// overload to_json for ResourceUsage
+	/// @param json to write to
+	/// @param resource usage to write
+	void to_json(json& j, const ResourceUsage& ru);
+
 	/// overload ByteConverter for RTL_OSVERSIONINFOEXW. szCSDVersion and wSuiteMask are omitted.
 	template<>
 	struct ByteConverter<RTL_OSVERSIONINFOEXW>
@@ -49,10 +67,10 @@ namespace FSecure
 		/// Get size required after serialization.
 		/// @param obj. Object to be serialized.
 		/// @return size_t. Number of bytes used after serialization.
-		static size_t Size()
+		constexpr static size_t Size()
 		{
-			RTL_OSVERSIONINFOEXW* p = nullptr;
-			return ByteVector::Size(p->dwOSVersionInfoSize, p->dwMajorVersion, p->dwMinorVersion, p->dwBuildNumber, p->dwPlatformId, p->wServicePackMajor, p->wServicePackMinor, p->wProductType);
+			using T = RTL_OSVERSIONINFOEXW;
+			return ByteVector::ConstantSize<decltype(T::dwOSVersionInfoSize), decltype(T::dwMajorVersion), decltype(T::dwMinorVersion), decltype(T::dwBuildNumber), decltype(T::dwPlatformId), decltype(T::wServicePackMajor), decltype(T::wServicePackMinor), decltype(T::wProductType)>();
 		}
 
 		/// Deserialize from ByteView.
@@ -95,4 +113,35 @@ namespace FSecure
 			return ByteReader{ bv }.Create(&T::m_ComputerName, &T::m_UserName, &T::m_Domain, &T::m_OsVersionInfo, &T::m_ProcessId, &T::m_IsElevated);
 		}
 	};
+
+	/// overload ByteConverter for ResourceUsage
+	template<>
+	struct ByteConverter<ResourceUsage>
+	{
+		/// Serialize ResourceUsage type to ByteVector.
+		/// @param obj. Object to be serialized.
+		/// @param bv. ByteVector to be expanded.
+		static void To(ResourceUsage const& obj, ByteVector& bv)
+		{
+			bv.Store(obj.m_PrivateBytes, obj.m_WorkingSetBytes, obj.m_HandleCount, obj.m_ThreadCount, obj.m_CpuTimeMs);
+		}
+
+		/// Get size required after serialization.
+		/// @return size_t. Number of bytes used after serialization.
+		constexpr static size_t Size()
+		{
+			using T = ResourceUsage;
+			return ByteVector::ConstantSize<decltype(T::m_PrivateBytes), decltype(T::m_WorkingSetBytes), decltype(T::m_HandleCount), decltype(T::m_ThreadCount), decltype(T::m_CpuTimeMs)>();
+		}
+
+		/// Deserialize from ByteView.
+		/// @param bv. Buffer with serialized data.
+		/// @return ResourceUsage.
+		static ResourceUsage From(ByteView& bv)
+		{
+			ResourceUsage obj;
+			ByteReader{ bv }.Read(obj.m_PrivateBytes, obj.m_WorkingSetBytes, obj.m_HandleCount, obj.m_ThreadCount, obj.m_CpuTimeMs);
+			return obj;
+		}
+	};
 }
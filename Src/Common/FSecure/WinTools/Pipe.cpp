@@ -47,6 +47,29 @@ namespace
 	};
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::WinTools::WaitForPipe(ByteView pipename, std::chrono::milliseconds timeout)
+{
+	// WaitNamedPipe fails immediately if pipe was not created yet, so poll for it in short intervals.
+	constexpr auto pollInterval = std::chrono::milliseconds{ 5 };
+	auto name = OBF("\\\\.\\pipe\\") + std::string{ pipename };
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	for (;;)
+	{
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if (left <= 0)
+			return false;
+
+		if (WaitNamedPipeA(name.c_str(), static_cast<DWORD>(left)))
+			return true;
+
+		if (GetLastError() == ERROR_SEM_TIMEOUT)
+			return false;
+
+		std::this_thread::sleep_for(pollInterval);
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::WinTools::WritePipe::WritePipe(ByteView pipename)
 	:
@@ -74,11 +97,13 @@ size_t FSecure::WinTools::WritePipe::Write(ByteView data)
 
 	ConnectNamedPipe(m_Pipe.get(), nullptr);
 	SCOPE_GUARD( DisconnectNamedPipe(m_Pipe.get()); );
-	DWORD written;
+	DWORD written = 0;
 	uint32_t len = static_cast<uint32_t>(data.size());
-	WriteFile(m_Pipe.get(), &len, sizeof(len), nullptr, nullptr);
-	WriteFile(m_Pipe.get(), data.data(), len, &written, nullptr);
-	if (written != data.size())
+	if (!WriteFile(m_Pipe.get(), &len, sizeof(len), &written, nullptr) || written != sizeof(len))
+		throw std::runtime_error{ OBF("Write pipe failed ") };
+
+	// Data is written straight from caller's buffer.
+	if (!WriteFile(m_Pipe.get(), data.data(), len, &written, nullptr) || written != data.size())
 		throw std::runtime_error{ OBF("Write pipe failed ") };
 
 	FlushFileBuffers(m_Pipe.get());
@@ -103,7 +128,6 @@ FSecure::ByteVector FSecure::WinTools::ReadPipe::Read()
 	SCOPE_GUARD( CloseHandle(pipe); );
 
 	DWORD chunkSize;
-	uint32_t pipeBufferSize = 512u;
 	uint32_t dataSize = 0u;
 	if (!ReadFile(pipe, static_cast<LPVOID>(&dataSize), 4, nullptr, nullptr))
 		throw std::runtime_error{ OBF("Unable to read data") };
@@ -111,10 +135,11 @@ FSecure::ByteVector FSecure::WinTools::ReadPipe::Read()
 	ByteVector buffer;
 	buffer.resize(dataSize);
 
+	// Ask for everything that is left, so that a message already written by the other side takes a single read.
 	DWORD read = 0;
 	while (read < dataSize)
 	{
-		if (!ReadFile(pipe, (LPVOID)&buffer[read], static_cast<DWORD>((pipeBufferSize < (dataSize - read)) ? pipeBufferSize : (dataSize - read)), &chunkSize, nullptr) || !chunkSize)
+		if (!ReadFile(pipe, &buffer[read], dataSize - read, &chunkSize, nullptr) || !chunkSize)
 			throw std::runtime_error{ OBF("Unable to read data") };
 
 		read += chunkSize;
@@ -166,34 +191,10 @@ FSecure::WinTools::AlternatingPipe::AlternatingPipe(ByteView pipename)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::WinTools::AlternatingPipe::ReadCov()
 {
-	DWORD temp = 0, total = 0;
 	if (WaitForSingleObject(m_Event.get(), 0) != WAIT_OBJECT_0)
 		return{};
 
-	//The SMB Grunt writes the size of the chunk in a loop like the below, mimic that here.
-	BYTE size[4] = { 0 };
-	int totalReadBytes = 0;
-	for(int i = 0; i < 4; i++)
-		ReadFile(m_Pipe.get(), size + i, 1, &temp, NULL);
-
-
-	DWORD32 len = (size[0] << 24) + (size[1] << 16) + (size[2] << 8) + size[3];
-
-	ByteVector buffer;
-	buffer.resize(len);
-
-	//Now read the actual data
-	DWORD read = 0;
-	temp = 0;
-	while (total < len) {
-		bool didRead = ReadFile(m_Pipe.get(), (LPVOID)& buffer[read], len - total, &temp,
-			NULL);
-		total += temp;
-		read += temp;
-	}
-
-	return buffer;
-
+	return ReadMessage(true);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -203,48 +204,62 @@ FSecure::ByteVector FSecure::WinTools::AlternatingPipe::Read()
 	if (WaitForSingleObject(m_Event.get(), 0) != WAIT_OBJECT_0)
 		return{};
 
-	// Read four bytes and find the length of the next chunk of data.
-	DWORD chunkLength = 0, bytesReadCurrent = 0;
-	if (!ReadFile(m_Pipe.get(), &chunkLength, 4, &bytesReadCurrent, nullptr))
+	return ReadMessage(false);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteView FSecure::WinTools::AlternatingPipe::ReadMessage(bool isBigEndian)
+{
+	// Peeking doesn't block, so it can only tell if the whole message is already there.
+	constexpr auto prefixSize = static_cast<DWORD>(sizeof(uint32_t));
+	uint32_t size = 0;
+	DWORD peeked = 0, available = 0;
+	if (!PeekNamedPipe(m_Pipe.get(), &size, prefixSize, &peeked, &available, nullptr))
 		throw std::runtime_error{ OBF("Couldn't read from Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
 
-	// Read the next chunk of data up to the length specified in the previous four bytes.
-	ByteVector buffer;
-	buffer.resize(chunkLength);
-	for (DWORD bytesReadTotal = 0; bytesReadTotal < chunkLength; bytesReadTotal += bytesReadCurrent)
-		if (!ReadFile(m_Pipe.get(), &buffer[bytesReadTotal], chunkLength - bytesReadTotal, &bytesReadCurrent, nullptr))
-			throw std::runtime_error{ OBF("Couldn't read from Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
+	if (isBigEndian)
+		size = _byteswap_ulong(size);
 
-	return buffer;
+	if (peeked == prefixSize && available - prefixSize >= size)
+	{
+		m_Buffer.resize(prefixSize + size);
+		ReadExactly(m_Buffer.data(), prefixSize + size);
+		return ByteView{ m_Buffer }.SubString(prefixSize);
+	}
+
+	// Message is still being written. Its size prefix may not be complete yet.
+	ReadExactly(reinterpret_cast<uint8_t*>(&size), prefixSize);
+	if (isBigEndian)
+		size = _byteswap_ulong(size);
+
+	m_Buffer.resize(size);
+	ReadExactly(m_Buffer.data(), size);
+	return m_Buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::WinTools::AlternatingPipe::ReadExactly(uint8_t* buffer, DWORD size)
+{
+	for (DWORD bytesReadTotal = 0, bytesReadCurrent = 0; bytesReadTotal < size; bytesReadTotal += bytesReadCurrent)
+		if (!ReadFile(m_Pipe.get(), buffer + bytesReadTotal, size - bytesReadTotal, &bytesReadCurrent, nullptr))
+			throw std::runtime_error{ OBF("Couldn't read from Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 size_t FSecure::WinTools::AlternatingPipe::WriteCov(ByteView data)
 {
-	DWORD written;
-	DWORD start = 0, size = static_cast<DWORD>(data.size());
-
-	uint32_t len = static_cast<uint32_t>(data.size());
-	BYTE* bytes = (BYTE*)& len;
-	DWORD32 chunkLength = (bytes[0] << 24) + (bytes[1] << 16) + (bytes[2] << 8) + bytes[3];
+	DWORD written = 0;
+	auto chunkLength = _byteswap_ulong(static_cast<uint32_t>(data.size()));
 
 	//Write the length first
-	WriteFile(m_Pipe.get(), &chunkLength, 4, nullptr, nullptr);
-
-	//We have to write in chunks of 1024, this is mirrored in how the Grunt reads.
-	const uint8_t* d = &data.front();
-	while (size > 1024)
-	{
-		WriteFile(m_Pipe.get(), d + start, 1024, &written, nullptr);
-		start += 1024;
-		size -= 1024;
-	}
-	WriteFile(m_Pipe.get(), d + start, size, &written, nullptr);
-	start += size;
+	if (!WriteFile(m_Pipe.get(), &chunkLength, 4, &written, nullptr))
+		throw std::runtime_error{ OBF("Couldn't write to Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
 
-	if (start != data.size())
-		throw std::runtime_error{ OBF("Write pipe failed ") };
+	//We have to write in chunks of 1024, this is mirrored in how the Grunt reads. Chunks are written straight from caller's buffer.
+	for (size_t start = 0; start < data.size(); start += written)
+		if (!WriteFile(m_Pipe.get(), data.data() + start, static_cast<DWORD>(std::min<size_t>(1024, data.size() - start)), &written, nullptr))
+			throw std::runtime_error{ OBF("Couldn't write to Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
 
 	// Let Read() know that the pipe is ready to be read.
 	SetEvent(m_Event.get());
@@ -260,7 +275,7 @@ size_t FSecure::WinTools::AlternatingPipe::Write(ByteView data)
 		throw std::runtime_error{ OBF("Couldn't write to Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
 
 	// Write the chunk.
-	if (!WriteFile(m_Pipe.get(), &data.front(), chunkLength, &bytesWritten, nullptr))
+	if (!WriteFile(m_Pipe.get(), data.data(), chunkLength, &bytesWritten, nullptr))
 		throw std::runtime_error{ OBF("Couldn't write to Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
 
 	// Let Read() know that the pipe is ready to be read.
@@ -269,3 +284,238 @@ size_t FSecure::WinTools::AlternatingPipe::Write(ByteView data)
 	return data.size();
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::WinTools::OverlappedPipe::OverlappedPipe(ByteView pipename)
+	: m_PipeName(OBF("\\\\.\\pipe\\") + std::string{ pipename })
+	, m_Pipe([&]() {auto tmp = CreateFileA(m_PipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, g_SecurityAttributes.get(), OPEN_EXISTING, FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_ANONYMOUS, NULL); return tmp == INVALID_HANDLE_VALUE ? nullptr : tmp; }())
+	, m_ReadEvent(CreateEvent(nullptr, true, false, nullptr))
+	, m_WriteEvent(CreateEvent(nullptr, true, false, nullptr))
+{
+	if (!m_Pipe)
+		throw std::runtime_error{ OBF("Couldn't open named") };
+
+	if (!m_ReadEvent || !m_WriteEvent)
+		throw std::runtime_error{ OBF("Couldn't create synchronization event") };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::WinTools::OverlappedPipe::OverlappedPipe(std::string pipename, HANDLE pipe)
+	: m_PipeName(std::move(pipename))
+	, m_Pipe(pipe)
+	, m_ReadEvent(CreateEvent(nullptr, true, false, nullptr))
+	, m_WriteEvent(CreateEvent(nullptr, true, false, nullptr))
+{
+	if (!m_ReadEvent || !m_WriteEvent)
+		throw std::runtime_error{ OBF("Couldn't create synchronization event") };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::unique_ptr<FSecure::WinTools::OverlappedPipe> FSecure::WinTools::OverlappedPipe::Create(ByteView pipename)
+{
+	auto name = OBF("\\\\.\\pipe\\") + std::string{ pipename };
+	auto pipe = CreateNamedPipeA(name.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 1024 * 1024, 1024 * 1024, 0, g_SecurityAttributes.get());
+	if (pipe == INVALID_HANDLE_VALUE)
+		throw std::runtime_error{ OBF("Couldn't create named pipe: ") + std::to_string(GetLastError()) + OBF(".") };
+
+	return std::unique_ptr<OverlappedPipe>{ new OverlappedPipe{ std::move(name), pipe } };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::WinTools::OverlappedPipe::WaitForClient(std::chrono::milliseconds timeout, HANDLE abortHandle)
+{
+	m_ReadOverlapped = {};
+	m_ReadOverlapped.hEvent = m_ReadEvent.get();
+	if (ConnectNamedPipe(m_Pipe.get(), &m_ReadOverlapped))
+		return;
+
+	switch (GetLastError())
+	{
+	case ERROR_PIPE_CONNECTED:
+		return;
+	case ERROR_IO_PENDING:
+		break;
+	default:
+		throw std::runtime_error{ OBF("Couldn't wait for Pipe client: ") + std::to_string(GetLastError()) + OBF(".") };
+	}
+
+	HANDLE handles[] = { m_ReadEvent.get(), abortHandle };
+	if (WaitForMultipleObjects(abortHandle ? 2 : 1, handles, false, static_cast<DWORD>(timeout.count())) != WAIT_OBJECT_0)
+	{
+		// Kernel writes to m_ReadOverlapped until operation is cancelled.
+		DWORD unused;
+		if (CancelIoEx(m_Pipe.get(), &m_ReadOverlapped))
+			GetOverlappedResult(m_Pipe.get(), &m_ReadOverlapped, &unused, true);
+
+		throw std::runtime_error{ OBF("Pipe client didn't connect.") };
+	}
+
+	DWORD unused;
+	if (!GetOverlappedResult(m_Pipe.get(), &m_ReadOverlapped, &unused, false))
+		throw std::runtime_error{ OBF("Couldn't wait for Pipe client: ") + std::to_string(GetLastError()) + OBF(".") };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::WinTools::OverlappedPipe::~OverlappedPipe()
+{
+	// Kernel writes to m_MessageSize until pending read is finished.
+	DWORD read;
+	if (m_IsReadPending && CancelIoEx(m_Pipe.get(), &m_ReadOverlapped))
+		GetOverlappedResult(m_Pipe.get(), &m_ReadOverlapped, &read, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+HANDLE FSecure::WinTools::OverlappedPipe::PrepareRead()
+{
+	// Size prefix is read asynchronously, because it arrives only when the other side answers.
+	if (!m_IsReadPending)
+	{
+		m_ReadOverlapped = {};
+		m_ReadOverlapped.hEvent = m_ReadEvent.get();
+		if (!ReadFile(m_Pipe.get(), &m_MessageSize, sizeof(m_MessageSize), nullptr, &m_ReadOverlapped) && GetLastError() != ERROR_IO_PENDING)
+			throw std::runtime_error{ OBF("Couldn't read from Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
+
+		m_IsReadPending = true;
+	}
+
+	return m_ReadEvent.get();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ByteVector> FSecure::WinTools::OverlappedPipe::Read(HANDLE stopEvent)
+{
+	return ReadMessage(stopEvent, false);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ByteVector> FSecure::WinTools::OverlappedPipe::ReadCov(HANDLE stopEvent)
+{
+	return ReadMessage(stopEvent, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ByteVector> FSecure::WinTools::OverlappedPipe::ReadMessage(HANDLE stopEvent, bool isBigEndian)
+{
+	auto size = ReadMessageSize(stopEvent, isBigEndian);
+	if (!size)
+		return {};
+
+	ByteVector buffer;
+	buffer.resize(*size);
+	ReadExactly(buffer.data(), *size);
+	return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::WinTools::OverlappedPipe::ReadSegments(size_t segmentSize, SegmentHandler const& onSegment, HANDLE stopEvent)
+{
+	return ReadMessageSegments(stopEvent, false, segmentSize, onSegment);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::WinTools::OverlappedPipe::ReadCovSegments(size_t segmentSize, SegmentHandler const& onSegment, HANDLE stopEvent)
+{
+	return ReadMessageSegments(stopEvent, true, segmentSize, onSegment);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::WinTools::OverlappedPipe::ReadMessageSegments(HANDLE stopEvent, bool isBigEndian, size_t segmentSize, SegmentHandler const& onSegment)
+{
+	if (!segmentSize)
+		throw std::invalid_argument{ OBF("Segment size must be positive.") };
+
+	auto size = ReadMessageSize(stopEvent, isBigEndian);
+	if (!size)
+		return false;
+
+	// Buffer is reused for all segments and messages, so that reading doesn't allocate memory. Empty message is passed as a single empty segment.
+	m_SegmentBuffer.resize(std::max(m_SegmentBuffer.size(), std::min<size_t>(*size, segmentSize)));
+	uint32_t offset = 0;
+	do
+	{
+		auto length = static_cast<DWORD>(std::min<size_t>(*size - offset, segmentSize));
+		ReadExactly(m_SegmentBuffer.data(), length);
+		onSegment(ByteView{ m_SegmentBuffer }.SubString(0, length), *size, offset);
+		offset += length;
+	} while (offset < *size);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<uint32_t> FSecure::WinTools::OverlappedPipe::ReadMessageSize(HANDLE stopEvent, bool isBigEndian)
+{
+	HANDLE events[] = { PrepareRead(), stopEvent };
+	switch (WaitForMultipleObjects(stopEvent ? 2 : 1, events, false, INFINITE))
+	{
+	case WAIT_OBJECT_0:
+		break;
+	case WAIT_OBJECT_0 + 1:
+		return {};
+	default:
+		throw std::runtime_error{ OBF("Couldn't wait for Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
+	}
+
+	DWORD read = 0;
+	m_IsReadPending = false;
+	if (!GetOverlappedResult(m_Pipe.get(), &m_ReadOverlapped, &read, false))
+		throw std::runtime_error{ OBF("Couldn't read from Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
+
+	// The rest of the message follows the prefix right away.
+	if (read < sizeof(m_MessageSize))
+		ReadExactly(reinterpret_cast<uint8_t*>(&m_MessageSize) + read, sizeof(m_MessageSize) - read);
+
+	if (isBigEndian)
+		m_MessageSize = _byteswap_ulong(m_MessageSize);
+
+	return m_MessageSize;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::WinTools::OverlappedPipe::Write(ByteView data)
+{
+	auto chunkLength = static_cast<uint32_t>(data.size());
+	WriteExactly(reinterpret_cast<uint8_t const*>(&chunkLength), sizeof(chunkLength));
+	WriteExactly(data.data(), chunkLength);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::WinTools::OverlappedPipe::WriteCov(ByteView data)
+{
+	auto chunkLength = _byteswap_ulong(static_cast<uint32_t>(data.size()));
+	WriteExactly(reinterpret_cast<uint8_t const*>(&chunkLength), sizeof(chunkLength));
+
+	// We have to write in chunks of 1024, this is mirrored in how the Grunt reads.
+	for (size_t start = 0; start < data.size(); start += 1024)
+		WriteExactly(data.data() + start, static_cast<DWORD>(std::min<size_t>(1024, data.size() - start)));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::WinTools::OverlappedPipe::ReadExactly(uint8_t* buffer, DWORD size)
+{
+	for (DWORD bytesReadTotal = 0, bytesReadCurrent = 0; bytesReadTotal < size; bytesReadTotal += bytesReadCurrent)
+	{
+		m_ReadOverlapped = {};
+		m_ReadOverlapped.hEvent = m_ReadEvent.get();
+		if (!ReadFile(m_Pipe.get(), buffer + bytesReadTotal, size - bytesReadTotal, nullptr, &m_ReadOverlapped) && GetLastError() != ERROR_IO_PENDING)
+			throw std::runtime_error{ OBF("Couldn't read from Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
+
+		if (!GetOverlappedResult(m_Pipe.get(), &m_ReadOverlapped, &bytesReadCurrent, true))
+			throw std::runtime_error{ OBF("Couldn't read from Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::WinTools::OverlappedPipe::WriteExactly(uint8_t const* buffer, DWORD size)
+{
+	for (DWORD bytesWrittenTotal = 0, bytesWrittenCurrent = 0; bytesWrittenTotal < size; bytesWrittenTotal += bytesWrittenCurrent)
+	{
+		m_WriteOverlapped = {};
+		m_WriteOverlapped.hEvent = m_WriteEvent.get();
+		if (!WriteFile(m_Pipe.get(), buffer + bytesWrittenTotal, size - bytesWrittenTotal, nullptr, &m_WriteOverlapped) && GetLastError() != ERROR_IO_PENDING)
+			throw std::runtime_error{ OBF("Couldn't write to Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
+
+		if (!GetOverlappedResult(m_Pipe.get(), &m_WriteOverlapped, &bytesWrittenCurrent, true))
+			throw std::runtime_error{ OBF("Couldn't write to Pipe: ") + std::to_string(GetLastError()) + OBF(".") };
+	}
+}
+
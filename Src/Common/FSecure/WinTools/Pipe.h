@@ -1,9 +1,18 @@
 #pragma once
 
+#include <optional>
+#include <functional>
 #include "UniqueHandle.h"
 
 namespace FSecure::WinTools
 {
+	/// Waits until pipe created by other side of communication can be opened.
+	/// Returns as soon as the pipe appears, so callers don't have to sleep between connection trials.
+	/// @param pipename name of the pipe. Pipe prefix is not required.
+	/// @param timeout maximal time to wait.
+	/// @return true if pipe instance is available, false on timeout.
+	bool WaitForPipe(ByteView pipename, std::chrono::milliseconds timeout);
+
 	/// Class that does not own any pipe, can be used to read and write data in alternating way.
 	class AlternatingPipe // TODO support for creating pipe.
 	{
@@ -29,6 +38,17 @@ namespace FSecure::WinTools
 		///Covenant specific implementation of Write
 		size_t WriteCov(ByteView data);
 	private:
+		/// Reads one message to m_Buffer.
+		/// If the whole message is already in the pipe, size prefix and data are taken with a single read.
+		/// @param isBigEndian true if size prefix is big-endian.
+		/// @return message. Valid until the next read.
+		ByteView ReadMessage(bool isBigEndian);
+
+		/// Reads exactly as many bytes as requested.
+		/// @param buffer memory to fill.
+		/// @param size number of bytes to read.
+		void ReadExactly(uint8_t* buffer, DWORD size);
+
 		/// Name of the Pipe used to communicate with the implant.
 		std::string m_PipeName;
 
@@ -37,6 +57,146 @@ namespace FSecure::WinTools
 
 		/// Unnamed event used to synchronize reads/writes to the pipe.
 		UniqueHandle m_Event;
+
+		/// Messages are read here. Grows to the longest message and is reused, so reading doesn't allocate memory for every message.
+		ByteVector m_Buffer;
+	};
+
+	/// Class that does not own any pipe, reads and writes messages with overlapped I/O.
+	/// Messages are prefixed with their size, like in AlternatingPipe. Waiting for a message can be interrupted, so the owner can react to other events while the other side prepares an answer.
+	/// One thread can read while other one writes, so both directions of the pipe can be used at the same time.
+	class OverlappedPipe
+	{
+	public:
+		/// Public constructor.
+		///
+		/// @param pipename. Name used for pipe registration. Pipe prefix is not required.
+		/// @throws std::runtime_error on any WinAPI errors occurring.
+		OverlappedPipe(ByteView pipename);
+
+		/// Pending read refers to members of this object, so it can't be copied.
+		OverlappedPipe(OverlappedPipe const&) = delete;
+
+		/// Pending read refers to members of this object, so it can't be copied.
+		OverlappedPipe& operator=(OverlappedPipe const&) = delete;
+
+		/// Destructor. Cancels pending read.
+		~OverlappedPipe();
+
+		/// Creates a new pipe, which the other side opens with the public constructor.
+		/// @param pipename. Name used for pipe registration. Pipe prefix is not required.
+		/// @return created pipe. Call WaitForClient before using it.
+		/// @throws std::runtime_error if pipe can't be created, e.g. because pipe of that name already exists.
+		static std::unique_ptr<OverlappedPipe> Create(ByteView pipename);
+
+		/// Waits until the other side opens a pipe made with Create.
+		/// @param timeout maximal time to wait.
+		/// @param abortHandle handle that interrupts waiting when signaled, e.g. of the process that should open the pipe. Can be null.
+		/// @throws std::runtime_error if the other side didn't open the pipe in time.
+		void WaitForClient(std::chrono::milliseconds timeout, HANDLE abortHandle = nullptr);
+
+		/// Starts waiting for a message from the other side, unless already waiting. Does not block.
+		/// Lets the owner wait for many pipes at once, e.g. with ThreadpoolWait, instead of blocking a thread in Read.
+		/// @return event signaled when the message arrives. Read called after that returns without waiting for the other side.
+		/// @throws std::runtime_error on any WinAPI errors occurring during reading from the named pipe.
+		HANDLE PrepareRead();
+
+		/// Waits for a message from the other side.
+		/// @param stopEvent event that interrupts waiting. Can be null.
+		/// @return message, or nothing if stopEvent was signaled first. Next call continues reading the same message.
+		/// @throws std::runtime_error on any WinAPI errors occurring during reading from the named pipe.
+		std::optional<ByteVector> Read(HANDLE stopEvent = nullptr);
+
+		/// Covenant specific implementation of Read. Size prefix is big-endian.
+		std::optional<ByteVector> ReadCov(HANDLE stopEvent = nullptr);
+
+		/// Called by ReadSegments for every segment of the message.
+		/// @param segment part of the message. Valid only during the call.
+		/// @param messageSize size of the whole message.
+		/// @param offset position of segment in the message.
+		using SegmentHandler = std::function<void(ByteView segment, uint32_t messageSize, uint32_t offset)>;
+
+		/// Waits for a message from the other side and reads it in segments, so that long messages are never held in memory as a whole.
+		/// @param segmentSize maximal size of a segment. Messages that fit are passed whole in a single segment.
+		/// @param onSegment called for every segment, in order.
+		/// @param stopEvent event that interrupts waiting. Can be null.
+		/// @return true if message was read, false if stopEvent was signaled first.
+		/// @throws std::runtime_error on any WinAPI errors occurring during reading from the named pipe.
+		bool ReadSegments(size_t segmentSize, SegmentHandler const& onSegment, HANDLE stopEvent = nullptr);
+
+		/// Covenant specific implementation of ReadSegments. Size prefix is big-endian.
+		bool ReadCovSegments(size_t segmentSize, SegmentHandler const& onSegment, HANDLE stopEvent = nullptr);
+
+		/// Sends message to the other side.
+		/// @param data buffer to send.
+		/// @throws std::runtime_error on any WinAPI errors occurring during writing to the named pipe.
+		void Write(ByteView data);
+
+		/// Covenant specific implementation of Write. Size prefix is big-endian and data is written in chunks the Grunt reads.
+		void WriteCov(ByteView data);
+
+	private:
+		/// Takes ownership of pipe created by Create.
+		/// @param pipename full name of the pipe.
+		/// @param pipe pipe handle.
+		OverlappedPipe(std::string pipename, HANDLE pipe);
+
+		/// Waits for a message from the other side.
+		/// @param stopEvent event that interrupts waiting. Can be null.
+		/// @param isBigEndian true if size prefix is big-endian.
+		/// @return message, or nothing if stopEvent was signaled first.
+		std::optional<ByteVector> ReadMessage(HANDLE stopEvent, bool isBigEndian);
+
+		/// Waits for a message from the other side and reads it in segments.
+		/// @param stopEvent event that interrupts waiting. Can be null.
+		/// @param isBigEndian true if size prefix is big-endian.
+		/// @param segmentSize maximal size of a segment.
+		/// @param onSegment called for every segment, in order.
+		/// @return true if message was read, false if stopEvent was signaled first.
+		bool ReadMessageSegments(HANDLE stopEvent, bool isBigEndian, size_t segmentSize, SegmentHandler const& onSegment);
+
+		/// Waits for size prefix of a message from the other side.
+		/// @param stopEvent event that interrupts waiting. Can be null.
+		/// @param isBigEndian true if size prefix is big-endian.
+		/// @return size of the message that follows, or nothing if stopEvent was signaled first.
+		std::optional<uint32_t> ReadMessageSize(HANDLE stopEvent, bool isBigEndian);
+
+		/// Reads exactly as many bytes as requested.
+		/// @param buffer memory to fill.
+		/// @param size number of bytes to read.
+		void ReadExactly(uint8_t* buffer, DWORD size);
+
+		/// Writes whole buffer.
+		/// @param buffer data to write.
+		/// @param size number of bytes to write.
+		void WriteExactly(uint8_t const* buffer, DWORD size);
+
+		/// Name of the Pipe used to communicate with the implant.
+		std::string m_PipeName;
+
+		/// Communication Pipe handle.
+		UniqueHandle m_Pipe;
+
+		/// Signaled when read operation completes.
+		UniqueHandle m_ReadEvent;
+
+		/// Signaled when write operation completes.
+		UniqueHandle m_WriteEvent;
+
+		/// State of read operation.
+		OVERLAPPED m_ReadOverlapped = {};
+
+		/// State of write operation.
+		OVERLAPPED m_WriteOverlapped = {};
+
+		/// Size prefix of the message being read.
+		uint32_t m_MessageSize = 0;
+
+		/// Segments are read here. Grows to the longest segment and is reused by all messages.
+		ByteVector m_SegmentBuffer;
+
+		/// True if reading of size prefix was started, but not finished.
+		bool m_IsReadPending = false;
 	};
 
 	/// Class that owns one pipe and can write to it.
@@ -1,5 +1,87 @@
 #include "StdAfx.h"
 #include "Proxy.h"
+#include <winhttp.h>
+
+#pragma comment(lib, "winhttp.lib")
+
+namespace
+{
+	/// How long discovered proxy is reused.
+	constexpr auto s_DiscoveredProxyTtl = std::chrono::minutes{ 10 };
+
+	/// Proxy discovered for scheme, host and port.
+	struct DiscoveredProxy
+	{
+		std::wstring m_Proxy;																							///< Proxy address, empty if there is none.
+		std::chrono::steady_clock::time_point m_ExpiresAt;																///< Time when proxy should be discovered again.
+	};
+
+	std::mutex g_DiscoveredProxiesMutex;																				///< Guards g_DiscoveredProxies.
+	std::unordered_map<std::wstring, DiscoveredProxy> g_DiscoveredProxies;												///< Discovered proxies by scheme, host and port.
+
+	/// Get scheme, host and port part of url.
+	/// @param url absolute url.
+	/// @return beginning of url up to the path.
+	std::wstring GetAuthority(std::wstring const& url)
+	{
+		auto hostBegin = url.find(OBF(L"://"));
+		hostBegin = hostBegin == std::wstring::npos ? 0 : hostBegin + 3;
+		return url.substr(0, url.find_first_of(L"/?#", hostBegin));
+	}
+
+	/// Take the first proxy from WinHTTP proxy list, e.g. "proxy:8080;other:8080" or "http=proxy:8080;https=proxy:8443".
+	/// @param proxyList list returned by WinHTTP.
+	/// @return address of the first proxy with scheme, empty if list is empty.
+	std::wstring GetFirstProxy(std::wstring_view proxyList)
+	{
+		auto proxy = proxyList.substr(0, proxyList.find_first_of(L"; "));
+		if (auto assignment = proxy.find(L'='); assignment != std::wstring_view::npos)
+			proxy.remove_prefix(assignment + 1);
+
+		if (proxy.empty() || proxy.find(OBF(L"://")) != std::wstring_view::npos)
+			return std::wstring{ proxy };
+
+		return OBF(L"http://") + std::wstring{ proxy };
+	}
+
+	/// Ask WinHTTP for proxy of url.
+	/// @param url absolute url.
+	/// @return proxy address, empty if url should be reached directly.
+	std::wstring QueryProxy(std::wstring const& url)
+	{
+		// Session is only used for discovery, it is shared by all queries.
+		static std::unique_ptr<void, decltype(&WinHttpCloseHandle)> session{ WinHttpOpen(nullptr, WINHTTP_ACCESS_TYPE_NO_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0), &WinHttpCloseHandle };
+		if (!session)
+			return {};
+
+		WINHTTP_CURRENT_USER_IE_PROXY_CONFIG ieConfig{};
+		WinHttpGetIEProxyConfigForCurrentUser(&ieConfig);
+		SCOPE_GUARD( GlobalFree(ieConfig.lpszAutoConfigUrl); GlobalFree(ieConfig.lpszProxy); GlobalFree(ieConfig.lpszProxyBypass); );
+
+		WINHTTP_AUTOPROXY_OPTIONS options{};
+		options.fAutoLogonIfChallenged = TRUE;
+		if (ieConfig.lpszAutoConfigUrl)
+		{
+			options.dwFlags = WINHTTP_AUTOPROXY_CONFIG_URL;
+			options.lpszAutoConfigUrl = ieConfig.lpszAutoConfigUrl;
+		}
+		else
+		{
+			options.dwFlags = WINHTTP_AUTOPROXY_AUTO_DETECT;
+			options.dwAutoDetectFlags = WINHTTP_AUTO_DETECT_TYPE_DHCP | WINHTTP_AUTO_DETECT_TYPE_DNS_A;
+		}
+
+		WINHTTP_PROXY_INFO info{};
+		if (WinHttpGetProxyForUrl(session.get(), url.c_str(), &options, &info))
+		{
+			SCOPE_GUARD( GlobalFree(info.lpszProxy); GlobalFree(info.lpszProxyBypass); );
+			return info.dwAccessType == WINHTTP_ACCESS_TYPE_NAMED_PROXY && info.lpszProxy ? GetFirstProxy(info.lpszProxy) : std::wstring{};
+		}
+
+		// No PAC script was found. Fall back to the proxy set manually in Internet Options.
+		return ieConfig.lpszProxy ? GetFirstProxy(ieConfig.lpszProxy) : std::wstring{};
+	}
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::wstring FSecure::WinTools::GetProxyConfiguration()
@@ -10,3 +92,20 @@ std::wstring FSecure::WinTools::GetProxyConfiguration()
 	std::unique_ptr<wchar_t, void(*)(wchar_t*)> holder(pValue, [](wchar_t* p) { free(p); });
 	return (!err && pValue && len) ? std::wstring{ pValue, len - 1 } : std::wstring{};
 }
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::wstring FSecure::WinTools::DiscoverProxy(std::wstring const& url)
+{
+	auto authority = GetAuthority(url);
+	{
+		std::scoped_lock lock(g_DiscoveredProxiesMutex);
+		if (auto cached = g_DiscoveredProxies.find(authority); cached != g_DiscoveredProxies.end() && cached->second.m_ExpiresAt > std::chrono::steady_clock::now())
+			return cached->second.m_Proxy;
+	}
+
+	// Lock is not held during discovery, so that other hosts don't wait for it. Concurrent discoveries of the same host store the same result.
+	auto proxy = QueryProxy(url);
+	std::scoped_lock lock(g_DiscoveredProxiesMutex);
+	g_DiscoveredProxies[authority] = { proxy, std::chrono::steady_clock::now() + s_DiscoveredProxyTtl };
+	return proxy;
+}
@@ -4,4 +4,10 @@ namespace FSecure::WinTools
 {
 	/// Retrieve proxy configuration from environment.
 	std::wstring GetProxyConfiguration();
+
+	/// Find proxy for url with PAC script configured for current user, or with WPAD if there is none.
+	/// Discovery can take seconds, so results are cached for the whole process per scheme, host and port. Cached result is discovered again after ten minutes, so that moving to another network is noticed.
+	/// @param url absolute url.
+	/// @return proxy address, e.g. "http://proxy:8080", or empty string if url should be reached directly.
+	std::wstring DiscoverProxy(std::wstring const& url);
 }
\ No newline at end of file
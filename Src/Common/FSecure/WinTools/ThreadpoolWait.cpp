@@ -0,0 +1,38 @@
+#include "Stdafx.h"
+#include "ThreadpoolWait.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::WinTools::ThreadpoolWait::ThreadpoolWait(std::function<void()> handler)
+	: m_Handler{ std::move(handler) }
+	, m_Wait{ CreateThreadpoolWait(&ThreadpoolWait::OnSignaled, this, nullptr) }
+{
+	if (!m_Wait)
+		throw std::runtime_error{ OBF("Failed to create thread pool wait. Error: ") + std::to_string(GetLastError()) };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::WinTools::ThreadpoolWait::~ThreadpoolWait()
+{
+	Disarm();
+	CloseThreadpoolWait(m_Wait);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::WinTools::ThreadpoolWait::Arm(HANDLE handle)
+{
+	SetThreadpoolWait(m_Wait, handle, nullptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::WinTools::ThreadpoolWait::Disarm()
+{
+	// Cancel callbacks that haven't started yet, running ones use the owner of this object until they return.
+	SetThreadpoolWait(m_Wait, nullptr, nullptr);
+	WaitForThreadpoolWaitCallbacks(m_Wait, TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CALLBACK FSecure::WinTools::ThreadpoolWait::OnSignaled(PTP_CALLBACK_INSTANCE, PVOID context, PTP_WAIT, TP_WAIT_RESULT)
+{
+	static_cast<ThreadpoolWait*>(context)->m_Handler();
+}
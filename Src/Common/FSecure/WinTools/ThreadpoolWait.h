@@ -0,0 +1,38 @@
+#pragma once
+
+namespace FSecure::WinTools
+{
+	/// Calls a handler on a thread of the system thread pool when a handle gets signaled, using CreateThreadpoolWait.
+	/// Lets many objects wait for their pipes, events or processes without blocking a thread each.
+	class ThreadpoolWait
+	{
+	public:
+		/// Create wait. Nothing is waited for until Arm is called.
+		/// @param handler called once for every Arm, after armed handle gets signaled.
+		/// @throws std::runtime_error if wait can't be created.
+		ThreadpoolWait(std::function<void()> handler);
+
+		/// Destructor. Disarms wait.
+		~ThreadpoolWait();
+
+		/// Thread pool refers to this object, so it can't be moved or copied.
+		ThreadpoolWait(ThreadpoolWait const&) = delete;
+
+		/// Thread pool refers to this object, so it can't be moved or copied.
+		ThreadpoolWait& operator=(ThreadpoolWait const&) = delete;
+
+		/// Wait for handle to get signaled. Handler is called once, it can Arm again to keep waiting.
+		/// @param handle handle to wait for. Replaces handle armed previously.
+		void Arm(HANDLE handle);
+
+		/// Stop waiting and wait for running handler to return. Must not be called from the handler.
+		void Disarm();
+
+	private:
+		/// Thread pool callback.
+		static void CALLBACK OnSignaled(PTP_CALLBACK_INSTANCE, PVOID context, PTP_WAIT, TP_WAIT_RESULT);
+
+		std::function<void()> m_Handler;																				///< Called when armed handle gets signaled.
+		PTP_WAIT m_Wait;																								///< Thread pool wait object.
+	};
+}
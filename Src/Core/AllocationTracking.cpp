@@ -0,0 +1,120 @@
+#include "StdAfx.h"
+#include "AllocationTracking.h"
+
+#ifdef C3_COUNT_ALLOCATIONS
+namespace
+{
+	using FSecure::C3::Core::AllocationTracking::Subsystem;
+
+	/// Counters of one subsystem. Updated by every thread, so they are atomic.
+	struct AtomicCounters
+	{
+		std::atomic<std::uint64_t> m_Allocations = 0;																	///< @see Counters::m_Allocations.
+		std::atomic<std::uint64_t> m_Bytes = 0;																			///< @see Counters::m_Bytes.
+	};
+
+	/// Counters of every subsystem. Zero-initialized before any allocation of the process, so they can be used by operator new called during static initialization.
+	AtomicCounters g_Counters[static_cast<size_t>(Subsystem::Count)];
+
+	/// Subsystem charged for allocations of this thread. Constant-initialized, so reading it doesn't allocate.
+	thread_local Subsystem t_CurrentSubsystem = Subsystem::Other;
+
+	/// Allocate and count memory.
+	/// @param size number of bytes.
+	/// @return allocated memory.
+	/// @throws std::bad_alloc if memory couldn't be allocated.
+	void* CountedAllocate(size_t size)
+	{
+		auto& counters = g_Counters[static_cast<size_t>(t_CurrentSubsystem)];
+		counters.m_Allocations.fetch_add(1, std::memory_order_relaxed);
+		counters.m_Bytes.fetch_add(size, std::memory_order_relaxed);
+		if (auto ptr = std::malloc(size ? size : 1))
+			return ptr;
+
+		throw std::bad_alloc{};
+	}
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::AllocationTracking::Snapshot FSecure::C3::Core::AllocationTracking::Get() noexcept
+{
+	Snapshot snapshot;
+#ifdef C3_COUNT_ALLOCATIONS
+	for (size_t i = 0; i < snapshot.size(); ++i)
+		snapshot[i] = { g_Counters[i].m_Allocations.load(std::memory_order_relaxed), g_Counters[i].m_Bytes.load(std::memory_order_relaxed) };
+#endif
+
+	return snapshot;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+char const* FSecure::C3::Core::AllocationTracking::GetName(Subsystem subsystem) noexcept
+{
+	switch (subsystem)
+	{
+	case Subsystem::QualityOfService:
+		return "qos";
+	case Subsystem::Crypto:
+		return "crypto";
+	case Subsystem::Procedures:
+		return "procedures";
+	case Subsystem::Channels:
+		return "channels";
+	case Subsystem::Profiler:
+		return "profiler";
+	default:
+		return "other";
+	}
+}
+
+#ifdef C3_COUNT_ALLOCATIONS
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::AllocationTracking::Scope::Scope(Subsystem subsystem) noexcept
+	: m_Previous{ std::exchange(t_CurrentSubsystem, subsystem) }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::AllocationTracking::Scope::~Scope()
+{
+	t_CurrentSubsystem = m_Previous;
+}
+
+// Replacements of global allocation functions. Core is linked statically, so they replace allocation functions of the whole Relay. Nothrow and aligned versions are not replaced, they are rarely used by C3.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void* operator new(size_t size)
+{
+	return CountedAllocate(size);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void* operator new[](size_t size)
+{
+	return CountedAllocate(size);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void operator delete[](void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void operator delete(void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void operator delete[](void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+#endif
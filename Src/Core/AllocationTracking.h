@@ -0,0 +1,70 @@
+#pragma once
+
+namespace FSecure::C3::Core::AllocationTracking
+{
+	/// Parts of the packet pipeline which heap allocations are counted separately.
+	enum class Subsystem : std::uint8_t
+	{
+		Other,																											///< Allocations made outside of tagged scopes, e.g. routing and Relay's own bookkeeping.
+		QualityOfService,																								///< Chunking and reassembly of packets.
+		Crypto,																											///< Encryption and decryption of packets.
+		Procedures,																										///< Parsing and handling of decrypted protocol packets.
+		Channels,																										///< Channel's own code sending and receiving frames.
+		Profiler,																										///< Building and updating Network Profile.
+		Count,																											///< Number of subsystems. Not a subsystem.
+	};
+
+	/// Heap allocations of one subsystem.
+	struct Counters
+	{
+		std::uint64_t m_Allocations = 0;																				///< Number of calls to operator new.
+		std::uint64_t m_Bytes = 0;																						///< Sum of requested bytes.
+	};
+
+	/// Counters of every subsystem, indexed by Subsystem.
+	using Snapshot = std::array<Counters, static_cast<size_t>(Subsystem::Count)>;
+
+	/// Allocations are counted only in instrumented builds, which define C3_COUNT_ALLOCATIONS. Global operator new is replaced in them.
+	/// Build with "msbuild /p:C3CountAllocations=true" to define it for Core and the tools linking Core.
+#ifdef C3_COUNT_ALLOCATIONS
+	constexpr bool IsEnabled = true;
+#else
+	constexpr bool IsEnabled = false;
+#endif
+
+	/// Read counters. Safe to call from any thread.
+	/// @return counters since the start of the process. All zero if allocations are not counted.
+	Snapshot Get() noexcept;
+
+	/// Get name of a subsystem, used in reports and metric labels.
+	/// @param subsystem subsystem to name.
+	/// @return short lowercase name.
+	char const* GetName(Subsystem subsystem) noexcept;
+
+	/// Tags allocations made by the thread during the scope's lifetime with a subsystem. Nested scope overrides outer one until it ends, so every allocation is counted once.
+	/// Tasks posted to other threads are not tagged. Without C3_COUNT_ALLOCATIONS scopes are empty.
+	class Scope
+	{
+	public:
+#ifdef C3_COUNT_ALLOCATIONS
+		/// Start tagging.
+		/// @param subsystem subsystem charged for allocations of the thread.
+		Scope(Subsystem subsystem) noexcept;
+
+		/// Restore tag of the outer scope.
+		~Scope();
+#else
+		/// Counting is not compiled in.
+		Scope(Subsystem) noexcept {}
+#endif
+
+		/// Scopes are bound to the thread's stack.
+		Scope(Scope const&) = delete;
+		Scope& operator=(Scope const&) = delete;
+
+#ifdef C3_COUNT_ALLOCATIONS
+	private:
+		Subsystem m_Previous;																							///< Tag of the outer scope.
+#endif
+	};
+}
@@ -3,6 +3,7 @@
 #include "Common/FSecure/Crypto/Base64.h"
 #include "GateRelay.h"
 #include "NodeRelay.h"
+#include "ConnectorHost.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /// Anonymous namespace with helpers.
@@ -62,6 +63,97 @@ namespace
 		return std::make_tuple(false, singatures, broadcastKey);
 	}
 
+	/// Converts name of Network key encryption algorithm used in configuration file.
+	/// @param name one of FSecure::Crypto::GetName values or "fastest".
+	/// @return algorithm with given name. "fastest" selects AES-256-GCM if this CPU accelerates it, XChaCha20-Poly1305 otherwise.
+	/// @throws std::invalid_argument if name is unknown or algorithm is not available on this CPU.
+	FSecure::Crypto::AeadSuite ParseBroadcastSuite(std::string const& name)
+	{
+		auto suite = name == OBF("fastest") ? FSecure::Crypto::GetFastestAeadSuite() : FSecure::Crypto::ParseAeadSuite(name);
+		if (!FSecure::Crypto::IsAvailable(suite))
+			throw std::invalid_argument{ OBF_STR("Broadcast cipher ") + name + OBF(" is not available on this CPU.") };
+
+		return suite;
+	}
+
+	/// Converts name of outbound queue overflow policy used in configuration file.
+	/// @param name one of "Block", "DropOldest" or "DropNewest".
+	/// @return policy with given name.
+	/// @throws std::invalid_argument if name is unknown.
+	FSecure::C3::QualityOfService::OverflowPolicy ParseOverflowPolicy(std::string const& name)
+	{
+		using FSecure::C3::QualityOfService;
+		if (name == OBF("Block"))
+			return QualityOfService::OverflowPolicy::Block;
+
+		if (name == OBF("DropOldest"))
+			return QualityOfService::OverflowPolicy::DropOldest;
+
+		if (name == OBF("DropNewest"))
+			return QualityOfService::OverflowPolicy::DropNewest;
+
+		throw std::invalid_argument{ OBF("Unknown outbound queue overflow policy: ") + name };
+	}
+
+	/// Converts name of thread priority used in configuration file.
+	/// @param name one of "Idle", "Lowest", "Below normal", "Normal", "Above normal", "Highest" or "Time critical".
+	/// @return THREAD_PRIORITY_* value with given name.
+	/// @throws std::invalid_argument if name is unknown.
+	int ParseThreadPriority(std::string const& name)
+	{
+		if (name == OBF("Idle"))
+			return THREAD_PRIORITY_IDLE;
+
+		if (name == OBF("Lowest"))
+			return THREAD_PRIORITY_LOWEST;
+
+		if (name == OBF("Below normal"))
+			return THREAD_PRIORITY_BELOW_NORMAL;
+
+		if (name == OBF("Normal"))
+			return THREAD_PRIORITY_NORMAL;
+
+		if (name == OBF("Above normal"))
+			return THREAD_PRIORITY_ABOVE_NORMAL;
+
+		if (name == OBF("Highest"))
+			return THREAD_PRIORITY_HIGHEST;
+
+		if (name == OBF("Time critical"))
+			return THREAD_PRIORITY_TIME_CRITICAL;
+
+		throw std::invalid_argument{ OBF("Unknown thread priority: ") + name };
+	}
+
+	/// Reads settings of one of Gateway's worker pools.
+	/// @param pools "Worker pools" element of configuration file. Pool's element might contain "Threads", "Affinity" and "Priority".
+	/// @param name name of the pool's element.
+	/// @param workerCount number of threads used if not configured.
+	/// @return settings of the pool.
+	/// @throws std::invalid_argument if affinity or priority can't be parsed.
+	FSecure::C3::Core::ThreadPoolSettings ReadThreadPoolSettings(json const& pools, std::string const& name, std::size_t workerCount)
+	{
+		auto it = pools.is_object() ? pools.find(name) : pools.end();
+		auto pool = it != pools.end() && it->is_object() ? *it : json::object();
+
+		// Affinity is usually written as a hex string, e.g. "0xF0" for processors 4-7.
+		auto affinity = pool.value(OBF("Affinity"), json{});
+		std::uint64_t affinityMask = 0;
+		if (affinity.is_string())
+			try
+			{
+				affinityMask = std::stoull(affinity.get<std::string>(), nullptr, 0);
+			}
+			catch (std::exception&)
+			{
+				throw std::invalid_argument{ OBF_STR("Incorrect affinity of ") + name + OBF(" worker pool: ") + affinity.get<std::string>() };
+			}
+		else if (affinity.is_number_unsigned())
+			affinityMask = affinity.get<std::uint64_t>();
+
+		return { pool.value(OBF("Threads"), workerCount), affinityMask, ParseThreadPriority(pool.value(OBF("Priority"), OBF_STR("Normal"))) };
+	}
+
 	/// Obtains Gateway's configuration.
 	/// @param configurationFilePath path to the configuration file.
 	/// @return std::tuple with read configuration.
@@ -77,13 +169,43 @@ namespace
 		{
 			return configuration.is_object() ? configuration.value(key, defaultValue) : defaultValue; };
 
+		// "Device worker threads" predates "Worker pools" and stays as the default size of the Devices pool.
+		auto pools = jsonValueClosure(OBF("Worker pools"), json::object());
+		auto workerPools = FSecure::C3::Core::GatewayWorkerPools
+		{
+			ReadThreadPoolSettings(pools, OBF_STR("Devices"), jsonValueClosure(OBF("Device worker threads"), FSecure::C3::Core::Scheduler::s_DefaultWorkerCount)),
+			ReadThreadPoolSettings(pools, OBF_STR("API bridge"), FSecure::C3::Core::TaskExecutor::s_DefaultWorkerCount),
+			ReadThreadPoolSettings(pools, OBF_STR("Negotiation"), FSecure::C3::Core::TaskExecutor::s_DefaultWorkerCount),
+			ReadThreadPoolSettings(pools, OBF_STR("Connector startup"), FSecure::C3::Core::TaskExecutor::s_DefaultWorkerCount)
+		};
+
 		return std::make_tuple
 		(
 			jsonValueClosure(OBF("API Bridge IP"), OBF("127.0.0.1")),
 			jsonValueClosure(OBF("API Bridge port"), std::uint16_t{ 2323 }),
 			FSecure::C3::BuildId{ jsonValueClosure(OBF("BuildId"), FSecure::C3::BuildId::GenerateRandom().ToString()) },
 			FSecure::C3::AgentId{ jsonValueClosure(OBF("AgentId"), FSecure::C3::AgentId::GenerateRandom().ToString()) },
-			jsonValueClosure("Name", "")
+			jsonValueClosure("Name", ""),
+			workerPools,
+			FSecure::C3::QualityOfService::Settings
+			{
+				std::chrono::seconds{ jsonValueClosure(OBF("Incomplete packet TTL"), FSecure::C3::QualityOfService::Settings{}.m_IncompletePacketTtl.count()) },
+				jsonValueClosure(OBF("Incomplete packets bytes limit"), FSecure::C3::QualityOfService::Settings{}.m_IncompleteBytesLimit),
+				jsonValueClosure(OBF("Selective retransmission"), FSecure::C3::QualityOfService::Settings{}.m_SelectiveRetransmission),
+				std::chrono::seconds{ jsonValueClosure(OBF("Retransmission delay"), FSecure::C3::QualityOfService::Settings{}.m_RetransmissionDelay.count()) },
+				jsonValueClosure(OBF("Retransmission window bytes"), FSecure::C3::QualityOfService::Settings{}.m_RetransmissionWindowBytes),
+				jsonValueClosure(OBF("Outbound queue depth"), FSecure::C3::QualityOfService::Settings{}.m_OutboundQueueDepth),
+				ParseOverflowPolicy(jsonValueClosure(OBF("Outbound queue overflow policy"), OBF_STR("Block"))),
+				jsonValueClosure(OBF("Compact chunk headers"), FSecure::C3::QualityOfService::Settings{}.m_CompactHeaders),
+				jsonValueClosure(OBF("Parity group size"), FSecure::C3::QualityOfService::Settings{}.m_ParityGroupSize),
+				std::chrono::seconds{ jsonValueClosure(OBF("Link probe interval"), FSecure::C3::QualityOfService::Settings{}.m_LinkProbeInterval.count()) }
+			},
+			std::chrono::seconds{ jsonValueClosure(OBF("Last seen flush interval"), std::chrono::duration_cast<std::chrono::seconds>(FSecure::C3::Core::GateRelay::s_DefaultLastSeenFlushInterval).count()) },
+			jsonValueClosure(OBF("Device metrics"), false),
+			jsonValueClosure(OBF("Metrics endpoint"), std::string{}),
+			jsonValueClosure(OBF("Lock profiling sample interval"), std::uint32_t{ 0 }),
+			ParseBroadcastSuite(jsonValueClosure(OBF("Broadcast cipher"), OBF_STR("xsalsa20poly1305"))),
+			jsonValueClosure(OBF("Out-of-process connectors"), false)
 		);
 	}
 }
@@ -99,22 +221,69 @@ std::shared_ptr<FSecure::C3::Relay> FSecure::C3::Utils::CreateGatewayFromConfigu
 	// Read both input files.
 	callbackOnLog({ OBF("Reading input files..."), LogMessage::Severity::Information }, "");
 
-	auto [apiBridgeIp, apiBrigdePort, buildId, agentId, name] = ReadGatewayConfigurationFile(std::filesystem::path{ executableFilePath }.remove_filename() / configurationFileName);
+	auto [apiBridgeIp, apiBrigdePort, buildId, agentId, name, workerPools, qosSettings, lastSeenFlushInterval, reportDeviceMetrics, metricsEndpoint, lockProfilingSampleInterval, broadcastSuite, outOfProcessConnectors] = ReadGatewayConfigurationFile(std::filesystem::path{ executableFilePath }.remove_filename() / configurationFileName);
 	auto [wereKeysReadOrGenerated, signatures, broadcastKey] = ReadFromFileOrGenerateGatewayKeys(std::filesystem::path{ executableFilePath }.remove_filename() / keysFileName);
-	auto snapshotPath = std::filesystem::path{ executableFilePath }.remove_filename() / OBF("GatewaySnapshot.json");
+	auto snapshotPath = std::filesystem::path{ executableFilePath }.remove_filename() / OBF("GatewaySnapshot.bin");
 
 	// Create and run the Gateway.
 	if (!wereKeysReadOrGenerated)
 		callbackOnLog({ OBF("Generated new keys/signatures and stored them on disk."), LogMessage::Severity::Information }, "");
 
+	// Locks are profiled from the start, so that contention of startup is measured too.
+	if (lockProfilingSampleInterval)
+	{
+		FSecure::C3::Core::LockProfiling::SetSampleInterval(lockProfilingSampleInterval);
+		callbackOnLog({ OBF_STR("Lock profiling is on, hold time is sampled every ") + std::to_string(lockProfilingSampleInterval) + OBF(" acquisitions."), LogMessage::Severity::Information }, "");
+	}
+
 	callbackOnLog({ OBF("Starting Gateway..."), LogMessage::Severity::Information }, "");
-	return FSecure::C3::Core::GateRelay::CreateAndRun(callbackOnLog, interfaceFactory, apiBridgeIp, apiBrigdePort, signatures, broadcastKey, buildId, snapshotPath, agentId, name);
+	auto gateway = FSecure::C3::Core::GateRelay::CreateAndRun(callbackOnLog, interfaceFactory, apiBridgeIp, apiBrigdePort, signatures, broadcastKey, buildId, snapshotPath, agentId, name, workerPools, qosSettings, lastSeenFlushInterval, reportDeviceMetrics, metricsEndpoint);
+	gateway->SetBroadcastSuite(broadcastSuite);
+	callbackOnLog({ OBF_STR("Network key encryption: ") + FSecure::Crypto::GetName(broadcastSuite) + OBF("."), LogMessage::Severity::Information }, "");
+	if (outOfProcessConnectors)
+		gateway->SetOutOfProcessConnectors(true);
+
+	return gateway;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-std::shared_ptr<FSecure::C3::Relay> FSecure::C3::Utils::CreateNodeRelayFromImagePatch(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, ByteView buildId, ByteView gatewaySignature, ByteView broadcastKey, std::vector<ByteVector> const& gatewayInitialPackets)
+bool FSecure::C3::Utils::RunConnectorHostIfRequested(int argc, char* argv[])
 {
-	return Core::NodeRelay::CreateAndRun(callbackOnLog, interfaceFactory, gatewaySignature, broadcastKey, gatewayInitialPackets, buildId.Read<BuildId>());
+	if (argc != 3 || argv[1] != Core::ConnectorHost::GetHostArgument())
+		return false;
+
+	Core::ConnectorHost::Run(argv[2]);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Relay> FSecure::C3::Utils::CreateNodeRelayFromImagePatch(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, ByteView buildId, ByteView gatewaySignature, ByteView broadcastKey, std::vector<ByteVector> const& gatewayInitialPackets, std::size_t deviceWorkerThreads)
+{
+	return Core::NodeRelay::CreateAndRun(callbackOnLog, interfaceFactory, gatewaySignature, broadcastKey, gatewayInitialPackets, buildId.Read<BuildId>(), AgentId::GenerateRandom(), Crypto::GenerateAsymmetricKeys(), deviceWorkerThreads);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<std::shared_ptr<FSecure::C3::Relay>> FSecure::C3::Utils::CreateNodeRelaySwarmFromImagePatch(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, ByteView buildId, ByteView gatewaySignature,
+	ByteView broadcastKey, std::vector<ByteVector> const& gatewayInitialPackets, std::size_t relayCount, std::size_t deviceWorkerThreads)
+{
+	// Workers run until the process exits, as no single Relay owns them.
+	auto workers = Core::NodeRelay::SharedWorkers{ deviceWorkerThreads ? Core::Scheduler::Create(deviceWorkerThreads) : nullptr, Core::TaskExecutor::Create() };
+	auto build = buildId.Read<BuildId>();
+
+	std::vector<std::shared_ptr<Relay>> relays;
+	relays.reserve(relayCount);
+	for (std::size_t i = 0; i < relayCount; ++i)
+		try
+		{
+			relays.push_back(Core::NodeRelay::CreateAndRun(callbackOnLog, interfaceFactory, gatewaySignature, broadcastKey, gatewayInitialPackets, build, AgentId::GenerateRandom(), Crypto::GenerateAsymmetricKeys(), workers));
+		}
+		catch (std::exception& exception)
+		{
+			if (callbackOnLog)
+				callbackOnLog({ OBF_STR("Failed to start Relay ") + std::to_string(i) + OBF(". ") + exception.what(), LogMessage::Severity::Error }, "");
+		}
+
+	return relays;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
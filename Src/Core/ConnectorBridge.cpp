@@ -8,6 +8,7 @@ FSecure::C3::Core::ConnectorBridge::ConnectorBridge(std::shared_ptr<GateRelay>&&
 	, m_NameHash{ nameHash }
 	, m_GateRelay{ gateway }
 	, m_Connector{ std::move(connector) }
+	, m_IsStarting{ !m_Connector }
 {
 }
 
@@ -20,7 +21,83 @@ void FSecure::C3::Core::ConnectorBridge::OnAttach()
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::ConnectorBridge::Detach()
 {
-	m_IsAlive = false;
+	{
+		std::lock_guard lock{ m_StartupMutex };
+		m_IsAlive = false;
+		m_IsStarting = false;
+		m_PendingBinderCommands.clear();
+	}
+
+	m_StartupCondition.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorBridge::Start(std::shared_ptr<AbstractConnector> connector)
+{
+	{
+		std::lock_guard lock{ m_StartupMutex };
+		if (!m_IsAlive)
+			return;
+
+		m_Connector = connector;
+	}
+
+	connector->OnAttach(shared_from_this());
+
+	// Binders keep sending while pending Commands are passed, so take them in batches until none are left.
+	std::unique_lock lock{ m_StartupMutex };
+	while (!m_PendingBinderCommands.empty())
+	{
+		auto pending = std::exchange(m_PendingBinderCommands, {});
+		lock.unlock();
+		for (auto&& [binderId, command] : pending)
+		{
+			try
+			{
+				connector->OnCommandFromBinder(binderId, command);
+			}
+			catch (std::exception& exception)
+			{
+				Log({ "Caught an exception while passing Command queued during Connector startup. "s + exception.what(), LogMessage::Severity::Error });
+			}
+		}
+
+		lock.lock();
+	}
+
+	m_IsStarting = false;
+	lock.unlock();
+	m_StartupCondition.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorBridge::Fail(std::string_view errorMessage)
+{
+	// Connector is destroyed outside of the lock, its destructor might take long.
+	std::shared_ptr<AbstractConnector> connector;
+	{
+		std::lock_guard lock{ m_StartupMutex };
+		connector = std::move(m_Connector);
+		m_IsStarting = false;
+		m_PendingBinderCommands.clear();
+	}
+
+	m_StartupCondition.notify_all();
+	SetErrorStatus(errorMessage);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::ConnectorBridge::IsStarting() const
+{
+	std::lock_guard lock{ m_StartupMutex };
+	return m_IsStarting;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::ConnectorBridge::IsRunning() const
+{
+	std::lock_guard lock{ m_StartupMutex };
+	return !m_IsStarting && m_Connector;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -36,9 +113,22 @@ void FSecure::C3::Core::ConnectorBridge::PostCommandToBinder(ByteView binderId,
 	return GetGateRelay()->PostCommandToPeripheral(command, binderId.Read<RouteId>());
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::ConnectorBridge::CanPostCommandToBinder(ByteView binderId)
+{
+	return GetGateRelay()->CanPostCommandToPeripheral(binderId.Read<RouteId>());
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::ConnectorBridge::OnCommandFromBinder(ByteView binderId, ByteView command)
 {
+	// Binders that check in while Connector is starting, e.g. after Gateway restart, must not lose their Commands.
+	if (std::lock_guard lock{ m_StartupMutex }; m_IsStarting)
+	{
+		m_PendingBinderCommands.emplace_back(binderId, command);
+		return;
+	}
+
 	return GetConnector()->OnCommandFromBinder(binderId, command);
 }
 
@@ -70,6 +160,11 @@ FSecure::HashT FSecure::C3::Core::ConnectorBridge::GetNameHash() const
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::AbstractConnector> FSecure::C3::Core::ConnectorBridge::GetConnector() const
 {
+	std::unique_lock lock{ m_StartupMutex };
+	m_StartupCondition.wait(lock, [this] { return !m_IsStarting; });
+	if (!m_Connector)
+		throw std::runtime_error{ "Connector " + m_Name + " is not running." };
+
 	return m_Connector;
 }
 
@@ -81,22 +176,24 @@ std::shared_ptr<FSecure::C3::Core::GateRelay> FSecure::C3::Core::ConnectorBridge
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::ConnectorBridge::SetErrorStatus(std::string_view errorMessage)
 {
+	std::lock_guard lock{ m_ErrorMutex };
 	m_Error = errorMessage;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::string FSecure::C3::Core::ConnectorBridge::GetErrorStatus()
 {
+	std::lock_guard lock{ m_ErrorMutex };
 	return m_Error;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Core::ConnectorBridge::PeripheralCreationCommand(ByteView connectionId, ByteView data, bool isX64)
 {
-	return m_Connector->PeripheralCreationCommand(connectionId, data, isX64);
+	return GetConnector()->PeripheralCreationCommand(connectionId, data, isX64);
 }
 
 FSecure::ByteVector FSecure::C3::Core::ConnectorBridge::CloseConnection(ByteView connectionId)
 {
-	return m_Connector->CloseConnection(connectionId);
+	return GetConnector()->CloseConnection(connectionId);
 }
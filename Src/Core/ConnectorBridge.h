@@ -19,7 +19,7 @@ namespace FSecure::C3::Core
 	{
 		/// Public constructor, used by GateRelays.
 		/// @param gateway "parent" GateRelay this Connector is being attached to.
-		/// @param connector the Connector this object binds GateRelay with.
+		/// @param connector the Connector this object binds GateRelay with. Null if Connector is being started, @see Start.
 		/// @param name of connector
 		/// @param nameHash hash of connector.
 		ConnectorBridge(std::shared_ptr<GateRelay>&& gateway, std::shared_ptr<AbstractConnector>&& connector, std::string name, HashT nameHash);
@@ -30,6 +30,22 @@ namespace FSecure::C3::Core
 		/// Called by GateRelay just after the Connector creation.
 		void OnAttach() override;
 
+		/// Binds Connector that was built in the background and attaches it. Commands from Binders that came in the meantime are passed to it in order.
+		/// @param connector newly built Connector. Dropped if this object was detached while Connector was being built.
+		void Start(std::shared_ptr<AbstractConnector> connector);
+
+		/// Ends startup of Connector which couldn't be built or attached.
+		/// @param errorMessage reason of the failure, reported in the Profile.
+		void Fail(std::string_view errorMessage);
+
+		/// Checks whether Connector is still being started.
+		/// @return true until Start, Fail or Detach is called.
+		bool IsStarting() const;
+
+		/// Checks whether Connector is bound.
+		/// @return true if Connector was started and didn't fail.
+		bool IsRunning() const;
+
 		/// Detaches the Connector.
 		void Detach() override;
 
@@ -41,6 +57,11 @@ namespace FSecure::C3::Core
 		/// @param command full Command with arguments.
 		void PostCommandToBinder(ByteView binderId, ByteView command) override;
 
+		/// Checks whether Commands can be posted to a Binder without waiting for slow Channels on the Route.
+		/// @param binderId Identifier of Peripheral that receives the Commands.
+		/// @return true if Route to the Binder has credits.
+		bool CanPostCommandToBinder(ByteView binderId) override;
+
 		/// Fired by Relay to pass by provided Command from Binder Peripheral.
 		/// @param binderId Identifier of Peripheral who sends the Command.
 		/// @param command full Command with arguments.
@@ -89,16 +110,22 @@ namespace FSecure::C3::Core
 		ByteVector CloseConnection(ByteView connectionId) override;
 
 	protected:
-		/// Connector object getter.
+		/// Connector object getter. Waits until Connector is started.
 		/// @return Connector this object binds GateRelay with.
+		/// @throws std::runtime_error if Connector failed to start or was detached.
 		std::shared_ptr<AbstractConnector> GetConnector() const;
 
 	private:
-		bool m_IsAlive = true;																							///< False if detached and about to be destroyed.
+		std::atomic<bool> m_IsAlive = true;																				///< False if detached and about to be destroyed.
 		std::string m_Name;																								///< Connector's name.
 		HashT m_NameHash;																								///< Hash of Connector's name.
 		std::weak_ptr<GateRelay> m_GateRelay;																			///< GateRelay this Connector is attached to.
+		mutable std::mutex m_StartupMutex;																				///< Guards m_Connector, m_IsStarting and m_PendingBinderCommands.
+		mutable std::condition_variable m_StartupCondition;																///< Notified when Connector stops starting.
 		std::shared_ptr<AbstractConnector> m_Connector;																	///< Connector this object binds GateRelay with.
+		bool m_IsStarting;																								///< True while Connector is being built in the background.
+		std::vector<std::pair<ByteVector, ByteVector>> m_PendingBinderCommands;											///< Binder ids and Commands that came while Connector was starting.
+		mutable std::mutex m_ErrorMutex;																				///< Guards m_Error. Connectors set errors from their own threads.
 		std::string m_Error;																							///< String with error text. No error if empty.
 	};
 }
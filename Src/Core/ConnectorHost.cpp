@@ -0,0 +1,543 @@
+#include "StdAfx.h"
+#include "ConnectorHost.h"
+#include "Common/FSecure/WinTools/Pipe.h"
+
+namespace
+{
+	using FSecure::C3::Core::ConnectorHost::Message;
+
+	/// Ordering key of a received message. Messages of the same Binder are handled in order, other messages are ordered by type.
+	/// @param type type of the message.
+	/// @param payload message data.
+	/// @return key for TaskExecutor::Post.
+	std::string GetOrderingKey(Message type, FSecure::ByteView payload)
+	{
+		if (type == Message::CommandFromBinder || type == Message::PostCommandToBinder)
+			return OBF_STR("B") + std::string{ payload.Read<FSecure::ByteView>() };
+
+		return OBF_STR("T") + std::to_string(static_cast<int>(type));
+	}
+
+	/// Job of all host processes. Closed by the system when Gateway exits, which kills the hosts even if Gateway crashed.
+	/// @return job handle, null if job could not be created.
+	HANDLE GetHostsJob()
+	{
+		static auto job = []
+		{
+			auto job = FSecure::WinTools::UniqueHandle{ CreateJobObjectW(nullptr, nullptr) };
+			JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits{};
+			limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+			if (job && !SetInformationJobObject(job.get(), JobObjectExtendedLimitInformation, &limits, sizeof(limits)))
+				job.reset();
+
+			return job;
+		}();
+
+		return job.get();
+	}
+
+	/// Host side of the pipe. Passes calls of the Connector to Gateway and messages of Gateway to the Connector.
+	struct HostedConnectorBridge : FSecure::C3::AbstractConnectorBridge, std::enable_shared_from_this<HostedConnectorBridge>
+	{
+		/// Create bridge.
+		HostedConnectorBridge()
+			: m_StopEvent{ CreateEventW(nullptr, true, false, nullptr) }
+		{
+			if (!m_StopEvent)
+				throw std::runtime_error{ OBF("Could not create stop event.") };
+		}
+
+		/// Called by the Connector just after its creation.
+		void OnAttach() override
+		{
+		}
+
+		/// Detaches the Connector.
+		void Detach() override
+		{
+			m_IsAlive = false;
+		}
+
+		/// Notify the gateway to turn off the connector.
+		void TurnOff() override
+		{
+			m_Link->Post(Message::TurnOff, FSecure::ByteView{});
+		}
+
+		/// Called whenever Connector wants to send a Command to its Peripheral Binder.
+		/// @param binderId Identifier of Peripheral who sends the Command.
+		/// @param command full Command with arguments.
+		void PostCommandToBinder(FSecure::ByteView binderId, FSecure::ByteView command) override
+		{
+			m_Link->Post(Message::PostCommandToBinder, FSecure::ByteVector::Create(binderId, command));
+		}
+
+		/// Checks whether Commands can be posted to a Binder. Asks Gateway.
+		/// @param binderId Identifier of Peripheral that receives the Commands.
+		/// @return true if Route to the Binder has credits.
+		bool CanPostCommandToBinder(FSecure::ByteView binderId) override
+		{
+			auto answer = m_Link->Call(Message::CanPostCommandToBinder, FSecure::ByteVector::Create(binderId));
+			return FSecure::ByteView{ answer }.Read<std::uint8_t>();
+		}
+
+		/// Passes Command from Binder to the Connector.
+		/// @param binderId Identifier of Peripheral who sends the Command.
+		/// @param command full Command with arguments.
+		void OnCommandFromBinder(FSecure::ByteView binderId, FSecure::ByteView command) override
+		{
+			GetConnector()->OnCommandFromBinder(binderId, command);
+		}
+
+		/// Runs Connector's Command.
+		/// @param command Connector's Command to run.
+		/// @return Command result.
+		FSecure::ByteVector RunCommand(FSecure::ByteView command) override
+		{
+			return GetConnector()->OnRunCommand(command);
+		}
+
+		/// Called every time new peripheral is being created.
+		/// @param connectionId adders of peripheral in C3 network.
+		/// @param data all parameters used to create peripheral.
+		/// @param isX64 indicates if relay staging peripheral is x64.
+		/// @returns ByteVector correct command that will be used to stage peripheral.
+		FSecure::ByteVector PeripheralCreationCommand(FSecure::ByteView connectionId, FSecure::ByteView data, bool isX64) override
+		{
+			return GetConnector()->PeripheralCreationCommand(connectionId, data, isX64);
+		}
+
+		/// Close desired connection.
+		/// @param connectionId id of connection (RouteId) in string form.
+		/// @returns ByteVector empty vector.
+		FSecure::ByteVector CloseConnection(FSecure::ByteView connectionId) override
+		{
+			return GetConnector()->CloseConnection(connectionId);
+		}
+
+		/// Passes log message to Gateway.
+		/// @param message information to log.
+		void Log(FSecure::C3::LogMessage const& message) override
+		{
+			m_Link->Post(Message::Log, FSecure::ByteVector::Create(message.m_Severity, std::string_view{ message.m_Body }));
+		}
+
+		/// @return false if Connector is detached.
+		bool IsAlive() const override
+		{
+			return m_IsAlive;
+		}
+
+		/// Set error status, also on Gateway side.
+		/// @param errorMessage error text.
+		void SetErrorStatus(std::string_view errorMessage) override
+		{
+			{
+				std::scoped_lock lock(m_Mutex);
+				m_Error = errorMessage;
+			}
+
+			m_Link->Post(Message::SetErrorStatus, FSecure::ByteVector::Create(errorMessage));
+		}
+
+		/// @return error status.
+		std::string GetErrorStatus() override
+		{
+			std::scoped_lock lock(m_Mutex);
+			return m_Error;
+		}
+
+		/// Handle a message from Gateway.
+		/// @param type type of the message.
+		/// @param payload message data.
+		/// @return result of the call.
+		FSecure::ByteVector OnGatewayMessage(Message type, FSecure::ByteView payload)
+		{
+			switch (type)
+			{
+			case Message::Create:
+			{
+				auto [connectorNameHash, commandLine] = payload.Read<FSecure::HashT, FSecure::ByteView>();
+				auto connectorData = FSecure::C3::InterfaceFactory::Instance().GetInterfaceData<FSecure::C3::AbstractConnector>(connectorNameHash);
+				if (!connectorData)
+					throw std::runtime_error{ OBF("Connector with hash ") + std::to_string(connectorNameHash) + OBF(" is not registered in the host.") };
+
+				auto connector = connectorData->m_Builder(commandLine);
+				connector->OnAttach(shared_from_this());
+
+				std::scoped_lock lock(m_Mutex);
+				m_Connector = std::move(connector);
+				return {};
+			}
+
+			case Message::CommandFromBinder:
+			{
+				auto [binderId, command] = payload.Read<FSecure::ByteView, FSecure::ByteView>();
+				OnCommandFromBinder(binderId, command);
+				return {};
+			}
+
+			case Message::RunCommand:
+				return RunCommand(payload);
+
+			case Message::PeripheralCreationCommand:
+			{
+				auto [connectionId, data, isX64] = payload.Read<FSecure::ByteView, FSecure::ByteView, std::uint8_t>();
+				return PeripheralCreationCommand(connectionId, data, isX64);
+			}
+
+			case Message::CloseConnection:
+				return CloseConnection(payload.Read<FSecure::ByteView>());
+
+			case Message::Stop:
+				SetEvent(m_StopEvent.get());
+				return {};
+
+			default:
+				throw std::logic_error{ OBF("Unexpected message from Gateway.") };
+			}
+		}
+
+		/// Destroy the Connector. Called after Gateway stopped it or closed the pipe.
+		void DestroyConnector()
+		{
+			std::shared_ptr<FSecure::C3::AbstractConnector> connector;
+			{
+				std::scoped_lock lock(m_Mutex);
+				std::swap(connector, m_Connector);
+			}
+
+			m_IsAlive = false;
+		}
+
+		/// @return hosted Connector.
+		/// @throws std::logic_error if Connector is not created yet.
+		std::shared_ptr<FSecure::C3::AbstractConnector> GetConnector()
+		{
+			std::scoped_lock lock(m_Mutex);
+			if (!m_Connector)
+				throw std::logic_error{ OBF("Connector is not created.") };
+
+			return m_Connector;
+		}
+
+		FSecure::C3::Core::ConnectorHost::Link* m_Link = nullptr;														///< Pipe to Gateway.
+		FSecure::WinTools::UniqueHandle m_StopEvent;																	///< Set when Gateway stops the Connector or closes the pipe.
+
+	private:
+		std::mutex m_Mutex;																								///< Guards m_Connector and m_Error.
+		std::shared_ptr<FSecure::C3::AbstractConnector> m_Connector;													///< Hosted Connector.
+		std::string m_Error;																							///< Error status.
+		std::atomic<bool> m_IsAlive = true;																				///< False if detached.
+	};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::ConnectorHost::Link::Link(std::unique_ptr<WinTools::OverlappedPipe> pipe, Handler handler, std::function<void()> onClosed)
+	: m_Pipe{ std::move(pipe) }
+	, m_Handler{ std::move(handler) }
+	, m_OnClosed{ std::move(onClosed) }
+	, m_Executor{ TaskExecutor::Create() }
+	, m_StopEvent{ CreateEventW(nullptr, true, false, nullptr) }
+{
+	if (!m_StopEvent)
+		throw std::runtime_error{ OBF("Could not create stop event.") };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::ConnectorHost::Link::~Link()
+{
+	Stop();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorHost::Link::Start()
+{
+	m_ReadingThread = std::thread{ &Link::Read, this };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorHost::Link::Stop()
+{
+	SetEvent(m_StopEvent.get());
+	if (m_ReadingThread.joinable())
+	{
+		// Stop can be called from m_OnClosed, which runs on the reading thread.
+		if (m_ReadingThread.get_id() == std::this_thread::get_id())
+			m_ReadingThread.detach();
+		else
+			m_ReadingThread.join();
+	}
+
+	m_Executor->Stop();
+	FailCalls(OBF("Connector host link is stopped."));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorHost::Link::Post(Message type, ByteView payload)
+{
+	Send(type, s_NoCall, payload);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Core::ConnectorHost::Link::Call(Message type, ByteView payload)
+{
+	auto callId = s_NoCall;
+	auto result = std::future<ByteVector>{};
+	{
+		std::scoped_lock lock(m_CallsMutex);
+		if (m_IsClosed)
+			throw std::runtime_error{ OBF("Connector host link is closed.") };
+
+		do
+			callId = ++m_LastCallId;
+		while (callId == s_NoCall || m_Calls.count(callId));
+
+		result = m_Calls[callId].get_future();
+	}
+
+	try
+	{
+		Send(type, callId, payload);
+	}
+	catch (...)
+	{
+		std::scoped_lock lock(m_CallsMutex);
+		m_Calls.erase(callId);
+		throw;
+	}
+
+	return result.get();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorHost::Link::Send(Message type, std::uint32_t callId, ByteView payload)
+{
+	auto frame = ByteVector::Create(type, callId);
+	frame.Concat(payload);
+
+	std::scoped_lock lock(m_WriteMutex);
+	m_Pipe->Write(frame);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorHost::Link::Read()
+{
+	try
+	{
+		while (auto frame = m_Pipe->Read(m_StopEvent.get()))
+		{
+			auto view = ByteView{ *frame };
+			auto [type, callId] = view.Read<Message, std::uint32_t>();
+			if (type != Message::Response)
+			{
+				Dispatch(type, callId, ByteVector{ view });
+				continue;
+			}
+
+			// Answers are resolved here rather than on the executor, so that a handler waiting for one doesn't block it.
+			auto promise = std::promise<ByteVector>{};
+			{
+				std::scoped_lock lock(m_CallsMutex);
+				auto it = m_Calls.find(callId);
+				if (it == m_Calls.end())
+					continue;
+
+				promise = std::move(it->second);
+				m_Calls.erase(it);
+			}
+
+			if (view.Read<std::uint8_t>())
+				promise.set_value(ByteVector{ view });
+			else
+				promise.set_exception(std::make_exception_ptr(std::runtime_error{ view.Read<std::string>() }));
+		}
+
+		// Stopped.
+		return;
+	}
+	catch (std::exception const& exception)
+	{
+		FailCalls(OBF_STR("Connector host link is closed: ") + exception.what());
+	}
+
+	if (m_OnClosed)
+		m_OnClosed();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorHost::Link::Dispatch(Message type, std::uint32_t callId, ByteVector payload)
+{
+	auto orderingKey = GetOrderingKey(type, payload);
+	m_Executor->Post(std::move(orderingKey), TaskExecutor::Priority::Normal, [this, type, callId, payload = std::move(payload)]
+	{
+		try
+		{
+			auto result = m_Handler(type, payload);
+			if (callId != s_NoCall)
+				Send(Message::Response, callId, ByteVector::Create(std::uint8_t{ 1 }).Concat(result));
+		}
+		catch (std::exception const& exception)
+		{
+			if (callId != s_NoCall)
+				Send(Message::Response, callId, ByteVector::Create(std::uint8_t{ 0 }, std::string{ exception.what() }));
+		}
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorHost::Link::FailCalls(std::string const& reason)
+{
+	std::scoped_lock lock(m_CallsMutex);
+	m_IsClosed = true;
+	for (auto& call : m_Calls)
+		call.second.set_exception(std::make_exception_ptr(std::runtime_error{ reason }));
+
+	m_Calls.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::ConnectorHost::OutOfProcessConnector::OutOfProcessConnector(HashT connectorNameHash, ByteView commandLine)
+{
+	auto pipeName = FSecure::Utils::GenerateRandomString(32);
+	auto pipe = WinTools::OverlappedPipe::Create(ByteView{ pipeName });
+
+	wchar_t executablePath[MAX_PATH];
+	if (!GetModuleFileNameW(nullptr, executablePath, MAX_PATH))
+		throw std::runtime_error{ OBF("Could not get path of Gateway executable. Error: ") + std::to_string(GetLastError()) };
+
+	auto hostArgument = GetHostArgument();
+	auto processCommandLine = L'"' + std::wstring{ executablePath } + L"\" " + std::wstring{ hostArgument.begin(), hostArgument.end() } + L' ' + std::wstring{ pipeName.begin(), pipeName.end() };
+
+	// Process is started suspended, so that it is in the job before it can do anything.
+	auto startupInfo = STARTUPINFOW{ sizeof(STARTUPINFOW) };
+	auto processInfo = PROCESS_INFORMATION{};
+	if (!CreateProcessW(nullptr, processCommandLine.data(), nullptr, nullptr, false, CREATE_NO_WINDOW | CREATE_SUSPENDED, nullptr, nullptr, &startupInfo, &processInfo))
+		throw std::runtime_error{ OBF("Could not start Connector host process. Error: ") + std::to_string(GetLastError()) };
+
+	m_Process.reset(processInfo.hProcess);
+	auto thread = WinTools::UniqueHandle{ processInfo.hThread };
+	if (auto job = GetHostsJob())
+		AssignProcessToJobObject(job, m_Process.get());
+
+	ResumeThread(thread.get());
+	pipe->WaitForClient(s_HostTimeout, m_Process.get());
+
+	m_Link = std::make_unique<Link>(std::move(pipe), [this](Message type, ByteView payload) { return OnHostMessage(type, payload); }, [this]
+	{
+		if (auto bridge = GetBridge())
+			bridge->SetErrorStatus(OBF("Connector host process has exited."));
+	});
+
+	m_Link->Start();
+	m_Link->Call(Message::Create, ByteVector::Create(connectorNameHash, commandLine));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::ConnectorHost::OutOfProcessConnector::~OutOfProcessConnector()
+{
+	try
+	{
+		m_Link->Post(Message::Stop, ByteView{});
+	}
+	catch (std::exception const&)
+	{
+		// Pipe is already broken, host exits on its own.
+	}
+
+	// Closing the pipe makes the host exit too, if Stop didn't reach it.
+	m_Link.reset();
+	if (WaitForSingleObject(m_Process.get(), static_cast<DWORD>(std::chrono::milliseconds{ s_HostTimeout }.count())) != WAIT_OBJECT_0)
+		TerminateProcess(m_Process.get(), EXIT_FAILURE);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorHost::OutOfProcessConnector::OnCommandFromBinder(ByteView binderId, ByteView command)
+{
+	m_Link->Post(Message::CommandFromBinder, ByteVector::Create(binderId, command));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Core::ConnectorHost::OutOfProcessConnector::OnRunCommand(ByteView command)
+{
+	return m_Link->Call(Message::RunCommand, command);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Core::ConnectorHost::OutOfProcessConnector::PeripheralCreationCommand(ByteView connectionId, ByteView data, bool isX64)
+{
+	return m_Link->Call(Message::PeripheralCreationCommand, ByteVector::Create(connectionId, data, static_cast<std::uint8_t>(isX64)));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Core::ConnectorHost::OutOfProcessConnector::CloseConnection(ByteView connectionId)
+{
+	return m_Link->Call(Message::CloseConnection, ByteVector::Create(connectionId));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Core::ConnectorHost::OutOfProcessConnector::OnHostMessage(Message type, ByteView payload)
+{
+	auto bridge = GetBridge();
+	switch (type)
+	{
+	case Message::PostCommandToBinder:
+	{
+		auto [binderId, command] = payload.Read<ByteView, ByteView>();
+		if (bridge)
+			bridge->PostCommandToBinder(binderId, command);
+
+		return {};
+	}
+
+	case Message::CanPostCommandToBinder:
+		return ByteVector::Create(static_cast<std::uint8_t>(bridge && bridge->CanPostCommandToBinder(payload.Read<ByteView>())));
+
+	case Message::Log:
+	{
+		auto [severity, body] = payload.Read<LogMessage::Severity, std::string>();
+		Log({ body, severity });
+		return {};
+	}
+
+	case Message::SetErrorStatus:
+		if (bridge)
+			bridge->SetErrorStatus(payload.Read<std::string>());
+
+		return {};
+
+	case Message::TurnOff:
+		// Turning off destroys this Connector and the Link running this handler, so it's done on a separate thread.
+		if (bridge)
+			std::thread{ [bridge] { bridge->TurnOff(); } }.detach();
+
+		return {};
+
+	default:
+		throw std::logic_error{ OBF("Unexpected message from Connector host.") };
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::C3::Core::ConnectorHost::GetHostArgument()
+{
+	return OBF("--connector-host");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ConnectorHost::Run(std::string_view pipeName)
+{
+	if (!WinTools::WaitForPipe(ByteView{ pipeName }, std::chrono::seconds{ 10 }))
+		throw std::runtime_error{ OBF("Could not open Gateway pipe.") };
+
+	auto bridge = std::make_shared<HostedConnectorBridge>();
+	auto link = Link{ std::make_unique<WinTools::OverlappedPipe>(ByteView{ pipeName }), [&bridge](Message type, ByteView payload) { return bridge->OnGatewayMessage(type, payload); }, [&bridge] { SetEvent(bridge->m_StopEvent.get()); } };
+	bridge->m_Link = &link;
+	link.Start();
+
+	WaitForSingleObject(bridge->m_StopEvent.get(), INFINITE);
+
+	// Connector is destroyed while the pipe is still open, so that its last logs reach Gateway.
+	bridge->DestroyConnector();
+	link.Stop();
+}
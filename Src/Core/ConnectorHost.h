@@ -0,0 +1,168 @@
+#pragma once
+
+#include "TaskExecutor.h"
+#include "Common/FSecure/C3/Internals/Interface.h"
+#include "Common/FSecure/WinTools/UniqueHandle.h"
+
+// Forward declarations.
+namespace FSecure::WinTools
+{
+	class OverlappedPipe;
+}
+
+namespace FSecure::C3::Core::ConnectorHost
+{
+	/// Types of messages sent between Gateway and the process hosting its Connector.
+	enum class Message : std::uint8_t
+	{
+		// Gateway to host.
+		Create,																											///< Create Connector. Carries its name hash and command line. Answered when Connector is created.
+		CommandFromBinder,																								///< AbstractConnector::OnCommandFromBinder.
+		RunCommand,																										///< AbstractConnector::OnRunCommand. Answered with Command result.
+		PeripheralCreationCommand,																						///< AbstractConnector::PeripheralCreationCommand. Answered with staging Command.
+		CloseConnection,																								///< AbstractConnector::CloseConnection. Answered when connection is closed.
+		Stop,																											///< Destroy Connector and exit.
+
+		// Host to Gateway.
+		PostCommandToBinder,																							///< AbstractConnectorBridge::PostCommandToBinder.
+		CanPostCommandToBinder,																							///< AbstractConnectorBridge::CanPostCommandToBinder. Answered with a flag.
+		Log,																											///< AbstractConnectorBridge::Log.
+		SetErrorStatus,																									///< AbstractConnectorBridge::SetErrorStatus.
+		TurnOff,																										///< AbstractConnectorBridge::TurnOff.
+
+		// Both directions.
+		Response,																										///< Answer to a call. Carries success flag, followed by the result or error text.
+	};
+
+	/// One end of the pipe connecting Gateway with the process hosting its Connector.
+	/// Messages are handled on a TaskExecutor, so that handlers can make calls to the other side while the pipe is being read. Messages of the same Binder are handled in order.
+	struct Link
+	{
+		/// Handler of received messages.
+		/// @param type type of the message.
+		/// @param payload message data.
+		/// @return result of the call, ignored if message is not a call.
+		using Handler = std::function<ByteVector(Message type, ByteView payload)>;
+
+		/// Create link. Nothing is read until Start is called.
+		/// @param pipe connected pipe.
+		/// @param handler handler of received messages.
+		/// @param onClosed called once when the other side closes the pipe. Can be empty.
+		Link(std::unique_ptr<WinTools::OverlappedPipe> pipe, Handler handler, std::function<void()> onClosed);
+
+		/// Destructor. Stops reading and handling messages.
+		~Link();
+
+		/// Start reading messages on a background thread.
+		void Start();
+
+		/// Stop reading messages. Calls in progress fail. Messages being handled are finished, queued ones are dropped.
+		void Stop();
+
+		/// Send message that is not answered.
+		/// @param type type of the message.
+		/// @param payload message data.
+		/// @throws std::runtime_error if pipe is broken.
+		void Post(Message type, ByteView payload);
+
+		/// Send message and wait for the answer.
+		/// @param type type of the message.
+		/// @param payload message data.
+		/// @return result returned by handler of the other side.
+		/// @throws std::runtime_error with the text of the exception thrown by the other side, or if the link is closed.
+		ByteVector Call(Message type, ByteView payload);
+
+	private:
+		/// Mark used by messages that are not calls.
+		static constexpr std::uint32_t s_NoCall = 0;
+
+		/// Write message to the pipe.
+		/// @param type type of the message.
+		/// @param callId identifier of the call, s_NoCall if message is not answered.
+		/// @param payload message data.
+		void Send(Message type, std::uint32_t callId, ByteView payload);
+
+		/// Reading thread body.
+		void Read();
+
+		/// Handle a message that is not an answer.
+		/// @param type type of the message.
+		/// @param callId identifier of the call, s_NoCall if message is not answered.
+		/// @param payload message data.
+		void Dispatch(Message type, std::uint32_t callId, ByteVector payload);
+
+		/// Fail all calls in progress.
+		/// @param reason text of the exception thrown by Call.
+		void FailCalls(std::string const& reason);
+
+		std::unique_ptr<WinTools::OverlappedPipe> m_Pipe;																///< Connected pipe.
+		Handler m_Handler;																								///< Handler of received messages.
+		std::function<void()> m_OnClosed;																				///< Called when the other side closes the pipe.
+		std::shared_ptr<TaskExecutor> m_Executor;																		///< Runs handlers.
+		WinTools::UniqueHandle m_StopEvent;																				///< Interrupts reading.
+		std::thread m_ReadingThread;																					///< Reads the pipe.
+		std::mutex m_WriteMutex;																						///< Only one message is written at a time.
+		std::mutex m_CallsMutex;																						///< Guards m_Calls and m_IsClosed.
+		std::unordered_map<std::uint32_t, std::promise<ByteVector>> m_Calls;											///< Calls waiting for answers, by identifier.
+		std::uint32_t m_LastCallId = s_NoCall;																			///< Identifier of the last call.
+		bool m_IsClosed = false;																						///< Set when pipe is closed. Calls fail right away.
+	};
+
+	/// Gateway side of a Connector run in a separate process. The process runs the same executable, started with GetHostArgument.
+	/// Connector gets its own heap and threads. If it stalls, only calls to it wait, routing and other Connectors are not affected.
+	struct OutOfProcessConnector : AbstractConnector
+	{
+		/// Start host process and create Connector in it.
+		/// @param connectorNameHash hash of Connector's name.
+		/// @param commandLine Connector's creation arguments.
+		/// @throws std::runtime_error if host process can't be started or Connector creation fails.
+		OutOfProcessConnector(HashT connectorNameHash, ByteView commandLine);
+
+		/// Destructor. Stops host process.
+		~OutOfProcessConnector();
+
+		/// Fired by Relay to pass by provided Command from Binder Peripheral.
+		/// @param binderId Identifier of Peripheral who sends the Command.
+		/// @param command full Command with arguments.
+		void OnCommandFromBinder(ByteView binderId, ByteView command) override;
+
+		/// Processes internal (C3 API) Command.
+		/// @param command a buffer containing whole command and it's parameters.
+		/// @return command result.
+		ByteVector OnRunCommand(ByteView command) override;
+
+		/// Called every time new peripheral is being created.
+		/// @param connectionId adders of peripheral in C3 network.
+		/// @param data all parameters used to create peripheral.
+		/// @param isX64 indicates if relay staging peripheral is x64.
+		/// @returns ByteVector correct command that will be used to stage peripheral.
+		ByteVector PeripheralCreationCommand(ByteView connectionId, ByteView data, bool isX64) override;
+
+		/// Close desired connection
+		/// @param connectionId id of connection (RouteId) in string form.
+		/// @returns ByteVector empty vector.
+		ByteVector CloseConnection(ByteView connectionId) override;
+
+	private:
+		/// Host process has that long to open the pipe and to exit after Stop.
+		static constexpr std::chrono::seconds s_HostTimeout{ 10 };
+
+		/// Handle a message from the host.
+		/// @param type type of the message.
+		/// @param payload message data.
+		/// @return result of the call.
+		ByteVector OnHostMessage(Message type, ByteView payload);
+
+		WinTools::UniqueHandle m_Process;																				///< Host process.
+		std::unique_ptr<Link> m_Link;																					///< Pipe to the host process.
+	};
+
+	/// Command line argument that makes Gateway executable host a Connector. Followed by the pipe name.
+	/// @return argument text.
+	std::string GetHostArgument();
+
+	/// Host a Connector until Gateway stops it or closes the pipe. Called in the process started by OutOfProcessConnector.
+	/// @param pipeName name of the pipe created by Gateway.
+	/// @throws std::runtime_error if pipe can't be opened.
+	void Run(std::string_view pipeName);
+}
@@ -1,6 +1,8 @@
 #include "StdAfx.h"
 #include "DeviceBridge.h"
 #include "Relay.h"
+#include "EventTracing.h"
+#include "AllocationTracking.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::DeviceBridge::DeviceBridge(std::shared_ptr<Relay>&& relay, DeviceId did, HashT typeNameHash, std::shared_ptr<Device>&& device, bool isNegotiationChannel, bool isSlave, ByteVector args /*= ByteVector()*/)
@@ -8,14 +10,23 @@ FSecure::C3::Core::DeviceBridge::DeviceBridge(std::shared_ptr<Relay>&& relay, De
 	, m_IsSlave(isSlave)
 	, m_Did{ did }
 	, m_TypeNameHash(typeNameHash)
+	, m_QoS{ relay->GetQoSSettings() }
 	, m_Relay{ relay }
 	, m_Device{ std::move(device) }
+	, m_ProtectWriteInConcurrentThreads{ OBF("DeviceBridge::m_ProtectWriteInConcurrentThreads") }
+	, m_MaxFrameSize{ std::max(m_Device->GetMaxFrameSize().value_or(std::numeric_limits<size_t>::max()), QualityOfService::s_MinFrameSize) }
+	, m_IsQoSBypassed{ !isNegotiationChannel && m_Device->IsChannel() && !m_Device->GetMaxFrameSize() && m_Device->GetDeliveryGuarantees().m_IsReliable && m_Device->GetDeliveryGuarantees().m_IsOrdered }
+	, m_SendFrameSize{ m_MaxFrameSize }
+	, m_OutboundQueueDepth{ m_Relay->GetQoSSettings().m_OutboundQueueDepth }
+	, m_OutboundOverflowPolicy{ m_Relay->GetQoSSettings().m_OutboundOverflowPolicy }
 {
+	// Frames carry packets already encrypted by the Relay. Their memory is not worth zeroing when released.
+	m_SendBuffer.SetSensitive(false);
 	if (!isNegotiationChannel)
 		return;
 
 	auto readView = ByteView{ args };
-	std::tie(m_InputId, m_OutpuId) = readView.Read<ByteVector, ByteVector>();
+	std::tie(m_InputId, m_OutpuId) = readView.Read<ByteView, ByteView>();
 	m_NonNegotiatiedArguments = readView;
 }
 
@@ -23,12 +34,36 @@ FSecure::C3::Core::DeviceBridge::DeviceBridge(std::shared_ptr<Relay>&& relay, De
 void FSecure::C3::Core::DeviceBridge::OnAttach()
 {
 	GetDevice()->OnAttach(shared_from_this());
+
+	// Channels send routed packets from their own thread, so that a slow one doesn't stall routing through others.
+	if (!IsChannel() || !m_OutboundQueueDepth)
+		return;
+
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_ProtectOutboundPackets };
+		m_IsDraining = true;
+	}
+
+	std::thread{ [this, self = shared_from_this()]() { DrainOutboundQueue(); } }.detach();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::DeviceBridge::Detach()
 {
-	m_IsAlive = false;
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_ProtectOutboundPackets };
+		m_IsAlive = false;
+	}
+
+	m_OutboundPacketsChanged.notify_all();
+
+	// Wake up the separate thread waiting for the next update, and release the Device waiting in the Scheduler.
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_UpdateDelayMutex };
+	}
+
+	m_UpdateDelayChanged.notify_all();
+	GetRelay()->StopUpdating(*this);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -41,50 +76,559 @@ void FSecure::C3::Core::DeviceBridge::Close()
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::DeviceBridge::OnReceive()
 {
-	GetDevice()->OnReceive();
+	EventTracing::Scope<EventTracing::Keyword::Devices> tracingScope{ "DeviceBridge::OnReceive" };
+
+	// Send frames that Channel didn't accept last time.
+	if (!m_IsNegotiationChannel && GetDevice()->GetBatchingSettings())
+		if (auto queueLock = std::unique_lock<std::mutex>{ m_ProtectOutboundQueue }; !m_IsLingering && !m_OutboundFrames.empty())
+		{
+			queueLock.unlock();
+			FlushNetworkPackets();
+		}
+
+	// Channel's own allocations are charged to Channels. Packets it passes on are charged to the pipeline again, see PassNetworkPacket.
+	{
+		AllocationTracking::Scope allocationScope{ IsChannel() ? AllocationTracking::Subsystem::Channels : AllocationTracking::Subsystem::Other };
+		GetDevice()->OnReceive();
+	}
+
+	if (m_QoS.IsSelectiveRetransmissionEnabled() && !m_IsNegotiationChannel && !m_IsQoSBypassed && IsChannel())
+		RequestMissingChunks();
+
+	if (!m_IsNegotiationChannel && IsChannel())
+		ProbeLinkIfDue();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::DeviceBridge::PassNetworkPacket(ByteView packet)
 {
-	if (m_IsNegotiationChannel && !m_IsSlave) // negotiation channel does not support chunking. Just pass packet and leave.
+	AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::Other };
+	m_Metrics.m_BytesIn += packet.size();
+	// Negotiation channel has no QoS, fragments are reassembled by Distributor. Channel that loses nothing carries whole packets. Just pass packet and leave.
+	if ((m_IsNegotiationChannel && !m_IsSlave) || m_IsQoSBypassed)
+	{
+		++m_Metrics.m_PacketsIn;
 		return GetRelay()->OnPacketReceived(packet, shared_from_this());
+	}
+
+	if (m_QoS.IsSelectiveRetransmissionEnabled() && !m_IsNegotiationChannel && QualityOfService::IsRetransmissionRequest(packet, m_QoS.AreCompactHeadersEnabled()))
+		return Retransmit(packet);
+
+	// Packets that fit in one frame are handled straight from the Channel's buffer.
+	if (auto wholePacket = m_QoS.GetWholePacket(packet))
+	{
+		++m_Metrics.m_PacketsIn;
+		return GetRelay()->OnPacketReceived(*wholePacket, shared_from_this());
+	}
 
 	m_QoS.PushReceivedChunk(packet);
+	CutThrough(packet);
 	auto nextPacket = m_QoS.GetNextPacket();
 	if (!nextPacket.empty())
+	{
+		++m_Metrics.m_PacketsIn;
 		GetRelay()->OnPacketReceived(nextPacket, shared_from_this());
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::PassNetworkPackets(std::vector<ByteVector> const& packets)
+{
+	if (packets.size() == 1)
+		return PassNetworkPacket(packets.front());
+
+	for (auto&& packet : packets)
+		m_Metrics.m_BytesIn += packet.size();
+
+	// Negotiation channel has no QoS, fragments are reassembled by Distributor. Channel that loses nothing carries whole packets. Just pass packets and leave.
+	if ((m_IsNegotiationChannel && !m_IsSlave) || m_IsQoSBypassed)
+	{
+		m_Metrics.m_PacketsIn += packets.size();
+		return GetRelay()->OnPacketsReceived({ packets.begin(), packets.end() }, shared_from_this());
+	}
+
+	// Reassembled packets are kept alive until Relay handles them. Moving ByteVectors doesn't invalidate views on their data. Packets that fit in one frame are viewed in place.
+	std::vector<ByteVector> reassembled;
+	std::vector<ByteView> completePackets;
+	reassembled.reserve(packets.size());
+	completePackets.reserve(packets.size());
+	for (auto&& packet : packets)
+	{
+		if (m_QoS.IsSelectiveRetransmissionEnabled() && !m_IsNegotiationChannel && QualityOfService::IsRetransmissionRequest(packet, m_QoS.AreCompactHeadersEnabled()))
+		{
+			Retransmit(packet);
+			continue;
+		}
+
+		if (auto wholePacket = m_QoS.GetWholePacket(packet))
+		{
+			completePackets.push_back(*wholePacket);
+			continue;
+		}
+
+		m_QoS.PushReceivedChunk(packet);
+		CutThrough(packet);
+		if (auto nextPacket = m_QoS.GetNextPacket(); !nextPacket.empty())
+			completePackets.emplace_back(reassembled.emplace_back(std::move(nextPacket.SetSensitive(false))));
+	}
+
+	m_Metrics.m_PacketsIn += completePackets.size();
+	if (!completePackets.empty())
+		GetRelay()->OnPacketsReceived(completePackets, shared_from_this());
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::DeviceBridge::OnPassNetworkPacket(ByteView packet)
 {
-	auto lock = std::lock_guard<std::mutex>{ m_ProtectWriteInConcurrentThreads };
+	OnPassNetworkPacket(packet, TrafficClass::Bulk);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::OnPassNetworkPacket(ByteView packet, TrafficClass trafficClass, bool allowCutThrough /*= false*/)
+{
+	auto lock = std::unique_lock<std::mutex>{ m_ProtectOutboundPackets };
+	if (!m_IsDraining)
+	{
+		lock.unlock();
+		return SendNetworkPacket(packet, allowCutThrough);
+	}
+
+	if (CountOutboundPackets() >= m_OutboundQueueDepth)
+		switch (m_OutboundOverflowPolicy)
+		{
+		case QualityOfService::OverflowPolicy::Block:
+			m_OutboundPacketsChanged.wait(lock, [this] { return !m_IsAlive || CountOutboundPackets() < m_OutboundQueueDepth; });
+			break;
+		case QualityOfService::OverflowPolicy::DropOldest:
+		{
+			// Bulk packets are dropped first.
+			auto& bulk = m_OutboundPackets[static_cast<size_t>(TrafficClass::Bulk)];
+			(bulk.empty() ? m_OutboundPackets[static_cast<size_t>(TrafficClass::Control)] : bulk).pop_front();
+			++m_DroppedOutboundPackets;
+			break;
+		}
+		case QualityOfService::OverflowPolicy::DropNewest:
+			++m_DroppedOutboundPackets;
+			return;
+		}
+
+	m_OutboundPackets[static_cast<size_t>(trafficClass)].push_back({ ByteVector{ packet }, allowCutThrough });
+	lock.unlock();
+	m_OutboundPacketsChanged.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::DrainOutboundQueue()
+{
+	auto logExceptions = [this](auto&& send)
+	{
+		try
+		{
+			send();
+		}
+		catch (std::exception const& exception)
+		{
+			++m_Metrics.m_Exceptions;
+			Log({ OBF_SEC("std::exception while sending a packet: ") + exception.what(), LogMessage::Severity::Error });
+		}
+		catch (...)
+		{
+			++m_Metrics.m_Exceptions;
+			Log({ OBF_SEC("Unknown exception while sending a packet."), LogMessage::Severity::Error });
+		}
+	};
+
+	auto lock = std::unique_lock<std::mutex>{ m_ProtectOutboundPackets };
+	while (true)
+	{
+		m_OutboundPacketsChanged.wait(lock, [this] { return !m_IsAlive || CountOutboundPackets(); });
+		if (!m_IsAlive)
+		{
+			for (auto& packets : m_OutboundPackets)
+				packets.clear();
+
+			m_IsDraining = false;
+			return;
+		}
+
+		// Batching Channel gets everything that was routed through it during the linger time.
+		auto batching = m_IsNegotiationChannel || m_IsQoSBypassed ? std::nullopt : GetDevice()->GetBatchingSettings();
+		auto deadline = std::chrono::steady_clock::now() + (batching ? batching->m_Linger : std::chrono::milliseconds{});
+		auto isFull = false;
+		do
+		{
+			// Packets are taken one by one, so that control packets queued meanwhile overtake waiting bulk ones. Only as many as were queued are taken, so that batch is flushed during continuous traffic.
+			for (auto count = CountOutboundPackets(); count && CountOutboundPackets(); --count)
+			{
+				auto packet = TakeOutboundPacket();
+				lock.unlock();
+
+				// Senders blocked by full queue can continue.
+				m_OutboundPacketsChanged.notify_all();
+				logExceptions([&]
+				{
+					if (!batching)
+						return SendNetworkPacket(packet.m_Data, packet.m_AllowCutThrough);
+
+					auto queueLock = std::lock_guard<std::mutex>{ m_ProtectOutboundQueue };
+					isFull = QueueFrames(packet.m_Data, batching->m_MaxBatchSize, packet.m_AllowCutThrough);
+				});
+
+				lock.lock();
+			}
+		} while (batching && !isFull && m_OutboundPacketsChanged.wait_until(lock, deadline, [this] { return !m_IsAlive || CountOutboundPackets(); }) && m_IsAlive);
+
+		if (batching)
+		{
+			lock.unlock();
+			logExceptions([this] { FlushNetworkPackets(); });
+			lock.lock();
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::SendNetworkPacket(ByteView packet, bool allowCutThrough /*= false*/)
+{
+	OnTraffic();
+	if (!m_IsNegotiationChannel && !m_IsQoSBypassed)
+		if (auto batching = GetDevice()->GetBatchingSettings())
+			return QueueNetworkPacket(packet, *batching, allowCutThrough);
+
+	auto lock = std::lock_guard{ m_ProtectWriteInConcurrentThreads };
+	++m_Metrics.m_PacketsOut;
+	m_Metrics.m_BytesOut += packet.size();
+
+	// Channel that loses nothing takes whole packets. Receiver passes them on straight away.
+	if (m_IsQoSBypassed)
+	{
+		if (auto sent = SendFrame(packet); sent != packet.size())
+			throw std::runtime_error{ OBF("Reliable channel accepted only a part of the packet. Packet size: ") + std::to_string(packet.size()) + OBF(" Channel sent: ") + std::to_string(sent) };
+
+		++m_Metrics.m_ChunksSent;
+		return;
+	}
 
-	if (m_IsNegotiationChannel) // negotiation channel does not support chunking. Just pass packet and leave.
+	if (m_IsNegotiationChannel) // negotiation channel has no QoS. Packets that don't fit in a frame are split before locking, @see Fragment. Just pass packet and leave.
 	{
-		auto sent = GetDevice()->OnSendToChannelInternal(packet);
+		if (packet.size() > m_SendFrameSize)
+			throw std::runtime_error{ OBF("Packet doesn't fit in negotiation channel frame. Packet size: ") + std::to_string(packet.size()) + OBF(" Channel frame size: ") + std::to_string(m_SendFrameSize) };
+
+		auto sent = SendFrame(packet);
 		if (sent != packet.size())
-			throw std::runtime_error{OBF("Negotiation channel does not support chunking. Packet size: ") + std::to_string(packet.size()) + OBF(" Channel sent: ") + std::to_string(sent)};
+		{
+			// Following packets are split into fragments that fit in the accepted part.
+			if (sent >= QualityOfService::s_MinFrameSize)
+				m_SendFrameSize = sent;
+
+			++m_Metrics.m_PartialSends;
+			throw std::runtime_error{ OBF("Negotiation channel accepted only a part of the packet. Packet size: ") + std::to_string(packet.size()) + OBF(" Channel sent: ") + std::to_string(sent) };
+		}
 
+		++m_Metrics.m_ChunksSent;
 		return;
 	}
 
 	auto oryginalSize = static_cast<uint32_t>(packet.size());
-	auto messageId = m_QoS.GetOutgouingPacketId();
+	uint32_t messageId;
+	{
+		// Only packets split into chunks are worth forwarding early.
+		auto queueLock = std::lock_guard<std::mutex>{ m_ProtectOutboundQueue };
+		messageId = m_QoS.GetOutgouingPacketId(allowCutThrough && packet.size() + QualityOfService::s_HeaderSize > m_SendFrameSize);
+	}
+
+	std::vector<uint32_t> chunkOffsets;
 	uint32_t chunkId = 0u;
-	while (!packet.empty())
+	SendChunks(messageId, chunkId, oryginalSize, packet, 0u, m_QoS.IsSelectiveRetransmissionEnabled() ? &chunkOffsets : nullptr);
+	if (m_QoS.IsSelectiveRetransmissionEnabled())
+	{
+		auto queueLock = std::lock_guard<std::mutex>{ m_ProtectOutboundQueue };
+		m_QoS.StoreSentPacket(messageId, packet, std::move(chunkOffsets));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::SendChunks(uint32_t packetId, uint32_t& chunkId, uint32_t expectedSize, ByteView data, uint32_t offset, std::vector<uint32_t>* chunkOffsets)
+{
+	EventTracing::Scope<EventTracing::Keyword::QualityOfService> tracingScope{ "DeviceBridge::SendChunks", data.size() };
+	AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::QualityOfService };
+	auto groupSize = m_QoS.GetParityGroupSize();
+	auto groupChunkId = chunkId;
+	std::vector<ByteView> group;
+	while (!data.empty())
 	{
-		auto data = ByteVector{}.Write(messageId, chunkId, oryginalSize).Concat(packet);
-		auto sent = GetDevice()->OnSendToChannelInternal(data);
+		// Offer no more than channel accepted last time, so remaining data is not copied over and over again.
+		m_SendBuffer.clear();
+		auto headerSize = QualityOfService::WriteHeader(m_SendBuffer, packetId, chunkId, expectedSize, m_QoS.AreCompactHeadersEnabled());
+		auto offered = std::min(data.size(), m_SendFrameSize - std::max(headerSize, m_QoS.GetParityReserve()));
+		m_SendBuffer.reserve(headerSize + offered);
+		m_SendBuffer.Concat(data.SubString(0, offered));
+		auto sent = SendFrame(m_SendBuffer);
 
-		if (sent >= QualityOfService::s_MinFrameSize || sent == data.size()) // if this condition were not channel must resend data.
+		if (sent >= QualityOfService::s_MinFrameSize || sent == m_SendBuffer.size()) // if this condition were not channel must resend data.
 		{
+			if (chunkOffsets)
+				chunkOffsets->push_back(offset);
+
+			if (groupSize)
+				group.push_back(data.SubString(0, sent - headerSize));
+
 			chunkId++;
-			packet.remove_prefix(sent - QualityOfService::s_HeaderSize);
+			data.remove_prefix(sent - headerSize);
+			offset += static_cast<uint32_t>(sent - headerSize);
+			++m_Metrics.m_ChunksSent;
+
+			// Parity chunk follows each group and the last chunk of the packet. It's sent once, as lost one only means that receiver asks for missing chunks.
+			if (groupSize && (group.size() == groupSize || data.empty()) && (chunkId > 1 || !data.empty()))
+			{
+				auto parity = QualityOfService::CreateParityFrame(packetId, groupChunkId, expectedSize, group, m_QoS.AreCompactHeadersEnabled());
+				if (auto paritySent = SendFrame(parity); paritySent >= QualityOfService::s_MinFrameSize || paritySent == parity.size())
+					++m_Metrics.m_ChunksSent;
+
+				group.clear();
+				groupChunkId = chunkId;
+			}
+
+			if (sent < m_SendBuffer.size())
+			{
+				++m_Metrics.m_PartialSends;
+				m_SendFrameSize = sent;
+			}
+			else if (!data.empty() && m_SendFrameSize < m_MaxFrameSize) // Whole trimmed frame was accepted. Try a bigger one next time.
+				m_SendFrameSize = m_SendFrameSize < m_MaxFrameSize / 2 ? m_SendFrameSize * 2 : m_MaxFrameSize;
 		}
+		else
+			++m_Metrics.m_Resends;
 	}
+}
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<uint32_t> FSecure::C3::Core::DeviceBridge::BeginCutThrough()
+{
+	// Forwarded chunks are sent right away and not kept, so Channels that batch frames, retransmit them, protect them with parity or carry no QoS headers take whole packets only.
+	if (m_IsNegotiationChannel || m_IsQoSBypassed || GetDevice()->GetBatchingSettings() || m_QoS.IsSelectiveRetransmissionEnabled() || m_QoS.GetParityGroupSize())
+		return {};
+
+	auto queueLock = std::lock_guard<std::mutex>{ m_ProtectOutboundQueue };
+	return m_QoS.GetOutgouingPacketId(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::SendCutThroughChunk(uint32_t packetId, uint32_t& chunkId, uint32_t expectedSize, ByteView chunk, uint32_t offset)
+{
+	OnTraffic();
+	auto lock = std::lock_guard{ m_ProtectWriteInConcurrentThreads };
+	if (!offset)
+		++m_Metrics.m_PacketsOut;
+
+	m_Metrics.m_BytesOut += chunk.size();
+	SendChunks(packetId, chunkId, expectedSize, chunk, offset, nullptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::CutThrough(ByteView chunkWithHeader)
+{
+	auto header = m_QoS.ReadHeader(chunkWithHeader);
+	if (!header || !(header->m_PacketId & QualityOfService::s_CutThroughPacketIdFlag))
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	auto it = m_CutThroughStreams.find(header->m_PacketId);
+	if (it == m_CutThroughStreams.end())
+	{
+		// Only the first chunk starts a stream, as it carries the size of the packet and nothing was skipped before it. Copies of delivered packets are not forwarded again.
+		if (header->m_ChunkId || !header->m_ExpectedSize || chunkWithHeader.size() >= *header->m_ExpectedSize || m_QoS.IsDelivered(header->m_PacketId))
+			return;
+
+		auto ttl = GetRelay()->GetQoSSettings().m_IncompletePacketTtl;
+		for (auto stream = m_CutThroughStreams.begin(); stream != m_CutThroughStreams.end();)
+			stream = now - stream->second.m_LastUpdate > ttl ? m_CutThroughStreams.erase(stream) : std::next(stream);
+
+		auto target = GetRelay()->SelectCutThroughChannel(shared_from_this());
+		auto targetPacketId = target ? target->BeginCutThrough() : std::nullopt;
+		if (!targetPacketId)
+			return;
+
+		it = m_CutThroughStreams.emplace(header->m_PacketId, CutThroughStream{ target, *targetPacketId, *header->m_ExpectedSize }).first;
+	}
+
+	auto& stream = it->second;
+	stream.m_LastUpdate = now;
+	if (!stream.m_IsActive || header->m_ChunkId < stream.m_NextChunkId) // Duplicates of forwarded chunks are ignored.
+		return;
+
+	// Chunks are forwarded in order. After a gap the packet is reassembled and routed as usual.
+	auto target = stream.m_Target.lock();
+	if (!target || header->m_ChunkId != stream.m_NextChunkId || stream.m_Forwarded + chunkWithHeader.size() > stream.m_ExpectedSize)
+	{
+		stream.m_IsActive = false;
+		return;
+	}
+
+	try
+	{
+		target->SendCutThroughChunk(stream.m_TargetPacketId, stream.m_NextTargetChunkId, stream.m_ExpectedSize, chunkWithHeader, stream.m_Forwarded);
+	}
+	catch (std::exception const& exception)
+	{
+		stream.m_IsActive = false;
+		Log({ OBF_SEC("Failed to forward a chunk, packet will be routed once reassembled. ") + exception.what(), LogMessage::Severity::Warning });
+		return;
+	}
+
+	++stream.m_NextChunkId;
+	stream.m_Forwarded += static_cast<uint32_t>(chunkWithHeader.size());
+	if (stream.m_Forwarded < stream.m_ExpectedSize)
+		return;
+
+	// Whole packet left already, so its reassembled copy is not needed.
+	stream.m_IsActive = false;
+	m_QoS.DiscardPacket(header->m_PacketId);
+	++m_Metrics.m_PacketsIn;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::QueueNetworkPacket(ByteView packet, Device::BatchingSettings const& settings, bool allowCutThrough)
+{
+	auto isFull = false;
+	{
+		// The first thread waits for other packets. The rest leave, unless there is enough data to send right away.
+		auto lock = std::lock_guard<std::mutex>{ m_ProtectOutboundQueue };
+		isFull = QueueFrames(packet, settings.m_MaxBatchSize, allowCutThrough);
+		if (!isFull && std::exchange(m_IsLingering, true))
+			return;
+	}
+
+	if (!isFull)
+		std::this_thread::sleep_for(settings.m_Linger);
+
+	FlushNetworkPackets();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::DeviceBridge::QueueFrames(ByteView packet, size_t maxBatchSize, bool allowCutThrough)
+{
+	// Channel accepts whole frames, so chunk sizes are known up front.
+	auto frameSize = std::max(std::min(maxBatchSize, m_MaxFrameSize), QualityOfService::s_MinFrameSize);
+	auto oryginalSize = static_cast<uint32_t>(packet.size());
+	++m_Metrics.m_PacketsOut;
+	m_Metrics.m_BytesOut += packet.size();
+	auto messageId = m_QoS.GetOutgouingPacketId(allowCutThrough && packet.size() + QualityOfService::s_HeaderSize > frameSize);
+	std::vector<uint32_t> chunkOffsets;
+	std::vector<ByteView> group;
+	for (uint32_t chunkId = 0u, offset = 0u, groupChunkId = 0u; offset < oryginalSize || !chunkId; ++chunkId)
+	{
+		auto& frame = m_OutboundFrames.emplace_back().SetSensitive(false);
+		frame.reserve(frameSize);
+		auto chunk = packet.SubString(offset, frameSize - std::max(QualityOfService::WriteHeader(frame, messageId, chunkId, oryginalSize, m_QoS.AreCompactHeadersEnabled()), m_QoS.GetParityReserve()));
+		frame.Concat(chunk);
+		m_OutboundBytes += frame.size();
+		chunkOffsets.push_back(offset);
+		offset += static_cast<uint32_t>(chunk.size());
+
+		// Parity chunk follows each group and the last chunk of a packet that didn't fit in one frame.
+		if (auto groupSize = m_QoS.GetParityGroupSize(); groupSize)
+		{
+			group.push_back(chunk);
+			if ((group.size() == groupSize || offset >= oryginalSize) && (chunkId || offset < oryginalSize))
+			{
+				m_OutboundBytes += m_OutboundFrames.emplace_back(QualityOfService::CreateParityFrame(messageId, groupChunkId, oryginalSize, group, m_QoS.AreCompactHeadersEnabled())).SetSensitive(false).size();
+				group.clear();
+				groupChunkId = chunkId + 1;
+			}
+		}
+	}
+
+	if (m_QoS.IsSelectiveRetransmissionEnabled())
+		m_QoS.StoreSentPacket(messageId, packet, std::move(chunkOffsets));
+
+	return m_OutboundBytes >= maxBatchSize;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::FlushNetworkPackets()
+{
+	auto lock = std::lock_guard{ m_ProtectWriteInConcurrentThreads };
+	std::vector<ByteVector> frames;
+	{
+		// Thread that comes next will wait for another batch.
+		auto queueLock = std::lock_guard<std::mutex>{ m_ProtectOutboundQueue };
+		frames = std::move(m_OutboundFrames);
+		m_OutboundFrames.clear();
+		m_OutboundBytes = 0;
+		m_IsLingering = false;
+	}
+
+	if (frames.empty())
+		return;
+
+	// Keep order of frames. Unsent ones go before the ones queued meanwhile.
+	auto requeue = [&](size_t sent)
+	{
+		for (size_t i = 0; i < sent; ++i)
+			m_Capture.Record(TrafficCapture::Direction::Sent, frames[i]);
+
+		m_Metrics.m_ChunksSent += sent;
+		m_Metrics.m_Resends += frames.size() - sent;
+		auto queueLock = std::lock_guard<std::mutex>{ m_ProtectOutboundQueue };
+		for (auto i = sent; i < frames.size(); ++i)
+			m_OutboundBytes += frames[i].size();
+
+		m_OutboundFrames.insert(m_OutboundFrames.begin(), std::make_move_iterator(frames.begin() + sent), std::make_move_iterator(frames.end()));
+	};
+
+	try
+	{
+		size_t sent;
+		{
+			AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::Channels };
+			sent = GetDevice()->OnSendBatchToChannelInternal({ frames.begin(), frames.end() });
+		}
+
+		if (sent != frames.size())
+			requeue(sent);
+		else
+		{
+			m_Metrics.m_ChunksSent += sent;
+			for (auto&& frame : frames)
+				m_Capture.Record(TrafficCapture::Direction::Sent, frame);
+		}
+	}
+	catch (...)
+	{
+		requeue(0);
+		throw;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::RequestMissingChunks()
+{
+	auto missingChunks = m_QoS.CollectMissingChunks();
+	if (missingChunks.empty())
+		return;
+
+	auto request = QualityOfService::CreateRetransmissionRequest(missingChunks, m_QoS.AreCompactHeadersEnabled());
+	auto lock = std::lock_guard{ m_ProtectWriteInConcurrentThreads };
+	SendFrame(request); // Best effort. Packets will be requested again if request is lost.
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::Retransmit(ByteView request)
+{
+	auto lock = std::lock_guard{ m_ProtectWriteInConcurrentThreads };
+	for (auto&& missingChunks : QualityOfService::ParseRetransmissionRequest(request, m_QoS.AreCompactHeadersEnabled()))
+	{
+		std::vector<ByteVector> frames;
+		{
+			auto queueLock = std::lock_guard<std::mutex>{ m_ProtectOutboundQueue };
+			frames = m_QoS.CreateRetransmissionFrames(missingChunks);
+		}
+
+		for (auto&& frame : frames)
+			if (SendFrame(frame.SetSensitive(false)) != frame.size())
+				return; // Chunk boundaries must match the original ones. Give up, receiver will ask again.
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -93,17 +637,36 @@ void FSecure::C3::Core::DeviceBridge::PostCommandToConnector(ByteView packet)
 	GetRelay()->PostCommandToConnector(packet, shared_from_this());
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::PostCommandSegmentToConnector(ByteView segment, std::uint32_t commandSize, std::uint32_t offset)
+{
+	auto commandId = offset ? m_StreamedCommandId.load() : ++m_StreamedCommandId;
+	GetRelay()->PostCommandSegmentToConnector(segment, BinderSegment{ commandId, commandSize, offset }, shared_from_this());
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::DeviceBridge::OnCommandFromConnector(ByteView command)
 {
-	auto lock = std::lock_guard<std::mutex>{ m_ProtectWriteInConcurrentThreads };
+	auto lock = std::lock_guard{ m_ProtectWriteInConcurrentThreads };
+	OnTraffic();
 	GetDevice()->OnCommandFromConnector(command);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Core::DeviceBridge::RunCommand(ByteView command)
 {
-	return GetDevice()->OnRunCommand(command);
+	// Devices never see QoS frames, so the bridge captures them itself.
+	auto commandId = command.size() >= sizeof(uint16_t) ? ByteView{ command }.Read<uint16_t>() : uint16_t{ 0 };
+	if (commandId == static_cast<uint16_t>(FSecure::C3::Command::SetCapture))
+		return SetCapture(command.SubString(sizeof(uint16_t))), ByteVector{};
+
+	// Jitter is changed by the Device itself, bypassing SetUpdateDelay.
+	auto isJitterUpdate = commandId == static_cast<uint16_t>(FSecure::C3::Command::UpdateJitter);
+	auto result = GetDevice()->OnRunCommand(command);
+	if (isJitterUpdate)
+		OnUpdateDelayChanged();
+
+	return result;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -130,51 +693,148 @@ void FSecure::C3::Core::DeviceBridge::StartUpdatingInSeparateThread()
 	std::thread{
 		[this, self = shared_from_this()]()
 		{
-			WinTools::StructuredExceptionHandling::SehWrapper([&]()
+			auto lastUpdate = std::chrono::steady_clock::now();
+			while (m_IsAlive)
 			{
-				while (m_IsAlive)
-					try
-					{
-						std::this_thread::sleep_for(GetDevice()->GetUpdateDelay());
-						OnReceive();
-					}
-					catch (std::exception const& exception)
+				{
+					// Delay is recalculated if a send opens response window meanwhile, and only ever gets shorter, unless update delay itself is changed. Detach ends the wait.
+					auto lock = std::unique_lock<std::mutex>{ m_UpdateDelayMutex };
+					auto deadline = lastUpdate + GetUpdateDelay();
+					auto revision = m_UpdateDelayRevision;
+					while (m_IsAlive && !m_IsUpdateRequested && m_UpdateDelayChanged.wait_until(lock, deadline) == std::cv_status::no_timeout)
 					{
-						Log({ OBF_SEC("std::exception while updating: ") + exception.what(), LogMessage::Severity::Error });
+						deadline = revision == m_UpdateDelayRevision ? std::min(deadline, lastUpdate + GetUpdateDelay()) : lastUpdate + GetUpdateDelay();
+						revision = m_UpdateDelayRevision;
 					}
-					catch (...)
-					{
-						Log({ OBF_SEC("Unknown exception while updating."), LogMessage::Severity::Error });
-					}
-			}, [this]()
-			{
-#				if defined _DEBUG
-						Log({ "Signal captured, ending thread execution.", LogMessage::Severity::Error });
-#				endif
-			});
+
+					m_IsUpdateRequested = false;
+				}
+
+				if (!UpdateOnce())
+					break;
+
+				lastUpdate = std::chrono::steady_clock::now();
+			}
 		}}.detach();
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::DeviceBridge::UpdateOnce()
+{
+	if (!m_IsAlive)
+		return false;
+
+	auto signalCaptured = false;
+	WinTools::StructuredExceptionHandling::SehWrapper([&]()
+	{
+		auto start = std::chrono::steady_clock::now();
+		try
+		{
+			OnReceive();
+		}
+		catch (std::exception const& exception)
+		{
+			++m_Metrics.m_Exceptions;
+			Log({ OBF_SEC("std::exception while updating: ") + exception.what(), LogMessage::Severity::Error });
+		}
+		catch (...)
+		{
+			++m_Metrics.m_Exceptions;
+			Log({ OBF_SEC("Unknown exception while updating."), LogMessage::Severity::Error });
+		}
+
+		RecordReceiveDuration(std::chrono::steady_clock::now() - start);
+	}, [&]()
+	{
+		signalCaptured = true;
+#		if defined _DEBUG
+			Log({ "Signal captured, ending Device updates.", LogMessage::Severity::Error });
+#		endif
+	});
+
+	return m_IsAlive && !signalCaptured;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::milliseconds FSecure::C3::Core::DeviceBridge::GetUpdateDelay() const
+{
+	return GetDevice()->GetUpdateDelay();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::DeviceBridge::SetUpdateDelay(std::chrono::milliseconds minUpdateDelayInMs, std::chrono::milliseconds maxUpdateDelayInMs)
 {
 	GetDevice()->SetUpdateDelay(minUpdateDelayInMs, maxUpdateDelayInMs);
+	OnUpdateDelayChanged();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::DeviceBridge::SetUpdateDelay(std::chrono::milliseconds frequencyInMs)
 {
 	GetDevice()->SetUpdateDelay(frequencyInMs);
+	OnUpdateDelayChanged();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::OnUpdateDelayChanged()
+{
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_UpdateDelayMutex };
+		++m_UpdateDelayRevision;
+	}
+
+	m_UpdateDelayChanged.notify_one();
+	GetRelay()->RescheduleUpdate(*this);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::SetAdaptiveUpdateDelay(bool isAdaptive)
+{
+	GetDevice()->SetAdaptiveUpdateDelay(isAdaptive);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::SetResponseWindow(std::chrono::milliseconds window)
+{
+	GetDevice()->SetResponseWindow(window);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-std::shared_ptr<FSecure::C3::Device> FSecure::C3::Core::DeviceBridge::GetDevice() const
+void FSecure::C3::Core::DeviceBridge::OnTraffic()
+{
+	GetDevice()->OnTraffic();
+	if (!GetDevice()->GetResponseWindow().count())
+		return;
+
+	// Lock makes sure that the separate thread either sees the new delay or is already waiting for the notification.
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_UpdateDelayMutex };
+	}
+
+	m_UpdateDelayChanged.notify_one();
+	GetRelay()->ExpediteUpdate(*this);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::RequestUpdate()
+{
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_UpdateDelayMutex };
+		m_IsUpdateRequested = true;
+	}
+
+	m_UpdateDelayChanged.notify_one();
+	GetRelay()->ExpediteUpdate(*this, 0ms);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Device> const& FSecure::C3::Core::DeviceBridge::GetDevice() const
 {
 	return m_Device;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-std::shared_ptr<FSecure::C3::Core::Relay> FSecure::C3::Core::DeviceBridge::GetRelay() const
+std::shared_ptr<FSecure::C3::Core::Relay> const& FSecure::C3::Core::DeviceBridge::GetRelay() const
 {
 	return m_Relay;
 }
@@ -199,6 +859,13 @@ bool FSecure::C3::Core::DeviceBridge::IsNegotiationChannel() const
 	return m_IsNegotiationChannel && IsChannel();
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Core::DeviceBridge::GetNegotiationFrameSize()
+{
+	auto lock = std::lock_guard{ m_ProtectWriteInConcurrentThreads };
+	return m_SendFrameSize;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::DeviceBridge::SetErrorStatus(std::string_view errorMessage)
@@ -211,3 +878,218 @@ std::string FSecure::C3::Core::DeviceBridge::GetErrorStatus()
 {
 	return m_Error;
 }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::QualityOfService::Statistics FSecure::C3::Core::DeviceBridge::GetQoSStatistics() const
+{
+	auto ret = m_QoS.GetStatistics();
+	ret.m_DroppedOutboundPackets = m_DroppedOutboundPackets;
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Core::DeviceBridge::GetOutboundQueueDepth() const
+{
+	auto lock = std::lock_guard<std::mutex>{ m_ProtectOutboundPackets };
+	return CountOutboundPackets();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Core::DeviceBridge::GetOutboundCredits() const
+{
+	auto lock = std::lock_guard<std::mutex>{ m_ProtectOutboundPackets };
+	if (!m_IsDraining)
+		return std::numeric_limits<size_t>::max();
+
+	auto count = CountOutboundPackets();
+	return count < m_OutboundQueueDepth ? m_OutboundQueueDepth - count : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Core::DeviceBridge::CountOutboundPackets() const
+{
+	return m_OutboundPackets[static_cast<size_t>(TrafficClass::Control)].size() + m_OutboundPackets[static_cast<size_t>(TrafficClass::Bulk)].size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::DeviceBridge::OutboundPacket FSecure::C3::Core::DeviceBridge::TakeOutboundPacket()
+{
+	auto& control = m_OutboundPackets[static_cast<size_t>(TrafficClass::Control)];
+	auto& bulk = m_OutboundPackets[static_cast<size_t>(TrafficClass::Bulk)];
+	auto takeBulk = control.empty() || (!bulk.empty() && m_OutboundControlStreak >= s_ControlBurst);
+	m_OutboundControlStreak = takeBulk || bulk.empty() ? 0 : m_OutboundControlStreak + 1;
+
+	auto& packets = takeBulk ? bulk : control;
+	auto packet = std::move(packets.front());
+	packets.pop_front();
+	return packet;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::DeviceBridge::Metrics FSecure::C3::Core::DeviceBridge::GetMetrics() const
+{
+	Metrics ret;
+	ret.m_BytesIn = m_Metrics.m_BytesIn;
+	ret.m_PacketsIn = m_Metrics.m_PacketsIn;
+	ret.m_BytesOut = m_Metrics.m_BytesOut;
+	ret.m_PacketsOut = m_Metrics.m_PacketsOut;
+	ret.m_ChunksSent = m_Metrics.m_ChunksSent;
+	ret.m_PartialSends = m_Metrics.m_PartialSends;
+	ret.m_Resends = m_Metrics.m_Resends;
+	ret.m_Exceptions = m_Metrics.m_Exceptions;
+	for (size_t i = 0; i < ret.m_ReceiveDurations.size(); ++i)
+		ret.m_ReceiveDurations[i] = m_Metrics.m_ReceiveDurations[i];
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::ProbeLinkIfDue()
+{
+	auto interval = std::chrono::duration_cast<std::chrono::milliseconds>(GetRelay()->GetQoSSettings().m_LinkProbeInterval);
+	if (interval == 0ms || !m_Metrics.m_PacketsIn)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	uint32_t sequence;
+	{
+		std::lock_guard lock{ m_LinkProbeMutex };
+		if (now < m_NextLinkProbe)
+			return;
+
+		m_NextLinkProbe = now + FSecure::Utils::GenerateRandomValue(interval * 3 / 4, interval * 5 / 4);
+		while (!m_PendingLinkProbes.empty() && now - m_PendingLinkProbes.front().second > interval * s_LinkProbeTimeoutIntervals)
+		{
+			m_LinkQuality.m_LossRate = (m_LinkQuality.m_LossRate * 7 + 1) / 8;
+			m_PendingLinkProbes.pop_front();
+		}
+
+		sequence = ++m_LastLinkProbe;
+		m_PendingLinkProbes.emplace_back(sequence, now);
+		++m_LinkQuality.m_ProbesSent;
+	}
+
+	GetRelay()->SendLinkProbe(shared_from_this(), sequence);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::OnLinkProbeAnswered(uint32_t sequence)
+{
+	auto now = std::chrono::steady_clock::now();
+	auto traffic = m_Metrics.m_BytesIn + m_Metrics.m_BytesOut;
+	std::lock_guard lock{ m_LinkProbeMutex };
+	auto probe = std::find_if(m_PendingLinkProbes.begin(), m_PendingLinkProbes.end(), [&](auto const& e) { return e.first == sequence; });
+	if (probe == m_PendingLinkProbes.end())
+		return;
+
+	// Smoothing follows TCP retransmission timer estimation (RFC 6298).
+	auto roundTrip = std::chrono::duration<float, std::milli>{ now - probe->second }.count();
+	if (!m_LinkQuality.m_ProbesAnswered)
+	{
+		m_LinkQuality.m_RoundTripMs = roundTrip;
+		m_LinkQuality.m_JitterMs = roundTrip / 2;
+	}
+	else
+	{
+		m_LinkQuality.m_JitterMs = (m_LinkQuality.m_JitterMs * 3 + std::abs(m_LinkQuality.m_RoundTripMs - roundTrip)) / 4;
+		m_LinkQuality.m_RoundTripMs = (m_LinkQuality.m_RoundTripMs * 7 + roundTrip) / 8;
+	}
+
+	m_LinkQuality.m_LossRate = m_LinkQuality.m_LossRate * 7 / 8;
+	++m_LinkQuality.m_ProbesAnswered;
+	m_PendingLinkProbes.erase(probe);
+
+	if (m_LinkProbeTraffic && now > m_LinkProbeTraffic->second)
+		m_LinkQuality.m_Throughput = static_cast<uint64_t>((traffic - m_LinkProbeTraffic->first) / std::chrono::duration<double>{ now - m_LinkProbeTraffic->second }.count());
+
+	m_LinkProbeTraffic.emplace(traffic, now);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::C3::Core::DeviceBridge::LinkQuality> FSecure::C3::Core::DeviceBridge::GetLinkQuality() const
+{
+	std::lock_guard lock{ m_LinkProbeMutex };
+	if (!m_LinkQuality.m_ProbesAnswered)
+		return {};
+
+	return m_LinkQuality;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::TrimMemory()
+{
+	// Channel might be stuck in a write. Its buffers are not idle then, so they are left alone.
+	if (auto lock = std::unique_lock{ m_ProtectWriteInConcurrentThreads, std::try_to_lock }; lock)
+	{
+		auto queueLock = std::lock_guard<std::mutex>{ m_ProtectOutboundQueue };
+		m_SendBuffer = {};
+		m_SendBuffer.SetSensitive(false);
+		m_OutboundFrames.shrink_to_fit();
+		m_QoS.ForgetSentPackets();
+	}
+
+	auto lock = std::lock_guard<std::mutex>{ m_ProtectOutboundPackets };
+	for (auto& packets : m_OutboundPackets)
+		packets.shrink_to_fit();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::StartCapture(std::filesystem::path const& path, std::uint64_t sizeLimit)
+{
+	if (!IsChannel())
+		throw std::logic_error{ OBF("Only Channels can capture traffic.") };
+
+	m_Capture.Start(path, sizeLimit);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::StopCapture()
+{
+	m_Capture.Stop();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Core::DeviceBridge::SendFrame(ByteView frame)
+{
+	size_t sent;
+	{
+		AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::Channels };
+		sent = GetDevice()->OnSendToChannelInternal(frame);
+	}
+
+	m_Capture.Record(TrafficCapture::Direction::Sent, frame.SubString(0, sent));
+	return sent;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::SetCapture(ByteView arguments)
+{
+	auto [path, sizeLimit] = arguments.Read<std::string, uint16_t>();
+	if (path.empty())
+		return StopCapture(), Log({ OBF_SEC("Traffic capture stopped."), LogMessage::Severity::Information });
+
+	StartCapture(path, std::uint64_t{ sizeLimit } * 1024 * 1024);
+	Log({ OBF_SEC("Capturing traffic to ") + path + OBF("."), LogMessage::Severity::Information });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::DeviceBridge::RecordReceiveDuration(std::chrono::steady_clock::duration duration)
+{
+	auto& buckets = Metrics::s_ReceiveDurationBuckets;
+	auto bucket = std::find_if(buckets.begin(), buckets.end(), [&](auto bound) { return duration < bound; }) - buckets.begin();
+	m_Metrics.m_ReceiveDurations[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::to_json(json& j, DeviceBridge::LinkQuality const& quality)
+{
+	j = json
+	{
+		{ "roundTripMs", quality.m_RoundTripMs },
+		{ "jitterMs", quality.m_JitterMs },
+		{ "lossRate", quality.m_LossRate },
+		{ "throughput", quality.m_Throughput },
+		{ "probesSent", quality.m_ProbesSent },
+		{ "probesAnswered", quality.m_ProbesAnswered },
+	};
+}
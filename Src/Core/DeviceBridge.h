@@ -4,6 +4,8 @@
 #include "Identifiers.h"
 #include "Common/FSecure/C3/Internals/Interface.h"
 #include "QualityOfService.h"
+#include "TrafficCapture.h"
+#include "LockProfiling.h"
 
 // Forward declarations.
 namespace FSecure::C3
@@ -20,6 +22,42 @@ namespace FSecure::C3::Core
 	/// PIMPL for Device type.
 	struct DeviceBridge : AbstractDeviceBridge, std::enable_shared_from_this<DeviceBridge>
 	{
+		/// Priority class of a routed packet. Outbound queue sends control packets first, so that route setup and operator commands stay fast during bulk transfers.
+		enum class TrafficClass : std::uint8_t
+		{
+			Control,																								///< Route setup and small packets, e.g. commands and their responses.
+			Bulk,																									///< Big packets and fragments of striped ones.
+		};
+
+		/// Traffic counters of the bridge, collected since the Device was attached.
+		struct Metrics
+		{
+			/// Upper bounds of OnReceive duration histogram buckets. Last bucket of the histogram counts longer calls.
+			static constexpr std::array<std::chrono::microseconds, 5> s_ReceiveDurationBuckets = { 100us, 1ms, 10ms, 100ms, 1s };
+
+			uint64_t m_BytesIn = 0;																					///< Size of frames received from the Channel, including QoS headers.
+			uint64_t m_PacketsIn = 0;																				///< Complete packets passed to the Relay.
+			uint64_t m_BytesOut = 0;																				///< Size of packets routed through the Channel, without QoS headers.
+			uint64_t m_PacketsOut = 0;																				///< Packets routed through the Channel.
+			uint64_t m_ChunksSent = 0;																				///< Frames accepted by the Channel.
+			uint64_t m_PartialSends = 0;																			///< Frames that the Channel accepted only partially.
+			uint64_t m_Resends = 0;																					///< Frames that the Channel didn't accept, which are offered again.
+			uint64_t m_Exceptions = 0;																				///< Exceptions thrown while updating the Device or sending packets.
+			std::array<uint64_t, s_ReceiveDurationBuckets.size() + 1> m_ReceiveDurations = {};						///< Number of OnReceive calls in each duration bucket.
+		};
+
+		/// Quality of the link to the neighbour Relay at the other end of the Channel, measured with ProceduresN2N::LinkProbe.
+		/// Round trip includes update delays of both ends, so it is the latency seen by routed packets rather than of the transport alone.
+		struct LinkQuality
+		{
+			float m_RoundTripMs = 0;																				///< Smoothed round trip time of probes.
+			float m_JitterMs = 0;																					///< Smoothed deviation of round trip time.
+			float m_LossRate = 0;																					///< Moving average of the share of probes that weren't answered in time.
+			uint64_t m_Throughput = 0;																				///< Bytes per second passed through the Channel in both directions between the last two answered probes. Probes don't saturate the link, so it's a lower bound of its bandwidth.
+			uint32_t m_ProbesSent = 0;																				///< Number of probes sent.
+			uint32_t m_ProbesAnswered = 0;																			///< Number of probes answered in time.
+		};
+
 		/// Public constructor, used by Relays.
 		/// @param relay "parent" Relay this Device is being attached to.
 		/// @param did preferred Identifier.
@@ -46,14 +84,45 @@ namespace FSecure::C3::Core
 		/// @param packet full C3 packet.
 		void PassNetworkPacket(ByteView packet) override;
 
-		/// Fired by Relay to pass provided C3 packet through the Channel Device.
-		/// @param packet full C3 packet.
+		/// Fired by Channel when several C3 packets arrive at once. Complete packets are passed to the Relay together.
+		/// @param packets full C3 packets in order of arrival.
+		void PassNetworkPackets(std::vector<ByteVector> const& packets) override;
+
+		/// Brings the next update forward to now, whether it waits in the Scheduler or in the separate thread.
+		void RequestUpdate() override;
+
+		/// Fired by Relay to pass provided C3 packet through the Channel Device. Packet is queued and sent by Channel's own thread, unless queue is disabled in QualityOfService::Settings.
+		/// @param packet full C3 packet. Queued as bulk traffic.
 		void OnPassNetworkPacket(ByteView packet) override;
 
+		/// Fired by Relay to pass provided C3 packet through the Channel Device. @see OnPassNetworkPacket.
+		/// @param packet full C3 packet.
+		/// @param trafficClass priority class of the packet in the outbound queue.
+		/// @param allowCutThrough true if the packet is bound for the Gateway, so that Relays on the way may forward its chunks before it's reassembled.
+		void OnPassNetworkPacket(ByteView packet, TrafficClass trafficClass, bool allowCutThrough = false);
+
+		/// Starts a packet whose chunks are forwarded as they arrive from another Channel.
+		/// @return id of the packet or nothing if the Channel can't send it, e.g. when it batches frames or keeps sent packets for retransmission.
+		std::optional<uint32_t> BeginCutThrough();
+
+		/// Passes a chunk of a packet started by BeginCutThrough to the Channel, bypassing the outbound queue. Chunk is split further if it doesn't fit in a frame.
+		/// @param packetId id returned by BeginCutThrough.
+		/// @param chunkId id of the next chunk to send. Updated to the id following the last sent one.
+		/// @param expectedSize size of whole packet.
+		/// @param chunk part of the packet following the chunks sent so far.
+		/// @param offset position of chunk in the packet.
+		void SendCutThroughChunk(uint32_t packetId, uint32_t& chunkId, uint32_t expectedSize, ByteView chunk, uint32_t offset);
+
 		/// Called whenever an attached Peripheral wants to send a Command to its Connector Binder.
 		/// @param command full Command with arguments.
 		void PostCommandToConnector(ByteView packet) override;
 
+		/// Called whenever an attached Peripheral streams a long Command to its Connector Binder in parts.
+		/// @param segment part of the Command.
+		/// @param commandSize size of the whole Command.
+		/// @param offset position of segment in the Command.
+		void PostCommandSegmentToConnector(ByteView segment, std::uint32_t commandSize, std::uint32_t offset) override;
+
 		/// Fired by Relay to pass by provided Command from Connector.
 		/// @param command full Command with arguments.
 		void OnCommandFromConnector(ByteView command) override;
@@ -83,6 +152,10 @@ namespace FSecure::C3::Core
 		/// @returns true if device is negotiation channel, false if it is normal channel, or peripheral.
 		bool IsNegotiationChannel() const;
 
+		/// Gets size of the largest frame that negotiation channel is known to take whole. Larger packets are split by Distributor, as negotiation channel has no QoS.
+		/// @returns frame size declared by Device, lowered when Channel accepted a frame only partially.
+		size_t GetNegotiationFrameSize();
+
 		/// Get original channel parameters.
 		/// @returns ByteView view of parameters.
 		/// @remarks should be called only for negotiation channels.
@@ -105,6 +178,14 @@ namespace FSecure::C3::Core
 		/// Creates the receiving thread.
 		virtual void StartUpdatingInSeparateThread();
 
+		/// Performs a single OnReceive() call, logging all exceptions. Used by both the receiving thread and the Scheduler.
+		/// @return true if Device is still attached and should be updated again.
+		bool UpdateOnce();
+
+		/// Gets time span to the next OnReceive() call.
+		/// @return randomized value in range set by SetUpdateDelay.
+		std::chrono::milliseconds GetUpdateDelay() const;
+
 		/// Modifies the duration and jitter of OnReceive() calls. If minUpdateDelayInMs != maxUpdateDelayInMs then update frequency is randomized in range between those values.
 		/// @param minUpdateDelayInMs minimum update frequency.
 		/// @param maxUpdateDelayInMs maximum update frequency.
@@ -114,9 +195,17 @@ namespace FSecure::C3::Core
 		/// @param frequencyInMs frequency of OnReceive() calls.
 		void SetUpdateDelay(std::chrono::milliseconds frequencyInMs) override;
 
+		/// Turns adaptive update delay on or off. @see Device::GetUpdateDelay.
+		/// @param isAdaptive true to poll faster while there is traffic.
+		void SetAdaptiveUpdateDelay(bool isAdaptive);
+
+		/// Turns response expected mode on or off. @see Device::SetResponseWindow.
+		/// @param window time after a send during which updates happen at minimal delay. Zero turns the mode off.
+		void SetResponseWindow(std::chrono::milliseconds window);
+
 		/// "Parent" Relay getter.
-		/// @return Relay this Device is attached to.
-		std::shared_ptr<Relay> GetRelay() const;
+		/// @return Relay this Device is attached to. Set once in the constructor, so the reference is valid as long as this bridge is.
+		std::shared_ptr<Relay> const& GetRelay() const;
 
 		/// Set error on device.
 		/// @param errorMessage text of error. Set empty to remove error.
@@ -125,12 +214,150 @@ namespace FSecure::C3::Core
 		/// Get error string.
 		std::string GetErrorStatus() override;
 
+		/// Get counters of incomplete packets dropped by Quality of Service.
+		/// @returns copy of current counters.
+		QualityOfService::Statistics GetQoSStatistics() const;
+
+		/// @return number of packets waiting in the outbound queue.
+		size_t GetOutboundQueueDepth() const;
+
+		/// Gets credits of the outbound queue, i.e. number of packets that can still be passed to the Device without waiting or dropping.
+		/// @return free slots of the outbound queue. Maximal value if Device sends packets on the thread that routes them.
+		size_t GetOutboundCredits() const;
+
+		/// Get traffic counters. Safe to call from any thread.
+		/// @returns copy of current counters.
+		Metrics GetMetrics() const;
+
+		/// Sends a ProceduresN2N::LinkProbe if QualityOfService::Settings::m_LinkProbeInterval passed since the last one. Probes start once a packet was received, i.e. there is a neighbour to answer them.
+		/// Interval varies by a quarter either way, so that probes don't make a steady beacon on the Channel. Probes not answered within s_LinkProbeTimeoutIntervals intervals are counted as lost.
+		void ProbeLinkIfDue();
+
+		/// Records an answer to a probe sent by ProbeLinkIfDue. Answers to unknown or lost probes are ignored.
+		/// @param sequence number of the probe.
+		void OnLinkProbeAnswered(uint32_t sequence);
+
+		/// Get quality of the link to the neighbour. Safe to call from any thread.
+		/// @returns copy of current measurements or nothing if no probe was answered yet.
+		std::optional<LinkQuality> GetLinkQuality() const;
+
+		/// Releases capacity left in buffers and queues by past traffic, along with packets kept for retransmission. Called when Relay is idle.
+		void TrimMemory();
+
+		/// Starts recording frames passing through the Channel. @see TrafficCapture.
+		/// @param path location of the capture file.
+		/// @param sizeLimit size of the capture file in bytes.
+		/// @throws std::logic_error if Device is not a Channel.
+		/// @throws std::runtime_error if file can't be created.
+		void StartCapture(std::filesystem::path const& path, std::uint64_t sizeLimit = TrafficCapture::s_DefaultSizeLimit);
+
+		/// Stops recording frames. Does nothing if capture is not running.
+		void StopCapture();
+
 	protected:
+		/// Packet waiting in the outbound queue.
+		struct OutboundPacket
+		{
+			ByteVector m_Data;																						///< Full C3 packet.
+			bool m_AllowCutThrough;																					///< @see OnPassNetworkPacket.
+		};
+
 		/// Device object getter.
-		/// @return Device this object binds Relay with.
-		std::shared_ptr<Device> GetDevice() const;
+		/// @return Device this object binds Relay with. Set once in the constructor, so the reference is valid as long as this bridge is.
+		std::shared_ptr<Device> const& GetDevice() const;
+
+		/// Sends request for chunks of packets that stopped receiving data.
+		void RequestMissingChunks();
+
+		/// Splits packet into chunks and passes them to the Channel.
+		/// @param packet full C3 packet.
+		/// @param allowCutThrough whether chunks of the packet may be forwarded before it's reassembled. @see QualityOfService::s_CutThroughPacketIdFlag.
+		void SendNetworkPacket(ByteView packet, bool allowCutThrough = false);
+
+		/// Passes chunks of a packet to the Channel, offering no more than Channel accepted last time. Must be called with m_ProtectWriteInConcurrentThreads taken.
+		/// @param packetId id of the packet.
+		/// @param chunkId id of the first chunk to send. Updated to the id following the last sent one.
+		/// @param expectedSize size of whole packet.
+		/// @param data part of the packet to send.
+		/// @param offset position of data in the packet.
+		/// @param chunkOffsets offset of each sent chunk is appended to it. Can be null.
+		void SendChunks(uint32_t packetId, uint32_t& chunkId, uint32_t expectedSize, ByteView data, uint32_t offset, std::vector<uint32_t>* chunkOffsets);
+
+		/// Forwards a received chunk of a packet bound for the Gateway, if Relay chose a Channel for it. Packet is still reassembled, and passed to Relay only if forwarding broke off.
+		/// @param chunkWithHeader received chunk, already pushed to m_QoS.
+		void CutThrough(ByteView chunkWithHeader);
+
+		/// Outbound queue thread body. Sends queued packets until the Device is detached. Packets queued during linger time of a batching Channel are sent together.
+		void DrainOutboundQueue();
+
+		/// Counts packets in the outbound queue. Must be called with m_ProtectOutboundPackets taken.
+		/// @return number of packets of all traffic classes.
+		size_t CountOutboundPackets() const;
+
+		/// Takes the next packet from the outbound queue. Must be called with m_ProtectOutboundPackets taken and queue not empty.
+		/// Control packets go first, but one bulk packet is let through after every s_ControlBurst of them, so that bulk transfers are slowed down and never stopped.
+		/// @return packet to send.
+		OutboundPacket TakeOutboundPacket();
+
+		/// Sends chunks requested by the other end of the Channel.
+		/// @param request frame created by QualityOfService::CreateRetransmissionRequest.
+		void Retransmit(ByteView request);
+
+		/// Splits packet into frames and adds them to the outbound queue. Thread that finds the queue empty waits for the linger time and sends everything collected meanwhile.
+		/// @param packet full C3 packet.
+		/// @param settings batching settings of the Channel.
+		/// @param allowCutThrough whether chunks of the packet may be forwarded before it's reassembled.
+		void QueueNetworkPacket(ByteView packet, Device::BatchingSettings const& settings, bool allowCutThrough);
+
+		/// Splits packet into frames and adds them to the outbound queue. Must be called with m_ProtectOutboundQueue taken.
+		/// @param packet full C3 packet.
+		/// @param maxBatchSize maximum size of a frame, trimmed to m_MaxFrameSize.
+		/// @param allowCutThrough whether chunks of the packet may be forwarded before it's reassembled.
+		/// @return true if queued frames should be sent right away.
+		bool QueueFrames(ByteView packet, size_t maxBatchSize, bool allowCutThrough);
+
+		/// Passes all queued frames to the Channel at once. Frames that Channel didn't accept stay queued.
+		void FlushNetworkPackets();
+
+		/// Tells Device that packets passed through it. If response window is set, the pending update is brought forward, whether it waits in the Scheduler or in the separate thread.
+		void OnTraffic();
+
+		/// Passes a frame to the Channel and records the part it accepted, if traffic is captured. Must be called with m_ProtectWriteInConcurrentThreads taken.
+		/// @param frame frame to send.
+		/// @return number of bytes accepted by the Channel.
+		size_t SendFrame(ByteView frame);
+
+		/// Handles Command::SetCapture.
+		/// @param arguments path of the capture file, empty to stop, and its size limit in MiB.
+		void SetCapture(ByteView arguments);
+
+		/// Adds OnReceive call to the duration histogram.
+		/// @param duration time spent in OnReceive.
+		void RecordReceiveDuration(std::chrono::steady_clock::duration duration);
 
 	private:
+		/// Number of control packets sent in a row, while bulk ones wait, before a bulk one is sent.
+		static constexpr size_t s_ControlBurst = 8;
+
+		/// Number of probing intervals after which an unanswered probe is counted as lost.
+		static constexpr size_t s_LinkProbeTimeoutIntervals = 3;
+
+		/// Makes the new update delay take effect right away, instead of after the update already waited for.
+		void OnUpdateDelayChanged();
+
+		/// Received packet whose chunks are forwarded to another Channel.
+		struct CutThroughStream
+		{
+			std::weak_ptr<DeviceBridge> m_Target;																	///< Channel the chunks are forwarded to.
+			uint32_t m_TargetPacketId;																				///< Id of the packet in the target Channel.
+			uint32_t m_ExpectedSize;																				///< Size of whole packet.
+			uint32_t m_NextChunkId = 0;																				///< Id of the next received chunk to forward.
+			uint32_t m_NextTargetChunkId = 0;																		///< Id of the next chunk sent through the target Channel.
+			uint32_t m_Forwarded = 0;																				///< Bytes of the packet forwarded so far.
+			bool m_IsActive = true;																					///< False once all chunks were forwarded or forwarding broke off.
+			std::chrono::steady_clock::time_point m_LastUpdate = std::chrono::steady_clock::now();					///< Time of the last chunk arrival.
+		};
+
 		bool m_IsAlive = true;																							///< False if detached and about to be destroyed.
 		const bool m_IsNegotiationChannel = false;																		///< Indicates that device is channel, and will be used in negotiation procedure.
 		const bool m_IsSlave;																							///< Indicates that device is negotiation channel, and will be requesting to join the network.
@@ -144,6 +371,88 @@ namespace FSecure::C3::Core
 		std::shared_ptr<Relay> m_Relay;																					///< Relay this Device is attached to.
 		std::shared_ptr<Device> m_Device;																				///< Device this object binds Relay with.
 		std::string m_Error;																							///< String with error text. No error if empty.
-		std::mutex m_ProtectWriteInConcurrentThreads;																	///< Allow only one thread to Write to device at one time.
+		LockProfiling::Mutex<> m_ProtectWriteInConcurrentThreads;														///< Allow only one thread to Write to device at one time. Lock site is shared by all DeviceBridges.
+		ByteVector m_SendBuffer;																						///< Reused for every chunk sent through the Channel. Guarded by m_ProtectWriteInConcurrentThreads.
+		const size_t m_MaxFrameSize;																					///< Frame size declared by Device::GetMaxFrameSize, or maximal value if Device didn't declare one.
+		const bool m_IsQoSBypassed;																						///< Set for Channels that are reliable, ordered and not limited in frame size. Packets are sent through them as single frames without QoS. @see Device::GetDeliveryGuarantees.
+		size_t m_SendFrameSize;																							///< Size of the last frame accepted only partially by the Channel, never above m_MaxFrameSize. Guarded by m_ProtectWriteInConcurrentThreads.
+		std::mutex m_ProtectOutboundQueue;																				///< Guards the outbound queue and outgoing packets in m_QoS. Taken after m_ProtectWriteInConcurrentThreads, if both are needed.
+		std::vector<ByteVector> m_OutboundFrames;																		///< Frames waiting to be sent together. Guarded by m_ProtectOutboundQueue.
+		size_t m_OutboundBytes = 0;																						///< Size of m_OutboundFrames in bytes. Guarded by m_ProtectOutboundQueue.
+		bool m_IsLingering = false;																						///< True if a thread waits to send m_OutboundFrames. Guarded by m_ProtectOutboundQueue.
+		const size_t m_OutboundQueueDepth;																				///< Maximum number of packets in m_OutboundPackets.
+		const QualityOfService::OverflowPolicy m_OutboundOverflowPolicy;												///< What happens to a routed packet if m_OutboundPackets is full.
+		mutable std::mutex m_ProtectOutboundPackets;																	///< Guards m_OutboundPackets and m_IsDraining.
+		std::condition_variable m_OutboundPacketsChanged;																///< Notified when a packet is queued or taken, and when Device is detached.
+		std::array<std::deque<OutboundPacket>, 2> m_OutboundPackets;													///< Packets waiting to be sent by the outbound queue thread, indexed by TrafficClass.
+		size_t m_OutboundControlStreak = 0;																				///< Control packets sent in a row while bulk ones were waiting. Guarded by m_ProtectOutboundPackets.
+		bool m_IsDraining = false;																						///< True if the outbound queue thread is running.
+		std::atomic<uint64_t> m_DroppedOutboundPackets = 0;																///< Packets dropped because m_OutboundPackets was full.
+		std::mutex m_UpdateDelayMutex;																					///< Guards the wait for the next update in the separate thread.
+		std::condition_variable m_UpdateDelayChanged;																	///< Notified when a send opens response window, update delay changes or Device is detached, so that the separate thread recalculates its wait.
+		uint64_t m_UpdateDelayRevision = 0;																				///< Incremented whenever update delay is changed. Guarded by m_UpdateDelayMutex.
+		bool m_IsUpdateRequested = false;																				///< Set by RequestUpdate, ends the wait of the separate thread. Guarded by m_UpdateDelayMutex.
+		std::map<uint32_t, CutThroughStream> m_CutThroughStreams;														///< Received packets being forwarded, by packet id. Accessed only by receiving thread.
+		mutable std::mutex m_LinkProbeMutex;																			///< Guards m_LinkQuality and probing state below.
+		LinkQuality m_LinkQuality;																						///< Measurements of the link. Meaningful once a probe was answered.
+		std::chrono::steady_clock::time_point m_NextLinkProbe;															///< Time when the next probe is due.
+		uint32_t m_LastLinkProbe = 0;																					///< Sequence number of the last sent probe.
+		std::deque<std::pair<uint32_t, std::chrono::steady_clock::time_point>> m_PendingLinkProbes;						///< Probes waiting for an answer, with times they were sent, oldest first.
+		std::optional<std::pair<uint64_t, std::chrono::steady_clock::time_point>> m_LinkProbeTraffic;					///< Bytes passed through the Channel and time of the last answered probe, used to estimate throughput.
+		TrafficCapture m_Capture;																						///< Records frames passing through the Channel when turned on.
+		std::atomic<uint32_t> m_StreamedCommandId{ FSecure::Utils::GenerateRandomValue<uint32_t>() };					///< Identifies the Command being streamed by the Peripheral. Changed when its first segment is posted.
+
+		/// Counters updated by all threads using the bridge. @see Metrics.
+		struct
+		{
+			std::atomic<uint64_t> m_BytesIn = 0;																	///< @see Metrics::m_BytesIn.
+			std::atomic<uint64_t> m_PacketsIn = 0;																	///< @see Metrics::m_PacketsIn.
+			std::atomic<uint64_t> m_BytesOut = 0;																	///< @see Metrics::m_BytesOut.
+			std::atomic<uint64_t> m_PacketsOut = 0;																	///< @see Metrics::m_PacketsOut.
+			std::atomic<uint64_t> m_ChunksSent = 0;																	///< @see Metrics::m_ChunksSent.
+			std::atomic<uint64_t> m_PartialSends = 0;																///< @see Metrics::m_PartialSends.
+			std::atomic<uint64_t> m_Resends = 0;																	///< @see Metrics::m_Resends.
+			std::atomic<uint64_t> m_Exceptions = 0;																	///< @see Metrics::m_Exceptions.
+			std::array<std::atomic<uint64_t>, Metrics::s_ReceiveDurationBuckets.size() + 1> m_ReceiveDurations = {};	///< @see Metrics::m_ReceiveDurations.
+		} m_Metrics;
+	};
+
+	/// overload to_json for DeviceBridge::LinkQuality
+	/// @param json to write to
+	/// @param quality link quality to write
+	void to_json(json& j, DeviceBridge::LinkQuality const& quality);
+}
+
+namespace FSecure
+{
+	/// overload ByteConverter for DeviceBridge::LinkQuality
+	template<>
+	struct ByteConverter<C3::Core::DeviceBridge::LinkQuality>
+	{
+		/// Serialize LinkQuality type to ByteVector.
+		/// @param obj. Object to be serialized.
+		/// @param bv. ByteVector to be expanded.
+		static void To(C3::Core::DeviceBridge::LinkQuality const& obj, ByteVector& bv)
+		{
+			bv.Store(obj.m_RoundTripMs, obj.m_JitterMs, obj.m_LossRate, obj.m_Throughput, obj.m_ProbesSent, obj.m_ProbesAnswered);
+		}
+
+		/// Get size required after serialization.
+		/// @return size_t. Number of bytes used after serialization.
+		constexpr static size_t Size()
+		{
+			using T = C3::Core::DeviceBridge::LinkQuality;
+			return ByteVector::ConstantSize<decltype(T::m_RoundTripMs), decltype(T::m_JitterMs), decltype(T::m_LossRate), decltype(T::m_Throughput), decltype(T::m_ProbesSent), decltype(T::m_ProbesAnswered)>();
+		}
+
+		/// Deserialize from ByteView.
+		/// @param bv. Buffer with serialized data.
+		/// @return LinkQuality.
+		static C3::Core::DeviceBridge::LinkQuality From(ByteView& bv)
+		{
+			C3::Core::DeviceBridge::LinkQuality obj;
+			ByteReader{ bv }.Read(obj.m_RoundTripMs, obj.m_JitterMs, obj.m_LossRate, obj.m_Throughput, obj.m_ProbesSent, obj.m_ProbesAnswered);
+			return obj;
+		}
 	};
 }
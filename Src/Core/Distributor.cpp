@@ -1,11 +1,35 @@
 #include "StdAfx.h"
 #include "Distributor.h"
 #include "DeviceBridge.h"
+#include "EventTracing.h"
+#include "AllocationTracking.h"
 #include "Common/FSecure/CppTools/ByteConverter/ByteConverter.h"
+#include "Common/FSecure/CppTools/ScopeGuard.h"
+
+namespace
+{
+	/// Trace context of the packet handled by this thread. Null if the packet is not traced.
+	thread_local FSecure::C3::Core::TraceContext* g_CurrentTrace = nullptr;
+
+	/// Incremented by Distributor::ReleaseThreadBuffers.
+	std::atomic<std::uint32_t> g_BuffersGeneration = 0;
+
+	/// Releases capacity of a per-thread buffer if ReleaseThreadBuffers was called since its last use.
+	/// @param buffer per-thread buffer.
+	/// @param generation value of g_BuffersGeneration seen at the last use of the buffer.
+	void ReleaseIfRequested(FSecure::ByteVector& buffer, std::uint32_t& generation)
+	{
+		if (auto current = g_BuffersGeneration.load(std::memory_order_relaxed); current != generation)
+		{
+			generation = current;
+			buffer = {};
+		}
+	}
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::Distributor::Distributor(LoggerCallback callbackOnLog, Crypto::PrivateKey const& decryptionKey, Crypto::SymmetricKey const& broadcastKey)
-	: m_CallbackOnLog{ callbackOnLog }
+	: m_LogPipeline{ callbackOnLog }
 	, m_BroadcastKey{ broadcastKey }
 	, m_DecryptionKey{ decryptionKey }
 {
@@ -14,41 +38,104 @@ FSecure::C3::Core::Distributor::Distributor(LoggerCallback callbackOnLog, Crypto
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::Distributor::Log(LogMessage const& message, DeviceId sender) noexcept
 {
-	m_CallbackOnLog(message, std::string_view{ sender.IsNull() ? "" : sender.ToString() });
+	m_LogPipeline.Push(message, sender);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::Distributor::OnPacketReceived(ByteView packet, std::shared_ptr<DeviceBridge> sender)
+bool FSecure::C3::Core::Distributor::IsLogEnabled(LogMessage::Severity severity) const noexcept
 {
-	try
-	{
-		// Sanity check.
-		if (packet.empty())
-			throw std::runtime_error{ OBF("Received an empty packet.") };
+	return m_LogPipeline.IsEnabled(severity);
+}
 
-		// Decrypt the packet and interpret the protocol.
-		auto unlockedPacket = UnlockPacket(packet);
-		switch (static_cast<Protocols>(unlockedPacket[0]))
-		{
-		case Protocols::N2N:
-			return OnProtocolN2N(unlockedPacket, sender);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::SetLogThreshold(LogMessage::Severity threshold) noexcept
+{
+	m_LogPipeline.SetThreshold(threshold);
+}
 
-		case Protocols::S2G:
-			return OnProtocolS2G(unlockedPacket, sender);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::uint64_t FSecure::C3::Core::Distributor::GetDroppedLogsCount() const noexcept
+{
+	return m_LogPipeline.GetDroppedCount();
+}
 
-		case Protocols::G2A:
-			return OnProtocolG2A(unlockedPacket, sender);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::OnPacketReceived(ByteView packet, std::shared_ptr<DeviceBridge> const& sender)
+{
+	EventTracing::Scope<EventTracing::Keyword::Packets> tracingScope{ "Distributor::OnPacketReceived", packet.size() };
+	try
+	{
+		// Decrypt the packet into this thread's buffer. Buffer is taken for the time of handling, so that nested calls don't overwrite it.
+		thread_local ByteVector unlockBuffer;
+		thread_local std::uint32_t unlockBufferGeneration = 0;
+		ReleaseIfRequested(unlockBuffer, unlockBufferGeneration);
+		auto buffer = std::move(unlockBuffer);
+		SCOPE_GUARD(
+			FSecure::Utils::SecureMemzero(buffer.data(), buffer.size());
+			buffer.clear();
+			unlockBuffer = std::move(buffer);
+		);
 
-		case Protocols::G2R:
-			return OnProtocolG2R(unlockedPacket, sender);
+		ByteView unlocked;
+		if (auto error = UnlockPacket(packet, buffer, unlocked); error.IsFailure())
+			return LogDroppedPacket(error, sender);
 
-		default:
-			throw std::runtime_error{ OBF("Unknown protocol: ") + std::to_string(unlockedPacket[0]) + OBF(".") };
-		}
+		// Interpret the protocol.
+		HandleUnlockedPacket(unlocked, sender);
 	}
 	catch (std::runtime_error& e)
 	{
-		Log({ OBF_SEC("Packet handling failure. ") +e.what(), LogMessage::Severity::Error }, sender ? sender->GetDid() : DeviceId{});
+		Log(LogMessage::Severity::Error, [&] { return OBF_SEC("Packet handling failure. ") + e.what(); }, sender ? sender->GetDid() : DeviceId{});
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::OnPacketsReceived(std::vector<ByteView> const& packets, std::shared_ptr<DeviceBridge> const& sender)
+{
+	for (auto packet : packets)
+		OnPacketReceived(packet, sender);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::HandleUnlockedPacket(ByteView unlockedPacket, std::shared_ptr<DeviceBridge> const& sender)
+{
+	AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::Procedures };
+
+	// Sanity check.
+	if (unlockedPacket.empty())
+		throw std::runtime_error{ OBF("Received an empty packet.") };
+
+	switch (static_cast<Protocols>(unlockedPacket[0]))
+	{
+	case Protocols::N2N:
+		return OnProtocolN2N(unlockedPacket, sender);
+
+	case Protocols::S2G:
+		return OnProtocolS2G(unlockedPacket, sender);
+
+	case Protocols::G2A:
+		return OnProtocolG2A(unlockedPacket, sender);
+
+	case Protocols::G2R:
+		return OnProtocolG2R(unlockedPacket, sender);
+
+	case Protocols::Traced:
+		return OnProtocolTraced(unlockedPacket, sender);
+
+	case Protocols::Multicast:
+		return OnProtocolMulticast(unlockedPacket, sender);
+
+	case Protocols::Striped:
+		return OnProtocolStriped(unlockedPacket, sender);
+
+	case Protocols::Envelope:
+		return OnProtocolEnvelope(unlockedPacket, sender);
+
+	case Protocols::Fragmented:
+		return OnProtocolFragmented(unlockedPacket, sender);
+
+	default:
+		throw std::runtime_error{ OBF("Unknown protocol: ") + std::to_string(unlockedPacket[0]) + OBF(".") };
 	}
 }
 
@@ -59,7 +146,7 @@ bool FSecure::C3::Core::Distributor::IsAgentBanned(AgentId agentId)
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::Distributor::OnProtocolN2N(ByteView packet0, std::shared_ptr<DeviceBridge> sender)
+void FSecure::C3::Core::Distributor::OnProtocolN2N(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
 {
 	// Protocol structure: [NeighborToNeighbor][SENDERS AID.IID][N2N Procedure][FIELDS]...
 	try
@@ -73,7 +160,7 @@ void FSecure::C3::Core::Distributor::OnProtocolN2N(ByteView packet0, std::shared
 		// Parse neighbor identifier and check whether is banned.
 		auto neighborRouteId = packet0.Read<RouteId>();
 		if (IsAgentBanned(neighborRouteId.GetAgentId()))
-			return Log({ OBF("Received packet from a banned Agent ") + neighborRouteId.ToString() + OBF("."), LogMessage::Severity::Warning });
+			return Log(LogMessage::Severity::Warning, [&] { return OBF("Received packet from a banned Agent ") + neighborRouteId.ToString() + OBF("."); });
 
 		// Handle Procedure part.
 		return ProceduresN2N::RequestHandler::ParseRequestAndHandleIt(sender, neighborRouteId, packet0);
@@ -85,13 +172,190 @@ void FSecure::C3::Core::Distributor::OnProtocolN2N(ByteView packet0, std::shared
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::Distributor::LockAndSendPacket(ByteView packet, std::shared_ptr<DeviceBridge> channel)
+void FSecure::C3::Core::Distributor::OnProtocolTraced(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
 {
-	channel->OnPassNetworkPacket(FSecure::Crypto::EncryptAnonymously(packet, m_BroadcastKey));
+	auto context = TraceContext::Parse(packet0);
+	if (context.m_Packet.empty() || static_cast<Protocols>(context.m_Packet[0]) == Protocols::Traced)
+		throw std::runtime_error{ OBF("Traced packet doesn't wrap a packet of other protocol.") };
+
+	{
+		auto previousTrace = std::exchange(g_CurrentTrace, &context);
+		SCOPE_GUARD( g_CurrentTrace = previousTrace; );
+		HandleUnlockedPacket(context.m_Packet, sender);
+	}
+
+	if (!context.m_IsForwarded)
+		OnTracedPacketDelivered(context, sender);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-FSecure::ByteVector FSecure::C3::Core::Distributor::UnlockPacket(ByteView packet)
+void FSecure::C3::Core::Distributor::OnProtocolEnvelope(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
 {
-	return FSecure::Crypto::DecryptFromAnonymous(packet, m_BroadcastKey);
+	for (auto const& packet : Envelope::Parse(packet0))
+	{
+		try
+		{
+			HandleUnlockedPacket(packet, sender);
+		}
+		catch (std::exception& exception)
+		{
+			Log(LogMessage::Severity::Error, [&] { return OBF_SEC("Failed to handle a packet of Envelope. ") + exception.what(); }, sender ? sender->GetDid() : DeviceId{});
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::OnProtocolFragmented(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	// Other Channels have QoS of their own.
+	if (!sender || !sender->IsNegotiationChannel())
+		throw std::runtime_error{ OBF("Fragmented packet received from a channel that is not a negotiation channel.") };
+
+	std::vector<ByteVector> packets;
+	{
+		std::lock_guard lock{ m_FragmentedPacketsMutex };
+		m_FragmentedPackets.PushReceivedChunk(packet0.SubString(1));
+		for (auto packet = m_FragmentedPackets.GetNextPacket(); !packet.empty(); packet = m_FragmentedPackets.GetNextPacket())
+			packets.push_back(std::move(packet));
+	}
+
+	for (auto const& packet : packets)
+	{
+		if (static_cast<Protocols>(packet[0]) == Protocols::Fragmented)
+			throw std::runtime_error{ OBF("Fragmented packet may not be nested.") };
+
+		HandleUnlockedPacket(packet, sender);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::OnTracedPacketDelivered(TraceContext const& context, std::shared_ptr<DeviceBridge> const& sender)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::TraceContext const* FSecure::C3::Core::Distributor::GetCurrentTrace()
+{
+	return g_CurrentTrace;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::LockAndSendPacket(ByteView packet, std::shared_ptr<DeviceBridge> const& channel)
+{
+	EventTracing::Scope<EventTracing::Keyword::Packets> tracingScope{ "Distributor::LockAndSendPacket", packet.size() };
+
+	// Buffer is taken for the time of sending, so that nested calls don't overwrite it.
+	thread_local ByteVector lockBuffer;
+	thread_local std::uint32_t lockBufferGeneration = 0;
+	ReleaseIfRequested(lockBuffer, lockBufferGeneration);
+	auto buffer = std::move(lockBuffer);
+	auto trafficClass = LockPacket(packet, buffer);
+	if (channel->IsNegotiationChannel() && buffer.size() > channel->GetNegotiationFrameSize())
+		LockAndSendFragments(packet, buffer.size() - packet.size(), channel, trafficClass);
+	else
+		channel->OnPassNetworkPacket(buffer, trafficClass);
+
+	lockBuffer = std::move(buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::LockAndSendFragments(ByteView packet, size_t lockOverhead, std::shared_ptr<DeviceBridge> const& channel, DeviceBridge::TrafficClass trafficClass)
+{
+	auto frameSize = channel->GetNegotiationFrameSize();
+	if (frameSize <= lockOverhead + Fragment::Header::Size)
+		throw std::runtime_error{ OBF("Negotiation channel frame is too small to carry a fragment. Channel frame size: ") + std::to_string(frameSize) };
+
+	ByteVector buffer;
+	for (auto const& fragment : Fragment::Split(packet, frameSize - lockOverhead - Fragment::Header::Size))
+	{
+		LockPacket(fragment, buffer);
+		channel->OnPassNetworkPacket(buffer, trafficClass);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::DeviceBridge::TrafficClass FSecure::C3::Core::Distributor::LockPacket(ByteView packet, ByteVector& buffer)
+{
+	EventTracing::Scope<EventTracing::Keyword::Crypto> tracingScope{ "Distributor::LockPacket", packet.size() };
+	AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::Crypto };
+	auto trafficClass = ClassifyPacket(packet);
+
+	// Traced packet passed further as it was received keeps its trace context.
+	ByteVector traced;
+	if (g_CurrentTrace && packet.data() == g_CurrentTrace->m_Packet.data() && packet.size() == g_CurrentTrace->m_Packet.size())
+	{
+		auto hops = g_CurrentTrace->m_Hops;
+		hops.push_back({ GetAgentId(), g_CurrentTrace->GetResidenceUs() });
+		traced = TraceContext::Wrap(g_CurrentTrace->m_TraceId, hops, packet);
+		g_CurrentTrace->m_IsForwarded = true;
+		packet = traced;
+	}
+
+	FSecure::Crypto::EncryptAnonymously(packet, m_BroadcastKey, buffer, m_BroadcastSuite.load(std::memory_order_relaxed));
+	m_LockedPacketsCount.fetch_add(1, std::memory_order_relaxed);
+	return trafficClass;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::DeviceBridge::TrafficClass FSecure::C3::Core::Distributor::ClassifyPacket(ByteView packet)
+{
+	if (packet.empty())
+		return DeviceBridge::TrafficClass::Bulk;
+
+	switch (static_cast<Protocols>(packet[0]))
+	{
+	case Protocols::N2N:
+		return DeviceBridge::TrafficClass::Control;
+	case Protocols::Striped:
+		return DeviceBridge::TrafficClass::Bulk;
+	default:
+		return packet.size() <= s_ControlPacketSize ? DeviceBridge::TrafficClass::Control : DeviceBridge::TrafficClass::Bulk;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::ReleaseThreadBuffers() noexcept
+{
+	g_BuffersGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::CppCommons::CppTools::XError<FSecure::C3::Core::Distributor::UnlockError> FSecure::C3::Core::Distributor::UnlockPacket(ByteView packet, ByteVector& buffer, ByteView& unlocked)
+{
+	EventTracing::Scope<EventTracing::Keyword::Crypto> tracingScope{ "Distributor::UnlockPacket", packet.size() };
+	AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::Crypto };
+	if (packet.empty())
+		return UnlockError::EmptyPacket;
+
+	auto suite = FSecure::Crypto::TryDecryptFromAnonymous(packet, m_BroadcastKey, buffer);
+	if (!suite)
+		return UnlockError::Forged;
+
+	m_UnlockedPacketsCount.fetch_add(1, std::memory_order_relaxed);
+
+	// Untagged packets may come from older builds, so they never downgrade the algorithm.
+	if (*suite != Crypto::AeadSuite::XSalsa20Poly1305 && !m_IsBroadcastSuitePinned.load(std::memory_order_relaxed) && m_BroadcastSuite.exchange(*suite, std::memory_order_relaxed) != *suite)
+		Log({ OBF("Switched Network key encryption to ") + Crypto::GetName(*suite) + OBF("."), LogMessage::Severity::Information });
+
+	unlocked = buffer;
+	return UnlockError::Success;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::LogDroppedPacket(UnlockError error, std::shared_ptr<DeviceBridge> const& sender) noexcept
+{
+	Log(LogMessage::Severity::Error, [error]
+	{
+		return OBF_SEC("Packet handling failure. ") + (error == UnlockError::EmptyPacket ? OBF("Received an empty packet.") : OBF("Packet is forged or encrypted with other Network key."));
+	}, sender ? sender->GetDid() : DeviceId{});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Distributor::SetBroadcastSuite(Crypto::AeadSuite suite)
+{
+	if (!Crypto::IsAvailable(suite))
+		throw std::invalid_argument{ OBF_STR("Encryption suite ") + Crypto::GetName(suite) + OBF(" is not available on this CPU.") };
+
+	m_IsBroadcastSuitePinned = true;
+	m_BroadcastSuite = suite;
 }
@@ -3,7 +3,9 @@
 #include "Procedures.h"
 #include "ProceduresG2X.h"
 #include "RouteManager.h"
+#include "LogPipeline.h"
 #include "Common/FSecure/Crypto/Crypto.hpp"
+#include "Common/FSecure/CppTools/XError.h"
 
 // Forward declarations.
 namespace FSecure::C3
@@ -26,15 +28,64 @@ namespace FSecure::C3::Core
 		virtual ~Distributor() = default;
 
 		/// Logs a message. Used by internal Relay mechanisms and attached Interfaces to report errors, warnings, informations and debug messages.
+		/// Message is queued and passed to the logger callback on a background thread, so this never blocks.
 		/// @param message information to log.
 		/// @param sender Interface reporting the message. If sender.IsNull() then the message comes from internal Relay mechanisms.
 		virtual void Log(LogMessage const& message, DeviceId sender = DeviceId{}) noexcept;
 
+		/// Logs a message that is built only if its severity is not filtered out, so that disabled logging costs no string building.
+		/// @param severity severity of the message.
+		/// @param formatter callable returning text of the message. Exceptions thrown from it are swallowed.
+		/// @param sender Interface reporting the message. If sender.IsNull() then the message comes from internal Relay mechanisms.
+		template <typename Formatter, typename = std::enable_if_t<std::is_invocable_v<Formatter&>>>
+		void Log(LogMessage::Severity severity, Formatter&& formatter, DeviceId sender = DeviceId{}) noexcept
+		{
+			if (!IsLogEnabled(severity))
+				return;
+
+			try
+			{
+				Log({ formatter(), severity }, sender);
+			}
+			catch (...)
+			{
+			}
+		}
+
+		/// Checks whether messages of given severity are logged. Call it before formatting costly messages.
+		/// @param severity severity to check.
+		/// @return true if severity is not filtered out.
+		bool IsLogEnabled(LogMessage::Severity severity) const noexcept;
+
+		/// Sets the least important severity that is logged. By default DebugInformation is logged only in debug builds. Has no effect if Relay was created without logger callback.
+		/// @param threshold severity to set.
+		void SetLogThreshold(LogMessage::Severity threshold) noexcept;
+
+		/// Gets number of Log entries dropped because the logger callback could not keep up.
+		/// @return number of dropped entries.
+		std::uint64_t GetDroppedLogsCount() const noexcept;
+
+		/// Sets algorithm used to encrypt packets with the Network key. Relays that receive packets encrypted with another algorithm switch to it, unless it was set with this method.
+		/// Incoming packets are decrypted with any available algorithm, so the choice propagates from the Gateway. Older builds read only XSalsa20Poly1305, and Aes256Gcm requires AES-NI on every Relay.
+		/// @param suite algorithm to use.
+		/// @throws std::invalid_argument if suite is not available on this CPU.
+		void SetBroadcastSuite(Crypto::AeadSuite suite);
+
 		/// Callback fired to by a Channel when a C3 packet arrives.
 		/// @param packet full C3 packet to interpret.
 		/// @param sender Interface passing the packet.
 		/// @throws std::runtime_error.
-		virtual void OnPacketReceived(ByteView packet, std::shared_ptr<DeviceBridge> sender);
+		virtual void OnPacketReceived(ByteView packet, std::shared_ptr<DeviceBridge> const& sender);
+
+		/// Callback fired to by a Channel when several C3 packets arrive at once.
+		/// @param packets full C3 packets to interpret, in order of arrival.
+		/// @param sender Interface passing the packets.
+		/// @throws std::runtime_error.
+		virtual void OnPacketsReceived(std::vector<ByteView> const& packets, std::shared_ptr<DeviceBridge> const& sender);
+
+		/// Gets identifier appended to trace contexts of passed packets.
+		/// @return Agent identifier of this Relay.
+		virtual AgentId GetAgentId() const = 0;
 
 	protected:
 		/// Expose all base classes `On` methods.
@@ -42,11 +93,17 @@ namespace FSecure::C3::Core
 		using ProceduresS2G::RequestHandler::On;
 
 		/// A protected ctor.
-		/// @param callbackOnLog callback fired whenever a new Log entry is being added.
+		/// @param callbackOnLog callback fired whenever a new Log entry is being added. If null, logging is disabled and messages are not built at all.
 		/// @param decryptionKey Relay's private asymmetric key.
 		/// @param broadcastKey Network's symmetric key.
 		Distributor(LoggerCallback callbackOnLog, Crypto::PrivateKey const& decryptionKey, Crypto::SymmetricKey const& broadcastKey);
 
+		/// Interprets the protocol of a decrypted packet and passes it to the proper handler.
+		/// @param unlockedPacket packet decrypted with the Network key.
+		/// @param sender a Channel that provided the packet.
+		/// @throws std::runtime_error.
+		void HandleUnlockedPacket(ByteView unlockedPacket, std::shared_ptr<DeviceBridge> const& sender);
+
 		/// Checks whether particular Agent is banned.
 		/// @param agentId ID of the Agent to check.
 		virtual bool IsAgentBanned(AgentId agentId);
@@ -54,38 +111,122 @@ namespace FSecure::C3::Core
 		/// Fired when a N2N protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		virtual void OnProtocolN2N(ByteView packet0, std::shared_ptr<DeviceBridge> sender);
+		virtual void OnProtocolN2N(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender);
 
 		/// Fired when a S2G protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		virtual void OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> sender) = 0;
+		virtual void OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) = 0;
 
 		/// Fired when a S2G protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		virtual void OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> sender) = 0;
+		virtual void OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) = 0;
 
 		/// Fired when a S2G protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		virtual void OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> sender) = 0;
+		virtual void OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) = 0;
+
+		/// Fired when a Multicast protocol packet arrives.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		virtual void OnProtocolMulticast(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) = 0;
+
+		/// Fired when a Striped protocol packet arrives.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		virtual void OnProtocolStriped(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) = 0;
+
+		/// Fired when an Envelope protocol packet arrives. Handles wrapped packets in order. Failure of one of them doesn't affect the others.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		/// @throws std::runtime_error if envelope is malformed.
+		virtual void OnProtocolEnvelope(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender);
+
+		/// Fired when a Fragmented protocol packet arrives. Handles the packet once all its fragments arrived.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a negotiation Channel that provided the packet.
+		/// @throws std::runtime_error if sender is not a negotiation Channel or packet is malformed.
+		virtual void OnProtocolFragmented(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender);
+
+		/// Fired when a Traced protocol packet arrives. Handles the wrapped packet with its trace context set.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		/// @throws std::runtime_error.
+		virtual void OnProtocolTraced(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender);
+
+		/// Fired when the wrapped packet of a Traced packet was handled without being sent further.
+		/// @param context trace context of the packet.
+		/// @param sender a Channel that provided the packet.
+		virtual void OnTracedPacketDelivered(TraceContext const& context, std::shared_ptr<DeviceBridge> const& sender);
+
+		/// Gets trace context of the packet handled by this thread.
+		/// @return trace context or null if the packet is not traced.
+		static TraceContext const* GetCurrentTrace();
 
 		/// Encrypts a packet with the Network key and sends it through specified Channel. This is the last function to be called for a completely built outgoing packet.
+		/// Encrypted packet is stored in a per-thread buffer, that is reused by subsequent calls. Traced packet that is passed further is wrapped again, with this Relay's hop appended.
 		/// @param packet plain-text packet to encrypt.
 		/// @param channel Interface used to send the packet.
 		/// @throws std::runtime_error.
-		virtual void LockAndSendPacket(ByteView packet, std::shared_ptr<DeviceBridge> channel);
+		virtual void LockAndSendPacket(ByteView packet, std::shared_ptr<DeviceBridge> const& channel);
+
+		/// Encrypts a packet with the Network key, the same way LockAndSendPacket does, without sending it.
+		/// @param packet plain-text packet to encrypt.
+		/// @param buffer storage of the encrypted packet.
+		/// @return traffic class of the packet. @see ClassifyPacket.
+		DeviceBridge::TrafficClass LockPacket(ByteView packet, ByteVector& buffer);
+
+		/// Splits a packet that doesn't fit in a frame of a negotiation Channel into Fragmented packets, locks and sends each of them. @see Fragment.
+		/// @param packet plain-text packet to send.
+		/// @param lockOverhead number of bytes that locking adds to a packet.
+		/// @param channel negotiation Channel used to send the packet.
+		/// @param trafficClass traffic class of the packet, used for all fragments.
+		/// @throws std::runtime_error if frame of the Channel is too small to carry any data.
+		void LockAndSendFragments(ByteView packet, size_t lockOverhead, std::shared_ptr<DeviceBridge> const& channel, DeviceBridge::TrafficClass trafficClass);
+
+		/// Reasons for dropping a received packet before it is parsed. Zero means success, so that it can be held by XError.
+		enum class UnlockError
+		{
+			Success = 0,																							///< Packet was decrypted.
+			EmptyPacket,																							///< Packet had no data.
+			Forged,																									///< Packet was too short, corrupted or encrypted with other Network key.
+		};
 
 		/// Decrypts a packet with the Network key. This is the first thing called before parsing a packet from a Channel (even before QOS).
+		/// Packets that can't be decrypted are everyday events on lossy and shared Channels, so they are reported without throwing.
 		/// @param packet encrypted packet to decrypt.
-		/// @return decrypted packet.
-		/// @throws std::runtime_error.
-		virtual ByteVector UnlockPacket(ByteView packet);
+		/// @param buffer storage for decrypted packet. Previous content is overwritten, but allocated memory is reused.
+		/// @param unlocked set to view on decrypted packet if it was decrypted.
+		/// @return UnlockError::Success or reason for dropping the packet.
+		virtual CppCommons::CppTools::XError<UnlockError> UnlockPacket(ByteView packet, ByteVector& buffer, ByteView& unlocked);
+
+		/// Logs why a packet was dropped. Message is built only if Error severity is logged.
+		/// @param error reason returned by UnlockPacket.
+		/// @param sender Channel that received the packet. Can be null.
+		void LogDroppedPacket(UnlockError error, std::shared_ptr<DeviceBridge> const& sender) noexcept;
+
+		/// Chooses priority class of a plain-text packet in outbound queues. N2N route setup and small packets are control traffic. Bodies of other protocols are encrypted, so size is the only hint left.
+		/// @param packet plain-text packet.
+		/// @return traffic class of the packet.
+		static DeviceBridge::TrafficClass ClassifyPacket(ByteView packet);
+
+		/// Makes every thread release capacity of its packet buffers on their next use, so that a burst of big packets doesn't keep the memory.
+		static void ReleaseThreadBuffers() noexcept;
 
 	protected:
-		LoggerCallback m_CallbackOnLog;																					///< Callback fired whenever a new Log entry is being added.
+		/// Packets up to this size are control traffic, e.g. Ping, CreateRoute and most commands and their responses.
+		static constexpr std::size_t s_ControlPacketSize = 1024;
+
+		LogPipeline m_LogPipeline;																						///< Passes Log entries to the callback on a background thread.
 		Crypto::SymmetricKey m_BroadcastKey;																			///< Network key.
 		Crypto::PrivateKey m_DecryptionKey;																				///< Own key used to decrypt messages addressed to me.
+		std::atomic<std::uint64_t> m_LockedPacketsCount = 0;															///< Number of packets encrypted with the Network key.
+		std::atomic<std::uint64_t> m_UnlockedPacketsCount = 0;															///< Number of packets decrypted with the Network key.
+		std::atomic<Crypto::AeadSuite> m_BroadcastSuite = Crypto::AeadSuite::XSalsa20Poly1305;							///< Algorithm used to encrypt packets with the Network key.
+		std::atomic_bool m_IsBroadcastSuitePinned = false;																///< Set by SetBroadcastSuite. Stops adopting algorithm of received packets.
+		std::mutex m_FragmentedPacketsMutex;																			///< Guards m_FragmentedPackets.
+		QualityOfService m_FragmentedPackets;																			///< Reassembles Fragmented packets coming through all negotiation Channels.
 	};
 }
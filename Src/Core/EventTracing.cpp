@@ -0,0 +1,71 @@
+#include "StdAfx.h"
+#include "EventTracing.h"
+
+#ifdef C3_EVENT_TRACING
+#include <TraceLoggingProvider.h>
+
+// {449429DA-C125-470C-AB06-D06D32F12A44}
+TRACELOGGING_DEFINE_PROVIDER(g_C3TraceLoggingProvider, "FSecure.C3", (0x449429da, 0xc125, 0x470c, 0xab, 0x06, 0xd0, 0x6d, 0x32, 0xf1, 0x2a, 0x44));
+
+namespace
+{
+	/// Registers provider for the lifetime of the process.
+	struct ProviderRegistration
+	{
+		/// Register provider. Sessions can enable it from now on.
+		ProviderRegistration()
+		{
+			TraceLoggingRegister(g_C3TraceLoggingProvider);
+		}
+
+		/// Unregister provider.
+		~ProviderRegistration()
+		{
+			TraceLoggingUnregister(g_C3TraceLoggingProvider);
+		}
+	} g_ProviderRegistration;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <FSecure::C3::Core::EventTracing::Keyword keyword>
+FSecure::C3::Core::EventTracing::Scope<keyword>::Scope(char const* name, std::uint64_t size) noexcept
+{
+	if (!TraceLoggingProviderEnabled(g_C3TraceLoggingProvider, WINEVENT_LEVEL_VERBOSE, static_cast<ULONGLONG>(keyword)))
+		return;
+
+	// New activity becomes the thread's current one, so that events of nested scopes point at it as their parent.
+	if (EventActivityIdControl(EVENT_ACTIVITY_CTRL_CREATE_ID, &m_ActivityId) != ERROR_SUCCESS)
+		return;
+
+	m_ParentActivityId = m_ActivityId;
+	EventActivityIdControl(EVENT_ACTIVITY_CTRL_GET_SET_ID, &m_ParentActivityId);
+
+	m_Name = name;
+	TraceLoggingWriteActivity(g_C3TraceLoggingProvider, "Operation", &m_ActivityId, &m_ParentActivityId,
+		TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(static_cast<ULONGLONG>(keyword)), TraceLoggingOpcode(WINEVENT_OPCODE_START),
+		TraceLoggingString(name, "Name"), TraceLoggingUInt64(size, "Size"));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <FSecure::C3::Core::EventTracing::Keyword keyword>
+FSecure::C3::Core::EventTracing::Scope<keyword>::~Scope()
+{
+	if (!m_Name)
+		return;
+
+	// Stop event is written even if the session stopped listening in the meantime. ETW drops it then.
+	TraceLoggingWriteActivity(g_C3TraceLoggingProvider, "Operation", &m_ActivityId, nullptr,
+		TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(static_cast<ULONGLONG>(keyword)), TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+		TraceLoggingString(m_Name, "Name"));
+
+	EventActivityIdControl(EVENT_ACTIVITY_CTRL_SET_ID, &m_ParentActivityId);
+}
+
+// Scopes of every keyword.
+template class FSecure::C3::Core::EventTracing::Scope<FSecure::C3::Core::EventTracing::Keyword::Packets>;
+template class FSecure::C3::Core::EventTracing::Scope<FSecure::C3::Core::EventTracing::Keyword::QualityOfService>;
+template class FSecure::C3::Core::EventTracing::Scope<FSecure::C3::Core::EventTracing::Keyword::Crypto>;
+template class FSecure::C3::Core::EventTracing::Scope<FSecure::C3::Core::EventTracing::Keyword::Devices>;
+template class FSecure::C3::Core::EventTracing::Scope<FSecure::C3::Core::EventTracing::Keyword::Gateway>;
+template class FSecure::C3::Core::EventTracing::Scope<FSecure::C3::Core::EventTracing::Keyword::Locks>;
+#endif
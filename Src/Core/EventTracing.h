@@ -0,0 +1,48 @@
+#pragma once
+
+namespace FSecure::C3::Core::EventTracing
+{
+	/// Groups of events. ETW sessions choose groups they listen to with provider keywords.
+	enum class Keyword : std::uint64_t
+	{
+		Packets = 0x1,																									///< Packets handled and sent by Relays.
+		QualityOfService = 0x2,																							///< Chunking and reassembly of packets.
+		Crypto = 0x4,																									///< Encryption and decryption of packets.
+		Devices = 0x8,																									///< Updates of Devices.
+		Gateway = 0x10,																									///< Profile snapshots and API bridge messages.
+		Locks = 0x20,																									///< Contended acquisitions of profiled mutexes. Written only while lock profiling is on.
+	};
+
+	/// Operation timed with ETW. Start event is written when scope is created and stop event when it is destroyed.
+	/// Every scope gets its own activity, a child of the thread's current one. Thread's events in the meantime belong to it, so WPA can show per-packet timelines and nested timings.
+	/// Provider "FSecure.C3" is only compiled in if C3_EVENT_TRACING is defined. Otherwise scopes are empty. If no session listens to the keyword, a scope costs one check.
+	/// @tparam keyword group of the events. Must be known at compile time, as it is a part of event's metadata.
+	template <Keyword keyword>
+	class Scope
+	{
+	public:
+#ifdef C3_EVENT_TRACING
+		/// Start operation.
+		/// @param name of the operation. Must outlive the scope, e.g. a string literal.
+		/// @param size number of bytes processed by the operation, zero if not applicable.
+		Scope(char const* name, std::uint64_t size = 0) noexcept;
+
+		/// Stop operation.
+		~Scope();
+#else
+		/// Tracing is not compiled in.
+		Scope(char const*, std::uint64_t = 0) noexcept {}
+#endif
+
+		/// Scopes are bound to the thread's stack.
+		Scope(Scope const&) = delete;
+		Scope& operator=(Scope const&) = delete;
+
+#ifdef C3_EVENT_TRACING
+	private:
+		char const* m_Name = nullptr;																					///< Name of the operation. Null if no session listened when scope was started.
+		GUID m_ActivityId;																								///< Activity of the operation.
+		GUID m_ParentActivityId;																						///< Activity of the thread before the operation started.
+#endif
+	};
+}
@@ -4,15 +4,102 @@
 #include "DeviceBridge.h"
 #include "Common/FSecure/Sockets/SocketsException.h"
 #include "ConnectorBridge.h"
+#include "ConnectorHost.h"
+#include "MetricsEndpoint.h"
+#include "JsonObjectView.h"
+#include "EventTracing.h"
+#include "AllocationTracking.h"
+#include "Common/FSecure/CppTools/ScopeGuard.h"
+#include "Common/FSecure/CppTools/Compression.h"
+
+namespace
+{
+	/// Time of queuing the Controller's message handled by this thread. Empty if thread doesn't handle one.
+	thread_local std::optional<std::chrono::steady_clock::time_point> g_MessageQueuedAt;
+
+	/// Command packets with Channels they are sent through.
+	using DeferredCommands = std::vector<std::pair<FSecure::ByteVector, std::shared_ptr<FSecure::C3::Core::DeviceBridge>>>;
+
+	/// Command packets collected by SendCommandsInParallel running on this thread. Null if sends are not deferred.
+	thread_local DeferredCommands* g_DeferredCommands = nullptr;
+
+	/// Commands to one Agent collected by SendCommandsInParallel, in order of sending.
+	struct AgentCommands
+	{
+		FSecure::C3::RouteId m_RouteId;																					///< Route of the first command.
+		FSecure::Crypto::SharedKey m_SharedKey;																			///< Key shared with the Agent.
+		std::shared_ptr<FSecure::C3::Core::DeviceBridge> m_Channel;														///< Channel of the Route.
+		std::vector<FSecure::ByteVector> m_Commands;																	///< Sub-commands of RunCommandsOnAgentQuery.
+	};
+
+	/// Commands collected by SendCommandsInParallel running on this thread, by recipient. Null if commands are not packed together.
+	thread_local std::map<FSecure::C3::AgentId, AgentCommands>* g_DeferredAgentCommands = nullptr;
+
+	/// Encrypted and decrypted body of the S2G packet handled by this thread. Lets query handlers skip decrypting the body again.
+	thread_local std::pair<FSecure::ByteView, FSecure::ByteView> g_DecryptedS2G;
+
+	/// Wrap G2A packets sent through the same Channel in Multicast envelopes.
+	/// @param commands packets to wrap. Packets of other protocols, including traced ones, are left as they are.
+	/// @return packets to send.
+	DeferredCommands WrapInMulticasts(DeferredCommands commands)
+	{
+		using namespace FSecure::C3::Core;
+		using ProceduresG2X::Multicast;
+
+		DeferredCommands ret;
+		std::map<std::shared_ptr<DeviceBridge>, std::vector<FSecure::ByteView>> branches;
+		for (auto& command : commands)
+			if (static_cast<Protocols>(command.first[0]) == Protocols::G2A)
+				branches[command.second].emplace_back(command.first);
+			else
+				ret.push_back(std::move(command));
+
+		for (auto const& [channel, packets] : branches)
+			for (size_t i = 0; i < packets.size(); i += Multicast::s_MaxPackets)
+			{
+				auto count = std::min(packets.size() - i, Multicast::s_MaxPackets);
+				ret.emplace_back(count == 1 ? FSecure::ByteVector{ packets[i] } : Multicast::Wrap(std::vector<FSecure::ByteView>(packets.begin() + i, packets.begin() + i + count)), channel);
+			}
+
+		return ret;
+	}
+
+	/// Convert duration to milliseconds reported in the Profile.
+	/// @param duration duration to convert.
+	/// @return fractional number of milliseconds.
+	double ToReportedMilliseconds(std::chrono::microseconds duration)
+	{
+		return std::chrono::duration<double, std::milli>{ duration }.count();
+	}
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::Core::GateRelay> FSecure::C3::Core::GateRelay::CreateAndRun(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory,
 	std::string_view apiBridgeIp, std::uint16_t apiBrigdePort, FSecure::Crypto::SignatureKeys const& signatures, FSecure::Crypto::SymmetricKey const& broadcastKey,
-	FSecure::C3::BuildId buildId, std::filesystem::path snapshotPath, FSecure::C3::AgentId agentId /*= FSecure::C3::AgentId::GenerateRandom()*/, std::string name /*= ""*/)
+	FSecure::C3::BuildId buildId, std::filesystem::path snapshotPath, FSecure::C3::AgentId agentId /*= FSecure::C3::AgentId::GenerateRandom()*/, std::string name /*= ""*/, GatewayWorkerPools const& workerPools /*= {}*/,
+	QualityOfService::Settings const& qosSettings /*= {}*/, std::chrono::milliseconds lastSeenFlushInterval /*= s_DefaultLastSeenFlushInterval*/, bool reportDeviceMetrics /*= false*/,
+	std::string const& metricsEndpoint /*= ""*/)
 {
 	// Create GateRelay.
-	auto gateNode = std::shared_ptr<GateRelay>{ new GateRelay(callbackOnLog, interfaceFactory, apiBridgeIp, apiBrigdePort, signatures, broadcastKey, buildId, std::move(snapshotPath), agentId) };
+	auto gateNode = std::shared_ptr<GateRelay>{ new GateRelay(callbackOnLog, interfaceFactory, apiBridgeIp, apiBrigdePort, signatures, broadcastKey, buildId, std::move(snapshotPath), agentId, workerPools, qosSettings, lastSeenFlushInterval, reportDeviceMetrics) };
 	gateNode->m_Profiler->Initialize(std::move(name), gateNode);
+
+	// Metrics are optional, so Gateway runs even if the endpoint can't be opened.
+	if (!metricsEndpoint.empty())
+		try
+		{
+			gateNode->m_MetricsEndpoint = std::make_shared<MetricsEndpoint>(metricsEndpoint, [weakGateway = std::weak_ptr<GateRelay>{ gateNode }]
+			{
+				auto gateway = weakGateway.lock();
+				return gateway ? gateway->CollectMetrics() : std::string{};
+			});
+			gateNode->Log({ "Serving metrics on " + metricsEndpoint, FSecure::C3::LogMessage::Severity::Information });
+		}
+		catch (std::exception& exception)
+		{
+			gateNode->Log({ exception.what(), FSecure::C3::LogMessage::Severity::Error });
+		}
+
 	// Start API bridge.
 	gateNode->Log({ "Starting API bridge on " + std::string{ apiBridgeIp } + ":" + std::to_string(apiBrigdePort), FSecure::C3::LogMessage::Severity::Information });
 	std::thread([self = gateNode, controllerIp = std::string{ apiBridgeIp }, apiBrigdePort]() mutable { self->RunApiBrige(controllerIp, apiBrigdePort); }).detach();
@@ -23,36 +110,139 @@ std::shared_ptr<FSecure::C3::Core::GateRelay> FSecure::C3::Core::GateRelay::Crea
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::GateRelay::GateRelay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, std::string_view selfIp, std::uint16_t apiBrigdePort,
-	FSecure::Crypto::SignatureKeys const& signatures, FSecure::Crypto::SymmetricKey const& broadcastKey, FSecure::C3::BuildId buildId, std::filesystem::path snapshotPath, FSecure::C3::AgentId agentId)
-	: Relay(callbackOnLog, interfaceFactory, Crypto::ConvertToKey(signatures.first), broadcastKey, buildId, agentId)
+	FSecure::Crypto::SignatureKeys const& signatures, FSecure::Crypto::SymmetricKey const& broadcastKey, FSecure::C3::BuildId buildId, std::filesystem::path snapshotPath, FSecure::C3::AgentId agentId,
+	GatewayWorkerPools const& workerPools, QualityOfService::Settings const& qosSettings, std::chrono::milliseconds lastSeenFlushInterval, bool reportDeviceMetrics)
+	: Relay(callbackOnLog, interfaceFactory, Crypto::ConvertToKey(signatures.first), broadcastKey, buildId, agentId, workerPools.m_Devices.m_WorkerCount ? Scheduler::Create(workerPools.m_Devices) : nullptr, qosSettings)
+	, m_Connectors{ "GateRelay::m_Connectors" }
 	, m_AuthenticationKey{ Crypto::ConvertToKey(signatures.second) }
 	, m_Signature{ signatures.first }
-	, m_Profiler(std::make_shared<Profiler>(std::move(snapshotPath)))
+	, m_Profiler(std::make_shared<Profiler>(std::move(snapshotPath), lastSeenFlushInterval, reportDeviceMetrics))
+	, m_ApiBridgeExecutor(TaskExecutor::Create(workerPools.m_ApiBridge))
+	, m_NegotiationExecutor(TaskExecutor::Create(workerPools.m_Negotiation))
+	, m_ConnectorStartupExecutor(TaskExecutor::Create(workerPools.m_ConnectorStartup))
 {
+	// Scheduler was created for this Gateway, so it's stopped with it.
+	m_OwnsScheduler = true;
 	Log({ "Gateway launched.", FSecure::C3::LogMessage::Severity::Information });
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 bool FSecure::C3::Core::GateRelay::IsAgentBanned(AgentId agentId)
 {
-	if (auto agent = m_Profiler->Get().m_Gateway.m_Agents.Find(agentId))
-		return agent->m_IsBanned;
+	if (auto bannedAgents = std::atomic_load(&m_BannedAgents); bannedAgents && bannedAgents->count(agentId.ToUnderlyingType()))
+		return true;
 
 	return __super::IsAgentBanned(agentId);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::GateRelay::OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> sender)
+void FSecure::C3::Core::GateRelay::OnPacketsReceived(std::vector<ByteView> const& packets, std::shared_ptr<DeviceBridge> const& sender)
+{
+	if (packets.size() < 2)
+		return Relay::OnPacketsReceived(packets, sender);
+
+	/// State of a packet between parallel and sequential phases.
+	struct Item
+	{
+		ByteView m_Packet;																							///< Packet as received from Channel.
+		ByteVector m_Buffer;																						///< Storage of unlocked packet.
+		ByteView m_Unlocked;																						///< Unlocked packet.
+		ByteVector m_DecryptedS2G;																					///< Decrypted body of S2G packet. Empty for other protocols.
+		UnlockError m_UnlockError = UnlockError::Success;															///< Reason for dropping the packet.
+		std::exception_ptr m_Error;																					///< Failure of parallel phase.
+	};
+
+	std::vector<Item> items(packets.size());
+	for (size_t i = 0; i < packets.size(); ++i)
+		items[i].m_Packet = packets[i];
+
+	// Unlock packets and decrypt bodies of S2G ones in parallel. Decryption failures are left for sequential phase to report.
+	std::for_each(std::execution::par, items.begin(), items.end(), [this](Item& item)
+	{
+		try
+		{
+			if (item.m_UnlockError = UnlockPacket(item.m_Packet, item.m_Buffer, item.m_Unlocked); item.m_UnlockError != UnlockError::Success)
+				return;
+
+			if (!item.m_Unlocked.empty() && static_cast<Protocols>(item.m_Unlocked[0]) == Protocols::S2G)
+				item.m_DecryptedS2G = DecryptS2G(item.m_Unlocked.SubString(1));
+		}
+		catch (std::exception&)
+		{
+			if (item.m_Unlocked.empty())
+				item.m_Error = std::current_exception();
+		}
+	});
+
+	// Handle packets in order of arrival.
+	for (auto& item : items)
+	{
+		SCOPE_GUARD(
+			FSecure::Utils::SecureMemzero(item.m_Buffer.data(), item.m_Buffer.size());
+			FSecure::Utils::SecureMemzero(item.m_DecryptedS2G.data(), item.m_DecryptedS2G.size());
+		);
+		try
+		{
+			if (item.m_UnlockError != UnlockError::Success)
+			{
+				LogDroppedPacket(item.m_UnlockError, sender);
+				continue;
+			}
+
+			if (item.m_Error)
+				std::rethrow_exception(item.m_Error);
+
+			if (item.m_DecryptedS2G.empty())
+				HandleUnlockedPacket(item.m_Unlocked, sender);
+			else
+				HandleS2G(item.m_Unlocked, item.m_DecryptedS2G, sender);
+		}
+		catch (std::runtime_error& e)
+		{
+			Log(LogMessage::Severity::Error, [&] { return "Packet handling failure. "s + e.what(); }, sender ? sender->GetDid() : DeviceId{});
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	HandleS2G(packet0, {}, sender);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::HandleS2G(ByteView packet0, ByteView decrypted, std::shared_ptr<DeviceBridge> const& sender)
 {
 	try
 	{
+		auto whole = packet0;
 		packet0.remove_prefix(1);
-		auto decrypted = FSecure::Crypto::DecryptFromAnonymous(packet0, m_AuthenticationKey, m_DecryptionKey);
+		ByteVector buffer;
+		SCOPE_GUARD( FSecure::Utils::SecureMemzero(buffer.data(), buffer.size()); );
+		if (decrypted.empty())
+		{
+			buffer = DecryptS2G(packet0);
+			decrypted = buffer;
+		}
+
 		auto [procedure, rid, timestamp] = ByteView{ decrypted }.Read<ProceduresUnderlyingType, RouteId, int32_t>();
-		if (!m_Profiler->Get().m_Gateway.ConnectionExist(rid.GetAgentId()))
-			throw std::runtime_error{ "S2G packet received from not connected source." };
+		if (!IsAgentConnected(rid.GetAgentId()))
+		{
+			// Agent might be known to the snapshot which is still restored. Check again if restoring has just finished.
+			if (DeferS2GPacket(whole, sender))
+				return;
+
+			if (!IsAgentConnected(rid.GetAgentId()))
+				throw std::runtime_error{ "S2G packet received from not connected source." };
+		}
 
+		auto previous = std::exchange(g_DecryptedS2G, { packet0, decrypted });
+		SCOPE_GUARD( g_DecryptedS2G = previous; );
 		ProceduresS2G::RequestHandler::ParseRequestAndHandleIt(sender, procedure, rid, timestamp, packet0);
+
+		// Agent that was unreachable checked in. Commands sent meanwhile follow the Route its packet came through.
+		if (m_AgentsWithQueuedCommands.load(std::memory_order_relaxed))
+			FlushQueuedAgentCommands(rid.GetAgentId());
 	}
 	catch (std::exception& exception)
 	{
@@ -61,54 +251,593 @@ void FSecure::C3::Core::GateRelay::OnProtocolS2G(ByteView packet0, std::shared_p
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::GateRelay::OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> sender)
+FSecure::ByteVector FSecure::C3::Core::GateRelay::DecryptS2G(ByteView body)
+{
+	if (!g_DecryptedS2G.second.empty() && body == g_DecryptedS2G.first)
+		return g_DecryptedS2G.second;
+
+	EventTracing::Scope<EventTracing::Keyword::Crypto> tracingScope{ "GateRelay::DecryptS2G", body.size() };
+	AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::Crypto };
+	auto decrypted = FSecure::Crypto::DecryptFromAnonymous(body, m_AuthenticationKey, m_DecryptionKey);
+	m_DecryptedS2GPacketsCount.fetch_add(1, std::memory_order_relaxed);
+	return decrypted;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::GateRelay::DeferS2GPacket(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	std::lock_guard lock{ m_DeferredS2GPacketsMutex };
+	if (m_IsProfileRestored || m_DeferredS2GPackets.size() >= s_MaxDeferredS2GPackets)
+		return false;
+
+	m_DeferredS2GPackets.emplace_back(packet0, sender);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::OnProfileRestored()
+{
+	decltype(m_DeferredS2GPackets) packets;
+	{
+		std::lock_guard lock{ m_DeferredS2GPacketsMutex };
+		m_IsProfileRestored = true;
+		packets.swap(m_DeferredS2GPackets);
+	}
+
+	if (!packets.empty())
+		Log({ "Handling " + std::to_string(packets.size()) + " S2G packets received while restoring snapshot.", FSecure::C3::LogMessage::Severity::Information });
+
+	for (auto& [packet, weakSender] : packets)
+		try
+		{
+			auto sender = weakSender.lock();
+			HandleS2G(packet, {}, sender);
+		}
+		catch (std::exception& exception)
+		{
+			Log({ "Packet handling failure. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+		}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
 {
 	throw std::runtime_error{ "G2A packet received from Channel: " + sender->GetDid().ToString() + "." };
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::GateRelay::OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> sender)
+void FSecure::C3::Core::GateRelay::OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
 {
 	throw std::runtime_error{ "G2R packet received from Channel: " + sender->GetDid().ToString() + "." };
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::GateRelay::PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> senderPeripheral)
+void FSecure::C3::Core::GateRelay::OnProtocolMulticast(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	throw std::runtime_error{ "Multicast packet received from Channel: " + sender->GetDid().ToString() + "." };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::OnProtocolStriped(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	std::vector<ByteVector> packets;
+	{
+		std::lock_guard lock{ m_StripedPacketsMutex };
+		m_StripedPackets.PushReceivedChunk(packet0.SubString(1));
+		for (auto packet = m_StripedPackets.GetNextPacket(); !packet.empty(); packet = m_StripedPackets.GetNextPacket())
+			packets.push_back(std::move(packet));
+	}
+
+	for (auto const& packet : packets)
+	{
+		if (static_cast<Protocols>(packet[0]) != Protocols::S2G)
+			throw std::runtime_error{ "Striped packet doesn't carry a S2G packet." };
+
+		OnProtocolS2G(packet, sender);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> const& senderPeripheral)
 {
 	auto connectorHash = InterfaceFactory::Instance().Find<AbstractPeripheral>(senderPeripheral->GetTypeNameHash())->second.m_ClousureConnectorHash;
-	auto connector = m_Connectors.Find([&](auto const& e) { return e->GetNameHash() == connectorHash; });
+	auto connector = GetConnector(connectorHash);
 	if (!connector)
 		throw std::runtime_error{ "Connector not found" };
 
 	connector->OnCommandFromBinder(ByteVector::Create(RouteId{ GetAgentId(), senderPeripheral->GetDid() }), command);
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::PostCommandSegmentToConnector(ByteView segment, BinderSegment const& position, std::shared_ptr<DeviceBridge> const& senderPeripheral)
+{
+	if (auto command = CollectCommandSegment(RouteId{ GetAgentId(), senderPeripheral->GetDid() }, position, segment))
+		PostCommandToConnector(*command, senderPeripheral);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ByteVector> FSecure::C3::Core::GateRelay::CollectCommandSegment(RouteId binder, BinderSegment const& position, ByteView segment)
+{
+	if (position.m_Offset > position.m_MessageSize || segment.size() > position.m_MessageSize - position.m_Offset)
+		throw std::runtime_error{ "Segment exceeds streamed command." };
+
+	auto now = std::chrono::steady_clock::now();
+	std::scoped_lock lock(m_StreamedCommandsMutex);
+
+	// Forget commands of Peripherals that stopped streaming them.
+	for (auto it = m_StreamedCommands.begin(); it != m_StreamedCommands.end();)
+		if (now - it->second.m_LastSegmentAt > s_StreamedCommandTimeout)
+		{
+			m_StreamedCommandsSize -= it->second.m_Command.size();
+			it = m_StreamedCommands.erase(it);
+		}
+		else
+			++it;
+
+	auto key = std::pair{ binder, position.m_MessageId };
+	auto it = m_StreamedCommands.find(key);
+	if (it == m_StreamedCommands.end())
+	{
+		if (m_StreamedCommandsSize + position.m_MessageSize > s_MaxStreamedCommandsSize)
+			throw std::runtime_error{ "Too many streamed commands are being reassembled." };
+
+		it = m_StreamedCommands.emplace(key, StreamedCommand{ ByteVector(position.m_MessageSize) }).first;
+		m_StreamedCommandsSize += position.m_MessageSize;
+	}
+	else if (it->second.m_Command.size() != position.m_MessageSize)
+		throw std::runtime_error{ "Segment doesn't match streamed command." };
+
+	auto& streamed = it->second;
+	streamed.m_LastSegmentAt = now;
+	if (!streamed.m_Segments.emplace(position.m_Offset, static_cast<std::uint32_t>(segment.size())).second)
+		return {};
+
+	std::copy(segment.begin(), segment.end(), streamed.m_Command.begin() + position.m_Offset);
+	streamed.m_ReceivedSize += static_cast<std::uint32_t>(segment.size());
+	if (streamed.m_ReceivedSize < position.m_MessageSize)
+		return {};
+
+	auto command = std::move(streamed.m_Command);
+	m_StreamedCommandsSize -= command.size();
+	m_StreamedCommands.erase(it);
+	return command;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::PostCommandToPeripheral(ByteView command, RouteId routeId)
 {
+	auto receivedAt = std::chrono::steady_clock::now();
+
  	// Check if Peripheral is attached to Gateway.
 	if (routeId.GetAgentId() == GetAgentId())
 	{
- 		if (auto peripheral = m_Devices.Find([&](auto const& e) {auto sp = e.lock(); return sp &&  sp->GetDid() == routeId.GetInterfaceId(); }).lock(); peripheral)
+ 		if (auto peripheral = FindDevice(routeId.GetInterfaceId()); peripheral)
  			return peripheral->OnCommandFromConnector(command);
  		else
  			throw std::runtime_error{ "Couldn't find Gateway's recipient Peripheral." };
 	}
 
-	auto route = FindRoute(routeId.GetAgentId());
+	auto context = GetDeliveryContext(routeId.GetAgentId());
+	auto device = context.m_Channel.lock();
+	if (!device)
+		return QueueAgentCommand(routeId.GetAgentId(), { routeId.GetInterfaceId(), ByteVector{ command }, true });
+
+	auto query = ProceduresG2X::DeliverToBinder::Create(context.m_RouteId, m_Signature, context.m_SharedKey, routeId.GetInterfaceId(), command);
+	SendCommandPacket(query.ComposeQueryPacket(), routeId.GetAgentId(), device, receivedAt);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::GateRelay::CanPostCommandToPeripheral(RouteId routeId)
+{
+	if (routeId.GetAgentId() == GetAgentId())
+		return true;
+
+	try
+	{
+		auto channel = GetDeliveryContext(routeId.GetAgentId()).m_Channel.lock();
+		return !channel || channel->GetOutboundCredits();
+	}
+	catch (std::exception const&)
+	{
+		return true;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::GateRelay::DeliveryContext FSecure::C3::Core::GateRelay::GetDeliveryContext(AgentId agentId)
+{
+	// Version is read before the Route, so a Route change that happens meanwhile outdates the context made here.
+	auto routesVersion = GetRoutesVersion();
+	std::uint64_t epoch;
+	{
+		std::lock_guard lock{ m_DeliveryContextsMutex };
+		if (auto it = m_DeliveryContexts.find(agentId.ToUnderlyingType()); it != m_DeliveryContexts.end() && it->second.m_RoutesVersion == routesVersion)
+			return it->second;
+
+		epoch = m_DeliveryContextsEpoch;
+	}
+
+	// Preferred Route is used only while it exists, any other Route to the Agent is used otherwise.
+	std::shared_ptr<RouteManager::Route> route;
+	if (auto preferredRoutes = std::atomic_load(&m_PreferredRoutes))
+		if (auto it = preferredRoutes->find(agentId.ToUnderlyingType()); it != preferredRoutes->end())
+			route = FindRoute(it->second);
+
 	if (!route)
-		throw std::runtime_error{ "Unknown route." };
+		route = FindRoute(agentId);
 
-	auto device = route->m_Channel.lock();
-	if (!device)
-		throw std::runtime_error{ "Route was unexpectedly closed." };
+	auto context = [&]
+	{
+		auto agent = m_Profiler->GetAgent(agentId);
+		if (!agent)
+			throw std::runtime_error{ "Unknown agent." };
 
-	auto agent = m_Profiler->Get().m_Gateway.m_Agents.Find(routeId.GetAgentId());
-	if (!agent)
-		throw std::runtime_error{ "Unknown agent." };
+		if (!route)
+			return DeliveryContext{ routesVersion, RouteId::Null, {}, agent->m_SharedKey };
+
+		return DeliveryContext{ routesVersion, route->m_RouteId, route->m_Channel, agent->m_SharedKey };
+	}();
+
+	std::lock_guard lock{ m_DeliveryContextsMutex };
+	if (epoch == m_DeliveryContextsEpoch)
+		m_DeliveryContexts.insert_or_assign(agentId.ToUnderlyingType(), context);
+
+	return context;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::InvalidateDeliveryContexts()
+{
+	std::lock_guard lock{ m_DeliveryContextsMutex };
+	m_DeliveryContexts.clear();
+	++m_DeliveryContextsEpoch;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::GateRelay::IsAgentConnected(AgentId agentId)
+{
+	// Version is read before the Profile, so a Route change that happens meanwhile outdates the answer made here.
+	auto routesVersion = GetRoutesVersion();
+	std::uint64_t epoch;
+	{
+		std::lock_guard lock{ m_ConnectedAgentsMutex };
+		if (m_ConnectedAgentsRoutesVersion != routesVersion)
+		{
+			m_ConnectedAgents.clear();
+			m_ConnectedAgentsRoutesVersion = routesVersion;
+			++m_ConnectedAgentsEpoch;
+		}
+		else if (m_ConnectedAgents.count(agentId.ToUnderlyingType()))
+		{
+			return true;
+		}
+
+		epoch = m_ConnectedAgentsEpoch;
+	}
+
+	if (!m_Profiler->Get().m_Gateway.ConnectionExist(agentId))
+		return false;
+
+	std::lock_guard lock{ m_ConnectedAgentsMutex };
+	if (epoch == m_ConnectedAgentsEpoch && routesVersion == m_ConnectedAgentsRoutesVersion)
+		m_ConnectedAgents.insert(agentId.ToUnderlyingType());
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::InvalidateConnectedAgents()
+{
+	std::lock_guard lock{ m_ConnectedAgentsMutex };
+	m_ConnectedAgents.clear();
+	++m_ConnectedAgentsEpoch;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SetBannedAgents(std::unordered_set<AgentId::UnderlyingIntegerType> bannedAgents)
+{
+	std::atomic_store(&m_BannedAgents, std::shared_ptr<const std::unordered_set<AgentId::UnderlyingIntegerType>>{ std::make_shared<std::unordered_set<AgentId::UnderlyingIntegerType>>(std::move(bannedAgents)) });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SetCommandTracingInterval(std::uint32_t interval)
+{
+	m_CommandTracingInterval = interval;
+	Log({ interval ? "Tracing every " + std::to_string(interval) + ". command sent to Agents." : "Command tracing turned off.", FSecure::C3::LogMessage::Severity::Information });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SetMulticast(bool isEnabled)
+{
+	m_IsMulticastEnabled = isEnabled;
+	Log({ isEnabled ? "Commands sharing the first hop are sent in Multicast envelopes." : "Multicast turned off.", FSecure::C3::LogMessage::Severity::Information });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SetCompoundCommands(bool isEnabled)
+{
+	m_AreCompoundCommandsEnabled = isEnabled;
+	Log({ isEnabled ? "Commands composed together for one Agent are sent in one query." : "Compound commands turned off.", FSecure::C3::LogMessage::Severity::Information });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SetOutOfProcessConnectors(bool isEnabled)
+{
+	m_AreConnectorsOutOfProcess = isEnabled;
+	Log({ isEnabled ? "Connectors are hosted in separate processes." : "Connectors run inside Gateway process.", FSecure::C3::LogMessage::Severity::Information });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SetRoutePreference(RoutePreference preference)
+{
+	m_RoutePreference = preference;
+	switch (preference)
+	{
+	case RoutePreference::Latency:
+		Log({ "Commands are sent through Routes with the lowest latency.", FSecure::C3::LogMessage::Severity::Information });
+		break;
+	case RoutePreference::Bandwidth:
+		Log({ "Commands are sent through Routes with the highest throughput.", FSecure::C3::LogMessage::Severity::Information });
+		break;
+	default:
+		Log({ "Route preference turned off. Recommended Routes are only reported.", FSecure::C3::LogMessage::Severity::Information });
+		break;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::GateRelay::RoutePreference FSecure::C3::Core::GateRelay::GetRoutePreference() const
+{
+	return m_RoutePreference;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SetPreferredRoutes(std::unordered_map<AgentId::UnderlyingIntegerType, RouteId> preferredRoutes)
+{
+	// Cached delivery contexts hold the Routes chosen before, so they are dropped only if the choice has changed.
+	if (auto current = std::atomic_load(&m_PreferredRoutes); current ? *current == preferredRoutes : preferredRoutes.empty())
+		return;
+
+	std::atomic_store(&m_PreferredRoutes, std::shared_ptr<const std::unordered_map<AgentId::UnderlyingIntegerType, RouteId>>{ std::make_shared<std::unordered_map<AgentId::UnderlyingIntegerType, RouteId>>(std::move(preferredRoutes)) });
+	InvalidateDeliveryContexts();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SendCommandPacket(ByteView packet, AgentId agentId, std::shared_ptr<DeviceBridge> const& channel, std::optional<std::chrono::steady_clock::time_point> receivedAt)
+{
+	auto send = [&](ByteView packet)
+	{
+		if (g_DeferredCommands)
+			g_DeferredCommands->emplace_back(packet, channel);
+		else
+			LockAndSendPacket(packet, channel);
+	};
+
+	auto interval = m_CommandTracingInterval.load();
+	if (!interval || m_CommandsCount++ % interval)
+		return send(packet);
+
+	auto traceId = ++m_LastTraceId;
+	{
+		std::lock_guard lock{ m_CommandTracingMutex };
+
+		// Forget traces of commands that were lost or are handled by Relays that don't support tracing.
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = m_PendingTraces.begin(); it != m_PendingTraces.end();)
+			if (now - it->second.m_SentAt > s_TraceTimeout)
+			{
+				it = m_PendingTraces.erase(it);
+				++m_ExpiredTraces;
+			}
+			else
+				++it;
+
+		if (m_PendingTraces.size() >= s_MaxPendingTraces)
+			return send(packet);
+
+		auto gatewayTime = std::chrono::duration_cast<std::chrono::microseconds>(now - receivedAt.value_or(g_MessageQueuedAt.value_or(now)));
+		m_PendingTraces[traceId] = { agentId, now, gatewayTime };
+	}
+
+	send(TraceContext::Wrap(traceId, {}, packet));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SendAgentCommand(RouteId routeId, Crypto::SharedKey const& sharedKey, ByteView commandWithArguments, std::shared_ptr<DeviceBridge> const& channel, std::optional<DeviceId> deviceId)
+{
+	if (g_DeferredAgentCommands)
+	{
+		using ProceduresG2X::RunCommandsOnAgentQuery;
+		auto& commands = g_DeferredAgentCommands->try_emplace(routeId.GetAgentId(), AgentCommands{ routeId, sharedKey, channel }).first->second;
+		commands.m_Commands.push_back(deviceId ? RunCommandsOnAgentQuery::ComposeDeviceCommand(*deviceId, commandWithArguments) : RunCommandsOnAgentQuery::ComposeAgentCommand(commandWithArguments));
+		return;
+	}
+
+	if (deviceId)
+		SendCommandPacket(ProceduresG2X::RunCommandOnDeviceQuery::Create(routeId, m_Signature, sharedKey, *deviceId, commandWithArguments).ComposeQueryPacket(), routeId.GetAgentId(), channel);
+	else
+		SendCommandPacket(ProceduresG2X::RunCommandOnAgentQuery::Create(routeId, m_Signature, sharedKey, commandWithArguments).ComposeQueryPacket(), routeId.GetAgentId(), channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::PostAgentCommand(AgentId agentId, Crypto::SharedKey const& sharedKey, ByteView commandWithArguments, std::optional<DeviceId> deviceId)
+{
+	auto route = FindRoute(agentId);
+	auto channel = route ? route->m_Channel.lock() : nullptr;
+	if (!channel)
+		return QueueAgentCommand(agentId, { deviceId, ByteVector{ commandWithArguments } });
 
-	auto query = ProceduresG2X::DeliverToBinder::Create(route->m_RouteId, m_Signature, agent->m_EncryptionKey, m_DecryptionKey, routeId.GetInterfaceId(), command);
-	LockAndSendPacket(query->ComposeQueryPacket(), device);
+	SendAgentCommand(route->m_RouteId, sharedKey, commandWithArguments, channel, deviceId);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::QueueAgentCommand(AgentId agentId, QueuedAgentCommand command)
+{
+	// Settings are applied by a single command, so only the last one queued for the same recipient matters. It takes the place of the first one.
+	auto getSetting = [](QueuedAgentCommand const& queued) -> std::optional<Command>
+	{
+		if (queued.m_IsForBinder || queued.m_Command.size() < sizeof(std::uint16_t))
+			return {};
+
+		switch (auto commandId = static_cast<Command>(ByteView{ queued.m_Command }.Read<std::uint16_t>()))
+		{
+		case Command::UpdateJitter:
+			return queued.m_DeviceId ? std::optional{ commandId } : std::nullopt;
+		case Command::SetStriping:
+		case Command::SetIdleTrimming:
+		case Command::SetSpool:
+		case Command::SetAggregation:
+		case Command::SetCutThrough:
+		case Command::SetResumptionToken:
+			return queued.m_DeviceId ? std::nullopt : std::optional{ commandId };
+		default:
+			return {};
+		}
+	};
+
+	std::lock_guard lock{ m_QueuedAgentCommandsMutex };
+	auto& commands = m_QueuedAgentCommands[agentId.ToUnderlyingType()];
+	m_AgentsWithQueuedCommands = m_QueuedAgentCommands.size();
+	if (auto setting = getSetting(command))
+		for (auto& queued : commands)
+			if (queued.m_DeviceId == command.m_DeviceId && getSetting(queued) == setting)
+			{
+				queued = std::move(command);
+				return;
+			}
+
+	if (commands.size() >= s_MaxQueuedAgentCommands)
+		throw std::runtime_error{ "Too many commands wait for agent " + agentId.ToString() + " to check in." };
+
+	commands.push_back(std::move(command));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::FlushQueuedAgentCommands(AgentId agentId)
+{
+	{
+		std::lock_guard lock{ m_QueuedAgentCommandsMutex };
+		if (!m_QueuedAgentCommands.count(agentId.ToUnderlyingType()))
+			return;
+	}
+
+	auto context = GetDeliveryContext(agentId);
+	auto channel = context.m_Channel.lock();
+	if (!channel)
+		return;
+
+	std::vector<QueuedAgentCommand> commands;
+	{
+		std::lock_guard lock{ m_QueuedAgentCommandsMutex };
+		auto it = m_QueuedAgentCommands.find(agentId.ToUnderlyingType());
+		if (it == m_QueuedAgentCommands.end())
+			return;
+
+		commands = std::move(it->second);
+		m_QueuedAgentCommands.erase(it);
+		m_AgentsWithQueuedCommands = m_QueuedAgentCommands.size();
+	}
+
+	SendCommandsInParallel([&]
+	{
+		for (auto const& command : commands)
+			if (command.m_IsForBinder)
+				SendCommandPacket(ProceduresG2X::DeliverToBinder::Create(context.m_RouteId, m_Signature, context.m_SharedKey, *command.m_DeviceId, command.m_Command).ComposeQueryPacket(), agentId, channel);
+			else
+				SendAgentCommand(context.m_RouteId, context.m_SharedKey, command.m_Command, channel, command.m_DeviceId);
+	});
+
+	Log({ "Sent " + std::to_string(commands.size()) + " commands queued for agent " + agentId.ToString() + ".", FSecure::C3::LogMessage::Severity::Information });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::DropQueuedAgentCommands(AgentId agentId)
+{
+	std::lock_guard lock{ m_QueuedAgentCommandsMutex };
+	m_QueuedAgentCommands.erase(agentId.ToUnderlyingType());
+	m_AgentsWithQueuedCommands = m_QueuedAgentCommands.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SendCommandsInParallel(std::function<void()> const& compose)
+{
+	DeferredCommands deferred;
+	{
+		std::map<AgentId, AgentCommands> agentCommands;
+		auto previous = std::exchange(g_DeferredCommands, &deferred);
+		auto previousAgentCommands = std::exchange(g_DeferredAgentCommands, m_AreCompoundCommandsEnabled ? &agentCommands : nullptr);
+		SCOPE_GUARD( g_DeferredCommands = previous; g_DeferredAgentCommands = previousAgentCommands; );
+		compose();
+
+		// Every Agent gets its commands in as few queries as possible. Queries are deferred like all other commands.
+		g_DeferredAgentCommands = nullptr;
+		for (auto& [agentId, commands] : agentCommands)
+			for (size_t i = 0; i < commands.m_Commands.size(); i += ProceduresG2X::RunCommandsOnAgentQuery::s_MaxCommands)
+			{
+				auto count = std::min(commands.m_Commands.size() - i, ProceduresG2X::RunCommandsOnAgentQuery::s_MaxCommands);
+				std::vector<ByteVector> part(std::make_move_iterator(commands.m_Commands.begin() + i), std::make_move_iterator(commands.m_Commands.begin() + i + count));
+				auto query = ProceduresG2X::RunCommandsOnAgentQuery::Create(commands.m_RouteId, m_Signature, commands.m_SharedKey, part);
+				SendCommandPacket(query.ComposeQueryPacket(), agentId, commands.m_Channel);
+			}
+	}
+
+	if (m_IsMulticastEnabled && deferred.size() > 1)
+		deferred = WrapInMulticasts(std::move(deferred));
+
+	std::for_each(std::execution::par, deferred.begin(), deferred.end(), [this](auto const& command)
+	{
+		try
+		{
+			LockAndSendPacket(command.first, command.second);
+		}
+		catch (std::exception& exception)
+		{
+			Log({ "Caught an exception while sending command. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+		}
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+nlohmann::json FSecure::C3::Core::GateRelay::GetCommandTracingReport() const
+{
+	auto interval = m_CommandTracingInterval.load();
+	std::lock_guard lock{ m_CommandTracingMutex };
+	if (!interval && m_CommandLatencies.empty())
+		return {};
+
+	// Averages are computed over reported traces. Relays are listed in order of passing the command.
+	auto agents = json::array();
+	for (auto const& [agentId, latency] : m_CommandLatencies)
+	{
+		auto hops = json::array();
+		for (auto const& hopId : latency.m_Path)
+		{
+			auto const& hop = latency.m_Hops.at(hopId);
+			hops.push_back({
+				{ "agentId", hopId.ToString() },
+				{ "count", hop.m_Count },
+				{ "avgDownstreamMs", ToReportedMilliseconds(hop.m_Downstream / hop.m_Count) },
+				{ "avgUpstreamMs", ToReportedMilliseconds(hop.m_Upstream / hop.m_Count) }
+			});
+		}
+
+		agents.push_back({
+			{ "agentId", agentId.ToString() },
+			{ "count", latency.m_Count },
+			{ "avgGatewayMs", ToReportedMilliseconds(latency.m_GatewayTime / latency.m_Count) },
+			{ "avgRoundTripMs", ToReportedMilliseconds(latency.m_RoundTrip / latency.m_Count) },
+			{ "maxRoundTripMs", ToReportedMilliseconds(latency.m_MaxRoundTrip) },
+			{ "avgChannelsMs", ToReportedMilliseconds(latency.m_ChannelTime / latency.m_Count) },
+			{ "hops", std::move(hops) }
+		});
+	}
+
+	return {
+		{ "interval", interval },
+		{ "pendingTraces", m_PendingTraces.size() },
+		{ "expiredTraces", m_ExpiredTraces },
+		{ "agents", std::move(agents) }
+	};
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -119,8 +848,10 @@ void FSecure::C3::Core::GateRelay::RunApiBrige(std::string_view apiBrigdeIp, std
 	{
 		try
 		{
+			// Messages are queued as plain JSON and encoded when sent, according to the protocol version. Must outlive connection threads.
+			std::atomic<std::uint8_t> bridgeProtocol = 0;
 			DuplexConnection connection(apiBrigdeIp, apiBrigdePort);
-			connection.StartSending();
+			connection.StartSending([this, &bridgeProtocol](std::vector<ByteVector> messages, DuplexConnection::Priority priority) { return EncodeApiBridgeMessages(std::move(messages), bridgeProtocol, priority); });
 
 			auto clientKeys = Crypto::GenerateExchangeKeys();
 			connection.Send(clientKeys.second.ToByteVector());
@@ -128,113 +859,264 @@ void FSecure::C3::Core::GateRelay::RunApiBrige(std::string_view apiBrigdeIp, std
 			auto firstMessage = connection.Receive();
 			Crypto::ExchangePublicKey serverPublicKey = firstMessage;
 			m_SessionKeys = Crypto::GenerateClientSessionKeys(clientKeys, serverPublicKey);
+			bridgeProtocol = 1;
+			m_IsCborProfileEnabled = false;
+			m_SessionSuite = Crypto::AeadSuite::XSalsa20Poly1305;
+			std::atomic_store(&m_ProfileSubscription, std::shared_ptr<const ProfileSubscription>{});
 
-			// Send initial packet
+			// Send initial packet. Controller confirms it supports batches by sending one, and selects one of profile encodings and session ciphers with ProfileEncoding and SessionCipher messages. It may also limit Profile updates with ProfileSubscription message. Capability is spliced in as cached text, so that reconnect storms don't copy and serialize it again.
 			connection.Send(ByteView
 				{
-					Crypto::Encrypt(ByteView{json
-					{
-						{ "messageType", "GetCapability" },
-						{ "messageData", m_Profiler->Get().m_Gateway.GetCapability() }
-					}.dump()} ,m_SessionKeys.second)
+					R"({"bridgeProtocol":)" + std::to_string(s_ApiBridgeProtocolVersion) + R"(,"messageData":)" + m_Profiler->Get().m_Gateway.GetDumpedCapability() + R"(,"messageType":"GetCapability","profileEncodings":["cbor"],"profileScopes":["network","agent","counters","none"],"sessionCiphers":)" + GetSessionCiphers() + "}"
 				});
 
-			// Keep started messageHandlers to make sure that connection outlives them
-			std::list<std::future<void>> messageHandlers;
-			connection.StartReceiving([self = std::static_pointer_cast<GateRelay>(shared_from_this()), &connection, &messageHandlers](ByteVector encryptedMessagePacket)
+			// Make sure that connection outlives queued messages. Receiving thread is stopped first, so that no more messages are queued.
+			SCOPE_GUARD( connection.Close(); m_ApiBridgeExecutor->WaitUntilIdle(); );
+			connection.StartReceiving([self = std::static_pointer_cast<GateRelay>(shared_from_this()), &connection, &bridgeProtocol](ByteVector encryptedMessagePacket)
 			{
-				messageHandlers.emplace_back(std::async(std::launch::async, [&connection, &self, encryptedMessagePacket = std::move(encryptedMessagePacket)]()
+				try
+				{
+					auto isBatch = false;
+					for (auto&& decrypted : self->DecodeApiBridgeFrame(encryptedMessagePacket, isBatch))
 					{
-						try
-						{
-							auto decrypted = Crypto::Decrypt(encryptedMessagePacket, self->m_SessionKeys.first);
-							ByteView messagePacket = decrypted;
-							self->Log({ "Received message: " + std::string{messagePacket} , FSecure::C3::LogMessage::Severity::DebugInformation });
-							auto response = self->HandleMessage(json::parse(std::string{ messagePacket }));
-							if (!response.is_null())
-								connection.Send(ByteView{ Crypto::Encrypt(ByteView{response.dump()}, self->m_SessionKeys.second) });
-						}
-						catch (std::exception& exception)
-						{
-							self->Log({ "Caught an exception while processing message from Controller. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
-						}
+						if (self->IsLogEnabled(FSecure::C3::LogMessage::Severity::DebugInformation))
+							self->Log({ "Received message: " + std::string{ ByteView{ decrypted } }, FSecure::C3::LogMessage::Severity::DebugInformation });
+						self->QueueMessage(std::move(decrypted), connection);
 					}
-				));
 
-				// remove finished actions
-				messageHandlers.remove_if( [](std::future<void> const& t)
+					if (isBatch)
+						bridgeProtocol = s_ApiBridgeProtocolVersion;
+				}
+				catch (std::exception& exception)
 				{
-					return t.wait_for(1ns) == std::future_status::ready;
-				});
+					self->Log({ "Caught an exception while processing message from Controller. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+				}
 			});
 
 			Log({ "API bridge connection established on " + std::string{apiBrigdeIp} +':' + std::to_string(apiBrigdePort), FSecure::C3::LogMessage::Severity::Information });
 			reconnectWait = 0s;
 			// Enter main loop.
 			auto sp = m_Profiler->GetSnapshotProxy();
+			std::shared_ptr<const ProfileSubscription> subscription;
+			json subscribedProfile;
+			std::uint64_t subscribedVersion = 0;
+			auto lastUpdate = std::chrono::steady_clock::time_point{};
 			while (m_IsAlive && connection.IsSending())
 			{
-				// Read socket.
-				std::this_thread::sleep_for(300ms);
-				if (sp.CheckUpdates())
+				// Read socket. Close ends the loop right away.
+				if (WaitForClose(s_ProfileCheckInterval))
+					break;
+
+				// Changed subscription starts with a whole Profile part, as Controller has nothing to apply deltas to.
+				auto isResubscribed = false;
+				if (auto current = std::atomic_load(&m_ProfileSubscription); current != subscription)
+				{
+					subscription = std::move(current);
+					subscribedProfile = {};
+					isResubscribed = true;
+				}
+
+				// Nothing is built until Controller wants it.
+				auto scope = subscription ? subscription->m_Scope : ProfileSubscription::Scope::Network;
+				auto now = std::chrono::steady_clock::now();
+				if (scope == ProfileSubscription::Scope::None || (subscription && !isResubscribed && now - lastUpdate < subscription->m_Interval))
+					continue;
+
+				try
 				{
-					try
+					json message;
+					if (scope == ProfileSubscription::Scope::Network)
 					{
-						connection.Send(Crypto::Encrypt(ByteView{ json{ { "messageType", "GetProfile" }, { "messageData", sp.GetSnapshot()}}.dump() }, m_SessionKeys.second));
+						// Whole Profile is resent to a Controller that resubscribed to it, even if nothing changed meanwhile.
+						if (!sp.CheckUpdates() && !(isResubscribed && sp.GetVersion()))
+							continue;
+
+						// First Profile after connecting is always sent whole. Full Profile is also resent periodically, so Controller can recover if it failed to apply a delta.
+						message = isResubscribed || sp.GetDelta().is_null() || sp.GetVersion() % s_FullProfileInterval == 0
+							? json{ { "messageType", "GetProfile" }, { "profileVersion", sp.GetVersion() }, { "messageData", sp.GetSnapshot() } }
+							: json{ { "messageType", "GetProfileDelta" }, { "profileVersion", sp.GetVersion() }, { "messageData", sp.GetDelta() } };
 					}
-					catch (std::exception& exception)
+					else
 					{
-						Log({ "Caught an exception while sending Profile. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
-						break;
+						// Parts have their own versions, as they change independently of the whole Profile.
+						auto profile = CreateSubscribedProfile(*subscription);
+						if (profile == subscribedProfile)
+							continue;
+
+						auto isFull = subscribedProfile.is_null() || ++subscribedVersion % s_FullProfileInterval == 0;
+						message = json{
+							{ "messageType", isFull ? "GetProfile" : "GetProfileDelta" },
+							{ "profileScope", scope == ProfileSubscription::Scope::Agent ? "agent" : "counters" },
+							{ "profileVersion", subscribedVersion },
+							{ "messageData", isFull ? profile : json::diff(subscribedProfile, profile) }
+						};
+						subscribedProfile = std::move(profile);
 					}
+
+					lastUpdate = now;
+
+					// Profile can be big. It must not delay responses to commands. CBOR message is a map, so Controller tells it from JSON by the first byte.
+					if (m_IsCborProfileEnabled)
+						connection.Send(ByteVector{ json::to_cbor(message) }, DuplexConnection::Priority::Normal);
+					else
+						connection.Send(ByteView{ message.dump() }, DuplexConnection::Priority::Normal);
+				}
+				catch (std::exception& exception)
+				{
+					Log({ "Caught an exception while sending Profile. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+					break;
 				}
 			}
 		}
 		catch (SocketsException& exception)
 		{
 			Log({ "Connection to Controller failed. "s + exception.what() + ". Reconnect after " + std::to_string(reconnectWait.count()) + "s", FSecure::C3::LogMessage::Severity::Error });
-			std::this_thread::sleep_for(reconnectWait);
+			if (WaitForClose(reconnectWait))
+				break;
+
 			reconnectWait += 10s;
 		}
 	}
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::SetProfileSubscription(std::string_view messageData)
+{
+	auto fields = JsonObjectView{ messageData };
+	auto subscription = std::make_shared<ProfileSubscription>();
+	if (auto scope = fields.Get<std::string>("Scope"); scope == "network")
+		subscription->m_Scope = ProfileSubscription::Scope::Network;
+	else if (scope == "agent")
+	{
+		subscription->m_Scope = ProfileSubscription::Scope::Agent;
+		subscription->m_AgentId = AgentId{ fields.Get<std::string>("AgentId") };
+	}
+	else if (scope == "counters")
+		subscription->m_Scope = ProfileSubscription::Scope::Counters;
+	else if (scope == "none")
+		subscription->m_Scope = ProfileSubscription::Scope::None;
+	else
+		throw std::invalid_argument{ "Unsupported profile scope: " + scope + '.' };
+
+	subscription->m_Interval = std::max(std::chrono::milliseconds{ fields.Value("IntervalMs", std::uint32_t{ 0 }) }, s_ProfileCheckInterval);
+	std::atomic_store(&m_ProfileSubscription, std::shared_ptr<const ProfileSubscription>{ std::move(subscription) });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Core::GateRelay::CreateSubscribedProfile(ProfileSubscription const& subscription)
+{
+	if (subscription.m_Scope == ProfileSubscription::Scope::Counters)
+		return CollectChannelCounters();
+
+	// View is captured under the Profile lock, and assembled without it.
+	auto view = m_Profiler->Get().m_Gateway.CreateSubtreeSnapshotView(subscription.m_AgentId);
+	return view.ToJson();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Core::GateRelay::CollectChannelCounters()
+{
+	std::vector<std::shared_ptr<DeviceBridge>> channels;
+	{
+		std::shared_lock lock(m_DevicesMutex);
+		for (auto const& [did, device] : m_Devices)
+			if (auto channel = device.lock(); channel && channel->IsChannel())
+				channels.push_back(std::move(channel));
+	}
+
+	// Same members as in the Profiles of Channels, so that Controller can show them in the same way.
+	auto counters = json::array();
+	for (auto const& channel : channels)
+	{
+		auto metrics = channel->GetMetrics();
+		auto statistics = channel->GetQoSStatistics();
+		counters.push_back({
+			{ "iId", channel->GetDid().ToString() },
+			{ "qos", {
+				{ "expiredPackets", statistics.m_ExpiredPackets },
+				{ "evictedPackets", statistics.m_EvictedPackets },
+				{ "rejectedChunks", statistics.m_RejectedChunks },
+				{ "droppedBytes", statistics.m_DroppedBytes },
+				{ "droppedOutboundPackets", statistics.m_DroppedOutboundPackets },
+				{ "pendingPackets", statistics.m_PendingPackets },
+				{ "recoveredChunks", statistics.m_RecoveredChunks },
+				{ "duplicateChunks", statistics.m_DuplicateChunks },
+				{ "outboundQueueDepth", channel->GetOutboundQueueDepth() }
+			} },
+			{ "metrics", {
+				{ "bytesIn", metrics.m_BytesIn },
+				{ "packetsIn", metrics.m_PacketsIn },
+				{ "bytesOut", metrics.m_BytesOut },
+				{ "packetsOut", metrics.m_PacketsOut },
+				{ "chunksSent", metrics.m_ChunksSent },
+				{ "partialSends", metrics.m_PartialSends },
+				{ "resends", metrics.m_Resends },
+				{ "exceptions", metrics.m_Exceptions }
+			} }
+		});
+	}
+
+	return json{ { "agentId", m_AgentId.ToString() }, { "channels", std::move(counters) } };
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::TurnOnConnector(HashT connectorNameHash, ByteView commandLine)
 {
-	// Find the right factory and turn Connector on.
-	if (auto connectorData = InterfaceFactory::Instance().GetInterfaceData<AbstractConnector>(connectorNameHash); !connectorData)
+	// Find the right factory.
+	auto connectorData = InterfaceFactory::Instance().GetInterfaceData<AbstractConnector>(connectorNameHash);
+	if (!connectorData)
 		throw std::runtime_error{ "Couldn't find factory for Device of hash '" + std::to_string(connectorNameHash) + "'." };
-	else
+
+	// Check if Connector is already on. Connector that failed to start is replaced.
+	if (auto existing = GetConnector(connectorNameHash))
 	{
-		// Check if Connector is already on.
-		if (m_Connectors.Find([&connectorNameHash](std::shared_ptr<ConnectorBridge> c)
-			{
-				try
-				{
-					return c->GetNameHash() == connectorNameHash;
-				}
-				catch (...)
-				{
-					return false;
-				}
-			}))
-				throw std::invalid_argument{ "Connector of hash '" + std::to_string(connectorNameHash) + "' is already turned on." };
+		if (existing->IsStarting() || existing->IsRunning())
+			throw std::invalid_argument{ "Connector of hash '" + std::to_string(connectorNameHash) + "' is already turned on." };
 
-		// Create and add Connector.
-		auto connector = std::make_shared<ConnectorBridge>(std::static_pointer_cast<GateRelay>(shared_from_this()), connectorData->m_Builder(commandLine), connectorData->m_Name, connectorNameHash);
-		connector->OnAttach();
-		m_Connectors.Add(connector);
+		TurnOffConnector(connectorNameHash);
+	}
 
-		// Let the Profiler know that there's a new Connector turned on.
-		m_Profiler->Get().m_Gateway.ReTurnOnConnector(connectorNameHash, connector);
+	// Add Connector before it is built, so that it shows up in the Profile as starting.
+	auto connector = std::make_shared<ConnectorBridge>(std::static_pointer_cast<GateRelay>(shared_from_this()), nullptr, connectorData->m_Name, connectorNameHash);
+	m_Connectors.Add(connector);
+	{
+		std::unique_lock lock{ m_ConnectorsByHashMutex };
+		m_ConnectorsByHash.emplace(connectorNameHash, connector);
 	}
+
+	// Let the Profiler know that there's a new Connector turned on.
+	m_Profiler->Get().m_Gateway.ReTurnOnConnector(connectorNameHash, connector);
+
+	// Build Connector in the background. Out of process Connector is built by the host, so that its constructor doesn't run in Gateway either.
+	m_ConnectorStartupExecutor->Post(std::to_string(connectorNameHash), TaskExecutor::Priority::Normal, [self = std::static_pointer_cast<GateRelay>(shared_from_this()), connector, builder = connectorData->m_Builder,
+		commandLine = ByteVector{ commandLine }, isOutOfProcess = m_AreConnectorsOutOfProcess.load()]()
+	{
+		// Connector was turned off before its startup began.
+		if (!connector->IsAlive())
+			return;
+
+		try
+		{
+			auto instance = isOutOfProcess ? std::make_shared<ConnectorHost::OutOfProcessConnector>(connector->GetNameHash(), commandLine) : builder(commandLine);
+			connector->Start(std::move(instance));
+		}
+		catch (std::exception& exception)
+		{
+			connector->Fail(exception.what());
+			self->Log({ "Couldn't start Connector " + connector->GetName() + ". " + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+		}
+	});
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::TurnOffConnector(HashT connectorNameHash)
 {
 	m_Profiler->Get().m_Gateway.ReTurnOffConnector(connectorNameHash);
+	{
+		std::unique_lock lock{ m_ConnectorsByHashMutex };
+		m_ConnectorsByHash.erase(connectorNameHash);
+	}
+
 	m_Connectors.Remove([&connectorNameHash](std::shared_ptr<ConnectorBridge> c)
 		{
 			if (c->GetNameHash() == connectorNameHash)
@@ -249,7 +1131,9 @@ void FSecure::C3::Core::GateRelay::TurnOffConnector(HashT connectorNameHash)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::Core::ConnectorBridge> FSecure::C3::Core::GateRelay::GetConnector(HashT connectorNameHash)
 {
-	return m_Connectors.Find([&](auto& e) { return e->GetNameHash() == connectorNameHash; });
+	std::shared_lock lock{ m_ConnectorsByHashMutex };
+	auto it = m_ConnectorsByHash.find(connectorNameHash);
+	return it == m_ConnectorsByHash.end() ? nullptr : it->second;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -257,6 +1141,11 @@ void FSecure::C3::Core::GateRelay::Close()
 {
 	CloseDevicesAndConnectors();
 	m_IsAlive = false;
+	m_ApiBridgeExecutor->Stop();
+	m_NegotiationExecutor->Stop();
+	m_ConnectorStartupExecutor->Stop();
+	m_MetricsEndpoint.reset();
+	NotifyClosed();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -303,18 +1192,22 @@ void FSecure::C3::Core::GateRelay::On(ProceduresN2N::InitializeRouteQuery query)
 		return; // TODO signalize error
 
 	auto const& returnChannelRoute = query.GetSenderRouteId();
+	if (!IsAgentOfThisGateway(returnChannelRoute.GetAgentId(), newRelayBuildId))
+		return;
+
 	this->AddRoute(returnChannelRoute, receivedFrom);
 	m_Profiler->Get().m_Gateway.ReAddRoute(returnChannelRoute, receivedFrom->GetDid(), true);
 	m_Profiler->Get().m_Gateway.ReAddAgent(returnChannelRoute.GetAgentId(), newRelayBuildId, newRelayPublicKey, false, lastSeen, std::move(hostInfo)); // TODO check if is banned
 	m_Profiler->Get().m_Gateway.m_Agents.Find(returnChannelRoute.GetAgentId())->ReAddChannel(returnChannelRoute.GetInterfaceId(), hash, true);
 	m_Profiler->Get().m_Gateway.ConditionalUpdateChannelParameters({ GetAgentId(), receivedFrom->GetDid() });
+	IssueResumptionToken(returnChannelRoute.GetAgentId(), newRelayBuildId);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::On(ProceduresS2G::InitializeRouteQuery query)
 {
 	// whole message.
-	auto decryptedPacket = query.GetQueryPacket(m_AuthenticationKey, m_DecryptionKey);
+	auto decryptedPacket = DecryptS2G(query.GetQueryPacket());
 	auto readView = ByteView{ decryptedPacket };
 
 	// part of message created by parent Node
@@ -334,24 +1227,144 @@ void FSecure::C3::Core::GateRelay::On(ProceduresS2G::InitializeRouteQuery query)
 	if (!receivedFrom)
 		return; // TODO signalize error
 
+	if (!IsAgentOfThisGateway(childRid.GetAgentId(), newRelayBuildId))
+		return;
+
 	//Add route.
 	AddRoute(childRid, receivedFrom);
 
 	//update profiler
 	m_Profiler->Get().m_Gateway.ReAddRemoteAgent(childRid, newRelayBuildId, newRelayPublicKey, RouteId{ parentRid.GetAgentId(), childSideDid }, hash, lastSeen, hostInfo);
-	m_Profiler->Get().m_Gateway.UpdateRouteTimestamps(parentRid.GetAgentId(), timestamp);
+	m_Profiler->UpdateLastSeen(parentRid.GetAgentId(), timestamp);
+	m_Profiler->Get().m_Gateway.ConditionalUpdateChannelParameters({ parentRid.GetAgentId(), childSideDid });
+
+	//send update message across route.
+	auto packet = ProceduresG2X::AddRoute::Create(parentRid, m_Signature, ByteVector::Create(childRid,childSideDid));
+	LockAndSendPacket(packet.ComposeQueryPacket(), receivedFrom);
+	IssueResumptionToken(childRid.GetAgentId(), newRelayBuildId);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::On(ProceduresN2N::ResumeRouteQuery query)
+{
+	auto decryptedPacket = query.GetQueryPacket(this->m_AuthenticationKey, this->m_DecryptionKey);
+	auto [relayBuildId, token, hash, lastSeen] = ByteView{ decryptedPacket }.Read<BuildId, ByteView, HashT, int32_t>();
+
+	auto receivedFrom = query.GetSenderChannel().lock();
+	if (!receivedFrom)
+		return; // TODO signalize error
+
+	auto const& returnChannelRoute = query.GetSenderRouteId();
+	auto agentId = returnChannelRoute.GetAgentId();
+	if (!IsAgentOfThisGateway(agentId, relayBuildId))
+		return;
+
+	// Relay keeps its Profile. Only the Route it came through is added.
+	if (!IsResumptionTokenValid(token, agentId, relayBuildId) || !m_Profiler->Get().m_Gateway.ReResumeAgent(returnChannelRoute, relayBuildId, RouteId{ GetAgentId(), receivedFrom->GetDid() }, hash))
+	{
+		// Relay is a neighbor, so it's told to register in full right away.
+		auto rejection = ProceduresN2N::ResumeRouteRejected::Create(RouteId{ GetAgentId(), receivedFrom->GetDid() }, returnChannelRoute);
+		return LockAndSendPacket(rejection.ComposeQueryPacket(), receivedFrom);
+	}
+
+	this->AddRoute(returnChannelRoute, receivedFrom);
+	m_Profiler->Get().m_Gateway.ConditionalUpdateChannelParameters({ GetAgentId(), receivedFrom->GetDid() });
+	m_Profiler->UpdateLastSeen(agentId, lastSeen);
+	if (m_AgentsWithQueuedCommands.load(std::memory_order_relaxed))
+		FlushQueuedAgentCommands(agentId);
+
+	IssueResumptionToken(agentId, relayBuildId);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::On(ProceduresN2N::ResumeRouteRejected query)
+{
+	throw std::logic_error("Gateway should never receive rejection of route resumption");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::On(ProceduresS2G::ResumeRouteQuery query)
+{
+	auto decryptedPacket = DecryptS2G(query.GetQueryPacket());
+	auto readView = ByteView{ decryptedPacket };
+	auto [procedureID, parentRid, timestamp, childRid, childSideDid] = readView.Read<ProceduresUnderlyingType, RouteId, int32_t, RouteId, DeviceId>();
+
+	// part of message from rejoining relay, sealed for the gateway.
+	auto childPacket = Crypto::DecryptFromAnonymous(readView, m_AuthenticationKey, m_DecryptionKey);
+	auto [relayBuildId, token, hash, lastSeen] = ByteView{ childPacket }.Read<BuildId, ByteView, HashT, int32_t>();
+
+	auto receivedFrom = query.GetSenderChannel().lock();
+	if (!receivedFrom)
+		return; // TODO signalize error
+
+	auto agentId = childRid.GetAgentId();
+	if (!IsAgentOfThisGateway(agentId, relayBuildId))
+		return;
+
+	m_Profiler->UpdateLastSeen(parentRid.GetAgentId(), timestamp);
+	if (!IsResumptionTokenValid(token, agentId, relayBuildId) || !m_Profiler->Get().m_Gateway.ReResumeAgent(childRid, relayBuildId, RouteId{ parentRid.GetAgentId(), childSideDid }, hash))
+	{
+		// Relay that passed the request tells its neighbor to register in full.
+		auto rejection = ProceduresG2X::RejectRouteResumption::Create(parentRid, m_Signature, childRid, childSideDid);
+		return LockAndSendPacket(rejection.ComposeQueryPacket(), receivedFrom);
+	}
+
+	AddRoute(childRid, receivedFrom);
 	m_Profiler->Get().m_Gateway.ConditionalUpdateChannelParameters({ parentRid.GetAgentId(), childSideDid });
 
 	//send update message across route.
-	auto&& packet = ProceduresG2X::AddRoute::Create(parentRid, m_Signature, ByteVector::Create(childRid,childSideDid));
-	LockAndSendPacket(packet->ComposeQueryPacket(), receivedFrom);
+	auto packet = ProceduresG2X::AddRoute::Create(parentRid, m_Signature, ByteVector::Create(childRid, childSideDid));
+	LockAndSendPacket(packet.ComposeQueryPacket(), receivedFrom);
+
+	m_Profiler->UpdateLastSeen(agentId, lastSeen);
+	if (m_AgentsWithQueuedCommands.load(std::memory_order_relaxed))
+		FlushQueuedAgentCommands(agentId);
+
+	IssueResumptionToken(agentId, relayBuildId);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::IssueResumptionToken(AgentId agentId, BuildId buildId)
+{
+	auto sharedKey = [&]() -> std::optional<Crypto::SharedKey>
+	{
+		auto agent = m_Profiler->GetAgent(agentId);
+		return agent ? std::optional{ agent->m_SharedKey } : std::nullopt;
+	}();
+
+	if (!sharedKey)
+		return;
+
+	auto token = Crypto::EncryptAnonymously(ByteVector::Create(agentId, buildId, FSecure::Utils::TimeSinceEpoch()), m_ResumptionKey);
+	PostAgentCommand(agentId, *sharedKey, ByteVector{}.Write(Command::SetResumptionToken, ByteView{ token }));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::GateRelay::IsResumptionTokenValid(ByteView token, AgentId agentId, BuildId buildId)
+{
+	ByteVector sealed;
+	if (!Crypto::TryDecryptFromAnonymous(token, m_ResumptionKey, sealed))
+		return false;
+
+	auto [tokenAgentId, tokenBuildId, issuedAt] = ByteView{ sealed }.Read<AgentId, BuildId, int32_t>();
+	return tokenAgentId == agentId && tokenBuildId == buildId && std::chrono::seconds{ FSecure::Utils::TimeSinceEpoch() - issuedAt } < s_ResumptionTokenLifetime;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::GateRelay::IsAgentOfThisGateway(AgentId agentId, BuildId buildId)
+{
+	if (m_Profiler->Get().m_Gateway.HasAgentBuild(buildId))
+		return true;
+
+	Log({ "Ignoring agent " + agentId.ToString() + " of unknown build " + buildId.ToString() + ". It belongs to another Gateway sharing the network key.", FSecure::C3::LogMessage::Severity::Warning });
+	return false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::On(ProceduresS2G::DeliverToBinder query)
 {
 	// whole message.
-	auto decryptedPacket = query.GetQueryPacket(m_AuthenticationKey, m_DecryptionKey);
+	auto decryptedPacket = DecryptS2G(query.GetQueryPacket());
 	auto readView = ByteView{ decryptedPacket };
 
 	auto unusedProtocolId = readView.Read<int8_t>();
@@ -360,20 +1373,37 @@ void FSecure::C3::Core::GateRelay::On(ProceduresS2G::DeliverToBinder query)
 	auto deviceId = readView.Read<DeviceId>();
 	auto connectorHash = readView.Read<HashT>();
 
-	auto connector = m_Connectors.Find([&](auto const& e){ return e->GetNameHash() == connectorHash; });
+	auto connector = GetConnector(connectorHash);
 	if (!connector)
 		throw std::runtime_error{ "Connector not found" };
 
-	auto binder = ByteVector::Create(RouteId{ senderRid.GetAgentId(), deviceId });
-	connector->OnCommandFromBinder(binder, readView);
+	std::optional<ResourceUsage> resourceUsage;
+	std::optional<BinderSegment> segment;
+	auto message = UnpackBinderMessage(readView, &resourceUsage, &segment);
+	auto binderRouteId = RouteId{ senderRid.GetAgentId(), deviceId };
+	if (segment)
+	{
+		// Connector gets streamed command once all its segments arrived.
+		auto command = CollectCommandSegment(binderRouteId, *segment, message);
+		if (!command)
+			return m_Profiler->UpdateLastSeen(senderRid.GetAgentId(), timestamp);
+
+		message = std::move(*command);
+	}
+
+	auto binder = ByteVector::Create(binderRouteId);
+	connector->OnCommandFromBinder(binder, message);
 
-	m_Profiler->Get().m_Gateway.UpdateRouteTimestamps(senderRid.GetAgentId(), timestamp);
+	m_Profiler->UpdateLastSeen(senderRid.GetAgentId(), timestamp);
 
 	// part storing first message from beacon for gateway restart. This must be done here, as connectors knows nothing about profiler.
-	auto agent = m_Profiler->Get().m_Gateway.m_Agents.Find(senderRid.GetAgentId());
+	auto agent = m_Profiler->GetAgent(senderRid.GetAgentId());
 	if (!agent)
 		return;
 
+	if (resourceUsage)
+		agent->m_ResourceUsage = *resourceUsage;
+
 	auto peripheral = agent->m_Peripherals.Find(deviceId);
 	if (!peripheral || peripheral->m_StartupArguments.is_null())
 		return;
@@ -381,39 +1411,58 @@ void FSecure::C3::Core::GateRelay::On(ProceduresS2G::DeliverToBinder query)
 	if (!peripheral->m_StartupArguments["FirstResponse"].is_null())
 		return;
 
-	peripheral->m_StartupArguments["FirstResponse"] = base64::encode(readView);
+	peripheral->m_StartupArguments["FirstResponse"] = base64::encode(message);
 	peripheral->m_StartupArguments["Binder"] = base64::encode(binder);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::On(ProceduresS2G::AddDeviceResponse response)
 {
-	auto decryptedPacket = response.GetQueryPacket(m_AuthenticationKey, m_DecryptionKey);
+	auto decryptedPacket = DecryptS2G(response.GetQueryPacket());
 	auto readView = ByteView{ decryptedPacket };
 	auto [unsusedProcedureNo, unusedSenderRouteId, timestamp, deviceId, deviceTypeHash, flags] = readView.Read<ProceduresUnderlyingType, RouteId, int32_t, DeviceId, HashT, std::uint8_t>();
 	bool isChannel = flags & 1;
 	bool isNegotiationChannel = flags & (1 << 1);
 
-	auto agent = m_Profiler->Get().m_Gateway.m_Agents.Find(response.GetSenderRouteId().GetAgentId());
-	if (!agent)
-		throw std::runtime_error("Received response from agent which is not tracked. [AgentId] = " + response.GetSenderRouteId().GetAgentId().ToString());
-
-	if (isChannel)
-		agent->ReAddChannel(deviceId, deviceTypeHash, false, isNegotiationChannel);
-	else
-		agent->ReAddPeripheral(deviceId, deviceTypeHash);
+	{
+		auto agent = m_Profiler->GetAgent(response.GetSenderRouteId().GetAgentId());
+		if (!agent)
+			throw std::runtime_error("Received response from agent which is not tracked. [AgentId] = " + response.GetSenderRouteId().GetAgentId().ToString());
+
+		if (isChannel)
+			agent->ReAddChannel(deviceId, deviceTypeHash, false, isNegotiationChannel);
+		else
+			agent->ReAddPeripheral(deviceId, deviceTypeHash);
+	}
 
-	m_Profiler->Get().m_Gateway.UpdateRouteTimestamps(response.GetSenderRouteId().GetAgentId(), timestamp);
+	m_Profiler->UpdateLastSeen(response.GetSenderRouteId().GetAgentId(), timestamp);
 	m_Profiler->Get().m_Gateway.ConditionalUpdateChannelParameters({ response.GetSenderRouteId().GetAgentId(), deviceId });
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::On(ProceduresS2G::CachedArgumentsMissing query)
+{
+	auto decryptedPacket = DecryptS2G(query.GetQueryPacket());
+	auto readView = ByteView{ decryptedPacket };
+	auto [unsusedProcedureNo, unusedSenderRouteId, timestamp, deviceId] = readView.Read<ProceduresUnderlyingType, RouteId, int32_t, DeviceId>();
+
+	auto agentId = query.GetSenderRouteId().GetAgentId();
+	m_Profiler->UpdateLastSeen(agentId, timestamp);
+
+	auto profile = m_Profiler->Get();
+	auto agent = profile.m_Gateway.m_Agents.Find(agentId);
+	if (!agent)
+		throw std::runtime_error("Received request from agent which is not tracked. [AgentId] = " + agentId.ToString());
+
+	agent->ResendUncachedDevice(deviceId);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::On(ProceduresN2N::ChannelIdExchangeStep1 query)
 {
 	auto readView = ByteView{ query.GetQueryPacket() };
-	auto newOutputId = readView.Read<ByteView>();
+	auto newOutputId = std::string{ readView.Read<ByteView>() };
 
-	auto newInputId = FSecure::Utils::GenerateRandomString(newOutputId.size());
 	auto sender = query.GetSenderChannel().lock();
 	if (!sender)
 		throw std::runtime_error("Invalid sender channel");
@@ -421,7 +1470,37 @@ void FSecure::C3::Core::GateRelay::On(ProceduresN2N::ChannelIdExchangeStep1 quer
 	// sanity check
 	if (!sender->IsNegotiationChannel())
 		throw std::runtime_error("Sender Channel is not a negotiation channel");
-	auto negotiatedChannelArgs = ByteVector{}.Write(newInputId, newOutputId).Concat(sender->GetChannelParameters());
+
+	// Request delivered again while its channel is being opened is ignored.
+	{
+		std::lock_guard lock{ m_PendingNegotiationsMutex };
+		if (!m_PendingNegotiations.insert(newOutputId).second)
+			return;
+	}
+
+	m_NegotiationExecutor->Post(newOutputId, TaskExecutor::Priority::Normal, [self = std::static_pointer_cast<GateRelay>(shared_from_this()), negotiator = query.GetSenderChannel(), newOutputId]()
+	{
+		SCOPE_GUARD( std::lock_guard lock{ self->m_PendingNegotiationsMutex }; self->m_PendingNegotiations.erase(newOutputId); );
+		try
+		{
+			self->NegotiateChannel(negotiator, newOutputId);
+		}
+		catch (std::exception& exception)
+		{
+			self->Log({ "Caught an exception while opening negotiated channel. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+		}
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::NegotiateChannel(std::weak_ptr<DeviceBridge> negotiator, std::string const& newOutputId)
+{
+	auto sender = negotiator.lock();
+	if (!sender)
+		throw std::runtime_error("Negotiation channel was closed");
+
+	auto newInputId = FSecure::Utils::GenerateRandomString(newOutputId.size());
+	auto negotiatedChannelArgs = ByteVector{}.Write(newInputId, ByteView{ newOutputId }).Concat(sender->GetChannelParameters());
 	auto newDeviceId = ++(m_Profiler->Get().m_Gateway.m_LastDeviceId);
 	auto newChannel = CreateAndAttachDevice(newDeviceId, sender->GetTypeNameHash(), false, negotiatedChannelArgs);
 
@@ -430,7 +1509,7 @@ void FSecure::C3::Core::GateRelay::On(ProceduresN2N::ChannelIdExchangeStep1 quer
 
 	// send response
 	auto x = ProceduresN2N::ChannelIdExchangeStep2::Create(RouteId(m_AgentId, newChannel->GetDid()), ByteView{ newInputId });
-	LockAndSendPacket(x->ComposeQueryPacket(), newChannel);
+	LockAndSendPacket(x.ComposeQueryPacket(), newChannel);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -442,46 +1521,329 @@ void FSecure::C3::Core::GateRelay::On(ProceduresN2N::ChannelIdExchangeStep2 quer
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::On(ProceduresS2G::NewNegotiatedChannelNotification query)
 {
-	auto decryptedPacket = query.GetQueryPacket(m_AuthenticationKey, m_DecryptionKey);
+	auto decryptedPacket = DecryptS2G(query.GetQueryPacket());
 	auto readView = ByteView{ decryptedPacket };
-	auto [unsusedProcedureNo, unusedSenderRouteId, timestamp, newDeviceId, negotiatorId, inId, outId] = readView.Read<ProceduresUnderlyingType, RouteId, int32_t, DeviceId::UnderlyingIntegerType, DeviceId, std::string, std::string>();
+	auto [unsusedProcedureNo, unusedSenderRouteId, timestamp, newDeviceId, negotiatorId, inId, outId] = readView.Read<ProceduresUnderlyingType, RouteId, int32_t, DeviceId::UnderlyingIntegerType, DeviceId, std::string_view, std::string_view>();
 
-	auto agent = m_Profiler->Get().m_Gateway.m_Agents.Find(query.GetSenderRouteId().GetAgentId());
-	if (!agent)
-		throw std::runtime_error("Received response from agent which is not tracked. [AgentId] = " + query.GetSenderRouteId().GetAgentId().ToString());
+	{
+		auto agent = m_Profiler->GetAgent(query.GetSenderRouteId().GetAgentId());
+		if (!agent)
+			throw std::runtime_error("Received response from agent which is not tracked. [AgentId] = " + query.GetSenderRouteId().GetAgentId().ToString());
 
-	auto negotiator = agent->m_Channels.Find(negotiatorId);
-	if (!negotiator)
-		throw std::runtime_error("Received new negotiated channel notification, but unknown with unknown Negotiator DeviceId" + negotiatorId.ToString());
+		auto negotiator = agent->m_Channels.Find(negotiatorId);
+		if (!negotiator)
+			throw std::runtime_error("Received new negotiated channel notification, but unknown with unknown Negotiator DeviceId" + negotiatorId.ToString());
 
-	agent->ReAddChannel(newDeviceId, negotiator->m_TypeHash, false, false);
-	agent->UpdateFromNegotiationChannel(negotiatorId, newDeviceId, inId, outId);
+		agent->ReAddChannel(newDeviceId, negotiator->m_TypeHash, false, false);
+		agent->UpdateFromNegotiationChannel(negotiatorId, newDeviceId, inId, outId);
+	}
 
-	m_Profiler->Get().m_Gateway.UpdateRouteTimestamps(query.GetSenderRouteId().GetAgentId(), timestamp);
+	m_Profiler->UpdateLastSeen(query.GetSenderRouteId().GetAgentId(), timestamp);
 	m_Profiler->Get().m_Gateway.ConditionalUpdateChannelParameters({ query.GetSenderRouteId().GetAgentId(), DeviceId{newDeviceId} });
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::On(ProceduresS2G::Notification query)
 {
-	auto decryptedPacket = query.GetQueryPacket(m_AuthenticationKey, m_DecryptionKey);
+	auto decryptedPacket = DecryptS2G(query.GetQueryPacket());
 	auto readView = ByteView{ decryptedPacket };
 	auto [unsusedProcedureNo, unusedSenderRouteId, timestamp, blob] = readView.Read<ProceduresUnderlyingType, RouteId, int32_t, ByteView>();
-	// blob has not defined structure. Currently Notification is used as ping response.
+	// Notification is used as ping response. Blob carries ResourceUsage of the Relay followed by quality of links to its neighbours, parts are missing if Relay is older.
 
-	auto agent = m_Profiler->Get().m_Gateway.m_Agents.Find(query.GetSenderRouteId().GetAgentId());
-	if (!agent)
-		throw std::runtime_error("Received response from agent which is not tracked. [AgentId] = " + query.GetSenderRouteId().GetAgentId().ToString());
+	{
+		auto agent = m_Profiler->GetAgent(query.GetSenderRouteId().GetAgentId());
+		if (!agent)
+			throw std::runtime_error("Received response from agent which is not tracked. [AgentId] = " + query.GetSenderRouteId().GetAgentId().ToString());
+
+		if (!blob.empty())
+			agent->m_ResourceUsage = blob.Read<ResourceUsage>();
+
+		if (!blob.empty())
+			for (auto const& [channelId, linkQuality] : blob.Read<std::vector<std::tuple<DeviceId, DeviceBridge::LinkQuality>>>())
+				if (auto channel = agent->m_Channels.Find(channelId))
+					channel->m_LinkQuality = linkQuality;
+	}
+
+	// Preferred Routes depend on all Agents, so they are updated under the topology lock.
+
+	m_Profiler->Get().m_Gateway.UpdatePreferredRoutes();
+	m_Profiler->UpdateLastSeen(query.GetSenderRouteId().GetAgentId(), timestamp);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::C3::Core::GateRelay::CollectMetrics()
+{
+	MetricsEndpoint::Writer writer;
+
+	// Gather the network shape under the Profile lock. Counters of Devices are read without it.
+	std::size_t activeRelays = 0, inactiveRelays = 0, bannedRelays = 0;
+	std::vector<std::pair<std::string, std::size_t>> relayRoutes;
+	{
+		auto profile = m_Profiler->Get();
+		for (auto const& agent : std::as_const(profile.m_Gateway.m_Agents).GetUnderlyingContainer())
+		{
+			++(agent.IsActive() ? activeRelays : inactiveRelays);
+			bannedRelays += agent.m_IsBanned;
+			relayRoutes.emplace_back(agent.m_Id.ToString(), agent.m_Routes.GetUnderlyingContainer().size());
+		}
+	}
+
+	writer.Family("c3_relays", "gauge", "Relays known to the Gateway.")
+		.Sample(activeRelays, { { "state", "active" } })
+		.Sample(inactiveRelays, { { "state", "inactive" } });
+	writer.Family("c3_banned_relays", "gauge", "Relays banned by the operator.").Sample(bannedRelays);
+	writer.Family("c3_gateway_routes", "gauge", "Size of the Gateway's Route table.").Sample(GetRoutesCount());
+	writer.Family("c3_relay_routes", "gauge", "Size of Relay's Route table, as known to the Gateway.");
+	for (auto const& [agentId, routes] : relayRoutes)
+		writer.Sample(routes, { { "agent_id", agentId } });
+
+	// Traffic of Gateway's own Channels.
+	std::vector<std::shared_ptr<DeviceBridge>> channels;
+	{
+		std::shared_lock lock(m_DevicesMutex);
+		for (auto const& [did, device] : m_Devices)
+			if (auto channel = device.lock(); channel && channel->IsChannel())
+				channels.push_back(std::move(channel));
+	}
+
+	std::vector<std::pair<std::string, DeviceBridge::Metrics>> channelMetrics;
+	for (auto const& channel : channels)
+		channelMetrics.emplace_back(channel->GetDid().ToString(), channel->GetMetrics());
+
+	auto addChannelFamily = [&](std::string_view name, std::string_view help, auto member)
+	{
+		writer.Family(name, "counter", help);
+		for (auto const& [did, metrics] : channelMetrics)
+			writer.Sample(metrics.*member, { { "channel", did } });
+	};
+	addChannelFamily("c3_channel_received_bytes_total", "Bytes received by the Channel.", &DeviceBridge::Metrics::m_BytesIn);
+	addChannelFamily("c3_channel_received_packets_total", "Packets received by the Channel.", &DeviceBridge::Metrics::m_PacketsIn);
+	addChannelFamily("c3_channel_sent_bytes_total", "Bytes sent through the Channel.", &DeviceBridge::Metrics::m_BytesOut);
+	addChannelFamily("c3_channel_sent_packets_total", "Packets sent through the Channel.", &DeviceBridge::Metrics::m_PacketsOut);
+	addChannelFamily("c3_channel_resent_chunks_total", "Chunks sent through the Channel again.", &DeviceBridge::Metrics::m_Resends);
+	addChannelFamily("c3_channel_exceptions_total", "Exceptions thrown by the Channel.", &DeviceBridge::Metrics::m_Exceptions);
+
+	writer.Family("c3_channel_outbound_queue_depth", "gauge", "Packets waiting to be sent through the Channel.");
+	for (auto const& channel : channels)
+		writer.Sample(channel->GetOutboundQueueDepth(), { { "channel", channel->GetDid().ToString() } });
+
+	// Gateway's own load.
+	writer.Family("c3_api_bridge_queue_depth", "gauge", "Controller messages waiting to be handled.").Sample(m_ApiBridgeExecutor->GetQueueDepth());
+
+	auto snapshots = m_Profiler->GetSnapshotStatistics();
+	writer.Family("c3_snapshots_total", "counter", "Profile snapshots built.").Sample(snapshots.m_Count);
+	writer.Family("c3_snapshot_build_seconds_total", "counter", "Time spent building Profile snapshots.").Sample(std::chrono::duration<double>{ snapshots.m_Total }.count());
+	writer.Family("c3_last_snapshot_build_seconds", "gauge", "Time of building the last Profile snapshot.").Sample(std::chrono::duration<double>{ snapshots.m_Last }.count());
+
+	writer.Family("c3_crypto_operations_total", "counter", "Cryptographic operations on packets.")
+		.Sample(m_LockedPacketsCount.load(), { { "operation", "network_encrypt" } })
+		.Sample(m_UnlockedPacketsCount.load(), { { "operation", "network_decrypt" } })
+		.Sample(m_DecryptedS2GPacketsCount.load(), { { "operation", "s2g_decrypt" } });
+
+	writer.Family("c3_dropped_log_messages_total", "counter", "Log messages dropped because the logger could not keep up.")
+		.Sample(GetDroppedLogsCount());
+
+	// Locks are profiled only if configured. Sites register when their mutexes are created.
+	if (LockProfiling::g_SampleInterval.load(std::memory_order_relaxed))
+	{
+		auto locks = LockProfiling::GetStatistics();
+		auto addLockFamily = [&](std::string_view name, std::string_view help, auto value)
+		{
+			writer.Family(name, "counter", help);
+			for (auto const& site : locks)
+				writer.Sample(value(site), { { "site", site.m_Name } });
+		};
+		addLockFamily("c3_lock_acquisitions_total", "Acquisitions of mutexes of the lock site.", [](auto const& site) { return site.m_Acquisitions; });
+		addLockFamily("c3_lock_contentions_total", "Acquisitions that waited for another thread.", [](auto const& site) { return site.m_Contentions; });
+		addLockFamily("c3_lock_wait_seconds_total", "Time spent waiting in contended acquisitions.", [](auto const& site) { return std::chrono::duration<double>{ site.m_WaitTime }.count(); });
+		addLockFamily("c3_lock_hold_samples_total", "Exclusive acquisitions which hold time was measured.", [](auto const& site) { return site.m_HoldSamples; });
+		addLockFamily("c3_lock_sampled_hold_seconds_total", "Hold time of sampled acquisitions. Divided by samples, gives average hold time.", [](auto const& site) { return std::chrono::duration<double>{ site.m_SampledHoldTime }.count(); });
+	}
+
+	// Allocations are counted only by instrumented builds.
+	if constexpr (AllocationTracking::IsEnabled)
+	{
+		auto allocations = AllocationTracking::Get();
+		auto addAllocationFamily = [&](std::string_view name, std::string_view help, auto member)
+		{
+			writer.Family(name, "counter", help);
+			for (size_t i = 0; i < allocations.size(); ++i)
+				writer.Sample(allocations[i].*member, { { "subsystem", AllocationTracking::GetName(static_cast<AllocationTracking::Subsystem>(i)) } });
+		};
+		addAllocationFamily("c3_allocations_total", "Heap allocations made by a subsystem of the packet pipeline.", &AllocationTracking::Counters::m_Allocations);
+		addAllocationFamily("c3_allocated_bytes_total", "Bytes allocated by a subsystem of the packet pipeline.", &AllocationTracking::Counters::m_Bytes);
+	}
 
-	m_Profiler->Get().m_Gateway.UpdateRouteTimestamps(query.GetSenderRouteId().GetAgentId(), timestamp);
+	return writer.GetText();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-nlohmann::json FSecure::C3::Core::GateRelay::HandleMessage(nlohmann::json const& message)
+void FSecure::C3::Core::GateRelay::On(ProceduresS2G::TraceReport query)
 {
-	auto messageType = message.at("MessageType").get<std::string>();
-	auto sequenceNumber = message.value("SequenceNumber", 0ul);
-	auto const& messageData = message.at("MessageData");
+	auto receivedAt = std::chrono::steady_clock::now();
+	auto decryptedPacket = DecryptS2G(query.GetQueryPacket());
+	auto readView = ByteView{ decryptedPacket };
+	auto [unsusedProcedureNo, unusedSenderRouteId, timestamp, traceId] = readView.Read<ProceduresUnderlyingType, RouteId, int32_t, std::uint32_t>();
+	auto downstream = TraceContext::ReadHops(readView);
+
+	// Relays between the recipient and Gateway appended their hops to the report's own trace context.
+	auto upstream = GetCurrentTrace() ? GetCurrentTrace()->m_Hops : std::vector<TraceContext::Hop>{};
+	auto agentId = query.GetSenderRouteId().GetAgentId();
+	m_Profiler->UpdateLastSeen(agentId, timestamp);
+
+	std::lock_guard lock{ m_CommandTracingMutex };
+	auto pending = m_PendingTraces.find(traceId);
+	if (pending == m_PendingTraces.end())
+		return Log({ "Received report of unknown or expired trace from agent " + agentId.ToString() + ".", FSecure::C3::LogMessage::Severity::Warning });
+
+	if (pending->second.m_AgentId != agentId)
+		throw std::runtime_error{ "Received report of trace " + std::to_string(traceId) + " from wrong agent " + agentId.ToString() + "." };
+
+	// Whatever wasn't spent in Relays was spent in Channels, including their polling delays.
+	auto roundTrip = std::chrono::duration_cast<std::chrono::microseconds>(receivedAt - pending->second.m_SentAt);
+	auto& latency = m_CommandLatencies[agentId];
+	auto channelTime = roundTrip;
+	latency.m_Path.clear();
+	for (auto const& hop : downstream)
+	{
+		auto& hopLatency = latency.m_Hops[hop.m_AgentId];
+		++hopLatency.m_Count;
+		hopLatency.m_Downstream += std::chrono::microseconds{ hop.m_ResidenceUs };
+		channelTime -= std::chrono::microseconds{ hop.m_ResidenceUs };
+		latency.m_Path.push_back(hop.m_AgentId);
+	}
+
+	for (auto const& hop : upstream)
+	{
+		latency.m_Hops[hop.m_AgentId].m_Upstream += std::chrono::microseconds{ hop.m_ResidenceUs };
+		channelTime -= std::chrono::microseconds{ hop.m_ResidenceUs };
+	}
+
+	++latency.m_Count;
+	latency.m_GatewayTime += pending->second.m_GatewayTime;
+	latency.m_RoundTrip += roundTrip;
+	latency.m_MaxRoundTrip = std::max(latency.m_MaxRoundTrip, roundTrip);
+	latency.m_ChannelTime += std::max(channelTime, std::chrono::microseconds{});
+	m_PendingTraces.erase(pending);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::Core::GateRelay::EncodeApiBridgeMessages(std::vector<ByteVector> messages, std::uint8_t bridgeProtocol, DuplexConnection::Priority priority) const
+{
+	// Key exchange is sent as it is.
+	if (!bridgeProtocol)
+		return messages;
+
+	// Controller that doesn't support batches gets every message in its own frame.
+	if (bridgeProtocol < s_ApiBridgeProtocolVersion)
+	{
+		for (auto& message : messages)
+			message = Crypto::Encrypt(message, m_SessionKeys.second, m_SessionSuite);
+
+		return messages;
+	}
+
+	// Batch: [version][flags][size-prefixed messages, compressed if it pays off].
+	ByteVector batch;
+	for (auto const& message : messages)
+		batch.Write(ByteView{ message });
+
+	std::uint8_t flags = priority == DuplexConnection::Priority::Normal ? NormalPriority : 0;
+	if (batch.size() >= s_ApiBridgeCompressionThreshold && Compression::IsCompressible(batch))
+		if (auto compressed = Compression::Compress<Compression::Deflate>(batch); compressed.size() < batch.size())
+		{
+			batch = std::move(compressed);
+			flags |= Compressed;
+		}
+
+	// Big batch is split, every fragment is encrypted on its own. Controller concatenates fragments of one lane until the one without MoreFragments flag.
+	std::vector<ByteVector> frames;
+	for (auto rest = ByteView{ batch }; frames.empty() || !rest.empty();)
+	{
+		auto fragment = rest.SubString(0, s_ApiBridgeFragmentSize);
+		rest.remove_prefix(fragment.size());
+		auto frame = ByteVector{}.Write(s_ApiBridgeProtocolVersion, static_cast<std::uint8_t>(rest.empty() ? flags : flags | MoreFragments)).Concat(fragment);
+		frames.push_back(Crypto::Encrypt(frame, m_SessionKeys.second, m_SessionSuite));
+	}
+
+	return frames;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::Core::GateRelay::DecodeApiBridgeFrame(ByteView frame, bool& isBatch) const
+{
+	// Single messages are JSON objects, batches start with protocol version. Cipher is detected from the frame, because Controller may switch it before Gateway does.
+	auto decrypted = Crypto::Decrypt(frame, m_SessionKeys.first);
+	isBatch = !decrypted.empty() && decrypted[0] == s_ApiBridgeProtocolVersion;
+	if (!isBatch)
+		return { std::move(decrypted) };
+
+	auto header = ByteView{ decrypted }.SubString(1);
+	auto flags = header.Read<std::uint8_t>();
+	if (flags & MoreFragments)
+		throw std::runtime_error{ OBF("Fragmented API bridge batches are not supported.") };
+
+	auto body = flags & Compressed ? Compression::Decompress<Compression::Deflate>(header) : ByteVector{ header };
+
+	std::vector<ByteVector> messages;
+	for (auto view = ByteView{ body }; !view.empty();)
+		messages.emplace_back(view.Read<ByteView>());
+
+	return messages;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string FSecure::C3::Core::GateRelay::GetSessionCiphers()
+{
+	// Legacy cipher is not listed. Controller keeps using it if it doesn't support any of listed ones.
+	auto ciphers = json::array();
+	for (auto suite : { Crypto::AeadSuite::Aes256Gcm, Crypto::AeadSuite::XChaCha20Poly1305 })
+		if (Crypto::IsAvailable(suite))
+			ciphers.push_back(Crypto::GetName(suite));
+
+	return ciphers.dump();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::GateRelay::QueueMessage(ByteVector message, DuplexConnection& connection)
+{
+	// Actions addressed to one Agent must be handled in order. Actions addressed to Gateway have null relayAgentId and share one key.
+	auto fields = JsonObjectView{ ByteView{ message } };
+	auto messageType = fields.Get<std::string>("MessageType");
+	auto isAction = messageType == "Action" || messageType == "BulkAction";
+	auto orderingKey = messageType;
+	if (isAction)
+		if (auto relayAgentId = JsonObjectView{ fields.At("MessageData") }.Find("relayAgentId"); relayAgentId && relayAgentId->front() == '"')
+			orderingKey = json::parse(relayAgentId->begin(), relayAgentId->end()).get<std::string>();
+
+	m_ApiBridgeExecutor->Post(std::move(orderingKey), isAction ? TaskExecutor::Priority::Normal : TaskExecutor::Priority::High, [this, &connection, message = std::move(message), queuedAt = std::chrono::steady_clock::now()]()
+	{
+		// Traced commands report the time spent in the queue as part of Gateway's time.
+		g_MessageQueuedAt = queuedAt;
+		SCOPE_GUARD( g_MessageQueuedAt.reset(); );
+		try
+		{
+			auto response = HandleMessage(ByteView{ message });
+			if (!response.is_null())
+				connection.Send(ByteView{ response.dump() });
+		}
+		catch (std::exception& exception)
+		{
+			Log({ "Caught an exception while processing message from Controller. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+		}
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+nlohmann::json FSecure::C3::Core::GateRelay::HandleMessage(std::string_view message)
+{
+	EventTracing::Scope<EventTracing::Keyword::Gateway> tracingScope{ "GateRelay::HandleMessage", message.size() };
+
+	// Only the envelope is parsed here. Handlers parse MessageData, and Actions are passed further as text.
+	auto fields = JsonObjectView{ message };
+	auto messageType = fields.Get<std::string>("MessageType");
+	auto sequenceNumber = fields.Value("SequenceNumber", 0ul);
+	auto messageData = fields.At("MessageData");
 
 	json commandResponse;
 	std::optional<std::string> error;
@@ -489,16 +1851,40 @@ nlohmann::json FSecure::C3::Core::GateRelay::HandleMessage(nlohmann::json const&
 	{
 		if (messageType == "Action")
 		{
-			m_Profiler->HandleActionsPacket(ByteView{ messageData.dump() });
+			m_Profiler->HandleActionsPacket(ByteView{ messageData });
 			return {};
 		}
+		else if (messageType == "BulkAction")
+		{
+			commandResponse = m_Profiler->HandleBulkActionsPacket(json::parse(messageData.begin(), messageData.end()));
+		}
 		else if (messageType == "NewBuild")
 		{
-			commandResponse = m_Profiler->HandleNewBuildMessage(messageData);
+			commandResponse = m_Profiler->HandleNewBuildMessage(json::parse(messageData.begin(), messageData.end()));
+		}
+		else if (messageType == "ProfileEncoding")
+		{
+			if (auto encoding = JsonObjectView{ messageData }.Get<std::string>("Encoding"); encoding == "cbor" || encoding == "json")
+				m_IsCborProfileEnabled = encoding == "cbor";
+			else
+				throw std::invalid_argument{ "Unsupported profile encoding: " + encoding + '.' };
+		}
+		else if (messageType == "SessionCipher")
+		{
+			// Frames that are already queued are sent with previous cipher. Controller detects it from every frame.
+			auto suite = Crypto::ParseAeadSuite(JsonObjectView{ messageData }.Get<std::string>("Cipher"));
+			if (!Crypto::IsAvailable(suite))
+				throw std::invalid_argument{ "Session cipher " + Crypto::GetName(suite) + " is not available on this CPU." };
+
+			m_SessionSuite = suite;
+		}
+		else if (messageType == "ProfileSubscription")
+		{
+			SetProfileSubscription(messageData);
 		}
 		else if (messageType == "Error")
 		{
-			Log({ "Controller error: " + messageData.at("Message").get<std::string>(), LogMessage::Severity::Error });
+			Log({ "Controller error: " + JsonObjectView{ messageData }.Get<std::string>("Message"), LogMessage::Severity::Error });
 		}
 	}
 	catch (std::exception& e)
@@ -526,7 +1912,7 @@ nlohmann::json FSecure::C3::Core::GateRelay::HandleMessage(nlohmann::json const&
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::GateRelay::CloseDevicesAndConnectors()
 {
-	Relay::Close();
+	DetachAllDevices();
 
 	m_Connectors.For([](auto c)
 	{
@@ -534,6 +1920,11 @@ void FSecure::C3::Core::GateRelay::CloseDevicesAndConnectors()
 		return true;
 	});
 
+	{
+		std::unique_lock lock{ m_ConnectorsByHashMutex };
+		m_ConnectorsByHash.clear();
+	}
+
 	m_Connectors.Clear();
 }
 
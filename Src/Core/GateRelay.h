@@ -1,6 +1,9 @@
 #pragma once
 
 #include "Relay.h"
+#include "TaskExecutor.h"
+#include "LockProfiling.h"
+#include "Common/FSecure/CppTools/SafeSmartPointerContainer.h"
 #include "Common/FSecure/C3/Internals/BackendCommons.h"
 #include "Common/FSecure/Sockets/Sockets.hpp"
 #include "Common/json/json.hpp"
@@ -10,6 +13,16 @@ namespace FSecure::C3::Core
 	// Forward declarations.
 	struct Profiler;
 	struct ConnectorBridge;
+	class MetricsEndpoint;
+
+	/// Worker pools of a Gateway. @see ThreadPoolSettings.
+	struct GatewayWorkerPools
+	{
+		ThreadPoolSettings m_Devices{ Scheduler::s_DefaultWorkerCount };												///< Scheduler threads updating Channels. If number of threads is 0, every Device is updated in its own thread.
+		ThreadPoolSettings m_ApiBridge{ TaskExecutor::s_DefaultWorkerCount };											///< Threads handling messages from Controller.
+		ThreadPoolSettings m_Negotiation{ TaskExecutor::s_DefaultWorkerCount };											///< Threads opening negotiated channels.
+		ThreadPoolSettings m_ConnectorStartup{ TaskExecutor::s_DefaultWorkerCount };									///< Threads building Connectors that are being turned on.
+	};
 
 	/// Relay class specialization that implements a "server" Relay.
 	struct GateRelay : Relay, ProceduresG2X::RequestHandler
@@ -20,6 +33,9 @@ namespace FSecure::C3::Core
 		/// Destructor
 		virtual ~GateRelay() = default;
 
+		/// Last-seen timestamps of Agents are written to the Profile with this period if not configured otherwise.
+		static constexpr std::chrono::milliseconds s_DefaultLastSeenFlushInterval = 5s;
+
 		/// Factory method.
 		/// @param callbackOnLog callback fired whenever a new Log entry is being added.
 		/// @param interfaceFactory reference to interface factory.
@@ -31,14 +47,22 @@ namespace FSecure::C3::Core
 		/// @param snapshotPath path to json file with current state of network. Used in case of gateway restart.
 		/// @param agentId Agent identifier.
 		/// @param name optional name provided for gateway.
+		/// @param workerPools number and placement of threads of Gateway's worker pools.
+		/// @param qosSettings Quality of Service settings of each Channel.
+		/// @param lastSeenFlushInterval how often last-seen timestamps of Agents are written to the Profile.
+		/// @param reportDeviceMetrics whether traffic counters of Gateway's Channels are added to the Profile.
+		/// @param metricsEndpoint URL on which metrics are served in Prometheus format, e.g. http://127.0.0.1:9464/metrics. Empty if metrics are not served.
 		static std::shared_ptr<GateRelay> CreateAndRun(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, std::string_view apiBridgeIp,
 			std::uint16_t apiBrigdePort, FSecure::Crypto::SignatureKeys const& signatures, FSecure::Crypto::SymmetricKey const& broadcastKey, FSecure::C3::BuildId buildId, std::filesystem::path snapshotPath,
-			FSecure::C3::AgentId agentId = FSecure::C3::AgentId::GenerateRandom(), std::string name = "");
+			FSecure::C3::AgentId agentId = FSecure::C3::AgentId::GenerateRandom(), std::string name = "", GatewayWorkerPools const& workerPools = {},
+			QualityOfService::Settings const& qosSettings = {}, std::chrono::milliseconds lastSeenFlushInterval = s_DefaultLastSeenFlushInterval, bool reportDeviceMetrics = false,
+			std::string const& metricsEndpoint = "");
 
-		/// Turns on specified Connector.
+		/// Turns on specified Connector. Connector is added to the Profile at once and built on m_ConnectorStartupExecutor, as constructors of Connectors log in to C2 servers.
+		/// Failure to build it is reported as the error of the Connector in the Profile. Connector that failed can be turned on again.
 		/// @param connectorNameHash hash value of Connector's name.
 		/// @param commandLine buffer containing Connector's construction parameters.
-		/// @throws std::runtime_error if couldn't find factory for specified Connector name hash or if factory was unable to process provided command-line. Throws std::invalid_argument if specified Connector is already turned on.
+		/// @throws std::runtime_error if couldn't find factory for specified Connector name hash. Throws std::invalid_argument if specified Connector is already turned on or is starting.
 		virtual void TurnOnConnector(HashT connectorNameHash, ByteView commandLine);
 
 		/// Turns off specified Connector.
@@ -51,11 +75,66 @@ namespace FSecure::C3::Core
 		/// @return Connector pointer if found or null.
 		std::shared_ptr<FSecure::C3::Core::ConnectorBridge> GetConnector(HashT connectorNameHash);
 
-		/// Called whenever an attached Binder Connector wants to send a Command to its Peripheral Binder.
+		/// Called whenever an attached Binder Connector wants to send a Command to its Peripheral Binder. Commands for Agents that can't be reached wait until they check in. @see QueueAgentCommand.
 		/// @param command full Command with arguments.
 		/// @param routeId address to peripheral.
 		virtual void PostCommandToPeripheral(ByteView command, RouteId routeId);
 
+		/// Checks whether the Route to a Peripheral has credits, i.e. whether its first Channel can queue a command without blocking the caller.
+		/// @param routeId address to peripheral.
+		/// @return false if commands to the Peripheral would wait for the Channel. True if the Route is unknown, so that posting reports the error.
+		bool CanPostCommandToPeripheral(RouteId routeId);
+
+		/// Drops cached delivery contexts, so that the next command from a Connector reads Route and key of its Agent again. Called whenever Agents are added or removed.
+		/// Route changes don't need it, because contexts are tied to the version of the Route table.
+		void InvalidateDeliveryContexts();
+
+		/// Drops cached answers of IsAgentConnected. Called by Profiler whenever Agents or Routes are removed, or GRC of an Agent changes.
+		void InvalidateConnectedAgents();
+
+		/// Replaces the set of banned Agents checked for every N2N packet. Called by Profiler whenever Agents are added or removed.
+		/// @param bannedAgents identifiers of banned Agents.
+		void SetBannedAgents(std::unordered_set<AgentId::UnderlyingIntegerType> bannedAgents);
+
+		/// Sets how often commands sent to Agents are traced.
+		/// @param interval every interval-th command is traced. Zero turns tracing off.
+		void SetCommandTracingInterval(std::uint32_t interval);
+
+		/// Gets latency breakdown of traced commands.
+		/// @return per-Agent statistics, null if tracing is off and no command was traced.
+		nlohmann::json GetCommandTracingReport() const;
+
+		/// Sets whether commands sharing the first hop are sent in Multicast envelopes. All Relays of the network must support Multicast protocol.
+		/// @param isEnabled true to send envelopes, false to send every command separately.
+		void SetMulticast(bool isEnabled);
+
+		/// Sets whether commands composed together for one Agent are sent in one RunCommandsOnAgentQuery. All Relays of the network must support the query.
+		/// @param isEnabled true to send compound queries, false to send every command separately.
+		void SetCompoundCommands(bool isEnabled);
+
+		/// Sets whether Connectors turned on from now on run in separate processes. @see ConnectorHost::OutOfProcessConnector.
+		/// @param isEnabled true to host every Connector in its own process, false to run them inside Gateway.
+		void SetOutOfProcessConnectors(bool isEnabled);
+
+		/// Metric of the Route that commands to an Agent are sent through, if the Agent is reachable through more than one.
+		enum class RoutePreference : std::uint8_t
+		{
+			None,																									///< Any Route to the Agent is used. Recommended Routes are only reported in the Profile.
+			Latency,																								///< Route with the lowest latency.
+			Bandwidth,																								///< Route with the highest throughput.
+		};
+
+		/// Sets which Routes Profiler chooses for commands to Agents. @see Profiler::Gateway::UpdatePreferredRoutes.
+		/// @param preference metric to optimize.
+		void SetRoutePreference(RoutePreference preference);
+
+		/// @return metric optimized by Routes chosen for commands to Agents.
+		RoutePreference GetRoutePreference() const;
+
+		/// Replaces Routes used for commands to Agents. Agents missing in the map are reached through any of their Routes, as are those whose preferred Route is removed.
+		/// @param preferredRoutes Routes by Agent, chosen by Profiler.
+		void SetPreferredRoutes(std::unordered_map<AgentId::UnderlyingIntegerType, RouteId> preferredRoutes);
+
 	protected:
 		/// Protected ctor.
 		/// @param callbackOnLog callback fired whenever a new Log entry is being added.
@@ -67,8 +146,13 @@ namespace FSecure::C3::Core
 		/// @param buildId Build identifier.
 		/// @param snapshotPath path to json file with current state of network. Used in case of gateway restart.
 		/// @param agentId Agent identifier.
+		/// @param workerPools number and placement of threads of Gateway's worker pools.
+		/// @param qosSettings Quality of Service settings of each Channel.
+		/// @param lastSeenFlushInterval how often last-seen timestamps of Agents are written to the Profile.
+		/// @param reportDeviceMetrics whether traffic counters of Gateway's Channels are added to the Profile.
 		GateRelay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, std::string_view abiBridgeIp, std::uint16_t apiBrigdePort,
-			FSecure::Crypto::SignatureKeys const& signatures, FSecure::Crypto::SymmetricKey const& broadcastKey, FSecure::C3::BuildId buildId, std::filesystem::path snapshotPath, FSecure::C3::AgentId agentId = FSecure::C3::AgentId::GenerateRandom());
+			FSecure::Crypto::SignatureKeys const& signatures, FSecure::Crypto::SymmetricKey const& broadcastKey, FSecure::C3::BuildId buildId, std::filesystem::path snapshotPath, FSecure::C3::AgentId agentId = FSecure::C3::AgentId::GenerateRandom(),
+			GatewayWorkerPools const& workerPools = {}, QualityOfService::Settings const& qosSettings = {}, std::chrono::milliseconds lastSeenFlushInterval = s_DefaultLastSeenFlushInterval, bool reportDeviceMetrics = false);
 
 		/// Close Gateway.
 		void Close() override;
@@ -87,25 +171,47 @@ namespace FSecure::C3::Core
 		/// @param agentId ID of the Agent to check.
 		bool IsAgentBanned(AgentId agentId) override;
 
+		/// Interprets packets received at once through a Channel.
+		/// Packets are unlocked and S2G ones are decrypted in parallel, then packets are handled in order of arrival, so order of packets of every route is kept.
+		/// @param packets full C3 packets to interpret, in order of arrival.
+		/// @param sender Interface passing the packets.
+		void OnPacketsReceived(std::vector<ByteView> const& packets, std::shared_ptr<DeviceBridge> const& sender) override;
+
 		/// Fired when a S2G protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		void OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> sender) override;
+		void OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
 
 		/// Fired when a G2A protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		void OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> sender) override;
+		void OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
 
 		/// Fired when a G2R protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		void OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> sender) override;
+		void OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
+
+		/// Fired when a Multicast protocol packet arrives.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		void OnProtocolMulticast(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
+
+		/// Fired when a Striped protocol packet arrives. Handles S2G packet once all its fragments arrived.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		void OnProtocolStriped(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
 
 		/// Called whenever an attached Binder Peripheral wants to send a Command to its Connector Binder.
 		/// @param command full Command with arguments.
 		/// @param senderPeripheral Interface that is sending the Command.
-		void PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> senderPeripheral) override;
+		void PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> const& senderPeripheral) override;
+
+		/// Called whenever an attached Binder Peripheral streams a long Command to its Connector Binder in parts. Connector receives the Command once all parts arrived.
+		/// @param segment part of the Command.
+		/// @param position position of segment in the Command.
+		/// @param senderPeripheral Interface that is sending the Command.
+		void PostCommandSegmentToConnector(ByteView segment, BinderSegment const& position, std::shared_ptr<DeviceBridge> const& senderPeripheral) override;
 
 		/// Expose all base classes `On` methods.
 		using ProceduresG2X::RequestHandler::On;
@@ -120,7 +226,7 @@ namespace FSecure::C3::Core
 		void On(ProceduresS2G::InitializeRouteQuery query) override;
 
 		/// Handler fired when a N2N::ChannelIdExchangeStep1 Procedure Query arrives.
-		/// Gateway opens a new channel and sends parameters to relay.
+		/// Gateway opens a new channel and sends parameters to relay. Channel is opened on m_NegotiationExecutor, so that requests of other relays sharing the negotiation channel are not held up.
 		/// @param query object representing the Query.
 		void On(ProceduresN2N::ChannelIdExchangeStep1) override;
 
@@ -146,6 +252,27 @@ namespace FSecure::C3::Core
 		/// @remarks Current implementation supports only timestamp. Notification can be extended to send variety of data about relay state.
 		void On(ProceduresS2G::Notification query) override;
 
+		/// Handler fired when a S2G::TraceReport Procedure Query arrives.
+		/// @param query object representing the Query.
+		void On(ProceduresS2G::TraceReport query) override;
+
+		/// Handler fired when a S2G::CachedArgumentsMissing Procedure Query arrives.
+		/// @param query object representing the Query.
+		void On(ProceduresS2G::CachedArgumentsMissing query) override;
+
+		/// Handler fired when a N2N::ResumeRouteQuery Procedure Query arrives. Profile of the relay is kept, only its Route is added again.
+		/// @param query object representing the Query.
+		void On(ProceduresN2N::ResumeRouteQuery query) override;
+
+		/// Handler fired when a N2N::ResumeRouteRejected Procedure Query arrives.
+		/// @param query object representing the Query.
+		/// @remarks Gateway never holds a resumption token.
+		void On(ProceduresN2N::ResumeRouteRejected query) override;
+
+		/// Handler fired when a S2G::ResumeRouteQuery Procedure Query arrives. Profile of the relay is kept, only its Route is added again.
+		/// @param query object representing the Query.
+		void On(ProceduresS2G::ResumeRouteQuery query) override;
+
 		/// Detaches an Device. This operation leads to (delayed) destruction of the Device.
 		/// @param iidOfDeviceToDetach ID of the Device to detach.
 		/// @throw std::invalid_argument on an attempt of removal of a non-existent Device.
@@ -160,23 +287,338 @@ namespace FSecure::C3::Core
 		void Reset();
 
 	private:
+		/// Every n-th Profile update is sent to the Controller as a full Profile, others are sent as deltas.
+		static constexpr std::uint64_t s_FullProfileInterval = 100;
+
+		/// Version of API bridge protocol that sends batches of messages in one frame.
+		static constexpr std::uint8_t s_ApiBridgeProtocolVersion = 2;
+
+		/// Batches of API bridge messages smaller than this are not compressed.
+		static constexpr std::size_t s_ApiBridgeCompressionThreshold = 1024;
+
+		/// Bigger batches are split into fragments of this size, so that high priority messages can be sent between them.
+		static constexpr std::size_t s_ApiBridgeFragmentSize = 64 * 1024;
+
+		/// Traced commands that weren't reported for this long are forgotten.
+		static constexpr std::chrono::seconds s_TraceTimeout = 60s;
+
+		/// No more commands are traced while that many wait for reports.
+		static constexpr std::size_t s_MaxPendingTraces = 1024;
+
+		/// Maximal number of S2G packets waiting for the Profile to be restored. Further packets of unknown Agents are dropped.
+		static constexpr std::size_t s_MaxDeferredS2GPackets = 4096;
+
+		/// API bridge checks for Profile updates this often. Subscriptions can't ask for more frequent updates.
+		static constexpr std::chrono::milliseconds s_ProfileCheckInterval = 300ms;
+
+		/// Streamed Commands that got no segment for this long are forgotten.
+		static constexpr std::chrono::minutes s_StreamedCommandTimeout = 10min;
+
+		/// Maximal total size of streamed Commands being reassembled. Segments of further Commands are rejected.
+		static constexpr std::size_t s_MaxStreamedCommandsSize = 512 * 1024 * 1024;
+
+		/// Maximal number of commands waiting for one Agent to check in. Further commands are rejected.
+		static constexpr std::size_t s_MaxQueuedAgentCommands = 1024;
+
+		/// Resumption tokens older than this are rejected, so that relays register in full now and then.
+		static constexpr std::chrono::hours s_ResumptionTokenLifetime = 7 * 24h;
+
+		/// Part of the Profile that Controller keeps in sync with, chosen with ProfileSubscription message.
+		struct ProfileSubscription
+		{
+			/// Part of the Profile.
+			enum class Scope : std::uint8_t
+			{
+				Network,																						///< Whole Profile.
+				Agent,																							///< Profiles of one Agent and of Agents reached through it.
+				Counters,																						///< Traffic and Quality of Service counters of Gateway's own Channels.
+				None,																							///< Nothing. Profile is not built for Controller at all.
+			};
+
+			Scope m_Scope = Scope::Network;																			///< Subscribed part.
+			AgentId m_AgentId;																						///< Root of the subtree, if m_Scope is Scope::Agent.
+			std::chrono::milliseconds m_Interval = s_ProfileCheckInterval;											///< Minimal time between updates.
+		};
+
+		/// Traced command waiting for TraceReport.
+		struct PendingTrace
+		{
+			AgentId m_AgentId;																						///< Recipient of the command.
+			std::chrono::steady_clock::time_point m_SentAt;															///< Time of sending the command.
+			std::chrono::microseconds m_GatewayTime;																///< Time between arrival of the command at Gateway and sending it.
+		};
+
+		/// Latency breakdown of traced commands sent to one Agent.
+		struct CommandLatency
+		{
+			/// Time spent by one Relay on the Route.
+			struct Hop
+			{
+				std::uint64_t m_Count = 0;																		///< Number of traces passing the Relay.
+				std::chrono::microseconds m_Downstream{};														///< Total residence time of commands.
+				std::chrono::microseconds m_Upstream{};															///< Total residence time of reports.
+			};
+
+			std::uint64_t m_Count = 0;																				///< Number of reported traces.
+			std::chrono::microseconds m_GatewayTime{};																///< Total time of commands in Gateway.
+			std::chrono::microseconds m_RoundTrip{};																///< Total time between sending commands and receiving reports.
+			std::chrono::microseconds m_MaxRoundTrip{};																///< Longest round trip.
+			std::chrono::microseconds m_ChannelTime{};																///< Total part of round trips not spent in Relays.
+			std::vector<AgentId> m_Path;																			///< Relays passing the last traced command, ending with the recipient.
+			std::map<AgentId, Hop> m_Hops;																			///< Residence times of Relays.
+		};
+
+		/// Everything needed to send a command from a Connector to an Agent, cached so that commands don't take the Profiler lock.
+		struct DeliveryContext
+		{
+			std::uint64_t m_RoutesVersion;																			///< Version of the Route table the context was made of.
+			RouteId m_RouteId;																						///< Route leading to the Agent.
+			std::weak_ptr<DeviceBridge> m_Channel;																	///< First hop of the Route.
+			FSecure::Crypto::SharedKey m_SharedKey;																	///< Key shared with the Agent.
+		};
+
+		/// Command streamed by a Peripheral in segments, being reassembled for its Connector.
+		struct StreamedCommand
+		{
+			ByteVector m_Command;																				///< Whole Command, filled as segments arrive.
+			std::map<std::uint32_t, std::uint32_t> m_Segments;													///< Sizes of segments received so far by their positions, so that repeated ones are ignored.
+			std::uint32_t m_ReceivedSize = 0;																	///< Number of bytes received so far.
+			std::chrono::steady_clock::time_point m_LastSegmentAt;												///< Time of arrival of the last segment.
+		};
+
+		/// Command waiting for an unreachable Agent to check in.
+		struct QueuedAgentCommand
+		{
+			std::optional<DeviceId> m_DeviceId;																	///< Device running the command or receiving the message. If not set, command is run by the Agent itself.
+			ByteVector m_Command;																				///< Command with its arguments, or message from a Connector.
+			bool m_IsForBinder = false;																			///< Set for messages from Connectors, which are delivered to Peripherals instead of being run.
+		};
+
+		/// Flags of API bridge batch frame.
+		enum ApiBridgeFrameFlags : std::uint8_t
+		{
+			Compressed = 1 << 0,																					///< Batch is compressed.
+			MoreFragments = 1 << 1,																					///< Frame is a fragment of batch, which is continued in next frame of the same lane.
+			NormalPriority = 1 << 2,																				///< Frame belongs to the lane of normal priority messages.
+		};
+
 		/// Run API bridge
 		/// @param apiBridgeIp IP address to set up API bridge on.
 		/// @param apiBridgePort port to set up API bridge on.
 		void RunApiBrige(std::string_view apiBrigdeIp, std::uint16_t apiBrigdePort) noexcept;
 
 		/// Called when new message from Controller is received.
-		/// Unpacks and schedules actions from message.
-		nlohmann::json HandleMessage(nlohmann::json const& message);
+		/// Unpacks and schedules actions from message. Only the envelope and members needed by the handler are parsed.
+		/// @param message message text.
+		/// @return response to send to Controller, null if none is expected.
+		nlohmann::json HandleMessage(std::string_view message);
+
+		/// Parses ProfileSubscription message and makes RunApiBrige follow it.
+		/// @param messageData MessageData member of the message.
+		/// @throws std::invalid_argument if scope is unknown.
+		void SetProfileSubscription(std::string_view messageData);
+
+		/// Builds the part of the Profile chosen by subscription, other than the whole one, which is built by Profiler::SnapshotProxy.
+		/// @param subscription subscribed part.
+		/// @return Profile part in JSON format.
+		json CreateSubscribedProfile(ProfileSubscription const& subscription);
+
+		/// Collects counters of Gateway's own Channels, without building the Profile.
+		/// @return Channels' identifiers with their traffic and Quality of Service counters.
+		json CollectChannelCounters();
+
+		/// Converts API bridge messages queued at once into frames.
+		/// @param messages plain messages. During key exchange, the key.
+		/// @param bridgeProtocol 0 during key exchange, 1 if Controller doesn't support batches, s_ApiBridgeProtocolVersion otherwise.
+		/// @param priority priority of messages. Fragments of each priority are reassembled by Controller separately.
+		/// @return frames to send.
+		std::vector<ByteVector> EncodeApiBridgeMessages(std::vector<ByteVector> messages, std::uint8_t bridgeProtocol, DuplexConnection::Priority priority) const;
+
+		/// Decrypts frame received from Controller.
+		/// @param frame encrypted frame.
+		/// @param isBatch set to true if frame was a batch, which means that Controller supports them.
+		/// @return plain messages.
+		/// @throws std::runtime_error if frame could not be decrypted or is a fragment, which Controller never sends.
+		std::vector<ByteVector> DecodeApiBridgeFrame(ByteView frame, bool& isBatch) const;
+
+		/// Lists session ciphers Controller can select with SessionCipher message.
+		/// @return JSON array of cipher names available on this CPU, fastest first.
+		static std::string GetSessionCiphers();
+
+		/// Queues message from Controller to be handled by m_ApiBridgeExecutor.
+		/// Actions are ordered by the Agent they concern and have lower priority than messages Controller waits a response for. Bulk actions are ordered among themselves.
+		/// @param message text of message to handle. Only fields needed to order it are parsed before it is queued.
+		/// @param connection connection used to send response. Must outlive all queued messages.
+		void QueueMessage(ByteVector message, DuplexConnection& connection);
+
+		/// Sends a command to an Agent, traced if it is selected for sampling.
+		/// @param packet G2A packet carrying the command.
+		/// @param agentId recipient of the command.
+		/// @param channel Channel of the Route to the recipient.
+		/// @param receivedAt time of arrival of the command at Gateway. If not set, time of queuing Controller's message is used.
+		void SendCommandPacket(ByteView packet, AgentId agentId, std::shared_ptr<DeviceBridge> const& channel, std::optional<std::chrono::steady_clock::time_point> receivedAt = {});
+
+		/// Sends a command to an Agent or one of its Devices. If compound commands are enabled, commands SendCommandsInParallel collects for one Agent are sent in one query, in order.
+		/// @param routeId Route to the recipient.
+		/// @param sharedKey key shared with the recipient.
+		/// @param commandWithArguments plaintext command with its arguments in binary form.
+		/// @param channel Channel of the Route to the recipient.
+		/// @param deviceId Device running the command. If not set, command is run by the Agent itself.
+		void SendAgentCommand(RouteId routeId, Crypto::SharedKey const& sharedKey, ByteView commandWithArguments, std::shared_ptr<DeviceBridge> const& channel, std::optional<DeviceId> deviceId = {});
+
+		/// Sends a command to an Agent or one of its Devices with SendAgentCommand, or queues it until the Agent checks in if there is no live Route to it.
+		/// @param agentId recipient of the command.
+		/// @param sharedKey key shared with the recipient.
+		/// @param commandWithArguments plaintext command with its arguments in binary form.
+		/// @param deviceId Device running the command. If not set, command is run by the Agent itself.
+		/// @throws std::runtime_error if the command has to be queued, but too many commands wait for the Agent.
+		void PostAgentCommand(AgentId agentId, Crypto::SharedKey const& sharedKey, ByteView commandWithArguments, std::optional<DeviceId> deviceId = {});
+
+		/// Forgets commands queued for an Agent. Called when the Agent is removed.
+		/// @param agentId Agent whose commands are dropped.
+		void DropQueuedAgentCommands(AgentId agentId);
+
+		/// Runs a function sending commands to Agents with the sends deferred. Collected packets are then encrypted with the Network key and passed to their Channels in parallel.
+		/// If compound commands are enabled, commands sent to the same Agent by SendAgentCommand are packed into one query first.
+		/// If Multicast is enabled, untraced commands sent through the same Channel are wrapped in envelopes first.
+		/// Channels with outbound queue coalesce packets sent to them, so commands sent through one Route leave in as few frames as possible.
+		/// @param compose function calling SendCommandPacket. Runs on the calling thread.
+		void SendCommandsInParallel(std::function<void()> const& compose);
+
+		/// Opens channel negotiated by a relay and sends the second step of negotiation through it.
+		/// @param negotiator negotiation channel that received the request.
+		/// @param newOutputId input id generated by the relay, used as output id of the new channel.
+		void NegotiateChannel(std::weak_ptr<DeviceBridge> negotiator, std::string const& newOutputId);
+
+		/// Handles S2G packet.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param decrypted body of the packet decrypted in advance. Empty if body is to be decrypted here.
+		/// @param sender a Channel that provided the packet.
+		void HandleS2G(ByteView packet0, ByteView decrypted, std::shared_ptr<DeviceBridge> const& sender);
+
+		/// Decrypts S2G body sealed with Gateway's key. Avoids decrypting again the body of the S2G packet handled by this thread.
+		/// @param body encrypted body of S2G packet.
+		/// @return decrypted body.
+		ByteVector DecryptS2G(ByteView body);
 
-		SafeSmartPointerContainer<std::shared_ptr<ConnectorBridge>> m_Connectors;										///< Container for Connectors that are currently turned on.
+		/// Keeps S2G packet of an unknown Agent until the Profile is restored.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		/// @return false if Profile is already restored or too many packets wait.
+		bool DeferS2GPacket(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender);
+
+		/// Handles S2G packets kept by DeferS2GPacket. Called by Profiler when snapshot restoring is done.
+		void OnProfileRestored();
+
+		/// Checks if a new Agent should be tracked by this Gateway. Gateways of a cluster share the network key, so each of them can receive InitializeRoute of the others' Agents.
+		/// Agent belongs to the Gateway that issued its build. Other Gateways ignore it without adding Routes, so that every Agent is shown once in aggregated Profiles.
+		/// @param agentId new Agent.
+		/// @param buildId Agent's build.
+		/// @return true if build was issued by this Gateway.
+		bool IsAgentOfThisGateway(AgentId agentId, BuildId buildId);
+
+		/// Sends a new resumption token to a registered Agent. Token seals Agent's identifiers with m_ResumptionKey, so Gateway doesn't keep it.
+		/// @param agentId recipient of the token.
+		/// @param buildId Agent's build.
+		void IssueResumptionToken(AgentId agentId, BuildId buildId);
+
+		/// Checks a resumption token sent by a rejoining Agent.
+		/// @param token token to check.
+		/// @param agentId Agent that sent the token.
+		/// @param buildId Agent's build.
+		/// @return true if token was issued to this Agent by this Gateway and is not outdated.
+		bool IsResumptionTokenValid(ByteView token, AgentId agentId, BuildId buildId);
+
+		/// Gets delivery context of an Agent, making it if the cached one is missing or outdated.
+		/// @param agentId Agent to get context of.
+		/// @return copy of the context. Context has no Channel if there is no Route to the Agent.
+		/// @throws std::runtime_error if the Agent is unknown.
+		DeliveryContext GetDeliveryContext(AgentId agentId);
+
+		/// Queues a command until its Agent checks in. Commands that only change a setting replace the queued one changing the same setting, so that the last one wins.
+		/// @param agentId recipient of the command.
+		/// @param command command to queue.
+		/// @throws std::runtime_error if too many commands wait for the Agent.
+		void QueueAgentCommand(AgentId agentId, QueuedAgentCommand command);
+
+		/// Sends commands queued for an Agent that has just checked in, in one go. If compound commands are enabled, they are packed into as few queries as possible.
+		/// Commands stay queued if there is still no live Route to the Agent.
+		/// @param agentId Agent that checked in.
+		void FlushQueuedAgentCommands(AgentId agentId);
+
+		/// Checks whether an Agent is connected to this Gateway, so that its S2G packets are accepted.
+		/// Only positive answers are cached, so Agents that connect meanwhile are admitted as soon as Profile knows them. Cache is dropped when Route table changes.
+		/// @param agentId Agent to check.
+		/// @return true if there is a path between the Agent and this Gateway.
+		bool IsAgentConnected(AgentId agentId);
+
+		/// Builds metrics served by m_MetricsEndpoint.
+		/// @return metrics in Prometheus text exposition format.
+		std::string CollectMetrics();
+
+		/// Stores segment of a streamed Command.
+		/// @param binder Route of the Peripheral streaming the Command.
+		/// @param position position of segment in the Command.
+		/// @param segment part of the Command.
+		/// @return whole Command if segment was the last missing one, nothing otherwise.
+		/// @throws std::runtime_error if segment doesn't fit the Command or there are too many Commands being reassembled.
+		std::optional<ByteVector> CollectCommandSegment(RouteId binder, BinderSegment const& position, ByteView segment);
+
+		SafeSmartPointerContainer<std::shared_ptr<ConnectorBridge>, LockProfiling::Mutex<>> m_Connectors;				///< Container for Connectors that are currently turned on.
+		mutable std::shared_mutex m_ConnectorsByHashMutex;																///< Guards m_ConnectorsByHash.
+		std::unordered_map<HashT, std::shared_ptr<ConnectorBridge>> m_ConnectorsByHash;									///< Connectors that are currently turned on by their name hash, so that Binder traffic doesn't scan m_Connectors.
 
 		Crypto::PublicKey m_AuthenticationKey;																			///< Gateway's pubic key. Used to decrypt authenticated messages.
 		Crypto::PrivateSignature m_Signature;																			///< Used to authenticate as Network's Gateway.
+		Crypto::SymmetricKey m_ResumptionKey = Crypto::GenerateSymmetricKey();											///< Seals resumption tokens. Known only to this process, so tokens issued before restart are rejected.
 		Crypto::SessionKeys m_SessionKeys;																				///< Used for communication with controller.
+		std::atomic_bool m_IsCborProfileEnabled = false;																///< Profile messages are sent as CBOR. Set when Controller asks for it, reset on every connection.
+		std::atomic<Crypto::AeadSuite> m_SessionSuite = Crypto::AeadSuite::XSalsa20Poly1305;							///< Used to encrypt frames sent to Controller. Selected by Controller, reset on every connection.
+		std::shared_ptr<const ProfileSubscription> m_ProfileSubscription;												///< Set by Controller, reset on every connection. Null keeps whole Profile in sync, for Controllers that don't subscribe. Accessed with std::atomic_load and std::atomic_store.
 		FSecure::InitializeSockets m_InitializeSockets;																		///< Sockets initializer object used by API bridge.
 		bool m_IsAlive = true;																							///< Equals false if Controller sent the exit Command.
 
 		std::shared_ptr<Profiler> m_Profiler;																			///< Virtual shape of the network.
+		std::shared_ptr<TaskExecutor> m_ApiBridgeExecutor;																///< Handles messages from Controller. Messages concerning the same Agent are handled in order.
+		std::shared_ptr<TaskExecutor> m_NegotiationExecutor;															///< Opens negotiated channels. Negotiations of different relays run in parallel, even if they share a negotiation channel.
+		std::shared_ptr<TaskExecutor> m_ConnectorStartupExecutor;														///< Builds Connectors that are being turned on. Startups of the same Connector type run in order.
+		std::mutex m_PendingNegotiationsMutex;																			///< Guards m_PendingNegotiations.
+		std::unordered_set<std::string> m_PendingNegotiations;															///< Input ids of relays whose negotiations are queued or running, so that repeated requests don't open more channels.
+
+		std::atomic<bool> m_IsMulticastEnabled = false;																	///< Set if commands sharing the first hop are sent in Multicast envelopes.
+		std::atomic<bool> m_AreCompoundCommandsEnabled = false;															///< Set if commands composed together for one Agent are sent in one query.
+		std::atomic<bool> m_AreConnectorsOutOfProcess = false;															///< Set if new Connectors are hosted in separate processes.
+		std::atomic<RoutePreference> m_RoutePreference = RoutePreference::None;											///< Metric optimized by Routes chosen for commands to Agents.
+		std::atomic<std::uint32_t> m_CommandTracingInterval = 0;														///< Every n-th command is traced. Zero if tracing is off.
+		std::atomic<std::uint32_t> m_CommandsCount = 0;																	///< Number of commands sent to Agents, used for sampling.
+		std::atomic<std::uint32_t> m_LastTraceId = 0;																	///< Identifier of the last trace.
+		mutable std::mutex m_CommandTracingMutex;																		///< Guards m_PendingTraces, m_CommandLatencies and m_ExpiredTraces.
+		std::unordered_map<std::uint32_t, PendingTrace> m_PendingTraces;												///< Traced commands by trace identifier.
+		std::map<AgentId, CommandLatency> m_CommandLatencies;															///< Latency breakdowns by recipient.
+		std::uint64_t m_ExpiredTraces = 0;																				///< Number of traces that weren't reported in s_TraceTimeout.
+
+		std::mutex m_DeliveryContextsMutex;																				///< Guards m_DeliveryContexts and m_DeliveryContextsEpoch.
+		std::unordered_map<AgentId::UnderlyingIntegerType, DeliveryContext> m_DeliveryContexts;							///< Delivery contexts by Agent.
+		std::uint64_t m_DeliveryContextsEpoch = 0;																		///< Incremented by InvalidateDeliveryContexts, so that contexts made meanwhile are not cached.
+		std::mutex m_QueuedAgentCommandsMutex;																			///< Guards m_QueuedAgentCommands.
+		std::unordered_map<AgentId::UnderlyingIntegerType, std::vector<QueuedAgentCommand>> m_QueuedAgentCommands;		///< Commands waiting for unreachable Agents to check in, in order of sending.
+		std::atomic<std::size_t> m_AgentsWithQueuedCommands = 0;														///< Size of m_QueuedAgentCommands, read by S2G handling without taking the mutex.
+		std::mutex m_ConnectedAgentsMutex;																				///< Guards m_ConnectedAgents, m_ConnectedAgentsEpoch and m_ConnectedAgentsRoutesVersion.
+		std::unordered_set<AgentId::UnderlyingIntegerType> m_ConnectedAgents;											///< Agents known to be connected, admitted for S2G packets without taking Profiler's lock.
+		std::uint64_t m_ConnectedAgentsEpoch = 0;																		///< Incremented by InvalidateConnectedAgents, so that answers made meanwhile are not cached.
+		std::uint64_t m_ConnectedAgentsRoutesVersion = 0;																///< Version of the Route table m_ConnectedAgents was filled with.
+		std::shared_ptr<const std::unordered_set<AgentId::UnderlyingIntegerType>> m_BannedAgents;						///< Banned Agents, replaced as a whole by SetBannedAgents. Accessed with std::atomic_load and std::atomic_store, so that IsAgentBanned doesn't take Profiler's lock.
+		std::shared_ptr<const std::unordered_map<AgentId::UnderlyingIntegerType, RouteId>> m_PreferredRoutes;			///< Routes used for commands to Agents, replaced as a whole by SetPreferredRoutes. Accessed with std::atomic_load and std::atomic_store.
+
+		std::mutex m_StripedPacketsMutex;																				///< Guards m_StripedPackets.
+		QualityOfService m_StripedPackets;																				///< Reassembles fragments of Striped packets coming through all Channels.
+		std::mutex m_StreamedCommandsMutex;																				///< Guards m_StreamedCommands and m_StreamedCommandsSize.
+		std::map<std::pair<RouteId, std::uint32_t>, StreamedCommand> m_StreamedCommands;								///< Streamed Commands being reassembled, by Route of the Peripheral and Command identifier.
+		std::size_t m_StreamedCommandsSize = 0;																			///< Total size of m_StreamedCommands.
+		std::atomic<std::uint64_t> m_DecryptedS2GPacketsCount = 0;														///< Number of S2G packets decrypted with Gateway's private key.
+		std::mutex m_DeferredS2GPacketsMutex;																			///< Guards m_DeferredS2GPackets and m_IsProfileRestored.
+		std::vector<std::pair<ByteVector, std::weak_ptr<DeviceBridge>>> m_DeferredS2GPackets;							///< S2G packets of Agents received before the Profile was restored, in order of arrival.
+		bool m_IsProfileRestored = false;																				///< Set once Profiler has restored the snapshot.
+		std::shared_ptr<MetricsEndpoint> m_MetricsEndpoint;																///< Serves metrics over HTTP. Null if not configured.
 	};
 }
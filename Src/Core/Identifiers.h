@@ -38,6 +38,11 @@ namespace FSecure::C3
 		/// @return a string that describes this ID object.
 		std::string ToString() const;
 
+		/// Writes this ID as hex digits without allocating, e.g. to a stack buffer.
+		/// @param buffer place for TextSize characters. Null terminator is not added.
+		/// @return pointer past the last written character.
+		char* ToChars(char* buffer) const;
+
 		/// Converts identifier to underlying type.
 		/// @returns UnderlyingIntegerType identifier in arithmetic form.
 		UnderlyingIntegerType ToUnderlyingType() const;
@@ -52,17 +52,23 @@ FSecure::C3::Identifier<UnderlyingIntegerType> FSecure::C3::Identifier<Underlyin
 template<typename UnderlyingIntegerType>
 std::string FSecure::C3::Identifier<UnderlyingIntegerType>::ToString() const
 {
-	// Initialize buffers and pointers.
-	std::string ret(sizeof(UnderlyingIntegerType) * 2 + 1, '0');
-	char* rp = ret.data();
+	std::string ret(TextSize, '0');
+	ToChars(ret.data());
+	return ret;
+}
 
-	// Note: this function adds a null terminator.
-	auto p = reinterpret_cast<const uint8_t*>(&m_Id);
-	for (int i = 0; i < sizeof(UnderlyingIntegerType); ++i)
-		sprintf_s(&rp[i * 2], 3, OBF("%02hhX"), p[sizeof(UnderlyingIntegerType) - i - 1]);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template<typename UnderlyingIntegerType>
+char* FSecure::C3::Identifier<UnderlyingIntegerType>::ToChars(char* buffer) const
+{
+	// Most significant digit goes first, so that text reads as a hex number.
+	for (size_t i = 0; i < TextSize; ++i)
+	{
+		auto digit = static_cast<char>((m_Id >> ((TextSize - i - 1) * 4)) & 0xF);
+		buffer[i] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+	}
 
-	// Remove the trailing null.
-	return ret.substr(0, sizeof(UnderlyingIntegerType) * 2);
+	return buffer + TextSize;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -126,5 +132,28 @@ namespace FSecure
 		{
 			return bv.Read<typename C3::Identifier<T>::UnderlyingIntegerType>();
 		}
+
+		static void ToRaw(C3::Identifier<T> const& obj, std::uint8_t* ptr)
+		{
+			ByteConverter<typename C3::Identifier<T>::UnderlyingIntegerType>::ToRaw(obj.ToUnderlyingType(), ptr);
+		}
+
+		static C3::Identifier<T> FromRaw(std::uint8_t const* ptr)
+		{
+			return ByteConverter<typename C3::Identifier<T>::UnderlyingIntegerType>::FromRaw(ptr);
+		}
+	};
+}
+
+namespace std
+{
+	/// Add hashing function for identifiers, so that they can be used as keys of unordered containers.
+	template <typename T>
+	struct hash<FSecure::C3::Identifier<T>>
+	{
+		size_t operator()(FSecure::C3::Identifier<T> const& id) const noexcept
+		{
+			return std::hash<T>{}(id.ToUnderlyingType());
+		}
 	};
 }
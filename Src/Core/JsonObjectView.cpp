@@ -0,0 +1,149 @@
+#include "StdAfx.h"
+#include "JsonObjectView.h"
+
+namespace
+{
+	/// Skip white space.
+	/// @param text JSON text.
+	/// @param position index of first character to check. Moved past white space.
+	void SkipWhiteSpace(std::string_view text, size_t& position)
+	{
+		while (position < text.size() && (text[position] == ' ' || text[position] == '\t' || text[position] == '\n' || text[position] == '\r'))
+			++position;
+	}
+
+	/// Skip a string.
+	/// @param text JSON text.
+	/// @param position index of opening quote. Moved past closing quote.
+	/// @throws std::invalid_argument if string is not terminated.
+	void SkipString(std::string_view text, size_t& position)
+	{
+		for (++position; position < text.size(); ++position)
+			if (text[position] == '\\')
+				++position;
+			else if (text[position] == '"')
+				return void(++position);
+
+		throw std::invalid_argument{ "Unterminated JSON string." };
+	}
+
+	/// Skip a value of any type. Only nesting of objects and arrays is checked.
+	/// @param text JSON text.
+	/// @param position index of first character of value. Moved past the value.
+	/// @throws std::invalid_argument if value is empty, or string or nesting is not terminated.
+	void SkipValue(std::string_view text, size_t& position)
+	{
+		if (position >= text.size())
+			throw std::invalid_argument{ "Missing JSON value." };
+
+		if (text[position] == '"')
+			return SkipString(text, position);
+
+		if (text[position] == '{' || text[position] == '[')
+		{
+			for (size_t depth = 0; position < text.size();)
+			{
+				switch (text[position])
+				{
+				case '"':
+					SkipString(text, position);
+					continue;
+				case '{':
+				case '[':
+					++depth;
+					break;
+				case '}':
+				case ']':
+					if (--depth == 0)
+						return void(++position);
+					break;
+				}
+				++position;
+			}
+
+			throw std::invalid_argument{ "Unterminated JSON object or array." };
+		}
+
+		auto begin = position;
+		while (position < text.size() && !std::strchr(",}] \t\n\r", text[position]))
+			++position;
+
+		if (position == begin)
+			throw std::invalid_argument{ "Missing JSON value." };
+	}
+
+	/// Expect a character.
+	/// @param text JSON text.
+	/// @param position index of expected character. Moved past it.
+	/// @param expected expected character.
+	/// @throws std::invalid_argument if other character was found.
+	void Expect(std::string_view text, size_t& position, char expected)
+	{
+		if (position >= text.size() || text[position] != expected)
+			throw std::invalid_argument{ "Expected '"s + expected + "' at offset " + std::to_string(position) + " of JSON object." };
+
+		++position;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::JsonObjectView::JsonObjectView(std::string_view text)
+{
+	size_t position = 0;
+	SkipWhiteSpace(text, position);
+	Expect(text, position, '{');
+	SkipWhiteSpace(text, position);
+	if (position < text.size() && text[position] == '}')
+		++position;
+	else
+		while (true)
+		{
+			auto nameBegin = position;
+			if (position >= text.size() || text[position] != '"')
+				throw std::invalid_argument{ "Expected member name at offset " + std::to_string(position) + " of JSON object." };
+
+			SkipString(text, position);
+			auto name = text.substr(nameBegin + 1, position - nameBegin - 2);
+			SkipWhiteSpace(text, position);
+			Expect(text, position, ':');
+			SkipWhiteSpace(text, position);
+
+			auto valueBegin = position;
+			SkipValue(text, position);
+			m_Members.emplace_back(name, text.substr(valueBegin, position - valueBegin));
+
+			SkipWhiteSpace(text, position);
+			if (position < text.size() && text[position] == ',')
+			{
+				++position;
+				SkipWhiteSpace(text, position);
+				continue;
+			}
+
+			Expect(text, position, '}');
+			break;
+		}
+
+	SkipWhiteSpace(text, position);
+	if (position != text.size())
+		throw std::invalid_argument{ "Unexpected text after JSON object." };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<std::string_view> FSecure::C3::Core::JsonObjectView::Find(std::string_view name) const
+{
+	for (auto const& [memberName, value] : m_Members)
+		if (memberName == name)
+			return value;
+
+	return std::nullopt;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string_view FSecure::C3::Core::JsonObjectView::At(std::string_view name) const
+{
+	if (auto value = Find(name))
+		return *value;
+
+	throw std::out_of_range{ std::string{ name } + " is not specified." };
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+namespace FSecure::C3::Core
+{
+	/// Members of a JSON object located without parsing their values.
+	/// Values are parsed on demand, so that big members which are only passed further as text don't allocate a node per value.
+	class JsonObjectView
+	{
+	public:
+		/// Locate top-level members of an object.
+		/// @param text JSON object. Must outlive this object.
+		/// @throws std::invalid_argument if text is not an object or its nesting is broken. Member values are validated only when parsed.
+		explicit JsonObjectView(std::string_view text);
+
+		/// Find text of a member.
+		/// @param name name of member, as written in text.
+		/// @return text of member value, or std::nullopt if there is no such member.
+		std::optional<std::string_view> Find(std::string_view name) const;
+
+		/// Get text of a member.
+		/// @param name name of member, as written in text.
+		/// @return text of member value.
+		/// @throws std::out_of_range if there is no such member.
+		std::string_view At(std::string_view name) const;
+
+		/// Parse a member.
+		/// @param name name of member, as written in text.
+		/// @return parsed value.
+		/// @throws std::out_of_range if there is no such member, nlohmann::json::exception if it has a wrong type or is not valid JSON.
+		template <typename T>
+		T Get(std::string_view name) const
+		{
+			auto text = At(name);
+			return json::parse(text.begin(), text.end()).get<T>();
+		}
+
+		/// Parse a member if it exists.
+		/// @param name name of member, as written in text.
+		/// @param defaultValue value returned if there is no such member.
+		/// @return parsed value or defaultValue.
+		/// @throws nlohmann::json::exception if member has a wrong type or is not valid JSON.
+		template <typename T>
+		T Value(std::string_view name, T defaultValue) const
+		{
+			auto text = Find(name);
+			return text ? json::parse(text->begin(), text->end()).get<T>() : defaultValue;
+		}
+
+	private:
+		/// Names and texts of members, in order of appearance. Objects sent by Controller have a few members, so they are searched linearly.
+		std::vector<std::pair<std::string_view, std::string_view>> m_Members;
+	};
+}
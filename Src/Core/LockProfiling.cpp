@@ -0,0 +1,90 @@
+#include "StdAfx.h"
+#include "LockProfiling.h"
+
+namespace
+{
+	/// Guards sites returned by GetSites.
+	std::mutex& GetSitesMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	/// All sites by name. Nodes of a map are never moved, so sites can be referenced by mutexes for the lifetime of the process.
+	/// Function-local, so that mutexes which are static members, like Profile's topology lock, can register during static initialization.
+	std::map<std::string, FSecure::C3::Core::LockProfiling::Site, std::less<>>& GetSites()
+	{
+		static std::map<std::string, FSecure::C3::Core::LockProfiling::Site, std::less<>> sites;
+		return sites;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::LockProfiling::SetSampleInterval(std::uint32_t sampleInterval) noexcept
+{
+	g_SampleInterval.store(sampleInterval, std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::C3::Core::LockProfiling::Statistics> FSecure::C3::Core::LockProfiling::GetStatistics()
+{
+	std::scoped_lock lock(GetSitesMutex());
+	std::vector<Statistics> statistics;
+	for (auto const& [name, site] : GetSites())
+		statistics.push_back(site.GetStatistics());
+
+	return statistics;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::LockProfiling::Site& FSecure::C3::Core::LockProfiling::Site::Get(std::string_view name)
+{
+	std::scoped_lock lock(GetSitesMutex());
+	auto& sites = GetSites();
+	if (auto it = sites.find(name); it != sites.end())
+		return it->second;
+
+	return sites.try_emplace(std::string{ name }, std::string{ name }).first->second;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::LockProfiling::Site::Site(std::string name)
+	: m_Name{ std::move(name) }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::steady_clock::time_point FSecure::C3::Core::LockProfiling::Site::OnAcquired(std::uint32_t sampleInterval) noexcept
+{
+	m_Acquisitions.fetch_add(1, std::memory_order_relaxed);
+	if (!sampleInterval)
+		return {};
+
+	// Counted per thread, so that sampling doesn't add another shared counter to every acquisition.
+	thread_local std::uint32_t acquisitions = 0;
+	if (++acquisitions % sampleInterval)
+		return {};
+
+	return std::chrono::steady_clock::now();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::LockProfiling::Site::OnReleased(std::chrono::steady_clock::time_point acquiredAt) noexcept
+{
+	m_HoldSamples.fetch_add(1, std::memory_order_relaxed);
+	m_SampledHoldTime.fetch_add((std::chrono::steady_clock::now() - acquiredAt).count(), std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::LockProfiling::Statistics FSecure::C3::Core::LockProfiling::Site::GetStatistics() const
+{
+	return
+	{
+		m_Name,
+		m_Acquisitions.load(std::memory_order_relaxed),
+		m_Contentions.load(std::memory_order_relaxed),
+		std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::duration{ m_WaitTime.load(std::memory_order_relaxed) }),
+		m_HoldSamples.load(std::memory_order_relaxed),
+		std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::duration{ m_SampledHoldTime.load(std::memory_order_relaxed) }),
+	};
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "EventTracing.h"
+
+namespace FSecure::C3::Core::LockProfiling
+{
+	/// Lock statistics of a site.
+	struct Statistics
+	{
+		std::string m_Name;																								///< Name of the site.
+		std::uint64_t m_Acquisitions = 0;																				///< Number of times a mutex of the site was taken.
+		std::uint64_t m_Contentions = 0;																				///< Number of acquisitions that had to wait for another thread.
+		std::chrono::nanoseconds m_WaitTime{{}};																		///< Total time of waiting in contended acquisitions.
+		std::uint64_t m_HoldSamples = 0;																				///< Number of exclusive acquisitions which hold time was measured.
+		std::chrono::nanoseconds m_SampledHoldTime{{}};																	///< Total hold time of sampled acquisitions.
+	};
+
+	/// Every n-th exclusive acquisition on a thread has its hold time measured. 0 if locks are not profiled.
+	/// Read on every acquisition, so it is a plain atomic instead of a function call. @see SetSampleInterval.
+	inline std::atomic<std::uint32_t> g_SampleInterval = 0;
+
+	/// Turn profiling of all lock sites on or off. Off by default, then an acquisition costs one relaxed load more than of a bare mutex.
+	/// While on, every acquisition is counted and contended ones are timed and traced with ETW. Only hold time is sampled, because measuring it takes a clock read on both ends of every acquisition.
+	/// @param sampleInterval hold time is measured for every sampleInterval-th exclusive acquisition on a thread. 0 turns profiling off.
+	void SetSampleInterval(std::uint32_t sampleInterval) noexcept;
+
+	/// Read statistics of all sites.
+	/// @return statistics ordered by site name. Counters keep growing since the start of the process.
+	std::vector<Statistics> GetStatistics();
+
+	/// Place in code protecting a resource with mutexes. All mutexes of a site, e.g. of every DeviceBridge, share its counters.
+	class Site
+	{
+	public:
+		/// Find or register a site.
+		/// @param name name of the site, e.g. "DeviceBridge::m_ProtectWriteInConcurrentThreads".
+		/// @return site, which lives until the end of the process.
+		static Site& Get(std::string_view name);
+
+		/// Create site. @see Get.
+		/// @param name name of the site.
+		Site(std::string name);
+
+		/// Wait for a mutex held by another thread.
+		/// @param lock function taking the mutex.
+		template <typename Lock>
+		void Wait(Lock&& lock)
+		{
+			EventTracing::Scope<EventTracing::Keyword::Locks> tracingScope{ m_Name.c_str() };
+			auto start = std::chrono::steady_clock::now();
+			lock();
+			m_Contentions.fetch_add(1, std::memory_order_relaxed);
+			m_WaitTime.fetch_add((std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+		}
+
+		/// Count acquisition and decide if its hold time is measured.
+		/// @param sampleInterval current value of g_SampleInterval.
+		/// @return time of the acquisition if it is sampled, otherwise a default time point.
+		std::chrono::steady_clock::time_point OnAcquired(std::uint32_t sampleInterval) noexcept;
+
+		/// Record hold time of a sampled acquisition.
+		/// @param acquiredAt time returned by OnAcquired.
+		void OnReleased(std::chrono::steady_clock::time_point acquiredAt) noexcept;
+
+		/// Read counters.
+		/// @return statistics of the site.
+		Statistics GetStatistics() const;
+
+	private:
+		std::string m_Name;																								///< Name of the site.
+		std::atomic<std::uint64_t> m_Acquisitions = 0;																	///< @see Statistics::m_Acquisitions.
+		std::atomic<std::uint64_t> m_Contentions = 0;																	///< @see Statistics::m_Contentions.
+		std::atomic<std::int64_t> m_WaitTime = 0;																		///< @see Statistics::m_WaitTime. In ticks of steady_clock.
+		std::atomic<std::uint64_t> m_HoldSamples = 0;																	///< @see Statistics::m_HoldSamples.
+		std::atomic<std::int64_t> m_SampledHoldTime = 0;																///< @see Statistics::m_SampledHoldTime. In ticks of steady_clock.
+	};
+
+	/// Mutex which acquisitions are profiled under a named site. Drop-in replacement for std::mutex and std::shared_mutex, usable with std::scoped_lock, std::unique_lock and std::shared_lock.
+	/// Hold time is measured only for exclusive acquisitions. Shared ones are counted and timed when contended.
+	/// @tparam UnderlyingMutex mutex type wrapped.
+	template <typename UnderlyingMutex = std::mutex>
+	class Mutex
+	{
+	public:
+		/// Create mutex.
+		/// @param site name of the lock site.
+		explicit Mutex(std::string_view site)
+			: m_Site{ Site::Get(site) }
+		{
+		}
+
+		/// Mutexes can't be copied.
+		Mutex(Mutex const&) = delete;
+		Mutex& operator=(Mutex const&) = delete;
+
+		/// Take the mutex exclusively.
+		void lock()
+		{
+			auto sampleInterval = g_SampleInterval.load(std::memory_order_relaxed);
+			if (!sampleInterval)
+				return m_Mutex.lock();
+
+			if (!m_Mutex.try_lock())
+				m_Site.Wait([this] { m_Mutex.lock(); });
+
+			m_AcquiredAt = m_Site.OnAcquired(sampleInterval);
+		}
+
+		/// Take the mutex exclusively if it is free.
+		/// @return true if mutex was taken.
+		bool try_lock()
+		{
+			if (!m_Mutex.try_lock())
+				return false;
+
+			if (auto sampleInterval = g_SampleInterval.load(std::memory_order_relaxed))
+				m_AcquiredAt = m_Site.OnAcquired(sampleInterval);
+
+			return true;
+		}
+
+		/// Release exclusive ownership.
+		void unlock()
+		{
+			// Only the owner writes m_AcquiredAt, so it has to be read before the mutex is released.
+			auto acquiredAt = std::exchange(m_AcquiredAt, {});
+			m_Mutex.unlock();
+			if (acquiredAt != std::chrono::steady_clock::time_point{})
+				m_Site.OnReleased(acquiredAt);
+		}
+
+		/// Take the mutex shared.
+		void lock_shared()
+		{
+			auto sampleInterval = g_SampleInterval.load(std::memory_order_relaxed);
+			if (!sampleInterval)
+				return m_Mutex.lock_shared();
+
+			if (!m_Mutex.try_lock_shared())
+				m_Site.Wait([this] { m_Mutex.lock_shared(); });
+
+			m_Site.OnAcquired(0);
+		}
+
+		/// Take the mutex shared if it isn't held exclusively.
+		/// @return true if mutex was taken.
+		bool try_lock_shared()
+		{
+			if (!m_Mutex.try_lock_shared())
+				return false;
+
+			if (g_SampleInterval.load(std::memory_order_relaxed))
+				m_Site.OnAcquired(0);
+
+			return true;
+		}
+
+		/// Release shared ownership.
+		void unlock_shared()
+		{
+			m_Mutex.unlock_shared();
+		}
+
+	private:
+		UnderlyingMutex m_Mutex;																						///< Wrapped mutex.
+		Site& m_Site;																									///< Counters of the lock site.
+		std::chrono::steady_clock::time_point m_AcquiredAt;																///< Time of the current exclusive acquisition if it is sampled. Guarded by m_Mutex.
+	};
+}
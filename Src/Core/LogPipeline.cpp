@@ -0,0 +1,124 @@
+#include "StdAfx.h"
+#include "LogPipeline.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::LogPipeline::LogPipeline(Utils::LoggerCallback callback, std::size_t capacity)
+	: m_Callback{ callback }
+	, m_Entries{ callback ? capacity : 1 }
+#	if defined _DEBUG
+	, m_Threshold{ callback ? GetRank(LogMessage::Severity::DebugInformation) : s_Disabled }
+#	else
+	, m_Threshold{ callback ? GetRank(LogMessage::Severity::Information) : s_Disabled }
+#	endif
+{
+	if (callback)
+		m_SinkThread = std::thread{ [this] { RunSink(); } };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::LogPipeline::~LogPipeline()
+{
+	{
+		std::lock_guard lock{ m_WakeMutex };
+		m_IsStopping = true;
+	}
+
+	m_WakeCondition.notify_one();
+	if (m_SinkThread.joinable())
+		m_SinkThread.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::LogPipeline::IsEnabled(LogMessage::Severity severity) const noexcept
+{
+	return GetRank(severity) >= m_Threshold.load(std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::LogPipeline::SetThreshold(LogMessage::Severity threshold) noexcept
+{
+	if (m_Callback)
+		m_Threshold = GetRank(threshold);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::LogPipeline::Push(LogMessage const& message, DeviceId sender) noexcept
+{
+	if (!IsEnabled(message.m_Severity))
+		return;
+
+	try
+	{
+		auto entry = Entry{ message, sender };
+		if (!m_Entries.TryPush(entry))
+			return static_cast<void>(m_DroppedCount.fetch_add(1, std::memory_order_relaxed));
+	}
+	catch (...)
+	{
+		return static_cast<void>(m_DroppedCount.fetch_add(1, std::memory_order_relaxed));
+	}
+
+	// Sink is notified only if it went idle, so the busy path never touches the mutex.
+	if (m_IsSinkWaiting.exchange(false))
+	{
+		std::lock_guard lock{ m_WakeMutex };
+		m_WakeCondition.notify_one();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::uint64_t FSecure::C3::Core::LogPipeline::GetDroppedCount() const noexcept
+{
+	return m_DroppedCount.load(std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::LogPipeline::RunSink()
+{
+	while (!m_IsStopping)
+	{
+		// Flag is raised before draining, so that an entry queued after the last pop always wakes the sink up.
+		m_IsSinkWaiting = true;
+		Drain();
+
+		std::unique_lock lock{ m_WakeMutex };
+		m_WakeCondition.wait_for(lock, 1s, [this] { return !m_IsSinkWaiting || m_IsStopping; });
+	}
+
+	Drain();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::LogPipeline::Drain()
+{
+	auto call = [this](LogMessage const& message, DeviceId sender)
+	{
+		try
+		{
+			m_Callback(message, std::string_view{ sender.IsNull() ? "" : sender.ToString() });
+		}
+		catch (...)
+		{
+		}
+	};
+
+	while (auto entry = m_Entries.TryPop())
+		call(entry->m_Message, entry->m_Sender);
+
+	if (auto droppedCount = GetDroppedCount(); droppedCount != m_ReportedDroppedCount)
+	{
+		call({ OBF("Dropped ") + std::to_string(droppedCount - std::exchange(m_ReportedDroppedCount, droppedCount)) + OBF(" log messages, because logger could not keep up."), LogMessage::Severity::Warning }, {});
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int FSecure::C3::Core::LogPipeline::GetRank(LogMessage::Severity severity) noexcept
+{
+	switch (severity)
+	{
+	case LogMessage::Severity::DebugInformation: return 0;
+	case LogMessage::Severity::Information: return 1;
+	case LogMessage::Severity::Warning: return 2;
+	default: return 3;
+	}
+}
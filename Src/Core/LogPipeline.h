@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Identifiers.h"
+#include "Common/FSecure/C3/Internals/BackendCommons.h"
+#include "Common/FSecure/CppTools/MpscRing.h"
+
+namespace FSecure::C3::Core
+{
+	/// Passes Log entries to the logger callback on a background thread, so that threads handling packets never wait for console or file I/O.
+	/// Entries are queued in a lock-free ring. If the sink falls behind and the ring fills up, entries are dropped and counted instead of blocking the caller.
+	class LogPipeline
+	{
+	public:
+		/// Number of entries that can wait for the sink if not configured otherwise.
+		static constexpr std::size_t s_DefaultCapacity = 4096;
+
+		/// Create pipeline and start the sink thread.
+		/// @param callback logger callback called on the sink thread. If null, all messages are filtered out and no thread is started.
+		/// @param capacity maximal number of entries waiting for the sink. Must be a power of two.
+		LogPipeline(Utils::LoggerCallback callback, std::size_t capacity = s_DefaultCapacity);
+
+		/// Destructor. Passes remaining entries to the callback and stops the sink thread.
+		~LogPipeline();
+
+		/// Check whether messages of given severity are logged. Call it before formatting costly messages.
+		/// @param severity severity to check.
+		/// @return true if severity is not filtered out.
+		bool IsEnabled(LogMessage::Severity severity) const noexcept;
+
+		/// Set the least important severity that is logged. DebugInformation is the least important one, Error the most.
+		/// Has no effect if pipeline has no callback.
+		/// @param threshold severity to set.
+		void SetThreshold(LogMessage::Severity threshold) noexcept;
+
+		/// Queue an entry. Never blocks.
+		/// @param message information to log. Dropped if its severity is filtered out or if the ring is full.
+		/// @param sender Interface reporting the message.
+		void Push(LogMessage const& message, DeviceId sender) noexcept;
+
+		/// @return number of entries dropped because the ring was full.
+		std::uint64_t GetDroppedCount() const noexcept;
+
+	private:
+		/// Queued Log entry.
+		struct Entry
+		{
+			LogMessage m_Message;																						///< Information to log.
+			DeviceId m_Sender;																							///< Interface reporting the message.
+		};
+
+		/// Sink thread body. Passes queued entries to the callback until the pipeline is destroyed.
+		void RunSink();
+
+		/// Pass all queued entries to the callback, followed by a warning if some entries were dropped since the last call.
+		void Drain();
+
+		/// Map severity to its importance.
+		/// @param severity severity to map.
+		/// @return 0 for DebugInformation, growing up to Error.
+		static int GetRank(LogMessage::Severity severity) noexcept;
+
+		/// Threshold filtering out all severities.
+		static constexpr int s_Disabled = 4;
+
+		Utils::LoggerCallback m_Callback;																				///< Callback called on the sink thread.
+		MpscRing<Entry> m_Entries;																						///< Entries waiting for the sink.
+		std::atomic<int> m_Threshold;																					///< Rank of the least important severity that is logged.
+		std::atomic<std::uint64_t> m_DroppedCount = 0;																	///< Number of entries dropped because the ring was full.
+		std::uint64_t m_ReportedDroppedCount = 0;																		///< Value of m_DroppedCount when the sink last reported dropped entries.
+		std::atomic<bool> m_IsSinkWaiting = false;																		///< Set while the sink thread waits for entries, so that producers notify it only then.
+		std::atomic<bool> m_IsStopping = false;																			///< Set by the destructor.
+		std::mutex m_WakeMutex;																							///< Used with m_WakeCondition.
+		std::condition_variable m_WakeCondition;																		///< Notified when an entry is queued while the sink is waiting.
+		std::thread m_SinkThread;																						///< Thread calling the callback.
+	};
+}
@@ -0,0 +1,85 @@
+#include "StdAfx.h"
+#include "MetricsEndpoint.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::MetricsEndpoint::Writer& FSecure::C3::Core::MetricsEndpoint::Writer::Family(std::string_view name, std::string_view type, std::string_view help)
+{
+	m_Name = name;
+	m_Text.append("# HELP ").append(name).append(" ").append(help).push_back('\n');
+	m_Text.append("# TYPE ").append(name).append(" ").append(type).push_back('\n');
+	return *this;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::MetricsEndpoint::Writer::AppendSample(Labels labels)
+{
+	m_Text.append(m_Name);
+	if (labels.size())
+	{
+		auto separator = '{';
+		for (auto const& [name, value] : labels)
+		{
+			m_Text.append(1, std::exchange(separator, ',')).append(name).append("=\"");
+			for (auto c : value)
+				if (c == '\\' || c == '"')
+					m_Text.append(1, '\\').push_back(c);
+				else if (c == '\n')
+					m_Text.append("\\n");
+				else
+					m_Text.push_back(c);
+
+			m_Text.push_back('"');
+		}
+
+		m_Text.push_back('}');
+	}
+
+	m_Text.push_back(' ');
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::MetricsEndpoint::MetricsEndpoint(std::string const& url, Collector collector)
+	: m_Listener{ web::uri{ utility::conversions::to_string_t(url) } }
+	, m_Collector{ std::move(collector) }
+{
+	using namespace web::http;
+	m_Listener.support(methods::GET, [this](http_request request)
+	{
+		auto path = request.relative_uri().path();
+		if (!path.empty() && path != _XPLATSTR("/"))
+		{
+			request.reply(status_codes::NotFound);
+			return;
+		}
+
+		try
+		{
+			request.reply(status_codes::OK, m_Collector(), "text/plain; version=0.0.4; charset=utf-8");
+		}
+		catch (std::exception& exception)
+		{
+			request.reply(status_codes::InternalError, std::string{ exception.what() });
+		}
+	});
+
+	try
+	{
+		m_Listener.open().wait();
+	}
+	catch (std::exception& exception)
+	{
+		throw std::runtime_error{ "Failed to open metrics endpoint " + url + ". " + exception.what() };
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::MetricsEndpoint::~MetricsEndpoint()
+{
+	try
+	{
+		m_Listener.close().wait();
+	}
+	catch (...)
+	{
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+// Client header sets up static linkage of cpprest, which is shared with the listener.
+#include "Common/CppRestSdk/include/cpprest/http_client.h"
+#include "Common/CppRestSdk/include/cpprest/http_listener.h"
+
+namespace FSecure::C3::Core
+{
+	/// HTTP endpoint serving metrics in Prometheus text exposition format.
+	class MetricsEndpoint
+	{
+	public:
+		/// Builds exposition text.
+		class Writer
+		{
+		public:
+			/// Label names and values of a sample.
+			using Labels = std::initializer_list<std::pair<std::string_view, std::string>>;
+
+			/// Start a metric family. Following samples belong to it.
+			/// @param name metric name. Counters should end with "_total".
+			/// @param type "counter" or "gauge".
+			/// @param help description of the metric.
+			/// @return this object.
+			Writer& Family(std::string_view name, std::string_view type, std::string_view help);
+
+			/// Add sample of the current family.
+			/// @param value sample value.
+			/// @param labels labels distinguishing the sample from others of the family.
+			/// @return this object.
+			template <typename T>
+			Writer& Sample(T value, Labels labels = {})
+			{
+				AppendSample(labels);
+				std::ostringstream stream;
+				stream.precision(10);
+				stream << value;
+				m_Text.append(stream.str()).push_back('\n');
+				return *this;
+			}
+
+			/// Get exposition text.
+			/// @return text of all added families.
+			std::string const& GetText() const { return m_Text; }
+
+		private:
+			/// Append sample name and labels.
+			/// @param labels labels of the sample. Values are escaped.
+			void AppendSample(Labels labels);
+
+			std::string m_Name;																						///< Name of the current family.
+			std::string m_Text;																						///< Exposition text.
+		};
+
+		/// Produces exposition text on every scrape.
+		using Collector = std::function<std::string()>;
+
+		/// Start listening.
+		/// @param url address to listen on, e.g. http://127.0.0.1:9464/metrics. Requests for other paths are answered with 404.
+		/// @param collector called on every scrape, from cpprest's threads.
+		/// @throws std::runtime_error if the address can't be listened on.
+		MetricsEndpoint(std::string const& url, Collector collector);
+
+		/// Destructor. Stops listening and waits for requests being served.
+		~MetricsEndpoint();
+
+	private:
+		web::http::experimental::listener::http_listener m_Listener;													///< Listener bound to the address.
+		Collector m_Collector;																							///< Produces exposition text.
+	};
+}
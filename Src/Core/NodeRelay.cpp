@@ -1,16 +1,37 @@
 #include "StdAfx.h"
 #include "NodeRelay.h"
 #include "DeviceBridge.h"
+#include "EventTracing.h"
+#include "AllocationTracking.h"
 #include "Common/FSecure/CppTools/ByteConverter/ByteConverter.h"
+#include "Common/FSecure/CppTools/ScopeGuard.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::Core::NodeRelay> FSecure::C3::Core::NodeRelay::CreateAndRun(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory,
 	Crypto::PublicSignature const& gatewaySignature, Crypto::SymmetricKey const& broadcastKey, std::vector<ByteVector> const& gatewayInitialPackets, BuildId buildId, AgentId agentId,
-	Crypto::AsymmetricKeys const& asymmetricKeys)
+	Crypto::AsymmetricKeys const& asymmetricKeys, std::size_t deviceWorkerThreads, QualityOfService::Settings const& qosSettings)
 {
 	// Make one.
-	auto relay = std::shared_ptr<NodeRelay>{ new NodeRelay{ callbackOnLog, interfaceFactory, gatewaySignature, broadcastKey, buildId, agentId, asymmetricKeys} };
+	auto relay = std::shared_ptr<NodeRelay>{ new NodeRelay{ callbackOnLog, interfaceFactory, gatewaySignature, broadcastKey, buildId, agentId, asymmetricKeys, deviceWorkerThreads, qosSettings } };
+	relay->RunInitialPackets(gatewayInitialPackets);
 
+	// All fine and dandy.
+	return relay;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::NodeRelay> FSecure::C3::Core::NodeRelay::CreateAndRun(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory,
+	Crypto::PublicSignature const& gatewaySignature, Crypto::SymmetricKey const& broadcastKey, std::vector<ByteVector> const& gatewayInitialPackets, BuildId buildId, AgentId agentId,
+	Crypto::AsymmetricKeys const& asymmetricKeys, SharedWorkers const& workers, QualityOfService::Settings const& qosSettings)
+{
+	auto relay = std::shared_ptr<NodeRelay>{ new NodeRelay{ callbackOnLog, interfaceFactory, gatewaySignature, broadcastKey, buildId, agentId, asymmetricKeys, workers, qosSettings } };
+	relay->RunInitialPackets(gatewayInitialPackets);
+	return relay;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::RunInitialPackets(std::vector<ByteVector> const& gatewayInitialPackets)
+{
 	// Perform all initial Commands.
 	if (gatewayInitialPackets.empty())
 		throw std::invalid_argument{ OBF("No initial Command") };
@@ -18,66 +39,292 @@ std::shared_ptr<FSecure::C3::Core::NodeRelay> FSecure::C3::Core::NodeRelay::Crea
 	auto args = ByteView{ gatewayInitialPackets[0] };
 	auto isNegChannel = args.Read<bool>();
 	auto deviceHash = args.Read<HashT>();
-	auto dev = relay->CreateAndAttachDevice(DeviceId{ 0 }, deviceHash, isNegChannel, args, true);
 
+	// First Channel might take long to connect, so registration request is encrypted in the meantime.
+	std::future<ByteVector> initializeRoute;
+	if (!isNegChannel)
+		initializeRoute = std::async(std::launch::async, [this, deviceHash] { return ComposeInitializeRoute(DeviceId{ 0 }, deviceHash); });
+
+	auto dev = CreateAndAttachDevice(DeviceId{ 0 }, deviceHash, isNegChannel, args, true);
+
+	// Remaining Devices are created concurrently. First Channel is already attached, so it stays the GRC.
+	std::vector<std::future<std::shared_ptr<DeviceBridge>>> devices;
+	for (size_t i = 1; i < gatewayInitialPackets.size(); ++i)
+		devices.push_back(std::async(std::launch::async, [this, packet = ByteView{ gatewayInitialPackets[i] }] { return RunCommandAddDevice(packet); }));
 
 	// Send IC packet.
 	if (isNegChannel)
-		relay->NegotiateChannel(dev);
+		NegotiateChannel(dev);
+	else if (GetGatewayReturnChannel() == dev)
+		LockAndSendPacket(initializeRoute.get(), dev);
 	else
-		relay->InitializeRoute();
+		throw std::runtime_error{ OBF("No GRC.") };
 
-	// All fine and dandy.
-	return relay;
+	for (auto& device : devices)
+	{
+		try
+		{
+			if (auto created = device.get(); !isNegChannel)
+				SendNewDeviceNotification(created);
+		}
+		catch (std::exception& exception)
+		{
+			Log({ OBF_SEC("Failed to apply initial packet. ") + exception.what(), LogMessage::Severity::Error });
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::NodeRelay::NodeRelay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory,
+	Crypto::PublicSignature const& gatewaySignature, Crypto::SymmetricKey const& broadcastKey, BuildId buildId, AgentId agentId, Crypto::AsymmetricKeys const& asymmetricKeys,
+	std::size_t deviceWorkerThreads, QualityOfService::Settings const& qosSettings)
+	: Relay{ callbackOnLog, interfaceFactory, asymmetricKeys.first, broadcastKey, buildId, agentId, deviceWorkerThreads, qosSettings }
+	, m_GatewaySignature{ gatewaySignature }
+	, m_GatewayEncryptionKey{ Crypto::ConvertToKey(gatewaySignature) }
+	, m_GatewaySharedKey{ Crypto::PrecomputeSharedKey(m_GatewayEncryptionKey, m_DecryptionKey) }
+	, m_MyEncryptionKey{ asymmetricKeys.second }
+	, m_DeviceCreationExecutor{ TaskExecutor::Create(s_DeviceCreationWorkerCount) }
+	, m_OwnsDeviceCreationExecutor{ true }
+{
+	Log(LogMessage::Severity::Information, [&] { return OBF("Agent Id: ") + m_AgentId.ToString(); });
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::NodeRelay::NodeRelay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory,
-	Crypto::PublicSignature const& gatewaySignature, Crypto::SymmetricKey const& broadcastKey, BuildId buildId, AgentId agentId, Crypto::AsymmetricKeys const& asymmetricKeys)
-	: Relay{ callbackOnLog, interfaceFactory, asymmetricKeys.first, broadcastKey, buildId, agentId }
+	Crypto::PublicSignature const& gatewaySignature, Crypto::SymmetricKey const& broadcastKey, BuildId buildId, AgentId agentId, Crypto::AsymmetricKeys const& asymmetricKeys,
+	SharedWorkers const& workers, QualityOfService::Settings const& qosSettings)
+	: Relay{ callbackOnLog, interfaceFactory, asymmetricKeys.first, broadcastKey, buildId, agentId, workers.m_Scheduler, qosSettings }
 	, m_GatewaySignature{ gatewaySignature }
 	, m_GatewayEncryptionKey{ Crypto::ConvertToKey(gatewaySignature) }
+	, m_GatewaySharedKey{ Crypto::PrecomputeSharedKey(m_GatewayEncryptionKey, m_DecryptionKey) }
 	, m_MyEncryptionKey{ asymmetricKeys.second }
+	, m_DeviceCreationExecutor{ workers.m_DeviceCreationExecutor }
 {
-	Log({ OBF("Agent Id: ") + m_AgentId.ToString(), LogMessage::Severity::Information });
+	if (!m_DeviceCreationExecutor)
+		throw std::invalid_argument{ OBF("Device creation executor is required.") };
+
+	Log(LogMessage::Severity::Information, [&] { return OBF("Agent Id: ") + m_AgentId.ToString(); });
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::NodeRelay::OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> sender)
+FSecure::C3::Core::NodeRelay::~NodeRelay()
 {
-	auto grc = GetGatewayReturnChannel();
-	if (!grc)
-		std::runtime_error{ OBF("No GRC.") };
+	if (m_OwnsDeviceCreationExecutor)
+		m_DeviceCreationExecutor->Stop();
+
+	{
+		std::scoped_lock lock(m_IdleTrimmingMutex);
+		m_IsIdleTrimmingStopped = true;
+	}
+
+	{
+		std::scoped_lock lock(m_SpoolDrainingMutex);
+		m_IsSpoolDrainingStopped = true;
+	}
 
-	if (grc == sender)
+	{
+		std::scoped_lock lock(m_AggregationMutex);
+		m_IsAggregationStopped = true;
+	}
+
+	m_IdleTrimmingChanged.notify_all();
+	m_SpoolDrainingStopped.notify_all();
+	m_AggregationChanged.notify_all();
+
+	// Trimming, draining or aggregation might have released the last Device holding this Relay.
+	for (auto thread : { &m_IdleTrimmingThread, &m_SpoolDrainingThread, &m_AggregationThread })
+		if (!thread->joinable())
+			continue;
+		else if (thread->get_id() == std::this_thread::get_id())
+			thread->detach();
+		else
+			thread->join();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	if (IsGatewayReturnChannel(sender))
 		throw std::runtime_error{ OBF("S2G packet received from GRC.") };
 
-	// Expensive search on NodeRelay.
 	if (sender->IsChannel() && !FindRouteByOutgoingChannel(sender->GetDid()))
 		throw std::runtime_error{ OBF("S2G packet received from device that has no route attached.") };
 
+	SendToGateway(packet0, SelectGatewayReturnChannel());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::OnProtocolStriped(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	if (IsGatewayReturnChannel(sender))
+		throw std::runtime_error{ OBF("Striped packet received from GRC.") };
+
+	if (sender->IsChannel() && !FindRouteByOutgoingChannel(sender->GetDid()))
+		throw std::runtime_error{ OBF("Striped packet received from device that has no route attached.") };
+
+	auto grc = SelectGatewayReturnChannel();
+	if (!grc)
+		throw std::runtime_error{ OBF("No GRC.") };
+
 	LockAndSendPacket(packet0, grc);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::NodeRelay::OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> sender)
+void FSecure::C3::Core::NodeRelay::SendToGateway(ByteView packet, std::shared_ptr<DeviceBridge> const& grc)
 {
+	// Packets spooled earlier go first, new ones wait behind them. Full outbound queue would block or drop the packet, so it's spooled as well.
+	if (!grc || !DrainSpool(grc) || !grc->GetOutboundCredits())
+		return SpoolPacket(packet);
+
+	if (Aggregate(packet, grc))
+		return;
+
+	// Packets gathered so far were sent earlier, so they have to leave first.
+	FlushAggregated();
+	auto threshold = m_StripingThreshold.load();
+	if (!threshold || packet.size() <= threshold)
+		return SendOrSpool(packet, grc);
+
+	// Fragments fill outbound queues of healthy Channels, so faster Channels get more of them.
+	auto channel = grc;
+	for (auto const& fragment : Stripe::Split(packet, FSecure::Utils::GenerateRandomValue<std::uint32_t>()))
+	{
+		LockAndSendPacket(fragment, channel);
+		if (auto next = SelectGatewayReturnChannel())
+			channel = std::move(next);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SendOrSpool(ByteView packet, std::shared_ptr<DeviceBridge> const& grc)
+{
+	if (!grc || !DrainSpool(grc) || !grc->GetOutboundCredits())
+		return SpoolPacket(packet);
+
 	try
 	{
-		// Verify message.
-		auto veryfiedMessage = Crypto::VerifyMessage(packet0.SubString(1), m_GatewaySignature);
-		auto msgView = ByteView{ veryfiedMessage };
+		// Traced packets are reassembled on each hop, so that every Relay adds its hop to them.
+		auto trace = GetCurrentTrace();
+		if (!m_IsCutThroughEnabled || (trace && trace->m_Packet.data() == packet.data()))
+			return LockAndSendPacket(packet, grc);
 
-		// Parse recipient identifier.
-		if (auto routeId = msgView.Read<RouteId>(); routeId.GetAgentId() == m_AgentId)
+		ByteVector buffer;
+		auto trafficClass = LockPacket(packet, buffer);
+		grc->OnPassNetworkPacket(buffer, trafficClass, true);
+	}
+	catch (std::exception& exception)
+	{
+		Log(LogMessage::Severity::Warning, [&] { return OBF_SEC("Failed to send a packet to Gateway, spooling it. ") + exception.what(); });
+		SpoolPacket(packet);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::OnPacketsReceived(std::vector<ByteView> const& packets, std::shared_ptr<DeviceBridge> const& sender)
+{
+	if (packets.size() < 2)
+		return Relay::OnPacketsReceived(packets, sender);
+
+	/// State of a packet between parallel and sequential phases.
+	struct Item
+	{
+		ByteView m_Packet;																							///< Packet as received from Channel.
+		ByteVector m_Buffer;																						///< Storage of decrypted packet.
+		ByteView m_Unlocked;																						///< Decrypted packet.
+		bool m_IsSignatureVerified = false;																			///< True if signature was checked in parallel phase.
+		UnlockError m_UnlockError = UnlockError::Success;															///< Reason for dropping the packet.
+		std::exception_ptr m_Error;																					///< Failure of parallel phase.
+	};
+
+	std::vector<Item> items(packets.size());
+	for (size_t i = 0; i < packets.size(); ++i)
+		items[i].m_Packet = packets[i];
+
+	// Decrypt and verify signatures of packets addressed to this Relay in parallel. Signature failures are left for sequential phase to report.
+	std::for_each(std::execution::par, items.begin(), items.end(), [this](Item& item)
+	{
+		try
 		{
-			// addressed to me
-			auto decryptedMessage = Crypto::DecryptAndAuthenticate(msgView, m_GatewayEncryptionKey, m_DecryptionKey);
-			ProceduresG2X::RequestHandler::ParseRequestAndHandleIt(sender, routeId, decryptedMessage);
+			if (item.m_UnlockError = UnlockPacket(item.m_Packet, item.m_Buffer, item.m_Unlocked); item.m_UnlockError != UnlockError::Success || item.m_Unlocked.empty())
+				return;
+
+			auto protocol = static_cast<Protocols>(item.m_Unlocked[0]);
+			if (protocol == Protocols::G2R || (protocol == Protocols::G2A && Crypto::PeekSignedMessage(item.m_Unlocked.SubString(1)).Read<RouteId>().GetAgentId() == m_AgentId))
+			{
+				Crypto::VerifyMessageInPlace(item.m_Unlocked.SubString(1), m_GatewaySignature);
+				item.m_IsSignatureVerified = true;
+			}
 		}
-		else
+		catch (std::exception&)
+		{
+			if (item.m_Unlocked.empty())
+				item.m_Error = std::current_exception();
+		}
+	});
+
+	// Handle packets in order of arrival.
+	for (auto& item : items)
+	{
+		SCOPE_GUARD(FSecure::Utils::SecureMemzero(item.m_Buffer.data(), item.m_Buffer.size()); );
+		try
+		{
+			if (item.m_UnlockError != UnlockError::Success)
+			{
+				LogDroppedPacket(item.m_UnlockError, sender);
+				continue;
+			}
+
+			if (item.m_Error)
+				std::rethrow_exception(item.m_Error);
+
+			if (!item.m_IsSignatureVerified)
+				HandleUnlockedPacket(item.m_Unlocked, sender);
+			else if (static_cast<Protocols>(item.m_Unlocked[0]) == Protocols::G2A)
+				HandleG2A(item.m_Unlocked, sender, true);
+			else
+				HandleG2R(item.m_Unlocked, sender, true);
+		}
+		catch (std::runtime_error& e)
+		{
+			Log(LogMessage::Severity::Error, [&] { return OBF_SEC("Packet handling failure. ") + e.what(); }, sender ? sender->GetDid() : DeviceId{});
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	HandleG2A(packet0, sender, false);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::HandleG2A(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender, bool isSignatureVerified)
+{
+	try
+	{
+		// Parse recipient identifier. Packets that are only passed further are verified by the final recipient, so this hop checks only some of them.
+		auto signedMessage = packet0.SubString(1);
+		auto routeId = Crypto::PeekSignedMessage(signedMessage).Read<RouteId>();
+		auto isForwarded = routeId.GetAgentId() != m_AgentId;
+		if (isForwarded && m_ForwardedPacketsCount++ % s_ForwardedPacketVerificationInterval)
+			return MultiSendPacketFurtherThroughRouteId(packet0, routeId);
+
+		// Verify message.
+		auto msgView = isSignatureVerified ? Crypto::PeekSignedMessage(signedMessage) : Crypto::VerifyMessageInPlace(signedMessage, m_GatewaySignature);
+		msgView.remove_prefix(RouteId::BinarySize);
+		if (isForwarded)
 			// Not addressed to me -> packet needs to be passed further.
-			MultiSendPacketFurtherThroughRouteId(packet0, routeId);
+			return MultiSendPacketFurtherThroughRouteId(packet0, routeId);
+
+		// addressed to me
+		auto decryptedMessage = [&]
+		{
+			EventTracing::Scope<EventTracing::Keyword::Crypto> tracingScope{ "NodeRelay::DecryptG2A", msgView.size() };
+			AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::Crypto };
+			return Crypto::DecryptAndAuthenticate(msgView, m_GatewaySharedKey);
+		}();
+
+		ProceduresG2X::RequestHandler::ParseRequestAndHandleIt(sender, routeId, decryptedMessage);
 
 	}
 	catch (std::exception& exception)
@@ -87,13 +334,18 @@ void FSecure::C3::Core::NodeRelay::OnProtocolG2A(ByteView packet0, std::shared_p
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::NodeRelay::OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> sender)
+void FSecure::C3::Core::NodeRelay::OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	HandleG2R(packet0, sender, false);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::HandleG2R(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender, bool isSignatureVerified)
 {
 	try
 	{
-		// Verify message.
-		auto veryfiedMessage = Crypto::VerifyMessage(packet0.SubString(1), m_GatewaySignature);
-		auto msgView = ByteView{ veryfiedMessage };
+		// Verify message. Every Relay on the route handles G2R procedures, so signature is always checked.
+		auto msgView = isSignatureVerified ? Crypto::PeekSignedMessage(packet0.SubString(1)) : Crypto::VerifyMessageInPlace(packet0.SubString(1), m_GatewaySignature);
 
 		// Parse recipient identifier.
 		auto routeId = msgView.Read<RouteId>();
@@ -109,6 +361,70 @@ void FSecure::C3::Core::NodeRelay::OnProtocolG2R(ByteView packet0, std::shared_p
 	}
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::OnProtocolMulticast(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender)
+{
+	// Group packets passed further by the Channels leading to their recipients, keeping their order.
+	std::vector<std::pair<std::shared_ptr<DeviceBridge>, std::vector<ByteView>>> branches;
+	for (auto const& packet : ProceduresG2X::Multicast::Parse(packet0))
+	{
+		try
+		{
+			auto routeId = Crypto::PeekSignedMessage(packet.SubString(1)).Read<RouteId>();
+			if (routeId.GetAgentId() == m_AgentId)
+			{
+				HandleG2A(packet, sender, false);
+				continue;
+			}
+
+			auto route = FindRoute(routeId);
+			if (!route)
+				throw std::invalid_argument{ OBF("Tried to send a packet using non-existent RouteID.") };
+
+			auto channel = route->m_Channel.lock();
+			if (!channel)
+			{
+				Log({ OBF("Tried to send a packet through a dead Channel."), LogMessage::Severity::Warning });
+				continue;
+			}
+
+			auto branch = std::find_if(branches.begin(), branches.end(), [&](auto const& e) { return e.first == channel; });
+			if (branch == branches.end())
+				branch = branches.emplace(branches.end(), std::move(channel), std::vector<ByteView>{});
+
+			branch->second.push_back(packet);
+		}
+		catch (std::exception& exception)
+		{
+			Log(LogMessage::Severity::Error, [&] { return OBF_SEC("Failed to handle a packet of Multicast envelope. ") + exception.what(); }, sender ? sender->GetDid() : DeviceId{});
+		}
+	}
+
+	for (auto const& [channel, packets] : branches)
+		if (packets.size() == 1)
+			LockAndSendPacket(packets.front(), channel);
+		else
+			LockAndSendPacket(ProceduresG2X::Multicast::Wrap(packets), channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::OnTracedPacketDelivered(TraceContext const& context, std::shared_ptr<DeviceBridge> const& sender)
+{
+	// Reports are traced S2G packets and are never addressed to a NodeRelay.
+	if (static_cast<Protocols>(context.m_Packet[0]) == Protocols::S2G)
+		return;
+
+	auto grc = GetGatewayReturnChannel();
+	if (!grc)
+		throw std::runtime_error{ OBF("No GRC set while trying to send a S2G packet.") };
+
+	// Report carries hops of the delivered packet and starts a new hop list, that is filled on its way to Gateway.
+	auto hops = context.m_Hops;
+	hops.push_back({ GetAgentId(), context.GetResidenceUs() });
+	auto query = ProceduresS2G::TraceReport::Create(RouteId{ GetAgentId(), grc->GetDid() }, FSecure::Utils::TimeSinceEpoch(), context.m_TraceId, hops, m_GatewayEncryptionKey);
+	LockAndSendPacket(TraceContext::Wrap(context.m_TraceId, {}, query.ComposeQueryPacket()), grc);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::NodeRelay::MultiSendPacketFurtherThroughRouteId(ByteView packet0, RouteId routeId)
 {
@@ -123,27 +439,62 @@ void FSecure::C3::Core::NodeRelay::MultiSendPacketFurtherThroughRouteId(ByteView
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::NodeRelay::PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> senderPeripheral)
+void FSecure::C3::Core::NodeRelay::PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> const& senderPeripheral)
 {
-	auto grc = GetGatewayReturnChannel();
+	SendToConnector(command, nullptr, senderPeripheral);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::PostCommandSegmentToConnector(ByteView segment, BinderSegment const& position, std::shared_ptr<DeviceBridge> const& senderPeripheral)
+{
+	SendToConnector(segment, &position, senderPeripheral);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SendToConnector(ByteView message, BinderSegment const* segment, std::shared_ptr<DeviceBridge> const& senderPeripheral)
+{
+	auto grc = SelectGatewayReturnChannel();
 	if (!grc)
 		throw std::runtime_error{ OBF("No GRC set while trying to send a S2G packet.") };
 
 	auto connectorHash = InterfaceFactory::Instance().Find<AbstractPeripheral>(senderPeripheral->GetTypeNameHash())->second.m_ClousureConnectorHash;
-	auto query = ProceduresS2G::DeliverToBinder::Create(RouteId{ GetAgentId(), grc->GetDid() }, FSecure::Utils::TimeSinceEpoch(), senderPeripheral->GetDid(), connectorHash, command, m_GatewayEncryptionKey);
-	LockAndSendPacket(query->ComposeQueryPacket(), grc);
+	// Resources used are reported along with whole Commands or last segments of streamed ones, where Gateway handles the message.
+	auto resourceUsage = segment && segment->m_Offset + message.size() < segment->m_MessageSize ? std::nullopt : GatherResourceUsageIfDue();
+	auto query = ProceduresS2G::DeliverToBinder::Create(RouteId{ GetAgentId(), grc->GetDid() }, FSecure::Utils::TimeSinceEpoch(), senderPeripheral->GetDid(), connectorHash, message, m_GatewayEncryptionKey, resourceUsage ? &*resourceUsage : nullptr, segment);
+	SendToGateway(query.ComposeQueryPacket(), grc);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ResourceUsage> FSecure::C3::Core::NodeRelay::GatherResourceUsageIfDue()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+	auto last = m_LastResourceUsageReport.load(std::memory_order_relaxed);
+	if (now - last < std::chrono::duration_cast<std::chrono::steady_clock::duration>(s_ResourceUsageReportInterval).count())
+		return {};
+
+	// Only one of the threads sending packets at the same time reports.
+	if (!m_LastResourceUsageReport.compare_exchange_strong(last, now, std::memory_order_relaxed))
+		return {};
+
+	return ResourceUsage::Gather();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::NodeRelay::SetGatewayReturnChannel(std::shared_ptr<DeviceBridge> const& gatewayReturnChannel)
 {
-	m_GatewayReturnChannel = gatewayReturnChannel;
+	std::lock_guard lock{ m_GatewayReturnChannelsMutex };
+	auto& channels = m_GatewayReturnChannels;
+	channels.erase(std::remove_if(channels.begin(), channels.end(), [&](auto const& e) { return e.m_Channel.lock() == gatewayReturnChannel; }), channels.end());
+	if (channels.empty())
+		channels.emplace_back(gatewayReturnChannel);
+	else
+		channels.front() = ReturnChannel{ gatewayReturnChannel };
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::NodeRelay::SetGatewayReturnChannel(FSecure::ByteView args)
 {
-	auto channel = m_Devices.Find([did = DeviceId{ args.Read<std::string>() } ](auto const& e) { auto l = e.lock(); return l ? l->GetDid() == did && l->IsChannel() : false; }).lock();
+	auto channel = FindChannel(DeviceId{ args.Read<std::string_view>() });
 	if (!channel)
 		throw std::runtime_error{ OBF("Device not found") };
 
@@ -153,7 +504,341 @@ void FSecure::C3::Core::NodeRelay::SetGatewayReturnChannel(FSecure::ByteView arg
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::NodeRelay::GetGatewayReturnChannel() const
 {
-	return m_GatewayReturnChannel.lock();
+	std::lock_guard lock{ m_GatewayReturnChannelsMutex };
+	return m_GatewayReturnChannels.empty() ? nullptr : m_GatewayReturnChannels.front().m_Channel.lock();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::AddGatewayReturnChannel(FSecure::ByteView args)
+{
+	auto channel = FindChannel(DeviceId{ args.Read<std::string_view>() });
+	if (!channel)
+		throw std::runtime_error{ OBF("Device not found") };
+
+	if (IsGatewayReturnChannel(channel))
+		return;
+
+	std::lock_guard lock{ m_GatewayReturnChannelsMutex };
+	m_GatewayReturnChannels.emplace_back(channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SetStripingThreshold(FSecure::ByteView args)
+{
+	m_StripingThreshold = args.Read<std::uint32_t>();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SetIdleTrimming(FSecure::ByteView args)
+{
+	auto [quietPeriod, trimWorkingSet] = args.Read<std::uint32_t, bool>();
+	{
+		std::scoped_lock lock(m_IdleTrimmingMutex);
+		m_IdleTrimmingPeriod = std::chrono::seconds{ quietPeriod };
+		m_IsWorkingSetTrimmed = trimWorkingSet;
+		if (quietPeriod && !m_IdleTrimmingThread.joinable())
+			m_IdleTrimmingThread = std::thread{ &NodeRelay::RunIdleTrimming, this };
+	}
+
+	m_IdleTrimmingChanged.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SetSpool(FSecure::ByteView args)
+{
+	auto [memoryLimit, diskLimit] = args.Read<std::uint32_t, std::uint32_t>();
+	m_Spool.Configure(std::size_t{ memoryLimit } * 1024, std::size_t{ diskLimit } * 1024 * 1024);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SpoolPacket(ByteView packet)
+{
+	ByteVector locked;
+	auto trafficClass = LockPacket(packet, locked);
+	if (!m_Spool.Push(locked, trafficClass))
+		return Log(LogMessage::Severity::Warning, [&] { return OBF("Outbound spool is full. Packets to Gateway dropped so far: ") + std::to_string(m_Spool.GetDroppedCount()); });
+
+	std::scoped_lock lock(m_SpoolDrainingMutex);
+	if (!m_SpoolDrainingThread.joinable() && !m_IsSpoolDrainingStopped)
+		m_SpoolDrainingThread = std::thread{ &NodeRelay::RunSpoolDraining, this };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::NodeRelay::DrainSpool(std::shared_ptr<DeviceBridge> const& grc)
+{
+	if (m_Spool.IsEmpty())
+		return true;
+
+	std::scoped_lock lock(m_SpoolDrainMutex);
+	while (grc->GetOutboundCredits())
+	{
+		auto packet = m_Spool.Pop();
+		if (!packet)
+			return true;
+
+		try
+		{
+			grc->OnPassNetworkPacket(packet->m_Data, packet->m_TrafficClass);
+		}
+		catch (std::exception&)
+		{
+			m_Spool.PushFront(std::move(*packet));
+			return false;
+		}
+	}
+
+	return m_Spool.IsEmpty();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::RunSpoolDraining()
+{
+	std::unique_lock lock(m_SpoolDrainingMutex);
+	while (!m_SpoolDrainingStopped.wait_for(lock, s_SpoolDrainInterval, [this] { return m_IsSpoolDrainingStopped; }))
+	{
+		lock.unlock();
+		try
+		{
+			if (auto grc = SelectGatewayReturnChannel())
+				DrainSpool(grc);
+		}
+		catch (std::exception& exception)
+		{
+			Log(LogMessage::Severity::Error, [&] { return OBF_SEC("Failed to drain outbound spool. ") + exception.what(); });
+		}
+
+		lock.lock();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SetAggregation(FSecure::ByteView args)
+{
+	auto linger = std::chrono::milliseconds{ args.Read<std::uint32_t>() };
+	{
+		std::scoped_lock lock(m_AggregationMutex);
+		m_AggregationLinger = linger;
+		if (linger.count() && !m_AggregationThread.joinable())
+			m_AggregationThread = std::thread{ &NodeRelay::RunAggregation, this };
+	}
+
+	m_AggregationChanged.notify_all();
+	if (!linger.count())
+		FlushAggregated();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SetCutThrough(FSecure::ByteView args)
+{
+	m_IsCutThroughEnabled = args.Read<bool>();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SetResumptionToken(FSecure::ByteView args)
+{
+	auto token = args.Read<ByteView>();
+	std::scoped_lock lock(m_ResumptionTokenMutex);
+	m_ResumptionToken = token;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::NodeRelay::SelectCutThroughChannel(std::shared_ptr<DeviceBridge> const& sender)
+{
+	// Same checks as in OnProtocolS2G. Spooled packets have to leave first.
+	if (!m_IsCutThroughEnabled || !m_Spool.IsEmpty() || IsGatewayReturnChannel(sender) || !FindRouteByOutgoingChannel(sender->GetDid()))
+		return {};
+
+	auto grc = SelectGatewayReturnChannel();
+	return grc && grc != sender && grc->GetOutboundCredits() ? grc : nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::NodeRelay::Aggregate(ByteView packet, std::shared_ptr<DeviceBridge> const& grc)
+{
+	// Traced packets are sent on their own, so that this Relay's hop is added to them.
+	if (auto trace = GetCurrentTrace(); packet.size() > s_MaxAggregatedPacketSize || (trace && trace->m_Packet.data() == packet.data()))
+		return false;
+
+	std::vector<ByteVector> previous, full;
+	std::shared_ptr<DeviceBridge> previousChannel;
+	{
+		std::scoped_lock lock(m_AggregationMutex);
+		if (!m_AggregationLinger.count())
+			return false;
+
+		// Envelope goes to a single neighbor, so packets gathered for another Channel are sent first.
+		if (!m_Aggregated.empty() && m_AggregationChannel.lock() != grc)
+		{
+			previous = std::exchange(m_Aggregated, {});
+			previousChannel = m_AggregationChannel.lock();
+			m_AggregatedSize = 0;
+		}
+
+		if (m_Aggregated.empty())
+		{
+			m_AggregationChannel = grc;
+			m_AggregationDeadline = std::chrono::steady_clock::now() + m_AggregationLinger;
+			m_AggregationChanged.notify_all();
+		}
+
+		m_Aggregated.emplace_back(packet);
+		m_AggregatedSize += packet.size();
+		if (m_AggregatedSize >= s_MaxEnvelopeSize || m_Aggregated.size() == Envelope::s_MaxPackets)
+		{
+			full = std::exchange(m_Aggregated, {});
+			m_AggregatedSize = 0;
+		}
+	}
+
+	if (!previous.empty())
+		SendAggregated(previous, previousChannel);
+
+	if (!full.empty())
+		SendAggregated(full, grc);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::FlushAggregated()
+{
+	std::vector<ByteVector> packets;
+	std::shared_ptr<DeviceBridge> channel;
+	{
+		std::scoped_lock lock(m_AggregationMutex);
+		if (m_Aggregated.empty())
+			return;
+
+		packets = std::exchange(m_Aggregated, {});
+		channel = m_AggregationChannel.lock();
+		m_AggregatedSize = 0;
+	}
+
+	SendAggregated(packets, channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::SendAggregated(std::vector<ByteVector> const& packets, std::shared_ptr<DeviceBridge> const& grc)
+{
+	if (packets.size() == 1)
+		return SendOrSpool(packets.front(), grc);
+
+	SendOrSpool(Envelope::Wrap({ packets.begin(), packets.end() }), grc);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::RunAggregation()
+{
+	std::unique_lock lock(m_AggregationMutex);
+	while (!m_IsAggregationStopped)
+	{
+		if (m_Aggregated.empty())
+		{
+			m_AggregationChanged.wait(lock);
+			continue;
+		}
+
+		// Deadline moves when gathered packets are sent and new ones arrive, so it's checked again after waking up.
+		if (m_AggregationChanged.wait_until(lock, m_AggregationDeadline, [this] { return m_IsAggregationStopped; }) || std::chrono::steady_clock::now() < m_AggregationDeadline)
+			continue;
+
+		lock.unlock();
+		try
+		{
+			FlushAggregated();
+		}
+		catch (std::exception& exception)
+		{
+			Log(LogMessage::Severity::Error, [&] { return OBF_SEC("Failed to send aggregated packets. ") + exception.what(); });
+		}
+
+		lock.lock();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::RunIdleTrimming()
+{
+	auto getPacketsCount = [this] { return m_LockedPacketsCount.load(std::memory_order_relaxed) + m_UnlockedPacketsCount.load(std::memory_order_relaxed); };
+	auto lastPacketsCount = getPacketsCount();
+	auto lastActivity = std::chrono::steady_clock::now();
+	auto isTrimmed = false;
+
+	std::unique_lock lock(m_IdleTrimmingMutex);
+	while (!m_IsIdleTrimmingStopped)
+	{
+		if (!m_IdleTrimmingPeriod.count())
+		{
+			m_IdleTrimmingChanged.wait(lock);
+			continue;
+		}
+
+		// Activity is checked a few times per period, so that trimming starts soon after the period passes.
+		auto checkInterval = std::max<std::chrono::seconds>(m_IdleTrimmingPeriod / 4, 1s);
+		if (m_IdleTrimmingChanged.wait_for(lock, checkInterval, [this] { return m_IsIdleTrimmingStopped; }))
+			return;
+
+		auto now = std::chrono::steady_clock::now();
+		if (auto packetsCount = getPacketsCount(); packetsCount != lastPacketsCount)
+		{
+			lastPacketsCount = packetsCount;
+			lastActivity = now;
+			isTrimmed = false;
+			continue;
+		}
+
+		// Trimmed memory stays released until traffic comes back, so there's no point in trimming again before that.
+		if (isTrimmed || now - lastActivity < m_IdleTrimmingPeriod)
+			continue;
+
+		isTrimmed = true;
+		auto trimWorkingSet = m_IsWorkingSetTrimmed;
+		lock.unlock();
+		TrimMemory(trimWorkingSet);
+		Log({ OBF("Relay is idle. Memory trimmed."), LogMessage::Severity::DebugInformation });
+		lock.lock();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::NodeRelay::SelectGatewayReturnChannel()
+{
+	std::lock_guard lock{ m_GatewayReturnChannelsMutex };
+	std::shared_ptr<DeviceBridge> selected;
+	auto selectedScore = std::numeric_limits<double>::max();
+	for (auto& returnChannel : m_GatewayReturnChannels)
+	{
+		auto channel = returnChannel.m_Channel.lock();
+		if (!channel)
+			continue;
+
+		// Queued packets approximate the latency of the Channel. Failures catch Channels that stall without queuing, e.g. rate limited ones.
+		auto metrics = channel->GetMetrics();
+		auto failures = metrics.m_Exceptions + metrics.m_Resends;
+		returnChannel.m_FailureRate += s_FailureRateSmoothing * (static_cast<double>(failures - std::exchange(returnChannel.m_Failures, failures)) - returnChannel.m_FailureRate);
+		if (auto score = channel->GetOutboundQueueDepth() + s_FailurePenalty * returnChannel.m_FailureRate; score < selectedScore)
+		{
+			selected = std::move(channel);
+			selectedScore = score;
+		}
+	}
+
+	return selected;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::NodeRelay::IsGatewayReturnChannel(std::shared_ptr<DeviceBridge> const& device) const
+{
+	std::lock_guard lock{ m_GatewayReturnChannelsMutex };
+	return std::any_of(m_GatewayReturnChannels.begin(), m_GatewayReturnChannels.end(), [&](auto const& e) { return e.m_Channel.lock() == device; });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::NodeRelay::ReturnChannel::ReturnChannel(std::shared_ptr<DeviceBridge> const& channel)
+	: m_Channel{ channel }
+{
+	auto metrics = channel->GetMetrics();
+	m_Failures = metrics.m_Exceptions + metrics.m_Resends;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -161,7 +846,7 @@ std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::NodeRelay::C
 {
 	// Call the original CreateNewDevice.
 	auto device = Relay::CreateAndAttachDevice(iid, deviceNameHash, isNegotiationChannel, commandLine, negotiationClient);
-	if (!m_GatewayReturnChannel.lock() && !isNegotiationChannel && device->IsChannel())																			// First non-negotiation channel is automatically set as GRC.
+	if (!GetGatewayReturnChannel() && !isNegotiationChannel && device->IsChannel())																			// First non-negotiation channel is automatically set as GRC.
 		SetGatewayReturnChannel(device);
 
 	return device;
@@ -175,16 +860,30 @@ void FSecure::C3::Core::NodeRelay::InitializeRoute()
 	if (!grc)
 		throw std::runtime_error{ OBF("No GRC.") };
 
+	// Gateway that knows this Relay already needs only the token. Whole request is sent if the token is rejected.
+	auto token = [this] { std::scoped_lock lock(m_ResumptionTokenMutex); return m_ResumptionToken; }();
+	if (!token.empty())
+	{
+		auto query = ProceduresN2N::ResumeRouteQuery::Create(RouteId{ GetAgentId(), grc->GetDid() }, GetBuildId(), m_GatewayEncryptionKey, token, grc->GetTypeNameHash(), FSecure::Utils::TimeSinceEpoch());
+		return LockAndSendPacket(query.ComposeQueryPacket(), grc);
+	}
+
 	// And post it to Neighbor through GRC.
-	auto query = ProceduresN2N::InitializeRouteQuery::Create(RouteId{ GetAgentId(), grc->GetDid() }, GetBuildId(), m_GatewayEncryptionKey, m_MyEncryptionKey, grc->GetTypeNameHash(), FSecure::Utils::TimeSinceEpoch());
-	LockAndSendPacket(query->ComposeQueryPacket(), grc);
+	LockAndSendPacket(ComposeInitializeRoute(grc->GetDid(), grc->GetTypeNameHash()), grc);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Core::NodeRelay::ComposeInitializeRoute(DeviceId grcId, HashT grcTypeNameHash) const
+{
+	auto query = ProceduresN2N::InitializeRouteQuery::Create(RouteId{ GetAgentId(), grcId }, GetBuildId(), m_GatewayEncryptionKey, m_MyEncryptionKey, grcTypeNameHash, FSecure::Utils::TimeSinceEpoch());
+	return query.ComposeQueryPacket();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::NodeRelay::NegotiateChannel(std::shared_ptr<DeviceBridge> const& device)
 {
 	auto query = ProceduresN2N::ChannelIdExchangeStep1::Create(RouteId{ m_AgentId, device->GetDid()}, device->GetInputId());
-	LockAndSendPacket(query->ComposeQueryPacket(), device);
+	LockAndSendPacket(query.ComposeQueryPacket(), device);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -197,7 +896,7 @@ void FSecure::C3::Core::NodeRelay::On(ProceduresN2N::InitializeRouteQuery query)
 
 
 	auto queryS2G = ProceduresS2G::InitializeRouteQuery::Create(RouteId{ GetAgentId(), grc->GetDid() }, FSecure::Utils::TimeSinceEpoch(), query.GetSenderRouteId(), query.GetSenderChannel().lock()->GetDid(), query.GetQueryPacket(), m_GatewayEncryptionKey);
-	LockAndSendPacket(queryS2G->ComposeQueryPacket(), grc);
+	LockAndSendPacket(queryS2G.ComposeQueryPacket(), grc);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -206,19 +905,77 @@ void FSecure::C3::Core::NodeRelay::On(ProceduresS2G::InitializeRouteQuery query)
 	throw std::logic_error{ OBF("Wrong recipient.") };
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::On(ProceduresN2N::ResumeRouteQuery query)
+{
+	auto grc = GetGatewayReturnChannel();
+	if (!grc)
+		throw std::runtime_error(OBF("Cannot get GRC"));
+
+	auto sender = query.GetSenderChannel().lock();
+	if (!sender)
+		throw std::runtime_error(OBF("Invalid sender channel"));
+
+	auto queryS2G = ProceduresS2G::ResumeRouteQuery::Create(RouteId{ GetAgentId(), grc->GetDid() }, FSecure::Utils::TimeSinceEpoch(), query.GetSenderRouteId(), sender->GetDid(), query.GetQueryPacket(), m_GatewayEncryptionKey);
+	LockAndSendPacket(queryS2G.ComposeQueryPacket(), grc);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::On(ProceduresN2N::ResumeRouteRejected query)
+{
+	// Only neighbor on the way to Gateway passes rejections. Repeated rejections are ignored, as the token is already dropped.
+	auto sender = query.GetSenderChannel().lock();
+	if (!sender || !IsGatewayReturnChannel(sender) || ByteView{ query.GetQueryPacket() }.Read<RouteId>().GetAgentId() != GetAgentId())
+		return;
+
+	{
+		std::scoped_lock lock(m_ResumptionTokenMutex);
+		if (m_ResumptionToken.empty())
+			return;
+
+		m_ResumptionToken.clear();
+	}
+
+	Log({ OBF("Gateway rejected resumption token. Initializing route."), LogMessage::Severity::Warning });
+	InitializeRoute();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::On(ProceduresG2X::RejectRouteResumption query)
+{
+	// Every Relay on the route handles G2R procedures, but only the recipient is a neighbor of the rejected Relay.
+	if (query.GetRecipientRouteId().GetAgentId() != GetAgentId())
+		return;
+
+	auto [rejectedRid, directionDid] = ByteView{ query.GetPacketBody() }.Read<RouteId, DeviceId>();
+	auto bridge = FindDevice(directionDid);
+	if (!bridge)
+		throw std::runtime_error{ OBF("Cannot find bridge.") };
+
+	LockAndSendPacket(ProceduresN2N::ResumeRouteRejected::Create(RouteId{ GetAgentId(), directionDid }, rejectedRid).ComposeQueryPacket(), bridge);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::NodeRelay::On(ProceduresG2X::RunCommandOnAgentQuery query)
 {
-	ByteView queryBody = query.GetPacketBody();
+	RunAgentCommand(query.GetPacketBody());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::RunAgentCommand(ByteView queryBody)
+{
 	auto command = static_cast<Command>(queryBody.Read<std::underlying_type_t<Command>>());
 	switch (command)
 	{
 	case Command::AddDevice:
 	{
-		auto device = RunCommandAddDevice(queryBody);
-		SendNewDeviceNotification(device);
+		CacheArguments(queryBody.SubString(DeviceId::BinarySize + sizeof(bool) + sizeof(HashT)));
+		AddDeviceInBackground(queryBody);
 		break;
 	}
+	case Command::AddDeviceFromCache:
+		AddDeviceFromCache(queryBody);
+		break;
 	case Command::Close:
 		Close();
 		break;
@@ -231,6 +988,27 @@ void FSecure::C3::Core::NodeRelay::On(ProceduresG2X::RunCommandOnAgentQuery quer
 	case Command::SetGRC:
 		SetGatewayReturnChannel(queryBody);
 		break;
+	case Command::AddGRC:
+		AddGatewayReturnChannel(queryBody);
+		break;
+	case Command::SetStriping:
+		SetStripingThreshold(queryBody);
+		break;
+	case Command::SetIdleTrimming:
+		SetIdleTrimming(queryBody);
+		break;
+	case Command::SetSpool:
+		SetSpool(queryBody);
+		break;
+	case Command::SetAggregation:
+		SetAggregation(queryBody);
+		break;
+	case Command::SetCutThrough:
+		SetCutThrough(queryBody);
+		break;
+	case Command::SetResumptionToken:
+		SetResumptionToken(queryBody);
+		break;
 	case Command::Ping:
 		Ping(queryBody);
 		break;
@@ -247,8 +1025,7 @@ void FSecure::C3::Core::NodeRelay::On(ProceduresG2X::AddRoute query)
 	std::shared_ptr<DeviceBridge> bridge;
 	if (recipient.GetAgentId() == GetAgentId())
 	{
-		auto& dir = directionDid;
-		bridge = m_Devices.Find([&](auto& wp) { auto sp = wp.lock(); return sp ? sp->GetDid() == dir : false; }).lock();
+		bridge = FindDevice(directionDid);
 		if (!bridge)
 			throw std::runtime_error{OBF("Cannot find bridge.")};
 	}
@@ -269,10 +1046,15 @@ void FSecure::C3::Core::NodeRelay::On(ProceduresG2X::AddRoute query)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::NodeRelay::On(ProceduresG2X::RunCommandOnDeviceQuery query)
 {
-	ByteView queryBody = query.GetPacketBody();
+	RunDeviceCommand(query.GetPacketBody());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::RunDeviceCommand(ByteView queryBody)
+{
 	auto deviceId = DeviceId (queryBody.Read<DeviceId::UnderlyingIntegerType>());
 
-	auto device = m_Devices.Find([deviceId](auto& wp) { auto sp = wp.lock(); return sp ? sp->GetDid() == deviceId : false; }).lock();
+	auto device = FindDevice(deviceId);
 	if (!device)
 		throw std::runtime_error{ OBF("Cannot find device.") };
 
@@ -285,11 +1067,45 @@ void FSecure::C3::Core::NodeRelay::On(ProceduresG2X::DeliverToBinder query)
 	ByteView queryBody = query.GetPacketBody();
 	auto deviceId = DeviceId(queryBody.Read<DeviceId::UnderlyingIntegerType>());
 
-	auto device = m_Devices.Find([deviceId](auto& wp) { auto sp = wp.lock(); return sp ? sp->GetDid() == deviceId : false; }).lock();
+	auto device = FindDevice(deviceId);
 	if (!device)
 		throw std::runtime_error{ OBF("Cannot find device.") };
 
-	device->OnCommandFromConnector(queryBody);
+	device->OnCommandFromConnector(UnpackBinderMessage(queryBody));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::On(ProceduresG2X::RunCommandsOnAgentQuery query)
+{
+	ByteView queryBody = query.GetPacketBody();
+	auto count = queryBody.Read<std::uint16_t>();
+	std::string failures;
+	for (std::uint16_t i = 0; i < count; ++i)
+	{
+		// Malformed query is rejected as a whole, but a failed command doesn't keep the following ones from running, as if they were sent separately.
+		auto [procedureNo, commandBody] = queryBody.Read<ProceduresUnderlyingType, ByteView>();
+		try
+		{
+			switch (procedureNo)
+			{
+			case ProceduresG2X::RunCommandOnAgentQuery::GetProcedureNumberConstexpr():
+				RunAgentCommand(commandBody);
+				break;
+			case ProceduresG2X::RunCommandOnDeviceQuery::GetProcedureNumberConstexpr():
+				RunDeviceCommand(commandBody);
+				break;
+			default:
+				throw std::invalid_argument{ OBF("Unknown procedure number: ") + std::to_string(procedureNo) + '.' };
+			}
+		}
+		catch (std::exception const& exception)
+		{
+			failures += OBF_STR(" Command ") + std::to_string(i + 1) + OBF_STR(": ") + exception.what();
+		}
+	}
+
+	if (!failures.empty())
+		Log({ OBF_SEC("Some of commands sent together failed.") + failures.c_str(), LogMessage::Severity::Error });
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -312,7 +1128,7 @@ void FSecure::C3::Core::NodeRelay::On(ProceduresN2N::ChannelIdExchangeStep1 quer
 	auto newChannel = CreateAndAttachDevice(newDeviceId, sender->GetTypeNameHash(), false, negotiatedChannelArgs);
 	SendNewNegotiatedChannelNotification(newChannel->GetDid(), sender->GetDid(), ByteView{ newInputId }, newOutputId);
 	auto x = ProceduresN2N::ChannelIdExchangeStep2::Create(RouteId(m_AgentId, newChannel->GetDid()), ByteView{ newInputId });
-	LockAndSendPacket(x->ComposeQueryPacket(), newChannel);
+	LockAndSendPacket(x.ComposeQueryPacket(), newChannel);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -349,6 +1165,97 @@ std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::NodeRelay::R
 	return CreateAndAttachDevice(deviceId, deviceTypeHash, isNegotiable, commandArgs);
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::AddDeviceInBackground(ByteView commandArgs)
+{
+	// Devices with the same ID are created in order, so that a repeated command fails as it would if handled right away. Agent ID keeps Devices of Relays sharing the executor apart.
+	auto deviceId = ByteView{ commandArgs }.Read<DeviceId::UnderlyingIntegerType>();
+	m_DeviceCreationExecutor->Post(m_AgentId.ToString() + std::to_string(deviceId), TaskExecutor::Priority::Normal, [self = std::static_pointer_cast<NodeRelay>(shared_from_this()), commandArgs = ByteVector{ commandArgs }]()
+	{
+		try
+		{
+			self->SendNewDeviceNotification(self->RunCommandAddDevice(commandArgs));
+		}
+		catch (std::exception const& exception)
+		{
+			self->Log({ OBF_SEC("Failed to add Device. ") + exception.what(), LogMessage::Severity::Error });
+		}
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::AddDeviceFromCache(ByteView commandArgs)
+{
+	auto [deviceId, isNegotiable, deviceTypeHash, hash] = commandArgs.Read<DeviceId::UnderlyingIntegerType, bool, HashT, ByteView>();
+	auto arguments = FindCachedArguments(hash);
+	if (!arguments)
+	{
+		auto grc = GetGatewayReturnChannel();
+		if (!grc)
+			throw std::runtime_error(OBF("Failed to lock gateway return channel"));
+
+		auto query = ProceduresS2G::CachedArgumentsMissing::Create(RouteId(m_AgentId, grc->GetDid()), FSecure::Utils::TimeSinceEpoch(), deviceId, hash, m_GatewayEncryptionKey);
+		return LockAndSendPacket(query.ComposeQueryPacket(), grc);
+	}
+
+	AddDeviceInBackground(ByteVector{}.Write(deviceId, isNegotiable, deviceTypeHash).Concat(*arguments));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::CacheArguments(ByteView arguments)
+{
+	if (arguments.size() < s_MinCachedArgumentsSize || arguments.size() > s_ArgumentsCacheLimit)
+		return;
+
+	auto hash = Crypto::Hash(arguments);
+	auto encrypted = Crypto::EncryptAnonymously(arguments, m_ArgumentsCacheKey);
+
+	std::scoped_lock lock(m_ArgumentsCacheMutex);
+	if (auto it = std::find_if(m_ArgumentsCache.begin(), m_ArgumentsCache.end(), [&hash](auto const& cached) { return cached.m_Hash == hash; }); it != m_ArgumentsCache.end())
+	{
+		m_ArgumentsCacheSize -= it->m_Arguments.size();
+		m_ArgumentsCache.erase(it);
+	}
+
+	while (!m_ArgumentsCache.empty() && m_ArgumentsCacheSize + encrypted.size() > s_ArgumentsCacheLimit)
+	{
+		m_ArgumentsCacheSize -= m_ArgumentsCache.front().m_Arguments.size();
+		m_ArgumentsCache.pop_front();
+	}
+
+	m_ArgumentsCacheSize += encrypted.size();
+	m_ArgumentsCache.push_back({ std::move(hash), std::move(encrypted) });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ByteVector> FSecure::C3::Core::NodeRelay::FindCachedArguments(ByteView hash)
+{
+	std::scoped_lock lock(m_ArgumentsCacheMutex);
+	auto it = std::find_if(m_ArgumentsCache.begin(), m_ArgumentsCache.end(), [&hash](auto const& cached) { return ByteView{ cached.m_Hash } == hash; });
+	if (it == m_ArgumentsCache.end())
+		return {};
+
+	auto cached = std::move(*it);
+	m_ArgumentsCache.erase(it);
+	auto const& entry = m_ArgumentsCache.emplace_back(std::move(cached));
+
+	// Hash is checked again, so that a corrupted entry is never run.
+	auto arguments = Crypto::DecryptFromAnonymous(entry.m_Arguments, m_ArgumentsCacheKey);
+	if (Crypto::Hash(arguments) != entry.m_Hash)
+		throw std::runtime_error{ OBF("Cached arguments are corrupted.") };
+
+	return arguments;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::NodeRelay::Close()
+{
+	// Shared executor keeps creating Devices of other Relays. Builders already queued for this one still run.
+	if (m_OwnsDeviceCreationExecutor)
+		m_DeviceCreationExecutor->Stop();
+	Relay::Close();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::NodeRelay::SendNewDeviceNotification(std::shared_ptr<FSecure::C3::Core::DeviceBridge> const& device)
 {
@@ -357,7 +1264,7 @@ void FSecure::C3::Core::NodeRelay::SendNewDeviceNotification(std::shared_ptr<FSe
 		throw std::runtime_error(OBF("Failed to lock gateway return channel"));
 
 	auto response = ProceduresS2G::AddDeviceResponse::Create(RouteId(m_AgentId, grc->GetDid()), FSecure::Utils::TimeSinceEpoch(), device->GetDid(), device->GetTypeNameHash(), device->IsChannel(), device->IsNegotiationChannel(), m_GatewayEncryptionKey);
-	LockAndSendPacket(response->ComposeQueryPacket(), grc);
+	LockAndSendPacket(response.ComposeQueryPacket(), grc);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -368,15 +1275,35 @@ void FSecure::C3::Core::NodeRelay::SendNewNegotiatedChannelNotification(DeviceId
 		throw std::runtime_error(OBF("Failed to lock gateway return channel"));
 
 	auto response = ProceduresS2G::NewNegotiatedChannelNotification::Create(RouteId(m_AgentId, grc->GetDid()), FSecure::Utils::TimeSinceEpoch(), newDeviceId, negotiatorId, inId, outId, m_GatewayEncryptionKey);
-	LockAndSendPacket(response->ComposeQueryPacket(), grc);
+	LockAndSendPacket(response.ComposeQueryPacket(), grc);
 }
 
 void FSecure::C3::Core::NodeRelay::Ping(FSecure::ByteView args)
+{
+	SendNotification();
+}
+
+void FSecure::C3::Core::NodeRelay::SendNotification()
 {
 	auto grc = GetGatewayReturnChannel();
 	if (!grc)
 		throw std::runtime_error(OBF("Failed to lock gateway return channel"));
 
-	auto response = ProceduresS2G::Notification::Create(RouteId(m_AgentId, grc->GetDid()), FSecure::Utils::TimeSinceEpoch(), ByteView{}, m_GatewayEncryptionKey);
-	LockAndSendPacket(response->ComposeQueryPacket(), grc);
+	// Ping response carries resource usage and link quality, so that they're up to date for Relays that don't send any other S2G traffic. Older Gateways read only resource usage.
+	auto response = ProceduresS2G::Notification::Create(RouteId(m_AgentId, grc->GetDid()), FSecure::Utils::TimeSinceEpoch(), ByteVector::Create(ResourceUsage::Gather(), GetLinkQualities()), m_GatewayEncryptionKey);
+	LockAndSendPacket(response.ComposeQueryPacket(), grc);
+}
+
+void FSecure::C3::Core::NodeRelay::On(ProceduresN2N::LinkProbe query)
+{
+	Relay::On(std::move(query));
+
+	// Only one of the threads handling probes at the same time reports.
+	auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+	auto last = m_LastLinkQualityReport.load(std::memory_order_relaxed);
+	if (now - last < std::chrono::duration_cast<std::chrono::steady_clock::duration>(s_LinkQualityReportInterval).count() || !m_LastLinkQualityReport.compare_exchange_strong(last, now, std::memory_order_relaxed))
+		return;
+
+	if (GetGatewayReturnChannel())
+		SendNotification();
 }
@@ -1,14 +1,23 @@
 #pragma once
 
 #include "Relay.h"
+#include "OutboundSpool.h"
+#include "TaskExecutor.h"
 
 namespace FSecure::C3::Core
 {
 	/// Relay class specialization that implements a "client" Relay.
 	struct NodeRelay : Relay, ProceduresG2X::RequestHandler
 	{
-		/// Destructor
-		virtual ~NodeRelay() = default;
+		/// Worker pools shared by Relays running in one process, e.g. a swarm of virtual agents. Relays don't stop them.
+		struct SharedWorkers
+		{
+			std::shared_ptr<Scheduler> m_Scheduler;																	///< Updates Channels of every Relay. If null, every Device is updated in its own thread.
+			std::shared_ptr<TaskExecutor> m_DeviceCreationExecutor;													///< Runs Device builders of every Relay.
+		};
+
+		/// Destructor. Stops idle trimming and spool draining threads.
+		virtual ~NodeRelay();
 
 		/// Factory method.
 		/// @param callbackOnLog callback fired whenever a new Log entry is being added.
@@ -16,12 +25,31 @@ namespace FSecure::C3::Core
 		/// @param gatewaySignature public signature used by Network's Gateway to authenticate itself.
 		/// @param broadcastKey Network's symmetric key.
 		/// @param gatewayInitialPackets initial Procedures for this NodeRelay. Should contain creation of a at least a single Channel.
+		/// Following packets carry AddDevice arguments. These Devices are created concurrently and reported to Gateway once the Route is initialized.
 		/// @param buildId Build identifier.
 		/// @param agentId Agent identifier.
 		/// @param asymmetricKeys asymmetric keys used to communicate with the Gateway.
+		/// @param deviceWorkerThreads number of Scheduler threads updating Channels. If 0, every Device is updated in its own thread.
+		/// @param qosSettings Quality of Service settings of each Channel.
 		static std::shared_ptr<NodeRelay> CreateAndRun(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, Crypto::PublicSignature const& gatewaySignature,
 			Crypto::SymmetricKey const& broadcastKey, std::vector<ByteVector> const& gatewayInitialPackets, BuildId buildId, AgentId agentId = AgentId::GenerateRandom(),
-			Crypto::AsymmetricKeys const& asymmetricKeys = Crypto::GenerateAsymmetricKeys());
+			Crypto::AsymmetricKeys const& asymmetricKeys = Crypto::GenerateAsymmetricKeys(), std::size_t deviceWorkerThreads = Scheduler::s_DefaultWorkerCount,
+			QualityOfService::Settings const& qosSettings = {});
+
+		/// Factory method of a Relay sharing worker threads with other Relays of the process. @see CreateAndRun.
+		/// @param callbackOnLog callback fired whenever a new Log entry is being added.
+		/// @param interfaceFactory reference to interface factory.
+		/// @param gatewaySignature public signature used by Network's Gateway to authenticate itself.
+		/// @param broadcastKey Network's symmetric key.
+		/// @param gatewayInitialPackets initial Procedures for this NodeRelay. Should contain creation of a at least a single Channel.
+		/// @param buildId Build identifier.
+		/// @param agentId Agent identifier.
+		/// @param asymmetricKeys asymmetric keys used to communicate with the Gateway.
+		/// @param workers worker pools shared with other Relays.
+		/// @param qosSettings Quality of Service settings of each Channel.
+		static std::shared_ptr<NodeRelay> CreateAndRun(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, Crypto::PublicSignature const& gatewaySignature,
+			Crypto::SymmetricKey const& broadcastKey, std::vector<ByteVector> const& gatewayInitialPackets, BuildId buildId, AgentId agentId, Crypto::AsymmetricKeys const& asymmetricKeys,
+			SharedWorkers const& workers, QualityOfService::Settings const& qosSettings = {});
 
 	protected:
 		/// A protected constructor. @see Relay::Relay.
@@ -32,23 +60,61 @@ namespace FSecure::C3::Core
 		/// @param buildId Build identifier.
 		/// @param agentId Agent identifier.
 		/// @param asymmetricKeys asymmetric keys used to communicate with the Gateway.
+		/// @param deviceWorkerThreads number of Scheduler threads updating Channels.
+		/// @param qosSettings Quality of Service settings of each Channel.
+		NodeRelay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, Crypto::PublicSignature const& gatewaySignature, Crypto::SymmetricKey const& broadcastKey,
+			BuildId buildId, AgentId agentId = AgentId::GenerateRandom(), Crypto::AsymmetricKeys const& asymmetricKeys = Crypto::GenerateAsymmetricKeys(),
+			std::size_t deviceWorkerThreads = Scheduler::s_DefaultWorkerCount, QualityOfService::Settings const& qosSettings = {});
+
+		/// A protected constructor of a Relay sharing worker threads with other Relays of the process. @see Relay::Relay.
+		/// @param callbackOnLog callback fired whenever a new Log entry is being added.
+		/// @param interfaceFactory reference to interface factory.
+		/// @param gatewaySignature public signature used by Network's Gateway to authenticate itself.
+		/// @param broadcastKey Network's symmetric key.
+		/// @param buildId Build identifier.
+		/// @param agentId Agent identifier.
+		/// @param asymmetricKeys asymmetric keys used to communicate with the Gateway.
+		/// @param workers worker pools shared with other Relays. Executor must not be null.
+		/// @param qosSettings Quality of Service settings of each Channel.
 		NodeRelay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, Crypto::PublicSignature const& gatewaySignature, Crypto::SymmetricKey const& broadcastKey,
-			BuildId buildId, AgentId agentId = AgentId::GenerateRandom(), Crypto::AsymmetricKeys const& asymmetricKeys = Crypto::GenerateAsymmetricKeys());
+			BuildId buildId, AgentId agentId, Crypto::AsymmetricKeys const& asymmetricKeys, SharedWorkers const& workers, QualityOfService::Settings const& qosSettings = {});
+
+		/// Callback fired to by a Channel when several C3 packets arrive at once.
+		/// Packets are decrypted and signatures of those handled by this Relay are verified in parallel, then packets are handled in order of arrival.
+		/// @param packets full C3 packets to interpret, in order of arrival.
+		/// @param sender Interface passing the packets.
+		void OnPacketsReceived(std::vector<ByteView> const& packets, std::shared_ptr<DeviceBridge> const& sender) override;
 
 		/// Fired when a S2G protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		void OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> sender) override;
+		void OnProtocolS2G(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
 
 		/// Fired when a G2A protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		void OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> sender) override;
+		void OnProtocolG2A(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
 
 		/// Fired when a G2R protocol packet arrives.
 		/// @param packet0 a buffer that contains whole packet.
 		/// @param sender a Channel that provided the packet.
-		void OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> sender) override;
+		void OnProtocolG2R(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
+
+		/// Fired when a Multicast protocol packet arrives.
+		/// Handles wrapped packets addressed to this Relay and passes the rest further, re-wrapped for every Channel that leads to more than one recipient.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		void OnProtocolMulticast(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
+
+		/// Fired when a Striped protocol packet arrives. Fragment is passed further towards the Gateway.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		void OnProtocolStriped(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender) override;
+
+		/// Sends TraceReport to Gateway when a traced packet from Gateway is addressed to this Relay.
+		/// @param context trace context of the packet.
+		/// @param sender a Channel that provided the packet.
+		void OnTracedPacketDelivered(TraceContext const& context, std::shared_ptr<DeviceBridge> const& sender) override;
 
 		/// Passes provided (most probably an S2X) packet further.
 		/// @param packet0 a buffer that contains whole packet.
@@ -58,7 +124,13 @@ namespace FSecure::C3::Core
 		/// Called whenever an attached Binder Peripheral wants to send a Command to its Connector Binder.
 		/// @param command full Command with arguments.
 		/// @param channel Interface that will be used to send the packet.
-		void PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> channel) override;
+		void PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> const& channel) override;
+
+		/// Called whenever an attached Binder Peripheral streams a long Command to its Connector Binder in parts. Every segment is sent in its own DeliverToBinder procedure.
+		/// @param segment part of the Command.
+		/// @param position position of segment in the Command.
+		/// @param channel Interface that is sending the Command.
+		void PostCommandSegmentToConnector(ByteView segment, BinderSegment const& position, std::shared_ptr<DeviceBridge> const& channel) override;
 
 		/// Expose all base classes `On` methods.
 		using Relay::On;
@@ -86,6 +158,22 @@ namespace FSecure::C3::Core
 		/// @param query object representing the Query.
 		void On(ProceduresN2N::ChannelIdExchangeStep2 query) override;
 
+		/// Handler fired when a N2N::ResumeRouteQuery Procedure Query arrives. Query is passed to Gateway as S2G::ResumeRouteQuery.
+		/// @param query object representing the Query.
+		void On(ProceduresN2N::ResumeRouteQuery query) override;
+
+		/// Handler fired when a N2N::ResumeRouteRejected Procedure Query arrives. Resumption token is dropped and InitializeRoute is repeated in full.
+		/// @param query object representing the Query.
+		void On(ProceduresN2N::ResumeRouteRejected query) override;
+
+		/// Handler fired when a G2X::RejectRouteResumption Procedure Query arrives. Rejection is passed to the neighbor that sent the resume request.
+		/// @param query object representing the Query.
+		void On(ProceduresG2X::RejectRouteResumption query) override;
+
+		/// Handler fired when a N2N::LinkProbe Procedure Query arrives. Link quality is reported to the Gateway if an answered probe makes it due. @see s_LinkQualityReportInterval.
+		/// @param query object representing the Query.
+		void On(ProceduresN2N::LinkProbe query) override;
+
 		/// Sets the default Device used in communication with the server.
 		/// @param gatewayReturnChannel Device to set as a new return channel.
 		void SetGatewayReturnChannel(std::shared_ptr<DeviceBridge> const& gatewayReturnChannel);
@@ -98,10 +186,101 @@ namespace FSecure::C3::Core
 		/// @param args unused.
 		void Ping(FSecure::ByteView args);
 
+		/// Sends timestamp, resource usage and quality of links to neighbours to Gateway.
+		/// @throws std::runtime_error if there is no Gateway return channel.
+		void SendNotification();
+
+		/// Sets size above which S2G packets are striped across Gateway return channels.
+		/// @param args threshold in bytes stored in byte form. Zero turns striping off.
+		void SetStripingThreshold(FSecure::ByteView args);
+
+		/// Sets how long Relay has to be quiet before memory left by past traffic is released. @see Relay::TrimMemory.
+		/// @param args quiet period in seconds and working set flag stored in byte form. Zero period turns trimming off.
+		void SetIdleTrimming(FSecure::ByteView args);
+
+		/// Idle trimming thread body. Relay is quiet if no packet was sent or received.
+		void RunIdleTrimming();
+
+		/// Sets bounds of the spool keeping S2G packets while Gateway return channels are down or saturated. @see OutboundSpool::Configure.
+		/// @param args memory limit in KiB and disk limit in MiB stored in byte form. Zero disk limit turns spilling off.
+		void SetSpool(FSecure::ByteView args);
+
+		/// Locks a S2G packet and adds it to the spool. Starts the draining thread on the first call.
+		/// @param packet whole S2G packet.
+		void SpoolPacket(ByteView packet);
+
+		/// Sends spooled packets through a Gateway return channel, as long as it has outbound credits.
+		/// @param grc Gateway return channel chosen by SelectGatewayReturnChannel.
+		/// @return true if the spool is empty.
+		bool DrainSpool(std::shared_ptr<DeviceBridge> const& grc);
+
+		/// Spool draining thread body. Retries spooled packets periodically, so that they leave once a Channel recovers even if nothing else is sent.
+		void RunSpoolDraining();
+
+		/// Sets how long small S2G packets wait for others to be sent with them in one Envelope.
+		/// @param args linger window in milliseconds stored in byte form. Zero turns aggregation off. All Relays on the way must support it.
+		void SetAggregation(FSecure::ByteView args);
+
+		/// Turns cut-through of S2G packets on or off. Chunks of big packets sent to the Gateway are marked, so that Relays on the way forward them as they arrive.
+		/// Relay with cut-through enabled also forwards marked chunks it receives. Packets are reassembled anyway, and routed as usual if forwarding breaks off.
+		/// @param args flag stored in byte form.
+		void SetCutThrough(FSecure::ByteView args);
+
+		/// Stores resumption token issued by Gateway. Replaces the previous one.
+		/// @param args token stored in byte form.
+		void SetResumptionToken(FSecure::ByteView args);
+
+		/// Chooses Gateway return channel for chunks of a S2G packet received from a Route, if cut-through is enabled. @see Relay::SelectCutThroughChannel.
+		/// @param sender Channel that receives the packet.
+		/// @return Gateway return channel or null if packet should be reassembled first.
+		std::shared_ptr<DeviceBridge> SelectCutThroughChannel(std::shared_ptr<DeviceBridge> const& sender) override;
+
+		/// Adds a small S2G packet to the Envelope being gathered. Envelope is sent when it's full, when another Gateway return channel is chosen, or when the linger window passes.
+		/// @param packet whole S2G packet.
+		/// @param grc Gateway return channel chosen by SelectGatewayReturnChannel.
+		/// @return false if aggregation is off or packet is too big, and the packet should be sent on its own.
+		bool Aggregate(ByteView packet, std::shared_ptr<DeviceBridge> const& grc);
+
+		/// Sends packets gathered by Aggregate so far.
+		void FlushAggregated();
+
+		/// Sends gathered packets, wrapped in an Envelope if there is more than one.
+		/// @param packets whole S2G packets in order of sending.
+		/// @param grc Gateway return channel the packets were gathered for. Can be null if it's gone.
+		void SendAggregated(std::vector<ByteVector> const& packets, std::shared_ptr<DeviceBridge> const& grc);
+
+		/// Aggregation thread body. Sends gathered packets when their linger window passes.
+		void RunAggregation();
+
+		/// Sends whole packet through a Gateway return channel, or spools it if that's not possible. @see SendToGateway.
+		/// @param packet whole packet.
+		/// @param grc Gateway return channel chosen by SelectGatewayReturnChannel. Can be null.
+		void SendOrSpool(ByteView packet, std::shared_ptr<DeviceBridge> const& grc);
+
+		/// Sends S2G packet towards the Gateway. Packets larger than striping threshold are split, and each fragment goes through the Gateway return channel that is healthiest at the moment.
+		/// Packet is spooled instead if there is no Gateway return channel, its outbound queue is full, sending fails, or earlier packets are still spooled.
+		/// @param packet whole S2G packet.
+		/// @param grc Gateway return channel chosen by SelectGatewayReturnChannel. Can be null.
+		void SendToGateway(ByteView packet, std::shared_ptr<DeviceBridge> const& grc);
+
 		/// Gets the default Device used in communication with the server.
 		/// @return current Gateway return channel.
 		std::shared_ptr<DeviceBridge> GetGatewayReturnChannel() const;
 
+		/// Adds a Channel that S2G packets may be sent through when the default Gateway return channel is degraded.
+		/// @param args Device id stored in byte form. Channel must lead to a Relay connected to the Gateway.
+		void AddGatewayReturnChannel(FSecure::ByteView args);
+
+		/// Chooses the Gateway return channel for a S2G packet. Channels are scored by their outbound queue depth and recent exceptions and resends.
+		/// Default Gateway return channel is kept unless another one scores better.
+		/// @return healthiest Gateway return channel or null if none is alive.
+		std::shared_ptr<DeviceBridge> SelectGatewayReturnChannel();
+
+		/// Checks whether a Device is one of Gateway return channels.
+		/// @param device Device to check.
+		/// @return true if S2G packets may be sent through the Device.
+		bool IsGatewayReturnChannel(std::shared_ptr<DeviceBridge> const& device) const;
+
 		/// Creates and attaches a new Device.
 		/// @param iid address of Device in Relay.
 		/// @param deviceNameHash hash to distinguish devices types.
@@ -112,9 +291,20 @@ namespace FSecure::C3::Core
 		/// @throws std::runtime_error if device cannot be created becouse it was not registrated or commandLine is invalid.
 		std::shared_ptr<DeviceBridge> CreateAndAttachDevice(DeviceId iid, HashT deviceNameHash, bool isNegotiationChannel, ByteView commandLine, bool negotiationClient = false) override;
 
-		/// Send packet through first interface to gateway, with registration request.
+		/// Send packet through first interface to gateway, with registration request. If Gateway issued a resumption token, only the token is sent. @see SetResumptionToken.
 		void InitializeRoute();
 
+		/// Create initial Devices and register with Gateway. Part of CreateAndRun.
+		/// @param gatewayInitialPackets initial Procedures for this NodeRelay.
+		/// @throws std::invalid_argument if there are no initial Procedures.
+		void RunInitialPackets(std::vector<ByteVector> const& gatewayInitialPackets);
+
+		/// Prepare registration request. Doesn't need the Channel, so it can be composed while the Channel is being created.
+		/// @param grcId identifier of the Gateway Return Channel.
+		/// @param grcTypeNameHash type of the Gateway Return Channel.
+		/// @return whole InitializeRoute packet.
+		ByteVector ComposeInitializeRoute(DeviceId grcId, HashT grcTypeNameHash) const;
+
 		/// Starts procedure of unique channel negotiation.
 		/// @param device channel that will perform negotiation.
 		void NegotiateChannel(std::shared_ptr<DeviceBridge> const& device);
@@ -131,6 +321,18 @@ namespace FSecure::C3::Core
 		/// @param query object representing the Query.
 		void On(ProceduresG2X::DeliverToBinder query) override;
 
+		/// Handler fired when a G2X::RunCommandsOnAgentQuery Procedure Query arrives. Sub-commands are run in order, failed ones don't stop the following. Failures are reported in one log entry.
+		/// @param query object representing the Query.
+		void On(ProceduresG2X::RunCommandsOnAgentQuery query) override;
+
+		/// Runs command addressed to this Relay.
+		/// @param commandWithArguments body of RunCommandOnAgentQuery.
+		void RunAgentCommand(ByteView commandWithArguments);
+
+		/// Runs command addressed to one of Devices.
+		/// @param deviceIdWithCommand body of RunCommandOnDeviceQuery.
+		void RunDeviceCommand(ByteView deviceIdWithCommand);
+
 		/// Inform gateway that new Device was added correctly.
 		/// @param device pointer to newly created device.
 		void SendNewDeviceNotification(std::shared_ptr<FSecure::C3::Core::DeviceBridge> const& device);
@@ -146,12 +348,146 @@ namespace FSecure::C3::Core
 		/// @param commandArgs all arguments for CreateAndAttachDevice packed in byte form.
 		std::shared_ptr<FSecure::C3::Core::DeviceBridge> RunCommandAddDevice(ByteView commandArgs);
 
+		/// Creates device in the background and informs gateway when it's added @see RunCommandAddDevice. Failures are logged.
+		/// Builders of some Peripherals inject payloads and wait for them to connect, so they must not block the thread handling G2X packets.
+		/// @param commandArgs all arguments for CreateAndAttachDevice packed in byte form.
+		void AddDeviceInBackground(ByteView commandArgs);
+
+		/// Creates device from arguments cached by an earlier AddDevice Command (command handler). Gateway is asked to resend the arguments if they are not cached.
+		/// @param commandArgs [DeviceId][isNegotiable][typeHash][hash of arguments].
+		void AddDeviceFromCache(ByteView commandArgs);
+
+		/// Close Relay (command handler). Devices not created yet are dropped.
+		void Close() override;
+
 	private:
+		/// Channel leading towards the Gateway along with its health.
+		struct ReturnChannel
+		{
+			/// Create health record.
+			/// @param channel Channel leading towards the Gateway. Its failures so far are not counted.
+			ReturnChannel(std::shared_ptr<DeviceBridge> const& channel);
+
+			std::weak_ptr<DeviceBridge> m_Channel;																	///< Channel leading towards the Gateway.
+			std::uint64_t m_Failures = 0;																			///< Exceptions and resends of the Channel when it was last scored.
+			double m_FailureRate = 0;																				///< Smoothed number of failures between scorings.
+		};
+
+		/// Number of Devices created in parallel by AddDeviceInBackground.
+		static constexpr std::size_t s_DeviceCreationWorkerCount = 2;
+
+		/// AddDevice arguments of at least this size are cached, so that Gateway can send only their hash next time. Smaller ones, e.g. Channels' arguments, are not worth it.
+		static constexpr std::size_t s_MinCachedArgumentsSize = 4 * 1024;
+
+		/// Cached AddDevice arguments are bounded by this many bytes. Least recently used ones are dropped first.
+		static constexpr std::size_t s_ArgumentsCacheLimit = 8 * 1024 * 1024;
+
+		/// Weight of the newest sample in ReturnChannel::m_FailureRate.
+		static constexpr double s_FailureRateSmoothing = 0.2;
+
+		/// Score of a Gateway return channel grows by this many queued packets per smoothed failure.
+		static constexpr double s_FailurePenalty = 8;
+
+		/// Signatures of G2A packets that are only passed further are checked on every n-th packet. Final recipient always checks them.
+		static constexpr std::uint32_t s_ForwardedPacketVerificationInterval = 16;
+
+		/// S2G packets up to this size are aggregated.
+		static constexpr std::size_t s_MaxAggregatedPacketSize = s_ControlPacketSize;
+
+		/// Envelope is sent as soon as packets gathered in it reach this size.
+		static constexpr std::size_t s_MaxEnvelopeSize = 64 * 1024;
+
+		/// Spooled packets are retried this often.
+		static constexpr std::chrono::seconds s_SpoolDrainInterval = 1s;
+
+		/// Resource usage is carried by at most one DeliverToBinder procedure in this period.
+		static constexpr std::chrono::seconds s_ResourceUsageReportInterval = 1min;
+
+		/// Link quality is reported by at most one notification in this period, unless Gateway pings the Relay.
+		static constexpr std::chrono::seconds s_LinkQualityReportInterval = 5min;
+
+		/// AddDevice arguments cached for AddDeviceFromCache.
+		struct CachedArguments
+		{
+			ByteVector m_Hash;																						///< Hash of the arguments. @see Crypto::Hash.
+			ByteVector m_Arguments;																					///< Arguments, encrypted with m_ArgumentsCacheKey.
+		};
+
+		/// Caches AddDevice arguments if they are large enough. @see s_MinCachedArgumentsSize.
+		/// @param arguments Device's arguments following its type hash.
+		void CacheArguments(ByteView arguments);
+
+		/// Finds cached AddDevice arguments and marks them as recently used.
+		/// @param hash hash of the arguments.
+		/// @return decrypted arguments or nothing if they are not cached.
+		std::optional<ByteVector> FindCachedArguments(ByteView hash);
+
+		/// Gathers resource usage if it is due to be reported. @see s_ResourceUsageReportInterval.
+		/// @return resources used by the process, or nothing if they were reported recently.
+		std::optional<ResourceUsage> GatherResourceUsageIfDue();
+
+		/// Sends DeliverToBinder procedure to Gateway.
+		/// @param message whole Command or its segment.
+		/// @param segment position of message in the Command. Null if message is whole.
+		/// @param senderPeripheral Interface that is sending the Command.
+		void SendToConnector(ByteView message, BinderSegment const* segment, std::shared_ptr<DeviceBridge> const& senderPeripheral);
+
+		/// Handles G2A protocol packet.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		/// @param isSignatureVerified true if signature of the packet was already checked.
+		void HandleG2A(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender, bool isSignatureVerified);
+
+		/// Handles G2R protocol packet.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @param sender a Channel that provided the packet.
+		/// @param isSignatureVerified true if signature of the packet was already checked.
+		void HandleG2R(ByteView packet0, std::shared_ptr<DeviceBridge> const& sender, bool isSignatureVerified);
+
 		std::atomic<DeviceId::UnderlyingIntegerType> m_LastResevedDeviceId = ~(1 << (8 * DeviceId::BinarySize - 1));	///< DeviceId with MSB set are used for deviceId assigned by Node
 
-		std::weak_ptr<DeviceBridge> m_GatewayReturnChannel;																///< Channel used to communicate with the Gateway by default.
+		mutable std::mutex m_GatewayReturnChannelsMutex;																///< Guards m_GatewayReturnChannels.
+		std::vector<ReturnChannel> m_GatewayReturnChannels;																///< Channels leading towards the Gateway. First one is used by default.
 		Crypto::PublicSignature m_GatewaySignature;																		///< A public signature used by Network's Gateway to authenticate itself.
 		Crypto::PublicKey m_GatewayEncryptionKey;																		///< Gateway's public key (converted from signature) used to encrypt N2G packets.
+		Crypto::SharedKey m_GatewaySharedKey;																			///< Key shared with Gateway, used to decrypt G2A packets without repeating the key exchange.
 		Crypto::PublicKey m_MyEncryptionKey;																			///< This is going to be sent to Gateway.
+		std::atomic<std::uint32_t> m_StripingThreshold = 0;																///< S2G packets larger than this are striped. Zero if striping is off.
+		std::atomic<std::uint32_t> m_ForwardedPacketsCount = 0;															///< Number of G2A packets passed further, used to sample signature verification.
+		std::atomic<std::chrono::steady_clock::rep> m_LastResourceUsageReport = 0;										///< Time since clock's epoch when resource usage was last reported.
+		std::atomic<std::chrono::steady_clock::rep> m_LastLinkQualityReport = 0;										///< Time since clock's epoch when link quality was last reported.
+		std::atomic<bool> m_IsCutThroughEnabled = false;																///< Set if chunks of S2G packets are forwarded before reassembly.
+		std::mutex m_ResumptionTokenMutex;																				///< Guards m_ResumptionToken.
+		ByteVector m_ResumptionToken;																					///< Sent by InitializeRoute instead of the whole registration request. Empty if Gateway issued none or rejected it.
+		std::mutex m_ArgumentsCacheMutex;																				///< Guards m_ArgumentsCache and m_ArgumentsCacheSize.
+		Crypto::SymmetricKey m_ArgumentsCacheKey = Crypto::GenerateSymmetricKey();										///< Key known only to this process, so that cached arguments, e.g. stagers, don't lie in memory as plaintext.
+		std::deque<CachedArguments> m_ArgumentsCache;																	///< Cached AddDevice arguments, least recently used first.
+		std::size_t m_ArgumentsCacheSize = 0;																			///< Bytes of arguments in m_ArgumentsCache.
+		std::shared_ptr<TaskExecutor> m_DeviceCreationExecutor;															///< Runs Device builders, so that slow ones don't block G2X packets. Devices with different IDs are created in parallel.
+		bool m_OwnsDeviceCreationExecutor = false;																		///< Set if m_DeviceCreationExecutor was created by this Relay, so it's stopped with it.
+
+		std::mutex m_IdleTrimmingMutex;																					///< Guards idle trimming settings.
+		std::condition_variable m_IdleTrimmingChanged;																	///< Notified when settings change or Relay is destroyed.
+		std::chrono::seconds m_IdleTrimmingPeriod{ 0 };																	///< Quiet time after which memory is trimmed. Zero if trimming is off.
+		bool m_IsWorkingSetTrimmed = false;																				///< Set if idle trimming also swaps out the working set.
+		bool m_IsIdleTrimmingStopped = false;																			///< Set by destructor.
+		std::thread m_IdleTrimmingThread;																				///< Trims memory of idle Relay. Started by the first SetIdleTrimming.
+
+		OutboundSpool m_Spool;																							///< S2G packets waiting for a Gateway return channel.
+		std::mutex m_SpoolDrainMutex;																					///< Only one thread drains the spool at a time, so that packets leave in order.
+		std::mutex m_SpoolDrainingMutex;																				///< Guards members below.
+		std::condition_variable m_SpoolDrainingStopped;																	///< Notified by destructor.
+		bool m_IsSpoolDrainingStopped = false;																			///< Set by destructor.
+		std::thread m_SpoolDrainingThread;																				///< Retries spooled packets. Started by the first spooled packet.
+
+		std::mutex m_AggregationMutex;																					///< Guards members below.
+		std::condition_variable m_AggregationChanged;																	///< Notified when the first packet is gathered, when settings change or Relay is destroyed.
+		std::chrono::milliseconds m_AggregationLinger{ 0 };																///< How long the first gathered packet waits. Zero if aggregation is off.
+		std::vector<ByteVector> m_Aggregated;																			///< Packets gathered for the next Envelope, in order of sending.
+		std::size_t m_AggregatedSize = 0;																				///< Bytes of packets in m_Aggregated.
+		std::weak_ptr<DeviceBridge> m_AggregationChannel;																///< Gateway return channel the packets are gathered for.
+		std::chrono::steady_clock::time_point m_AggregationDeadline;													///< When gathered packets are sent.
+		bool m_IsAggregationStopped = false;																			///< Set by destructor.
+		std::thread m_AggregationThread;																				///< Sends gathered packets. Started by the first SetAggregation.
 	};
 }
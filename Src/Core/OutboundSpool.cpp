@@ -0,0 +1,160 @@
+#include "StdAfx.h"
+#include "OutboundSpool.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::OutboundSpool::~OutboundSpool()
+{
+	std::scoped_lock lock(m_Mutex);
+	RemoveSpillFile();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::OutboundSpool::Configure(std::size_t memoryLimit, std::size_t diskLimit)
+{
+	std::scoped_lock lock(m_Mutex);
+	m_MemoryLimit = memoryLimit;
+	m_DiskLimit = diskLimit;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::OutboundSpool::Push(ByteView packet, DeviceBridge::TrafficClass trafficClass)
+{
+	std::scoped_lock lock(m_Mutex);
+
+	// Packets go to memory only until the first one is spilled, so that they are taken in order.
+	if (m_Spilled.empty() && m_PacketsSize + packet.size() <= m_MemoryLimit)
+	{
+		m_Packets.push_back({ ByteVector{ packet }, trafficClass });
+		m_PacketsSize += packet.size();
+		return true;
+	}
+
+	if (m_SpillPath.empty())
+	{
+		if (!m_DiskLimit)
+			return ++m_DroppedCount, false;
+
+		auto path = std::filesystem::temp_directory_path() / (FSecure::Utils::GenerateRandomString(16) + OBF(".tmp"));
+		m_SpillFile.open(path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+		if (!m_SpillFile)
+			throw std::runtime_error{ OBF("Failed to create spool file.") };
+
+		m_SpillPath = std::move(path);
+		m_SpillCapacity = m_DiskLimit;
+		m_SpillOffset = 0;
+	}
+
+	auto offset = FindSpillOffset(packet.size());
+	if (!offset)
+		return ++m_DroppedCount, false;
+
+	m_SpillFile.seekp(*offset);
+	m_SpillFile.write(reinterpret_cast<char const*>(packet.data()), packet.size());
+	if (!m_SpillFile.flush())
+	{
+		m_SpillFile.clear();
+		throw std::runtime_error{ OBF("Failed to write spool file.") };
+	}
+
+	m_Spilled.push_back({ *offset, static_cast<std::uint32_t>(packet.size()), trafficClass });
+	m_SpillOffset = *offset + packet.size();
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::C3::Core::OutboundSpool::Packet> FSecure::C3::Core::OutboundSpool::Pop()
+{
+	std::scoped_lock lock(m_Mutex);
+	if (m_Packets.empty())
+		Refill();
+
+	if (m_Packets.empty())
+		return {};
+
+	auto packet = std::move(m_Packets.front());
+	m_Packets.pop_front();
+	m_PacketsSize -= packet.m_Data.size();
+	return packet;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::OutboundSpool::PushFront(Packet packet)
+{
+	std::scoped_lock lock(m_Mutex);
+	m_PacketsSize += packet.m_Data.size();
+	m_Packets.push_front(std::move(packet));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::OutboundSpool::IsEmpty() const
+{
+	std::scoped_lock lock(m_Mutex);
+	return m_Packets.empty() && m_Spilled.empty();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::uint64_t FSecure::C3::Core::OutboundSpool::GetDroppedCount() const
+{
+	return m_DroppedCount.load(std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<std::uint64_t> FSecure::C3::Core::OutboundSpool::FindSpillOffset(std::uint64_t size) const
+{
+	if (m_Spilled.empty())
+		return size <= m_SpillCapacity ? std::optional<std::uint64_t>{ 0 } : std::nullopt;
+
+	// Packets lie between the oldest one and m_SpillOffset, wrapping around the end of the file. Space left at the end is skipped if the packet doesn't fit there.
+	auto oldest = m_Spilled.front().m_Offset;
+	if (m_SpillOffset > oldest)
+	{
+		if (m_SpillCapacity - m_SpillOffset >= size)
+			return m_SpillOffset;
+
+		return size <= oldest ? std::optional<std::uint64_t>{ 0 } : std::nullopt;
+	}
+
+	// Equal offsets mean that the ring is full.
+	if (m_SpillOffset < oldest && oldest - m_SpillOffset >= size)
+		return m_SpillOffset;
+
+	return {};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::OutboundSpool::Refill()
+{
+	while (!m_Spilled.empty() && (m_Packets.empty() || m_PacketsSize + m_Spilled.front().m_Size <= m_MemoryLimit))
+	{
+		auto const& record = m_Spilled.front();
+		ByteVector data;
+		data.resize(record.m_Size);
+		m_SpillFile.seekg(record.m_Offset);
+		if (!m_SpillFile.read(reinterpret_cast<char*>(data.data()), data.size()))
+		{
+			m_SpillFile.clear();
+			throw std::runtime_error{ OBF("Failed to read spool file.") };
+		}
+
+		m_PacketsSize += data.size();
+		m_Packets.push_back({ std::move(data), record.m_TrafficClass });
+		m_Spilled.pop_front();
+	}
+
+	// Drained file is removed, so that it doesn't outlive the outage and picks up new disk limit.
+	if (m_Spilled.empty())
+		RemoveSpillFile();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::OutboundSpool::RemoveSpillFile()
+{
+	if (m_SpillPath.empty())
+		return;
+
+	m_SpillFile.close();
+	std::error_code ignored;
+	std::filesystem::remove(m_SpillPath, ignored);
+	m_SpillPath.clear();
+	m_Spilled.clear();
+}
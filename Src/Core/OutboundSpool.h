@@ -0,0 +1,85 @@
+#pragma once
+
+#include "DeviceBridge.h"
+
+namespace FSecure::C3::Core
+{
+	/// Bounded FIFO of locked packets waiting for a Channel towards the Gateway to recover.
+	/// Packets are kept in memory. Those that don't fit are spilled to a temporary file used as a ring buffer, and read back once memory is drained.
+	/// Packets are stored as sent to the Channel, i.e. encrypted with Network's key. Safe to call from any thread.
+	struct OutboundSpool
+	{
+		/// Memory held by spooled packets if not configured otherwise.
+		static constexpr std::size_t s_DefaultMemoryLimit = 4 * 1024 * 1024;
+
+		/// Spooled packet.
+		struct Packet
+		{
+			ByteVector m_Data;																						///< Locked packet.
+			DeviceBridge::TrafficClass m_TrafficClass;																///< Priority class of the packet in the outbound queue.
+		};
+
+		/// Destructor. Removes the spill file.
+		~OutboundSpool();
+
+		/// Sets bounds of the spool. Packets already spooled are kept even if they exceed new bounds.
+		/// @param memoryLimit bytes of packets kept in memory.
+		/// @param diskLimit size of the spill file in bytes. Zero turns spilling off. Takes effect once the current spill file is drained.
+		void Configure(std::size_t memoryLimit, std::size_t diskLimit);
+
+		/// Adds a packet at the end of the spool.
+		/// @param packet locked packet.
+		/// @param trafficClass priority class of the packet in the outbound queue.
+		/// @return false if there was no room for the packet and it was dropped.
+		/// @throws std::runtime_error if spill file can't be written.
+		bool Push(ByteView packet, DeviceBridge::TrafficClass trafficClass);
+
+		/// Takes the oldest packet.
+		/// @return oldest packet or nothing if spool is empty.
+		/// @throws std::runtime_error if spill file can't be read. Packet stays in the spool.
+		std::optional<Packet> Pop();
+
+		/// Puts back a packet taken by Pop that couldn't be sent. It becomes the oldest one again, regardless of bounds.
+		/// @param packet packet returned by Pop.
+		void PushFront(Packet packet);
+
+		/// @return true if there are no spooled packets.
+		bool IsEmpty() const;
+
+		/// @return number of packets dropped because the spool was full.
+		std::uint64_t GetDroppedCount() const;
+
+	private:
+		/// Location of a packet in the spill file.
+		struct SpilledRecord
+		{
+			std::uint64_t m_Offset;																					///< Position of the packet in the file.
+			std::uint32_t m_Size;																					///< Size of the packet.
+			DeviceBridge::TrafficClass m_TrafficClass;																///< Priority class of the packet in the outbound queue.
+		};
+
+		/// Finds room for a packet in the spill file. Must be called with m_Mutex taken.
+		/// @param size size of the packet.
+		/// @return offset to write the packet at or nothing if the file is full.
+		std::optional<std::uint64_t> FindSpillOffset(std::uint64_t size) const;
+
+		/// Moves the oldest spilled packets to memory, up to the memory limit but at least one. Must be called with m_Mutex taken.
+		/// @throws std::runtime_error if spill file can't be read.
+		void Refill();
+
+		/// Closes and removes the spill file. Must be called with m_Mutex taken.
+		void RemoveSpillFile();
+
+		mutable std::mutex m_Mutex;																						///< Guards members below.
+		std::size_t m_MemoryLimit = s_DefaultMemoryLimit;																///< Bytes of packets kept in memory.
+		std::size_t m_DiskLimit = 0;																					///< Size of the spill file when it is created. Zero if spilling is off.
+		std::deque<Packet> m_Packets;																					///< Oldest spooled packets.
+		std::size_t m_PacketsSize = 0;																					///< Bytes of packets in m_Packets.
+		std::deque<SpilledRecord> m_Spilled;																			///< Packets in the spill file, newer than those in m_Packets.
+		std::filesystem::path m_SpillPath;																				///< Location of the spill file. Empty if file is not created.
+		std::fstream m_SpillFile;																						///< Spill file.
+		std::uint64_t m_SpillCapacity = 0;																				///< Size of the ring in the spill file.
+		std::uint64_t m_SpillOffset = 0;																				///< Position where the next spilled packet is written.
+		std::atomic<std::uint64_t> m_DroppedCount = 0;																	///< Packets that didn't fit.
+	};
+}
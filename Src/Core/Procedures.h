@@ -2,6 +2,7 @@
 
 #include "BaseQuery.h"
 #include "Common/FSecure/Crypto/Crypto.hpp"
+#include "Common/FSecure/CppTools/Compression.h"
 #include "Common/FSecure/C3/Internals/BackendCommons.h"
 #include "RouteId.h"
 
@@ -19,6 +20,11 @@ namespace FSecure::C3::Core
 		G2A,																										///< [G2A]|SIGNED->|[RECEIVERS AID]|ENCRYPTED->|[G2N Procedure][FIELDS]...
 		G2R,																										///< [G2R]|SIGNED->|[AID][G2N Procedure][FIELDS]...
 		//G2B,																										///< [G2B]|SIGNED->|[AID][G2N Procedure][FIELDS]... NOT IMPLEMENTED.
+		Traced,																										///< [Traced][TRACE ID][HOP COUNT][HOPS]...[PACKET OF OTHER PROTOCOL]. @see TraceContext.
+		Multicast,																										///< [Multicast][PACKET COUNT][[SIZE][G2A PACKET]]... Not signed, so that Relays can split it. @see ProceduresG2X::Multicast.
+		Striped,																										///< [Striped][PACKET ID][CHUNK ID][PACKET SIZE][FRAGMENT OF S2G PACKET]. Reassembled by Gateway. @see Stripe.
+		Envelope,																										///< [Envelope][PACKET COUNT][[SIZE][PACKET]]... Packets for the same neighbor, locked together. Unwrapped by the neighbor. @see Envelope.
+		Fragmented,																										///< [Fragmented][PACKET ID][CHUNK ID][PACKET SIZE][FRAGMENT OF PACKET]. Packet that doesn't fit in a frame of a negotiation Channel. Every fragment is locked on its own. @see Fragment.
 	};
 
 	/// Sub-protocols of S2X.
@@ -40,6 +46,311 @@ namespace FSecure::C3::Core
 		return packetAtProcedureNumber.Read<ProceduresUnderlyingType>();
 	}
 
+	/// Messages between binders shorter than this are not compressed.
+	static constexpr std::size_t s_BinderMessageCompressionThreshold = 256;
+
+	/// Flags preceding message in DeliverToBinder procedures.
+	enum BinderMessageFlags : std::uint8_t
+	{
+		Compressed = 1 << 0,																						///< Message is compressed with Deflate.
+		WithResourceUsage = 1 << 1,																					///< Message is preceded by ResourceUsage of the sending Relay.
+		Segment = 1 << 2,																							///< Message is a segment of a longer one, preceded by its BinderSegment. Segments are not compressed.
+	};
+
+	/// Position of a segment in a message from Peripheral to Connector that was streamed in parts. @see AbstractDeviceBridge::PostCommandSegmentToConnector.
+	struct BinderSegment
+	{
+		std::uint32_t m_MessageId = 0;																				///< Identifies the message among those streamed by the same Peripheral.
+		std::uint32_t m_MessageSize = 0;																			///< Size of the whole message.
+		std::uint32_t m_Offset = 0;																					///< Position of the segment in the message.
+	};
+
+	/// Prepare message from Peripheral to Connector or back for DeliverToBinder procedure. Compresses message if it gets smaller. Messages that look random are sent as they are, without trying.
+	/// @param message original message.
+	/// @param resourceUsage resources used by the sending Relay, carried along with the message. Null if not reported.
+	/// @param segment position of the message in a longer one. Null if message is whole.
+	/// @return [flags][resourceUsage][segment][message].
+	static ByteVector PackBinderMessage(ByteView message, ResourceUsage const* resourceUsage = nullptr, BinderSegment const* segment = nullptr)
+	{
+		// Context is reused for all messages sent by the thread.
+		thread_local Compression::Compressor<Compression::Deflate> compressor;
+		auto flags = static_cast<std::uint8_t>((resourceUsage ? BinderMessageFlags::WithResourceUsage : 0) | (segment ? BinderMessageFlags::Segment : 0));
+		ByteVector compressed;
+		if (!segment && message.size() >= s_BinderMessageCompressionThreshold && Compression::IsCompressible(message))
+			if (compressed = compressor.Compress(message); compressed.size() < message.size())
+			{
+				flags |= BinderMessageFlags::Compressed;
+				message = compressed;
+			}
+
+		auto packed = ByteVector{}.Write(flags);
+		if (resourceUsage)
+			packed.Write(*resourceUsage);
+
+		if (segment)
+			packed.Write(segment->m_MessageId, segment->m_MessageSize, segment->m_Offset);
+
+		return packed.Concat(message);
+	}
+
+	/// Retrieve original message from DeliverToBinder procedure.
+	/// @param packedMessage message prepared by PackBinderMessage.
+	/// @param resourceUsage set to resources used by the sending Relay, if they were reported. Can be null.
+	/// @param segment set to position of the message in a longer one, if it's a segment. Can be null if caller doesn't reassemble messages.
+	/// @return original message, or its segment.
+	static ByteVector UnpackBinderMessage(ByteView packedMessage, std::optional<ResourceUsage>* resourceUsage = nullptr, std::optional<BinderSegment>* segment = nullptr)
+	{
+		thread_local Compression::Decompressor<Compression::Deflate> decompressor;
+		auto flags = packedMessage.Read<std::uint8_t>();
+		if (flags & BinderMessageFlags::WithResourceUsage)
+			if (auto usage = packedMessage.Read<ResourceUsage>(); resourceUsage)
+				*resourceUsage = usage;
+
+		if (flags & BinderMessageFlags::Segment)
+		{
+			if (!segment)
+				throw std::runtime_error{ OBF("Unexpected segment of a binder message.") };
+
+			auto [messageId, messageSize, offset] = packedMessage.Read<std::uint32_t, std::uint32_t, std::uint32_t>();
+			*segment = BinderSegment{ messageId, messageSize, offset };
+		}
+
+		return flags & BinderMessageFlags::Compressed ? decompressor.Decompress(packedMessage) : ByteVector{ packedMessage };
+	}
+
+	/// Trace context of a packet wrapped in Traced protocol.
+	/// Every Relay that passes the packet further appends its hop, so that Gateway can tell where the time was spent.
+	struct TraceContext
+	{
+		/// Relay that passed the packet.
+		struct Hop
+		{
+			AgentId m_AgentId;																						///< Relay's Agent identifier.
+			std::uint32_t m_ResidenceUs;																			///< Microseconds between receiving and sending the packet. Clocks of Relays are not synchronized, so only durations are carried.
+		};
+
+		/// Hops appended after this many are dropped.
+		static constexpr std::size_t s_MaxHops = 255;
+
+		/// Parse Traced packet.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @return trace context, with m_Packet pointing to the wrapped packet inside packet0.
+		/// @throws std::runtime_error if packet is malformed.
+		static TraceContext Parse(ByteView packet0)
+		{
+			try
+			{
+				packet0.remove_prefix(1);
+				TraceContext context;
+				context.m_ArrivalTime = std::chrono::steady_clock::now();
+				context.m_TraceId = packet0.Read<std::uint32_t>();
+				context.m_Hops = ReadHops(packet0);
+				context.m_Packet = packet0;
+				return context;
+			}
+			catch (std::exception& exception)
+			{
+				throw std::runtime_error{ OBF_STR("Failed to parse Traced packet. ") + exception.what() };
+			}
+		}
+
+		/// Wrap packet in Traced protocol.
+		/// @param traceId identifier of the trace.
+		/// @param hops Relays that already passed the packet.
+		/// @param packet packet of other protocol.
+		/// @return whole Traced packet.
+		static ByteVector Wrap(std::uint32_t traceId, std::vector<Hop> const& hops, ByteView packet)
+		{
+			auto buffer = ByteVector{};
+			buffer.reserve(Header::Size + HopsSize(hops) + packet.size());
+			Header::Write(buffer, static_cast<ProtocolsUnderlyingType>(Protocols::Traced), traceId);
+			return buffer.Concat(WriteHops(hops), packet);
+		}
+
+		/// Serialize hops.
+		/// @param hops hops to write. Only first s_MaxHops are written.
+		/// @return [HOP COUNT][[AID][RESIDENCE]]...
+		static ByteVector WriteHops(std::vector<Hop> const& hops)
+		{
+			auto count = std::min(hops.size(), s_MaxHops);
+			auto buffer = ByteVector{};
+			buffer.reserve(HopsSize(hops));
+			buffer.Write(static_cast<std::uint8_t>(count));
+			for (size_t i = 0; i < count; ++i)
+				HopLayout::Write(buffer, hops[i].m_AgentId, hops[i].m_ResidenceUs);
+
+			return buffer;
+		}
+
+		/// Deserialize hops and move buffer to position after.
+		/// @param buffer reference to buffer written by WriteHops.
+		/// @return hops in order of passing.
+		static std::vector<Hop> ReadHops(ByteView& buffer)
+		{
+			auto count = buffer.Read<std::uint8_t>();
+			if (count * HopLayout::Size > buffer.size())
+				throw std::out_of_range{ OBF("Hop count exceeds packet size.") };
+
+			std::vector<Hop> hops(count);
+			for (auto& hop : hops)
+				std::tie(hop.m_AgentId, hop.m_ResidenceUs) = HopLayout::Read(buffer);
+
+			return hops;
+		}
+
+		/// Get time that passed since the packet arrived.
+		/// @return microseconds, saturated to fit in Hop::m_ResidenceUs.
+		std::uint32_t GetResidenceUs() const
+		{
+			auto residence = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_ArrivalTime).count();
+			return static_cast<std::uint32_t>(std::min<decltype(residence)>(residence, std::numeric_limits<std::uint32_t>::max()));
+		}
+
+		/// Layout of Traced packet header: [PROTOCOL][TRACE ID].
+		using Header = FixedLayout<ProtocolsUnderlyingType, std::uint32_t>;
+
+		/// Layout of a single serialized hop: [AID][RESIDENCE].
+		using HopLayout = FixedLayout<AgentId, std::uint32_t>;
+
+		/// Get size of serialized hops.
+		/// @param hops hops to write.
+		/// @return number of bytes written by WriteHops.
+		static size_t HopsSize(std::vector<Hop> const& hops)
+		{
+			return sizeof(std::uint8_t) + std::min(hops.size(), s_MaxHops) * HopLayout::Size;
+		}
+
+		std::uint32_t m_TraceId = 0;																				///< Identifier assigned by Gateway.
+		std::vector<Hop> m_Hops;																					///< Relays that passed the packet before it arrived.
+		ByteView m_Packet;																							///< Wrapped packet.
+		std::chrono::steady_clock::time_point m_ArrivalTime;														///< Time of parsing the packet.
+		bool m_IsForwarded = false;																					///< Set when the wrapped packet is sent further.
+	};
+
+	/// Large S2G packet split into fragments, that Relays send through all their Gateway return channels.
+	/// Fragments are passed to Gateway unchanged and carry QoS header, so that Gateway reassembles them with QualityOfService no matter which Channels they came through.
+	struct Stripe
+	{
+		/// Maximal size of S2G packet data carried by one fragment.
+		static constexpr std::size_t s_FragmentSize = 64 * 1024;
+
+		/// Layout of fragment header: [PROTOCOL][PACKET ID][CHUNK ID][PACKET SIZE].
+		using Header = FixedLayout<ProtocolsUnderlyingType, std::uint32_t, std::uint32_t, std::uint32_t>;
+
+		/// Split packet into Striped packets.
+		/// @param packet whole S2G packet.
+		/// @param packetId identifier shared by the fragments. Should be random, because Gateway reassembles fragments from all Relays together.
+		/// @return whole Striped packets in order of fragments.
+		static std::vector<ByteVector> Split(ByteView packet, std::uint32_t packetId)
+		{
+			auto packetSize = static_cast<std::uint32_t>(packet.size());
+			std::vector<ByteVector> fragments;
+			for (std::uint32_t chunkId = 0; !packet.empty(); ++chunkId)
+			{
+				auto fragment = packet.SubString(0, s_FragmentSize);
+				packet.remove_prefix(fragment.size());
+				auto& buffer = fragments.emplace_back();
+				buffer.reserve(Header::Size + fragment.size());
+				Header::Write(buffer, static_cast<ProtocolsUnderlyingType>(Protocols::Striped), packetId, chunkId, packetSize);
+				buffer.Concat(fragment);
+			}
+
+			return fragments;
+		}
+	};
+
+	/// Small packets sent to the same neighbor within a linger window, so that they are locked once and take one Channel operation.
+	/// Envelope is unwrapped by the neighbor, which handles the packets as if they arrived one by one.
+	struct Envelope
+	{
+		/// Maximal number of packets in one envelope.
+		static constexpr std::size_t s_MaxPackets = std::numeric_limits<std::uint16_t>::max();
+
+		/// Wrap packets in Envelope protocol.
+		/// @param packets whole packets of any protocol but Envelope.
+		/// @return whole Envelope packet.
+		/// @throws std::invalid_argument if there are more than s_MaxPackets packets.
+		static ByteVector Wrap(std::vector<ByteView> const& packets)
+		{
+			if (packets.size() > s_MaxPackets)
+				throw std::invalid_argument{ OBF("Too many packets for an envelope.") };
+
+			auto buffer = ByteVector{}.Write(static_cast<ProtocolsUnderlyingType>(Protocols::Envelope), static_cast<std::uint16_t>(packets.size()));
+			for (auto const& packet : packets)
+				buffer.Write(packet);
+
+			return buffer;
+		}
+
+		/// Parse Envelope packet.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @return wrapped packets, pointing inside packet0.
+		/// @throws std::runtime_error if packet is malformed.
+		static std::vector<ByteView> Parse(ByteView packet0)
+		{
+			try
+			{
+				packet0.remove_prefix(1);
+				std::vector<ByteView> packets(packet0.Read<std::uint16_t>());
+				for (auto& packet : packets)
+					if (packet = packet0.Read<ByteView>(); packet.empty() || static_cast<Protocols>(packet[0]) == Protocols::Envelope)
+						throw std::invalid_argument{ OBF("Envelope may not be empty or nested.") };
+
+				return packets;
+			}
+			catch (std::exception& exception)
+			{
+				throw std::runtime_error{ OBF_STR("Failed to parse Envelope packet. ") + exception.what() };
+			}
+		}
+	};
+
+	/// Packet split to fit in frames of a negotiation Channel. Such Channel is shared by all Relays that join through it, so there are no QoS packet IDs to agree on.
+	/// Packet ID is derived from content of the packet instead, so fragments of a packet sent again land in the same place. Fragments carry QoS header, so that receiver reassembles them with QualityOfService.
+	struct Fragment
+	{
+		/// Layout of fragment header: [PROTOCOL][PACKET ID][CHUNK ID][PACKET SIZE].
+		using Header = FixedLayout<ProtocolsUnderlyingType, std::uint32_t, std::uint32_t, std::uint32_t>;
+
+		/// Derive packet ID from content of the packet.
+		/// @param packet whole packet.
+		/// @return FNV-1a hash of the packet.
+		static std::uint32_t GetPacketId(ByteView packet)
+		{
+			auto hash = std::uint32_t{ 2166136261u };
+			for (auto byte : packet)
+				hash = (hash ^ byte) * 16777619u;
+
+			return hash;
+		}
+
+		/// Split packet into Fragmented packets.
+		/// @param packet whole packet of any protocol but Fragmented.
+		/// @param fragmentSize maximal size of packet data carried by one fragment.
+		/// @return whole Fragmented packets in order of fragments.
+		/// @throws std::invalid_argument if fragmentSize is 0.
+		static std::vector<ByteVector> Split(ByteView packet, std::size_t fragmentSize)
+		{
+			if (!fragmentSize)
+				throw std::invalid_argument{ OBF("Fragment must carry data.") };
+
+			auto packetId = GetPacketId(packet);
+			auto packetSize = static_cast<std::uint32_t>(packet.size());
+			std::vector<ByteVector> fragments;
+			for (std::uint32_t chunkId = 0; !packet.empty(); ++chunkId)
+			{
+				auto fragment = packet.SubString(0, fragmentSize);
+				packet.remove_prefix(fragment.size());
+				auto& buffer = fragments.emplace_back();
+				buffer.reserve(Header::Size + fragment.size());
+				Header::Write(buffer, static_cast<ProtocolsUnderlyingType>(Protocols::Fragmented), packetId, chunkId, packetSize);
+				buffer.Concat(fragment);
+			}
+
+			return fragments;
+		}
+	};
+
 	/// Neighbor Relay -> Neighbor Relay Procedures.
 	namespace ProceduresN2N
 	{
@@ -132,10 +443,10 @@ namespace FSecure::C3::Core
 			/// @param grcHash hash identifying type of first interface.
 			/// @param timestamp time of generating message.
 			/// @param responseType inform if recipient if response is required.
-			static std::unique_ptr<InitializeRouteQuery> Create(RouteId sendersRid, BuildId buildId, Crypto::PublicKey gatewayEncryptionKey, Crypto::PublicKey agentsPublicEncryptionKey, HashT grcHash, int32_t timestamp, ResponseType responseType = ResponseType::None)
+			static InitializeRouteQuery Create(RouteId sendersRid, BuildId buildId, Crypto::PublicKey gatewayEncryptionKey, Crypto::PublicKey agentsPublicEncryptionKey, HashT grcHash, int32_t timestamp, ResponseType responseType = ResponseType::None)
 			{
-				auto query = std::make_unique<InitializeRouteQuery>(sendersRid, responseType);
-				query->m_QueryPacketBody = Crypto::EncryptAnonymously(ByteVector::Create(buildId, agentsPublicEncryptionKey.ToByteVector(), grcHash, timestamp, HostInfo::Gather()), gatewayEncryptionKey);
+				auto query = InitializeRouteQuery{ sendersRid, responseType };
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(ByteVector::Create(buildId, agentsPublicEncryptionKey.ToByteVector(), grcHash, timestamp, HostInfo::Gather()), gatewayEncryptionKey);
 				return query;
 			}
 
@@ -150,10 +461,10 @@ namespace FSecure::C3::Core
 			/// Create query.
 			/// @param sendersRid route id of sender.
 			/// @param generatedInputId input id of negotiated channel from new relay.
-			static std::unique_ptr<ChannelIdExchangeStep1> Create(RouteId sendersRid, ByteView generatedInputId)
+			static ChannelIdExchangeStep1 Create(RouteId sendersRid, ByteView generatedInputId)
 			{
-				auto query = std::make_unique<ChannelIdExchangeStep1>(sendersRid);
-				query->m_QueryPacketBody = ByteVector{}.Write(generatedInputId);
+				auto query = ChannelIdExchangeStep1{ sendersRid };
+				query.m_QueryPacketBody = ByteVector{}.Write(generatedInputId);
 				return query;
 			}
 
@@ -168,10 +479,69 @@ namespace FSecure::C3::Core
 			/// Create query.
 			/// @param sendersRid route id of sender.
 			/// @param generatedInputId input id of negotiated channel from network relay side.
-			static std::unique_ptr<ChannelIdExchangeStep2> Create(RouteId sendersRid, ByteView generatedInputId)
+			static ChannelIdExchangeStep2 Create(RouteId sendersRid, ByteView generatedInputId)
+			{
+				auto query = ChannelIdExchangeStep2{ sendersRid };
+				query.m_QueryPacketBody = ByteVector{}.Write(generatedInputId);
+				return query;
+			}
+
+		private:
+			/// Inherit Constructors.
+			using Query::Query;
+		};
+
+		/// Measures the link between neighbours. Receiver sends the probe back as an echo through the Channel it came from.
+		struct LinkProbe final : Query<4>
+		{
+			/// Create query.
+			/// @param sendersRid route id of sender.
+			/// @param isEcho true if query answers a probe.
+			/// @param sequence number of the probe, echoed back unchanged.
+			static LinkProbe Create(RouteId sendersRid, bool isEcho, std::uint32_t sequence)
 			{
-				auto query = std::make_unique<ChannelIdExchangeStep2>(sendersRid);
-				query->m_QueryPacketBody = ByteVector{}.Write(generatedInputId);
+				auto query = LinkProbe{ sendersRid };
+				query.m_QueryPacketBody = ByteVector::Create(isEcho, sequence);
+				return query;
+			}
+
+		private:
+			/// Inherit Constructors.
+			using Query::Query;
+		};
+
+		/// Query used to rejoin network by a relay that was registered before. Replaces InitializeRouteQuery if relay holds a resumption token issued by gateway.
+		struct ResumeRouteQuery final : Query<5>
+		{
+			/// Create new instance.
+			/// @param sendersRid RouteId created from relay AgentId, and grc DeviceId.
+			/// @param buildId id of relay build.
+			/// @param gatewayEncryptionKey key used to encrypt package. Only gateway will be able to decrypt package.
+			/// @param resumptionToken token received from gateway with SetResumptionToken Command.
+			/// @param grcHash hash identifying type of first interface.
+			/// @param timestamp time of generating message.
+			static ResumeRouteQuery Create(RouteId sendersRid, BuildId buildId, Crypto::PublicKey gatewayEncryptionKey, ByteView resumptionToken, HashT grcHash, int32_t timestamp)
+			{
+				auto query = ResumeRouteQuery{ sendersRid };
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(ByteVector::Create(buildId, resumptionToken, grcHash, timestamp), gatewayEncryptionKey);
+				return query;
+			}
+
+		private:
+			/// Inherit Constructors.
+			using Query::Query;
+		};
+
+		/// Tells relay that its resumption token was rejected, so it has to send InitializeRouteQuery.
+		struct ResumeRouteRejected final : Query<6>
+		{
+			/// Create query.
+			/// @param sendersRid route id of sender.
+			/// @param rejectedRid route id of relay whose token was rejected. Other relays sharing the Channel ignore the query.
+			static ResumeRouteRejected Create(RouteId sendersRid, RouteId rejectedRid)
+			{
+				auto query = ResumeRouteRejected{ sendersRid };
+				query.m_QueryPacketBody = ByteVector::Create(rejectedRid);
 				return query;
 			}
 
@@ -195,6 +565,15 @@ namespace FSecure::C3::Core
 			/// Declaration of support for ChannelIdExchangeStep2 Request.
 			virtual void On(ChannelIdExchangeStep2) = 0;
 
+			/// Declaration of support for LinkProbe Request.
+			virtual void On(LinkProbe) = 0;
+
+			/// Declaration of support for ResumeRouteQuery Request.
+			virtual void On(ResumeRouteQuery) = 0;
+
+			/// Declaration of support for ResumeRouteRejected Request.
+			virtual void On(ResumeRouteRejected) = 0;
+
 			/// Function responsible interpreting request and calling right handle.
 			/// @param sender Device that reported request.
 			/// @param neighborRouteId Id of sender relay.
@@ -220,6 +599,12 @@ namespace FSecure::C3::Core
 					return On(ChannelIdExchangeStep1{ sender, neighborRouteId, procedureNo, packetAfterProcedureNumber });
 				case ChannelIdExchangeStep2::GetProcedureNumberConstexpr():
 					return On(ChannelIdExchangeStep2{ sender, neighborRouteId, procedureNo, packetAfterProcedureNumber });
+				case LinkProbe::GetProcedureNumberConstexpr():
+					return On(LinkProbe{ sender, neighborRouteId, procedureNo, packetAfterProcedureNumber });
+				case ResumeRouteQuery::GetProcedureNumberConstexpr():
+					return On(ResumeRouteQuery{ sender, neighborRouteId, procedureNo, packetAfterProcedureNumber });
+				case ResumeRouteRejected::GetProcedureNumberConstexpr():
+					return On(ResumeRouteRejected{ sender, neighborRouteId, procedureNo, packetAfterProcedureNumber });
 				}
 
 				throw std::invalid_argument{ OBF("Unknown N2N Query Procedure number: ") + std::to_string(procedureNo) + OBF(".") };
@@ -273,7 +658,7 @@ namespace FSecure::C3::Core
 			}
 
 			/// Get Query Body.
-			ByteVector GetQueryPacket()
+			ByteView GetQueryPacket()
 			{
 				return m_QueryPacketBody;
 			}
@@ -325,10 +710,10 @@ namespace FSecure::C3::Core
 			/// @param senderSideDid device id that connects new relay
 			/// @param encryptedBlob encrypted message for gateway from N2N packet.
 			/// @param gatewayPublicEncryptionKey key used to encrypt package. Only gateway will be able to decrypt package.
-			static std::unique_ptr<InitializeRouteQuery> Create(RouteId rid, int32_t timestamp, RouteId senderRid, DeviceId senderSideDid, ByteVector encryptedBlob, Crypto::PublicKey gatewayPublicEncryptionKey)
+			static InitializeRouteQuery Create(RouteId rid, int32_t timestamp, RouteId senderRid, DeviceId senderSideDid, ByteVector encryptedBlob, Crypto::PublicKey gatewayPublicEncryptionKey)
 			{
-				auto query = std::make_unique<InitializeRouteQuery>(rid, timestamp, ResponseType::None);
-				query->m_QueryPacketBody = Crypto::EncryptAnonymously(query->CompileQueryHeader().Write(rid, timestamp, senderRid, senderSideDid).Concat(encryptedBlob), gatewayPublicEncryptionKey);
+				auto query = InitializeRouteQuery{ rid, timestamp, ResponseType::None };
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(query.CompileQueryHeader().Write(rid, timestamp, senderRid, senderSideDid).Concat(encryptedBlob), gatewayPublicEncryptionKey);
 				return query;
 			}
 
@@ -337,9 +722,9 @@ namespace FSecure::C3::Core
 			/// @param rid RouteID of Relay sending S2G.
 			/// @param timestamp reported time at relay.
 			/// @param encryptedBlob already encrypted packet body.
-			static std::unique_ptr<InitializeRouteQuery> Create(std::weak_ptr<DeviceBridge> sender, RouteId rid, int32_t timestamp, ByteView encryptedBlob)
+			static InitializeRouteQuery Create(std::weak_ptr<DeviceBridge> sender, RouteId rid, int32_t timestamp, ByteView encryptedBlob)
 			{
-				auto query = std::make_unique<InitializeRouteQuery>(sender, rid, timestamp, encryptedBlob);
+				auto query = InitializeRouteQuery{ sender, rid, timestamp, encryptedBlob };
 				return query;
 			}
 
@@ -359,11 +744,11 @@ namespace FSecure::C3::Core
 			/// @param isChannel informs if device is channel or peripheral.
 			/// @param isNegotiationChannel if channel informs if new device can be used for negotiation.
 			/// @param gatewayPublicEncryptionKey key used to encrypt package. Only gateway will be able to decrypt package.
-			static std::unique_ptr<AddDeviceResponse> Create(RouteId rid, int32_t timestamp, DeviceId newDeviceId, HashT deviceTypeHash, bool isChannel, bool isNegotiationChannel, Crypto::PublicKey gatewayPublicEncryptionKey)
+			static AddDeviceResponse Create(RouteId rid, int32_t timestamp, DeviceId newDeviceId, HashT deviceTypeHash, bool isChannel, bool isNegotiationChannel, Crypto::PublicKey gatewayPublicEncryptionKey)
 			{
-				auto query = std::make_unique<AddDeviceResponse>(rid, timestamp, ResponseType::None);
+				auto query = AddDeviceResponse{ rid, timestamp, ResponseType::None };
 				std::uint8_t flags = static_cast<std::uint8_t>(isChannel) | (static_cast<std::uint8_t>(isNegotiationChannel) << 1);
-				query->m_QueryPacketBody = Crypto::EncryptAnonymously(query->CompileQueryHeader().Write(rid, timestamp, newDeviceId, deviceTypeHash, flags), gatewayPublicEncryptionKey);
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(query.CompileQueryHeader().Write(rid, timestamp, newDeviceId, deviceTypeHash, flags), gatewayPublicEncryptionKey);
 				return query;
 			}
 
@@ -380,12 +765,14 @@ namespace FSecure::C3::Core
 			/// @param timestamp reported time at relay.
 			/// @param peripheralId id of peripheral sending packet.
 			/// @param connectorHash type of connector that should handle message.
-			/// @param blobFromPeripheral original message.
+			/// @param blobFromPeripheral original message. Compressed if it gets smaller. @see PackBinderMessage.
 			/// @param gatewayPublicEncryptionKey key used to encrypt package. Only gateway will be able to decrypt package.
-			static std::unique_ptr<DeliverToBinder> Create(RouteId rid, int32_t timestamp, DeviceId peripheralId, HashT connectorHash, ByteView blobFromPeripheral, Crypto::PublicKey gatewayPublicEncryptionKey)
+			/// @param resourceUsage resources used by the Relay, carried along with the message. Null if not reported.
+			/// @param segment position of blobFromPeripheral in a longer message. Null if message is whole.
+			static DeliverToBinder Create(RouteId rid, int32_t timestamp, DeviceId peripheralId, HashT connectorHash, ByteView blobFromPeripheral, Crypto::PublicKey gatewayPublicEncryptionKey, ResourceUsage const* resourceUsage = nullptr, BinderSegment const* segment = nullptr)
 			{
-				auto query = std::make_unique<DeliverToBinder>(rid, timestamp, ResponseType::None);
-				query->m_QueryPacketBody = Crypto::EncryptAnonymously(query->CompileQueryHeader().Write(rid, timestamp, peripheralId, connectorHash).Concat(blobFromPeripheral), gatewayPublicEncryptionKey);
+				auto query = DeliverToBinder{ rid, timestamp, ResponseType::None };
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(query.CompileQueryHeader().Write(rid, timestamp, peripheralId, connectorHash).Concat(PackBinderMessage(blobFromPeripheral, resourceUsage, segment)), gatewayPublicEncryptionKey);
 				return query;
 			}
 
@@ -393,10 +780,10 @@ namespace FSecure::C3::Core
 			/// @param rid of relay sending S2G
 			/// @param timestamp reported time at relay.
 			/// @param encryptedBlob already encrypted packet body.
-			static std::unique_ptr<DeliverToBinder> Create(RouteId rid, int32_t timestamp, ByteView encryptedBlob)
+			static DeliverToBinder Create(RouteId rid, int32_t timestamp, ByteView encryptedBlob)
 			{
-				auto query = std::make_unique<DeliverToBinder>(rid, timestamp, ResponseType::None);
-				query->m_QueryPacketBody = encryptedBlob;
+				auto query = DeliverToBinder{ rid, timestamp, ResponseType::None };
+				query.m_QueryPacketBody = encryptedBlob;
 				return query;
 			}
 
@@ -416,10 +803,10 @@ namespace FSecure::C3::Core
 			/// @param inId input id of new channel
 			/// @param outId output id of new channel
 			/// @param gatewayPublicEncryptionKey key used to encrypt package. Only gateway will be able to decrypt package.
-			static std::unique_ptr<NewNegotiatedChannelNotification> Create(RouteId rid, int32_t timestamp, DeviceId newDeviceId, DeviceId negotiatiorId, ByteView inId, ByteView outId, Crypto::PublicKey gatewayPublicEncryptionKey)
+			static NewNegotiatedChannelNotification Create(RouteId rid, int32_t timestamp, DeviceId newDeviceId, DeviceId negotiatiorId, ByteView inId, ByteView outId, Crypto::PublicKey gatewayPublicEncryptionKey)
 			{
-				auto query = std::make_unique<NewNegotiatedChannelNotification>(rid, timestamp, ResponseType::None);
-				query->m_QueryPacketBody = Crypto::EncryptAnonymously(query->CompileQueryHeader().Write(rid, timestamp, newDeviceId, negotiatiorId, inId, outId), gatewayPublicEncryptionKey);
+				auto query = NewNegotiatedChannelNotification{ rid, timestamp, ResponseType::None };
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(query.CompileQueryHeader().Write(rid, timestamp, newDeviceId, negotiatiorId, inId, outId), gatewayPublicEncryptionKey);
 				return query;
 			}
 
@@ -437,10 +824,75 @@ namespace FSecure::C3::Core
 			/// @param timestamp reported time at relay.
 			/// @param blob unspecified data
 			/// @param gatewayPublicEncryptionKey key used to encrypt package. Only gateway will be able to decrypt package.
-			static std::unique_ptr<Notification> Create(RouteId rid, int32_t timestamp, FSecure::ByteView blob, Crypto::PublicKey gatewayPublicEncryptionKey)
+			static Notification Create(RouteId rid, int32_t timestamp, FSecure::ByteView blob, Crypto::PublicKey gatewayPublicEncryptionKey)
+			{
+				auto query = Notification{ rid, timestamp, ResponseType::None };
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(query.CompileQueryHeader().Write(rid, timestamp, blob), gatewayPublicEncryptionKey);
+				return query;
+			}
+
+		private:
+			/// Inherit Constructors.
+			using Query::Query;
+		};
+
+		/// Report of a traced packet that was delivered to this Relay.
+		/// Report is traced too, so that Relays on the way back append their hops.
+		struct TraceReport final : Query<5>
+		{
+			/// Create new instance.
+			/// @param rid of relay sending S2G
+			/// @param timestamp reported time at relay.
+			/// @param traceId identifier of the delivered packet's trace.
+			/// @param hops Relays that passed the delivered packet, followed by the Relay sending the report.
+			/// @param gatewayPublicEncryptionKey key used to encrypt package. Only gateway will be able to decrypt package.
+			static TraceReport Create(RouteId rid, int32_t timestamp, std::uint32_t traceId, std::vector<TraceContext::Hop> const& hops, Crypto::PublicKey gatewayPublicEncryptionKey)
 			{
-				auto query = std::make_unique<Notification>(rid, timestamp, ResponseType::None);
-				query->m_QueryPacketBody = Crypto::EncryptAnonymously(query->CompileQueryHeader().Write(rid, timestamp, blob), gatewayPublicEncryptionKey);
+				auto query = TraceReport{ rid, timestamp, ResponseType::None };
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(query.CompileQueryHeader().Write(rid, timestamp, traceId).Concat(TraceContext::WriteHops(hops)), gatewayPublicEncryptionKey);
+				return query;
+			}
+
+		private:
+			/// Inherit Constructors.
+			using Query::Query;
+		};
+
+		/// Answer to AddDeviceFromCache Command carrying arguments that are not cached by the Relay anymore. Gateway resends full AddDevice Command.
+		struct CachedArgumentsMissing final : Query<6>
+		{
+			/// Create new instance.
+			/// @param rid of relay sending S2G
+			/// @param timestamp reported time at relay.
+			/// @param deviceId identifier of the Device that wasn't created.
+			/// @param argumentsHash hash of the missing arguments.
+			/// @param gatewayPublicEncryptionKey key used to encrypt package. Only gateway will be able to decrypt package.
+			static CachedArgumentsMissing Create(RouteId rid, int32_t timestamp, DeviceId deviceId, ByteView argumentsHash, Crypto::PublicKey gatewayPublicEncryptionKey)
+			{
+				auto query = CachedArgumentsMissing{ rid, timestamp, ResponseType::None };
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(query.CompileQueryHeader().Write(rid, timestamp, deviceId, argumentsHash), gatewayPublicEncryptionKey);
+				return query;
+			}
+
+		private:
+			/// Inherit Constructors.
+			using Query::Query;
+		};
+
+		/// Query used by relay in network, when relay registered before wants to rejoin. Network relay passes N2N::ResumeRouteQuery to gateway, like N2N::InitializeRouteQuery.
+		struct ResumeRouteQuery final : Query<7>
+		{
+			/// Create new instance.
+			/// @param rid of relay sending S2G
+			/// @param timestamp reported time at relay.
+			/// @param sendersRid rid of rejoining relay, sender of N2N
+			/// @param senderSideDid device id that connects rejoining relay
+			/// @param encryptedBlob encrypted message for gateway from N2N packet.
+			/// @param gatewayPublicEncryptionKey key used to encrypt package. Only gateway will be able to decrypt package.
+			static ResumeRouteQuery Create(RouteId rid, int32_t timestamp, RouteId senderRid, DeviceId senderSideDid, ByteView encryptedBlob, Crypto::PublicKey gatewayPublicEncryptionKey)
+			{
+				auto query = ResumeRouteQuery{ rid, timestamp, ResponseType::None };
+				query.m_QueryPacketBody = Crypto::EncryptAnonymously(query.CompileQueryHeader().Write(rid, timestamp, senderRid, senderSideDid).Concat(encryptedBlob), gatewayPublicEncryptionKey);
 				return query;
 			}
 
@@ -481,6 +933,15 @@ namespace FSecure::C3::Core
 			/// Default empty handler for Notification Request.
 			virtual void On(Notification) {};
 
+			/// Default empty handler for TraceReport Request.
+			virtual void On(TraceReport) {};
+
+			/// Default empty handler for CachedArgumentsMissing Request.
+			virtual void On(CachedArgumentsMissing) {};
+
+			/// Default empty handler for ResumeRouteQuery Request.
+			virtual void On(ResumeRouteQuery) {};
+
 			/// Function responsible interpreting request and calling right handle.
 			/// @param sender Device that reported request.
 			/// @param procedure type of procedure.
@@ -506,6 +967,15 @@ namespace FSecure::C3::Core
 				case  Notification::GetProcedureNumberConstexpr():
 					On(Notification{ sender, rid, timestamp, encryptedData });
 					break;
+				case TraceReport::GetProcedureNumberConstexpr():
+					On(TraceReport{ sender, rid, timestamp, encryptedData });
+					break;
+				case CachedArgumentsMissing::GetProcedureNumberConstexpr():
+					On(CachedArgumentsMissing{ sender, rid, timestamp, encryptedData });
+					break;
+				case ResumeRouteQuery::GetProcedureNumberConstexpr():
+					On(ResumeRouteQuery{ sender, rid, timestamp, encryptedData });
+					break;
 				default:
 					throw std::runtime_error{ OBF("Failed to parse S2G packet. ") };
 				}
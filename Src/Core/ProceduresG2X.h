@@ -115,11 +115,10 @@ namespace FSecure::C3::Core::ProceduresG2X
 	{
 		/// Encrypts and sets query body
 		/// @param queryPacketBody plaintext body of query
-		/// @param agentPublicKey - recipient agent's public key
-		/// @param gatewayPrivateKey - gateawy private key
-		void EncrpytQueryWithBody(ByteView queryPacketBody, Crypto::PublicKey const& agentPublicKey, Crypto::PrivateKey const& gatewayPrivateKey)
+		/// @param sharedKey - key precomputed from recipient agent's public key and gateway's private key
+		void EncrpytQueryWithBody(ByteView queryPacketBody, Crypto::SharedKey const& sharedKey)
 		{
-			m_QueryPacketBody = Crypto::EncryptAndAuthenticate(CompileQueryHeader().Concat(queryPacketBody), agentPublicKey, gatewayPrivateKey);
+			m_QueryPacketBody = Crypto::EncryptAndAuthenticate(CompileQueryHeader().Concat(queryPacketBody), sharedKey);
 		}
 
 		/// Forwarded constructors.
@@ -146,15 +145,14 @@ namespace FSecure::C3::Core::ProceduresG2X
 		/// Create new instance.
 		/// @param receiverRid - destination route id
 		/// @param gatewayPrivateSignature - gateway's private signature
-		/// @param agentPublicKey - destination agent's public key
-		/// @param gatewayPrivateKey - gateway's private key
+		/// @param sharedKey - key precomputed from destination agent's public key and gateway's private key
 		/// @param commandWithArguments - plaintext command with it's arguments in binary form
 		/// @param responseType - [Not used]
 		/// @returns a new query instance
-		static std::unique_ptr<RunCommandOnAgentQuery> Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, Crypto::PublicKey const& agentPublicKey, Crypto::PrivateKey const& gatewayPrivateKey, ByteView commandWithArguments, ResponseType responseType = ResponseType::None)
+		static RunCommandOnAgentQuery Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, Crypto::SharedKey const& sharedKey, ByteView commandWithArguments, ResponseType responseType = ResponseType::None)
 		{
-			auto query = std::make_unique<RunCommandOnAgentQuery>(Propagation::Agent, receiverRid, gatewayPrivateSignature, responseType);
-			query->EncrpytQueryWithBody(commandWithArguments, agentPublicKey, gatewayPrivateKey);
+			auto query = RunCommandOnAgentQuery{ Propagation::Agent, receiverRid, gatewayPrivateSignature, responseType };
+			query.EncrpytQueryWithBody(commandWithArguments, sharedKey);
 			return query;
 		}
 
@@ -172,10 +170,10 @@ namespace FSecure::C3::Core::ProceduresG2X
 		/// @param commandWithArguments - plaintext command with it's arguments in binary form
 		/// @param responseType - [Not used]
 		/// @returns a new query instance
-		static std::unique_ptr<AddRoute> Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, ByteView commandWithArguments, ResponseType responseType = ResponseType::None)
+		static AddRoute Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, ByteView commandWithArguments, ResponseType responseType = ResponseType::None)
 		{
-			auto query = std::make_unique<AddRoute>(Propagation::Route, receiverRid, gatewayPrivateSignature, responseType);
-			query->m_QueryPacketBody = commandWithArguments;
+			auto query = AddRoute{ Propagation::Route, receiverRid, gatewayPrivateSignature, responseType };
+			query.m_QueryPacketBody = commandWithArguments;
 			return query;
 		}
 
@@ -190,16 +188,15 @@ namespace FSecure::C3::Core::ProceduresG2X
 		/// Create new instance.
 		/// @param receiverRid - destination route id
 		/// @param gatewayPrivateSignature - gateway's private signature
-		/// @param agentPublicKey - destination agent's public key
-		/// @param gatewayPrivateKey - gateway's private key
+		/// @param sharedKey - key precomputed from destination agent's public key and gateway's private key
 		/// @param deviceToRunOn - device which should execute command
 		/// @param commandWithArguments - plaintext command with it's arguments in binary form
 		/// @param responseType - [Not used]
 		/// @returns a new query instance
-		static std::unique_ptr<RunCommandOnDeviceQuery> Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, Crypto::PublicKey const& agentPublicKey, Crypto::PrivateKey const& gatewayPrivateKey, DeviceId deviceToRunOn, ByteView commandWithArguments, ResponseType responseType = ResponseType::None)
+		static RunCommandOnDeviceQuery Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, Crypto::SharedKey const& sharedKey, DeviceId deviceToRunOn, ByteView commandWithArguments, ResponseType responseType = ResponseType::None)
 		{
-			auto query = std::make_unique<RunCommandOnDeviceQuery>(Propagation::Agent, receiverRid, gatewayPrivateSignature, responseType);
-			query->EncrpytQueryWithBody(ByteVector::Create(deviceToRunOn).Concat(commandWithArguments), agentPublicKey, gatewayPrivateKey);
+			auto query = RunCommandOnDeviceQuery{ Propagation::Agent, receiverRid, gatewayPrivateSignature, responseType };
+			query.EncrpytQueryWithBody(ByteVector::Create(deviceToRunOn).Concat(commandWithArguments), sharedKey);
 			return query;
 		}
 
@@ -214,16 +211,15 @@ namespace FSecure::C3::Core::ProceduresG2X
 		/// Create new instance.
 		/// @param receiverRid - destination route id
 		/// @param gatewayPrivateSignature - gateway's private signature
-		/// @param agentPublicKey - destination agent's public key
-		/// @param gatewayPrivateKey - gateway's private key
+		/// @param sharedKey - key precomputed from destination agent's public key and gateway's private key
 		/// @param deliverTo - device to deliver message to
-		/// @param commandWithArguments - message to binder
+		/// @param commandWithArguments - message to binder. Compressed if it gets smaller. @see PackBinderMessage
 		/// @param responseType - [Not used]
 		/// @returns a new query instance
-		static std::unique_ptr<DeliverToBinder> Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, Crypto::PublicKey const& agentPublicKey, Crypto::PrivateKey const& gatewayPrivateKey, DeviceId deliverTo, ByteView commandWithArguments, ResponseType responseType = ResponseType::None)
+		static DeliverToBinder Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, Crypto::SharedKey const& sharedKey, DeviceId deliverTo, ByteView commandWithArguments, ResponseType responseType = ResponseType::None)
 		{
-			auto query = std::make_unique<DeliverToBinder>(Propagation::Agent, receiverRid, gatewayPrivateSignature, responseType);
-			query->EncrpytQueryWithBody(ByteVector::Create(deliverTo).Concat(commandWithArguments), agentPublicKey, gatewayPrivateKey);
+			auto query = DeliverToBinder{ Propagation::Agent, receiverRid, gatewayPrivateSignature, responseType };
+			query.EncrpytQueryWithBody(ByteVector::Create(deliverTo).Concat(PackBinderMessage(commandWithArguments)), sharedKey);
 			return query;
 		}
 
@@ -232,6 +228,125 @@ namespace FSecure::C3::Core::ProceduresG2X
 		using QueryToAgent::QueryToAgent;
 	};
 
+	/// Query agent to run several commands, in order. Multi-step setups are encrypted, signed and sent once instead of once per command.
+	/// Each sub-command carries the procedure number and the body of a RunCommandOnAgentQuery or RunCommandOnDeviceQuery.
+	struct RunCommandsOnAgentQuery final : QueryToAgent<4>
+	{
+		/// Maximal number of sub-commands in one query.
+		static constexpr std::size_t s_MaxCommands = std::numeric_limits<std::uint16_t>::max();
+
+		/// Compose sub-command run by Agent itself.
+		/// @param commandWithArguments - plaintext command with it's arguments in binary form
+		/// @returns sub-command to pass to Create.
+		static ByteVector ComposeAgentCommand(ByteView commandWithArguments)
+		{
+			return ByteVector{}.Write(RunCommandOnAgentQuery::GetProcedureNumberConstexpr(), commandWithArguments);
+		}
+
+		/// Compose sub-command run by one of Agent's devices.
+		/// @param deviceToRunOn - device which should execute command
+		/// @param commandWithArguments - plaintext command with it's arguments in binary form
+		/// @returns sub-command to pass to Create.
+		static ByteVector ComposeDeviceCommand(DeviceId deviceToRunOn, ByteView commandWithArguments)
+		{
+			return ByteVector{}.Write(RunCommandOnDeviceQuery::GetProcedureNumberConstexpr(), ByteVector::Create(deviceToRunOn).Concat(commandWithArguments));
+		}
+
+		/// Create new instance.
+		/// @param receiverRid - destination route id
+		/// @param gatewayPrivateSignature - gateway's private signature
+		/// @param sharedKey - key precomputed from destination agent's public key and gateway's private key
+		/// @param commands - sub-commands composed by ComposeAgentCommand and ComposeDeviceCommand, in order of running
+		/// @param responseType - [Not used]
+		/// @returns a new query instance
+		/// @throws std::invalid_argument if there are more than s_MaxCommands sub-commands.
+		static RunCommandsOnAgentQuery Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, Crypto::SharedKey const& sharedKey, std::vector<ByteVector> const& commands, ResponseType responseType = ResponseType::None)
+		{
+			if (commands.size() > s_MaxCommands)
+				throw std::invalid_argument{ OBF("Too many commands for one query.") };
+
+			auto body = ByteVector{}.Write(static_cast<std::uint16_t>(commands.size()));
+			for (auto const& command : commands)
+				body.Concat(command);
+
+			auto query = RunCommandsOnAgentQuery{ Propagation::Agent, receiverRid, gatewayPrivateSignature, responseType };
+			query.EncrpytQueryWithBody(body, sharedKey);
+			return query;
+		}
+
+	private:
+		/// Inherit Constructors.
+		using QueryToAgent::QueryToAgent;
+	};
+
+	/// Query telling a relay that the resumption token of its neighbor was rejected. Relay passes it to the neighbor as N2N::ResumeRouteRejected.
+	struct RejectRouteResumption final : QueryToRoute<5>
+	{
+		/// Create new instance.
+		/// @param receiverRid - route id of relay that passed the resume request
+		/// @param gatewayPrivateSignature - gateway's private signature
+		/// @param rejectedRid - route id of relay whose token was rejected
+		/// @param directionDid - device of receiving relay that connects the rejected relay
+		/// @param responseType - [Not used]
+		/// @returns a new query instance
+		static RejectRouteResumption Create(RouteId receiverRid, Crypto::PrivateSignature const& gatewayPrivateSignature, RouteId rejectedRid, DeviceId directionDid, ResponseType responseType = ResponseType::None)
+		{
+			auto query = RejectRouteResumption{ Propagation::Route, receiverRid, gatewayPrivateSignature, responseType };
+			query.m_QueryPacketBody = ByteVector::Create(rejectedRid, directionDid);
+			return query;
+		}
+
+	private:
+		/// Inherit Constructors.
+		using QueryToRoute::QueryToRoute;
+	};
+
+	/// Envelope carrying G2A packets whose Routes share the first hop, so that shared Channels pass them as one packet.
+	/// Relays split the envelope by the Channels leading to the recipients. Wrapped packets keep their own signatures and encryption and are verified by their recipients.
+	struct Multicast
+	{
+		/// Maximal number of packets in one envelope.
+		static constexpr std::size_t s_MaxPackets = std::numeric_limits<std::uint16_t>::max();
+
+		/// Wrap G2A packets in Multicast protocol.
+		/// @param packets whole G2A packets.
+		/// @return whole Multicast packet.
+		/// @throws std::invalid_argument if there are more than s_MaxPackets packets.
+		static ByteVector Wrap(std::vector<ByteView> const& packets)
+		{
+			if (packets.size() > s_MaxPackets)
+				throw std::invalid_argument{ OBF("Too many packets for a Multicast envelope.") };
+
+			auto buffer = ByteVector{}.Write(static_cast<ProtocolsUnderlyingType>(Protocols::Multicast), static_cast<std::uint16_t>(packets.size()));
+			for (auto const& packet : packets)
+				buffer.Write(packet);
+
+			return buffer;
+		}
+
+		/// Parse Multicast packet.
+		/// @param packet0 a buffer that contains whole packet.
+		/// @return wrapped G2A packets, pointing inside packet0.
+		/// @throws std::runtime_error if packet is malformed.
+		static std::vector<ByteView> Parse(ByteView packet0)
+		{
+			try
+			{
+				packet0.remove_prefix(1);
+				std::vector<ByteView> packets(packet0.Read<std::uint16_t>());
+				for (auto& packet : packets)
+					if (packet = packet0.Read<ByteView>(); packet.empty() || static_cast<Protocols>(packet[0]) != Protocols::G2A)
+						throw std::invalid_argument{ OBF("Multicast envelope may carry G2A packets only.") };
+
+				return packets;
+			}
+			catch (std::exception& exception)
+			{
+				throw std::runtime_error{ OBF_STR("Failed to parse Multicast packet. ") + exception.what() };
+			}
+		}
+	};
+
 	/// Base class for G2X queries request handler
 	struct RequestHandler
 	{
@@ -246,6 +361,10 @@ namespace FSecure::C3::Core::ProceduresG2X
 		virtual void On(RunCommandOnDeviceQuery) {};
 		/// empty DeliverToBinder handler
 		virtual void On(DeliverToBinder) {};
+		/// empty RunCommandsOnAgentQuery handler
+		virtual void On(RunCommandsOnAgentQuery) {};
+		/// empty RejectRouteResumption handler
+		virtual void On(RejectRouteResumption) {};
 
 		/// Dispatch the query packet to suitable handler
 		/// @param sender - device that originally received packet
@@ -276,6 +395,10 @@ namespace FSecure::C3::Core::ProceduresG2X
 				return On(RunCommandOnDeviceQuery{sender, destinationRoute, procedureNo, packetAfterProcedureNumber});
 			case DeliverToBinder::GetProcedureNumberConstexpr():
 				return On(DeliverToBinder{ sender, destinationRoute, procedureNo, packetAfterProcedureNumber });
+			case RunCommandsOnAgentQuery::GetProcedureNumberConstexpr():
+				return On(RunCommandsOnAgentQuery{ sender, destinationRoute, procedureNo, packetAfterProcedureNumber });
+			case RejectRouteResumption::GetProcedureNumberConstexpr():
+				return On(RejectRouteResumption{ sender, destinationRoute, procedureNo, packetAfterProcedureNumber });
 			}
 
 			throw std::invalid_argument{ OBF("Unknown G2X Query Procedure number: ") + std::to_string(procedureNo) + '.' };
@@ -4,14 +4,80 @@
 #include "GateRelay.h"
 #include "ConnectorBridge.h"
 #include "DeviceBridge.h"
+#include "EventTracing.h"
+#include "AllocationTracking.h"
 #include "Common/FSecure/CppTools/Utils.h"
+#include "Common/FSecure/CppTools/Compression.h"
+
+namespace
+{
+	/// Appends binary form of an argument value to a buffer.
+	using ArgumentEncoder = void(*)(FSecure::ByteVector& out, json const& value);
+
+	/// Encodes integer argument. Controller may send integers as strings.
+	template <typename T>
+	void EncodeInteger(FSecure::ByteVector& out, json const& value)
+	{
+		if (!value.is_string())
+			out.Write(value.get<T>());
+		else if constexpr (std::is_signed_v<T>)
+			out.Write(FSecure::Utils::SafeCast<T>(std::stoll(value.get_ref<std::string const&>())));
+		else
+			out.Write(FSecure::Utils::SafeCast<T>(std::stoull(value.get_ref<std::string const&>())));
+	}
+
+	/// Gets encoders of all argument types, so that translating an argument is a single lookup instead of comparing its type with every known one.
+	/// @return encoders by argument type name.
+	std::unordered_map<std::string_view, ArgumentEncoder> const& GetArgumentEncoders()
+	{
+		static auto const encoders = std::unordered_map<std::string_view, ArgumentEncoder>
+		{
+			{ "uint8", EncodeInteger<uint8_t> },
+			{ "uint16", EncodeInteger<uint16_t> },
+			{ "uint32", EncodeInteger<uint32_t> },
+			{ "uint64", EncodeInteger<uint64_t> },
+			{ "int8", EncodeInteger<int8_t> },
+			{ "int16", EncodeInteger<int16_t> },
+			{ "int32", EncodeInteger<int32_t> },
+			{ "int64", EncodeInteger<int64_t> },
+			{ "float", [](FSecure::ByteVector& out, json const& value) { out.Write(value.is_string() ? std::stof(value.get_ref<std::string const&>()) : value.get<float>()); } },
+			{ "boolean", [](FSecure::ByteVector& out, json const& value) { out.Write(value.get<bool>()); } },
+			{ "string", [](FSecure::ByteVector& out, json const& value) { out.Write(value.get_ref<std::string const&>()); } },
+			{ "ip", [](FSecure::ByteVector& out, json const& value) { out.Write(value.get_ref<std::string const&>()); } },
+			{ "binary", [](FSecure::ByteVector& out, json const& value) { out.Write(base64::decode<FSecure::ByteVector>(value.get_ref<std::string const&>())); } },
+		};
+
+		return encoders;
+	}
+
+	/// Appends binary form of an argument to a buffer.
+	/// @param out buffer to append to.
+	/// @param type argument type name.
+	/// @param value argument value.
+	/// @throws std::invalid_argument if type is unknown.
+	void EncodeArgument(FSecure::ByteVector& out, std::string_view type, json const& value)
+	{
+		auto const& encoders = GetArgumentEncoders();
+		auto encoder = encoders.find(type);
+		if (encoder == encoders.end())
+			throw std::invalid_argument{ "Unrecognized argument type: " + std::string{ type } };
+
+		encoder->second(out, value);
+	}
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-std::mutex FSecure::C3::Core::Profiler::Profile::m_Mutex;
+FSecure::C3::Core::LockProfiling::Mutex<std::shared_mutex> FSecure::C3::Core::Profiler::Profile::m_Mutex{ "Profiler::Profile::m_Mutex" };
+std::array<std::mutex, 64> FSecure::C3::Core::Profiler::AgentProfile::s_AgentMutexes;
+std::atomic<std::uint64_t> FSecure::C3::Core::Profiler::s_ProfileVersion = 0;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-FSecure::C3::Core::Profiler::Profiler(std::filesystem::path snapshotPath) : m_SnapshotPath(std::move(snapshotPath))
+FSecure::C3::Core::Profiler::Profiler(std::filesystem::path snapshotPath, std::chrono::milliseconds lastSeenFlushInterval, bool reportDeviceMetrics /*= false*/)
+	: m_AccessMutex{ "Profiler::m_AccessMutex" }
+	, m_LastSeenTracker(lastSeenFlushInterval)
+	, m_ReportDeviceMetrics(reportDeviceMetrics)
+	, m_SnapshotPath(std::move(snapshotPath))
 {
 }
 
@@ -22,8 +88,34 @@ void FSecure::C3::Core::Profiler::Initialize(std::string name, std::shared_ptr<G
 	for (auto&& e : m_Gateway->m_Gateway.lock()->m_InterfaceFactory.GetMap<AbstractPeripheral>())
 		m_BindersMappings.emplace_back(e.first, e.second.m_ClousureConnectorHash);
 
-	RestoreFromSnapshot();
-	std::thread(&Profiler::DumpSnapshots, this).detach();
+	// Restoring large snapshot takes a while. Meanwhile Channels are already working, S2G packets of Agents not yet restored wait in GateRelay.
+	std::thread([this, weakGateway = std::weak_ptr<GateRelay>{ gateway }]
+	{
+		try
+		{
+			{
+				std::scoped_lock lock(m_AccessMutex);
+				RestoreFromSnapshot();
+			}
+
+			m_IsRestored = true;
+			if (auto gateway = weakGateway.lock())
+				gateway->OnProfileRestored();
+		}
+		catch (std::exception& exception)
+		{
+			// Snapshot is not overwritten, so it can be recovered.
+			if (auto gateway = weakGateway.lock())
+			{
+				gateway->Log({ "Failed to restore Gateway snapshot. Snapshots won't be stored. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+				gateway->OnProfileRestored();
+			}
+
+			return;
+		}
+
+		DumpSnapshots();
+	}).detach();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -31,38 +123,132 @@ void FSecure::C3::Core::Profiler::HandleActionsPacket(ByteView actionsPacket)
 {
 	std::scoped_lock lock(m_AccessMutex);
 
+	auto gateRelay = m_Gateway->m_Gateway.lock();
+	if (!gateRelay)
+		return; // probably shutting down
+
+	json actions;
 	try
 	{
-		auto actions = json::parse(std::string{ actionsPacket });
-		auto jActions = actions.find("Command");
-		if (jActions == actions.end())
-			throw std::runtime_error{ "Command object is missing" };
+		actions = json::parse(actionsPacket.begin(), actionsPacket.end());
+		if (!actions.is_array())
+		{
+			TranslateAction(actions);
+			return RunAction(actions);
+		}
+	}
+	catch (std::exception& exception)
+	{
+		gateRelay->Log({ "Caught an exception while parsing Action. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error});
+		return;
+	}
 
-		(*jActions)["ByteForm"] = base64::encode(TranslateCommand(*jActions));
+	// Group Actions by target, keeping their order within each group. Actions that can't be translated are reported and skipped.
+	std::vector<std::pair<json, std::vector<json*>>> groups;
+	for (auto& action : actions)
+	{
+		try
+		{
+			TranslateAction(action);
+			auto const& relayAgentId = action.at("relayAgentId");
+			auto group = std::find_if(groups.begin(), groups.end(), [&](auto const& e) { return e.first == relayAgentId; });
+			if (group == groups.end())
+				group = groups.emplace(groups.end(), relayAgentId, std::vector<json*>{});
 
-		// Helper lambda that read particular element from actions JSON.
-		auto ReadJsonElement = [&actions](std::string_view elementName)
+			group->second.push_back(&action);
+		}
+		catch (std::exception& exception)
 		{
-			auto element = actions.find(elementName);
-			if (element != actions.end())
-				return element;
+			gateRelay->Log({ "Caught an exception while parsing Action. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+		}
+	}
 
-			throw std::runtime_error{ std::string{ elementName } +" is not specified." };
-		};
+	gateRelay->SendCommandsInParallel([&]
+	{
+		for (auto const& group : groups)
+			for (auto action : group.second)
+			{
+				try
+				{
+					RunAction(*action);
+				}
+				catch (std::exception& exception)
+				{
+					gateRelay->Log({ "Caught an exception while parsing Action. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+				}
+			}
+	});
+}
 
-		// Parse AgentId.
-		if (auto relayAgentId = ReadJsonElement("relayAgentId"); relayAgentId->is_null())
-			m_Gateway->ParseAndRunCommand(actions);
-		else if (auto agent = m_Gateway->m_Agents.Find(relayAgentId->get<std::string>()))
-			agent->ParseAndRunCommand(actions);
-		else
-			throw std::runtime_error{ "Unknown AgentId." };
-	}
-	catch (std::exception& exception)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::TranslateAction(json& action)
+{
+	auto jCommand = action.find("Command");
+	if (jCommand == action.end())
+		throw std::runtime_error{ "Command object is missing" };
+
+	(*jCommand)["ByteForm"] = base64::encode(TranslateCommand(*jCommand));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::RunAction(json const& action)
+{
+	auto relayAgentId = action.find("relayAgentId");
+	if (relayAgentId == action.end())
+		throw std::runtime_error{ "relayAgentId is not specified." };
+
+	if (relayAgentId->is_null())
+		m_Gateway->ParseAndRunCommand(action);
+	else if (auto agent = m_Gateway->FindAgent(relayAgentId->get<std::string>()))
+		agent->ParseAndRunCommand(action);
+	else
+		throw std::runtime_error{ "Unknown AgentId." };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Core::Profiler::HandleBulkActionsPacket(json const& bulkAction)
+{
+	std::scoped_lock lock(m_AccessMutex);
+
+	auto gateRelay = m_Gateway->m_Gateway.lock();
+	if (!gateRelay)
+		return {}; // probably shutting down
+
+	// Translate the Command once, then address it to each target as a single Action would be.
+	auto action = json{ { "Command", bulkAction.at("Command") } };
+	action["Command"]["ByteForm"] = base64::encode(TranslateCommand(action["Command"]));
+
+	auto failed = json::array();
+	gateRelay->SendCommandsInParallel([&]
 	{
-		if (auto gateway = m_Gateway->m_Gateway.lock())
-			gateway->Log({ "Caught an exception while parsing Action. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error});
-	}
+		for (auto const& target : bulkAction.at("targets"))
+		{
+			try
+			{
+				for (auto const& key : { "channelId", "peripheralId", "connectorId" })
+					if (auto value = target.find(key); value != target.end())
+						action[key] = *value;
+					else
+						action.erase(key);
+
+				if (auto const& relayAgentId = target.at("relayAgentId"); relayAgentId.is_null())
+					m_Gateway->ParseAndRunCommand(action);
+				else if (auto agent = m_Gateway->FindAgent(relayAgentId.get<std::string>()))
+					agent->ParseAndRunCommand(action);
+				else
+					throw std::runtime_error{ "Unknown AgentId." };
+			}
+			catch (std::exception& exception)
+			{
+				failed.push_back({ { "relayAgentId", target.value("relayAgentId", json{}) }, { "Error", exception.what() } });
+			}
+		}
+	});
+
+	if (!failed.empty())
+		gateRelay->Log({ "Bulk Action failed for " + std::to_string(failed.size()) + " of " + std::to_string(bulkAction.at("targets").size()) + " targets.", FSecure::C3::LogMessage::Severity::Warning });
+
+	return json{ { "Failed", std::move(failed) } };
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -71,6 +257,18 @@ FSecure::C3::Core::Profiler::Profile FSecure::C3::Core::Profiler::Get()
 	return Profile{ *m_Gateway };
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Profiler::AgentProfile FSecure::C3::Core::Profiler::GetAgent(AgentId agentId)
+{
+	return AgentProfile{ *m_Gateway, agentId };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::UpdateLastSeen(AgentId agentId, int32_t timestamp)
+{
+	m_LastSeenTracker.Update(agentId, timestamp);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 uint32_t FSecure::C3::Core::Profiler::GetBinderTo(uint32_t id)
 {
@@ -93,13 +291,13 @@ FSecure::ByteVector FSecure::C3::Core::Profiler::TranslateCommand(json const& co
 FSecure::ByteVector FSecure::C3::Core::Profiler::TranslateArguments(json const& arguments)
 {
 	ByteVector ret;
-	auto translate = [&ret](auto arg) { ret.Concat(Translate(arg.at("type"), arg.at("value"))); };
-	for (auto argument : arguments)
+	auto translate = [&ret](json const& arg) { EncodeArgument(ret, arg.at("type").get_ref<std::string const&>(), arg.at("value")); };
+	for (auto const& argument : arguments)
 	{
 		if (!argument.is_array())
 			translate(argument);
 		else
-			for (auto const subargument : argument)
+			for (auto const& subargument : argument)
 				translate(subargument);
 	}
 
@@ -123,32 +321,9 @@ FSecure::ByteVector FSecure::C3::Core::Profiler::TranslateStartupCommand(json co
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::Core::Profiler::Translate(std::string const& type, json::value_type const& value)
 {
-	if (type == "uint8")
-		return ByteVector{}.Write(value.is_string() ? FSecure::Utils::SafeCast<uint8_t>(std::stoull(value.get<std::string>())) : value.get<uint8_t>());
-	if (type == "uint16")
-		return ByteVector{}.Write(value.is_string() ? FSecure::Utils::SafeCast<uint16_t>(std::stoull(value.get<std::string>())) : value.get<uint16_t>());
-	if (type == "uint32")
-		return ByteVector{}.Write(value.is_string() ? FSecure::Utils::SafeCast<uint32_t>(std::stoull(value.get<std::string>())) : value.get<uint32_t>());
-	if (type == "uint64")
-		return ByteVector{}.Write(value.is_string() ? FSecure::Utils::SafeCast<uint64_t>(std::stoull(value.get<std::string>())) : value.get<uint64_t>());
-	if (type == "int8")
-		return ByteVector{}.Write(value.is_string() ? FSecure::Utils::SafeCast<int8_t>(std::stoll(value.get<std::string>())) : value.get<int8_t>());
-	if (type == "int16")
-		return ByteVector{}.Write(value.is_string() ? FSecure::Utils::SafeCast<int16_t>(std::stoll(value.get<std::string>())) : value.get<int16_t>());
-	if (type == "int32")
-		return ByteVector{}.Write(value.is_string() ? FSecure::Utils::SafeCast<int32_t>(std::stoll(value.get<std::string>())) : value.get<int32_t>());
-	if (type == "int64")
-		return ByteVector{}.Write(value.is_string() ? FSecure::Utils::SafeCast<int64_t>(std::stoll(value.get<std::string>())) : value.get<int64_t>());
-	if (type == "float")
-		return ByteVector{}.Write(value.is_string() ? std::stof(value.get<std::string>()) : value.get<float>());
-	if (type == "boolean")
-		return ByteVector{}.Write(value.get<bool>());
-	if (type == "string" || type == "ip")
-		return ByteVector{}.Write(value.get<std::string>());
-	if (type == "binary")
-		return ByteVector{}.Write(base64::decode<ByteVector>(value.get<std::string>()));
-
-	throw std::invalid_argument{ "Unrecognized argument type: " + type };
+	ByteVector ret;
+	EncodeArgument(ret, type, value);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -159,30 +334,131 @@ void FSecure::C3::Core::Profiler::DumpSnapshots()
 	{
 		if (sp.CheckUpdates())
 		{
-			const auto snapshotTmpPath = std::filesystem::path(m_SnapshotPath).replace_extension(".tmp");
+			try
 			{
-				std::ofstream snapshotTmp{ snapshotTmpPath };
-				snapshotTmp << sp.GetSnapshot().dump() << std::endl;
+				// Journal is compacted once it outgrows the snapshot, so disk usage is bounded and writes are proportional to changes.
+				if (sp.GetDelta().is_null() || !m_Journal.is_open() || m_JournalSize > std::max(m_SnapshotSize, s_MinJournalCompactionSize))
+					WriteSnapshot(sp.GetSnapshot());
+				else
+					AppendToJournal(sp.GetDelta());
+			}
+			catch (std::exception& exception)
+			{
+				if (auto gateway = m_Gateway->m_Gateway.lock())
+					gateway->Log({ "Failed to store Gateway snapshot. "s + exception.what(), FSecure::C3::LogMessage::Severity::Error });
+
+				m_Journal.close();																						// Next change will retry writing the full snapshot.
 			}
-			std::filesystem::rename(snapshotTmpPath, m_SnapshotPath);
 		}
 		std::this_thread::sleep_for(1s);
 	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::Profiler::RestoreFromSnapshot()
+FSecure::ByteVector FSecure::C3::Core::Profiler::EncodeSnapshot(json const& snapshot)
+{
+	return Compression::Compress<Compression::Deflate>(ByteVector{ json::to_cbor(snapshot) });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Core::Profiler::DecodeSnapshot(ByteView encoded)
+{
+	return json::from_cbor(Compression::Decompress<Compression::Deflate>(encoded));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::WriteSnapshot(json const& snapshot)
 {
-	json snapshot;
-	// get snapshot
+	m_Journal.close();
+
+	// New generation makes the old journal obsolete even if the process dies before the journal is truncated.
+	auto generation = FSecure::Utils::GenerateRandomValue<std::uint64_t>();
+	auto encoded = ByteVector::Create(s_SnapshotMagic, generation, EncodeSnapshot(snapshot));
+	const auto snapshotTmpPath = std::filesystem::path(m_SnapshotPath).replace_extension(".tmp");
 	{
-		auto ifile = std::ifstream{ m_SnapshotPath };
-		auto str = std::string((std::istreambuf_iterator<char>(ifile)), std::istreambuf_iterator<char>());
-		if (str.empty())
-			return;
-		snapshot = json::parse(str);
+		std::ofstream snapshotTmp{ snapshotTmpPath, std::ios::binary | std::ios::trunc };
+		snapshotTmp.write(reinterpret_cast<char const*>(encoded.data()), encoded.size());
+		if (!snapshotTmp.flush())
+			throw std::runtime_error{ "Cannot write " + snapshotTmpPath.string() };
+	}
+	std::filesystem::rename(snapshotTmpPath, m_SnapshotPath);
+	m_SnapshotSize = encoded.size();
+
+	auto header = ByteVector::Create(s_JournalMagic, generation);
+	m_Journal.open(GetJournalPath(), std::ios::binary | std::ios::trunc);
+	m_Journal.write(reinterpret_cast<char const*>(header.data()), header.size());
+	if (!m_Journal.flush())
+		throw std::runtime_error{ "Cannot write " + GetJournalPath().string() };
+
+	m_JournalSize = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::AppendToJournal(json const& delta)
+{
+	auto record = ByteVector::Create(EncodeSnapshot(delta));
+	m_Journal.write(reinterpret_cast<char const*>(record.data()), record.size());
+	if (!m_Journal.flush())
+		throw std::runtime_error{ "Cannot write " + GetJournalPath().string() };
+
+	m_JournalSize += record.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::filesystem::path FSecure::C3::Core::Profiler::GetJournalPath() const
+{
+	return std::filesystem::path(m_SnapshotPath).replace_extension(".journal");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Core::Profiler::LoadSnapshot() const
+{
+	auto readFile = [](std::filesystem::path const& path)
+	{
+		auto ifile = std::ifstream{ path, std::ios::binary };
+		return ByteVector{ std::vector<uint8_t>((std::istreambuf_iterator<char>(ifile)), std::istreambuf_iterator<char>()) };
+	};
+
+	// Snapshots written by older versions are plain JSON.
+	if (!std::filesystem::exists(m_SnapshotPath))
+	{
+		auto legacy = readFile(std::filesystem::path(m_SnapshotPath).replace_extension(".json"));
+		return legacy.empty() ? json{} : json::parse(legacy.begin(), legacy.end());
 	}
 
+	auto file = readFile(m_SnapshotPath);
+	ByteView snapshotView = file;
+	auto [magic, generation, encoded] = snapshotView.Read<std::uint32_t, std::uint64_t, ByteView>();
+	if (magic != s_SnapshotMagic)
+		throw std::runtime_error{ "Invalid snapshot file " + m_SnapshotPath.string() };
+
+	auto snapshot = DecodeSnapshot(encoded);
+
+	// Replay journal. It is ignored if it was not written for this snapshot. Reading stops at the first damaged record, which is the one that was being written when process died.
+	auto journal = readFile(GetJournalPath());
+	try
+	{
+		ByteView journalView = journal;
+		if (journalView.Read<std::uint32_t, std::uint64_t>() != std::tuple{ s_JournalMagic, generation })
+			return snapshot;
+
+		while (!journalView.empty())
+			snapshot = snapshot.patch(DecodeSnapshot(journalView.Read<ByteView>()));
+	}
+	catch (std::exception&)
+	{
+	}
+
+	return snapshot;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::RestoreFromSnapshot()
+{
+	auto snapshot = LoadSnapshot();
+	if (snapshot.is_null())
+		return;
+
 	// restore gateway.
 	{
 		for (auto&& b : snapshot["_RegisteredBuilds"])
@@ -218,11 +494,17 @@ void FSecure::C3::Core::Profiler::RestoreFromSnapshot()
 			);
 
 			auto jitter = std::pair{ FSecure::Utils::ToMilliseconds(channel["jitter"][0].get<float>()), FSecure::Utils::ToMilliseconds(channel["jitter"][1].get<float>()) };
+			auto isJitterAdaptive = channel.value("adaptiveJitter", false);
+			auto responseWindow = FSecure::Utils::ToMilliseconds(channel.value("responseWindow", 0.f));
 			device->SetUpdateDelay(jitter.first, jitter.second);
+			device->SetAdaptiveUpdateDelay(isJitterAdaptive);
+			device->SetResponseWindow(responseWindow);
 			auto profile = Get(); // we need to take profile each time, as it is also taken in CreateAndAttachDevice and that would lead to deadlock.
 			auto channelProfile = profile.m_Gateway.m_Channels.Find(did);
 			channelProfile->m_StartupArguments = channel["startupCommand"];
 			channelProfile->m_Jitter = jitter;
+			channelProfile->m_IsJitterAdaptive = isJitterAdaptive;
+			channelProfile->m_ResponseWindow = responseWindow;
 		}
 
 		for (auto&& connector : snapshot["connectors"])
@@ -255,34 +537,18 @@ void FSecure::C3::Core::Profiler::RestoreFromSnapshot()
 			profile.m_Gateway.ReAddRoute(RouteId(route["destinationAgent"].get<std::string>(), route["receivingInterface"].get<std::string>()), route["outgoingInterface"].get<std::string>(), route["isNeighbour"].get<bool>());
 
 		for (auto&& relay : snapshot["relays"])
-		{
-			auto agent = profile.m_Gateway.ReAddAgent
-			(
-				relay["agentId"].get<std::string>(),
-				relay["buildId"].get<std::string>(),
-				base64::decode<ByteVector>(relay["publicKey"].get<std::string>()),
-				false,
-				relay["timestamp"].get<int32_t>(),
-				HostInfo(relay["hostInfo"])
-			);
-
-			agent->m_LastDeviceId = relay["_LastDeviceId"].get<DeviceId::UnderlyingIntegerType>();
+			profile.m_Gateway.RestoreAgent(relay);
 
-			for (auto&& channel : relay["channels"])
-			{
-				auto device = agent->ReAddChannel(channel["iId"].get<std::string>(), channel["type"].get<HashT>(), channel["isReturnChannel"].get<bool>(), channel["isNegotiationChannel"].get<bool>());
-				device->m_StartupArguments = channel["startupCommand"];
-				device->m_Jitter = std::pair{ FSecure::Utils::ToMilliseconds(channel["jitter"][0].get<float>()), FSecure::Utils::ToMilliseconds(channel["jitter"][1].get<float>()) };
-			}
-			for (auto&& peripheral : relay["peripherals"])
+		if (auto archived = snapshot.find("_archivedRelays"); archived != snapshot.end())
+			for (auto& item : archived->items())
 			{
-				auto device = agent->ReAddPeripheral(peripheral["iId"].get<std::string>(), peripheral["type"].get<HashT>());
-				device->m_StartupArguments = peripheral["startupCommand"];
-				device->m_Jitter = std::pair{ FSecure::Utils::ToMilliseconds(peripheral["jitter"][0].get<float>()), FSecure::Utils::ToMilliseconds(peripheral["jitter"][1].get<float>()) };
+				auto encoded = item.value().get<std::string>();
+				auto relay = DecodeSnapshot(base64::decode<ByteVector>(encoded));
+				for (auto&& route : relay["routes"])
+					profile.m_Gateway.m_ArchivedRouteOwners.emplace(AgentId{ route["destinationAgent"].get<std::string>() }, AgentId{ item.key() });
+
+				profile.m_Gateway.m_ArchivedAgents.emplace(AgentId{ item.key() }, std::move(encoded));
 			}
-			for (auto&& route : relay["routes"])
-				agent->ReAddRoute(RouteId(route["destinationAgent"].get<std::string>(), route["receivingInterface"].get<std::string>()), route["outgoingInterface"].get<std::string>(), route["isNeighbour"].get<bool>());
-		}
 	}
 
 	// Restore real routing table
@@ -291,16 +557,18 @@ void FSecure::C3::Core::Profiler::RestoreFromSnapshot()
 		auto gateRelay = profile.m_Gateway.m_Gateway.lock();
 		if (!gateRelay)
 			throw std::logic_error("Parent GateRelay cannot be locked");
-		auto const& routes = profile.m_Gateway.m_Routes.GetUnderlyingContainer();
-		for (auto const& route : routes)
+		RouteManager::Changes changes;
+		for (auto const& route : profile.m_Gateway.m_Routes.GetUnderlyingContainer())
 		{
 			auto outgoingDevice = gateRelay->FindDevice(route.m_OutgoingDevice);
 			if (!outgoingDevice)
 				throw std::logic_error("Outgoing device cannot be locked");
 
-			gateRelay->AddRoute(route.m_Id, outgoingDevice);
+			changes.m_AddedRoutes.emplace_back(route.m_Id, std::move(outgoingDevice));
 		}
 
+		gateRelay->ApplyChanges(changes);
+
 		profile.m_Gateway.m_LastDeviceId = snapshot["_LastDeviceId"].get<DeviceId::UnderlyingIntegerType>();
 	}
 
@@ -317,7 +585,7 @@ void FSecure::C3::Core::Profiler::RestoreFromSnapshot()
 			for (auto&& peripheral : relay["peripherals"])
 			{
 				auto connectorHash = GetBinderTo(peripheral["type"].get<HashT>());
-				auto connector = gateway->m_Connectors.Find([&](auto const& e) { return e->GetNameHash() == connectorHash; });
+				auto connector = gateway->GetConnector(connectorHash);
 				if (!connector)
 					continue;
 
@@ -383,11 +651,62 @@ json FSecure::C3::Core::Profiler::HandleNewBuildMessage(json const& message)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 json FSecure::C3::Core::Profiler::Gateway::CreateProfileSnapshot() const
+{
+	return CreateSnapshotView().ToJson();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Core::Profiler::Gateway::SnapshotView::ToJson() const
+{
+	if (m_Gateway.is_null())
+		return {};
+
+	auto profile = m_Gateway;
+	auto& relays = profile["relays"] = json::array();
+
+	// Agents' snapshots are deep copied concurrently.
+	auto& copies = relays.get_ref<json::array_t&>();
+	copies.resize(m_Relays.size());
+	std::transform(std::execution::par, m_Relays.begin(), m_Relays.end(), copies.begin(), [](auto const& relay) { return *relay; });
+
+	return profile;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Profiler::Gateway::SnapshotView FSecure::C3::Core::Profiler::Gateway::CreateSubtreeSnapshotView(AgentId agentId) const
 {
 	auto gateway = m_Gateway.lock();
 	if (!gateway)
 		return {};
 
+	// Routes of an Agent lead to Agents behind it. Their Routes are followed too, in case Route table of the root is not complete yet.
+	SnapshotView view{ { { "agentId", gateway->m_AgentId.ToString() }, { "subtreeAgentId", agentId.ToString() } } };
+	std::unordered_set<AgentId> visited{ agentId };
+	for (std::vector<AgentId> pending{ agentId }; !pending.empty();)
+	{
+		auto agent = m_Agents.Find(pending.back());
+		pending.pop_back();
+		if (!agent)
+			continue;
+
+		view.m_Relays.push_back(agent->GetCachedProfileSnapshot());
+		for (auto const& route : agent->m_Routes.GetUnderlyingContainer())
+			if (visited.insert(route.m_Id.GetAgentId()).second)
+				pending.push_back(route.m_Id.GetAgentId());
+	}
+
+	return view;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Profiler::Gateway::SnapshotView FSecure::C3::Core::Profiler::Gateway::CreateSnapshotView() const
+{
+	EventTracing::Scope<EventTracing::Keyword::Gateway> tracingScope{ "Profiler::CreateSnapshotView" };
+	AllocationTracking::Scope allocationScope{ AllocationTracking::Subsystem::Profiler };
+	auto gateway = m_Gateway.lock();
+	if (!gateway)
+		return {};
+
 	// Fill in basic data.
 	json profile = {
 		{ "agentId", gateway->m_AgentId.ToString() },
@@ -399,12 +718,72 @@ json FSecure::C3::Core::Profiler::Gateway::CreateProfileSnapshot() const
 	if (!m_ErrorState.empty())
 		profile["error"] = m_ErrorState;
 
+	if (m_ResourceUsage)
+		profile["resourceUsage"] = *m_ResourceUsage;
+
 	// Populate output json with all containers and their elements Profiles.
 	profile["channels"] = m_Channels.CreateProfileSnapshot();
 	profile["peripherals"] = m_Peripherals.CreateProfileSnapshot();
 	profile["routes"] = m_Routes.CreateProfileSnapshot();
 	profile["connectors"] = m_Connectors.CreateProfileSnapshot();
-	profile["relays"] = m_Agents.CreateProfileSnapshot();
+
+	// Quality of Service counters and traffic metrics are known only for Gateway's own Channels.
+	auto profiler = m_Owner.lock();
+	for (auto& channel : profile["channels"])
+		if (auto device = gateway->FindDevice(DeviceId{ channel["iId"].get<std::string>() }); device)
+		{
+			auto statistics = device->GetQoSStatistics();
+			channel["qos"] = {
+				{ "expiredPackets", statistics.m_ExpiredPackets },
+				{ "evictedPackets", statistics.m_EvictedPackets },
+				{ "rejectedChunks", statistics.m_RejectedChunks },
+				{ "droppedBytes", statistics.m_DroppedBytes },
+				{ "droppedOutboundPackets", statistics.m_DroppedOutboundPackets },
+				{ "pendingPackets", statistics.m_PendingPackets },
+				{ "recoveredChunks", statistics.m_RecoveredChunks },
+				{ "duplicateChunks", statistics.m_DuplicateChunks },
+				{ "outboundQueueDepth", device->GetOutboundQueueDepth() }
+			};
+
+			if (auto linkQuality = device->GetLinkQuality())
+				channel["link"] = *linkQuality;
+
+			if (!profiler || !profiler->m_ReportDeviceMetrics)
+				continue;
+
+			// Histogram bucket counts OnReceive calls shorter than its "maxMs". The last one has no bound.
+			auto metrics = device->GetMetrics();
+			auto& buckets = DeviceBridge::Metrics::s_ReceiveDurationBuckets;
+			auto receiveDurations = json::array();
+			for (size_t i = 0; i < metrics.m_ReceiveDurations.size(); ++i)
+				receiveDurations.push_back({
+					{ "maxMs", i < buckets.size() ? json(std::chrono::duration<double, std::milli>{ buckets[i] }.count()) : json{} },
+					{ "count", metrics.m_ReceiveDurations[i] }
+				});
+
+			channel["metrics"] = {
+				{ "bytesIn", metrics.m_BytesIn },
+				{ "packetsIn", metrics.m_PacketsIn },
+				{ "bytesOut", metrics.m_BytesOut },
+				{ "packetsOut", metrics.m_PacketsOut },
+				{ "chunksSent", metrics.m_ChunksSent },
+				{ "partialSends", metrics.m_PartialSends },
+				{ "resends", metrics.m_Resends },
+				{ "exceptions", metrics.m_Exceptions },
+				{ "receiveDurations", std::move(receiveDurations) }
+			};
+		}
+
+	// Number of Controller messages waiting to be handled.
+	profile["apiBridge"] = { { "queueDepth", gateway->m_ApiBridgeExecutor->GetQueueDepth() } };
+
+	// Latency breakdown of sampled commands.
+	if (auto commandTracing = gateway->GetCommandTracingReport(); !commandTracing.is_null())
+		profile["commandTracing"] = std::move(commandTracing);
+
+	// Routes recommended for Agents reachable in more than one way.
+	if (!m_RouteRecommendations.empty())
+		profile["routeRecommendations"] = m_RouteRecommendations;
 
 	json registeredBuilds;
 	for (auto b : m_AgentBuilds)
@@ -420,14 +799,26 @@ json FSecure::C3::Core::Profiler::Gateway::CreateProfileSnapshot() const
 		);
 	}
 	profile["_RegisteredBuilds"] = registeredBuilds;
+	if (!m_ArchivedAgents.empty())
+	{
+		auto& archived = profile["_archivedRelays"] = json::object();
+		for (auto const& [agentId, encoded] : m_ArchivedAgents)
+			archived[agentId.ToString()] = encoded;
+	}
 
-	return profile;
+	// Agents are independent, so those without a valid cached snapshot are serialized concurrently. Snapshots are immutable and can be read after the Profile lock is released.
+	auto& agents = m_Agents.GetUnderlyingContainer();
+	std::vector<std::shared_ptr<const json>> relays(agents.size());
+	std::transform(std::execution::par, agents.begin(), agents.end(), relays.begin(), [](Agent const& agent) { return agent.GetCachedProfileSnapshot(); });
+
+	return { std::move(profile), std::move(relays) };
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-FSecure::C3::Core::Profiler::Agent::Agent(std::weak_ptr<Profiler> owner, AgentId agentId, BuildId buildId, FSecure::Crypto::PublicKey encryptionKey, bool isBanned, int32_t lastSeen, bool isX64, HostInfo hostInfo)
+FSecure::C3::Core::Profiler::Agent::Agent(std::weak_ptr<Profiler> owner, AgentId agentId, BuildId buildId, FSecure::Crypto::PublicKey encryptionKey, FSecure::Crypto::SharedKey sharedKey, bool isBanned, int32_t lastSeen, bool isX64, HostInfo hostInfo)
 	: Relay(owner, agentId, buildId, lastSeen)
 	, m_EncryptionKey(encryptionKey)
+	, m_SharedKey(std::move(sharedKey))
 	, m_HostInfo(std::move(hostInfo))
 	, m_IsBanned(isBanned)
 	, m_IsX64(isX64)
@@ -445,7 +836,7 @@ json FSecure::C3::Core::Profiler::Agent::CreateProfileSnapshot() const
 		{ "_LastDeviceId", m_LastDeviceId },
 		{ "timestamp", m_LastSeen },
 		{ "hostInfo", m_HostInfo },
-		{ "isActive", FSecure::Utils::TimeSinceEpoch() - m_LastSeen < 300 }
+		{ "isActive", IsActive() }
 	};
 	if (!m_ErrorState.empty())
 		profile["error"] = m_ErrorState;
@@ -509,7 +900,7 @@ void FSecure::C3::Core::Profiler::Agent::ParseAndRunCommand(json const& jCommand
 					if (deviceIsChannel)
 					{
 						m_Channels.TryRemove(*deviceId);
-						m_Routes.RemoveIf([deviceId](Profiler::Route const& route) { return route.m_OutgoingDevice == deviceId; });
+						ReApplyRoutes({ *deviceId });
 					}
 					else
 					{
@@ -524,7 +915,7 @@ void FSecure::C3::Core::Profiler::Agent::ParseAndRunCommand(json const& jCommand
 						m_Peripherals.TryRemove(*deviceId);
 
 						// Get connector
-						auto connector = gateRelay->m_Connectors.Find([&](auto const& e) { return e->GetNameHash() == connectorHash; });
+						auto connector = gateRelay->GetConnector(connectorHash);
 						if (!connector)
 							return;
 
@@ -542,6 +933,8 @@ void FSecure::C3::Core::Profiler::Agent::ParseAndRunCommand(json const& jCommand
 
 					device->m_Jitter.first = FSecure::Utils::ToMilliseconds(commandReadView.Read<float>());
 					device->m_Jitter.second = FSecure::Utils::ToMilliseconds(commandReadView.Read<float>());
+					device->m_IsJitterAdaptive = !commandReadView.empty() && commandReadView.Read<uint8_t>();
+					device->m_ResponseWindow = commandReadView.empty() ? 0ms : FSecure::Utils::ToMilliseconds(commandReadView.Read<float>());
 				};
 				break;
 			default:
@@ -549,16 +942,8 @@ void FSecure::C3::Core::Profiler::Agent::ParseAndRunCommand(json const& jCommand
 			}
 		}
 
-		auto route = gateRelay->FindRoute(m_Id);
-		if (!route)
-			throw std::runtime_error("Failed to find route to agent id = " + m_Id.ToString());
-
-		auto outgoingChannel = route->m_Channel.lock();
-		if (!outgoingChannel)
-			throw std::runtime_error("Tried to send command through dead channel"); // TODO maybe try through different route
-
-		auto query = ProceduresG2X::RunCommandOnDeviceQuery::Create(route->m_RouteId, gateRelay->m_Signature, m_EncryptionKey, gateRelay->m_DecryptionKey, *deviceId, ByteView{ commandWithArgs });
-		gateRelay->LockAndSendPacket(query->ComposeQueryPacket(), outgoingChannel);
+		// Commands for unreachable Agent wait until it checks in. Profile shows the state they lead to.
+		gateRelay->PostAgentCommand(m_Id, m_SharedKey, ByteView{ commandWithArgs }, *deviceId);
 		finalizer();
 	}
 	else// If we're here then let NodeRelay run Command on itself.
@@ -586,10 +971,6 @@ void FSecure::C3::Core::Profiler::Agent::RunCommand(ByteView commandWithArgument
 	if (!gateRelay)
 		return; // probably shutting down
 
-	auto route = gateRelay->FindRoute(m_Id);
-	if (!route)
-		throw std::runtime_error("Failed to find route to agent id = " + m_Id.ToString());
-
 	std::function<void()> finalizer = []() {};
 	switch (static_cast<Command>(commandId))
 	{
@@ -606,7 +987,7 @@ void FSecure::C3::Core::Profiler::Agent::RunCommand(ByteView commandWithArgument
 			{
 				auto connectorHash = profiler->GetBinderTo(element.m_TypeHash);
 
-				auto connector = gateRelay->m_Connectors.Find([&](auto const& e) { return e->GetNameHash() == connectorHash; });
+				auto connector = gateRelay->GetConnector(connectorHash);
 				if (!connector)
 					break;
 
@@ -615,7 +996,11 @@ void FSecure::C3::Core::Profiler::Agent::RunCommand(ByteView commandWithArgument
 			}
 
 			m_Peripherals.Clear();
+			gateRelay->DropQueuedAgentCommands(m_Id);
 			owner->Get().m_Gateway.m_Agents.Remove(m_Id);
+			owner->Get().m_Gateway.UpdateBannedAgents();
+			gateRelay->InvalidateDeliveryContexts();
+			gateRelay->InvalidateConnectedAgents();
 		};
 		break;
 	}
@@ -646,21 +1031,30 @@ void FSecure::C3::Core::Profiler::Agent::RunCommand(ByteView commandWithArgument
 
 			for (auto& e : m_Channels.GetUnderlyingContainer())
 				e.m_IsReturnChannel = e.m_Id == did;
+
+			InvalidateConnectedAgents();
 		};
 		break;
 	}
+	case Command::AddGRC:
+	{
+		if (!m_Channels.Find(DeviceId{ ByteView{ commandReadView }.Read<std::string_view>() }))
+			throw std::runtime_error{ "Channel not found" };
+
+		break;
+	}
+	case Command::SetStriping:
+	case Command::SetIdleTrimming:
+	case Command::SetSpool:
+	case Command::SetAggregation:
+	case Command::SetCutThrough:
 	case Command::Ping:
 		break;
 	default:
 		throw std::runtime_error("Profiler received an unknown command for agent id: " + m_Id.ToString());
 	}
 
-	auto outgoingChannel = route->m_Channel.lock();
-	if (!outgoingChannel)
-		throw std::runtime_error("Tried to send command through dead channel"); // TODO maybe try through different route
-
-	auto query = ProceduresG2X::RunCommandOnAgentQuery::Create(route->m_RouteId, gateRelay->m_Signature, m_EncryptionKey, gateRelay->m_DecryptionKey, commandWithArguments);
-	gateRelay->LockAndSendPacket(query->ComposeQueryPacket(), outgoingChannel);
+	gateRelay->PostAgentCommand(m_Id, m_SharedKey, commandWithArguments);
 	finalizer();
 }
 
@@ -675,10 +1069,6 @@ void FSecure::C3::Core::Profiler::Agent::PerformCreateCommand(json const& jComma
 	if (!gateRelay)
 		return; // probably shutting down
 
-	auto route = gateRelay->FindRoute(m_Id);
-	if (!route)
-		throw std::runtime_error("Failed to find route to agent id = " + m_Id.ToString());
-
 	auto commandWithArguments = base64::decode<ByteVector>(jCommandElement["Command"]["ByteForm"].get<std::string>());
 
 	// check if command is a create device command -> then we need to assign deviceId and retreive its hash and repack commandWithArguments
@@ -702,7 +1092,7 @@ void FSecure::C3::Core::Profiler::Agent::PerformCreateCommand(json const& jComma
 		if (!connector)
 			throw std::runtime_error{ "Connector for requested peripheral is closed" };
 
-		auto updatedArguments = connector->PeripheralCreationCommand(ByteVector::Create(RouteId{ route->m_RouteId.GetAgentId(), newDeviceId }), commandReadView, m_IsX64);
+		auto updatedArguments = connector->PeripheralCreationCommand(ByteVector::Create(RouteId{ m_Id, newDeviceId }), commandReadView, m_IsX64);
 		repacked.Concat(updatedArguments);
 	}
 	else
@@ -712,21 +1102,25 @@ void FSecure::C3::Core::Profiler::Agent::PerformCreateCommand(json const& jComma
 
 	commandWithArguments = repacked;
 
-	auto outgoingChannel = route->m_Channel.lock();
-	if (!outgoingChannel)
-		throw std::runtime_error("Tried to send command through dead channel"); // TODO maybe try through different route
+	// Stagers are sent in full only once. Later on only their hash is sent and Relay asks for the full Command if it doesn't have them cached anymore.
+	auto arguments = ByteView{ repacked }.SubString(sizeof(std::underlying_type_t<Command>) + DeviceId::BinarySize + sizeof(bool) + sizeof(HashT));
+	auto argumentsHash = arguments.size() >= s_MinCachedArgumentsSize ? Crypto::Hash(arguments) : ByteVector{};
+	if (!argumentsHash.empty() && !m_SentArgumentsHashes.emplace(std::string{ ByteView{ argumentsHash } }).second)
+		commandWithArguments = ByteVector{}.Write(Command::AddDeviceFromCache, newDeviceId, command->m_IsNegotiableChannel, command->m_Hash, ByteView{ argumentsHash });
 
 	// push json with startup arguments to some container, use it if channel is created.
 	AddScheduledDevice(newDeviceId, jCommandElement["Command"]);
+	if (commandWithArguments.size() != repacked.size())
+		m_UncachedDeviceCommands.insert_or_assign(newDeviceId.ToUnderlyingType(), std::move(repacked));
 
-	auto query = ProceduresG2X::RunCommandOnAgentQuery::Create(route->m_RouteId, gateRelay->m_Signature, m_EncryptionKey, gateRelay->m_DecryptionKey, commandWithArguments);
-	gateRelay->LockAndSendPacket(query->ComposeQueryPacket(), outgoingChannel);
+	gateRelay->PostAgentCommand(m_Id, m_SharedKey, commandWithArguments);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::Profiler::Channel* FSecure::C3::Core::Profiler::Agent::ReAddChannel(Device::Id did, HashT typeNameHash, bool isReturnChannel /*= false*/, bool isNegotiationChannel /*= false*/)
 {
 	auto channel = Relay::ReAddChannel(did, typeNameHash, isReturnChannel, isNegotiationChannel);
+	m_UncachedDeviceCommands.erase(did.ToUnderlyingType());
 
 	if (auto it = m_ScheduledDevices.find(did.ToUnderlyingType()); it != m_ScheduledDevices.cend())
 		channel->m_StartupArguments = it->second;
@@ -738,6 +1132,7 @@ FSecure::C3::Core::Profiler::Channel* FSecure::C3::Core::Profiler::Agent::ReAddC
 FSecure::C3::Core::Profiler::Device* FSecure::C3::Core::Profiler::Agent::ReAddPeripheral(Device::Id did, HashT typeNameHash)
 {
 	auto device = Relay::ReAddPeripheral(did, typeNameHash);
+	m_UncachedDeviceCommands.erase(did.ToUnderlyingType());
 
 	if (auto it = m_ScheduledDevices.find(did.ToUnderlyingType()); it != m_ScheduledDevices.cend())
 		device->m_StartupArguments = it->second;
@@ -745,6 +1140,35 @@ FSecure::C3::Core::Profiler::Device* FSecure::C3::Core::Profiler::Agent::ReAddPe
 	return device;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::Agent::ResendUncachedDevice(DeviceId deviceId)
+{
+	auto command = m_UncachedDeviceCommands.find(deviceId.ToUnderlyingType());
+	if (command == m_UncachedDeviceCommands.end())
+		throw std::runtime_error{ "Agent " + m_Id.ToString() + " asked for arguments of unknown device " + deviceId.ToString() + "." };
+
+	auto commandWithArguments = std::move(command->second);
+	m_UncachedDeviceCommands.erase(command);
+
+	auto profiler = m_Owner.lock();
+	if (!profiler)
+		return; // probably shutting down
+
+	auto gateRelay = profiler->m_Gateway->m_Gateway.lock();
+	if (!gateRelay)
+		return; // probably shutting down
+
+	auto route = gateRelay->FindRoute(m_Id);
+	if (!route)
+		throw std::runtime_error("Failed to find route to agent id = " + m_Id.ToString());
+
+	auto outgoingChannel = route->m_Channel.lock();
+	if (!outgoingChannel)
+		throw std::runtime_error("Tried to send command through dead channel");
+
+	gateRelay->SendAgentCommand(route->m_RouteId, m_SharedKey, commandWithArguments, outgoingChannel);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::Profiler::Agent::AddScheduledDevice(DeviceId deviceId, json command)
 {
@@ -761,6 +1185,18 @@ FSecure::C3::Core::Profiler::Channel* FSecure::C3::Core::Profiler::Agent::FindGr
 	return nullptr;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::Profiler::Agent::IsActive() const
+{
+	return FSecure::Utils::TimeSinceEpoch() - m_LastSeen < 300;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::Profiler::Agent::IsCachedProfileSnapshotValid(json const& cachedSnapshot) const
+{
+	return cachedSnapshot.at("isActive").get<bool>() == IsActive();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::Profiler::Gateway::Gateway(std::weak_ptr<Profiler> owner, std::string name, std::shared_ptr<GateRelay> gateway)
 	: Relay(owner, gateway->m_AgentId, gateway->m_BuildId, FSecure::Utils::TimeSinceEpoch())
@@ -799,6 +1235,8 @@ void FSecure::C3::Core::Profiler::Gateway::ParseAndRunCommand(json const& jComma
 
 							profilerElement->m_Jitter.first = FSecure::Utils::ToMilliseconds(localView.Read<float>());
 							profilerElement->m_Jitter.second = FSecure::Utils::ToMilliseconds(localView.Read<float>());
+							profilerElement->m_IsJitterAdaptive = !localView.empty() && localView.Read<uint8_t>();
+							profilerElement->m_ResponseWindow = localView.empty() ? 0ms : FSecure::Utils::ToMilliseconds(localView.Read<float>());
 							break;
 						}
 						case FSecure::C3::Command::Close:
@@ -806,7 +1244,7 @@ void FSecure::C3::Core::Profiler::Gateway::ParseAndRunCommand(json const& jComma
 							if (auto profilerElement = m_Peripherals.Find(device->GetDid()))
 							{
 								auto connectorHash = m_Owner.lock()->GetBinderTo(profilerElement->m_TypeHash);
-								auto connector = m_Gateway.lock()->m_Connectors.Find([&](auto const& e) { return e->GetNameHash() == connectorHash; });
+								auto connector = m_Gateway.lock()->GetConnector(connectorHash);
 								if (!connector)
 									break;
 
@@ -815,7 +1253,7 @@ void FSecure::C3::Core::Profiler::Gateway::ParseAndRunCommand(json const& jComma
 							}
 							else if (auto profilerElemnt = m_Channels.Find(device->GetDid()))
 							{
-								m_Routes.RemoveIf([did = device->GetDid()](Profiler::Route const& route) { return route.m_OutgoingDevice == did; });
+								ReApplyRoutes({ device->GetDid() });
 							}
 							break;
 						}
@@ -852,12 +1290,22 @@ void FSecure::C3::Core::Profiler::Gateway::ParseAndRunCommand(json const& jComma
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-json FSecure::C3::Core::Profiler::Gateway::GetCapability()
+json const& FSecure::C3::Core::Profiler::Gateway::GetCapability()
 {
 	// Request access to Gateway object.
 	auto gateway = m_Gateway.lock();
 	if (!gateway)
-		return {};
+	{
+		static auto const empty = json{};
+		return empty;
+	}
+
+	auto revision = gateway->m_InterfaceFactory.GetRevision();
+	if (m_Capability && m_CapabilityRevision == revision)
+		return *m_Capability;
+
+	m_DumpedCapability.reset();
+	m_CapabilityRevision = revision;
 
 	// TODO This function require refactoring.
 
@@ -921,6 +1369,14 @@ json FSecure::C3::Core::Profiler::Gateway::GetCapability()
 	modifyEntry({ "gateway", "relay" }, "peripherals", { "AddPeripheral" }, true);
 	modifyEntry({ "gateway" }, "connectors", { "TurnOnConnector" }, false);
 
+	// Frames are captured by DeviceBridge, so every Channel gets the command.
+	for (auto& channel : initialPacket["channels"])
+		channel["commands"].push_back(json{ {"name", "Capture traffic"}, {"description", "Record frames passing through the Channel, for replaying them with RelayBenchmark. Frames are stored encrypted, as they travel."},
+			{"id", static_cast<std::underlying_type_t<Command>>(Command::SetCapture) }, {"arguments", {
+				{{"type", "string"}, {"name", "Path"}, {"description", "File on the Relay's host to write the capture to. Empty stops the capture."}, {"min", 0}},
+				{{"type", "uint16"}, {"name", "Size limit"}, {"description", "MiB after which frames are no longer recorded."}, {"min", 1}, {"defaultValue", 64}}
+			}} });
+
 
 	// Add common commands for relay.
 	auto addRelayCommand = [&](std::vector<std::string> relayTypes, json const& newCommand)
@@ -944,12 +1400,54 @@ json FSecure::C3::Core::Profiler::Gateway::GetCapability()
 				{{"type", "string"}, {"name", "DeviceID"}, {"description", "Id of device in string form."}, {"min", 1}}
 			}} });
 
+	addRelayCommand({ "relay" }, json{ {"name", "AddGatewayReturnChannel"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::AddGRC) }, {"arguments", {
+				{{"type", "string"}, {"name", "DeviceID"}, {"description", "Id of device in string form. Packets to Gateway are sent through it when it is healthier than the default return channel."}, {"min", 1}}
+			}} });
+
+	addRelayCommand({ "relay" }, json{ {"name", "SetStriping"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::SetStriping) }, {"arguments", {
+				{{"type", "uint32"}, {"name", "Threshold"}, {"description", "Packets to Gateway larger than this many bytes are split and sent through all Gateway return channels. 0 turns striping off. All Relays on the way must support it."}, {"defaultValue", 0}}
+			}} });
+
+	addRelayCommand({ "relay" }, json{ {"name", "SetIdleTrimming"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::SetIdleTrimming) }, {"arguments", {
+				{{"type", "uint32"}, {"name", "Quiet period"}, {"description", "Seconds without any packet after which memory left by past traffic is released. 0 turns trimming off."}, {"defaultValue", 0}},
+				{{"type", "boolean"}, {"name", "Trim working set"}, {"description", "Also compact the heap and swap out the working set of the process."}, {"defaultValue", false}}
+			}} });
+
+	addRelayCommand({ "relay" }, json{ {"name", "SetSpool"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::SetSpool) }, {"arguments", {
+				{{"type", "uint32"}, {"name", "Memory limit"}, {"description", "KiB of packets to Gateway kept in memory while Gateway return channels are down or saturated."}, {"defaultValue", 4096}},
+				{{"type", "uint32"}, {"name", "Disk limit"}, {"description", "MiB of packets spilled to an encrypted temporary file when memory limit is reached. 0 turns spilling off."}, {"defaultValue", 0}}
+			}} });
+
+	addRelayCommand({ "relay" }, json{ {"name", "SetAggregation"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::SetAggregation) }, {"arguments", {
+				{{"type", "uint32"}, {"name", "Linger"}, {"description", "Milliseconds that small packets to Gateway wait for others, so that they are encrypted and sent together. 0 turns aggregation off. All Relays on the way must support it."}, {"defaultValue", 0}}
+			}} });
+
+	addRelayCommand({ "relay" }, json{ {"name", "SetCutThrough"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::SetCutThrough) }, {"arguments", {
+				{{"type", "boolean"}, {"name", "Enabled"}, {"description", "Forward chunks of big packets to Gateway as they arrive, instead of reassembling them first. Relays on the way are not slowed down by whole packet transfers."}, {"defaultValue", false}}
+			}} });
+
 	addRelayCommand({ "relay" }, json{ {"name", "Ping"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::Ping) }, {"arguments", json::array() } });
 
 	addRelayCommand({ "gateway" }, json{ {"name", "ClearNetwork"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::ClearNetwork) }, {"arguments", {
 					{{"type", "boolean"}, {"name", "Are you sure?"}, {"description", "Confirm clearing the network. All network state will be lost, this can not be undone."}, {"default", false}}
 				}} });
 
+	addRelayCommand({ "gateway" }, json{ {"name", "SetCommandTracing"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::SetCommandTracing) }, {"arguments", {
+					{{"type", "uint32"}, {"name", "Interval"}, {"description", "Trace every n-th command sent to Agents and report its latency in the Gateway's profile. 0 turns tracing off."}, {"defaultValue", 0}}
+				}} });
+
+	addRelayCommand({ "gateway" }, json{ {"name", "SetMulticast"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::SetMulticast) }, {"arguments", {
+					{{"type", "boolean"}, {"name", "Enabled"}, {"description", "Send commands to Agents sharing the first hop as one packet, split by Relays where their Routes branch. All Relays must support it."}, {"defaultValue", false}}
+				}} });
+
+	addRelayCommand({ "gateway" }, json{ {"name", "SetCompoundCommands"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::SetCompoundCommands) }, {"arguments", {
+					{{"type", "boolean"}, {"name", "Enabled"}, {"description", "Send commands given to one Agent together as one packet, run by the Agent in order. All Relays must support it."}, {"defaultValue", false}}
+				}} });
+
+	addRelayCommand({ "gateway" }, json{ {"name", "SetRoutePreference"}, {"id", static_cast<std::underlying_type_t<Command>>(Command::SetRoutePreference) }, {"arguments", {
+					{{"type", "uint8"}, {"name", "Preference"}, {"description", "Route used for commands to Agents reachable in more than one way. 0 uses any Route and only reports recommended ones in the Gateway's profile, 1 uses the Route with the lowest latency, 2 the one with the highest throughput."}, {"defaultValue", 0}}
+				}} });
+
 
 	// add extra fields.
 	auto gatewayPushBack = [&](auto key, auto value)
@@ -963,7 +1461,17 @@ json FSecure::C3::Core::Profiler::Gateway::GetCapability()
 	gatewayPushBack("broadcastKey", gateway->m_BroadcastKey.ToBase64());
 	gatewayPushBack("name", m_Name);
 
-	return initialPacket;
+	return *(m_Capability = std::move(initialPacket));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::string const& FSecure::C3::Core::Profiler::Gateway::GetDumpedCapability()
+{
+	auto const& capability = GetCapability();
+	if (!m_DumpedCapability)
+		m_DumpedCapability = capability.dump();
+
+	return *m_DumpedCapability;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -993,7 +1501,9 @@ void FSecure::C3::Core::Profiler::Gateway::AddBuildInCommands(json& interface, b
 		interface["commands"].push_back(json{ {"name", "Set UpdateDelayJitter"}, {"description", "Set delay between receiving function calls."}, {"id", static_cast<std::underlying_type_t<Command>>(Command::UpdateJitter) },
 			{"arguments", {
 				{{"type", "float"}, {"name", "Min"}, {"description", "Minimal delay in seconds"}, {"min", 0.03}},
-				{{"type", "float"}, {"name", "Max"}, {"description", "Maximal delay in seconds. "}, {"min", 0.03}}
+				{{"type", "float"}, {"name", "Max"}, {"description", "Maximal delay in seconds. "}, {"min", 0.03}},
+				{{"type", "boolean"}, {"name", "Adaptive"}, {"description", "Poll close to minimal delay while there is traffic and back off towards maximal one when idle."}, {"defaultValue", false}},
+				{{"type", "float"}, {"name", "Response window"}, {"description", "Seconds after each send during which Device polls at minimal delay, so that replies are picked up quickly. 0 turns it off."}, {"min", 0}, {"defaultValue", 0}}
 			}} });
 }
 
@@ -1035,6 +1545,26 @@ void FSecure::C3::Core::Profiler::Gateway::RunCommand(ByteView commandWithArgume
 		}
 		break;
 	}
+	case Command::SetCommandTracing:
+		pin->SetCommandTracingInterval(commandWithArguments.Read<std::uint32_t>());
+		break;
+	case Command::SetMulticast:
+		pin->SetMulticast(commandWithArguments.Read<bool>());
+		break;
+	case Command::SetCompoundCommands:
+		pin->SetCompoundCommands(commandWithArguments.Read<bool>());
+		break;
+	case Command::SetRoutePreference:
+	{
+		auto preference = commandWithArguments.Read<std::uint8_t>();
+		if (preference > static_cast<std::uint8_t>(GateRelay::RoutePreference::Bandwidth))
+			throw std::invalid_argument{ "Unknown route preference." };
+
+		pin->SetRoutePreference(static_cast<GateRelay::RoutePreference>(preference));
+		if (auto profiler = m_Owner.lock())
+			profiler->Get().m_Gateway.UpdatePreferredRoutes();
+		break;
+	}
 	default:
 		break;
 	}
@@ -1112,6 +1642,7 @@ void FSecure::C3::Core::Profiler::Gateway::ReTurnOffConnector(HashT connectorNam
 void FSecure::C3::Core::Profiler::Gateway::ReDeleteChannel(DeviceId iidOfDeviceToDetach)
 {
 	m_Channels.Remove(iidOfDeviceToDetach);
+	ReApplyRoutes({ iidOfDeviceToDetach });
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1128,11 +1659,125 @@ FSecure::C3::Core::Profiler::Agent* FSecure::C3::Core::Profiler::Gateway::ReAddA
 		throw std::runtime_error{ "Tried to add agent with unknown buildId" };
 	if (build->second.m_IsBanned)
 		return nullptr;
-	auto agent = m_Agents.Add(agentId, Agent{ m_Owner, agentId, buildId, encryptionKey, isBanned, lastSeen, build->second.m_IsX64, std::move(hostInfo) });
+	auto gateRelay = m_Gateway.lock();
+	if (!gateRelay)
+		throw std::logic_error("Parent GateRelay cannot be locked");
+
+	auto sharedKey = FSecure::Crypto::PrecomputeSharedKey(encryptionKey, gateRelay->m_DecryptionKey);
+	auto agent = m_Agents.Add(agentId, Agent{ m_Owner, agentId, buildId, encryptionKey, std::move(sharedKey), isBanned, lastSeen, build->second.m_IsX64, std::move(hostInfo) });
+	gateRelay->InvalidateDeliveryContexts();
+	UpdateBannedAgents();
 	agent->AddScheduledDevice(0u, build->second.m_StartupCmd);
 	return agent;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::Gateway::UpdateBannedAgents()
+{
+	auto gateRelay = m_Gateway.lock();
+	if (!gateRelay)
+		return;
+
+	std::unordered_set<AgentId::UnderlyingIntegerType> bannedAgents;
+	for (auto const& agent : std::as_const(m_Agents).GetUnderlyingContainer())
+		if (agent.m_IsBanned)
+			bannedAgents.insert(agent.m_Id.ToUnderlyingType());
+
+	gateRelay->SetBannedAgents(std::move(bannedAgents));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::Gateway::UpdatePreferredRoutes()
+{
+	auto gateRelay = m_Gateway.lock();
+	if (!gateRelay)
+		return;
+
+	// Gateway has a Route for every way an Agent was reached. Relays on the way forward packets by the whole RouteId, so choosing a RouteId chooses the path.
+	std::map<AgentId, std::vector<RouteMetrics>> candidates;
+	for (auto const& route : std::as_const(m_Routes).GetUnderlyingContainer())
+		if (auto metrics = MeasureRoute(route.m_Id))
+			candidates[route.m_Id.GetAgentId()].push_back(*metrics);
+
+	auto byLatency = [](RouteMetrics const& a, RouteMetrics const& b) { return std::tie(a.m_LatencyMs, a.m_Hops) < std::tie(b.m_LatencyMs, b.m_Hops); };
+	auto byBandwidth = [&](RouteMetrics const& a, RouteMetrics const& b) { return a.m_Throughput != b.m_Throughput ? a.m_Throughput > b.m_Throughput : byLatency(a, b); };
+
+	auto preference = gateRelay->GetRoutePreference();
+	std::unordered_map<AgentId::UnderlyingIntegerType, RouteId> preferredRoutes;
+	auto recommendations = json::array();
+	for (auto const& [agentId, routes] : candidates)
+	{
+		if (routes.size() < 2)
+			continue;
+
+		auto lowestLatency = std::min_element(routes.begin(), routes.end(), byLatency)->m_RouteId;
+		auto highestBandwidth = std::min_element(routes.begin(), routes.end(), byBandwidth)->m_RouteId;
+		if (preference != GateRelay::RoutePreference::None)
+			preferredRoutes.emplace(agentId.ToUnderlyingType(), preference == GateRelay::RoutePreference::Latency ? lowestLatency : highestBandwidth);
+
+		auto jRoutes = json::array();
+		for (auto const& route : routes)
+			jRoutes.push_back({ { "routeId", route.m_RouteId.ToString() }, { "latencyMs", route.m_LatencyMs }, { "throughput", route.m_Throughput }, { "hops", route.m_Hops } });
+
+		recommendations.push_back({ { "agentId", agentId.ToString() }, { "lowestLatency", lowestLatency.ToString() }, { "highestBandwidth", highestBandwidth.ToString() }, { "routes", std::move(jRoutes) } });
+	}
+
+	m_RouteRecommendations = std::move(recommendations);
+	gateRelay->SetPreferredRoutes(std::move(preferredRoutes));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::C3::Core::Profiler::Gateway::RouteMetrics> FSecure::C3::Core::Profiler::Gateway::MeasureRoute(RouteId routeId)
+{
+	auto gateRelay = m_Gateway.lock();
+	auto metrics = RouteMetrics{ routeId };
+	Relay* current = this;
+	for (auto depthLimit = 128; depthLimit; --depthLimit)
+	{
+		auto route = std::as_const(current->m_Routes).Find(routeId);
+		if (!route)
+			return {};
+
+		// Gateway measures its own Channels, Agents report theirs in Notifications.
+		std::optional<DeviceBridge::LinkQuality> linkQuality;
+		if (current == this)
+		{
+			if (auto device = gateRelay ? gateRelay->FindDevice(route->m_OutgoingDevice) : nullptr)
+				linkQuality = device->GetLinkQuality();
+		}
+		else if (auto channel = std::as_const(current->m_Channels).Find(route->m_OutgoingDevice))
+		{
+			linkQuality = channel->m_LinkQuality;
+		}
+
+		++metrics.m_Hops;
+		if (linkQuality)
+		{
+			metrics.m_LatencyMs += linkQuality->m_RoundTripMs / (1.f - std::min(linkQuality->m_LossRate, s_MaxLinkLossRate));
+			metrics.m_Throughput = std::min(metrics.m_Throughput, linkQuality->m_Throughput);
+		}
+		else
+		{
+			metrics.m_LatencyMs += s_UnmeasuredLinkLatencyMs;
+			metrics.m_Throughput = 0;
+		}
+
+		if (route->m_IsNeighbour)
+			return metrics;
+
+		try
+		{
+			current = FindNeighborOnDevice(*current, route->m_OutgoingDevice);
+		}
+		catch (std::logic_error const&)
+		{
+			return {};
+		}
+	}
+
+	return {};
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::Profiler::Agent* FSecure::C3::Core::Profiler::Gateway::ReAddRemoteAgent(RouteId childRouteId, BuildId buildId, FSecure::Crypto::PublicKey encryptionKey, RouteId ridOfConectionPlace, HashT childGrcHash, int32_t lastSeen, HostInfo hostInfo)
 {
@@ -1140,6 +1785,16 @@ FSecure::C3::Core::Profiler::Agent* FSecure::C3::Core::Profiler::Gateway::ReAddR
 	auto newAgent = ReAddAgent(childRouteId.GetAgentId(), buildId, encryptionKey, false, lastSeen, std::move(hostInfo)); // TODO check if is banned
 
 	// add routes
+	ReAddRemoteRoute(childRouteId, ridOfConectionPlace);
+
+	// add return channel to new agent
+	newAgent->ReAddChannel(childRouteId.GetInterfaceId(), childGrcHash, true);
+	return newAgent;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::Gateway::ReAddRemoteRoute(RouteId childRouteId, RouteId ridOfConectionPlace)
+{
 	Relay* current = this;
 	while (current->m_Id != ridOfConectionPlace.GetAgentId())
 	{
@@ -1150,14 +1805,23 @@ FSecure::C3::Core::Profiler::Agent* FSecure::C3::Core::Profiler::Gateway::ReAddR
 
 	// add route to neighboring device
 	current->ReAddRoute(childRouteId, ridOfConectionPlace.GetInterfaceId(), true);
+}
 
-	// add return channel to new agent
-	newAgent->ReAddChannel(childRouteId.GetInterfaceId(), childGrcHash, true);
-	return newAgent;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Profiler::Agent* FSecure::C3::Core::Profiler::Gateway::ReResumeAgent(RouteId agentRouteId, BuildId buildId, RouteId ridOfConectionPlace, HashT grcHash)
+{
+	// Agent, its Devices and scheduled Devices stay as they are.
+	auto agent = m_Agents.Find(agentRouteId.GetAgentId());
+	if (!agent || agent->m_IsBanned || agent->m_BuildId != buildId)
+		return nullptr;
+
+	ReAddRemoteRoute(agentRouteId, ridOfConectionPlace);
+	agent->ReAddChannel(agentRouteId.GetInterfaceId(), grcHash, true);
+	return agent;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::Profiler::Relay::UpdateFromNegotiationChannel(DeviceId negotiationDid, DeviceId newDeviceId, std::string newInputId, std::string newOutputId)
+void FSecure::C3::Core::Profiler::Relay::UpdateFromNegotiationChannel(DeviceId negotiationDid, DeviceId newDeviceId, std::string_view newInputId, std::string_view newOutputId)
 {
 	auto oldDeviceProfile = m_Channels.Find(negotiationDid);
 	auto newDeviceProfile = m_Channels.Find(newDeviceId);
@@ -1168,7 +1832,7 @@ void FSecure::C3::Core::Profiler::Relay::UpdateFromNegotiationChannel(DeviceId n
 		newDeviceProfile->m_StartupArguments["arguments"][0] = { { {"name", "Input ID"}, {"type", "string"}, {"value", newInputId} }, { {"name", "Output ID"}, {"type", "string"}, {"value", newOutputId} } };
 		auto oldDeviceCmd = base64::decode<ByteVector>(oldDeviceProfile->m_StartupArguments["ByteForm"].get<std::string>());
 		auto oldDeviceCmdReadView = ByteView{ oldDeviceCmd };
-		auto [cmdId, uniqueId] = oldDeviceCmdReadView.Read<uint16_t, std::string>();
+		auto [cmdId, uniqueId] = oldDeviceCmdReadView.Read<uint16_t, std::string_view>();
 		auto newDeviceCmd = ByteVector{}.Write(cmdId, newInputId, newOutputId).Concat(oldDeviceCmdReadView);
 		newDeviceProfile->m_StartupArguments["ByteForm"] = base64::encode(newDeviceCmd);
 	}
@@ -1177,7 +1841,7 @@ void FSecure::C3::Core::Profiler::Relay::UpdateFromNegotiationChannel(DeviceId n
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::Profiler::Agent* FSecure::C3::Core::Profiler::Gateway::FindNeighborOnDevice(Relay& relay, DeviceId did)
 {
-	auto& routes = relay.m_Routes.GetUnderlyingContainer();
+	auto const& routes = std::as_const(relay.m_Routes).GetUnderlyingContainer();
 	auto it = std::find_if(routes.begin(), routes.end(), [&](auto& e) { return e.m_IsNeighbour && e.m_OutgoingDevice == did; });
 	if (it == routes.end())
 		throw std::logic_error{ "There is no route from provided agent" };
@@ -1203,23 +1867,39 @@ void FSecure::C3::Core::Profiler::Gateway::UpdateRouteTimestamps(AgentId agentId
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::Profiler::Agent* FSecure::C3::Core::Profiler::Gateway::FindGatewaySideAgent(Agent* agent)
 {
-	auto& channels = agent->m_Channels.GetUnderlyingContainer();
+	auto const& channels = std::as_const(agent->m_Channels).GetUnderlyingContainer();
 	auto grcIt = std::find_if(channels.begin(), channels.end(), [](auto& e) {return e.m_IsReturnChannel; });
 	if (grcIt == channels.end())
 		throw std::runtime_error{ "GRC not found" };
 
-	for (auto& current : m_Agents.GetUnderlyingContainer())
-	{
-		for (auto& route : current.m_Routes.GetUnderlyingContainer())
+	auto routeToAgent = RouteId{ agent->m_Id, grcIt->m_Id };
+	if (IsGatewaySideOf(*this, routeToAgent))
+		return nullptr;
+
+	// Try the parent that was found last time.
+	if (auto it = m_GatewaySideAgents.find(agent->m_Id.ToUnderlyingType()); it != m_GatewaySideAgents.end())
+		if (auto parent = std::as_const(m_Agents).Find(it->second); parent && IsGatewaySideOf(*parent, routeToAgent))
+			return m_Agents.Find(it->second);
+
+	// Topology has changed, search all agents.
+	for (auto const& current : std::as_const(m_Agents).GetUnderlyingContainer())
+		if (IsGatewaySideOf(current, routeToAgent))
 		{
-			if (route.m_IsNeighbour && route.m_Id.GetAgentId() == agent->m_Id && route.m_Id.GetInterfaceId() == grcIt->m_Id)
-				return &current;
+			m_GatewaySideAgents[agent->m_Id.ToUnderlyingType()] = current.m_Id;
+			return m_Agents.Find(current.m_Id);
 		}
-	}
 
+	m_GatewaySideAgents.erase(agent->m_Id.ToUnderlyingType());
 	return nullptr;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::Profiler::Gateway::IsGatewaySideOf(Relay const& relay, RouteId routeToAgent)
+{
+	auto route = relay.m_Routes.Find(routeToAgent);
+	return route && route->m_IsNeighbour;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::vector<FSecure::C3::Core::Profiler::Agent*> FSecure::C3::Core::Profiler::Gateway::GetPathFromAgent(Agent* agent)
 {
@@ -1237,11 +1917,120 @@ std::vector<FSecure::C3::Core::Profiler::Agent*> FSecure::C3::Core::Profiler::Ga
 	return ret;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Profiler::Agent* FSecure::C3::Core::Profiler::Gateway::FindAgent(AgentId agentId)
+{
+	if (auto agent = m_Agents.Find(agentId))
+		return agent;
+
+	return UnarchiveAgent(agentId) ? m_Agents.Find(agentId) : nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::Gateway::ArchiveStaleAgents()
+{
+	auto now = std::chrono::steady_clock::now();
+	if (now - m_LastArchival < s_AgentArchivalInterval)
+		return;
+
+	m_LastArchival = now;
+	auto threshold = FSecure::Utils::TimeSinceEpoch() - static_cast<int32_t>(std::chrono::duration_cast<std::chrono::seconds>(s_AgentArchivalAge).count());
+	std::vector<AgentId> stale;
+	for (auto const& agent : std::as_const(m_Agents).GetUnderlyingContainer())
+		if (agent.m_LastSeen < threshold)
+			stale.push_back(agent.m_Id);
+
+	if (stale.empty())
+		return;
+
+	for (auto const& agentId : stale)
+	{
+		auto agent = std::as_const(m_Agents).Find(agentId);
+		for (auto const& route : std::as_const(agent->m_Routes).GetUnderlyingContainer())
+			m_ArchivedRouteOwners.emplace(route.m_Id.GetAgentId(), agentId);
+
+		m_ArchivedAgents[agentId] = base64::encode(EncodeSnapshot(*agent->GetCachedProfileSnapshot()));
+		m_GatewaySideAgents.erase(agentId.ToUnderlyingType());
+		m_Agents.Remove(agentId);
+	}
+
+	InvalidateProfileSnapshot();
+	UpdateBannedAgents();
+	if (auto gateRelay = m_Gateway.lock())
+	{
+		gateRelay->InvalidateDeliveryContexts();
+		gateRelay->InvalidateConnectedAgents();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::Profiler::Gateway::UnarchiveAgent(AgentId agentId)
+{
+	auto archived = m_ArchivedAgents.find(agentId);
+	if (archived == m_ArchivedAgents.end())
+		return false;
+
+	auto relay = DecodeSnapshot(base64::decode<ByteVector>(archived->second));
+	m_ArchivedAgents.erase(archived);
+	InvalidateProfileSnapshot();
+	auto agent = RestoreAgent(relay);
+	agent->m_LastSeen = std::max(agent->m_LastSeen, FSecure::Utils::TimeSinceEpoch());
+
+	// Agents on the path to this one were archived with it, as their last-seen timestamps are updated together.
+	auto [begin, end] = m_ArchivedRouteOwners.equal_range(agentId);
+	std::vector<AgentId> owners;
+	for (auto it = begin; it != end; ++it)
+		owners.push_back(it->second);
+
+	m_ArchivedRouteOwners.erase(begin, end);
+	for (auto const& owner : owners)
+		UnarchiveAgent(owner);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Profiler::Agent* FSecure::C3::Core::Profiler::Gateway::RestoreAgent(json const& relay)
+{
+	auto agent = ReAddAgent
+	(
+		relay["agentId"].get<std::string>(),
+		relay["buildId"].get<std::string>(),
+		base64::decode<ByteVector>(relay["publicKey"].get<std::string>()),
+		false,
+		relay["timestamp"].get<int32_t>(),
+		HostInfo(relay["hostInfo"])
+	);
+
+	agent->m_LastDeviceId = relay["_LastDeviceId"].get<DeviceId::UnderlyingIntegerType>();
+
+	for (auto&& channel : relay["channels"])
+	{
+		auto device = agent->ReAddChannel(channel["iId"].get<std::string>(), channel["type"].get<HashT>(), channel["isReturnChannel"].get<bool>(), channel["isNegotiationChannel"].get<bool>());
+		device->m_StartupArguments = channel["startupCommand"];
+		device->m_Jitter = std::pair{ FSecure::Utils::ToMilliseconds(channel["jitter"][0].get<float>()), FSecure::Utils::ToMilliseconds(channel["jitter"][1].get<float>()) };
+		device->m_IsJitterAdaptive = channel.value("adaptiveJitter", false);
+		device->m_ResponseWindow = FSecure::Utils::ToMilliseconds(channel.value("responseWindow", 0.f));
+	}
+	for (auto&& peripheral : relay["peripherals"])
+	{
+		auto device = agent->ReAddPeripheral(peripheral["iId"].get<std::string>(), peripheral["type"].get<HashT>());
+		device->m_StartupArguments = peripheral["startupCommand"];
+		device->m_Jitter = std::pair{ FSecure::Utils::ToMilliseconds(peripheral["jitter"][0].get<float>()), FSecure::Utils::ToMilliseconds(peripheral["jitter"][1].get<float>()) };
+		device->m_IsJitterAdaptive = peripheral.value("adaptiveJitter", false);
+		device->m_ResponseWindow = FSecure::Utils::ToMilliseconds(peripheral.value("responseWindow", 0.f));
+	}
+	for (auto&& route : relay["routes"])
+		agent->ReAddRoute(RouteId(route["destinationAgent"].get<std::string>(), route["receivingInterface"].get<std::string>()), route["outgoingInterface"].get<std::string>(), route["isNeighbour"].get<bool>());
+
+	return agent;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 bool FSecure::C3::Core::Profiler::Gateway::ConnectionExist(AgentId agentId)
 {
-	if (auto path = GetPathFromAgent(m_Agents.Find(agentId)); !path.empty())
-		for (auto& e : m_Routes.GetUnderlyingContainer())
+	if (auto path = GetPathFromAgent(FindAgent(agentId)); !path.empty())
+		for (auto const& e : std::as_const(m_Routes).GetUnderlyingContainer())
 			if (e.m_IsNeighbour && e.m_Id.GetAgentId() == path.back()->m_Id)
 				return true;
 
@@ -1254,6 +2043,14 @@ void FSecure::C3::Core::Profiler::Gateway::AddAgentBuild(BuildId bid, BuildPrope
 	auto emplaced = m_AgentBuilds.emplace(bid, properties);
 	if (!emplaced.second)
 		throw std::logic_error{ "Tried to add new build with existing buildId" };
+
+	InvalidateProfileSnapshot();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::Profiler::Gateway::HasAgentBuild(BuildId bid) const
+{
+	return m_AgentBuilds.count(bid);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1304,12 +2101,22 @@ void FSecure::C3::Core::Profiler::Gateway::ConditionalUpdateChannelParameters(Ro
 void FSecure::C3::Core::Profiler::Gateway::Reset()
 {
 	m_Agents.Clear();
+	UpdateBannedAgents();
+	if (auto gateRelay = m_Gateway.lock())
+	{
+		gateRelay->InvalidateDeliveryContexts();
+		gateRelay->InvalidateConnectedAgents();
+	}
 	m_Connectors.Clear();
 	m_Peripherals.Clear();
 	m_Channels.Clear();
 	m_Routes.Clear();
 	m_AgentBuilds.clear();
+	m_GatewaySideAgents.clear();
+	m_ArchivedAgents.clear();
+	m_ArchivedRouteOwners.clear();
 	m_LastDeviceId = 0;
+	InvalidateProfileSnapshot();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1411,12 +2218,41 @@ void FSecure::C3::Core::Profiler::Relay::ReAddRoute(RouteId receivingRid, Device
 void FSecure::C3::Core::Profiler::Relay::ReRemoveRoute(RouteId rid)
 {
 	m_Routes.Remove(rid);
+	InvalidateConnectedAgents();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::Relay::ReApplyRoutes(std::vector<DeviceId> const& removedChannels, std::vector<std::tuple<RouteId, DeviceId, bool>> const& addedRoutes)
+{
+	auto isRemoved = [&](Profiler::Route const& route) { return std::find(removedChannels.begin(), removedChannels.end(), route.m_OutgoingDevice) != removedChannels.end(); };
+
+	std::unordered_set<RouteId, RouteId::Hash> takenRoutes;
+	for (auto const& [rid, outgoingInterface, isNeighbour] : addedRoutes)
+		if (auto route = std::as_const(m_Routes).Find(rid); (route && !isRemoved(*route)) || !takenRoutes.insert(rid).second)
+			throw std::invalid_argument{ OBF("Element with specified ID already exists.") };
+
+	if (!removedChannels.empty())
+	{
+		m_Routes.RemoveIf(isRemoved);
+		InvalidateConnectedAgents();
+	}
+
+	for (auto const& [rid, outgoingInterface, isNeighbour] : addedRoutes)
+		m_Routes.Add(rid, Route{ m_Owner, rid, outgoingInterface, isNeighbour });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::Relay::InvalidateConnectedAgents() const
+{
+	if (auto owner = m_Owner.lock(); owner && owner->m_Gateway)
+		if (auto gateRelay = owner->m_Gateway->m_Gateway.lock())
+			gateRelay->InvalidateConnectedAgents();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::DeviceId FSecure::C3::Core::Profiler::Relay::FindDirectionDevice(AgentId aid)
 {
-	auto& routes = m_Routes.GetUnderlyingContainer();
+	auto const& routes = std::as_const(m_Routes).GetUnderlyingContainer();
 	auto it = std::find_if(routes.begin(), routes.end(), [&](auto& e) {return e.m_Id.GetAgentId() == aid; });
 	if (it == routes.end())
 		throw std::logic_error{ "There is no route to provided agent" };
@@ -1449,6 +2285,15 @@ FSecure::C3::Core::Profiler::Profile::Profile(Gateway& gateway)
 {
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Profiler::AgentProfile::AgentProfile(Gateway& gateway, AgentId agentId)
+	: m_TopologyLock(Profile::m_Mutex)
+	, m_AgentLock(s_AgentMutexes[std::hash<AgentId>{}(agentId) % s_AgentMutexes.size()])
+{
+	// Index of m_Agents is not modified under the shared lock, so it can be searched concurrently.
+	m_Agent = gateway.m_Agents.Find(agentId);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 json FSecure::C3::Core::Profiler::ProfileElement::CreateProfileSnapshot() const
 {
@@ -1467,6 +2312,15 @@ FSecure::C3::Core::Profiler::ProfileElement::ProfileElement(std::weak_ptr<Profil
 {
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<const json> FSecure::C3::Core::Profiler::ProfileElement::GetCachedProfileSnapshot() const
+{
+	if (!m_CachedSnapshot || !IsCachedProfileSnapshotValid(*m_CachedSnapshot))
+		m_CachedSnapshot = std::make_shared<const json>(CreateProfileSnapshot());
+
+	return m_CachedSnapshot;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 json FSecure::C3::Core::Profiler::Gateway::Connector::CreateProfileSnapshot() const
 {
@@ -1474,8 +2328,14 @@ json FSecure::C3::Core::Profiler::Gateway::Connector::CreateProfileSnapshot() co
 	profile["iId"] = Identifier(m_Id).ToString();
 	profile["type"] = m_Id;
 	profile["startupCommand"] = m_StartupArguments;
-	if (auto lock = m_Connector.lock(); lock && !lock->GetErrorStatus().empty())
-		profile["error"] = lock->GetErrorStatus();
+	if (auto lock = m_Connector.lock())
+	{
+		if (lock->IsStarting())
+			profile["isStarting"] = true;
+
+		if (auto error = lock->GetErrorStatus(); !error.empty())
+			profile["error"] = std::move(error);
+	}
 
 	return profile;
 }
@@ -1488,6 +2348,8 @@ json FSecure::C3::Core::Profiler::Device::CreateProfileSnapshot() const
 	profile["type"] = m_TypeHash;
 	profile["startupCommand"] = m_StartupArguments;
 	profile["jitter"] = { FSecure::Utils::DoubleSeconds(m_Jitter.first).count(), FSecure::Utils::DoubleSeconds(m_Jitter.second).count() };
+	profile["adaptiveJitter"] = m_IsJitterAdaptive;
+	profile["responseWindow"] = FSecure::Utils::DoubleSeconds(m_ResponseWindow).count();
 
 	// get error here.
 	return profile;
@@ -1507,31 +2369,155 @@ json FSecure::C3::Core::Profiler::Channel::CreateProfileSnapshot() const
 	auto profile = __super::CreateProfileSnapshot();
 	profile["isReturnChannel"] = m_IsReturnChannel;
 	profile["isNegotiationChannel"] = m_IsNegotiationChannel;
+	if (m_LinkQuality)
+		profile["link"] = *m_LinkQuality;
 
 	return profile;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::Profiler::SnapshotProxy::SnapshotProxy(Profiler& profiler) :
-	m_Profiler(profiler)
+	m_Profiler(profiler),
+	m_CurrentSnapshot(std::make_shared<const json>())
 {
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 bool FSecure::C3::Core::Profiler::SnapshotProxy::CheckUpdates()
 {
-	m_CurrentSnapshot = m_Profiler.Get().m_Gateway.CreateProfileSnapshot();
-	auto currentHash = std::hash<json>{}(m_CurrentSnapshot);
-	if (m_PreviousHash && currentHash == *m_PreviousHash)
+	if (!m_Profiler.m_IsRestored)
+		return false;
+
+	auto snapshot = [this]
+	{
+		std::lock_guard lock{ m_Profiler.m_SharedSnapshotMutex };
+		auto start = std::chrono::steady_clock::now();
+
+		// Profile lock is held only while the view is captured. Agents' snapshots are immutable, so the view is assembled without the lock.
+		std::optional<Gateway::SnapshotView> view;
+		{
+			auto profile = m_Profiler.Get();
+			m_Profiler.m_LastSeenTracker.Flush(profile.m_Gateway);
+			profile.m_Gateway.ArchiveStaleAgents();
+			auto version = s_ProfileVersion.load(std::memory_order_relaxed);
+			if (m_Profiler.m_SharedSnapshot && version == m_Profiler.m_SharedSnapshotVersion && start - m_Profiler.m_SharedSnapshotBuiltAt < s_SnapshotRefreshInterval)
+				return m_Profiler.m_SharedSnapshot;
+
+			m_Profiler.m_SharedSnapshotVersion = version;
+			view = profile.m_Gateway.CreateSnapshotView();
+		}
+		m_Profiler.m_SharedSnapshot = std::make_shared<const json>(view->ToJson());
+		m_Profiler.m_SharedSnapshotBuiltAt = start;
+
+		auto buildTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		m_Profiler.m_LastSnapshotBuildTime = buildTime;
+		m_Profiler.m_SnapshotsBuildTime += buildTime;
+		++m_Profiler.m_SnapshotsCount;
+		return m_Profiler.m_SharedSnapshot;
+	}();
+
+	if (snapshot == m_CurrentSnapshot)
 		return false;
 
-	m_PreviousHash = currentHash;
+	// Modifications might have left the Profile as it was.
+	if (m_Version && *snapshot == *m_CurrentSnapshot)
+	{
+		m_CurrentSnapshot = std::move(snapshot);
+		return false;
+	}
+
+	m_Delta = m_Version ? json::diff(*m_CurrentSnapshot, *snapshot) : json{};
+	m_CurrentSnapshot = std::move(snapshot);
+	++m_Version;
 	return true;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Profiler::LastSeenTracker::LastSeenTracker(std::chrono::milliseconds flushInterval)
+	: m_FlushInterval(flushInterval)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::LastSeenTracker::Update(AgentId agentId, int32_t timestamp)
+{
+	auto storeNewer = [timestamp](std::atomic<int32_t>& slot)
+	{
+		auto current = slot.load(std::memory_order_relaxed);
+		while (current < timestamp && !slot.compare_exchange_weak(current, timestamp, std::memory_order_relaxed));
+	};
+
+	{
+		std::shared_lock lock(m_SlotsMutex);
+		if (auto it = m_Slots.find(agentId.ToUnderlyingType()); it != m_Slots.end())
+			return storeNewer(it->second);
+	}
+
+	std::unique_lock lock(m_SlotsMutex);
+	if (auto [it, inserted] = m_Slots.try_emplace(agentId.ToUnderlyingType(), timestamp); !inserted)
+		storeNewer(it->second);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Profiler::LastSeenTracker::Flush(Gateway& gateway)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (now - m_LastFlush < m_FlushInterval)
+		return;
+
+	m_LastFlush = now;
+	std::vector<std::pair<AgentId, int32_t>> pending;
+	{
+		std::shared_lock lock(m_SlotsMutex);
+		for (auto& [agentId, slot] : m_Slots)
+			if (auto timestamp = slot.exchange(0, std::memory_order_relaxed))
+				pending.emplace_back(agentId, timestamp);
+	}
+
+	std::vector<AgentId> unknown;
+	for (auto& [agentId, timestamp] : pending)
+	{
+		try
+		{
+			gateway.UpdateRouteTimestamps(agentId, timestamp);
+		}
+		catch (std::exception&)
+		{
+			// Agent was removed or its path is broken. Either way timestamp cannot be applied.
+			if (!std::as_const(gateway.m_Agents).Find(agentId))
+				unknown.push_back(agentId);
+		}
+	}
+
+	if (unknown.empty())
+		return;
+
+	std::unique_lock lock(m_SlotsMutex);
+	for (auto& agentId : unknown)
+		m_Slots.erase(agentId.ToUnderlyingType());
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 json const& FSecure::C3::Core::Profiler::SnapshotProxy::GetSnapshot() const
 {
-	return m_CurrentSnapshot;
+	return *m_CurrentSnapshot;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json const& FSecure::C3::Core::Profiler::SnapshotProxy::GetDelta() const
+{
+	return m_Delta;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::uint64_t FSecure::C3::Core::Profiler::SnapshotProxy::GetVersion() const
+{
+	return m_Version;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Profiler::SnapshotStatistics FSecure::C3::Core::Profiler::GetSnapshotStatistics() const
+{
+	return { m_SnapshotsCount, std::chrono::microseconds{ m_SnapshotsBuildTime }, std::chrono::microseconds{ m_LastSnapshotBuildTime } };
 }
 
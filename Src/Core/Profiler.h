@@ -16,17 +16,32 @@ namespace FSecure::C3::Core
 			json m_StartupCmd;													///< Build startup command
 		};
 
-		// An std::vector-based container used by Profiler to manage its sub-types.
+		// An std::vector-based container used by Profiler to manage its sub-types. Elements are indexed by their IDs, order of insertion is preserved.
 		template<typename Element>
 		struct Manager
 		{
 			/// Finds Element specified by ID.
 			/// @param id ID of the Element to find.
 			/// @return Element object if existed, otherwise null.
+			/// Returned Element is assumed to be modified, so its cached Profile snapshot is discarded.
 			Element* Find(typename Element::Id const& id)
 			{
-				auto it = FindElementIterator(id);
-				return it == m_Elements.end() ? nullptr : &*it;
+				auto it = m_Index.find(id);
+				if (it == m_Index.end())
+					return nullptr;
+
+				auto& element = m_Elements[it->second];
+				element.InvalidateProfileSnapshot();
+				return &element;
+			}
+
+			/// Finds Element specified by ID for read-only access.
+			/// @param id ID of the Element to find.
+			/// @return Element object if existed, otherwise null.
+			Element const* Find(typename Element::Id const& id) const
+			{
+				auto it = m_Index.find(id);
+				return it == m_Index.end() ? nullptr : &m_Elements[it->second];
 			}
 
 			/// Adds a new Element.
@@ -36,10 +51,12 @@ namespace FSecure::C3::Core
 			/// @throw std::invalid_argument if specified ID is already in use.
 			Element* Add(typename Element::Id id, Element const& element)
 			{
-				if (FindElementIterator(id) != m_Elements.end())
+				if (m_Index.find(id) != m_Index.end())
 					throw std::invalid_argument{ OBF("Element with specified ID already exists.") };
 
 				m_Elements.push_back(std::move(element));
+				m_Index.emplace(id, m_Elements.size() - 1);
+				m_Elements.back().InvalidateProfileSnapshot();
 				return &m_Elements.back();
 			}
 
@@ -48,9 +65,7 @@ namespace FSecure::C3::Core
 			/// @throw std::invalid_argument on an attempt of removal of a non-existent Element.
 			void Remove(typename Element::Id id)
 			{
-				if (auto it = FindElementIterator(id); it != m_Elements.end())
-					m_Elements.erase(it);
-				else
+				if (!TryRemove(id))
 					throw std::invalid_argument{ OBF("Attempt of removing Element that doesn't exist.") };
 			}
 
@@ -60,6 +75,8 @@ namespace FSecure::C3::Core
 			void RemoveIf(Predicate predicate)
 			{
 				m_Elements.erase(std::remove_if(begin(m_Elements), end(m_Elements), predicate), end(m_Elements));
+				m_Index.clear();
+				Reindex(0);
 			}
 
 
@@ -67,22 +84,24 @@ namespace FSecure::C3::Core
 			/// @param id ID of the Element to remove.
 			bool TryRemove(typename Element::Id id)
 			{
-				if (auto it = FindElementIterator(id); it != m_Elements.end())
-				{
-					m_Elements.erase(it);
-					return true;
-				}
-				else
+				auto it = m_Index.find(id);
+				if (it == m_Index.end())
 					return false;
+
+				auto position = it->second;
+				m_Index.erase(it);
+				m_Elements.erase(m_Elements.begin() + position);
+				Reindex(position);
+				return true;
 			}
 
-			/// Dumps container contents to JSON format.
+			/// Dumps container contents to JSON format. Only Elements modified since the previous call are serialized again.
 			/// @return Container description in JSON format.
 			virtual json CreateProfileSnapshot() const
 			{
 				auto profile = json::array();
 				for (auto& element : m_Elements)
-					profile += element.CreateProfileSnapshot();
+					profile += *element.GetCachedProfileSnapshot();
 
 				return profile;
 			}
@@ -91,6 +110,7 @@ namespace FSecure::C3::Core
 			void Clear() noexcept
 			{
 				m_Elements.clear();
+				m_Index.clear();
 			}
 
 			// TODO remove this method
@@ -100,22 +120,37 @@ namespace FSecure::C3::Core
 			}
 
 			// TODO remove this method
+			/// All Elements are assumed to be modified, so their cached Profile snapshots are discarded. Use the const overload for read-only access.
+			/// Elements' IDs must not be changed through the returned container.
 			auto& GetUnderlyingContainer() noexcept
 			{
+				for (auto& element : m_Elements)
+					element.InvalidateProfileSnapshot();
+
 				return m_Elements;
 			}
 
-		protected:
-			/// Finds Element iterator specified by ID.
-			/// @param id ID of the Element to find.
-			/// @return Element iterator if existed, otherwise null.
-			typename std::vector<Element>::iterator FindElementIterator(typename Element::Id const& id)
+		private:
+			/// Hash functor for all ID types used by Profiler elements.
+			struct IdHash
 			{
-				return std::find_if(m_Elements.begin(), m_Elements.end(), [&id](Element const& element) { return id == element.m_Id; });
+				template<typename Id>
+				size_t operator()(Id const& id) const noexcept
+				{
+					return std::hash<Id>{}(id);
+				}
+			};
+
+			/// Updates positions stored in the index after Elements were moved inside of the vector.
+			/// @param from position of the first moved Element.
+			void Reindex(size_t from)
+			{
+				for (auto i = from; i < m_Elements.size(); ++i)
+					m_Index[m_Elements[i].m_Id] = i;
 			}
 
-		private:
 			std::vector<Element> m_Elements;																			///< Elements Container.
+			std::unordered_map<typename Element::Id, size_t, IdHash> m_Index;											///< Positions of Elements in m_Elements, indexed by Elements' IDs.
 		};
 
 		/// Basic class of a remote C3 Network elements.
@@ -136,8 +171,24 @@ namespace FSecure::C3::Core
 			/// @param commandWithArguments whole Command in binary format.
 			virtual void RunCommand(ByteView commandWithArguments) = 0;
 
+			/// Gets Profile snapshot, serializing the element only if it was modified since the previous call.
+			/// @return Network Profile in JSON format. Returned object is never modified, modification of the element creates a new one.
+			std::shared_ptr<const json> GetCachedProfileSnapshot() const;
+
+			/// Discards cached Profile snapshot and moves Profile version. Called whenever element is accessed for modification.
+			void InvalidateProfileSnapshot() const noexcept { m_CachedSnapshot.reset(); s_ProfileVersion.fetch_add(1, std::memory_order_relaxed); }
+
 			std::string m_ErrorState;																					///< A message like "BuildId collision" or empty if working correctly.
 			std::weak_ptr<Profiler> m_Owner;																			///< Owner Profiler.
+
+		protected:
+			/// Checks if cached Profile snapshot still describes the element. Override for elements which depend on time or on objects outside of the Profiler.
+			/// @param cachedSnapshot previous result of CreateProfileSnapshot.
+			/// @return true if cachedSnapshot can be reused.
+			virtual bool IsCachedProfileSnapshotValid(json const& cachedSnapshot) const { return true; }
+
+		private:
+			mutable std::shared_ptr<const json> m_CachedSnapshot;														///< Result of the last CreateProfileSnapshot call, if element was not modified since.
 		};
 
 		/// Virtual image of Device.
@@ -165,6 +216,8 @@ namespace FSecure::C3::Core
 			HashT m_TypeHash;																							///< Type name hash of the Device.
 			json m_StartupArguments;																					///< Device's startup arguments
 			std::pair<std::chrono::milliseconds, std::chrono::milliseconds> m_Jitter;									///< Current jitter pm device
+			bool m_IsJitterAdaptive = false;																			///< True if update delay follows the traffic.
+			std::chrono::milliseconds m_ResponseWindow{};																///< Time after a send during which Device is updated at minimal delay.
 		};
 
 		/// Virtual image of Device.
@@ -186,6 +239,7 @@ namespace FSecure::C3::Core
 
 			bool m_IsReturnChannel;
 			bool m_IsNegotiationChannel;
+			std::optional<DeviceBridge::LinkQuality> m_LinkQuality;														///< Quality of the link to the neighbour, as last reported by the Relay. Carried by all Routes going out through the Channel.
 		};
 
 		/// Forward declaration.
@@ -267,7 +321,7 @@ namespace FSecure::C3::Core
 			/// @param newDeviceId - newly created (negotiated) device
 			/// @param newInputId - negotiated InputId
 			/// @param newOutputId - negotiated OutputId
-			void UpdateFromNegotiationChannel(DeviceId negotiationDid, DeviceId newDeviceId, std::string newInputId, std::string newOutputId);
+			void UpdateFromNegotiationChannel(DeviceId negotiationDid, DeviceId newDeviceId, std::string_view newInputId, std::string_view newOutputId);
 
 			/// Add new route
 			/// @param receivingRid - Destination receiving route id
@@ -279,6 +333,16 @@ namespace FSecure::C3::Core
 			/// @param rid - route to remove
 			void ReRemoveRoute(RouteId rid);
 
+			/// Apply many route modifications with a single pass over the route container. Removals are applied before additions.
+			/// @param removedChannels - channels, whose all routes are removed
+			/// @param addedRoutes - receiving route id, outgoing channel and neighbour flag of each route to add
+			/// @throw std::invalid_argument if an added route is already in use. Routes are left unchanged then.
+			void ReApplyRoutes(std::vector<DeviceId> const& removedChannels, std::vector<std::tuple<RouteId, DeviceId, bool>> const& addedRoutes = {});
+
+			/// Drops Agents that GateRelay admitted for S2G packets, because a removed Route or a changed GRC might have disconnected them.
+			/// Doesn't take Profiler's lock, so it can be called while the Profile is modified.
+			void InvalidateConnectedAgents() const;
+
 			Manager<Route> m_Routes;																					///< Container for Routes.
 			Manager<Channel> m_Channels;																				///< Container for Channels.
 			Manager<Device> m_Peripherals;																				///< Container for Peripherals.
@@ -295,10 +359,11 @@ namespace FSecure::C3::Core
 			/// @param agentId dynamic ID of the Relay.
 			/// @param buildId Build identifier.
 			/// @param encryptionKey asymmetric public key used to encrypt all outgoing transmission.
+			/// @param sharedKey key precomputed from encryptionKey and Gateway's private key.
 			/// @param isBanned flag indicating whether Agent should be added to the black-list.
 			/// @param lastSeen timestamp when agent was last seen (responded)
 			/// @param hostInfo agent's host information
-			Agent(std::weak_ptr<Profiler> owner, AgentId agentId, BuildId buildId, FSecure::Crypto::PublicKey encryptionKey, bool isBanned, int32_t lastSeen, bool isX64, HostInfo hostInfo);
+			Agent(std::weak_ptr<Profiler> owner, AgentId agentId, BuildId buildId, FSecure::Crypto::PublicKey encryptionKey, FSecure::Crypto::SharedKey sharedKey, bool isBanned, int32_t lastSeen, bool isX64, HostInfo hostInfo);
 
 			/// Destructor
 			virtual ~Agent() = default;
@@ -334,6 +399,11 @@ namespace FSecure::C3::Core
 			/// @returns a pointer to newly created peripheral
 			Device* ReAddPeripheral(Device::Id did, HashT typeNameHash) override;
 
+			/// Resends full AddDevice Command of a Device whose arguments were sent by hash, but are not cached by the Relay anymore.
+			/// @param deviceId identifier of the Device.
+			/// @throws std::runtime_error if Command was not sent by hash or Agent can't be reached.
+			void ResendUncachedDevice(DeviceId deviceId);
+
 			/// Add scheduled device parameters
 			/// @param deviceId - scheduled device Id
 			/// @param command - scheduled device command
@@ -343,13 +413,28 @@ namespace FSecure::C3::Core
 			/// @returns return channel or nullptr
 			Channel* FindGrc();
 
+			/// Checks if Agent responded recently.
+			/// @returns true if Agent was seen in last 5 minutes.
+			bool IsActive() const;
+
 			FSecure::Crypto::PublicKey m_EncryptionKey;																		///< Agent's public key.
+			FSecure::Crypto::SharedKey m_SharedKey;																			///< Key shared with Gateway, used to encrypt all outgoing transmission without repeating the key exchange.
 			HostInfo m_HostInfo;																						///< Agent's Host information
+			std::optional<ResourceUsage> m_ResourceUsage;															///< Resources used by Agent's process, as last reported.
 			bool m_IsBanned;																							///< Is Agent black-listed?
 			bool m_IsX64;
 
+		protected:
+			/// Cached snapshot is outdated if Agent became inactive.
+			bool IsCachedProfileSnapshotValid(json const& cachedSnapshot) const override;
+
 		private:
+			/// Creation arguments of at least this size are sent by hash if Agent received them before. Should not be lower than NodeRelay's cache threshold.
+			static constexpr std::size_t s_MinCachedArgumentsSize = 4 * 1024;
+
 			std::unordered_map<DeviceId::UnderlyingIntegerType, json> m_ScheduledDevices;
+			std::unordered_set<std::string> m_SentArgumentsHashes;														///< Hashes of large creation arguments already sent to Agent in full. Agent is likely to have them cached.
+			std::unordered_map<DeviceId::UnderlyingIntegerType, ByteVector> m_UncachedDeviceCommands;					///< Full AddDevice Commands of Devices created by hash, kept until Device is added.
 		};
 
 		/// Virtual image of Gateway.
@@ -376,6 +461,13 @@ namespace FSecure::C3::Core
 			/// @param hostInfo - new agnet's host information
 			Agent* ReAddAgent(AgentId agentId, BuildId buildId, FSecure::Crypto::PublicKey encryptionKey, bool isBanned, int32_t lastSeen, HostInfo hostInfo);
 
+			/// Passes banned Agents to GateRelay, so that packets are filtered without taking Profiler's lock. Called whenever Agents are added or removed.
+			void UpdateBannedAgents();
+
+			/// Chooses Routes to Agents reachable through more than one, measuring every Route hop by hop with link qualities reported by Relays. Recommended Routes are added to the Profile.
+			/// Passes the choice to GateRelay if GateRelay::RoutePreference is set. Called whenever link qualities are reported.
+			void UpdatePreferredRoutes();
+
 			/// Reprofile: Add remote agent (agent not neigbouring with gateway)
 			/// @param agentId - new agent Id
 			/// @param buildId - new agents' build Id
@@ -386,6 +478,19 @@ namespace FSecure::C3::Core
 			/// @param hostInfo - new agnet's host information
 			Agent* ReAddRemoteAgent(RouteId childRouteId, BuildId buildId, FSecure::Crypto::PublicKey encryptionKey, RouteId ridOfConectionPlace, HashT childGrcHash, int32_t lastSeen, HostInfo hostInfo);
 
+			/// Reprofile: Add routes to agent on every relay between gateway and the connection place
+			/// @param childRouteId - route id of agent
+			/// @param ridOfConectionPlace - relay and its device the agent is connected to. Gateway's own id if agent is a neighbour of gateway
+			void ReAddRemoteRoute(RouteId childRouteId, RouteId ridOfConectionPlace);
+
+			/// Reprofile: Agent that holds a resumption token rejoined the network
+			/// @param agentRouteId - route id of agent
+			/// @param buildId - agent's build Id
+			/// @param ridOfConectionPlace - relay and its device the agent is connected to. Gateway's own id if agent is a neighbour of gateway
+			/// @param grcHash - type name hash of agent's return channel
+			/// @returns agent or nullptr if agent is unknown, banned or of another build
+			Agent* ReResumeAgent(RouteId agentRouteId, BuildId buildId, RouteId ridOfConectionPlace, HashT grcHash);
+
 			/// Find an agent directly connected to relay through given channel
 			/// @param relay - relay whose neighbour to find
 			/// @param did - device id through which the agent is connected
@@ -398,16 +503,60 @@ namespace FSecure::C3::Core
 			/// @param properties - build properties
 			void AddAgentBuild(BuildId bid, BuildProperties properties);
 
+			/// Check if build was issued by this Gateway. Gateways sharing the network key receive each other's Agents, but only the issuer of Agent's build tracks it.
+			/// @param bid - build Id
+			/// @returns true if build is known
+			bool HasAgentBuild(BuildId bid) const;
+
 			/// Get a list of all agents on the path from agent to gateway
 			/// @param agent - starting point of the path
 			/// @returns list of agents on path from agent to gateway
 			/// @throws std::runtime_error if any agent on the path doesn't have a gateway return channel
 			std::vector<Agent*> GetPathFromAgent(Agent* agent);
 
+			/// Finds Agent, bringing it back from the archive if needed.
+			/// @param agentId ID of the Agent to find.
+			/// @return Agent object if existed, otherwise null.
+			Agent* FindAgent(AgentId agentId);
+
+			/// Moves Agents not seen for s_AgentArchivalAge from m_Agents to the archive, so that they are no longer serialized and scanned. Does nothing if s_AgentArchivalInterval hasn't passed since the last call.
+			void ArchiveStaleAgents();
+
+			/// Brings back archived Agent, together with archived Agents having routes to it. Restored Agents are treated as seen now.
+			/// @param agentId ID of the Agent to restore.
+			/// @return false if Agent is not archived.
+			bool UnarchiveAgent(AgentId agentId);
+
+			/// Recreates Agent from its Profile.
+			/// @param relay Agent's Profile, as created by Agent::CreateProfileSnapshot.
+			/// @return restored Agent.
+			Agent* RestoreAgent(json const& relay);
+
 			/// Dumps current Profile to JSON.
 			/// @return Network Profile in JSON format.
 			json CreateProfileSnapshot() const override;
 
+			/// Parts of the Gateway Profile that can be turned into JSON after the Profile lock is released.
+			struct SnapshotView
+			{
+				/// Assembles full Profile.
+				/// @return Network Profile in JSON format. @see Gateway::CreateProfileSnapshot.
+				json ToJson() const;
+
+				json m_Gateway;																							///< Gateway's own part of the Profile.
+				std::vector<std::shared_ptr<const json>> m_Relays;													///< Immutable snapshots of Agents.
+			};
+
+			/// Captures Profile state. Only Gateway's own elements are copied, Agents are referenced by their immutable snapshots.
+			/// Agents modified since the previous snapshot are serialized in parallel.
+			/// @return view of the Profile.
+			SnapshotView CreateSnapshotView() const;
+
+			/// Captures Profiles of an Agent and of all Agents reached through it. Gateway's part holds only identifiers. @see CreateSnapshotView.
+			/// @param agentId root of the subtree.
+			/// @return view of the subtree. Has no Agents if the root is not known.
+			SnapshotView CreateSubtreeSnapshotView(AgentId agentId) const;
+
 			/// Adds a default 'create' property
 			/// @param interface - json definition of interface
 			static void EnsureCreateExists(json& interface);
@@ -417,9 +566,13 @@ namespace FSecure::C3::Core
 			/// @param isDevice - whether interfce is a device (channel/peripheral) or not (connstors)
 			static void AddBuildInCommands(json& interface, bool isDevice);
 
-			/// Get JSON representing available Commands.
+			/// Get JSON representing available Commands. Built on the first call and rebuilt only if set of registered Interfaces has changed since.
 			/// @return Network's Capability in JSON format.
-			json GetCapability();
+			json const& GetCapability();
+
+			/// Get Capability dumped to string. Cached together with the JSON, so that Controller reconnects don't serialize it again.
+			/// @return Network's Capability in JSON text.
+			std::string const& GetDumpedCapability();
 
 			/// Performs C3 Command on itself.
 			/// @param commandWithArguments whole Command in binary format.
@@ -434,6 +587,13 @@ namespace FSecure::C3::Core
 			std::weak_ptr<GateRelay> m_Gateway;																			///< The "physical" Gateway.
 			Manager<Agent> m_Agents;																					///< Table of Agents.
 			std::map<BuildId, BuildProperties> m_AgentBuilds;															///< Known agent builds
+			std::unordered_map<AgentId, std::string> m_ArchivedAgents;													///< Archived Agents' Profiles by Agent ID. Profiles are compressed with EncodeSnapshot and encoded in Base64.
+
+			/// Agents not seen for that long are archived.
+			static constexpr std::chrono::hours s_AgentArchivalAge{ 24 * 7 };
+
+			/// ArchiveStaleAgents runs at most that often.
+			static constexpr std::chrono::minutes s_AgentArchivalInterval{ 1 };
 
 			/// Virtual image of Connector.
 			struct Connector : ProfileElement
@@ -459,6 +619,10 @@ namespace FSecure::C3::Core
 				Id m_Id;																								///< Hash of the name of the Connector.
 				std::weak_ptr<ConnectorBridge> m_Connector;																///< Pointer to the Connector object.
 				json m_StartupArguments;
+
+			protected:
+				/// Connector error status is read from the Connector object, so snapshot is never reused.
+				bool IsCachedProfileSnapshotValid(json const& cachedSnapshot) const override { return false; }
 			};
 
 			/// Performs a create command (create new device)
@@ -474,6 +638,9 @@ namespace FSecure::C3::Core
 			};
 
 			std::vector<CreateCommand> m_CreateCommands;
+			std::optional<json> m_Capability;																			///< Capability built by GetCapability.
+			std::optional<std::string> m_DumpedCapability;																///< m_Capability dumped to string.
+			std::size_t m_CapabilityRevision = 0;																		///< InterfaceFactory revision m_Capability was built from.
 			Manager<Connector> m_Connectors;																			///< Container for Connectors.
 
 			/// Reprofile - Turn off connector
@@ -498,7 +665,7 @@ namespace FSecure::C3::Core
 
 			/// Find a (parent) agent directly connected through (child) agent's return channel
 			/// @param agent - child agent
-			/// @returns agent directly connected through gateway return channel
+			/// @returns agent directly connected through gateway return channel or nullptr if child is connected directly to the Gateway
 			Agent* FindGatewaySideAgent(Agent* agent);
 
 			/// Check if connection to agent exists
@@ -512,18 +679,84 @@ namespace FSecure::C3::Core
 
 			/// Reset profile state - remove all elements
 			void Reset();
+
+		private:
+			/// Checks if relay has a neighbour route to the agent through agent's return channel.
+			/// @param relay - possible parent of the agent
+			/// @param routeToAgent - agent's ID and its gateway return channel ID
+			/// @returns true if relay is the parent of the agent
+			static bool IsGatewaySideOf(Relay const& relay, RouteId routeToAgent);
+
+			/// Cost of a Route to an Agent, summed over its hops.
+			struct RouteMetrics
+			{
+				RouteId m_RouteId;																						///< Measured Route.
+				float m_LatencyMs = 0;																					///< Sum of round-trip times of hops, each divided by the chance of getting through. Hops not measured yet count as s_UnmeasuredLinkLatencyMs.
+				std::uint64_t m_Throughput = std::numeric_limits<std::uint64_t>::max();									///< Bytes per second of the slowest hop. Zero if any hop is not measured yet.
+				std::uint32_t m_Hops = 0;																				///< Number of Channels the Route goes through.
+			};
+
+			/// Follows a Route from the Gateway to its Agent.
+			/// @param routeId Route to measure.
+			/// @return metrics of the Route, nothing if any hop of the Route is missing in the Profile.
+			std::optional<RouteMetrics> MeasureRoute(RouteId routeId);
+
+			/// Latency assumed for a hop whose Relay hasn't reported quality of the link yet.
+			static constexpr float s_UnmeasuredLinkLatencyMs = 30'000.f;
+
+			/// Loss rate is capped at this value, so that a link that lost all recent probes still has a finite latency.
+			static constexpr float s_MaxLinkLossRate = 0.9f;
+
+			std::unordered_map<AgentId::UnderlyingIntegerType, AgentId> m_GatewaySideAgents;							///< Parent-pointer index of agents paths. Entries are validated on use, so stale ones are harmless.
+			std::unordered_multimap<AgentId, AgentId> m_ArchivedRouteOwners;											///< IDs of archived Agents by IDs of Agents they have routes to. Entries of Agents no longer archived are harmless.
+			std::chrono::steady_clock::time_point m_LastArchival;													///< Time of the last ArchiveStaleAgents run.
+			json m_RouteRecommendations;																				///< Metrics of Routes to Agents with more than one Route, made by UpdatePreferredRoutes.
+		};
+
+		/// Coalesces last-seen timestamps of Agents, so that packets don't update the Profile one by one.
+		class LastSeenTracker
+		{
+		public:
+			/// Public ctor.
+			/// @param flushInterval minimal time between two updates of the Profile.
+			LastSeenTracker(std::chrono::milliseconds flushInterval);
+
+			/// Records that Agent was seen. Doesn't wait for the Profile lock and doesn't block other updates of known Agents.
+			/// @param agentId - last agent on the route (origin of the message)
+			/// @param timestamp - time of the message
+			void Update(AgentId agentId, int32_t timestamp);
+
+			/// Moves recorded timestamps to the Profile, if flush interval has elapsed.
+			/// @param gateway - Profile to update. Must be locked by the caller.
+			void Flush(Gateway& gateway);
+
+		private:
+			std::chrono::milliseconds m_FlushInterval;																	///< Minimal time between two flushes.
+			std::chrono::steady_clock::time_point m_LastFlush;															///< Time of the last flush. Guarded by the Profile lock.
+			std::shared_mutex m_SlotsMutex;																				///< Exclusive only when a slot for a new Agent is created.
+			std::unordered_map<AgentId::UnderlyingIntegerType, std::atomic<int32_t>> m_Slots;							///< Latest timestamp of each Agent that was not flushed yet, 0 if there is none.
 		};
 
 		/// Public ctor.
-		Profiler(std::filesystem::path snapshotPath);
+		/// @param snapshotPath path of the file used to store Profile between Gateway restarts.
+		/// @param lastSeenFlushInterval how often last-seen timestamps of Agents are written to the Profile.
+		/// @param reportDeviceMetrics whether traffic counters of Gateway's Channels are added to the Profile.
+		Profiler(std::filesystem::path snapshotPath, std::chrono::milliseconds lastSeenFlushInterval, bool reportDeviceMetrics = false);
 
+		/// Snapshot is restored in background, so that Gateway's Channels and API bridge don't wait for it. Controller's commands are handled once restoring is done.
 		/// @param gateway pointer to Gate Relay.
 		void Initialize(std::string name, std::shared_ptr<GateRelay> gateway);
 
 		/// Performs Actions parsed from provided packet.
+		/// Packet holds a single Action or an array of them. Actions of an array are applied in one pass, grouped by target Agent in order of arrival, and their commands are sent together, so that commands to one Agent are packed into one query and commands sharing a Channel into Multicasts.
 		/// @param actionsPacket packet to parse.
 		void HandleActionsPacket(ByteView actionsPacket);
 
+		/// Performs one Action on many targets. Command is translated once and sends to all targets are encrypted with the Network key in parallel.
+		/// @param bulkAction Action with "Command" and "targets" array. Each target has relayAgentId and optionally channelId, peripheralId or connectorId, like a single Action.
+		/// @return response listing targets that failed, with reasons.
+		json HandleBulkActionsPacket(json const& bulkAction);
+
 		/// NewBuild message handler
 		/// @param message - NewBuild message to process.
 		/// @returns json representation of NewBuild response
@@ -535,6 +768,16 @@ namespace FSecure::C3::Core
 		/// @throws nlohmann::basic_json::exception
 		static ByteVector TranslateCommand(json const& command);
 
+		/// Adds binary form of its Command to an Action.
+		/// @param action Action to translate.
+		/// @throws std::runtime_error if Command is missing.
+		static void TranslateAction(json& action);
+
+		/// Performs a translated Action on the Relay it is addressed to.
+		/// @param action Action with relayAgentId.
+		/// @throws std::runtime_error if relayAgentId is missing or unknown, or Action fails.
+		void RunAction(json const& action);
+
 		/// Translate arguments from JSON to binary representation
 		/// @param command - command in JSON format
 		/// @returns Binary representation of arguments [packed arguments]
@@ -555,7 +798,7 @@ namespace FSecure::C3::Core
 		/// @throws std::invalid_argument if type is not any of [int8, int16, int32, int64, uint8, uint16, uint32, uint64, float, boolean, string, ip, binary]
 		static ByteVector Translate(std::string const& type, json::value_type const& value);
 
-		/// Current Profile snapshot with synchronized access.
+		/// Current Profile snapshot with synchronized access. Topology lock is held exclusively, so no AgentProfile is used meanwhile.
 		struct Profile
 		{
 			/// Public ctor.
@@ -565,14 +808,52 @@ namespace FSecure::C3::Core
 			Gateway& m_Gateway;																							///< Gateway profile.
 
 		private:
-			std::unique_lock<std::mutex> m_Lock;																		///< Access lock.
-			static std::mutex m_Mutex;																					///< Lock object.
+			friend struct AgentProfile;
+
+			std::unique_lock<LockProfiling::Mutex<std::shared_mutex>> m_Lock;										///< Access lock.
+			static LockProfiling::Mutex<std::shared_mutex> m_Mutex;													///< Topology lock. Taken shared by AgentProfiles, exclusively by Profiles.
+		};
+
+		/// Synchronized access to a single Agent. Agents are guarded by a sharded table of mutexes, so traffic of different Agents doesn't contend.
+		/// Topology lock is held shared, so Agents are neither added nor removed meanwhile. Only the Agent may be accessed through it, the rest of the Profile requires Get().
+		/// Thread must not hold another AgentProfile or a Profile, otherwise it deadlocks.
+		struct AgentProfile
+		{
+			/// Public ctor.
+			/// @param gateway which profile is locked
+			/// @param agentId Agent to lock.
+			AgentProfile(Gateway& gateway, AgentId agentId);
+
+			/// Checks if Agent is tracked.
+			/// @return true if m_Agent is set.
+			explicit operator bool() const noexcept { return m_Agent; }
+
+			/// Member access operator.
+			/// @return locked Agent.
+			Agent* operator->() const noexcept { return m_Agent; }
+
+			Agent* m_Agent = nullptr;																				///< Locked Agent, null if Agent is not tracked.
+
+		private:
+			std::shared_lock<LockProfiling::Mutex<std::shared_mutex>> m_TopologyLock;								///< Shared lock of Profile::m_Mutex.
+			std::unique_lock<std::mutex> m_AgentLock;																///< Lock of the Agent's shard.
+			static std::array<std::mutex, 64> s_AgentMutexes;														///< Sharded table of Agent locks, indexed by hash of AgentId.
 		};
 
 		/// Profile getter.
 		/// @return Current Profile snapshot.
 		Profile Get();
 
+		/// Agent getter. Use for operations that touch only one Agent, as they don't wait for operations on other Agents.
+		/// @param agentId Agent to lock.
+		/// @return Agent with synchronized access. Empty if Agent is not tracked.
+		AgentProfile GetAgent(AgentId agentId);
+
+		/// Records that Agent was seen. Timestamps are written to the Profile periodically, when the snapshot is checked for updates.
+		/// @param agentId - last agent on the route (origin of the message)
+		/// @param timestamp - time of the message
+		void UpdateLastSeen(AgentId agentId, int32_t timestamp);
+
 		/// Maps peripheral type hash to connector type hash and other way around
 		/// @param id beacon hash
 		/// @returns binder id
@@ -587,7 +868,8 @@ namespace FSecure::C3::Core
 			SnapshotProxy(Profiler& profiler);
 
 			/// Check if new version of snapshot is available.
-			/// @param ob. Observer token. If observer is not registered function will always return true.
+			/// Snapshot is built only if Profile was modified or the last one is older than s_SnapshotRefreshInterval. Built snapshot is shared by all proxies.
+			/// There are no updates until snapshot is restored, so that partially restored Profile is neither sent nor stored.
 			/// @returns true if new snapshot is available.
 			bool CheckUpdates();
 
@@ -595,37 +877,118 @@ namespace FSecure::C3::Core
 			/// @return std::nullopt if snaphot hasn't change since the last call
 			json const& GetSnapshot() const;
 
+			/// Get changes introduced by the last successful CheckUpdates call.
+			/// @return JSON patch (RFC 6902) transforming previous snapshot into the current one. Null after the first CheckUpdates call.
+			json const& GetDelta() const;
+
+			/// Get snapshot version. Version is increased every time CheckUpdates returns true.
+			/// @return version of the current snapshot.
+			std::uint64_t GetVersion() const;
+
 		private:
 			/// Proxied profiler
 			Profiler& m_Profiler;
 
-			/// helper state variable
-			std::optional<size_t> m_PreviousHash;
-
 			/// Current snapshot
-			json m_CurrentSnapshot;
+			std::shared_ptr<const json> m_CurrentSnapshot;
+
+			/// Difference between previous and current snapshot
+			json m_Delta;
+
+			/// Version of the current snapshot
+			std::uint64_t m_Version = 0;
 		};
 
 		/// Create Snapshot proxy for this profiler
 		/// @returns snapshot proxy for this profiler
 		SnapshotProxy GetSnapshotProxy() { return SnapshotProxy(*this); }
 
+		/// Time spent building Profile snapshots by all SnapshotProxy objects.
+		struct SnapshotStatistics
+		{
+			std::uint64_t m_Count;																						///< Number of built snapshots.
+			std::chrono::microseconds m_Total;																			///< Total time of building.
+			std::chrono::microseconds m_Last;																			///< Time of building the last snapshot.
+		};
+
+		/// Gets snapshot building statistics. Can be called from any thread.
+		/// @return current statistics.
+		SnapshotStatistics GetSnapshotStatistics() const;
+
 	protected:
 		std::optional<Gateway> m_Gateway;																				///< The "virtual gateway object".
 
-		mutable std::mutex m_AccessMutex;																				///< Mutex for synchronization.
+		mutable LockProfiling::Mutex<> m_AccessMutex;																	///< Mutex for synchronization.
 
 		/// Contains hashes of binders. This allows to call: auto tsConnectorhash = GetBinderTo(hashBeacona);. First hash in pair is Peripheral hash and second one is corresponding Connector.
 		std::vector<std::pair<std::uint32_t, std::uint32_t>> m_BindersMappings;
 
+		LastSeenTracker m_LastSeenTracker;																				///< Pending last-seen timestamps.
+		const bool m_ReportDeviceMetrics;																				///< Add DeviceBridge::Metrics of Gateway's Channels to the Profile. Counters change all the time, so every snapshot refresh yields an update.
+		std::atomic<std::uint64_t> m_SnapshotsCount = 0;																///< Number of snapshots built by SnapshotProxy::CheckUpdates.
+		std::atomic<std::int64_t> m_SnapshotsBuildTime = 0;																///< Total time of building snapshots, in microseconds.
+		std::atomic<std::int64_t> m_LastSnapshotBuildTime = 0;															///< Time of building the last snapshot, in microseconds.
+
+		static std::atomic<std::uint64_t> s_ProfileVersion;																///< Incremented on every modification of the Profile.
+
+		/// Snapshots are rebuilt at least this often, even if Profile was not modified. Refreshes parts that depend on time or live counters, like Agents' activity and Channels' QoS statistics.
+		static constexpr std::chrono::seconds s_SnapshotRefreshInterval{ 2 };
+
+		std::mutex m_SharedSnapshotMutex;																				///< Guards the shared snapshot. Taken before the Profile lock.
+		std::shared_ptr<const json> m_SharedSnapshot;																	///< The last snapshot built by SnapshotProxy::CheckUpdates.
+		std::uint64_t m_SharedSnapshotVersion = 0;																		///< Profile version the shared snapshot was built at.
+		std::chrono::steady_clock::time_point m_SharedSnapshotBuiltAt;													///< Time of building the shared snapshot.
+
 		private:
+			/// Identifies snapshot file format.
+			static constexpr std::uint32_t s_SnapshotMagic = 0x53334300;
+
+			/// Identifies journal file format.
+			static constexpr std::uint32_t s_JournalMagic = 0x4A334300;
+
+			/// Journal is never compacted before reaching this size, so small profiles aren't rewritten on every change.
+			static constexpr std::size_t s_MinJournalCompactionSize = 64 * 1024;
+
 			/// Dump snapshot file in regular intervals
-			/// Creates a snapshot .tmp file and replaces previous snapshot file
+			/// Changes are appended to the journal. When journal grows larger than the snapshot, a new snapshot .tmp file replaces the previous snapshot file and journal is started over.
 			void DumpSnapshots();
 
 			/// Restore Gateway and profiler state from snapshot
 			void RestoreFromSnapshot();
 
+			/// Reads snapshot and applies journaled changes.
+			/// @return Profile in JSON format or null if there is no snapshot.
+			/// @throws std::runtime_error if snapshot file is damaged.
+			json LoadSnapshot() const;
+
+			/// Replaces snapshot file and starts a new journal.
+			/// @param snapshot Profile to store.
+			/// @throws std::runtime_error if files cannot be written.
+			void WriteSnapshot(json const& snapshot);
+
+			/// Appends a record to the journal.
+			/// @param delta JSON patch from the last stored Profile.
+			/// @throws std::runtime_error if journal cannot be written.
+			void AppendToJournal(json const& delta);
+
+			/// Gets path of the journal. It is placed next to the snapshot file.
+			/// @return journal path.
+			std::filesystem::path GetJournalPath() const;
+
+			/// Converts JSON to the compressed binary form used on disk.
+			/// @param snapshot JSON to encode.
+			/// @return Deflate compressed CBOR.
+			static ByteVector EncodeSnapshot(json const& snapshot);
+
+			/// Reverses EncodeSnapshot.
+			/// @param encoded Deflate compressed CBOR.
+			/// @return decoded JSON.
+			static json DecodeSnapshot(ByteView encoded);
+
 			std::filesystem::path m_SnapshotPath;																		///< Snapshot dump path
+			std::ofstream m_Journal;																					///< Journal of changes made since the snapshot was written. Used only by DumpSnapshots thread.
+			std::size_t m_JournalSize = 0;																				///< Bytes appended to the journal.
+			std::size_t m_SnapshotSize = 0;																				///< Size of the last written snapshot.
+			std::atomic<bool> m_IsRestored = false;																	///< Set once RestoreFromSnapshot has finished.
 	};
 }
@@ -1,18 +1,98 @@
 #include "StdAfx.h"
 #include "QualityOfService.h"
 #include "RouteId.h"
+#include "EventTracing.h"
+#include "AllocationTracking.h"
 #include "Common/FSecure/CppTools/ScopeGuard.h"
 
+namespace
+{
+	/// Appends unsigned integer encoded in 7-bit groups, least significant first, with the highest bit set on all bytes but the last.
+	/// @param buffer buffer to write to.
+	/// @param value value to write.
+	void WriteVarint(FSecure::ByteVector& buffer, uint64_t value)
+	{
+		for (; value >= 0x80; value >>= 7)
+			buffer.push_back(static_cast<uint8_t>(value | 0x80));
+
+		buffer.push_back(static_cast<uint8_t>(value));
+	}
+
+	/// Reads integer written by WriteVarint.
+	/// @param buffer buffer to read from. Read bytes are removed from the view.
+	/// @param maxValue largest valid value.
+	/// @returns value or nothing if buffer ends too early or value is too big.
+	std::optional<uint64_t> ReadVarint(FSecure::ByteView& buffer, uint64_t maxValue)
+	{
+		uint64_t value = 0;
+		for (auto shift = 0u; !buffer.empty() && shift < 64; shift += 7)
+		{
+			auto byte = buffer[0];
+			buffer.remove_prefix(1);
+			value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+				return value <= maxValue ? std::optional<uint64_t>{ value } : std::nullopt;
+		}
+
+		return {};
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::QualityOfService::QualityOfService(Settings const& settings)
+	: m_Settings{ settings }
+{
+	m_Settings.m_ParityGroupSize = std::min(m_Settings.m_ParityGroupSize, s_MaxParityGroupSize);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint32_t FSecure::C3::QualityOfService::GetOutgouingPacketId(bool allowCutThrough /*= false*/)
+{
+	auto packetId = m_OutgouingPacketId++ & ~s_CutThroughPacketIdFlag;
+	return allowCutThrough ? packetId | s_CutThroughPacketIdFlag : packetId;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-uint32_t FSecure::C3::QualityOfService::GetOutgouingPacketId()
+void FSecure::C3::QualityOfService::DiscardPacket(uint32_t packetId)
 {
-	return m_OutgouingPacketId++;
+	MarkDelivered(packetId);
+	auto it = m_ReciveQueue.find(packetId);
+	if (it == m_ReciveQueue.end())
+		return;
+
+	if (it->second.IsReady())
+		m_ReadyPackets.erase(std::remove(m_ReadyPackets.begin(), m_ReadyPackets.end(), packetId), m_ReadyPackets.end());
+	else
+	{
+		m_IncompleteBytes -= it->second.GetExpectedSize();
+		--m_PendingPackets;
+	}
+
+	m_ReciveQueue.erase(it);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::QualityOfService::IsDelivered(uint32_t packetId) const
+{
+	return m_DeliveredPackets.Contains(packetId & ~s_CutThroughPacketIdFlag);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::QualityOfService::MarkDelivered(uint32_t packetId)
+{
+	m_DeliveredPackets.Insert(packetId & ~s_CutThroughPacketIdFlag);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::ByteVector FSecure::C3::QualityOfService::GetNextPacket()
 {
-	auto it = std::find_if(m_ReciveQueue.begin(), m_ReciveQueue.end(), [](auto& e) {return e.second.IsReady(); });
+	Core::EventTracing::Scope<Core::EventTracing::Keyword::QualityOfService> tracingScope{ "QualityOfService::GetNextPacket" };
+	Core::AllocationTracking::Scope allocationScope{ Core::AllocationTracking::Subsystem::QualityOfService };
+	if (m_ReadyPackets.empty())
+		return {};
+
+	auto it = m_ReciveQueue.find(m_ReadyPackets.front());
+	m_ReadyPackets.pop_front();
 	if (it == m_ReciveQueue.end())
 		return {};
 
@@ -21,53 +101,597 @@ FSecure::ByteVector FSecure::C3::QualityOfService::GetNextPacket()
 	return ret;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ByteView> FSecure::C3::QualityOfService::GetWholePacket(ByteView chunkWithHeader)
+{
+	if (!m_ReadyPackets.empty())
+		return {};
+
+	auto header = ReadHeader(chunkWithHeader);
+	if (!header || chunkWithHeader.empty() || header->m_ChunkId || header->m_ExpectedSize != chunkWithHeader.size() || m_ReciveQueue.count(header->m_PacketId) || IsDelivered(header->m_PacketId))
+		return {};
+
+	// Incomplete packets expire as if the chunk was pushed.
+	DropExpiredPackets(std::chrono::steady_clock::now());
+	MarkDelivered(header->m_PacketId);
+	return chunkWithHeader;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::QualityOfService::PushReceivedChunk(ByteView chunkWithHeader)
 {
-	if (chunkWithHeader.size() < QualityOfService::s_HeaderSize) // Data is to short to even be chunk of packet.
+	Core::EventTracing::Scope<Core::EventTracing::Keyword::QualityOfService> tracingScope{ "QualityOfService::PushReceivedChunk", chunkWithHeader.size() };
+	Core::AllocationTracking::Scope allocationScope{ Core::AllocationTracking::Subsystem::QualityOfService };
+	auto header = ReadHeader(chunkWithHeader);
+	if (!header) // Data is to short to even be chunk of packet.
 		return; // skip this chunk. there is nothing that can be done with it. If sender knows it pushed chunk to short it will retransmit it.
 
-	auto [mId, cId, expectedSize] = chunkWithHeader.Read<uint32_t, uint32_t, uint32_t>();
-	PushReceivedChunk(mId, cId, expectedSize, chunkWithHeader);
+	// Copies of delivered packets are dropped before anything is allocated for them.
+	if (IsDelivered(header->m_PacketId))
+	{
+		++m_DuplicateChunks;
+		return;
+	}
+
+	// Parity chunks carry size of the packet, so that they can be stored even if the first chunk is lost.
+	if (!header->m_ExpectedSize && (header->m_ChunkId & s_ParityChunkIdFlag) && chunkWithHeader.size() >= s_ParityFieldsSize)
+		header->m_ExpectedSize = ByteView{ chunkWithHeader }.Read<uint32_t>();
+
+	if (header->m_ExpectedSize)
+		return PushReceivedChunk(header->m_PacketId, header->m_ChunkId, *header->m_ExpectedSize, chunkWithHeader);
+
+	// Compact header of a chunk that is not the first one. Size is known only if the first chunk already arrived.
+	auto now = std::chrono::steady_clock::now();
+	DropExpiredPackets(now);
+	if (auto it = m_ReciveQueue.find(header->m_PacketId); it != m_ReciveQueue.end())
+	{
+		it->second.m_LastUpdate = now;
+		return PushToPacket(it, header->m_ChunkId, chunkWithHeader);
+	}
+
+	PushEarlyChunk(header->m_PacketId, header->m_ChunkId, chunkWithHeader);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::QualityOfService::PushReceivedChunk(uint32_t packetId, uint32_t chunkId, uint32_t expectedSize, ByteView chunk)
 {
+	if (IsDelivered(packetId))
+	{
+		++m_DuplicateChunks;
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	DropExpiredPackets(now);
+
 	auto it = m_ReciveQueue.find(packetId);
 	if (it == m_ReciveQueue.end())
-		m_ReciveQueue.emplace(packetId, Packet{ chunkId, expectedSize, ByteVector{ chunk } });
+	{
+		if (!ReserveIncompleteBytes(expectedSize))
+		{
+			++m_RejectedChunks;
+			return;
+		}
+
+		it = m_ReciveQueue.emplace(packetId, Packet{ expectedSize }).first;
+		++m_PendingPackets;
+	}
+
+	it->second.m_LastUpdate = now;
+	if (it->second.GetExpectedSize() != expectedSize)
+	{
+		++m_RejectedChunks;
+		return;
+	}
+
+	PushToPacket(it, chunkId, chunk);
+
+	// Size of the packet is known now, so chunks that came before the first one can be stored.
+	if (auto early = m_EarlyChunks.find(packetId); early != m_EarlyChunks.end())
+	{
+		auto earlyChunks = std::move(early->second);
+		m_EarlyBytes -= earlyChunks.m_Size;
+		m_EarlyChunks.erase(early);
+		for (auto&& [earlyChunkId, earlyChunk] : earlyChunks.m_Chunks)
+			PushToPacket(it, earlyChunkId, earlyChunk);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::QualityOfService::PushToPacket(std::map<uint32_t, Packet>::iterator it, uint32_t chunkId, ByteView chunk)
+{
+	if (chunkId & s_ParityChunkIdFlag)
+	{
+		chunkId &= ~s_ParityChunkIdFlag;
+		if (it->second.IsReady() || !it->second.PushParity(chunkId, chunk))
+			return;
+	}
+	else switch (it->second.PushNextChunk(chunkId, it->second.GetExpectedSize(), chunk))
+	{
+	case Packet::PushResult::Completed:
+		m_IncompleteBytes -= it->second.GetExpectedSize();
+		--m_PendingPackets;
+		m_ReadyPackets.push_back(it->first);
+		MarkDelivered(it->first);
+		return;
+	case Packet::PushResult::Malformed:
+		++m_RejectedChunks;
+		return;
+	case Packet::PushResult::Ignored:
+		return;
+	default:
+		break;
+	}
+
+	// Rebuilt chunk is pushed as if it was received.
+	if (auto recovered = it->second.RecoverChunk(chunkId))
+	{
+		++m_RecoveredChunks;
+		PushToPacket(it, recovered->first, recovered->second);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::QualityOfService::PushEarlyChunk(uint32_t packetId, uint32_t chunkId, ByteView chunk)
+{
+	if (m_EarlyBytes + chunk.size() > m_Settings.m_IncompleteBytesLimit)
+	{
+		++m_RejectedChunks;
+		return;
+	}
+
+	auto& early = m_EarlyChunks[packetId];
+	early.m_LastUpdate = std::chrono::steady_clock::now();
+	if (!early.m_Chunks.emplace(chunkId, ByteVector{ chunk }).second)
+		return; // Duplicate, e.g. original chunk arrived after it was retransmitted.
+
+	early.m_Size += chunk.size();
+	m_EarlyBytes += chunk.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::C3::QualityOfService::ChunkHeader> FSecure::C3::QualityOfService::ReadHeader(ByteView& chunkWithHeader) const
+{
+	if (!m_Settings.m_CompactHeaders)
+	{
+		if (chunkWithHeader.size() < QualityOfService::s_HeaderSize)
+			return {};
+
+		auto [packetId, chunkId, expectedSize] = chunkWithHeader.Read<uint32_t, uint32_t, uint32_t>();
+		return ChunkHeader{ packetId, chunkId, expectedSize };
+	}
+
+	auto packetField = ReadVarint(chunkWithHeader, (uint64_t{ std::numeric_limits<uint32_t>::max() } << 1) | 1);
+	if (!packetField)
+		return {};
+
+	auto packetId = static_cast<uint32_t>(*packetField >> 1);
+	auto value = ReadVarint(chunkWithHeader, std::numeric_limits<uint32_t>::max());
+	if (!value)
+		return {};
+
+	if (*packetField & 1)
+		return ChunkHeader{ packetId, 0, static_cast<uint32_t>(*value) };
+
+	// Chunk 0 is always the first one. Such header marks retransmission requests.
+	if (!*value)
+		return {};
+
+	return ChunkHeader{ packetId, static_cast<uint32_t>(*value), std::nullopt };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::QualityOfService::WriteHeader(ByteVector& frame, uint32_t packetId, uint32_t chunkId, uint32_t expectedSize, bool compactHeaders)
+{
+	auto oldSize = frame.size();
+	if (!compactHeaders)
+		frame.Write(packetId, chunkId, expectedSize);
+	else if (!chunkId)
+	{
+		WriteVarint(frame, (uint64_t{ packetId } << 1) | 1);
+		WriteVarint(frame, expectedSize);
+	}
 	else
-		it->second.PushNextChunk(chunkId, expectedSize, ByteVector{ chunk });
+	{
+		WriteVarint(frame, uint64_t{ packetId } << 1);
+		WriteVarint(frame, chunkId);
+	}
+
+	return frame.size() - oldSize;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-FSecure::C3::QualityOfService::Packet::Packet(uint32_t chunkId, uint32_t expectedSize, ByteVector chunk)
-	: m_ExpectedSize(expectedSize)
+FSecure::ByteVector FSecure::C3::QualityOfService::CreateParityFrame(uint32_t packetId, uint32_t firstChunkId, uint32_t expectedSize, std::vector<ByteView> const& chunks, bool compactHeaders)
+{
+	size_t longest = 0;
+	uint32_t sizes = 0;
+	for (auto&& chunk : chunks)
+	{
+		longest = std::max(longest, chunk.size());
+		sizes ^= static_cast<uint32_t>(chunk.size());
+	}
+
+	auto frame = ByteVector{};
+	frame.reserve(s_HeaderSize + s_ParityFieldsSize + longest);
+	WriteHeader(frame, packetId, s_ParityChunkIdFlag | firstChunkId, expectedSize, compactHeaders);
+	frame.Write(expectedSize, static_cast<uint8_t>(chunks.size()), sizes);
+	auto parity = frame.size();
+	frame.resize(parity + longest);
+	for (auto&& chunk : chunks)
+		for (size_t i = 0; i < chunk.size(); ++i)
+			frame[parity + i] ^= chunk[i];
+
+	return frame;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::QualityOfService::Statistics FSecure::C3::QualityOfService::GetStatistics() const
+{
+	return { m_ExpiredPackets, m_EvictedPackets, m_RejectedChunks, m_DroppedBytes, 0, m_PendingPackets, m_RecoveredChunks, m_DuplicateChunks };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::QualityOfService::DropExpiredPackets(std::chrono::steady_clock::time_point now)
+{
+	if (now - m_LastExpiryCheck < 1s)
+		return;
+
+	m_LastExpiryCheck = now;
+	for (auto it = m_ReciveQueue.begin(); it != m_ReciveQueue.end();)
+		if (!it->second.IsReady() && now - it->second.m_LastUpdate > m_Settings.m_IncompletePacketTtl)
+		{
+			++m_ExpiredPackets;
+			it = DropPacket(it);
+		}
+		else
+			++it;
+
+	for (auto it = m_EarlyChunks.begin(); it != m_EarlyChunks.end();)
+		if (now - it->second.m_LastUpdate > m_Settings.m_IncompletePacketTtl)
+		{
+			++m_ExpiredPackets;
+			m_DroppedBytes += it->second.m_Size;
+			m_EarlyBytes -= it->second.m_Size;
+			it = m_EarlyChunks.erase(it);
+		}
+		else
+			++it;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::QualityOfService::ReserveIncompleteBytes(uint32_t expectedSize)
+{
+	if (expectedSize > m_Settings.m_IncompleteBytesLimit)
+		return false;
+
+	while (m_IncompleteBytes + expectedSize > m_Settings.m_IncompleteBytesLimit)
+	{
+		auto oldest = m_ReciveQueue.end();
+		for (auto it = m_ReciveQueue.begin(); it != m_ReciveQueue.end(); ++it)
+			if (!it->second.IsReady() && (oldest == m_ReciveQueue.end() || it->second.m_LastUpdate < oldest->second.m_LastUpdate))
+				oldest = it;
+
+		if (oldest == m_ReciveQueue.end()) // Should never happen, as m_IncompleteBytes counts only packets from the queue.
+			break;
+
+		++m_EvictedPackets;
+		DropPacket(oldest);
+	}
+
+	m_IncompleteBytes += expectedSize;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::map<uint32_t, FSecure::C3::QualityOfService::Packet>::iterator FSecure::C3::QualityOfService::DropPacket(std::map<uint32_t, Packet>::iterator it)
 {
+	m_DroppedBytes += it->second.GetReceivedSize();
+	m_IncompleteBytes -= it->second.GetExpectedSize();
+	--m_PendingPackets;
+	return m_ReciveQueue.erase(it);
+}
 
-	if (chunk.size() >= QualityOfService::s_MinBodySize || chunk.size() == expectedSize)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::C3::QualityOfService::MissingChunks> FSecure::C3::QualityOfService::CollectMissingChunks()
+{
+	std::vector<MissingChunks> ret;
+	auto now = std::chrono::steady_clock::now();
+	for (auto& [packetId, packet] : m_ReciveQueue)
 	{
-		m_Size += static_cast<uint32_t>(chunk.size());
-		m_Chunks.emplace(chunkId, std::move(chunk));
+		if (ret.size() == s_MaxRequestedPackets)
+			break;
+
+		if (packet.IsReady() || now - packet.m_LastUpdate < m_Settings.m_RetransmissionDelay || now - packet.m_LastRetransmissionRequest < m_Settings.m_RetransmissionDelay)
+			continue;
+
+		packet.m_LastRetransmissionRequest = now;
+		auto [chunkIds, firstTailChunkId] = packet.GetMissingChunks();
+		ret.push_back({ packetId, std::move(chunkIds), firstTailChunkId });
+	}
+
+	// First chunk of these packets is missing for sure, other gaps are requested as well.
+	for (auto& [packetId, early] : m_EarlyChunks)
+	{
+		if (ret.size() == s_MaxRequestedPackets)
+			break;
+
+		if (now - early.m_LastUpdate < m_Settings.m_RetransmissionDelay || now - early.m_LastRetransmissionRequest < m_Settings.m_RetransmissionDelay)
+			continue;
+
+		early.m_LastRetransmissionRequest = now;
+		std::vector<uint32_t> chunkIds;
+		auto chunkId = 0u;
+		for (auto&& e : early.m_Chunks)
+		{
+			for (; chunkId < e.first; ++chunkId)
+				chunkIds.push_back(chunkId);
+
+			chunkId = e.first + 1;
+		}
+
+		ret.push_back({ packetId, std::move(chunkIds), chunkId });
 	}
+
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::QualityOfService::Packet::PushNextChunk(uint32_t chunkId, uint32_t expectedSize, ByteVector chunk)
+FSecure::ByteVector FSecure::C3::QualityOfService::CreateRetransmissionRequest(std::vector<MissingChunks> const& missingChunks, bool compactHeaders /*= false*/)
+{
+	auto frameSize = s_HeaderSize;
+	for (auto&& e : missingChunks)
+		frameSize += ByteVector::Size(e.m_PacketId, e.m_FirstTailChunkId, e.m_ChunkIds);
+
+	auto frame = ByteVector{};
+	frame.reserve(frameSize);
+	if (compactHeaders)
+		frame.Write(uint8_t{ 0 }, uint8_t{ 0 });
+	else
+		frame.Write(uint32_t{ 0 }, s_RetransmissionRequestChunkId);
+
+	frame.Write(static_cast<uint32_t>(missingChunks.size()));
+	for (auto&& e : missingChunks)
+		frame.Write(e.m_PacketId, e.m_FirstTailChunkId, e.m_ChunkIds);
+
+	return frame;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::QualityOfService::IsRetransmissionRequest(ByteView frame, bool compactHeaders /*= false*/)
+{
+	if (compactHeaders)
+		return frame.size() >= 2 + sizeof(uint32_t) && !frame[0] && !frame[1];
+
+	return frame.size() >= s_HeaderSize && frame.SubString(s_PacketIdSize).Read<uint32_t>() == s_RetransmissionRequestChunkId;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::C3::QualityOfService::MissingChunks> FSecure::C3::QualityOfService::ParseRetransmissionRequest(ByteView frame, bool compactHeaders /*= false*/)
+{
+	if (!IsRetransmissionRequest(frame, compactHeaders))
+		throw std::runtime_error{ OBF("QoS error. Malformed retransmission request") };
+
+	frame.remove_prefix(compactHeaders ? 2 : s_PacketIdSize + s_ChunkIdSize);
+	auto count = frame.Read<uint32_t>();
+	if (count > s_MaxRequestedPackets)
+		throw std::runtime_error{ OBF("QoS error. Malformed retransmission request") };
+
+	std::vector<MissingChunks> ret;
+	for (auto i = 0u; i < count; ++i)
+	{
+		auto [packetId, firstTailChunkId, chunkIds] = frame.Read<uint32_t, uint32_t, std::vector<uint32_t>>();
+		ret.push_back({ packetId, std::move(chunkIds), firstTailChunkId });
+	}
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::QualityOfService::StoreSentPacket(uint32_t packetId, ByteView packet, std::vector<uint32_t> chunkOffsets)
+{
+	if (packet.size() > m_Settings.m_RetransmissionWindowBytes)
+		return;
+
+	while (m_RetransmissionWindowSize + packet.size() > m_Settings.m_RetransmissionWindowBytes)
+	{
+		m_RetransmissionWindowSize -= m_RetransmissionWindow.front().m_Data.size();
+		m_RetransmissionWindow.pop_front();
+	}
+
+	m_RetransmissionWindowSize += packet.size();
+	m_RetransmissionWindow.push_back({ packetId, ByteVector{ packet }, std::move(chunkOffsets) });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::ByteVector> FSecure::C3::QualityOfService::CreateRetransmissionFrames(MissingChunks const& missingChunks) const
+{
+	auto it = std::find_if(m_RetransmissionWindow.begin(), m_RetransmissionWindow.end(), [&](auto const& e) { return e.m_Id == missingChunks.m_PacketId; });
+	if (it == m_RetransmissionWindow.end())
+		return {};
+
+	auto createFrame = [&](uint32_t chunkId)
+	{
+		auto data = ByteView{ it->m_Data };
+		auto begin = it->m_ChunkOffsets[chunkId];
+		auto end = chunkId + 1 < it->m_ChunkOffsets.size() ? it->m_ChunkOffsets[chunkId + 1] : static_cast<uint32_t>(data.size());
+		auto frame = ByteVector{};
+		frame.reserve(s_HeaderSize + end - begin);
+		WriteHeader(frame, it->m_Id, chunkId, static_cast<uint32_t>(data.size()), m_Settings.m_CompactHeaders);
+		return frame.Concat(data.SubString(begin, end - begin));
+	};
+
+	std::vector<ByteVector> ret;
+	for (auto chunkId : missingChunks.m_ChunkIds)
+		if (chunkId < it->m_ChunkOffsets.size())
+			ret.push_back(createFrame(chunkId));
+
+	for (auto chunkId = missingChunks.m_FirstTailChunkId; chunkId < it->m_ChunkOffsets.size(); ++chunkId)
+		ret.push_back(createFrame(chunkId));
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::QualityOfService::ForgetSentPackets()
+{
+	m_RetransmissionWindow = {};
+	m_RetransmissionWindowSize = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::QualityOfService::DeliveredPackets::Contains(uint32_t packetId) const
+{
+	if (m_IsEmpty)
+		return false;
+
+	auto age = GetAge(packetId);
+	return age >= 0 && age < static_cast<int32_t>(s_DeliveredWindowSize) && m_Window[age];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::QualityOfService::DeliveredPackets::Insert(uint32_t packetId)
+{
+	auto age = GetAge(packetId);
+	if (m_IsEmpty || age >= static_cast<int32_t>(s_DeliveredWindowSize))
+	{
+		// Sender started a new sequence, or packet is too old to be told from one.
+		m_Window.reset();
+		m_Newest = packetId;
+		m_IsEmpty = false;
+		age = 0;
+	}
+	else if (age < 0)
+	{
+		// Bits shifted past the end of the window are forgotten. Shift by more than the window clears it.
+		m_Window <<= static_cast<size_t>(-age);
+		m_Newest = packetId;
+		age = 0;
+	}
+
+	m_Window.set(static_cast<size_t>(age));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t FSecure::C3::QualityOfService::DeliveredPackets::GetAge(uint32_t packetId) const
+{
+	// Ids have 31 bits. Moving the difference to the top bits makes it wrap around with them, shifting back keeps the sign.
+	return static_cast<int32_t>((m_Newest - packetId) << 1) >> 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::QualityOfService::Packet::Packet(uint32_t expectedSize)
+	: m_ExpectedSize(expectedSize)
+{
+	m_Data.resize(m_ExpectedSize);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::QualityOfService::Packet::PushResult FSecure::C3::QualityOfService::Packet::PushNextChunk(uint32_t chunkId, uint32_t expectedSize, ByteView chunk)
 {
 	if (expectedSize != m_ExpectedSize)
-		throw std::runtime_error{ OBF("QoS error. Received chunk of packet has wrong expected size") };
+		return PushResult::Malformed;
+
+	if (chunkId < m_NextChunkId || m_OutOfOrderChunks.count(chunkId))
+		return PushResult::Ignored; // Duplicate, e.g. original chunk arrived after it was retransmitted.
+
+	if (chunk.size() < QualityOfService::s_MinBodySize && m_Size + chunk.size() != m_ExpectedSize)
+		return PushResult::Ignored;
+
+	if (m_Size + chunk.size() > m_ExpectedSize)
+		return PushResult::Malformed;
+
+	m_Size += static_cast<uint32_t>(chunk.size());
+	if (chunkId == m_NextChunkId)
+		Store(chunk);
+	else
+		m_OutOfOrderChunks.emplace(chunkId, ByteVector{ chunk });
+
+	return IsReady() ? PushResult::Completed : PushResult::Stored;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::QualityOfService::Packet::Store(ByteView chunk)
+{
+	m_ChunkOffsets.push_back(m_Written);
+	memcpy(m_Data.data() + m_Written, chunk.data(), chunk.size());
+	m_Written += static_cast<uint32_t>(chunk.size());
+	++m_NextChunkId;
+
+	for (auto it = m_OutOfOrderChunks.begin(); it != m_OutOfOrderChunks.end() && it->first == m_NextChunkId; it = m_OutOfOrderChunks.erase(it))
+	{
+		m_ChunkOffsets.push_back(m_Written);
+		memcpy(m_Data.data() + m_Written, it->second.data(), it->second.size());
+		m_Written += static_cast<uint32_t>(it->second.size());
+		++m_NextChunkId;
+	}
+}
 
-	auto it = m_Chunks.find(chunkId);
-	if (it != m_Chunks.end())
-		throw std::runtime_error{ OBF("QoS error. Received chunk of packet was already set") };
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<FSecure::ByteView> FSecure::C3::QualityOfService::Packet::FindChunk(uint32_t chunkId) const
+{
+	if (chunkId < m_NextChunkId)
+	{
+		auto end = chunkId + 1 < m_NextChunkId ? m_ChunkOffsets[chunkId + 1] : m_Written;
+		return ByteView{ m_Data }.SubString(m_ChunkOffsets[chunkId], end - m_ChunkOffsets[chunkId]);
+	}
 
-	if (chunk.size() >= QualityOfService::s_MinBodySize || m_Size + chunk.size() == m_ExpectedSize)
+	if (auto it = m_OutOfOrderChunks.find(chunkId); it != m_OutOfOrderChunks.end())
+		return ByteView{ it->second };
+
+	return {};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::QualityOfService::Packet::PushParity(uint32_t firstChunkId, ByteView parity)
+{
+	if (parity.size() < s_ParityFieldsSize || parity.Read<uint32_t>() != m_ExpectedSize || !parity[0])
+		return false;
+
+	m_Parity.emplace(firstChunkId, ByteVector{ parity });
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<std::pair<uint32_t, FSecure::ByteVector>> FSecure::C3::QualityOfService::Packet::RecoverChunk(uint32_t chunkId)
+{
+	auto group = m_Parity.upper_bound(chunkId);
+	if (group == m_Parity.begin())
+		return {};
+
+	--group;
+	auto parity = ByteView{ group->second };
+	auto [count, size] = parity.Read<uint8_t, uint32_t>();
+	if (chunkId >= group->first + count)
+		return {};
+
+	// Size of the missing chunk is what is left of XOR of all sizes.
+	std::optional<uint32_t> missing;
+	std::vector<ByteView> chunks;
+	for (auto id = group->first; id < group->first + count; ++id)
+		if (auto chunk = FindChunk(id))
+		{
+			chunks.push_back(*chunk);
+			size ^= static_cast<uint32_t>(chunk->size());
+		}
+		else if (std::exchange(missing, id))
+			return {};
+
+	// Parity chunk is not needed any more if group is complete. It's too short if Channel accepted only a part of it.
+	if (!missing || size > parity.size())
 	{
-		m_Size += static_cast<uint32_t>(chunk.size());
-		m_Chunks.emplace(chunkId, std::move(chunk));
+		if (!missing)
+			m_Parity.erase(group);
+
+		return {};
 	}
+
+	auto recovered = ByteVector{ parity.SubString(0, size) };
+	for (auto&& chunk : chunks)
+		for (size_t i = 0; i < std::min<size_t>(chunk.size(), size); ++i)
+			recovered[i] ^= chunk[i];
+
+	m_Parity.erase(group);
+	return std::make_pair(*missing, std::move(recovered));
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -76,23 +700,27 @@ FSecure::ByteVector FSecure::C3::QualityOfService::Packet::Read()
 	if (!IsReady())
 		throw std::runtime_error{ OBF("QoS error. Packet is not ready") };
 
-	ByteVector ret;
-	ret.resize(m_ExpectedSize);
-	auto data = ret.data();
-	for (auto&& e : m_Chunks)
+	return std::move(m_Data);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::pair<std::vector<uint32_t>, uint32_t> FSecure::C3::QualityOfService::Packet::GetMissingChunks() const
+{
+	std::vector<uint32_t> missing;
+	auto chunkId = m_NextChunkId;
+	for (auto&& e : m_OutOfOrderChunks)
 	{
-		memcpy(data, e.second.data(), e.second.size());
-		data += e.second.size();
+		for (; chunkId < e.first; ++chunkId)
+			missing.push_back(chunkId);
+
+		chunkId = e.first + 1;
 	}
 
-	return ret;
+	return { std::move(missing), chunkId };
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-bool FSecure::C3::QualityOfService::Packet::IsReady()
+bool FSecure::C3::QualityOfService::Packet::IsReady() const
 {
-	if (m_Size > m_ExpectedSize)
-		throw std::runtime_error{ OBF("QoS error. Packet size is longer than expected, wrong chunks must been set.") };
-
-	return m_Size == m_ExpectedSize;
+	return m_Written == m_ExpectedSize;
 }
@@ -1,7 +1,10 @@
 #pragma once
 // TODO
 #include <map>
+#include <deque>
+#include <atomic>
 #include <functional>
+#include <bitset>
 #include "RouteId.h"
 
 namespace FSecure::C3
@@ -10,36 +13,96 @@ namespace FSecure::C3
 	class QualityOfService
 	{
 		/// Struct representing not merged packet.
+		/// Chunks are written directly into a buffer of expected size. Offset of a chunk is known only when all previous chunks arrived, so chunks received out of order are held aside until the gap is filled.
 		struct Packet
 		{
-			/// Constructor of packet.
-			/// @param chunkId handle order of chunks.
+			/// Constructor of packet. Allocates buffer for the whole packet.
 			/// @param expectedSize informs how long whole packet should be.
-			/// @param chunk fragment of packet.
-			Packet(uint32_t chunkId, uint32_t expectedSize, ByteVector chunk);
+			Packet(uint32_t expectedSize);
+
+			/// Outcome of PushNextChunk. Bad chunks are everyday events on lossy Channels, so they are reported without throwing.
+			enum class PushResult
+			{
+				Stored,																								///< Chunk was stored, packet is still incomplete.
+				Completed,																							///< Chunk was stored and packet became ready.
+				Ignored,																							///< Chunk was a duplicate or too short, e.g. original chunk arrived after it was retransmitted.
+				Malformed,																							///< Chunk doesn't match the packet, e.g. expected size of whole packet is different or packet would get too long.
+			};
 
 			/// Add next chunk.
 			/// @param chunkId handle order of chunks.
 			/// @param expectedSize informs how long whole packet should be.
 			/// @param chunk fragment of packet.
-			/// @throw QosException if expected size of whole packet is different for any of chunks.
-			void PushNextChunk(uint32_t chunkId, uint32_t expectedSize, ByteVector chunk);
+			/// @return whether chunk was stored and packet became ready.
+			PushResult PushNextChunk(uint32_t chunkId, uint32_t expectedSize, ByteView chunk);
 
-			/// Returns merged packet.
-			/// @throw QosException if called before packet was ready to be merged. Use IsReady() to check packet.
+			/// Returns merged packet. Buffer is moved out of the Packet.
+			/// @throw std::runtime_error if called before packet was ready to be merged. Use IsReady() to check packet.
 			ByteVector Read();
 
 			/// Informs that packet can be merged from chunks.
-			bool IsReady();
+			bool IsReady() const;
+
+			/// Add parity chunk of a group of chunks. @see CreateParityFrame.
+			/// @param firstChunkId id of the first chunk of the group.
+			/// @param parity parity chunk without QoS header.
+			/// @return false if parity chunk doesn't match the packet.
+			bool PushParity(uint32_t firstChunkId, ByteView parity);
+
+			/// Rebuilds the chunk missing from a parity group, if it's the only one missing.
+			/// @param chunkId id of any chunk of the group, or of its first chunk for the parity chunk.
+			/// @returns id and data of rebuilt chunk, or nothing if group has no parity chunk, or misses none or more than one chunk.
+			std::optional<std::pair<uint32_t, ByteVector>> RecoverChunk(uint32_t chunkId);
+
+			/// Gets size of the buffer allocated for the packet.
+			uint32_t GetExpectedSize() const { return m_ExpectedSize; }
+
+			/// Gets number of bytes received so far.
+			uint32_t GetReceivedSize() const { return m_Size; }
+
+			/// Lists chunks that are known to be missing.
+			/// @returns ids of chunks missing between received ones and id of the first chunk after the last received one.
+			std::pair<std::vector<uint32_t>, uint32_t> GetMissingChunks() const;
+
+			/// Time of the last chunk arrival.
+			std::chrono::steady_clock::time_point m_LastUpdate = std::chrono::steady_clock::now();
+
+			/// Time of the last retransmission request.
+			std::chrono::steady_clock::time_point m_LastRetransmissionRequest;
 
 		private:
-			/// Map of chunks
-			std::map<uint32_t, ByteVector> m_Chunks;
+			/// Copies chunk to the buffer and flushes out of order chunks that can follow it.
+			/// @param chunk fragment of packet with id equal to m_NextChunkId.
+			void Store(ByteView chunk);
+
+			/// Finds a received chunk.
+			/// @param chunkId id of the chunk.
+			/// @returns chunk data or nothing if chunk didn't arrive yet.
+			std::optional<ByteView> FindChunk(uint32_t chunkId) const;
+
+			/// Buffer for the whole packet.
+			ByteVector m_Data;
+
+			/// Chunks that arrived before one of their predecessors.
+			std::map<uint32_t, ByteVector> m_OutOfOrderChunks;
 
 			/// Expected size of packet.
 			const uint32_t m_ExpectedSize;
 
+			/// Number of bytes received, including out of order chunks.
 			uint32_t m_Size = 0;
+
+			/// Number of bytes written to m_Data.
+			uint32_t m_Written = 0;
+
+			/// Id of chunk that will be written at m_Written offset.
+			uint32_t m_NextChunkId = 0;
+
+			/// Offsets of chunks written to m_Data, by chunk id.
+			std::vector<uint32_t> m_ChunkOffsets;
+
+			/// Parity chunks of groups that are still incomplete, by id of the first chunk of the group.
+			std::map<uint32_t, ByteVector> m_Parity;
 		};
 
 		/// Used to mark order to outgoing packets.
@@ -49,6 +112,50 @@ namespace FSecure::C3
 		// removed, manual route table management means that channels should not wait for missing packets. It will be introduced at the edges of network
 		//uint32_t m_IncomigPacketId = 0u;
 	public:
+		/// Tells what happens to a packet routed through a Channel whose outbound queue is full.
+		enum class OverflowPolicy
+		{
+			Block,																									///< Routing thread waits until there is room in the queue.
+			DropOldest,																								///< Packet that waits longest is dropped.
+			DropNewest,																								///< Routed packet is dropped.
+		};
+
+		/// Bounds of memory held by incomplete packets and retransmission options.
+		struct Settings
+		{
+			std::chrono::seconds m_IncompletePacketTtl = 10min;													///< Incomplete packet is dropped if none of its chunks arrived for this long.
+			size_t m_IncompleteBytesLimit = 64 * 1024 * 1024;														///< Maximum number of bytes allocated for incomplete packets.
+			bool m_SelectiveRetransmission = false;																	///< Request missing chunks from the sender. Must be enabled on both ends of the Channel.
+			std::chrono::seconds m_RetransmissionDelay = 10s;														///< Time without any new chunk after which missing chunks of a packet are requested.
+			size_t m_RetransmissionWindowBytes = 4 * 1024 * 1024;													///< Maximum number of bytes of sent packets kept for retransmission.
+			size_t m_OutboundQueueDepth = 256;																		///< Number of packets waiting to be sent by Channel's own thread. 0 sends packets on the thread that routes them.
+			OverflowPolicy m_OutboundOverflowPolicy = OverflowPolicy::Block;										///< What happens to a routed packet if the outbound queue is full.
+			bool m_CompactHeaders = false;																			///< Encode chunk headers with varints, @see s_MaxCompactHeaderSize. Must be enabled on both ends of the Channel.
+			size_t m_ParityGroupSize = 0;																			///< Number of chunks followed by a parity chunk, @see CreateParityFrame. 0 turns forward error correction off. At most s_MaxParityGroupSize.
+			std::chrono::seconds m_LinkProbeInterval = 1min;														///< Average time between probes measuring the link to the neighbour, @see DeviceBridge::LinkQuality. 0 turns probing off.
+		};
+
+		/// Chunks of a single packet requested by the receiver.
+		struct MissingChunks
+		{
+			uint32_t m_PacketId;																					///< Id of the packet.
+			std::vector<uint32_t> m_ChunkIds;																		///< Ids of chunks missing between received ones.
+			uint32_t m_FirstTailChunkId;																			///< All chunks starting from this one are missing as well.
+		};
+
+		/// Counters of data dropped because of Settings, and number of packets being reassembled.
+		struct Statistics
+		{
+			uint64_t m_ExpiredPackets = 0;																			///< Incomplete packets dropped after Settings::m_IncompletePacketTtl.
+			uint64_t m_EvictedPackets = 0;																			///< Incomplete packets dropped to make room for new ones.
+			uint64_t m_RejectedChunks = 0;																			///< Chunks of packets larger than Settings::m_IncompleteBytesLimit, or not matching their packet.
+			uint64_t m_DroppedBytes = 0;																			///< Sum of bytes received for all dropped packets.
+			uint64_t m_DroppedOutboundPackets = 0;																	///< Packets not sent, because outbound queue was full.
+			uint64_t m_PendingPackets = 0;																			///< Incomplete packets currently waiting for chunks.
+			uint64_t m_RecoveredChunks = 0;																			///< Lost chunks rebuilt from parity chunks.
+			uint64_t m_DuplicateChunks = 0;																			///< Chunks of packets delivered already, e.g. retransmitted or parity chunks that came late. Dropped before reassembly.
+		};
+
 		/// Size of QoS header added to each sent chunk.
 		static constexpr size_t s_MaxPacketSize = sizeof(uint32_t);
 		static constexpr size_t s_PacketIdSize = sizeof(uint32_t);
@@ -57,13 +164,55 @@ namespace FSecure::C3
 		static constexpr size_t s_MinFrameSize = 64U;
 		static constexpr size_t s_MinBodySize = s_MinFrameSize - s_HeaderSize;
 
+		/// Upper bound of header size when Settings::m_CompactHeaders is enabled.
+		/// Compact header is a varint of packet id shifted left by one, with the lowest bit set on the first chunk. First chunk is followed by a varint of expected size of whole packet, other chunks by a varint of their id.
+		/// Packet that fits in one frame takes two or three bytes of header. Retransmission requests start with two zero bytes, as chunk 0 is always the first one.
+		static constexpr size_t s_MaxCompactHeaderSize = 5 + 5;
+
+		/// Bit of packet id set by sender of a packet bound for the Gateway. Relay on the way may forward chunks of such packet before it's reassembled.
+		/// Receivers that don't support cut-through reassemble the packet as any other.
+		static constexpr uint32_t s_CutThroughPacketIdFlag = 0x80000000;
+
+		/// Bit of chunk id set on parity chunks. Remaining bits hold id of the first chunk of the group. @see CreateParityFrame.
+		static constexpr uint32_t s_ParityChunkIdFlag = 0x80000000;
+
+		/// Size of fields that precede XOR of chunks in a parity chunk.
+		static constexpr size_t s_ParityFieldsSize = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t);
+
+		/// Upper bound of Settings::m_ParityGroupSize.
+		static constexpr size_t s_MaxParityGroupSize = std::numeric_limits<uint8_t>::max();
+
+		/// Chunk id used in header of frames carrying retransmission requests instead of packet data.
+		static constexpr uint32_t s_RetransmissionRequestChunkId = std::numeric_limits<uint32_t>::max();
+
+		/// Number of most recent packet ids remembered after their packets were delivered. @see IsDelivered.
+		static constexpr size_t s_DeliveredWindowSize = 1024;
+
+		/// Maximum number of packets listed in a single retransmission request.
+		static constexpr size_t s_MaxRequestedPackets = 32;
+
 		/// Map of received packets. Packets could be not complete, or there could be packet missing.
 		std::map<uint32_t, Packet> m_ReciveQueue;
 
+		/// Ids of packets from m_ReciveQueue that are ready, in order of completion.
+		std::deque<uint32_t> m_ReadyPackets;
+
+		/// Create QoS object with default Settings.
+		QualityOfService() = default;
+
+		/// Create QoS object.
+		/// @param settings bounds of memory held by incomplete packets and retransmission options.
+		QualityOfService(Settings const& settings);
+
 		/// Get next packet.
 		/// @returns ByteVector whole packet when it's ready or empty buffer otherwise.
 		ByteVector GetNextPacket();
 
+		/// Get packet carried whole by a single chunk, without copying it to the receive queue. Call before PushReceivedChunk.
+		/// @param chunkWithHeader received chunk.
+		/// @returns view of packet inside chunkWithHeader, or nothing if chunk is a part of bigger packet or ready packets wait to be read before it.
+		std::optional<ByteView> GetWholePacket(ByteView chunkWithHeader);
+
 		/// Push chunk to QoS storage to handle merging and ordering.
 		/// @param chunkWithHeader received packet. Device will add QoS header before sending any chunk.
 		void PushReceivedChunk(ByteView chunkWithHeader);
@@ -76,7 +225,194 @@ namespace FSecure::C3
 		void PushReceivedChunk(uint32_t packetId, uint32_t chunkId, uint32_t expectedSize, ByteView chunk);
 
 		/// Returns next ids for packets.
-		uint32_t GetOutgouingPacketId();
+		/// @param allowCutThrough whether to set s_CutThroughPacketIdFlag.
+		uint32_t GetOutgouingPacketId(bool allowCutThrough = false);
+
+		/// Drops a packet being reassembled, along with its ready state, e.g. when all of its chunks were forwarded already.
+		/// @param packetId id of the packet.
+		void DiscardPacket(uint32_t packetId);
+
+		/// Checks if packet was delivered already, either reassembled, handled straight from a frame or forwarded whole with cut-through.
+		/// Chunks of such packets are copies sent by retransmission or forward error correction, and are dropped without being stored.
+		/// @param packetId id of the packet.
+		/// @returns true if packet is one of the last s_DeliveredWindowSize packets delivered.
+		bool IsDelivered(uint32_t packetId) const;
+
+		/// Informs if chunk headers are encoded with varints.
+		bool AreCompactHeadersEnabled() const { return m_Settings.m_CompactHeaders; }
+
+		/// Gets number of chunks followed by a parity chunk. 0 if forward error correction is off.
+		size_t GetParityGroupSize() const { return m_Settings.m_ParityGroupSize; }
+
+		/// Gets bytes of each frame left for the header and fields of a parity chunk, so that parity chunk as long as the longest data chunk of its group fits in a frame.
+		/// @returns size of the longest header followed by parity fields, or 0 if forward error correction is off.
+		size_t GetParityReserve() const { return m_Settings.m_ParityGroupSize ? (m_Settings.m_CompactHeaders ? s_MaxCompactHeaderSize : s_HeaderSize) + s_ParityFieldsSize : 0; }
+
+		/// Creates parity chunk of a group of chunks. Receiver rebuilds any single chunk of the group from the others and the parity chunk, without asking for retransmission.
+		/// Parity chunk carries expected size of whole packet, number of chunks in the group, XOR of their sizes and XOR of their data padded to the longest one.
+		/// Receivers always accept parity chunks, so Settings::m_ParityGroupSize is needed only on the sending end. Both ends of the Channel must support it.
+		/// @param packetId id of the packet.
+		/// @param firstChunkId id of the first chunk of the group.
+		/// @param expectedSize size of whole packet.
+		/// @param chunks data of chunks of the group, in order.
+		/// @param compactHeaders whether to use compact encoding. @see s_MaxCompactHeaderSize.
+		/// @returns frame with QoS header that should be sent through the Channel after the chunks.
+		static ByteVector CreateParityFrame(uint32_t packetId, uint32_t firstChunkId, uint32_t expectedSize, std::vector<ByteView> const& chunks, bool compactHeaders);
+
+		/// Header of a received chunk.
+		struct ChunkHeader
+		{
+			uint32_t m_PacketId;																					///< Id of the packet.
+			uint32_t m_ChunkId;																						///< Id of the chunk.
+			std::optional<uint32_t> m_ExpectedSize;																	///< Size of whole packet. Compact headers carry it only on the first chunk.
+		};
+
+		/// Reads QoS header of a chunk.
+		/// @param chunkWithHeader received chunk. Header is removed from the view.
+		/// @returns header or nothing if chunk is too short or malformed.
+		std::optional<ChunkHeader> ReadHeader(ByteView& chunkWithHeader) const;
+
+		/// Appends QoS header of a chunk.
+		/// @param frame buffer to write header to.
+		/// @param packetId id of the packet.
+		/// @param chunkId id of the chunk.
+		/// @param expectedSize size of whole packet.
+		/// @param compactHeaders whether to use compact encoding. @see s_MaxCompactHeaderSize.
+		/// @returns size of written header.
+		static size_t WriteHeader(ByteVector& frame, uint32_t packetId, uint32_t chunkId, uint32_t expectedSize, bool compactHeaders);
+
+		/// Gets counters of dropped data. Safe to call from any thread.
+		/// @returns copy of current counters.
+		Statistics GetStatistics() const;
+
+		/// Informs if missing chunks should be requested and retransmitted.
+		bool IsSelectiveRetransmissionEnabled() const { return m_Settings.m_SelectiveRetransmission; }
+
+		/// Finds incomplete packets that did not receive any chunk for Settings::m_RetransmissionDelay.
+		/// Each packet is reported again only after another Settings::m_RetransmissionDelay.
+		/// @returns missing chunks of at most s_MaxRequestedPackets packets.
+		std::vector<MissingChunks> CollectMissingChunks();
+
+		/// Creates frame requesting retransmission of missing chunks.
+		/// @param missingChunks chunks to request.
+		/// @param compactHeaders whether receiver uses compact headers.
+		/// @returns frame with QoS header that should be sent through the Channel.
+		static ByteVector CreateRetransmissionRequest(std::vector<MissingChunks> const& missingChunks, bool compactHeaders = false);
+
+		/// Checks if received frame is a retransmission request.
+		/// @param frame received frame with QoS header.
+		/// @param compactHeaders whether sender uses compact headers.
+		/// @returns true if frame was created by CreateRetransmissionRequest.
+		static bool IsRetransmissionRequest(ByteView frame, bool compactHeaders = false);
+
+		/// Parses frame created by CreateRetransmissionRequest.
+		/// @param frame received frame with QoS header.
+		/// @param compactHeaders whether sender uses compact headers.
+		/// @returns requested chunks.
+		static std::vector<MissingChunks> ParseRetransmissionRequest(ByteView frame, bool compactHeaders = false);
+
+		/// Stores sent packet so its chunks could be retransmitted. Oldest packets are forgotten when Settings::m_RetransmissionWindowBytes is exceeded.
+		/// @param packetId id of the packet.
+		/// @param packet whole packet without QoS headers.
+		/// @param chunkOffsets offset of each sent chunk in packet.
+		void StoreSentPacket(uint32_t packetId, ByteView packet, std::vector<uint32_t> chunkOffsets);
+
+		/// Recreates requested chunks of a sent packet.
+		/// @param missingChunks chunks to recreate.
+		/// @returns frames with QoS headers, or nothing if packet is no longer in the retransmission window.
+		std::vector<ByteVector> CreateRetransmissionFrames(MissingChunks const& missingChunks) const;
+
+		/// Drops all packets kept for retransmission, e.g. when Channel was quiet for longer than receiver would wait for missing chunks.
+		void ForgetSentPackets();
+
+	private:
+		/// Chunks of a packet whose first chunk didn't arrive yet. Possible only with compact headers, as size of the packet is unknown.
+		struct EarlyChunks
+		{
+			std::map<uint32_t, ByteVector> m_Chunks;																///< Chunks by id.
+			size_t m_Size = 0;																						///< Sum of bytes in m_Chunks.
+			std::chrono::steady_clock::time_point m_LastUpdate = std::chrono::steady_clock::now();					///< Time of the last chunk arrival.
+			std::chrono::steady_clock::time_point m_LastRetransmissionRequest;										///< Time of the last retransmission request.
+		};
+
+		/// Stores a chunk of a packet whose size is not known yet.
+		/// @param packetId id of the packet.
+		/// @param chunkId id of the chunk.
+		/// @param chunk chunk of packet.
+		void PushEarlyChunk(uint32_t packetId, uint32_t chunkId, ByteView chunk);
+
+		/// Adds chunk to an incomplete packet and updates counters.
+		/// @param it packet the chunk belongs to.
+		/// @param chunkId id of the chunk.
+		/// @param chunk chunk of packet.
+		void PushToPacket(std::map<uint32_t, Packet>::iterator it, uint32_t chunkId, ByteView chunk);
+
+		/// Drops incomplete packets that exceeded Settings::m_IncompletePacketTtl. Checks queue at most once per second.
+		/// @param now current time.
+		void DropExpiredPackets(std::chrono::steady_clock::time_point now);
+
+		/// Makes room for a new incomplete packet by dropping the least recently updated ones.
+		/// @param expectedSize size of the new packet.
+		/// @returns false if packet would not fit in Settings::m_IncompleteBytesLimit even if queue was empty.
+		bool ReserveIncompleteBytes(uint32_t expectedSize);
+
+		/// Removes incomplete packet from queue and updates counters.
+		/// @param it packet to remove.
+		/// @returns iterator following removed packet.
+		std::map<uint32_t, Packet>::iterator DropPacket(std::map<uint32_t, Packet>::iterator it);
+
+		/// Ids of recently delivered packets. Sender numbers packets of a Channel one after another, so ids are kept as a bitmap of a window that slides with the newest one.
+		/// Id far behind the window is taken as the start of a new sequence, e.g. after sender restarted, and the window moves back to it.
+		class DeliveredPackets
+		{
+		public:
+			/// Checks if id is in the window and marked.
+			/// @param packetId id of the packet without s_CutThroughPacketIdFlag.
+			/// @returns true if packet was marked and window didn't slide past it yet.
+			bool Contains(uint32_t packetId) const;
+
+			/// Marks packet as delivered. Window slides forward if id is newer than any marked so far.
+			/// @param packetId id of the packet without s_CutThroughPacketIdFlag.
+			void Insert(uint32_t packetId);
+
+		private:
+			/// Gets distance from the newest id to packetId in 31-bit serial number arithmetic, so that sequence wraps around like ids do.
+			/// @param packetId id of the packet without s_CutThroughPacketIdFlag.
+			/// @returns number of ids packetId is behind the newest one. Negative if packetId is newer.
+			int32_t GetAge(uint32_t packetId) const;
+
+			std::bitset<s_DeliveredWindowSize> m_Window;															///< Bit n is set if packet m_Newest - n was delivered.
+			uint32_t m_Newest = 0;																					///< Newest id in the window.
+			bool m_IsEmpty = true;																					///< Set until the first packet is inserted.
+		};
+
+		/// Marks packet as delivered. @see IsDelivered.
+		/// @param packetId id of the packet.
+		void MarkDelivered(uint32_t packetId);
+
+		/// Packet kept for retransmission.
+		struct SentPacket
+		{
+			uint32_t m_Id;																							///< Id of the packet.
+			ByteVector m_Data;																						///< Whole packet without QoS headers.
+			std::vector<uint32_t> m_ChunkOffsets;																	///< Offset of each chunk in m_Data.
+		};
+
+		Settings m_Settings;																						///< Bounds of memory held by incomplete packets and retransmission options.
+		std::deque<SentPacket> m_RetransmissionWindow;																///< Recently sent packets. Accessed only by sending thread.
+		size_t m_RetransmissionWindowSize = 0;																		///< Sum of bytes held in m_RetransmissionWindow.
+		size_t m_IncompleteBytes = 0;																				///< Bytes allocated for incomplete packets.
+		std::map<uint32_t, EarlyChunks> m_EarlyChunks;																///< Chunks that arrived before the first chunk of their packet, by packet id.
+		size_t m_EarlyBytes = 0;																					///< Sum of bytes held in m_EarlyChunks. Bound by Settings::m_IncompleteBytesLimit.
+		DeliveredPackets m_DeliveredPackets;																		///< Recently delivered packets, whose chunks are dropped on arrival.
+		std::chrono::steady_clock::time_point m_LastExpiryCheck = std::chrono::steady_clock::now();					///< Last call of DropExpiredPackets that checked the queue.
+		std::atomic<uint64_t> m_ExpiredPackets = 0;																	///< @see Statistics::m_ExpiredPackets.
+		std::atomic<uint64_t> m_EvictedPackets = 0;																	///< @see Statistics::m_EvictedPackets.
+		std::atomic<uint64_t> m_RejectedChunks = 0;																	///< @see Statistics::m_RejectedChunks.
+		std::atomic<uint64_t> m_DroppedBytes = 0;																	///< @see Statistics::m_DroppedBytes.
+		std::atomic<uint64_t> m_PendingPackets = 0;																	///< @see Statistics::m_PendingPackets.
+		std::atomic<uint64_t> m_RecoveredChunks = 0;																///< @see Statistics::m_RecoveredChunks.
+		std::atomic<uint64_t> m_DuplicateChunks = 0;																///< @see Statistics::m_DuplicateChunks.
 	};
 }
 
@@ -6,28 +6,55 @@
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::Core::Relay::Relay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, Crypto::PrivateKey const& decryptionKey, Crypto::SymmetricKey const& broadcastKey,
-	BuildId buildId, AgentId agentId)
+	BuildId buildId, AgentId agentId, std::size_t deviceWorkerThreads, QualityOfService::Settings const& qosSettings)
+	: Relay{ callbackOnLog, interfaceFactory, decryptionKey, broadcastKey, buildId, agentId, deviceWorkerThreads ? Scheduler::Create(deviceWorkerThreads) : nullptr, qosSettings }
+{
+	m_OwnsScheduler = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Relay::Relay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, Crypto::PrivateKey const& decryptionKey, Crypto::SymmetricKey const& broadcastKey,
+	BuildId buildId, AgentId agentId, std::shared_ptr<Scheduler> scheduler, QualityOfService::Settings const& qosSettings)
 	: Distributor{ callbackOnLog, decryptionKey, broadcastKey }
 	, m_BuildId{ buildId }
 	, m_AgentId{ agentId }
 	, m_InterfaceFactory{ interfaceFactory }
+	, m_QoSSettings{ qosSettings }
+	, m_Scheduler{ std::move(scheduler) }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::Relay::~Relay()
 {
+	// Scheduler holds Devices which hold the Relay, so there is nothing left to update at this point. Shared Scheduler still updates other Relays.
+	if (m_Scheduler && m_OwnsScheduler)
+		m_Scheduler->Stop();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::Relay::AttachDevice(std::shared_ptr<FSecure::C3::Core::DeviceBridge> device)
 {
-	m_Devices.TryAdd(
-		[did = device->GetDid()](std::weak_ptr<DeviceBridge> const& c)
+	{
+		std::unique_lock lock(m_DevicesMutex);
+		auto [it, inserted] = m_Devices.try_emplace(device->GetDid().ToUnderlyingType(), device);
+		if (!inserted)
 		{
-			auto sp = c.lock();
-			return sp ? sp->GetDid() == did : false;
-		}, device);
+			if (!it->second.expired())
+				throw std::invalid_argument{ OBF("Tried to attach a Device with an ID that is already in use.") };
+
+			it->second = device;																						// Replace an entry of a destroyed Device.
+		}
+	}
 
 	device->OnAttach();
 
-	// Current implementation just runs OnReceive in a separate thread. In the future we might implement some single threaded solutions (i.e. schedulers).
-	device->StartUpdatingInSeparateThread();
+	// Channels share the Scheduler's worker pool. Peripherals might block in OnReceive (e.g. waiting for the payload), so each of them keeps a separate thread.
+	if (m_Scheduler && device->IsChannel())
+		m_Scheduler->Schedule(device, device->GetUpdateDelay());
+	else
+		device->StartUpdatingInSeparateThread();
+
 	return device;
 }
 
@@ -62,54 +89,151 @@ std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::Relay::Creat
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-void FSecure::C3::Core::Relay::DetachDevice(DeviceId const& iidOfDeviceToDetach)
+void FSecure::C3::Core::Relay::ExpediteUpdate(DeviceBridge const& device, std::optional<std::chrono::milliseconds> delay)
+{
+	// Devices updated in their own threads are woken up by DeviceBridge.
+	if (m_Scheduler && device.IsChannel())
+		m_Scheduler->Expedite(device, delay.value_or(device.GetUpdateDelay()));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Relay::RescheduleUpdate(DeviceBridge const& device)
+{
+	// Devices updated in their own threads are woken up by DeviceBridge.
+	if (m_Scheduler && device.IsChannel())
+		m_Scheduler->Reschedule(device, device.GetUpdateDelay());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Relay::StopUpdating(DeviceBridge const& device)
 {
-	// Find specified Device.
+	if (m_Scheduler && device.IsChannel())
+		m_Scheduler->Remove(device);
+}
 
-	m_Devices.Remove([&iidOfDeviceToDetach](std::weak_ptr<DeviceBridge> const& c)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::Relay::SelectCutThroughChannel(std::shared_ptr<DeviceBridge> const& sender)
+{
+	return {};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Relay::SendLinkProbe(std::shared_ptr<DeviceBridge> const& channel, std::uint32_t sequence)
+{
+	LockAndSendPacket(ProceduresN2N::LinkProbe::Create(RouteId{ GetAgentId(), channel->GetDid() }, false, sequence).ComposeQueryPacket(), channel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Relay::On(ProceduresN2N::LinkProbe query)
+{
+	auto sender = query.GetSenderChannel().lock();
+	if (!sender)
+		return;
+
+	auto [isEcho, sequence] = query.GetQueryPacket().Read<bool, std::uint32_t>();
+	if (isEcho)
+		return sender->OnLinkProbeAnswered(sequence);
+
+	LockAndSendPacket(ProceduresN2N::LinkProbe::Create(RouteId{ GetAgentId(), sender->GetDid() }, true, sequence).ComposeQueryPacket(), sender);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<std::tuple<FSecure::C3::DeviceId, FSecure::C3::Core::DeviceBridge::LinkQuality>> FSecure::C3::Core::Relay::GetLinkQualities()
+{
+	std::vector<std::tuple<DeviceId, DeviceBridge::LinkQuality>> ret;
+	std::shared_lock lock(m_DevicesMutex);
+	for (auto& [did, weakDevice] : m_Devices)
+		if (auto device = weakDevice.lock(); device && device->IsChannel())
+			if (auto quality = device->GetLinkQuality())
+				ret.emplace_back(device->GetDid(), *quality);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Relay::DetachDevice(DeviceId const& iidOfDeviceToDetach)
+{
+	// Find specified Device and remove it from the registry.
+	std::shared_ptr<DeviceBridge> device;
+	{
+		std::unique_lock lock(m_DevicesMutex);
+		if (auto it = m_Devices.find(iidOfDeviceToDetach.ToUnderlyingType()); it != m_Devices.end())
 		{
-			if (auto ri = c.lock(); ri && ri->GetDid() == iidOfDeviceToDetach)
-			{
-				ri->Detach();
-				return true;
-			}
+			device = it->second.lock();
+			m_Devices.erase(it);
+		}
+	}
 
-			return false;
-		});
+	if (!device)
+		throw std::invalid_argument{ OBF("Attempted to detach a non-existent Device.") };
 
+	device->Detach();
 	RemoveChannelRoutes(iidOfDeviceToDetach);
+
+	// Blocks cached during the Device's traffic go back to the heap together, as it's likely that nothing else will need so many of them.
+	device.reset();
+	BlockPool::Trim();
+	BlockPool::CompactHeap();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::Relay::FindDevice(DeviceId did)
 {
-	std::shared_ptr<FSecure::C3::Core::DeviceBridge> retVal;
-	m_Devices.Find([&did, &retVal](std::weak_ptr<DeviceBridge> const& c)
-		{
-			if (auto ri = c.lock(); ri && ri->GetDid() == did)
-			{
-				retVal = std::move(ri);
-				return true;
-			}
+	{
+		std::shared_lock lock(m_DevicesMutex);
+		auto it = m_Devices.find(did.ToUnderlyingType());
+		if (it == m_Devices.end())
+			return {};
+
+		if (auto device = it->second.lock(); device)
+			return device;
+	}
+
+	// Device was destroyed without being detached. Drop its entry, unless it was replaced in the meantime.
+	std::unique_lock lock(m_DevicesMutex);
+	if (auto it = m_Devices.find(did.ToUnderlyingType()); it != m_Devices.end() && it->second.expired())
+		m_Devices.erase(it);
 
-			return false;
-		});
+	return {};
+}
 
-	return retVal;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Core::Relay::FindChannel(DeviceId did)
+{
+	auto device = FindDevice(did);
+	return device && device->IsChannel() ? device : nullptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::Relay::Close()
 {
-	m_Devices.For([](auto c)
-		{
-			if (auto ri = c.lock(); ri)
-				ri->Detach();
+	DetachAllDevices();
+	NotifyClosed();
+}
 
-			return true;
-		});
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Relay::DetachAllDevices()
+{
+	decltype(m_Devices) devices;
+	{
+		std::unique_lock lock(m_DevicesMutex);
+		devices.swap(m_Devices);
+	}
 
-	m_Devices.Clear();
+	for (auto& [did, device] : devices)
+		if (auto ri = device.lock(); ri)
+			ri->Detach();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Relay::NotifyClosed()
+{
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_ClosedMutex };
+		m_IsClosed = true;
+	}
+
+	m_ClosedCondition.notify_all();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -117,15 +241,59 @@ void FSecure::C3::Core::Relay::Join()
 {
 	auto self = shared_from_this();
 	// The main thread has a shared_ptr on which that Join method is called ->
+	// Close wakes the wait up. Threads release the Relay shortly after, so from then on it is checked often.
+	auto lock = std::unique_lock<std::mutex>{ m_ClosedMutex };
 	while (self.use_count() > 2)
-		std::this_thread::sleep_for(1s);
+		m_ClosedCondition.wait_for(lock, m_IsClosed ? s_JoinPollInterval : s_JoinTimeout);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::Relay::WaitForClose(std::chrono::milliseconds timeout)
+{
+	auto lock = std::unique_lock<std::mutex>{ m_ClosedMutex };
+	return m_ClosedCondition.wait_for(lock, timeout, [this] { return m_IsClosed; });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Relay::TrimMemory(bool trimWorkingSet)
+{
+	// Expired entries are dropped on the way, so that the table can shrink.
+	std::vector<std::shared_ptr<DeviceBridge>> devices;
+	{
+		std::unique_lock lock(m_DevicesMutex);
+		for (auto it = m_Devices.begin(); it != m_Devices.end();)
+			if (auto device = it->second.lock())
+			{
+				devices.push_back(std::move(device));
+				++it;
+			}
+			else
+				it = m_Devices.erase(it);
+
+		m_Devices.rehash(0);
+	}
+
+	for (auto& device : devices)
+		device->TrimMemory();
+
+	devices.clear();
+	RouteManager::TrimMemory();
+	ReleaseThreadBuffers();
+	BlockPool::Trim();
+
+	if (trimWorkingSet)
+	{
+		HeapCompact(GetProcessHeap(), 0);
+		BlockPool::CompactHeap();
+		SetProcessWorkingSetSize(GetCurrentProcess(), static_cast<SIZE_T>(-1), static_cast<SIZE_T>(-1));
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::Relay::CreateRoute(ByteView args)
 {
 	auto [ridStr, didStr] = args.Read<std::string_view, std::string_view>();
-	auto channel = m_Devices.Find([did = DeviceId{ didStr }](auto const& e) { auto l = e.lock(); return l ? l->GetDid() == did : false; }).lock();
+	auto channel = FindDevice(DeviceId{ didStr });
 	if (!channel)
 		throw std::runtime_error{ OBF("Device not found") };
 
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "Distributor.h"
+#include "DeviceBridge.h"
+#include "Scheduler.h"
+#include "QualityOfService.h"
 #include "Common/FSecure/C3/Internals/InterfaceFactory.h"
 
 namespace FSecure::C3::Core
@@ -8,16 +11,48 @@ namespace FSecure::C3::Core
 	/// Last base layer class for both Relay types.
 	struct Relay : Distributor, FSecure::C3::Relay
 	{
-		/// Destructor
-		virtual ~Relay() = default;
+		/// Destructor. Stops the Scheduler threads, unless the Scheduler is shared with other Relays.
+		virtual ~Relay();
 
 		/// Called whenever an attached Binder Peripheral wants to send a Command to its Connector Binder.
 		/// @param command full Command with arguments.
 		/// @param sender Interface that is sending the Command.
-		virtual void PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> sender) = 0;
-		AgentId GetAgentId() const { return m_AgentId; }
+		virtual void PostCommandToConnector(ByteView command, std::shared_ptr<DeviceBridge> const& sender) = 0;
+
+		/// Called whenever an attached Binder Peripheral streams a long Command to its Connector Binder in parts.
+		/// @param segment part of the Command.
+		/// @param position position of segment in the Command.
+		/// @param sender Interface that is sending the Command.
+		virtual void PostCommandSegmentToConnector(ByteView segment, BinderSegment const& position, std::shared_ptr<DeviceBridge> const& sender) = 0;
+		AgentId GetAgentId() const override { return m_AgentId; }
 		BuildId GetBuildId() const { return m_BuildId; }
 
+		/// Gets Quality of Service settings of each Channel.
+		QualityOfService::Settings const& GetQoSSettings() const { return m_QoSSettings; }
+
+		/// Brings forward the next update of a Device to its current update delay, e.g. after it sent a packet that is likely to be answered.
+		/// @param device Device to update.
+		/// @param delay time after which the Device should be updated. If not set, Device's update delay is used.
+		void ExpediteUpdate(DeviceBridge const& device, std::optional<std::chrono::milliseconds> delay = {});
+
+		/// Moves the next update of a Device to its new update delay, sooner or later. Called when update delay or jitter of the Device changes.
+		/// @param device Device to update.
+		void RescheduleUpdate(DeviceBridge const& device);
+
+		/// Stops updates of a detached Device, so that it is released right away instead of after its update delay.
+		/// @param device detached Device.
+		void StopUpdating(DeviceBridge const& device);
+
+		/// Chooses a Channel that chunks of a received Gateway-bound packet are forwarded to before the packet is reassembled. @see QualityOfService::s_CutThroughPacketIdFlag.
+		/// @param sender Channel that receives the packet.
+		/// @return Channel to forward chunks to, or null if packet should be reassembled and routed as usual.
+		virtual std::shared_ptr<DeviceBridge> SelectCutThroughChannel(std::shared_ptr<DeviceBridge> const& sender);
+
+		/// Sends a probe measuring the link to the neighbour. @see DeviceBridge::ProbeLinkIfDue.
+		/// @param channel Channel to probe.
+		/// @param sequence number of the probe.
+		void SendLinkProbe(std::shared_ptr<DeviceBridge> const& channel, std::uint32_t sequence);
+
 		/// Detaches an Device. This operation leads to (delayed) destruction of the Device.
 		/// @param iidOfDeviceToDetach ID of the Device to detach.
 		/// @throw std::invalid_argument on an attempt of removal of a non-existent Device.
@@ -33,7 +68,22 @@ namespace FSecure::C3::Core
 		/// @param broadcastKey Network's symmetric key.
 		/// @param buildId Build identifier.
 		/// @param agentId Agent identifier.
-		Relay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, Crypto::PrivateKey const& decryptionKey, Crypto::SymmetricKey const& broadcastKey, BuildId buildId, AgentId agentId = AgentId::GenerateRandom());
+		/// @param deviceWorkerThreads number of Scheduler threads updating Channels. If 0, every Device is updated in its own thread.
+		/// @param qosSettings Quality of Service settings of each Channel.
+		Relay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, Crypto::PrivateKey const& decryptionKey, Crypto::SymmetricKey const& broadcastKey, BuildId buildId, AgentId agentId = AgentId::GenerateRandom(),
+			std::size_t deviceWorkerThreads = Scheduler::s_DefaultWorkerCount, QualityOfService::Settings const& qosSettings = {});
+
+		/// A protected constructor of a Relay sharing its Scheduler with other Relays of the process. @see Distributor::Distributor.
+		/// @param callbackOnLog callback fired whenever a new Log entry is being added.
+		/// @param interfaceFactory reference to Interface factory.
+		/// @param decryptionKey Relay's private asymmetric key.
+		/// @param broadcastKey Network's symmetric key.
+		/// @param buildId Build identifier.
+		/// @param agentId Agent identifier.
+		/// @param scheduler Scheduler updating Channels. Relay doesn't stop it. If null, every Device is updated in its own thread.
+		/// @param qosSettings Quality of Service settings of each Channel.
+		Relay(LoggerCallback callbackOnLog, InterfaceFactory& interfaceFactory, Crypto::PrivateKey const& decryptionKey, Crypto::SymmetricKey const& broadcastKey, BuildId buildId, AgentId agentId,
+			std::shared_ptr<Scheduler> scheduler, QualityOfService::Settings const& qosSettings = {});
 
 		/// Add a new Device.
 		/// @param iid preferred Identifier.
@@ -51,6 +101,12 @@ namespace FSecure::C3::Core
 		/// Close Relay (command handler)
 		virtual void Close();
 
+		/// Detaches all Devices. Part of Close that doesn't end the Relay.
+		void DetachAllDevices();
+
+		/// Marks Relay as closed, waking up Join and WaitForClose. Part of Close.
+		void NotifyClosed();
+
 		/// Create route (command handler)
 		/// @param args - packed arguments of route to create
 		virtual void CreateRoute(ByteView args);
@@ -59,17 +115,53 @@ namespace FSecure::C3::Core
 		/// @param args - packed arguments of route to remove
 		virtual void RemoveRoute(ByteView args);
 
-		/// Finds attached Device from Device ID hex text.
+		/// Handler fired when a N2N::LinkProbe Procedure Query arrives. Probes are echoed back, echoes are passed to the Channel that sent the probe.
+		/// @param query object representing Query.
+		void On(ProceduresN2N::LinkProbe query) override;
+
+		/// Gets quality of links to neighbours of all Channels that measured it.
+		/// @return Channel identifiers with their link quality.
+		std::vector<std::tuple<DeviceId, DeviceBridge::LinkQuality>> GetLinkQualities();
+
+		/// Finds attached Device. Expired entry found on the way is removed from the registry.
 		/// @param did ID of the Device to find.
 		/// @return Device pointer to the Device if found or null.
 		std::shared_ptr<DeviceBridge> FindDevice(DeviceId did);
 
+		/// Finds attached Channel.
+		/// @param did ID of the Channel to find.
+		/// @return Device pointer to the Channel if found or null if there is no such Device or it is not a Channel.
+		std::shared_ptr<DeviceBridge> FindChannel(DeviceId did);
+
 		/// Waits for Relay to be terminated internally by a C3 API Command (e.g. from WebController).
 		void Join() override;
 
-		SafeSmartPointerContainer<std::weak_ptr<DeviceBridge>> m_Devices;												///< Container for all attached Devices.
+		/// Waits until Relay is closed or timeout elapses. Used instead of sleeping by threads that should notice Close right away.
+		/// @param timeout maximum time to wait.
+		/// @return true if Relay is closed.
+		bool WaitForClose(std::chrono::milliseconds timeout);
+
+		/// Releases memory left by past traffic: capacity of Device and Route tables, Devices' buffers, per-thread packet buffers and pooled blocks.
+		/// @param trimWorkingSet true to also compact the process heap and swap out the process working set.
+		void TrimMemory(bool trimWorkingSet);
+
+		mutable std::shared_mutex m_DevicesMutex;																		///< Guards m_Devices. Lookups share the lock, attaching and detaching is exclusive.
+		std::unordered_map<DeviceId::UnderlyingIntegerType, std::weak_ptr<DeviceBridge>> m_Devices;						///< All attached Devices indexed by their IDs.
 		const BuildId m_BuildId;																						///< An unique identifier for the Relay's binary setup (Build identifier).
 		AgentId m_AgentId;																								///< A run-time generated, unique identifier for this Relay's instance.
 		InterfaceFactory& m_InterfaceFactory;																			///< Object responsible for crating new Devices.
+		const QualityOfService::Settings m_QoSSettings;																		///< Quality of Service settings of each Channel.
+		std::shared_ptr<Scheduler> m_Scheduler;																			///< Timer wheel updating Channels. Null if Devices are updated in separate threads.
+		bool m_OwnsScheduler = false;																					///< Set if m_Scheduler was created by this Relay, so it's stopped with it.
+		std::mutex m_ClosedMutex;																						///< Guards m_IsClosed.
+		std::condition_variable m_ClosedCondition;																		///< Notified by Close. Wakes up Join and WaitForClose.
+		bool m_IsClosed = false;																						///< Set by Close.
+
+	private:
+		/// Once Relay is closed, Join checks that often whether threads have released it.
+		static constexpr std::chrono::milliseconds s_JoinPollInterval = 10ms;
+
+		/// Join checks that often whether Relay was released without Close.
+		static constexpr std::chrono::seconds s_JoinTimeout = 1s;
 	};
 }
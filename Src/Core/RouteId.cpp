@@ -11,6 +11,13 @@ FSecure::C3::RouteId::RouteId(std::string_view textId)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::RouteId::Hash::operator()(RouteId const& routeId) const noexcept
+{
+	auto hash = std::hash<AgentId::UnderlyingIntegerType>{}(routeId.GetAgentId().ToUnderlyingType());
+	return hash ^ (std::hash<DeviceId::UnderlyingIntegerType>{}(routeId.GetInterfaceId().ToUnderlyingType()) + 0x9e3779b9 + (hash << 6) + (hash >> 2));
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 FSecure::C3::RouteId FSecure::C3::RouteId::GenerateRandom()
 {
@@ -20,7 +27,17 @@ FSecure::C3::RouteId FSecure::C3::RouteId::GenerateRandom()
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::string FSecure::C3::RouteId::ToString() const
 {
-	return m_AgentId.ToString() + OBF(":") + m_InterfaceId.ToString();
+	std::string ret(TextSize, '0');
+	ToChars(ret.data());
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+char* FSecure::C3::RouteId::ToChars(char* buffer) const
+{
+	auto separator = m_AgentId.ToChars(buffer);
+	*separator = ':';
+	return m_InterfaceId.ToChars(separator + 1);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -34,6 +34,11 @@ namespace FSecure::C3
 		/// @return a string that describes this ID object.
 		std::string ToString() const;
 
+		/// Writes this ID as text without allocating, e.g. to a stack buffer.
+		/// @param buffer place for TextSize characters. Null terminator is not added.
+		/// @return pointer past the last written character.
+		char* ToChars(char* buffer) const;
+
 		/// Logical negation operator. Can be used to check if ID is set.
 		/// @return true if ID is not set.
 		bool operator !() const;
@@ -65,6 +70,14 @@ namespace FSecure::C3
 		/// @return InterfaceId part of this RouteId.
 		DeviceId GetInterfaceId() const { return m_InterfaceId; }
 
+		/// Hash functor. Allows RouteId to be used as a key of unordered containers.
+		struct Hash
+		{
+			/// @param routeId ID to hash.
+			/// @return hash combining both parts of the ID.
+			size_t operator()(RouteId const& routeId) const noexcept;
+		};
+
 		static constexpr size_t TextSize = BinarySize * 2 + 1;															///< Length of the Identifier written in text format (two hex numbers + "." or ":" between them).
 		static const RouteId Null;																						///< Object that represents invalid Identifier. Might be used to address special cases (such as Gateway which is a special Relay).
 
@@ -94,6 +107,26 @@ namespace FSecure
 		{
 			return ByteReader{ bv }.Create<C3::RouteId, decltype(std::declval<C3::RouteId>().GetAgentId()), decltype(std::declval<C3::RouteId>().GetInterfaceId())>();
 		}
+
+		static void ToRaw(C3::RouteId const& obj, std::uint8_t* ptr)
+		{
+			ByteConverter<C3::AgentId>::ToRaw(obj.GetAgentId(), ptr);
+			ByteConverter<C3::DeviceId>::ToRaw(obj.GetInterfaceId(), ptr + C3::AgentId::BinarySize);
+		}
+
+		static C3::RouteId FromRaw(std::uint8_t const* ptr)
+		{
+			return { ByteConverter<C3::AgentId>::FromRaw(ptr), ByteConverter<C3::DeviceId>::FromRaw(ptr + C3::AgentId::BinarySize) };
+		}
 	};
 
 }
+
+namespace std
+{
+	/// Add hashing function for RouteId. @see RouteId::Hash.
+	template <>
+	struct hash<FSecure::C3::RouteId> : FSecure::C3::RouteId::Hash
+	{
+	};
+}
@@ -12,41 +12,180 @@ FSecure::C3::Core::RouteManager::Route::Route(RouteId routeId, std::shared_ptr<D
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::Core::RouteManager::Route> FSecure::C3::Core::RouteManager::FindRoute(RouteId const& routeId) const noexcept
 {
-	return m_Routes.Find([&routeId](std::shared_ptr<Route> const& c) { return c->m_RouteId == routeId; });
+	std::shared_lock lock(m_AccessMutex);
+	auto it = m_Routes.find(routeId);
+	return it == m_Routes.end() ? nullptr : it->second;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::Core::RouteManager::Route> FSecure::C3::Core::RouteManager::FindRoute(AgentId const& agentId) const noexcept
 {
-	return m_Routes.Find([&agentId](std::shared_ptr<Route> const& c) { return c->m_RouteId.GetAgentId() == agentId; });
+	std::shared_lock lock(m_AccessMutex);
+	auto it = m_RoutesByAgent.find(agentId.ToUnderlyingType());
+	return it == m_RoutesByAgent.end() ? nullptr : it->second;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-std::shared_ptr<FSecure::C3::Core::RouteManager::Route> FSecure::C3::Core::RouteManager::AddRoute(RouteId routeId, std::shared_ptr<DeviceBridge> channel)
+std::size_t FSecure::C3::Core::RouteManager::GetRoutesCount() const noexcept
 {
-	return m_Routes.TryAdd([&routeId](std::shared_ptr<Route> const& c) { return c->m_RouteId == routeId; }, std::make_shared<Route>(routeId, channel));
+	std::shared_lock lock(m_AccessMutex);
+	return m_Routes.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::uint64_t FSecure::C3::Core::RouteManager::GetRoutesVersion() const noexcept
+{
+	return m_RoutesVersion.load();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::RouteManager::Route> FSecure::C3::Core::RouteManager::AddRoute(RouteId routeId, std::shared_ptr<DeviceBridge> const& channel)
+{
+	auto route = std::make_shared<Route>(routeId, channel);
+
+	std::unique_lock lock(m_AccessMutex);
+	if (!m_Routes.emplace(routeId, route).second)
+		throw std::invalid_argument{ OBF("Tried to add an existing Element to the container.") };
+
+	AddToIndexes(route);
+	++m_RoutesVersion;
+	return route;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::RouteManager::RemoveRoute(RouteId const& routeId)
 {
-	m_Routes.Remove([&routeId](std::shared_ptr<Route> const& c) { return c->m_RouteId == routeId; });
+	std::unique_lock lock(m_AccessMutex);
+	auto it = m_Routes.find(routeId);
+	if (it == m_Routes.end())
+		throw std::invalid_argument{ OBF("Attempted to remove a non-existent Element.") };
+
+	RemoveFromIndexes(it->second);
+	m_Routes.erase(it);
+	++m_RoutesVersion;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 std::shared_ptr<FSecure::C3::Core::RouteManager::Route> FSecure::C3::Core::RouteManager::FindRouteByOutgoingChannel(DeviceId deviceId) const noexcept
 {
-	return m_Routes.Find([&deviceId](auto const& e) {return e->m_OutgoingDeviceId == deviceId; });
+	std::shared_lock lock(m_AccessMutex);
+	auto it = m_RoutesByOutgoingDevice.find(deviceId.ToUnderlyingType());
+	return it == m_RoutesByOutgoingDevice.end() ? nullptr : it->second;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::RouteManager::RemoveAllRoutes()
 {
-	m_Routes.Clear();
+	std::unique_lock lock(m_AccessMutex);
+	m_Routes.clear();
+	m_RoutesByAgent.clear();
+	m_RoutesByOutgoingDevice.clear();
+	++m_RoutesVersion;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void FSecure::C3::Core::RouteManager::RemoveChannelRoutes(DeviceId outgoingDeviceId)
 {
-	m_Routes.RemoveIf( [outgoingDeviceId](auto& route) { return route->m_OutgoingDeviceId == outgoingDeviceId; });
+	std::unique_lock lock(m_AccessMutex);
+	EraseChannelRoutes(outgoingDeviceId);
+	++m_RoutesVersion;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::RouteManager::TrimMemory()
+{
+	std::unique_lock lock(m_AccessMutex);
+	m_Routes.rehash(0);
+	m_RoutesByAgent.rehash(0);
+	m_RoutesByOutgoingDevice.rehash(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::RouteManager::ApplyChanges(Changes const& changes)
+{
+	// Routes are created before the lock is taken, so that readers wait only for the table updates.
+	std::vector<std::shared_ptr<Route>> addedRoutes;
+	addedRoutes.reserve(changes.m_AddedRoutes.size());
+	for (auto const& [routeId, channel] : changes.m_AddedRoutes)
+		addedRoutes.push_back(std::make_shared<Route>(routeId, channel));
+
+	std::unique_lock lock(m_AccessMutex);
+
+	// Validate the whole batch first, so that a failure doesn't leave the table half modified.
+	std::unordered_set<RouteId, RouteId::Hash> freedRoutes;
+	for (auto const& routeId : changes.m_RemovedRoutes)
+		if (!m_Routes.count(routeId) || !freedRoutes.insert(routeId).second)
+			throw std::invalid_argument{ OBF("Attempted to remove a non-existent Element.") };
+
+	for (auto outgoingDeviceId : changes.m_RemovedChannels)
+	{
+		auto [begin, end] = m_RoutesByOutgoingDevice.equal_range(outgoingDeviceId.ToUnderlyingType());
+		for (auto it = begin; it != end; ++it)
+			freedRoutes.insert(it->second->m_RouteId);
+	}
+
+	std::unordered_set<RouteId, RouteId::Hash> takenRoutes;
+	for (auto const& route : addedRoutes)
+		if ((m_Routes.count(route->m_RouteId) && !freedRoutes.count(route->m_RouteId)) || !takenRoutes.insert(route->m_RouteId).second)
+			throw std::invalid_argument{ OBF("Tried to add an existing Element to the container.") };
+
+	for (auto const& routeId : changes.m_RemovedRoutes)
+	{
+		auto it = m_Routes.find(routeId);
+		RemoveFromIndexes(it->second);
+		m_Routes.erase(it);
+	}
+
+	for (auto outgoingDeviceId : changes.m_RemovedChannels)
+		EraseChannelRoutes(outgoingDeviceId);
+
+	for (auto const& route : addedRoutes)
+	{
+		m_Routes.emplace(route->m_RouteId, route);
+		AddToIndexes(route);
+	}
+
+	++m_RoutesVersion;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::RouteManager::AddToIndexes(std::shared_ptr<Route> const& route)
+{
+	m_RoutesByAgent.emplace(route->m_RouteId.GetAgentId().ToUnderlyingType(), route);
+	m_RoutesByOutgoingDevice.emplace(route->m_OutgoingDeviceId.ToUnderlyingType(), route);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::RouteManager::EraseChannelRoutes(DeviceId outgoingDeviceId)
+{
+	auto [begin, end] = m_RoutesByOutgoingDevice.equal_range(outgoingDeviceId.ToUnderlyingType());
+	for (auto it = begin; it != end; ++it)
+	{
+		auto [agentBegin, agentEnd] = m_RoutesByAgent.equal_range(it->second->m_RouteId.GetAgentId().ToUnderlyingType());
+		for (auto agentIt = agentBegin; agentIt != agentEnd; ++agentIt)
+			if (agentIt->second == it->second)
+			{
+				m_RoutesByAgent.erase(agentIt);
+				break;
+			}
+
+		m_Routes.erase(it->second->m_RouteId);
+	}
+
+	m_RoutesByOutgoingDevice.erase(begin, end);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::RouteManager::RemoveFromIndexes(std::shared_ptr<Route> const& route)
+{
+	auto eraseFrom = [&route](auto& index, auto key)
+	{
+		auto [begin, end] = index.equal_range(key);
+		for (auto it = begin; it != end; ++it)
+			if (it->second == route)
+				return static_cast<void>(index.erase(it));
+	};
+
+	eraseFrom(m_RoutesByAgent, route->m_RouteId.GetAgentId().ToUnderlyingType());
+	eraseFrom(m_RoutesByOutgoingDevice, route->m_OutgoingDeviceId.ToUnderlyingType());
 }
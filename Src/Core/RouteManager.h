@@ -1,12 +1,11 @@
 #pragma once
 
-#include "Common/FSecure/CppTools/SafeSmartPointerContainer.h"
 #include "RouteId.h"
 #include "DeviceBridge.h"
 
 namespace FSecure::C3::Core
 {
-	/// A template class responsible for managing C3 connections.
+	/// A class responsible for managing C3 connections. Routes are indexed by RouteId, AgentId and outgoing DeviceId, so packet forwarding does not depend on the size of the Route table.
 	struct RouteManager
 	{
 		/// Route is used by Relays to indicate that a particular Interface (actually a Channel) is used to transport packets towards a specific Agent.
@@ -22,6 +21,14 @@ namespace FSecure::C3::Core
 			const DeviceId m_OutgoingDeviceId;
 		};
 
+		/// Set of Route table modifications applied at once. @see ApplyChanges.
+		struct Changes
+		{
+			std::vector<RouteId> m_RemovedRoutes;																	///< Routes to remove.
+			std::vector<DeviceId> m_RemovedChannels;																///< Outgoing Channels, whose all Routes are removed.
+			std::vector<std::pair<RouteId, std::shared_ptr<DeviceBridge>>> m_AddedRoutes;							///< Routes to add, along with Channels that "point" toward them.
+		};
+
 		/// Destructor
 		virtual ~RouteManager() = default;
 
@@ -40,12 +47,20 @@ namespace FSecure::C3::Core
 		/// @return Route object if any existed, otherwise null.
 		std::shared_ptr<Route> FindRouteByOutgoingChannel(DeviceId deviceId) const noexcept;
 
+		/// Gets size of the Route table.
+		/// @return number of Routes.
+		std::size_t GetRoutesCount() const noexcept;
+
+		/// Gets version of the Route table. It changes whenever a Route is added or removed, so information derived from Routes can be cached until then.
+		/// @return current version.
+		std::uint64_t GetRoutesVersion() const noexcept;
+
 		/// Adds a new Route to the Route table.
 		/// @param routeId an ID of the Route object to add.
 		/// @param channel a Channel that "points" toward the Route (the opposite direction to Gateway).
 		/// @return the newly created Route object.
 		/// @throw std::invalid_argument if specified routeId is already in use.
-		std::shared_ptr<Route> AddRoute(RouteId routeId, std::shared_ptr<DeviceBridge> channel);
+		std::shared_ptr<Route> AddRoute(RouteId routeId, std::shared_ptr<DeviceBridge> const& channel);
 
 		/// Removes a Route from the Route table.
 		/// @param routeId ID of the Route to remove.
@@ -59,7 +74,32 @@ namespace FSecure::C3::Core
 		/// Removes all Routes from the Route table.
 		void RemoveAllRoutes();
 
+		/// Applies many modifications with a single lock acquisition, so that readers never see the Route table half way through a topology change.
+		/// Removals are applied before additions, so a Route can be moved to another Channel in one go.
+		/// @param changes modifications to apply.
+		/// @throw std::invalid_argument if a removed Route doesn't exist or an added one is already in use. Route table is left unchanged then.
+		void ApplyChanges(Changes const& changes);
+
+		/// Releases capacity of the Route table left by Routes removed since it was largest.
+		void TrimMemory();
+
 	private:
-		SafeSmartPointerContainer<std::shared_ptr<Route>> m_Routes;														///< Table of Routes.
+		/// Adds Route to secondary indexes.
+		/// @param route Route to add.
+		void AddToIndexes(std::shared_ptr<Route> const& route);
+
+		/// Removes all Routes using the outgoing Channel. Must be called with m_AccessMutex locked exclusively.
+		/// @param outgoingDeviceId DeviceId of the outgoing Channel.
+		void EraseChannelRoutes(DeviceId outgoingDeviceId);
+
+		/// Removes Route from secondary indexes.
+		/// @param route Route to remove.
+		void RemoveFromIndexes(std::shared_ptr<Route> const& route);
+
+		mutable std::shared_mutex m_AccessMutex;																		///< Readers share the lock, modifications are exclusive.
+		std::unordered_map<RouteId, std::shared_ptr<Route>, RouteId::Hash> m_Routes;									///< Table of Routes.
+		std::unordered_multimap<AgentId::UnderlyingIntegerType, std::shared_ptr<Route>> m_RoutesByAgent;				///< Routes indexed by receiving Agent.
+		std::unordered_multimap<DeviceId::UnderlyingIntegerType, std::shared_ptr<Route>> m_RoutesByOutgoingDevice;		///< Routes indexed by outgoing Channel.
+		std::atomic<std::uint64_t> m_RoutesVersion = 0;																	///< Incremented on every modification of the Route table.
 	};
 }
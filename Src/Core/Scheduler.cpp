@@ -0,0 +1,170 @@
+#include "StdAfx.h"
+#include "Scheduler.h"
+#include "DeviceBridge.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::Scheduler> FSecure::C3::Core::Scheduler::Create(std::size_t workerCount)
+{
+	return Create(ThreadPoolSettings{ workerCount });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::Scheduler> FSecure::C3::Core::Scheduler::Create(ThreadPoolSettings const& settings)
+{
+	if (!settings.m_WorkerCount)
+		throw std::invalid_argument{ OBF("Scheduler requires at least one worker thread.") };
+
+	auto scheduler = std::shared_ptr<Scheduler>{ new Scheduler };
+
+	// Threads keep the Scheduler alive, so the owner never has to join them.
+	try
+	{
+		settings.StartThread([self = scheduler]() { self->RunTimer(); });
+		for (auto i = 0u; i < settings.m_WorkerCount; ++i)
+			settings.StartThread([self = scheduler]() { self->RunWorker(); });
+	}
+	catch (...)
+	{
+		scheduler->Stop();
+		throw;
+	}
+
+	return scheduler;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Scheduler::Schedule(std::shared_ptr<DeviceBridge> device, std::chrono::milliseconds delay)
+{
+	auto ticks = std::max<std::size_t>(1, static_cast<std::size_t>((delay + s_TickDuration - 1ms) / s_TickDuration));
+
+	auto lock = std::lock_guard<std::mutex>{ m_AccessMutex };
+	if (!m_IsRunning)
+		return;
+
+	m_Wheel[(m_CurrentSlot + ticks) % s_WheelSize].push_back({ std::move(device), (ticks - 1) / s_WheelSize });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Scheduler::Expedite(DeviceBridge const& device, std::chrono::milliseconds delay)
+{
+	Move(device, delay, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Scheduler::Reschedule(DeviceBridge const& device, std::chrono::milliseconds delay)
+{
+	Move(device, delay, false);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Scheduler::Remove(DeviceBridge const& device)
+{
+	// Device is released outside of the lock. Its destruction might lead to destruction of the Relay, which in turn calls Stop().
+	std::shared_ptr<DeviceBridge> removed;
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_AccessMutex };
+		for (auto& slot : m_Wheel)
+			if (auto it = std::find_if(slot.begin(), slot.end(), [&](Entry const& e) { return e.m_Device.get() == &device; }); it != slot.end())
+			{
+				removed = std::move(it->m_Device);
+				slot.erase(it);
+				break;
+			}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Scheduler::Move(DeviceBridge const& device, std::chrono::milliseconds delay, bool onlySooner)
+{
+	auto ticks = std::max<std::size_t>(1, static_cast<std::size_t>((delay + s_TickDuration - 1ms) / s_TickDuration));
+
+	auto lock = std::lock_guard<std::mutex>{ m_AccessMutex };
+	if (!m_IsRunning)
+		return;
+
+	for (auto i = 0u; i < s_WheelSize; ++i)
+	{
+		auto& slot = m_Wheel[i];
+		auto it = std::find_if(slot.begin(), slot.end(), [&](Entry const& e) { return e.m_Device.get() == &device; });
+		if (it == slot.end())
+			continue;
+
+		// Current slot was already processed this round, so its entries are due after a full revolution.
+		auto distance = (i + s_WheelSize - m_CurrentSlot) % s_WheelSize;
+		auto remaining = (distance ? distance : s_WheelSize) + it->m_Rounds * s_WheelSize;
+		if (!onlySooner || ticks < remaining)
+		{
+			auto entry = std::move(*it);
+			slot.erase(it);
+			entry.m_Rounds = (ticks - 1) / s_WheelSize;
+			m_Wheel[(m_CurrentSlot + ticks) % s_WheelSize].push_back(std::move(entry));
+		}
+
+		return;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Scheduler::Stop()
+{
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_AccessMutex };
+		m_IsRunning = false;
+	}
+
+	m_ReadyCondition.notify_all();
+	m_StopCondition.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Scheduler::RunTimer()
+{
+	auto nextTick = std::chrono::steady_clock::now();
+	auto lock = std::unique_lock<std::mutex>{ m_AccessMutex };
+	while (m_IsRunning)
+	{
+		nextTick += s_TickDuration;
+		if (m_StopCondition.wait_until(lock, nextTick, [this] { return !m_IsRunning; }))
+			return;
+
+		m_CurrentSlot = (m_CurrentSlot + 1) % s_WheelSize;
+		auto& slot = m_Wheel[m_CurrentSlot];
+		auto due = std::partition(slot.begin(), slot.end(), [](Entry const& e) { return e.m_Rounds != 0; });
+		for (auto it = slot.begin(); it != due; ++it)
+			--it->m_Rounds;
+
+		if (due == slot.end())
+			continue;
+
+		for (auto it = due; it != slot.end(); ++it)
+			m_Ready.push_back(std::move(it->m_Device));
+
+		slot.erase(due, slot.end());
+		m_ReadyCondition.notify_all();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::Scheduler::RunWorker()
+{
+	while (true)
+	{
+		std::shared_ptr<DeviceBridge> device;
+		{
+			auto lock = std::unique_lock<std::mutex>{ m_AccessMutex };
+			m_ReadyCondition.wait(lock, [this] { return !m_IsRunning || !m_Ready.empty(); });
+			if (!m_IsRunning)
+				return;
+
+			device = std::move(m_Ready.front());
+			m_Ready.pop_front();
+		}
+
+		// Device is released outside of the lock. Its destruction might lead to destruction of the Relay, which in turn calls Stop().
+		if (device->UpdateOnce())
+		{
+			auto delay = device->GetUpdateDelay();
+			Schedule(std::move(device), delay);
+		}
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "ThreadPoolSettings.h"
+
+namespace FSecure::C3::Core
+{
+	// Forward declarations.
+	struct DeviceBridge;
+
+	/// Hashed timer wheel that fires DeviceBridge::UpdateOnce on a bounded pool of worker threads.
+	/// Replaces a sleeping thread per Device. Each Device is rescheduled only after its update has finished, so a single Device is never updated from two workers at once.
+	struct Scheduler : std::enable_shared_from_this<Scheduler>
+	{
+		/// Number of worker threads used if not configured otherwise.
+		static constexpr std::size_t s_DefaultWorkerCount = 4;
+
+		/// Resolution of the timer wheel.
+		static constexpr std::chrono::milliseconds s_TickDuration = 10ms;
+
+		/// Number of slots in the timer wheel. Delays longer than s_WheelSize * s_TickDuration are handled by counting wheel rounds.
+		static constexpr std::size_t s_WheelSize = 512;
+
+		/// Factory method. Creates Scheduler and starts its timer and worker threads.
+		/// @param workerCount number of threads that will call Device updates. Must be greater than 0.
+		/// @return newly created Scheduler.
+		/// @throws std::invalid_argument if workerCount is 0.
+		static std::shared_ptr<Scheduler> Create(std::size_t workerCount);
+
+		/// Factory method. Creates Scheduler and starts its timer and worker threads on chosen processors. Timer thread is placed as the workers are.
+		/// @param settings number and placement of threads that will call Device updates. Number must be greater than 0.
+		/// @return newly created Scheduler.
+		/// @throws std::invalid_argument if number of threads is 0. std::runtime_error if threads couldn't be placed.
+		static std::shared_ptr<Scheduler> Create(ThreadPoolSettings const& settings);
+
+		/// Adds Device to the wheel.
+		/// @param device Device to update. Scheduler holds it until UpdateOnce returns false.
+		/// @param delay time after which the Device will be updated.
+		void Schedule(std::shared_ptr<DeviceBridge> device, std::chrono::milliseconds delay);
+
+		/// Brings forward the update of a Device waiting in the wheel. Does nothing if Device is due sooner, or is being updated, as it is rescheduled with its current delay afterwards.
+		/// @param device Device to update.
+		/// @param delay time after which the Device should be updated.
+		void Expedite(DeviceBridge const& device, std::chrono::milliseconds delay);
+
+		/// Moves the update of a Device waiting in the wheel, sooner or later, e.g. after its update delay was changed. Does nothing if Device is being updated.
+		/// @param device Device to update.
+		/// @param delay time after which the Device should be updated.
+		void Reschedule(DeviceBridge const& device, std::chrono::milliseconds delay);
+
+		/// Takes a detached Device out of the wheel, so that it is released right away instead of when it is due. Device being updated is released once UpdateOnce returns false.
+		/// @param device Device to remove.
+		void Remove(DeviceBridge const& device);
+
+		/// Stops all the threads. Does not wait for them to finish, so it is safe to call from a worker thread.
+		void Stop();
+
+	private:
+		/// Entry of a timer wheel slot.
+		struct Entry
+		{
+			std::shared_ptr<DeviceBridge> m_Device;																		///< Device to update.
+			std::size_t m_Rounds;																						///< Number of full wheel revolutions left before the Device is due.
+		};
+
+		/// Private ctor. @see Scheduler::Create.
+		Scheduler() = default;
+
+		/// Moves Device's entry to the slot due after delay.
+		/// @param device Device to update.
+		/// @param delay time after which the Device should be updated.
+		/// @param onlySooner true to leave the entry in place if it is due sooner.
+		void Move(DeviceBridge const& device, std::chrono::milliseconds delay, bool onlySooner);
+
+		/// Timer thread body. Advances the wheel every s_TickDuration and moves due Devices to the ready queue.
+		void RunTimer();
+
+		/// Worker thread body. Takes Devices from the ready queue, updates them and reschedules.
+		void RunWorker();
+
+		std::mutex m_AccessMutex;																						///< Guards the wheel and the ready queue.
+		std::condition_variable m_ReadyCondition;																		///< Notified when the ready queue is not empty or Scheduler is stopping.
+		std::condition_variable m_StopCondition;																		///< Used by the timer thread to wait for the next tick.
+		std::array<std::vector<Entry>, s_WheelSize> m_Wheel;															///< Timer wheel slots.
+		std::size_t m_CurrentSlot = 0;																					///< Slot processed during the last tick.
+		std::deque<std::shared_ptr<DeviceBridge>> m_Ready;																///< Devices which are due for an update.
+		bool m_IsRunning = true;																						///< False after Stop() was called.
+	};
+}
@@ -11,6 +11,12 @@
 #include <type_traits>																									//< For traits.
 #include <iostream>																										//< For std::cout. Parts that are common for NodeRelay and GateRelay should not use it.
 #include <future>																										//< For async
+#include <deque>																										//< For std::deque.
+#include <condition_variable>																							//< For std::condition_variable.
+#include <shared_mutex>																									//< For std::shared_mutex.
+#include <unordered_map>																								//< For std::unordered_map.
+#include <unordered_set>																								//< For std::unordered_set.
+#include <execution>																									//< For parallel algorithms.
 
 // External dependencies.
 #include "Common/json/json.hpp"																							//< For json.
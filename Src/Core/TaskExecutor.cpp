@@ -0,0 +1,141 @@
+#include "StdAfx.h"
+#include "TaskExecutor.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::TaskExecutor> FSecure::C3::Core::TaskExecutor::Create(std::size_t workerCount)
+{
+	return Create(ThreadPoolSettings{ workerCount });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::TaskExecutor> FSecure::C3::Core::TaskExecutor::Create(ThreadPoolSettings const& settings)
+{
+	if (!settings.m_WorkerCount)
+		throw std::invalid_argument{ OBF("TaskExecutor requires at least one worker thread.") };
+
+	auto executor = std::shared_ptr<TaskExecutor>{ new TaskExecutor };
+
+	// Threads keep the TaskExecutor alive, so the owner never has to join them.
+	try
+	{
+		for (auto i = 0u; i < settings.m_WorkerCount; ++i)
+			settings.StartThread([self = executor]() { self->RunWorker(); });
+	}
+	catch (...)
+	{
+		executor->Stop();
+		throw;
+	}
+
+	return executor;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::TaskExecutor::Post(std::string orderingKey, Priority priority, std::function<void()> task)
+{
+	auto lock = std::lock_guard<std::mutex>{ m_AccessMutex };
+	if (!m_IsRunning)
+		return;
+
+	// Key that is already present is either waiting in a ready queue or has a running task. It will be made ready again when that task finishes.
+	auto [it, isNew] = m_Tasks.try_emplace(std::move(orderingKey));
+	it->second.push_back({ priority, std::move(task) });
+	++m_QueueDepth;
+	if (isNew)
+	{
+		MakeReady(it->first);
+		m_ReadyCondition.notify_one();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::TaskExecutor::WaitUntilIdle()
+{
+	auto lock = std::unique_lock<std::mutex>{ m_AccessMutex };
+	m_IdleCondition.wait(lock, [this] { return !m_QueueDepth; });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::size_t FSecure::C3::Core::TaskExecutor::GetQueueDepth() const
+{
+	auto lock = std::lock_guard<std::mutex>{ m_AccessMutex };
+	return m_QueueDepth;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::TaskExecutor::Stop()
+{
+	{
+		auto lock = std::lock_guard<std::mutex>{ m_AccessMutex };
+		m_IsRunning = false;
+
+		// Drop tasks that didn't start. Only keys of running tasks are left, to be removed by their workers.
+		for (auto& ready : m_Ready)
+		{
+			for (auto& key : ready)
+			{
+				m_QueueDepth -= m_Tasks[key].size();
+				m_Tasks.erase(key);
+			}
+
+			ready.clear();
+		}
+
+		for (auto& [key, tasks] : m_Tasks)
+			if (tasks.size() > 1)
+			{
+				m_QueueDepth -= tasks.size() - 1;
+				tasks.erase(tasks.begin() + 1, tasks.end());
+			}
+	}
+
+	m_ReadyCondition.notify_all();
+	m_IdleCondition.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::TaskExecutor::MakeReady(std::string const& orderingKey)
+{
+	m_Ready[static_cast<std::size_t>(m_Tasks.at(orderingKey).front().m_Priority)].push_back(orderingKey);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::TaskExecutor::RunWorker()
+{
+	auto lock = std::unique_lock<std::mutex>{ m_AccessMutex };
+	while (true)
+	{
+		m_ReadyCondition.wait(lock, [this] { return !m_IsRunning || std::any_of(m_Ready.begin(), m_Ready.end(), [](auto const& ready) { return !ready.empty(); }); });
+		if (!m_IsRunning)
+			return;
+
+		auto& ready = *std::find_if(m_Ready.begin(), m_Ready.end(), [](auto const& ready) { return !ready.empty(); });
+		auto key = std::move(ready.front());
+		ready.pop_front();
+
+		// Task stays at the front of its queue while it runs, which marks the key as busy.
+		auto function = std::move(m_Tasks.at(key).front().m_Function);
+		lock.unlock();
+		try
+		{
+			function();
+		}
+		catch (...)
+		{
+		}
+
+		// Function with its captures is released outside of the lock.
+		function = nullptr;
+		lock.lock();
+
+		auto& tasks = m_Tasks.at(key);
+		tasks.pop_front();
+		if (tasks.empty())
+			m_Tasks.erase(key);
+		else if (m_IsRunning)
+			MakeReady(key);
+
+		if (!--m_QueueDepth)
+			m_IdleCondition.notify_all();
+	}
+}
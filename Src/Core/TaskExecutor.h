@@ -0,0 +1,74 @@
+#pragma once
+
+#include "ThreadPoolSettings.h"
+
+namespace FSecure::C3::Core
+{
+	/// Bounded pool of worker threads running queued tasks.
+	/// Tasks posted with the same ordering key are run one at a time in order of posting. Tasks with different keys run in parallel.
+	struct TaskExecutor : std::enable_shared_from_this<TaskExecutor>
+	{
+		/// Number of worker threads used if not configured otherwise.
+		static constexpr std::size_t s_DefaultWorkerCount = 4;
+
+		/// Priority of a task. Workers pick ordering keys whose next task has higher priority first.
+		enum class Priority
+		{
+			High,
+			Normal,
+		};
+
+		/// Factory method. Creates TaskExecutor and starts its worker threads.
+		/// @param workerCount number of threads running tasks. Must be greater than 0.
+		/// @return newly created TaskExecutor.
+		/// @throws std::invalid_argument if workerCount is 0.
+		static std::shared_ptr<TaskExecutor> Create(std::size_t workerCount = s_DefaultWorkerCount);
+
+		/// Factory method. Creates TaskExecutor and starts its worker threads on chosen processors.
+		/// @param settings number and placement of threads running tasks. Number must be greater than 0.
+		/// @return newly created TaskExecutor.
+		/// @throws std::invalid_argument if number of threads is 0. std::runtime_error if threads couldn't be placed.
+		static std::shared_ptr<TaskExecutor> Create(ThreadPoolSettings const& settings);
+
+		/// Queues a task.
+		/// @param orderingKey tasks with the same key are never run concurrently and are run in order of posting.
+		/// @param priority priority of the task.
+		/// @param task function to call. Exceptions thrown from it are swallowed.
+		void Post(std::string orderingKey, Priority priority, std::function<void()> task);
+
+		/// Blocks until all queued tasks are finished.
+		void WaitUntilIdle();
+
+		/// @return number of tasks queued or being run.
+		std::size_t GetQueueDepth() const;
+
+		/// Stops all the threads. Tasks that didn't start are dropped. Does not wait for running tasks, so it is safe to call from a task.
+		void Stop();
+
+	private:
+		/// Queued task.
+		struct Task
+		{
+			Priority m_Priority;																						///< Priority of the task.
+			std::function<void()> m_Function;																			///< Function to call.
+		};
+
+		/// Private ctor. @see TaskExecutor::Create.
+		TaskExecutor() = default;
+
+		/// Worker thread body. Takes ordering keys from the ready queues and runs their next task.
+		void RunWorker();
+
+		/// Puts ordering key in the ready queue matching priority of its next task. Must be called with m_AccessMutex taken.
+		/// @param orderingKey key that has at least one queued task.
+		void MakeReady(std::string const& orderingKey);
+
+		mutable std::mutex m_AccessMutex;																				///< Guards all the queues.
+		std::condition_variable m_ReadyCondition;																		///< Notified when a ready queue is not empty or TaskExecutor is stopping.
+		std::condition_variable m_IdleCondition;																		///< Notified when the last queued task has finished.
+		std::unordered_map<std::string, std::deque<Task>> m_Tasks;														///< Queued tasks by ordering key. Key is present while it has queued or running tasks.
+		std::array<std::deque<std::string>, 2> m_Ready;																	///< Keys which have a task to run and none running, one queue per Priority.
+		std::size_t m_QueueDepth = 0;																					///< Number of tasks queued or being run.
+		bool m_IsRunning = true;																						///< False after Stop() was called.
+	};
+}
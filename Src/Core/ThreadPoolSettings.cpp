@@ -0,0 +1,18 @@
+#include "StdAfx.h"
+#include "ThreadPoolSettings.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::ThreadPoolSettings::StartThread(std::function<void()> body) const
+{
+	// Handle of the thread is closed when it's detached, so placement has to be set first.
+	std::thread thread{ std::move(body) };
+	auto affinityError = m_AffinityMask && !SetThreadAffinityMask(thread.native_handle(), static_cast<DWORD_PTR>(m_AffinityMask)) ? GetLastError() : ERROR_SUCCESS;
+	auto priorityError = m_Priority != THREAD_PRIORITY_NORMAL && !SetThreadPriority(thread.native_handle(), m_Priority) ? GetLastError() : ERROR_SUCCESS;
+	thread.detach();
+
+	if (affinityError != ERROR_SUCCESS)
+		throw std::runtime_error{ OBF("Couldn't set affinity of worker thread. Error: ") + std::to_string(affinityError) };
+
+	if (priorityError != ERROR_SUCCESS)
+		throw std::runtime_error{ OBF("Couldn't set priority of worker thread. Error: ") + std::to_string(priorityError) };
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+namespace FSecure::C3::Core
+{
+	/// Size and placement of a pool of worker threads. Pools can be kept on chosen processors, away from other services of the host.
+	struct ThreadPoolSettings
+	{
+		std::size_t m_WorkerCount = 0;																					///< Number of threads.
+		std::uint64_t m_AffinityMask = 0;																				///< Processors the threads run on, one bit per processor of the process's group. 0 leaves affinity of the process.
+		int m_Priority = THREAD_PRIORITY_NORMAL;																		///< Priority of the threads, one of THREAD_PRIORITY_* values.
+
+		/// Starts a detached thread placed according to these settings.
+		/// @param body function run by the thread.
+		/// @throws std::runtime_error if the system refused affinity or priority. Thread is started anyway, owner of the pool should stop it.
+		void StartThread(std::function<void()> body) const;
+	};
+}
@@ -0,0 +1,113 @@
+#include "StdAfx.h"
+#include "TrafficCapture.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Core::TrafficCapture::~TrafficCapture()
+{
+	std::scoped_lock lock(m_Mutex);
+	Close();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::TrafficCapture::Start(std::filesystem::path const& path, std::uint64_t sizeLimit)
+{
+	std::scoped_lock lock(m_Mutex);
+	Close();
+
+	m_File.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+	auto header = ByteVector{}.Write(s_Signature, s_Version);
+	if (!m_File || !m_File.write(reinterpret_cast<char const*>(header.data()), header.size()))
+	{
+		m_File.close();
+		m_File.clear();
+		throw std::runtime_error{ OBF("Failed to create capture file.") };
+	}
+
+	m_Start = std::chrono::steady_clock::now();
+	m_Size = header.size();
+	m_SizeLimit = sizeLimit;
+	m_IsActive = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::TrafficCapture::Stop()
+{
+	std::scoped_lock lock(m_Mutex);
+	Close();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Core::TrafficCapture::IsActive() const
+{
+	return m_IsActive.load(std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::TrafficCapture::Record(Direction direction, ByteView frame)
+{
+	if (!IsActive())
+		return;
+
+	std::scoped_lock lock(m_Mutex);
+	if (!m_File.is_open())
+		return;
+
+	// Time is taken under the lock, so that records are ordered by it.
+	auto time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_Start);
+	auto record = ByteVector{}.Write(static_cast<std::uint64_t>(time.count()), direction, frame);
+	if (m_Size + record.size() > m_SizeLimit)
+		return;
+
+	// Capture is a diagnostic aid. A failed write ends it instead of disturbing the traffic.
+	if (!m_File.write(reinterpret_cast<char const*>(record.data()), record.size()))
+		return Close();
+
+	m_Size += record.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::C3::Core::TrafficCapture::Frame> FSecure::C3::Core::TrafficCapture::Load(std::filesystem::path const& path)
+{
+	std::ifstream file{ path, std::ios::binary };
+	if (!file)
+		throw std::runtime_error{ OBF("Failed to open capture file.") };
+
+	ByteVector content;
+	content.resize(static_cast<size_t>(std::filesystem::file_size(path)));
+	if (!file.read(reinterpret_cast<char*>(content.data()), content.size()))
+		throw std::runtime_error{ OBF("Failed to read capture file.") };
+
+	if (content.size() < s_HeaderSize)
+		throw std::runtime_error{ OBF("Capture file is too short.") };
+
+	auto view = ByteView{ content };
+	if (auto [signature, version] = view.Read<std::uint32_t, std::uint16_t>(); signature != s_Signature || version != s_Version)
+		throw std::runtime_error{ OBF("Unsupported capture file.") };
+
+	// Record is cut short if the Relay was killed while writing it.
+	std::vector<Frame> frames;
+	try
+	{
+		while (!view.empty())
+		{
+			auto [time, direction, data] = view.Read<std::uint64_t, Direction, ByteView>();
+			frames.push_back({ std::chrono::microseconds{ time }, direction, ByteVector{ data } });
+		}
+	}
+	catch (std::out_of_range&)
+	{
+	}
+
+	return frames;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Core::TrafficCapture::Close()
+{
+	m_IsActive = false;
+	if (!m_File.is_open())
+		return;
+
+	m_File.close();
+	m_File.clear();
+}
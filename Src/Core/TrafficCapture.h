@@ -0,0 +1,73 @@
+#pragma once
+
+namespace FSecure::C3::Core
+{
+	/// Records frames passing between a Channel and its DeviceBridge to a file, so that real-world traffic can be replayed by RelayBenchmark.
+	/// Frames are stored as they travel through the Channel, i.e. with QoS headers and encrypted with Network's key. Safe to call from any thread.
+	struct TrafficCapture
+	{
+		/// Which way a frame went through the Channel.
+		enum class Direction : std::uint8_t
+		{
+			Received,																								///< Frame passed from the Channel to the Relay.
+			Sent,																									///< Frame accepted by the Channel from the Relay.
+		};
+
+		/// Captured frame.
+		struct Frame
+		{
+			std::chrono::microseconds m_Time;																		///< Time since the capture was started.
+			Direction m_Direction;																					///< Way the frame went.
+			ByteVector m_Data;																						///< Frame with QoS header.
+		};
+
+		/// First bytes of every capture file.
+		static constexpr std::uint32_t s_Signature = 0x50414333;
+
+		/// Version of the file layout.
+		static constexpr std::uint16_t s_Version = 1;
+
+		/// Size of the capture file if not configured otherwise.
+		static constexpr std::uint64_t s_DefaultSizeLimit = 64 * 1024 * 1024;
+
+		/// Destructor. Closes the capture file.
+		~TrafficCapture();
+
+		/// Starts recording to a new file. Capture in progress is stopped first.
+		/// @param path location of the file. Existing file is overwritten.
+		/// @param sizeLimit size of the file in bytes. Frames that don't fit are not recorded.
+		/// @throws std::runtime_error if file can't be created.
+		void Start(std::filesystem::path const& path, std::uint64_t sizeLimit = s_DefaultSizeLimit);
+
+		/// Stops recording and closes the file. Does nothing if capture is not running.
+		void Stop();
+
+		/// @return true if frames are being recorded.
+		bool IsActive() const;
+
+		/// Appends a frame to the capture file. Costs one check if capture is not running.
+		/// @param direction way the frame went.
+		/// @param frame frame with QoS header.
+		void Record(Direction direction, ByteView frame);
+
+		/// Reads a capture file.
+		/// @param path location of the file.
+		/// @return all recorded frames, oldest first.
+		/// @throws std::runtime_error if file can't be read or is not a capture file.
+		static std::vector<Frame> Load(std::filesystem::path const& path);
+
+	private:
+		/// Size of the file header.
+		static constexpr std::uint64_t s_HeaderSize = sizeof(s_Signature) + sizeof(s_Version);
+
+		/// Closes the file. Must be called with m_Mutex taken.
+		void Close();
+
+		std::mutex m_Mutex;																								///< Guards members below, apart from m_IsActive.
+		std::atomic<bool> m_IsActive = false;																			///< True if m_File is open.
+		std::ofstream m_File;																							///< Capture file.
+		std::chrono::steady_clock::time_point m_Start;																	///< Time the capture was started.
+		std::uint64_t m_Size = 0;																						///< Bytes written to m_File.
+		std::uint64_t m_SizeLimit = 0;																					///< Size that m_File must not exceed.
+	};
+}
@@ -5,6 +5,17 @@
 /// @param argv vector of program arguments.
 int main(int argc, char * argv[])
 {
+	// Gateway executable is started again to host Connectors that run out of process. Such host has no console and logs through Gateway.
+	try
+	{
+		if (FSecure::C3::Utils::RunConnectorHostIfRequested(argc, argv))
+			return 0;
+	}
+	catch (...)
+	{
+		return 1;
+	}
+
 	std::cout << OBF("Custom Command and Control - GatewayConsoleExe. BUILD: ") << OBF(C3_BUILD_VERSION) << std::endl << std::endl;
 
 	try
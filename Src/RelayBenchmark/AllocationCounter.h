@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Core/AllocationTracking.h"
+
+namespace FSecure::C3::Benchmark
+{
+	/// Counts heap allocations made through global operator new, which is replaced in this executable.
+	/// In instrumented builds operator new is replaced by Core, which also counts allocations of every subsystem of the packet pipeline. @see Core::AllocationTracking.
+	struct AllocationCounter
+	{
+		/// State of counters.
+		struct Snapshot
+		{
+			uint64_t m_Allocations = 0;																					///< Number of calls to operator new.
+			uint64_t m_Bytes = 0;																						///< Sum of requested bytes.
+			Core::AllocationTracking::Snapshot m_Subsystems;															///< Counters of every subsystem. All zero if the build is not instrumented.
+
+			/// Get allocations made between two readings.
+			/// @param earlier counters read before this ones.
+			/// @return difference of all counters.
+			Snapshot operator -(Snapshot const& earlier) const;
+		};
+
+		/// Read counters. Safe to call from any thread.
+		/// @return counters since the start of the process.
+		static Snapshot Get();
+
+		/// Describe allocations of every subsystem for a report.
+		/// @param allocations counters to describe.
+		/// @param count number of packets, frames or iterations the counters are divided by.
+		/// @return object with allocations and bytes per count of every subsystem, or nothing if the build is not instrumented.
+		static std::optional<json> DescribeSubsystems(Snapshot const& allocations, double count);
+	};
+}
@@ -0,0 +1,474 @@
+#include "StdAfx.h"
+#include "Mesh.h"
+
+namespace
+{
+	std::atomic<size_t> g_Errors = 0;																					///< Number of errors logged by all Relays.
+
+	/// Read processor time used by the process.
+	/// @return kernel and user time of all threads.
+	std::chrono::nanoseconds GetProcessCpuTime()
+	{
+		FILETIME creation, exit, kernel, user;
+		if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+			throw std::runtime_error{ "Couldn't read process times. Error: " + std::to_string(GetLastError()) };
+
+		auto toHundredsOfNanoseconds = [](FILETIME const& time) { return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+		return std::chrono::nanoseconds{ (toHundredsOfNanoseconds(kernel) + toHundredsOfNanoseconds(user)) * 100 };
+	}
+
+	/// Compute percentile of sorted samples.
+	/// @param sorted samples in ascending order.
+	/// @param percentile value from 0 to 100.
+	/// @return sample at given percentile, or 0 if there are no samples.
+	double Percentile(std::vector<double> const& sorted, double percentile)
+	{
+		if (sorted.empty())
+			return 0.0;
+
+		auto index = static_cast<size_t>(percentile / 100.0 * (sorted.size() - 1) + 0.5);
+		return sorted[std::min(index, sorted.size() - 1)];
+	}
+
+	/// Convert duration to milliseconds.
+	/// @param duration duration to convert.
+	/// @return milliseconds with fraction.
+	double ToMilliseconds(std::chrono::steady_clock::duration duration)
+	{
+		return std::chrono::duration<double, std::milli>{ duration }.count();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::BenchmarkRelay::BenchmarkRelay(LoggerCallback callbackOnLog, Crypto::PublicSignature const& gatewaySignature, Crypto::SymmetricKey const& broadcastKey, Crypto::AsymmetricKeys const& asymmetricKeys,
+	QualityOfService::Settings const& qosSettings)
+	: NodeRelay{ callbackOnLog, InterfaceFactory::Instance(), gatewaySignature, broadcastKey, BuildId{ 0 }, AgentId::GenerateRandom(), asymmetricKeys, Core::Scheduler::s_DefaultWorkerCount, qosSettings }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::shared_ptr<FSecure::C3::Core::DeviceBridge> FSecure::C3::Benchmark::BenchmarkRelay::AddDevice(DeviceId did, HashT deviceNameHash, ByteView commandLine)
+{
+	return CreateAndAttachDevice(did, deviceNameHash, false, commandLine);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::GatewayStub::GatewayStub(Crypto::SignatureKeys const& signatures, Crypto::SymmetricKey const& broadcastKey, std::shared_ptr<Interfaces::Channels::InMemory::Buffer> input,
+	std::shared_ptr<Interfaces::Channels::InMemory::Buffer> output)
+	: m_Signature{ signatures.first }
+	, m_AuthenticationKey{ Crypto::ConvertToKey(signatures.second) }
+	, m_DecryptionKey{ Crypto::ConvertToKey(signatures.first) }
+	, m_BroadcastKey{ broadcastKey }
+	, m_Input{ std::move(input) }
+	, m_Output{ std::move(output) }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::Crypto::SharedKey FSecure::C3::Benchmark::GatewayStub::GetSharedKey(Crypto::PublicKey const& relayKey) const
+{
+	return Crypto::PrecomputeSharedKey(relayKey, m_DecryptionKey);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Benchmark::GatewayStub::PostCommandToPeripheral(RouteId routeId, Crypto::SharedKey const& sharedKey, DeviceId peripheral, ByteView message)
+{
+	auto query = Core::ProceduresG2X::DeliverToBinder::Create(routeId, m_Signature, sharedKey, peripheral, message);
+	auto packet = Crypto::EncryptAnonymously(query.ComposeQueryPacket(), m_BroadcastKey);
+
+	// Chunked like DeviceBridge::SendNetworkPacket does. Queues accept whole frames, rings may trim them or accept nothing until the root Relay reads from them.
+	auto packetId = m_OutgoingPacketId++;
+	auto chunkId = 0u;
+	for (auto remaining = ByteView{ packet }; !remaining.empty();)
+		if (auto written = m_Output->Write(ByteVector{}.Write(packetId, chunkId, static_cast<uint32_t>(packet.size())).Concat(remaining)); written > QualityOfService::s_HeaderSize)
+		{
+			remaining.remove_prefix(written - QualityOfService::s_HeaderSize);
+			++chunkId;
+		}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::C3::Benchmark::GatewayStub::Arrival> FSecure::C3::Benchmark::GatewayStub::ReceiveFromBinders()
+{
+	std::vector<Arrival> arrivals;
+	for (auto& frame : m_Input->ReadAll())
+	{
+		if (QualityOfService::IsRetransmissionRequest(frame))
+			continue;
+
+		m_QoS.PushReceivedChunk(frame);
+		for (auto packet = m_QoS.GetNextPacket(); !packet.empty(); packet = m_QoS.GetNextPacket())
+		{
+			auto now = std::chrono::steady_clock::now();
+			auto unlocked = Crypto::DecryptFromAnonymous(packet, m_BroadcastKey);
+			auto readView = ByteView{ unlocked };
+			if (readView.Read<Core::ProtocolsUnderlyingType>() != static_cast<Core::ProtocolsUnderlyingType>(Core::Protocols::S2G))
+				throw std::runtime_error{ "Gateway received packet that is not S2G." };
+
+			// Same layout as read by GateRelay::On(ProceduresS2G::DeliverToBinder).
+			auto decrypted = Crypto::DecryptFromAnonymous(readView, m_AuthenticationKey, m_DecryptionKey);
+			auto decryptedView = ByteView{ decrypted };
+			auto [procedure, senderRid, timestamp, deviceId, connectorHash] = decryptedView.Read<Core::ProceduresUnderlyingType, RouteId, int32_t, DeviceId, HashT>();
+			if (procedure != Core::ProceduresS2G::DeliverToBinder::GetProcedureNumberConstexpr())
+				throw std::runtime_error{ "Gateway received S2G packet that is not DeliverToBinder." };
+
+			auto message = Core::UnpackBinderMessage(decryptedView);
+			arrivals.push_back({ ByteView{ message }.Read<uint32_t>(), now });
+		}
+	}
+
+	return arrivals;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::Mesh::Mesh(MeshConfig config)
+	: m_Config{ std::move(config) }
+	, m_GatewaySignatures{ Crypto::GenerateSignatureKeys() }
+	, m_BroadcastKey{ Crypto::GenerateSymmetricKey() }
+{
+	if (!m_Config.m_Relays || m_Config.m_Relays > std::numeric_limits<DeviceId::UnderlyingIntegerType>::max() - s_FirstChildChannelId)
+		throw std::invalid_argument{ "Invalid number of Relays: " + std::to_string(m_Config.m_Relays) + "." };
+
+	if (m_Config.m_PacketSize < sizeof(uint32_t))
+		throw std::invalid_argument{ "Packet must be at least " + std::to_string(sizeof(uint32_t)) + " bytes long." };
+
+	if (m_Config.m_Network && m_Config.m_SharedMemory)
+		throw std::invalid_argument{ "Emulated network doesn't use shared memory." };
+
+	// Buffers may outlive Meshes, so every Mesh needs its own names.
+	static std::atomic<uint32_t> meshCounter = 0;
+	m_QueuePrefix = "Mesh" + std::to_string(meshCounter++) + "/";
+	auto queueName = [this](std::string_view direction, size_t index) { return m_QueuePrefix + std::string{ direction } + std::to_string(index); };
+	auto channelHash = m_Config.m_Network ? Hash::Fnv1aType<Interfaces::Channels::NetworkEmulator>() : Hash::Fnv1aType<Interfaces::Channels::InMemory>();
+	auto channelArguments = [this](std::string const& input, std::string const& output)
+	{
+		auto updateDelay = static_cast<uint16_t>(m_Config.m_UpdateDelay.count());
+		if (auto const& network = m_Config.m_Network)
+			return ByteVector{}.Write(input, output, static_cast<uint16_t>(network->m_Latency.count()), static_cast<uint16_t>(network->m_Jitter.count()), static_cast<float>(network->m_LossRate * 100),
+				static_cast<float>(network->m_ReorderRate * 100), static_cast<uint16_t>(network->m_OperationCost.count()), network->m_Mtu, network->m_Bandwidth / 1024, updateDelay);
+
+		return ByteVector{}.Write(input, output, m_Config.m_SharedMemory, s_RingSize, updateDelay, uint16_t{ 0 });
+	};
+
+	// Root is connected to Gateway with buffers of index 0. Every other Node is connected to its parent with buffers of its own index.
+	auto gatewayBuffer = [this](std::string const& name) -> std::shared_ptr<Interfaces::Channels::InMemory::Buffer>
+	{
+		if (m_Config.m_SharedMemory)
+			return std::make_shared<Interfaces::Channels::InMemory::SharedRing>(name, s_RingSize * 1024u);
+
+		// Stub has no Channel to set conditions of the link it writes to. Setting them on the link it reads from too does no harm, root Relay's Channel sets the same ones.
+		if (m_Config.m_Network)
+		{
+			auto link = Interfaces::Channels::NetworkEmulator::GetLink(name);
+			link->SetConditions(*m_Config.m_Network);
+			return link;
+		}
+
+		return Interfaces::Channels::InMemory::GetQueue(name);
+	};
+
+	m_Gateway = std::make_unique<GatewayStub>(m_GatewaySignatures, m_BroadcastKey, gatewayBuffer(queueName("Up", 0)), gatewayBuffer(queueName("Down", 0)));
+	m_Nodes.resize(m_Config.m_Relays);
+	for (size_t i = 0; i < m_Nodes.size(); ++i)
+	{
+		auto& node = m_Nodes[i];
+		node.m_Parent = GetParent(i);
+		node.m_Hops = node.m_Parent ? m_Nodes[*node.m_Parent].m_Hops + 1 : 1;
+		node.m_Keys = Crypto::GenerateAsymmetricKeys();
+		node.m_SharedKey = m_Gateway->GetSharedKey(node.m_Keys.second);
+		node.m_Relay = std::make_shared<BenchmarkRelay>(&Mesh::Log, m_GatewaySignatures.second, m_BroadcastKey, node.m_Keys, m_Config.m_QoS);
+
+		auto gatewayReturnChannel = node.m_Relay->AddDevice(s_GatewayReturnChannelId, channelHash, channelArguments(queueName("Down", i), queueName("Up", i)));
+		node.m_RouteId = RouteId{ node.m_Relay->GetAgentId(), s_GatewayReturnChannelId };
+		if (node.m_Parent)
+			node.m_ParentChannel = m_Nodes[*node.m_Parent].m_Relay->AddDevice(DeviceId{ static_cast<DeviceId::UnderlyingIntegerType>(s_FirstChildChannelId + i) }, channelHash,
+				channelArguments(queueName("Up", i), queueName("Down", i)));
+
+		// Routes are added the way Gateway's AddRoute commands would add them after negotiation: every ancestor learns which of its Channels leads to the new Node.
+		for (auto child = i; m_Nodes[child].m_Parent; child = *m_Nodes[child].m_Parent)
+		{
+			auto& ancestor = m_Nodes[*m_Nodes[child].m_Parent];
+			ancestor.m_Relay->AddRoute(node.m_RouteId, m_Nodes[child].m_ParentChannel);
+			ancestor.m_Routes.push_back(node.m_RouteId);
+		}
+
+		for (size_t j = 0; j < m_Config.m_ExtraRoutes; ++j)
+		{
+			auto routeId = RouteId{ AgentId::GenerateRandom(), DeviceId{ 1 } };
+			node.m_Relay->AddRoute(routeId, gatewayReturnChannel);
+			node.m_Routes.push_back(routeId);
+		}
+	}
+
+	for (size_t i = 0; i < m_Nodes.size(); ++i)
+		if (std::none_of(m_Nodes.begin(), m_Nodes.end(), [i](auto const& node) { return node.m_Parent == i; }))
+		{
+			m_Nodes[i].m_Probe = m_Nodes[i].m_Relay->AddDevice(s_ProbeId, Hash::Fnv1aType<Interfaces::Peripherals::Probe>(), {});
+			m_Leaves.push_back(i);
+		}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::Mesh::~Mesh()
+{
+	// Children first, so that no packets are sent to closed Relays.
+	for (auto it = m_Nodes.rbegin(); it != m_Nodes.rend(); ++it)
+	{
+		it->m_Probe.reset();
+		it->m_ParentChannel.reset();
+		it->m_Relay->Close();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Benchmark::Mesh::Run()
+{
+	m_Upstream.assign(m_Config.m_Packets, {});
+	m_Downstream.assign(m_Config.m_Packets, {});
+	for (size_t i = 0; i < m_Config.m_Packets; ++i)
+		m_Upstream[i].m_Node = m_Downstream[i].m_Node = m_Leaves[i % m_Leaves.size()];
+
+	auto errorsBefore = g_Errors.load();
+	auto cpuTimeBefore = GetProcessCpuTime();
+	auto allocationsBefore = AllocationCounter::Get();
+	auto start = std::chrono::steady_clock::now();
+
+	// Senders report their failures as logged errors, WaitForArrivals will time out if any messages are missing.
+	auto sender = [](Mesh* mesh, void (Mesh::*send)())
+	{
+		try
+		{
+			(mesh->*send)();
+		}
+		catch (std::exception& exception)
+		{
+			Log({ "Sending failed. "s + exception.what(), LogMessage::Severity::Error }, "Benchmark");
+		}
+	};
+
+	// Arrivals are collected while messages are still being sent, otherwise Gateway's arrival times would include the whole sending phase.
+	std::thread upstream{ sender, this, &Mesh::SendUpstream };
+	std::thread downstream{ sender, this, &Mesh::SendDownstream };
+	std::exception_ptr failure;
+	auto lastArrival = start;
+	try
+	{
+		lastArrival = WaitForArrivals();
+	}
+	catch (...)
+	{
+		failure = std::current_exception();
+	}
+
+	upstream.join();
+	downstream.join();
+	if (failure)
+		std::rethrow_exception(failure);
+
+	// Lost messages are waited for until timeout. That time is not part of the delivery.
+	auto duration = lastArrival - start;
+	auto allocationsAfter = AllocationCounter::Get();
+	auto cpuTime = GetProcessCpuTime() - cpuTimeBefore;
+	m_Errors = g_Errors.load() - errorsBefore;
+	return MakeReport(duration, cpuTime, allocationsAfter - allocationsBefore, MeasureRouteLookup());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::optional<size_t> FSecure::C3::Benchmark::Mesh::GetParent(size_t index) const
+{
+	if (!index)
+		return {};
+
+	switch (m_Config.m_Topology)
+	{
+	case Topology::Chain: return index - 1;
+	case Topology::Star: return 0;
+	case Topology::Tree: return (index - 1) / 2;
+	default: throw std::logic_error{ "Unknown topology." };
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Benchmark::Mesh::MakeMessage(size_t index) const
+{
+	// Pseudo-random body, so that compression of binder messages doesn't make the benchmark meaningless.
+	auto message = ByteVector{}.Write(static_cast<uint32_t>(index));
+	std::minstd_rand generator{ static_cast<uint32_t>(index + 1) };
+	while (message.size() < m_Config.m_PacketSize)
+		message.push_back(static_cast<uint8_t>(generator()));
+
+	return message;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Benchmark::Mesh::SendUpstream()
+{
+	for (size_t i = 0; i < m_Upstream.size(); ++i)
+	{
+		auto message = MakeMessage(i);
+		m_Upstream[i].m_SendTime = std::chrono::steady_clock::now();
+		m_Nodes[m_Upstream[i].m_Node].m_Probe->PostCommandToConnector(message);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Benchmark::Mesh::SendDownstream()
+{
+	for (size_t i = 0; i < m_Downstream.size(); ++i)
+	{
+		auto message = MakeMessage(i);
+		auto& node = m_Nodes[m_Downstream[i].m_Node];
+		m_Downstream[i].m_SendTime = std::chrono::steady_clock::now();
+		m_Gateway->PostCommandToPeripheral(node.m_RouteId, node.m_SharedKey, s_ProbeId, message);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::steady_clock::time_point FSecure::C3::Benchmark::Mesh::WaitForArrivals()
+{
+	auto record = [](std::vector<Message>& messages, GatewayStub::Arrival const& arrival)
+	{
+		if (arrival.m_Index >= messages.size() || messages[arrival.m_Index].m_ReceiveTime)
+			throw std::runtime_error{ "Unexpected message: " + std::to_string(arrival.m_Index) + "." };
+
+		messages[arrival.m_Index].m_ReceiveTime = arrival.m_Time;
+	};
+
+	size_t upstreamReceived = 0, downstreamReceived = 0;
+	auto lastProgress = std::chrono::steady_clock::now();
+	auto lossy = m_Config.m_Network && m_Config.m_Network->m_LossRate > 0;
+	while (upstreamReceived < m_Upstream.size() || downstreamReceived < m_Downstream.size())
+	{
+		auto progress = false;
+		for (auto const& arrival : m_Gateway->ReceiveFromBinders())
+		{
+			record(m_Upstream, arrival);
+			++upstreamReceived;
+			progress = true;
+		}
+
+		for (auto leaf : m_Leaves)
+		{
+			auto probe = std::static_pointer_cast<Interfaces::Peripherals::Probe>(m_Nodes[leaf].m_Probe->GetDevice());
+			for (auto const& arrival : probe->TakeArrivals())
+			{
+				record(m_Downstream, arrival);
+				if (m_Downstream[arrival.m_Index].m_Node != leaf)
+					throw std::runtime_error{ "Message " + std::to_string(arrival.m_Index) + " was delivered to a wrong Relay." };
+
+				++downstreamReceived;
+				progress = true;
+			}
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (progress)
+			lastProgress = now;
+		else if (now - lastProgress > m_Config.m_Timeout && lossy)
+			break;
+		else if (now - lastProgress > m_Config.m_Timeout)
+			throw std::runtime_error{ "Messages stopped arriving. Upstream: " + std::to_string(upstreamReceived) + "/" + std::to_string(m_Upstream.size()) + ", downstream: "
+				+ std::to_string(downstreamReceived) + "/" + std::to_string(m_Downstream.size()) + "." };
+
+		std::this_thread::sleep_for(m_Config.m_UpdateDelay);
+	}
+
+	return lastProgress;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+double FSecure::C3::Benchmark::Mesh::MeasureRouteLookup() const
+{
+	constexpr size_t lookupsPerRelay = 100'000;
+
+	double sum = 0.0;
+	size_t measuredRelays = 0;
+	for (auto const& node : m_Nodes)
+	{
+		if (node.m_Routes.empty())
+			continue;
+
+		size_t found = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < lookupsPerRelay; ++i)
+			found += node.m_Relay->FindRoute(node.m_Routes[i % node.m_Routes.size()]) != nullptr;
+
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		if (found != lookupsPerRelay)
+			throw std::logic_error{ "Route lookup failed." };
+
+		sum += std::chrono::duration<double, std::nano>{ elapsed }.count() / lookupsPerRelay;
+		++measuredRelays;
+	}
+
+	return measuredRelays ? sum / measuredRelays : 0.0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Benchmark::Mesh::MakeReport(std::chrono::steady_clock::duration duration, std::chrono::nanoseconds cpuTime, AllocationCounter::Snapshot allocations, double routeLookupNs) const
+{
+	auto describe = [this](std::vector<Message> const& messages)
+	{
+		std::vector<double> latencies, perHop;
+		for (auto const& message : messages)
+		{
+			if (!message.m_ReceiveTime)
+				continue;
+
+			auto latency = ToMilliseconds(*message.m_ReceiveTime - message.m_SendTime);
+			latencies.push_back(latency);
+			perHop.push_back(latency / m_Nodes[message.m_Node].m_Hops);
+		}
+
+		std::sort(latencies.begin(), latencies.end());
+		std::sort(perHop.begin(), perHop.end());
+		return json{
+			{ "packets", messages.size() },
+			{ "lost", messages.size() - latencies.size() },
+			{ "latencyMs", { { "p50", Percentile(latencies, 50) }, { "p99", Percentile(latencies, 99) }, { "max", latencies.empty() ? 0.0 : latencies.back() } } },
+			{ "perHopLatencyMs", { { "p50", Percentile(perHop, 50) }, { "p99", Percentile(perHop, 99) } } },
+		};
+	};
+
+	static std::map<Topology, std::string> const topologyNames{ { Topology::Chain, "chain" }, { Topology::Star, "star" }, { Topology::Tree, "tree" } };
+	auto seconds = std::chrono::duration<double>{ duration }.count();
+	auto arrived = [](std::vector<Message> const& messages) { return std::count_if(messages.begin(), messages.end(), [](auto const& message) { return message.m_ReceiveTime.has_value(); }); };
+	auto packets = static_cast<double>(arrived(m_Upstream) + arrived(m_Downstream));
+	auto routes = std::max_element(m_Nodes.begin(), m_Nodes.end(), [](auto const& a, auto const& b) { return a.m_Routes.size() < b.m_Routes.size(); })->m_Routes.size();
+	auto depth = std::max_element(m_Nodes.begin(), m_Nodes.end(), [](auto const& a, auto const& b) { return a.m_Hops < b.m_Hops; })->m_Hops;
+
+	auto report = json{
+		{ "topology", topologyNames.at(m_Config.m_Topology) },
+		{ "relays", m_Nodes.size() },
+		{ "leaves", m_Leaves.size() },
+		{ "maxHops", depth },
+		{ "packetSize", m_Config.m_PacketSize },
+		{ "durationMs", ToMilliseconds(duration) },
+		{ "packetsPerSecond", seconds > 0 ? packets / seconds : 0.0 },
+		{ "upstream", describe(m_Upstream) },
+		{ "downstream", describe(m_Downstream) },
+		{ "cpuMicrosecondsPerPacket", packets ? std::chrono::duration<double, std::micro>{ cpuTime }.count() / packets : 0.0 },
+		{ "allocationsPerPacket", packets ? allocations.m_Allocations / packets : 0.0 },
+		{ "allocatedBytesPerPacket", packets ? allocations.m_Bytes / packets : 0.0 },
+		{ "routesPerRelay", routes },
+		{ "routeLookupNs", routeLookupNs },
+		{ "errors", m_Errors },
+	};
+
+	if (auto subsystems = AllocationCounter::DescribeSubsystems(allocations, packets))
+		report["allocationsBySubsystemPerPacket"] = std::move(*subsystems);
+
+	return report;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Benchmark::Mesh::Log(LogMessage const& message, std::string_view sender)
+{
+	if (message.m_Severity != LogMessage::Severity::Error)
+		return;
+
+	++g_Errors;
+	static std::mutex mutex;
+	std::scoped_lock lock(mutex);
+	std::cerr << Utils::ConvertLogMessageToConsoleText("Benchmark", message, sender) << std::endl;
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "Common/FSecure/C3/Interfaces/Channels/InMemory.h"
+#include "Common/FSecure/C3/Interfaces/Channels/NetworkEmulator.h"
+#include "Probe.h"
+#include "AllocationCounter.h"
+
+namespace FSecure::C3::Benchmark
+{
+	/// Shape of benchmarked network.
+	enum class Topology
+	{
+		Chain,																											///< Every Relay has one child. Measures cost of long routes.
+		Star,																											///< All Relays are children of the first one. Measures cost of wide routing tables.
+		Tree,																											///< Binary tree. Mix of both.
+	};
+
+	/// Benchmark configuration.
+	struct MeshConfig
+	{
+		Topology m_Topology = Topology::Chain;																			///< Shape of network.
+		size_t m_Relays = 3;																							///< Number of NodeRelays.
+		size_t m_Packets = 1000;																						///< Number of messages sent in each direction.
+		size_t m_PacketSize = 1024;																						///< Size of each message. At least 4 bytes.
+		size_t m_ExtraRoutes = 0;																						///< Number of unused Routes added to each Relay, to simulate bigger networks.
+		std::chrono::milliseconds m_UpdateDelay = 1ms;																	///< Update delay of InMemory Channels.
+		bool m_SharedMemory = false;																					///< Connect Relays with shared memory rings instead of in-process queues.
+		std::chrono::seconds m_Timeout = 60s;																			///< Benchmark fails if messages don't arrive for this long.
+		std::optional<Interfaces::Channels::NetworkEmulator::Conditions> m_Network;										///< Connect Relays with NetworkEmulator Channels, both directions under these conditions. InMemory Channels are used if not set.
+		QualityOfService::Settings m_QoS;																				///< QoS settings of every Relay.
+	};
+
+	/// NodeRelay that can be wired up without Gateway's help.
+	struct BenchmarkRelay : Core::NodeRelay
+	{
+		/// Create Relay. @see NodeRelay::NodeRelay.
+		/// @param callbackOnLog callback fired whenever a new Log entry is being added.
+		/// @param gatewaySignature public signature used by Network's Gateway to authenticate itself.
+		/// @param broadcastKey Network's symmetric key.
+		/// @param asymmetricKeys asymmetric keys used to communicate with the Gateway.
+		/// @param qosSettings Quality of Service settings of each Channel.
+		BenchmarkRelay(LoggerCallback callbackOnLog, Crypto::PublicSignature const& gatewaySignature, Crypto::SymmetricKey const& broadcastKey, Crypto::AsymmetricKeys const& asymmetricKeys,
+			QualityOfService::Settings const& qosSettings = {});
+
+		/// Create and attach Device, like Gateway's AddDevice command does. First Channel becomes Gateway Return Channel.
+		/// @param did Device's identifier.
+		/// @param deviceNameHash hash of Device's type.
+		/// @param commandLine Device's construction parameters.
+		/// @return attached Device.
+		std::shared_ptr<Core::DeviceBridge> AddDevice(DeviceId did, HashT deviceNameHash, ByteView commandLine);
+
+		/// Detach all Devices.
+		using Core::NodeRelay::Close;
+	};
+
+	/// Stands in for GateRelay, which needs API bridge and Profile. Holds Gateway's keys, so it can read S2G messages and create G2X ones, and talks over a pair of InMemory buffers.
+	class GatewayStub
+	{
+	public:
+		/// Message delivered to Gateway.
+		using Arrival = Interfaces::Peripherals::Probe::Arrival;
+
+		/// Create stub.
+		/// @param signatures Gateway's signature keys.
+		/// @param broadcastKey Network's symmetric key.
+		/// @param input buffer to read from.
+		/// @param output buffer to write to.
+		GatewayStub(Crypto::SignatureKeys const& signatures, Crypto::SymmetricKey const& broadcastKey, std::shared_ptr<Interfaces::Channels::InMemory::Buffer> input, std::shared_ptr<Interfaces::Channels::InMemory::Buffer> output);
+
+		/// Compute key used to encrypt messages for Relay.
+		/// @param relayKey Relay's public key.
+		/// @return shared key.
+		Crypto::SharedKey GetSharedKey(Crypto::PublicKey const& relayKey) const;
+
+		/// Send a message to Peripheral, like GateRelay::PostCommandToPeripheral does.
+		/// @param routeId Route to the Relay hosting Peripheral.
+		/// @param sharedKey key shared with the Relay.
+		/// @param peripheral Peripheral's identifier.
+		/// @param message message starting with its index.
+		void PostCommandToPeripheral(RouteId routeId, Crypto::SharedKey const& sharedKey, DeviceId peripheral, ByteView message);
+
+		/// Read messages sent to Connectors.
+		/// @return arrivals of messages received since the last call.
+		/// @throws std::runtime_error if packet is not a S2G::DeliverToBinder.
+		std::vector<Arrival> ReceiveFromBinders();
+
+	private:
+		Crypto::PrivateSignature m_Signature;																			///< Signs G2X packets.
+		Crypto::PublicKey m_AuthenticationKey;																			///< Used with m_DecryptionKey to decrypt S2G packets.
+		Crypto::PrivateKey m_DecryptionKey;																				///< Gateway's private key.
+		Crypto::SymmetricKey m_BroadcastKey;																			///< Network key.
+		std::shared_ptr<Interfaces::Channels::InMemory::Buffer> m_Input;												///< Buffer from the root Relay.
+		std::shared_ptr<Interfaces::Channels::InMemory::Buffer> m_Output;												///< Buffer to the root Relay.
+		QualityOfService m_QoS;																							///< Reassembles chunks sent by the root Relay.
+		uint32_t m_OutgoingPacketId = 0;																				///< QoS id of next sent packet.
+	};
+
+	/// In-memory network of a Gateway stub and NodeRelays connected with InMemory or NetworkEmulator Channels. Leaf Relays host Probe Peripherals.
+	class Mesh
+	{
+	public:
+		/// Build network.
+		/// @param config benchmark configuration.
+		Mesh(MeshConfig config);
+
+		/// Destructor. Detaches all Devices, which releases Relays.
+		~Mesh();
+
+		/// Send messages from every Probe to Gateway and from Gateway to every Probe, and measure how it went.
+		/// @return JSON report.
+		/// @throws std::runtime_error if messages stopped arriving on a network that doesn't lose frames.
+		json Run();
+
+	private:
+		/// Relay in the network.
+		struct Node
+		{
+			std::shared_ptr<BenchmarkRelay> m_Relay;																	///< The Relay.
+			Crypto::AsymmetricKeys m_Keys;																				///< Relay's keys.
+			std::optional<size_t> m_Parent;																				///< Index of parent Node. Empty for the root, which is connected to Gateway.
+			size_t m_Hops = 1;																							///< Number of Channels between Node and Gateway.
+			RouteId m_RouteId;																							///< Route to Node, as seen by Gateway.
+			Crypto::SharedKey m_SharedKey;																				///< Key used by Gateway to encrypt messages for Node.
+			std::shared_ptr<Core::DeviceBridge> m_ParentChannel;														///< Channel of parent Relay connected to this Node.
+			std::vector<RouteId> m_Routes;																				///< Routes added to Relay.
+			std::shared_ptr<Core::DeviceBridge> m_Probe;																///< Probe Peripheral. Null if Node is not a leaf.
+		};
+
+		/// Message sent through the network.
+		struct Message
+		{
+			size_t m_Node;																								///< Index of Node hosting Probe.
+			std::chrono::steady_clock::time_point m_SendTime;															///< Time of sending.
+			std::optional<std::chrono::steady_clock::time_point> m_ReceiveTime;											///< Time of arrival.
+		};
+
+		/// Identifier of Gateway Return Channel of every Node.
+		static constexpr DeviceId s_GatewayReturnChannelId{ 1 };
+
+		/// Identifier of Probe Peripheral.
+		static constexpr DeviceId s_ProbeId{ 2 };
+
+		/// Size of shared memory rings in KiB.
+		static constexpr uint16_t s_RingSize = 4096;
+
+		/// Channels to children get identifiers starting from this one.
+		static constexpr DeviceId::UnderlyingIntegerType s_FirstChildChannelId = 3;
+
+		/// Get parent of Node in configured topology.
+		/// @param index index of Node.
+		/// @return index of parent, or nothing for the root.
+		std::optional<size_t> GetParent(size_t index) const;
+
+		/// Create message.
+		/// @param index index of message.
+		/// @return message starting with its index.
+		ByteVector MakeMessage(size_t index) const;
+
+		/// Send messages from Probes to Gateway.
+		void SendUpstream();
+
+		/// Send messages from Gateway to Probes.
+		void SendDownstream();
+
+		/// Wait until all messages arrive. On a network that loses frames, messages that don't arrive for MeshConfig::m_Timeout are counted as lost.
+		/// @return time of the last arrival.
+		/// @throws std::runtime_error if messages stopped arriving for MeshConfig::m_Timeout on a network that doesn't lose frames.
+		std::chrono::steady_clock::time_point WaitForArrivals();
+
+		/// Measure average time of Route lookup in each Relay.
+		/// @return lookup time in nanoseconds, average over all Relays.
+		double MeasureRouteLookup() const;
+
+		/// Build report from collected measurements.
+		/// @param duration time it took to deliver all messages that arrived.
+		/// @param cpuTime processor time used by whole process in that period.
+		/// @param allocations allocations made in that period.
+		/// @param routeLookupNs average Route lookup time.
+		/// @return JSON report.
+		json MakeReport(std::chrono::steady_clock::duration duration, std::chrono::nanoseconds cpuTime, AllocationCounter::Snapshot allocations, double routeLookupNs) const;
+
+		/// Called by Relays with log entries. Errors are printed and counted, other entries are dropped.
+		/// @param message log entry.
+		/// @param sender Device that logged the message.
+		static void Log(LogMessage const& message, std::string_view sender);
+
+		MeshConfig m_Config;																							///< Benchmark configuration.
+		std::string m_QueuePrefix;																						///< Makes names of InMemory buffers unique.
+		Crypto::SignatureKeys m_GatewaySignatures;																		///< Gateway's keys.
+		Crypto::SymmetricKey m_BroadcastKey;																			///< Network key.
+		std::vector<Node> m_Nodes;																						///< All Relays. Parent always precedes its children.
+		std::vector<size_t> m_Leaves;																					///< Indexes of Nodes hosting Probes.
+		std::unique_ptr<GatewayStub> m_Gateway;																			///< Gateway's side of the network.
+		std::vector<Message> m_Upstream;																				///< Messages sent from Probes.
+		std::vector<Message> m_Downstream;																				///< Messages sent to Probes.
+		size_t m_Errors = 0;																							///< Number of errors logged during the last Run.
+	};
+}
@@ -0,0 +1,347 @@
+#include "StdAfx.h"
+#include "Microbenchmarks.h"
+#include "Mesh.h"
+
+namespace
+{
+	using namespace FSecure;
+	using namespace FSecure::C3;
+	using namespace FSecure::C3::Benchmark;
+
+	/// Frame size used to chunk packets in Quality of Service benchmark. Typical for HTTP based Channels.
+	constexpr size_t s_QoSFrameSize = 64 * 1024;
+
+	/// Create pseudo-random buffer, so that compression and repeated content don't hide the cost of bigger messages.
+	/// @param size size of buffer.
+	/// @return buffer.
+	ByteVector MakePayload(size_t size)
+	{
+		ByteVector payload;
+		payload.reserve(size);
+		std::minstd_rand generator{ static_cast<uint32_t>(size + 1) };
+		while (payload.size() < size)
+			payload.push_back(static_cast<uint8_t>(generator()));
+
+		return payload;
+	}
+
+	/// Called by Relays with log entries. Benchmarks don't use any Channel that could log, so entries are dropped.
+	void DropLog(LogMessage const&, std::string_view)
+	{
+	}
+
+	/// Serialize a header and a payload, like every Procedure does.
+	void ByteVectorWrite(MicroState& state)
+	{
+		auto payload = MakePayload(state.GetArgument());
+		state.SetBytesPerIteration(payload.size());
+		while (state.KeepRunning())
+			DoNotOptimize(ByteVector{}.Write(uint32_t{ 1 }, uint64_t{ 2 }, ByteView{ payload }));
+	}
+
+	/// Parse buffer written by ByteVectorWrite.
+	void ByteViewRead(MicroState& state)
+	{
+		auto payload = MakePayload(state.GetArgument());
+		auto buffer = ByteVector{}.Write(uint32_t{ 1 }, uint64_t{ 2 }, ByteView{ payload });
+		state.SetBytesPerIteration(payload.size());
+		while (state.KeepRunning())
+		{
+			auto view = ByteView{ buffer };
+			DoNotOptimize(view.Read<uint32_t, uint64_t, ByteView>());
+		}
+	}
+
+	/// Split packet into chunks with QoS headers and reassemble them, like sending and receiving DeviceBridges do.
+	void QualityOfServiceRoundTrip(MicroState& state)
+	{
+		auto payload = MakePayload(state.GetArgument());
+		auto expectedSize = static_cast<uint32_t>(payload.size());
+		QualityOfService sender, receiver;
+		ByteVector frame;
+		state.SetBytesPerIteration(payload.size());
+		while (state.KeepRunning())
+		{
+			auto packetId = sender.GetOutgouingPacketId();
+			auto packet = ByteView{ payload };
+			for (uint32_t chunkId = 0; !packet.empty(); ++chunkId)
+			{
+				auto chunkSize = std::min(packet.size(), s_QoSFrameSize - QualityOfService::s_HeaderSize);
+				frame.clear();
+				frame.Write(packetId, chunkId, expectedSize).Concat(packet.SubString(0, chunkSize));
+				packet.remove_prefix(chunkSize);
+
+				if (auto wholePacket = receiver.GetWholePacket(frame))
+				{
+					DoNotOptimize(*wholePacket);
+					continue;
+				}
+
+				receiver.PushReceivedChunk(frame);
+				if (auto nextPacket = receiver.GetNextPacket(); !nextPacket.empty())
+					DoNotOptimize(nextPacket);
+			}
+		}
+	}
+
+	/// Encrypt with the Network key, like Distributor does with every sent packet.
+	/// @param suite cipher to encrypt with.
+	auto EncryptWithNetworkKey(Crypto::AeadSuite suite)
+	{
+		return [suite](MicroState& state)
+		{
+			auto payload = MakePayload(state.GetArgument());
+			auto key = Crypto::GenerateSymmetricKey();
+			ByteVector ciphertext;
+			state.SetBytesPerIteration(payload.size());
+			while (state.KeepRunning())
+			{
+				Crypto::EncryptAnonymously(payload, key, ciphertext, suite);
+				DoNotOptimize(ciphertext);
+			}
+		};
+	}
+
+	/// Decrypt with the Network key, like Distributor does with every received packet.
+	/// @param suite cipher of decrypted message.
+	auto DecryptWithNetworkKey(Crypto::AeadSuite suite)
+	{
+		return [suite](MicroState& state)
+		{
+			auto payload = MakePayload(state.GetArgument());
+			auto key = Crypto::GenerateSymmetricKey();
+			ByteVector ciphertext, plaintext;
+			Crypto::EncryptAnonymously(payload, key, ciphertext, suite);
+			state.SetBytesPerIteration(payload.size());
+			while (state.KeepRunning())
+				DoNotOptimize(Crypto::DecryptFromAnonymous(ciphertext, key, plaintext));
+		};
+	}
+
+	/// Verify signature of Gateway, like Relays do with every G2X packet.
+	void VerifyGatewaySignature(MicroState& state)
+	{
+		auto payload = MakePayload(state.GetArgument());
+		auto keys = Crypto::GenerateSignatureKeys();
+		auto signedMessage = Crypto::SignMessage(payload, keys.first);
+		state.SetBytesPerIteration(payload.size());
+		while (state.KeepRunning())
+			DoNotOptimize(Crypto::VerifyMessage(signedMessage, keys.second));
+	}
+
+	/// Look up Routes of a Relay having argument Routes, like Relays do with every forwarded packet.
+	void FindRoute(MicroState& state)
+	{
+		// Buffers may outlive the benchmark, so every run needs its own names.
+		static std::atomic<uint32_t> runCounter = 0;
+		auto queuePrefix = "Micro" + std::to_string(runCounter++) + "/";
+		auto signatures = Crypto::GenerateSignatureKeys();
+		auto relay = std::make_shared<BenchmarkRelay>(&DropLog, signatures.second, Crypto::GenerateSymmetricKey(), Crypto::GenerateAsymmetricKeys());
+		auto channel = relay->AddDevice(DeviceId{ 1 }, Hash::Fnv1aType<Interfaces::Channels::InMemory>(), ByteVector{}.Write(queuePrefix + "Down", queuePrefix + "Up", false, uint16_t{ 0 }, uint16_t{ 1000 }, uint16_t{ 0 }));
+		SCOPE_GUARD( channel.reset(); relay->Close(); );
+
+		// Routes are added at once, so that preparation of big tables doesn't rebuild indexes for every Route.
+		Core::RouteManager::Changes changes;
+		std::vector<RouteId> routes;
+		for (size_t i = 0; i < state.GetArgument(); ++i)
+			changes.m_AddedRoutes.emplace_back(routes.emplace_back(AgentId::GenerateRandom(), DeviceId{ 1 }), channel);
+
+		relay->ApplyChanges(changes);
+		size_t next = 0;
+		while (state.KeepRunning())
+			DoNotOptimize(relay->FindRoute(routes[next++ % routes.size()]));
+	}
+
+	/// Find Devices in a container of argument Devices, like Relays do for every Command addressed to a Device.
+	void SafeSmartPointerContainerFind(MicroState& state)
+	{
+		SafeSmartPointerContainer<std::shared_ptr<DeviceId>> devices;
+		for (size_t i = 0; i < state.GetArgument(); ++i)
+			devices.Add(std::make_shared<DeviceId>(static_cast<DeviceId::UnderlyingIntegerType>(i)));
+
+		DeviceId::UnderlyingIntegerType next = 0;
+		while (state.KeepRunning())
+		{
+			auto did = DeviceId{ static_cast<DeviceId::UnderlyingIntegerType>(next++ % state.GetArgument()) };
+			DoNotOptimize(devices.Find([&did](auto const& device) { return *device == did; }));
+		}
+	}
+
+	/// Build Network Profile of argument Agents from scratch, like Gateway does after restoring a snapshot or when all Agents changed.
+	void ProfilerSnapshot(MicroState& state)
+	{
+		auto keys = Crypto::GenerateAsymmetricKeys();
+		auto sharedKey = Crypto::PrecomputeSharedKey(keys.second, keys.first);
+		auto channelHash = Hash::Fnv1aType<Interfaces::Channels::InMemory>();
+		auto lastSeen = FSecure::Utils::TimeSinceEpoch();
+		std::vector<Core::Profiler::Agent> agents;
+		agents.reserve(state.GetArgument());
+		for (size_t i = 0; i < state.GetArgument(); ++i)
+		{
+			auto& agent = agents.emplace_back(std::weak_ptr<Core::Profiler>{}, AgentId::GenerateRandom(), BuildId{ 0 }, keys.second, sharedKey, false, lastSeen, true, HostInfo{ "Host" + std::to_string(i), "User", "Domain", RTL_OSVERSIONINFOEXW{}, static_cast<DWORD>(i), false });
+			agent.ReAddChannel(DeviceId{ 1 }, channelHash, true);
+			agent.ReAddChannel(DeviceId{ 2 }, channelHash);
+		}
+
+		while (state.KeepRunning())
+		{
+			Core::Profiler::Gateway::SnapshotView view;
+			view.m_Gateway = json{ { "agentId", "gateway" } };
+			view.m_Relays.reserve(agents.size());
+			for (auto const& agent : agents)
+				view.m_Relays.push_back(std::make_shared<const json>(agent.CreateProfileSnapshot()));
+
+			DoNotOptimize(view.ToJson());
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::MicroState::MicroState(size_t iterations, size_t argument)
+	: m_Remaining{ iterations }
+	, m_Argument{ argument }
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+bool FSecure::C3::Benchmark::MicroState::KeepRunning()
+{
+	if (!m_IsStarted)
+	{
+		m_IsStarted = true;
+		m_AllocationsAtStart = AllocationCounter::Get();
+		m_Start = std::chrono::steady_clock::now();
+	}
+
+	if (m_Remaining)
+	{
+		--m_Remaining;
+		return true;
+	}
+
+	m_Elapsed = std::chrono::steady_clock::now() - m_Start;
+	m_Allocations = AllocationCounter::Get() - m_AllocationsAtStart;
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Benchmark::MicroState::GetArgument() const
+{
+	return m_Argument;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Benchmark::MicroState::SetBytesPerIteration(size_t bytes)
+{
+	m_BytesPerIteration = bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Benchmark::MicroState::GetBytesPerIteration() const
+{
+	return m_BytesPerIteration;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::chrono::steady_clock::duration FSecure::C3::Benchmark::MicroState::GetElapsed() const
+{
+	return m_Elapsed;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::AllocationCounter::Snapshot FSecure::C3::Benchmark::MicroState::GetAllocations() const
+{
+	return m_Allocations;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::Microbenchmarks::Microbenchmarks(MicroConfig config)
+	: m_Config{ std::move(config) }
+{
+	// Message sizes: a command, a typical binder message and a full HTTP frame.
+	auto const sizes = std::vector<size_t>{ 64, 1024, 64 * 1024 };
+	Register("ByteVector::Write", &ByteVectorWrite, sizes);
+	Register("ByteView::Read", &ByteViewRead, sizes);
+	Register("QualityOfService::RoundTrip", &QualityOfServiceRoundTrip, { 1024, 64 * 1024, 1024 * 1024 });
+	for (auto suite : { Crypto::AeadSuite::XSalsa20Poly1305, Crypto::AeadSuite::XChaCha20Poly1305, Crypto::AeadSuite::Aes256Gcm })
+		if (Crypto::IsAvailable(suite))
+		{
+			Register("Crypto::EncryptAnonymously/" + Crypto::GetName(suite), EncryptWithNetworkKey(suite), sizes);
+			Register("Crypto::DecryptFromAnonymous/" + Crypto::GetName(suite), DecryptWithNetworkKey(suite), sizes);
+		}
+
+	Register("Crypto::VerifyMessage", &VerifyGatewaySignature, sizes);
+	Register("RouteManager::FindRoute", &FindRoute, { 16, 1024, 64 * 1024 });
+	Register("SafeSmartPointerContainer::Find", &SafeSmartPointerContainerFind, { 4, 64, 1024 });
+	Register("Profiler::Snapshot", &ProfilerSnapshot, { 10, 100, 1000 });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Benchmark::Microbenchmarks::Run() const
+{
+	auto benchmarks = json::array();
+	for (auto const& entry : m_Entries)
+	{
+		if (entry.m_Name.find(m_Config.m_Filter) == std::string::npos)
+			continue;
+
+		for (auto argument : entry.m_Arguments)
+		{
+			std::cerr << "Running " << entry.m_Name << "/" << argument << std::endl;
+			benchmarks.push_back(Measure(entry, argument));
+		}
+	}
+
+	return json{
+		{ "context", {
+			{ "build", C3_BUILD_VERSION },
+			{ "timestamp", FSecure::Utils::TimeSinceEpoch() },
+			{ "numCpus", std::thread::hardware_concurrency() },
+			{ "minTimeMs", m_Config.m_MinTime.count() },
+		} },
+		{ "benchmarks", std::move(benchmarks) },
+	};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Benchmark::Microbenchmarks::Register(std::string name, std::function<void(MicroState&)> function, std::vector<size_t> arguments)
+{
+	m_Entries.push_back({ std::move(name), std::move(function), std::move(arguments) });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Benchmark::Microbenchmarks::Measure(Entry const& entry, size_t argument) const
+{
+	// Like Google Benchmark, grow iterations until a run is long enough, aiming slightly above minimal time so that the next run is the last one.
+	size_t iterations = 1;
+	while (true)
+	{
+		MicroState state{ iterations, argument };
+		entry.m_Function(state);
+
+		auto elapsed = std::chrono::duration<double>{ state.GetElapsed() }.count();
+		auto minTime = std::chrono::duration<double>{ m_Config.m_MinTime }.count();
+		if (elapsed >= minTime || iterations >= s_MaxIterations)
+		{
+			auto allocations = state.GetAllocations();
+			auto result = json{
+				{ "name", entry.m_Name + "/" + std::to_string(argument) },
+				{ "iterations", iterations },
+				{ "nsPerIteration", elapsed * 1e9 / iterations },
+				{ "allocationsPerIteration", static_cast<double>(allocations.m_Allocations) / iterations },
+				{ "allocatedBytesPerIteration", static_cast<double>(allocations.m_Bytes) / iterations },
+			};
+
+			if (state.GetBytesPerIteration())
+				result["bytesPerSecond"] = static_cast<double>(state.GetBytesPerIteration()) * iterations / elapsed;
+
+			if (auto subsystems = AllocationCounter::DescribeSubsystems(allocations, static_cast<double>(iterations)))
+				result["allocationsBySubsystemPerIteration"] = std::move(*subsystems);
+
+			return result;
+		}
+
+		auto multiplier = elapsed > minTime / 10 ? minTime * 1.4 / elapsed : 10.0;
+		iterations = std::min(static_cast<size_t>(iterations * multiplier) + 1, s_MaxIterations);
+	}
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "AllocationCounter.h"
+
+namespace FSecure::C3::Benchmark
+{
+	/// Microbenchmarks configuration.
+	struct MicroConfig
+	{
+		std::string m_Filter;																							///< Only benchmarks which names contain this text are run. Empty runs all of them.
+		std::chrono::milliseconds m_MinTime = 500ms;																	///< Minimal measured time of every benchmark.
+	};
+
+	/// Loop state of a running microbenchmark. Modelled on benchmark::State of Google Benchmark.
+	/// Benchmark prepares its data, then runs measured code while KeepRunning returns true. Preparation is neither timed nor counted as allocations.
+	class MicroState
+	{
+	public:
+		/// Create state.
+		/// @param iterations number of iterations to run.
+		/// @param argument size parameter of the benchmark, e.g. message size or number of Routes.
+		MicroState(size_t iterations, size_t argument);
+
+		/// Check if loop should run again. Time and allocations are measured between the first call and the one returning false.
+		/// @return true if another iteration should be run.
+		bool KeepRunning();
+
+		/// @return size parameter of the benchmark.
+		size_t GetArgument() const;
+
+		/// Set number of bytes processed by a single iteration, so that throughput is reported.
+		/// @param bytes number of bytes.
+		void SetBytesPerIteration(size_t bytes);
+
+		/// @return number of bytes processed by a single iteration, 0 if throughput is not reported.
+		size_t GetBytesPerIteration() const;
+
+		/// @return time between the first and the last call to KeepRunning.
+		std::chrono::steady_clock::duration GetElapsed() const;
+
+		/// @return allocations made between the first and the last call to KeepRunning.
+		AllocationCounter::Snapshot GetAllocations() const;
+
+	private:
+		size_t m_Remaining;																								///< Iterations left to run.
+		size_t m_Argument;																								///< Size parameter of the benchmark.
+		size_t m_BytesPerIteration = 0;																					///< Bytes processed by a single iteration.
+		bool m_IsStarted = false;																						///< Set by the first call to KeepRunning.
+		std::chrono::steady_clock::time_point m_Start;																	///< Time of the first call to KeepRunning.
+		std::chrono::steady_clock::duration m_Elapsed{};																///< Measured time.
+		AllocationCounter::Snapshot m_AllocationsAtStart;																///< Allocation counters at the first call to KeepRunning.
+		AllocationCounter::Snapshot m_Allocations;																		///< Measured allocations.
+	};
+
+	/// Keep compiler from optimizing out computation of a value.
+	/// @param value result of measured code.
+	template <typename T>
+	void DoNotOptimize(T const& value)
+	{
+		static_cast<void>(*reinterpret_cast<char const volatile*>(&value));
+		_ReadWriteBarrier();
+	}
+
+	/// Measures primitives on hot paths of Relays and Gateway: serialization, Quality of Service, cryptography, Route and Device lookup and Profile snapshots.
+	class Microbenchmarks
+	{
+	public:
+		/// Register all benchmarks.
+		/// @param config microbenchmarks configuration.
+		Microbenchmarks(MicroConfig config);
+
+		/// Run benchmarks selected by MicroConfig::m_Filter, every one of them for each of its arguments.
+		/// @return JSON report, in layout of Google Benchmark's JSON output.
+		json Run() const;
+
+	private:
+		/// Registered benchmark.
+		struct Entry
+		{
+			std::string m_Name;																						///< Name of benchmark. Reported with argument appended, e.g. "ByteVector::Write/1024".
+			std::function<void(MicroState&)> m_Function;															///< Benchmark body.
+			std::vector<size_t> m_Arguments;																		///< Arguments benchmark is run with.
+		};
+
+		/// Maximal number of iterations of a single run.
+		static constexpr size_t s_MaxIterations = 1'000'000'000;
+
+		/// Register benchmark.
+		/// @param name name of benchmark.
+		/// @param function benchmark body.
+		/// @param arguments arguments benchmark is run with.
+		void Register(std::string name, std::function<void(MicroState&)> function, std::vector<size_t> arguments);
+
+		/// Run benchmark with growing number of iterations until it takes at least MicroConfig::m_MinTime.
+		/// @param entry benchmark to run.
+		/// @param argument argument to run benchmark with.
+		/// @return JSON result of the last run.
+		json Measure(Entry const& entry, size_t argument) const;
+
+		MicroConfig m_Config;																							///< Microbenchmarks configuration.
+		std::vector<Entry> m_Entries;																					///< Registered benchmarks.
+	};
+}
@@ -0,0 +1,37 @@
+#include "StdAfx.h"
+#include "Probe.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Interfaces::Peripherals::Probe::Probe(ByteView)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Interfaces::Peripherals::Probe::OnCommandFromConnector(ByteView packet)
+{
+	auto now = std::chrono::steady_clock::now();
+	auto index = packet.Read<uint32_t>();
+
+	std::scoped_lock lock(m_Mutex);
+	m_Arrivals.push_back({ index, now });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::ByteVector FSecure::C3::Interfaces::Peripherals::Probe::OnReceiveFromPeripheral()
+{
+	return {};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::vector<FSecure::C3::Interfaces::Peripherals::Probe::Arrival> FSecure::C3::Interfaces::Peripherals::Probe::TakeArrivals()
+{
+	std::scoped_lock lock(m_Mutex);
+	return std::exchange(m_Arrivals, {});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t FSecure::C3::Interfaces::Peripherals::Probe::GetArrivalsCount() const
+{
+	std::scoped_lock lock(m_Mutex);
+	return m_Arrivals.size();
+}
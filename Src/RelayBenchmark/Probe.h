@@ -0,0 +1,46 @@
+#pragma once
+
+/// Forward declaration of Connector associated with implant. @see Peripherals::Mock.
+namespace FSecure::C3::Interfaces::Connectors { class MockServer; }
+
+namespace FSecure::C3::Interfaces::Peripherals
+{
+	/// Peripheral receiving benchmark traffic. Like Mock it is served by MockServer Connector, but it records arrival of every message and never sends on its own.
+	/// Benchmark posts messages to Connector through Peripheral's bridge, exactly as AbstractPeripheral::OnReceive does. Mock limits its own messages to one per 5s, which is too few to measure anything.
+	class Probe : public Peripheral<Probe, Connectors::MockServer>
+	{
+	public:
+		/// Arrival of a message.
+		struct Arrival
+		{
+			uint32_t m_Index;																							///< Index of message, read from its first bytes.
+			std::chrono::steady_clock::time_point m_Time;																///< Time of arrival.
+		};
+
+		/// Public Constructor.
+		/// @param ByteView unused.
+		Probe(ByteView);
+
+		/// Destructor
+		virtual ~Probe() = default;
+
+		/// Records arrival of a message.
+		/// @param packet message starting with its index.
+		void OnCommandFromConnector(ByteView packet) override;
+
+		/// Probe doesn't send on its own.
+		/// @returns empty buffer.
+		ByteVector OnReceiveFromPeripheral() override;
+
+		/// Take recorded arrivals.
+		/// @return arrivals in order of receiving.
+		std::vector<Arrival> TakeArrivals();
+
+		/// @return number of messages received so far.
+		size_t GetArrivalsCount() const;
+
+	private:
+		mutable std::mutex m_Mutex;																						///< Guards m_Arrivals.
+		std::vector<Arrival> m_Arrivals;																				///< Recorded arrivals.
+	};
+}
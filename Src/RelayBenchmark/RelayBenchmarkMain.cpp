@@ -0,0 +1,265 @@
+#include "StdAfx.h"
+#include "Mesh.h"
+#include "Microbenchmarks.h"
+#include "Replay.h"
+
+#pragma comment(lib, "winmm.lib")
+
+namespace
+{
+	/// Usage text.
+	constexpr auto s_Usage = R"(Usage: RelayBenchmark [options]
+Builds an in-memory network of NodeRelays connected with InMemory or NetworkEmulator Channels, sends DeliverToBinder traffic in both directions and prints JSON report.
+
+Options:
+  --topology chain|star|tree   Shape of the network. Default: chain.
+  --relays N                   Number of NodeRelays. Default: 3.
+  --packets N                  Number of messages sent in each direction. Default: 1000.
+  --size N                     Size of each message in bytes, at least 4. Default: 1024.
+  --routes N                   Unused Routes added to each Relay. Default: 0.
+  --delay MS                   Update delay of InMemory Channels. Default: 1.
+  --shared-memory              Connect Relays with shared memory rings instead of in-process queues.
+  --timeout S                  Fail if messages stop arriving for this long. On a lossy network, count them as lost. Default: 60.
+  --network slack|smb          Connect Relays with NetworkEmulator Channels behaving like a Slack or a SMB Channel.
+  --latency MS                 One-way latency of emulated links. Implies --network if not given.
+  --jitter MS                  Upper bound of random delay added to every frame on emulated links.
+  --loss PERCENT               Share of frames lost on emulated links.
+  --reorder PERCENT            Share of frames overtaken by the following ones on emulated links.
+  --op-cost MS                 Time taken by every send and receive of emulated Channels.
+  --mtu N                      Largest frame of emulated links in bytes, at least 64. 0 for no limit.
+  --bandwidth KIB              KiB per second passing through emulated links. 0 for no limit.
+  --nack S                     Enable selective retransmission, requested after S seconds.
+  --parity N                   Send a parity chunk after every N chunks. 0 disables it.
+  --micro                      Run microbenchmarks of Core primitives instead of the network.
+  --filter TEXT                Run only microbenchmarks which names contain TEXT.
+  --min-time MS                Minimal measured time of every microbenchmark. Default: 500.
+  --replay FILE                Replay frames captured by a Channel's Capture traffic command into a Relay instead of building the network.
+  --keys FILE                  Gateway's key file of the captured Network, so that replayed packets can be decrypted.
+  --speed X                    Replay speed relative to the capture. 0 replays frames back to back. Default: 1.
+  --direction received|sent    Captured frames to replay. Default: received.
+  --output FILE                Write report to FILE instead of standard output.
+  -h, --help                   Show this message.
+)";
+
+	/// Parse unsigned number.
+	/// @param name name of the option.
+	/// @param value text to parse.
+	/// @return parsed number.
+	/// @throws std::invalid_argument if value is not a number.
+	size_t ParseNumber(std::string_view name, std::string const& value)
+	{
+		try
+		{
+			size_t parsed = 0;
+			auto number = std::stoull(value, &parsed);
+			if (parsed != value.size())
+				throw std::exception{};
+
+			return static_cast<size_t>(number);
+		}
+		catch (...)
+		{
+			throw std::invalid_argument{ "Invalid value of " + std::string{ name } + ": " + value + "." };
+		}
+	}
+
+	/// Emulated network conditions named by --network.
+	/// @param name name of the preset.
+	/// @return conditions of every link.
+	/// @throws std::invalid_argument if preset is unknown.
+	FSecure::C3::Interfaces::Channels::NetworkEmulator::Conditions GetNetworkPreset(std::string const& name)
+	{
+		// Slack: slow web API calls and large messages. SMB: fast file operations on a local network.
+		static std::map<std::string, FSecure::C3::Interfaces::Channels::NetworkEmulator::Conditions> const presets{
+			{ "slack", { 300ms, 100ms, 0.0, 0.0, 150ms, 40000, 0 } },
+			{ "smb", { 5ms, 2ms, 0.0, 0.0, 10ms, 0, 10 * 1024 * 1024 } },
+		};
+
+		auto preset = presets.find(name);
+		if (preset == presets.end())
+			throw std::invalid_argument{ "Unknown network: " + name + "." };
+
+		return preset->second;
+	}
+
+	/// Parse non-negative real number.
+	/// @param name name of the option.
+	/// @param value text to parse.
+	/// @return parsed number.
+	/// @throws std::invalid_argument if value is not a non-negative number.
+	double ParseReal(std::string_view name, std::string const& value)
+	{
+		try
+		{
+			size_t parsed = 0;
+			auto number = std::stod(value, &parsed);
+			if (parsed != value.size() || number < 0)
+				throw std::exception{};
+
+			return number;
+		}
+		catch (...)
+		{
+			throw std::invalid_argument{ "Invalid value of " + std::string{ name } + ": " + value + "." };
+		}
+	}
+
+	/// Parse percentage.
+	/// @param name name of the option.
+	/// @param value text to parse.
+	/// @return parsed share, from 0 to 1.
+	/// @throws std::invalid_argument if value is not a number from 0 to 100.
+	double ParsePercentage(std::string_view name, std::string const& value)
+	{
+		auto percentage = ParseReal(name, value);
+		if (percentage > 100)
+			throw std::invalid_argument{ "Invalid value of " + std::string{ name } + ": " + value + "." };
+
+		return percentage / 100;
+	}
+}
+
+/// Entry point of the application.
+/// @param argc number of program arguments.
+/// @param argv vector of program arguments.
+int main(int argc, char* argv[])
+try
+{
+	using namespace FSecure::C3::Benchmark;
+	std::cerr << "Custom Command and Control - Relay benchmark. BUILD: " << C3_BUILD_VERSION << std::endl;
+
+	MeshConfig config;
+	MicroConfig microConfig;
+	ReplayConfig replayConfig;
+	bool isMicro = false, isReplay = false;
+	std::optional<std::string> outputPath;
+
+	// Link options override the preset wherever they are given, so they are applied after all options are read.
+	using Conditions = FSecure::C3::Interfaces::Channels::NetworkEmulator::Conditions;
+	std::vector<std::function<void(Conditions&)>> networkOverrides;
+	for (auto i = 1; i < argc; ++i)
+	{
+		auto option = std::string{ argv[i] };
+		if (option == "-h" || option == "--help")
+		{
+			std::cout << s_Usage << std::endl;
+			return 0;
+		}
+
+		if (option == "--shared-memory")
+		{
+			config.m_SharedMemory = true;
+			continue;
+		}
+
+		if (option == "--micro")
+		{
+			isMicro = true;
+			continue;
+		}
+
+		if (i + 1 == argc)
+			throw std::invalid_argument{ "Missing value of " + option + ".\n" + s_Usage };
+
+		auto value = std::string{ argv[++i] };
+		if (option == "--topology")
+		{
+			static std::map<std::string, Topology> const topologies{ { "chain", Topology::Chain }, { "star", Topology::Star }, { "tree", Topology::Tree } };
+			auto topology = topologies.find(value);
+			if (topology == topologies.end())
+				throw std::invalid_argument{ "Unknown topology: " + value + "." };
+
+			config.m_Topology = topology->second;
+		}
+		else if (option == "--relays")
+			config.m_Relays = ParseNumber(option, value);
+		else if (option == "--packets")
+			config.m_Packets = ParseNumber(option, value);
+		else if (option == "--size")
+			config.m_PacketSize = ParseNumber(option, value);
+		else if (option == "--routes")
+			config.m_ExtraRoutes = ParseNumber(option, value);
+		else if (option == "--delay")
+			config.m_UpdateDelay = std::chrono::milliseconds{ ParseNumber(option, value) };
+		else if (option == "--timeout")
+			config.m_Timeout = std::chrono::seconds{ ParseNumber(option, value) };
+		else if (option == "--network")
+			config.m_Network = GetNetworkPreset(value);
+		else if (option == "--latency")
+			networkOverrides.push_back([latency = std::chrono::milliseconds{ ParseNumber(option, value) }](Conditions& conditions) { conditions.m_Latency = latency; });
+		else if (option == "--jitter")
+			networkOverrides.push_back([jitter = std::chrono::milliseconds{ ParseNumber(option, value) }](Conditions& conditions) { conditions.m_Jitter = jitter; });
+		else if (option == "--loss")
+			networkOverrides.push_back([loss = ParsePercentage(option, value)](Conditions& conditions) { conditions.m_LossRate = loss; });
+		else if (option == "--reorder")
+			networkOverrides.push_back([reorder = ParsePercentage(option, value)](Conditions& conditions) { conditions.m_ReorderRate = reorder; });
+		else if (option == "--op-cost")
+			networkOverrides.push_back([cost = std::chrono::milliseconds{ ParseNumber(option, value) }](Conditions& conditions) { conditions.m_OperationCost = cost; });
+		else if (option == "--mtu")
+			networkOverrides.push_back([mtu = static_cast<uint32_t>(ParseNumber(option, value))](Conditions& conditions) { conditions.m_Mtu = mtu; });
+		else if (option == "--bandwidth")
+			networkOverrides.push_back([bandwidth = static_cast<uint32_t>(ParseNumber(option, value) * 1024)](Conditions& conditions) { conditions.m_Bandwidth = bandwidth; });
+		else if (option == "--nack")
+		{
+			config.m_QoS.m_SelectiveRetransmission = true;
+			config.m_QoS.m_RetransmissionDelay = std::chrono::seconds{ ParseNumber(option, value) };
+		}
+		else if (option == "--parity")
+			config.m_QoS.m_ParityGroupSize = ParseNumber(option, value);
+		else if (option == "--filter")
+			microConfig.m_Filter = value;
+		else if (option == "--min-time")
+			microConfig.m_MinTime = std::chrono::milliseconds{ ParseNumber(option, value) };
+		else if (option == "--replay")
+		{
+			replayConfig.m_CapturePath = value;
+			isReplay = true;
+		}
+		else if (option == "--keys")
+			replayConfig.m_KeysPath = value;
+		else if (option == "--speed")
+			replayConfig.m_Speed = ParseReal(option, value);
+		else if (option == "--direction")
+		{
+			static std::map<std::string, Core::TrafficCapture::Direction> const directions{ { "received", Core::TrafficCapture::Direction::Received }, { "sent", Core::TrafficCapture::Direction::Sent } };
+			auto direction = directions.find(value);
+			if (direction == directions.end())
+				throw std::invalid_argument{ "Unknown direction: " + value + "." };
+
+			replayConfig.m_Direction = direction->second;
+		}
+		else if (option == "--output")
+			outputPath = value;
+		else
+			throw std::invalid_argument{ "Unknown option: " + option + ".\n" + s_Usage };
+	}
+
+	if (!networkOverrides.empty() && !config.m_Network)
+		config.m_Network.emplace();
+
+	for (auto const& networkOverride : networkOverrides)
+		networkOverride(*config.m_Network);
+
+	// Default timer resolution would turn every 1ms sleep of InMemory Channels into ~15ms.
+	timeBeginPeriod(1);
+	auto report = isMicro ? Microbenchmarks{ microConfig }.Run() : isReplay ? Replay{ replayConfig }.Run() : Mesh{ config }.Run();
+	timeEndPeriod(1);
+
+	if (!outputPath)
+	{
+		std::cout << report.dump(4) << std::endl;
+		return 0;
+	}
+
+	std::ofstream output{ *outputPath };
+	if (!output)
+		throw std::runtime_error{ "Couldn't open output file: " + *outputPath + "." };
+
+	output << report.dump(4) << std::endl;
+	return 0;
+}
+catch (std::exception& e)
+{
+	std::cerr << e.what() << std::endl;
+	return 1;
+}
@@ -0,0 +1,181 @@
+#include "StdAfx.h"
+#include "Replay.h"
+#include "Common/FSecure/Crypto/Base64.h"
+
+namespace
+{
+	std::atomic<size_t> g_Errors = 0;																					///< Number of errors logged by the Relay.
+
+	/// Read processor time used by the process.
+	/// @return kernel and user time of all threads.
+	std::chrono::nanoseconds GetProcessCpuTime()
+	{
+		FILETIME creation, exit, kernel, user;
+		if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+			throw std::runtime_error{ "Couldn't read process times. Error: " + std::to_string(GetLastError()) };
+
+		auto toHundredsOfNanoseconds = [](FILETIME const& time) { return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+		return std::chrono::nanoseconds{ (toHundredsOfNanoseconds(kernel) + toHundredsOfNanoseconds(user)) * 100 };
+	}
+
+	/// Describe distribution of samples.
+	/// @param samples samples to describe. Sorted in place.
+	/// @return p50, p99 and max of the samples.
+	json Describe(std::vector<double>& samples)
+	{
+		std::sort(samples.begin(), samples.end());
+		auto percentile = [&samples](double percentile)
+		{
+			if (samples.empty())
+				return 0.0;
+
+			auto index = static_cast<size_t>(percentile / 100.0 * (samples.size() - 1) + 0.5);
+			return samples[std::min(index, samples.size() - 1)];
+		};
+
+		return json{ { "p50", percentile(50) }, { "p99", percentile(99) }, { "max", samples.empty() ? 0.0 : samples.back() } };
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::Replay::Replay(ReplayConfig config)
+	: m_Config{ std::move(config) }
+{
+	if (m_Config.m_Speed < 0)
+		throw std::invalid_argument{ "Replay speed can't be negative." };
+
+	for (auto& frame : Core::TrafficCapture::Load(m_Config.m_CapturePath))
+		if (frame.m_Direction == m_Config.m_Direction)
+			m_Frames.push_back(std::move(frame));
+
+	if (m_Frames.empty())
+		throw std::runtime_error{ "Capture holds no frames going in chosen direction." };
+
+	// Buffers may outlive Replays, so every Replay needs its own names.
+	static std::atomic<uint32_t> replayCounter = 0;
+	auto queuePrefix = "Replay" + std::to_string(replayCounter++) + "/";
+	m_Output = Interfaces::Channels::InMemory::GetQueue(queuePrefix + "Out");
+
+	// Input stays empty, as frames are passed to the bridge directly. Channel is polled rarely, so that its updates don't add to measurements.
+	auto [gatewaySignature, broadcastKey] = ReadKeys();
+	m_Relay = std::make_shared<BenchmarkRelay>(&Replay::Log, gatewaySignature, broadcastKey, Crypto::GenerateAsymmetricKeys());
+	m_Channel = m_Relay->AddDevice(s_ChannelId, Hash::Fnv1aType<Interfaces::Channels::InMemory>(),
+		ByteVector{}.Write(queuePrefix + "In", queuePrefix + "Out", false, uint16_t{ 0 }, s_ChannelUpdateDelay, uint16_t{ 0 }));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+FSecure::C3::Benchmark::Replay::~Replay()
+{
+	m_Channel.reset();
+	m_Relay->Close();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+json FSecure::C3::Benchmark::Replay::Run()
+{
+	auto errorsBefore = g_Errors.load();
+	auto metricsBefore = m_Channel->GetMetrics();
+	auto cpuTimeBefore = GetProcessCpuTime();
+	auto allocationsBefore = AllocationCounter::Get();
+	auto start = std::chrono::steady_clock::now();
+
+	// Frames are handled on this thread, like a Channel passes them from its OnReceive. Lateness tells how far Relay fell behind the captured timing.
+	std::vector<double> handlingUs, latenessMs;
+	handlingUs.reserve(m_Frames.size());
+	size_t bytes = 0, framesOut = 0;
+	for (auto const& frame : m_Frames)
+	{
+		auto handlingStart = std::chrono::steady_clock::now();
+		if (m_Config.m_Speed > 0)
+		{
+			auto offset = std::chrono::duration<double, std::micro>{ (frame.m_Time - m_Frames.front().m_Time).count() / m_Config.m_Speed };
+			auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(offset);
+			std::this_thread::sleep_until(due);
+			handlingStart = std::chrono::steady_clock::now();
+			latenessMs.push_back(std::chrono::duration<double, std::milli>{ handlingStart - due }.count());
+		}
+
+		m_Channel->PassNetworkPacket(frame.m_Data);
+		handlingUs.push_back(std::chrono::duration<double, std::micro>{ std::chrono::steady_clock::now() - handlingStart }.count());
+		bytes += frame.m_Data.size();
+		framesOut += m_Output->ReadAll().size();
+	}
+
+	auto duration = std::chrono::steady_clock::now() - start;
+	auto allocationsAfter = AllocationCounter::Get();
+	auto cpuTime = GetProcessCpuTime() - cpuTimeBefore;
+	auto metrics = m_Channel->GetMetrics();
+	auto statistics = m_Channel->GetQoSStatistics();
+	framesOut += m_Output->ReadAll().size();
+
+	auto seconds = std::chrono::duration<double>{ duration }.count();
+	auto frames = static_cast<double>(m_Frames.size());
+	auto capturedSeconds = std::chrono::duration<double>{ m_Frames.back().m_Time - m_Frames.front().m_Time }.count();
+	auto allocations = allocationsAfter - allocationsBefore;
+	auto report = json{
+		{ "capture", m_Config.m_CapturePath.string() },
+		{ "direction", m_Config.m_Direction == Core::TrafficCapture::Direction::Received ? "received" : "sent" },
+		{ "speed", m_Config.m_Speed },
+		{ "frames", m_Frames.size() },
+		{ "bytes", bytes },
+		{ "capturedDurationMs", capturedSeconds * 1000 },
+		{ "durationMs", seconds * 1000 },
+		{ "bytesPerSecond", seconds > 0 ? bytes / seconds : 0.0 },
+		{ "frameHandlingUs", Describe(handlingUs) },
+		{ "latenessMs", Describe(latenessMs) },
+		{ "packetsReassembled", metrics.m_PacketsIn - metricsBefore.m_PacketsIn },
+		{ "packetsRouted", metrics.m_PacketsOut - metricsBefore.m_PacketsOut },
+		{ "framesSent", framesOut },
+		{ "incompletePackets", statistics.m_PendingPackets },
+		{ "droppedPackets", statistics.m_ExpiredPackets + statistics.m_EvictedPackets },
+		{ "rejectedChunks", statistics.m_RejectedChunks },
+		{ "duplicateChunks", statistics.m_DuplicateChunks },
+		{ "cpuMicrosecondsPerFrame", std::chrono::duration<double, std::micro>{ cpuTime }.count() / frames },
+		{ "allocationsPerFrame", allocations.m_Allocations / frames },
+		{ "allocatedBytesPerFrame", allocations.m_Bytes / frames },
+		{ "errors", g_Errors.load() - errorsBefore },
+	};
+
+	if (auto subsystems = AllocationCounter::DescribeSubsystems(allocations, frames))
+		report["allocationsBySubsystemPerFrame"] = std::move(*subsystems);
+
+	return report;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+std::pair<FSecure::Crypto::PublicSignature, FSecure::Crypto::SymmetricKey> FSecure::C3::Benchmark::Replay::ReadKeys() const
+{
+	if (!m_Config.m_KeysPath)
+	{
+		std::cerr << "No key file given. Packets will fail to decrypt, so only reassembly is measured." << std::endl;
+		return { Crypto::GenerateSignatureKeys().second, Crypto::GenerateSymmetricKey() };
+	}
+
+	std::ifstream file{ *m_Config.m_KeysPath };
+	if (!file)
+		throw std::runtime_error{ "Couldn't open key file: " + m_Config.m_KeysPath->string() + "." };
+
+	// Same layout as written by the Gateway on its first run.
+	try
+	{
+		auto keys = json::parse(file);
+		auto decode = [&keys](char const* name) { return cppcodec::base64_rfc4648::decode<ByteVector>(keys.at(name).get<std::string>()); };
+		return { Crypto::PublicSignature{ decode("Public signature") }, Crypto::SymmetricKey{ decode("Broadcast key") } };
+	}
+	catch (std::exception& exception)
+	{
+		throw std::runtime_error{ "Incorrect key file. "s + exception.what() };
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void FSecure::C3::Benchmark::Replay::Log(LogMessage const& message, std::string_view sender)
+{
+	if (message.m_Severity != LogMessage::Severity::Error)
+		return;
+
+	++g_Errors;
+	static std::mutex mutex;
+	std::scoped_lock lock(mutex);
+	std::cerr << Utils::ConvertLogMessageToConsoleText("Replay", message, sender) << std::endl;
+}
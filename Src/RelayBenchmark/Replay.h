@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Core/TrafficCapture.h"
+#include "Mesh.h"
+
+namespace FSecure::C3::Benchmark
+{
+	/// Replay configuration.
+	struct ReplayConfig
+	{
+		std::filesystem::path m_CapturePath;																			///< File recorded by a Channel's Capture traffic command.
+		std::optional<std::filesystem::path> m_KeysPath;																///< Gateway's key file of the captured Network. Without it packets fail to decrypt.
+		Core::TrafficCapture::Direction m_Direction = Core::TrafficCapture::Direction::Received;						///< Frames to replay. Sent frames are replayed as the Relay at the other end of the Channel received them.
+		double m_Speed = 1.0;																							///< Replay speed relative to the capture. 0 replays frames back to back.
+	};
+
+	/// Feeds captured frames to a Channel of a NodeRelay, with their original timing scaled by ReplayConfig::m_Speed.
+	/// Frames are passed straight to the Channel's bridge, so the Relay reassembles, decrypts and routes them exactly as it would in the field.
+	class Replay
+	{
+	public:
+		/// Load capture and build the Relay.
+		/// @param config replay configuration.
+		/// @throws std::runtime_error if capture or key file can't be read.
+		Replay(ReplayConfig config);
+
+		/// Destructor. Detaches all Devices, which releases the Relay.
+		~Replay();
+
+		/// Replay all frames and measure how the Relay kept up.
+		/// @return JSON report.
+		json Run();
+
+	private:
+		/// Identifier of the Channel frames are replayed to.
+		static constexpr DeviceId s_ChannelId{ 1 };
+
+		/// Update delay of the Channel in milliseconds.
+		static constexpr uint16_t s_ChannelUpdateDelay = 100;
+
+		/// Read Gateway's public signature and Network key. Generated if ReplayConfig::m_KeysPath is not set.
+		/// @return public signature and Network key.
+		/// @throws std::runtime_error if key file can't be read.
+		std::pair<Crypto::PublicSignature, Crypto::SymmetricKey> ReadKeys() const;
+
+		/// Called by the Relay with log entries. Errors are printed and counted, other entries are dropped.
+		/// @param message log entry.
+		/// @param sender Device that logged the message.
+		static void Log(LogMessage const& message, std::string_view sender);
+
+		ReplayConfig m_Config;																							///< Replay configuration.
+		std::vector<Core::TrafficCapture::Frame> m_Frames;																///< Frames to replay, oldest first.
+		std::shared_ptr<BenchmarkRelay> m_Relay;																		///< Relay receiving the frames.
+		std::shared_ptr<Core::DeviceBridge> m_Channel;																	///< Channel the frames are passed to.
+		std::shared_ptr<Interfaces::Channels::InMemory::Queue> m_Output;												///< Collects frames the Relay sends back through the Channel.
+	};
+}
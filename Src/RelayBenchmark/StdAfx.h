@@ -0,0 +1,19 @@
+#pragma once
+
+// Standard library includes.
+#include <iostream>
+#include <optional>
+#include <fstream>
+
+// C3 inclusion.
+#include "Common/FSecure/C3/Sdk.hpp"
+#include "Common/C3_BUILD_VERSION_HASH_PART.hxx"
+
+// C3 Core internals, driven directly by the benchmark. Core's precompiled header brings json and standard headers its internals rely on.
+#include "Core/StdAfx.h"
+#include "Core/NodeRelay.h"
+#include "Core/Profiler.h"
+#include "Core/DeviceBridge.h"
+
+// Windows timer resolution, excluded by WIN32_LEAN_AND_MEAN.
+#include <timeapi.h>
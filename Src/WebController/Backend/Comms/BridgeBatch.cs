@@ -0,0 +1,146 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.IO.Compression;
+
+namespace FSecure.C3.WebController.Comms
+{
+    /// <summary>
+    /// Encodes and decodes API bridge protocol v2 frames, which carry several messages at once.
+    /// Decrypted frame is [version][flags][messages], where messages are prefixed with their length (4 bytes, little-endian) and optionally compressed with raw Deflate.
+    /// Gateway splits big batches into fragments, which are reassembled separately for high and normal priority lane, because high priority frames can be sent between fragments.
+    /// Version 1 frames are single JSON messages, so they never start with the version byte.
+    /// </summary>
+    public static class BridgeBatch
+    {
+        public const byte ProtocolVersion = 2;
+
+        private const int CompressionThreshold = 1024;
+
+        [Flags]
+        private enum FrameFlags : byte
+        {
+            Compressed = 1 << 0,
+            MoreFragments = 1 << 1,
+            NormalPriority = 1 << 2,
+        }
+
+        /// <summary>
+        /// Collects fragments of batches received from one Gateway.
+        /// </summary>
+        public class Reassembler
+        {
+            private readonly MemoryStream[] lanes = { new MemoryStream(), new MemoryStream() };
+
+            /// <returns>Messages of the batch, or no messages if frame is a fragment of batch that is not complete yet.</returns>
+            public List<byte[]> Add(byte[] frame)
+            {
+                if (!IsBatch(frame) || frame.Length < 2)
+                    throw new FormatException("Invalid API bridge batch");
+
+                var flags = (FrameFlags)frame[1];
+                var lane = lanes[flags.HasFlag(FrameFlags.NormalPriority) ? 1 : 0];
+                if (flags.HasFlag(FrameFlags.MoreFragments) || lane.Length != 0)
+                {
+                    lane.Write(frame, 2, frame.Length - 2);
+                    if (flags.HasFlag(FrameFlags.MoreFragments))
+                        return new List<byte[]>();
+
+                    var whole = new byte[lane.Length + 2];
+                    whole[0] = frame[0];
+                    whole[1] = frame[1];
+                    lane.Position = 0;
+                    lane.Read(whole, 2, (int)lane.Length);
+                    lane.SetLength(0);
+                    frame = whole;
+                }
+
+                return Decode(frame);
+            }
+        }
+
+        public static bool IsBatch(byte[] frame) => frame.Length != 0 && frame[0] == ProtocolVersion;
+
+        public static byte[] Encode(IEnumerable<byte[]> messages)
+        {
+            byte[] body;
+            using (var stream = new MemoryStream())
+            {
+                foreach (var message in messages)
+                {
+                    stream.Write(BitConverter.GetBytes(message.Length), 0, sizeof(int));
+                    stream.Write(message, 0, message.Length);
+                }
+
+                body = stream.ToArray();
+            }
+
+            var isCompressed = false;
+            if (body.Length >= CompressionThreshold)
+            {
+                var compressed = Compress(body);
+                if (compressed.Length < body.Length)
+                {
+                    body = compressed;
+                    isCompressed = true;
+                }
+            }
+
+            var frame = new byte[body.Length + 2];
+            frame[0] = ProtocolVersion;
+            frame[1] = (byte)(isCompressed ? FrameFlags.Compressed : 0);
+            Buffer.BlockCopy(body, 0, frame, 2, body.Length);
+            return frame;
+        }
+
+        public static List<byte[]> Decode(byte[] frame)
+        {
+            if (!IsBatch(frame) || frame.Length < 2)
+                throw new FormatException("Invalid API bridge batch");
+
+            var flags = (FrameFlags)frame[1];
+            if (flags.HasFlag(FrameFlags.MoreFragments))
+                throw new FormatException("API bridge batch is not complete");
+
+            var body = flags.HasFlag(FrameFlags.Compressed) ? Decompress(frame, 2) : new ArraySegment<byte>(frame, 2, frame.Length - 2).ToArray();
+            var messages = new List<byte[]>();
+            for (var offset = 0; offset < body.Length;)
+            {
+                if (body.Length - offset < sizeof(int))
+                    throw new FormatException("Truncated API bridge batch");
+
+                var length = BitConverter.ToInt32(body, offset);
+                offset += sizeof(int);
+                if (length < 0 || length > body.Length - offset)
+                    throw new FormatException("Truncated API bridge batch");
+
+                messages.Add(new ArraySegment<byte>(body, offset, length).ToArray());
+                offset += length;
+            }
+
+            return messages;
+        }
+
+        private static byte[] Compress(byte[] data)
+        {
+            using (var output = new MemoryStream())
+            {
+                using (var deflate = new DeflateStream(output, CompressionLevel.Optimal))
+                    deflate.Write(data, 0, data.Length);
+
+                return output.ToArray();
+            }
+        }
+
+        private static byte[] Decompress(byte[] data, int offset)
+        {
+            using (var input = new MemoryStream(data, offset, data.Length - offset))
+            using (var deflate = new DeflateStream(input, CompressionMode.Decompress))
+            using (var output = new MemoryStream())
+            {
+                deflate.CopyTo(output);
+                return output.ToArray();
+            }
+        }
+    }
+}
@@ -0,0 +1,191 @@
+﻿using System;
+using System.Text;
+using Newtonsoft.Json.Linq;
+
+namespace FSecure.C3.WebController.Comms
+{
+    /// <summary>
+    /// Decodes CBOR (RFC 7049) documents, which Gateway uses for Profile messages once Controller asked for it.
+    /// Only items that have a JSON counterpart are supported: integers, floats, strings, arrays, maps with string keys, booleans and null. Tags are skipped.
+    /// </summary>
+    public static class Cbor
+    {
+        public const string ProfileEncoding = "cbor";
+
+        private const byte Break = 0xFF;
+
+        private const int IndefiniteLength = 31;
+
+        /// <returns>True if message is not a JSON object, so it must be a CBOR map.</returns>
+        public static bool IsCbor(byte[] message) => message.Length != 0 && message[0] != (byte)'{';
+
+        public static JToken Decode(byte[] data)
+        {
+            var position = 0;
+            var token = ReadItem(data, ref position);
+            if (position != data.Length)
+                throw new FormatException("Unexpected data after CBOR item");
+
+            return token;
+        }
+
+        private static JToken ReadItem(byte[] data, ref int position)
+        {
+            var initial = ReadByte(data, ref position);
+            var info = initial & 0x1F;
+            switch (initial >> 5)
+            {
+                case 0:
+                    return new JValue(ReadArgument(data, ref position, info));
+
+                case 1:
+                    var magnitude = ReadArgument(data, ref position, info);
+                    if (magnitude > long.MaxValue)
+                        throw new FormatException("CBOR negative integer out of range");
+
+                    return new JValue(-1 - (long)magnitude);
+
+                case 2:
+                    return new JValue(ReadBytes(data, ref position, info, 2));
+
+                case 3:
+                    return new JValue(Encoding.UTF8.GetString(ReadBytes(data, ref position, info, 3)));
+
+                case 4:
+                    var array = new JArray();
+                    for (var count = ReadLength(data, ref position, info); count != 0 && !IsBreak(data, ref position, count); --count)
+                        array.Add(ReadItem(data, ref position));
+
+                    return array;
+
+                case 5:
+                    var map = new JObject();
+                    for (var count = ReadLength(data, ref position, info); count != 0 && !IsBreak(data, ref position, count); --count)
+                    {
+                        if (!(ReadItem(data, ref position) is JValue key) || key.Type != JTokenType.String)
+                            throw new FormatException("CBOR map key is not a string");
+
+                        map[(string)key.Value] = ReadItem(data, ref position);
+                    }
+
+                    return map;
+
+                case 6:
+                    ReadArgument(data, ref position, info);
+                    return ReadItem(data, ref position);
+
+                default:
+                    return ReadSimple(data, ref position, info);
+            }
+        }
+
+        private static JToken ReadSimple(byte[] data, ref int position, int info)
+        {
+            switch (info)
+            {
+                case 20:
+                    return new JValue(false);
+                case 21:
+                    return new JValue(true);
+                case 22:
+                case 23:
+                    return JValue.CreateNull();
+                case 25:
+                    return new JValue(HalfToDouble((ushort)ReadArgument(data, ref position, info)));
+                case 26:
+                    return new JValue(BitConverter.Int32BitsToSingle((int)ReadArgument(data, ref position, info)));
+                case 27:
+                    return new JValue(BitConverter.Int64BitsToDouble((long)ReadArgument(data, ref position, info)));
+                default:
+                    throw new FormatException($"Unsupported CBOR simple value {info}");
+            }
+        }
+
+        private static double HalfToDouble(ushort half)
+        {
+            var exponent = (half >> 10) & 0x1F;
+            var mantissa = half & 0x3FF;
+            var value = exponent == 0 ? mantissa * Math.Pow(2, -24)
+                : exponent != 31 ? (mantissa + 1024) * Math.Pow(2, exponent - 25)
+                : mantissa == 0 ? double.PositiveInfinity : double.NaN;
+
+            return (half & 0x8000) != 0 ? -value : value;
+        }
+
+        private static byte ReadByte(byte[] data, ref int position)
+        {
+            if (position >= data.Length)
+                throw new FormatException("Truncated CBOR item");
+
+            return data[position++];
+        }
+
+        private static ulong ReadArgument(byte[] data, ref int position, int info)
+        {
+            if (info < 24)
+                return (ulong)info;
+
+            if (info > 27)
+                throw new FormatException($"Invalid CBOR additional information {info}");
+
+            ulong value = 0;
+            for (var size = 1 << (info - 24); size != 0; --size)
+                value = (value << 8) | ReadByte(data, ref position);
+
+            return value;
+        }
+
+        /// <returns>Number of items, or -1 for indefinite length.</returns>
+        private static long ReadLength(byte[] data, ref int position, int info)
+        {
+            if (info == IndefiniteLength)
+                return -1;
+
+            var length = ReadArgument(data, ref position, info);
+            if (length > int.MaxValue)
+                throw new FormatException("CBOR item too long");
+
+            return (long)length;
+        }
+
+        /// <returns>True if indefinite length item ends at position. Break code is consumed.</returns>
+        private static bool IsBreak(byte[] data, ref int position, long count)
+        {
+            if (count >= 0 || position >= data.Length || data[position] != Break)
+                return false;
+
+            ++position;
+            return true;
+        }
+
+        private static byte[] ReadBytes(byte[] data, ref int position, int info, int majorType)
+        {
+            // Indefinite length strings are split into chunks of the same major type.
+            if (info == IndefiniteLength)
+            {
+                using (var chunks = new System.IO.MemoryStream())
+                {
+                    while (!IsBreak(data, ref position, -1))
+                    {
+                        var initial = ReadByte(data, ref position);
+                        if (initial >> 5 != majorType || (initial & 0x1F) == IndefiniteLength)
+                            throw new FormatException("Invalid CBOR string chunk");
+
+                        var chunk = ReadBytes(data, ref position, initial & 0x1F, majorType);
+                        chunks.Write(chunk, 0, chunk.Length);
+                    }
+
+                    return chunks.ToArray();
+                }
+            }
+
+            var length = (int)ReadLength(data, ref position, info);
+            if (length > data.Length - position)
+                throw new FormatException("Truncated CBOR item");
+
+            var bytes = new ArraySegment<byte>(data, position, length).ToArray();
+            position += length;
+            return bytes;
+        }
+    }
+}
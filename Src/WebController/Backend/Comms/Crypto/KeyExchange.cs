@@ -9,20 +9,54 @@ namespace FSecure.C3.WebController.Comms.Crypto
         public const int KeyBytes = 32;
         public const int crypto_secretbox_NONCEBYTES = 24;
         public const int crypto_kx_SESSIONKEYBYTES = 32;
+        public const int crypto_aead_aes256gcm_NPUBBYTES = 12;
+        public const int crypto_aead_aes256gcm_ABYTES = 16;
+
+        /// <summary>
+        /// Ciphers of session messages. Values are tags that prefix encrypted messages, XSalsa20Poly1305 messages are untagged.
+        /// </summary>
+        public enum SessionCipher : byte
+        {
+            XSalsa20Poly1305 = 0,
+            Aes256Gcm = 2,
+        }
+
+        /// <summary>
+        /// Name of AES-256-GCM cipher used in GetCapability and SessionCipher messages.
+        /// </summary>
+        public const string Aes256GcmName = "aes256gcm";
 
         public static KeyPair GenerateKeyPair()
         {
             return PublicKeyBox.GenerateKeyPair();
         }
 
-        public static byte[] Encrypt(byte[] plaintext, byte[] txKey)
+        public static byte[] Encrypt(byte[] plaintext, byte[] txKey, SessionCipher cipher = SessionCipher.XSalsa20Poly1305)
         {
+            if (cipher == SessionCipher.Aes256Gcm)
+            {
+                var aesNonce = SecretAeadAes.GenerateNonce();
+                return new[] { (byte)cipher }.Concat(aesNonce).Concat(SecretAeadAes.Encrypt(plaintext, aesNonce, txKey)).ToArray();
+            }
+
             var nonce = SecretBox.GenerateNonce();
             return nonce.Concat(SecretBox.Create(plaintext, nonce, txKey)).ToArray();
         }
 
         public static byte[] Decrypt(byte[] message, byte[] rxKey)
         {
+            // Untagged messages start with a random nonce, so a tag is only a hint. Fall back to XSalsa20Poly1305 if MAC doesn't match.
+            if (message.Length >= 1 + crypto_aead_aes256gcm_NPUBBYTES + crypto_aead_aes256gcm_ABYTES && message[0] == (byte)SessionCipher.Aes256Gcm && SecretAeadAes.IsAvailable)
+            {
+                try
+                {
+                    var aesNonce = message.Skip(1).Take(crypto_aead_aes256gcm_NPUBBYTES).ToArray();
+                    return SecretAeadAes.Decrypt(message.Skip(1 + crypto_aead_aes256gcm_NPUBBYTES).ToArray(), aesNonce, rxKey);
+                }
+                catch (System.Security.Cryptography.CryptographicException)
+                {
+                }
+            }
 
             var nonce = message.Take(crypto_secretbox_NONCEBYTES).ToArray();
             var cipher = message.Skip(crypto_secretbox_NONCEBYTES).ToArray();
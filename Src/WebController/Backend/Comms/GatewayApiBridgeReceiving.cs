@@ -1,16 +1,24 @@
 ﻿using System;
+using System.Collections.Generic;
+using System.Linq;
 using System.Threading;
 using System.Threading.Tasks;
 using Microsoft.CSharp.RuntimeBinder;
 using Microsoft.Extensions.DependencyInjection;
 using FSecure.C3.WebController.Comms.GatewayResponses;
 using Newtonsoft.Json;
+using Newtonsoft.Json.Linq;
 
 namespace FSecure.C3.WebController.Comms
 {
     public partial class GatewayConnectionHandler
     {
         private Tuple<byte[], byte[]> SessionKeys;
+        private JToken lastProfile;
+        private ulong lastProfileVersion;
+        private bool useBatches;
+        private Crypto.KeyExchange.SessionCipher sessionCipher = Crypto.KeyExchange.SessionCipher.XSalsa20Poly1305;
+        private readonly BridgeBatch.Reassembler batchReassembler = new BridgeBatch.Reassembler();
 
         private class InvalidMessage : Exception
         {
@@ -75,23 +83,46 @@ namespace FSecure.C3.WebController.Comms
 
         private async Task ProcessInitialMessage(CancellationToken cancellationToken)
         {
-            var rawResponse = await ReceiveMessage(cancellationToken);
+            var rawResponse = (await ReceiveMessages(cancellationToken)).FirstOrDefault() ?? throw new InvalidMessage("First message is empty");
             // Parse response, dispatch
 
             GatewayResponse response = ParseResponse(rawResponse);
             if (response.MessageType.ToLower() != "getcapability")
                 throw new InvalidMessage("First message is not GetCapability");
+
+            // Gateway starts sending batches after receiving one, so confirm the support with an empty batch.
+            if (response.BridgeProtocol >= BridgeBatch.ProtocolVersion)
+            {
+                useBatches = true;
+                await EncryptAndSend(BridgeBatch.Encode(Enumerable.Empty<byte[]>()));
+            }
+
+            // Profile is the biggest message on the bridge, binary encoding makes it smaller and faster to produce.
+            if (response.ProfileEncodings?.Contains(Cbor.ProfileEncoding) == true)
+                await SendRequest(new GatewayRequests.GatewayRequest(new GatewayRequests.ProfileEncoding(Cbor.ProfileEncoding)));
+
+            // AES-GCM is much faster than default cipher on CPUs with AES-NI. Gateway detects cipher from every message, so switch right after asking for it.
+            if (response.SessionCiphers?.Contains(Crypto.KeyExchange.Aes256GcmName) == true && Sodium.SecretAeadAes.IsAvailable)
+            {
+                await SendRequest(new GatewayRequests.GatewayRequest(new GatewayRequests.SessionCipher(Crypto.KeyExchange.Aes256GcmName)));
+                sessionCipher = Crypto.KeyExchange.SessionCipher.Aes256Gcm;
+            }
+
             await BeginConnection(response);
         }
 
         private async Task ProcessMessages(CancellationToken cancellationToken)
+        {
+            foreach (var rawResponse in await ReceiveMessages(cancellationToken))
+                await ProcessMessage(rawResponse);
+        }
+
+        private async Task ProcessMessage(byte[] rawResponse)
         {
             try
             {
-                var rawResponse = await ReceiveMessage(cancellationToken);
-
                 // Parse response, dispatch
-                var response = ParseResponse(rawResponse);
+                var response = TrackProfile(ParseResponse(rawResponse));
                 await ProcessResponse(response);
             }
             catch (TypeLoadException e)
@@ -108,25 +139,148 @@ namespace FSecure.C3.WebController.Comms
             }
         }
 
-        private async Task<byte[]> ReceiveMessage(CancellationToken ct)
+        private async Task<List<byte[]>> ReceiveMessages(CancellationToken ct)
         {
-            var message = await tcpClient.ReceiveAsync(ct);
-            return Crypto.KeyExchange.Decrypt(message, SessionKeys.Item1);
+            var message = Crypto.KeyExchange.Decrypt(await tcpClient.ReceiveAsync(ct), SessionKeys.Item1);
+            if (!BridgeBatch.IsBatch(message))
+                return new List<byte[]> { message };
+
+            try
+            {
+                return batchReassembler.Add(message);
+            }
+            catch (Exception e)
+            when (e is FormatException || e is System.IO.InvalidDataException)
+            {
+                throw new InvalidMessage("Failed to decode message batch", e);
+            }
         }
 
         private GatewayResponses.GatewayResponse ParseResponse(byte[] responseData)
         {
-            var message = System.Text.Encoding.ASCII.GetString(responseData);
             try
             {
+                if (Cbor.IsCbor(responseData))
+                    return Cbor.Decode(responseData).ToObject<GatewayResponses.GatewayResponse>();
+
+                var message = System.Text.Encoding.ASCII.GetString(responseData);
                 return JsonConvert.DeserializeObject<GatewayResponses.GatewayResponse>(message);
             }
-            catch (JsonException e)
+            catch (Exception e)
+            when (e is JsonException || e is FormatException)
             {
                 throw new InvalidMessage("Failed to deserialize message", e);
             }
         }
 
+        private GatewayResponse TrackProfile(GatewayResponse response)
+        {
+            if (response.HasError())
+                return response;
+
+            switch (response.MessageType)
+            {
+                case "GetProfile":
+                    lastProfile = response.MessageData.DeepClone();
+                    lastProfileVersion = response.ProfileVersion;
+                    return response;
+
+                case "GetProfileDelta":
+                    if (lastProfile is null || response.ProfileVersion != lastProfileVersion + 1)
+                        throw new InvalidMessage($"Profile delta {response.ProfileVersion} does not follow known profile version {lastProfileVersion}. Waiting for full profile.");
+
+                    try
+                    {
+                        // Profile is dropped on failure, so patch can be applied in place.
+                        var patch = (JArray)response.MessageData;
+                        var changes = FindProfileChanges(patch);
+                        lastProfile = JsonPatch.Apply(lastProfile, patch);
+                        lastProfileVersion = response.ProfileVersion;
+                        if (changes is null)
+                            return new GatewayResponse { MessageType = "GetProfile", ProfileVersion = lastProfileVersion, MessageData = lastProfile.DeepClone() };
+
+                        return new GatewayResponse { MessageType = "GetProfileChanges", ProfileVersion = lastProfileVersion, MessageData = CollectProfileChanges(changes) };
+                    }
+                    catch (Exception e)
+                    {
+                        lastProfile = null;
+                        throw new InvalidMessage("Failed to apply profile delta", e);
+                    }
+
+                default:
+                    return response;
+            }
+        }
+
+        private class ProfileChanges
+        {
+            public bool GatewayChanged;
+            public int AddedRelaysFrom = int.MaxValue;
+            public SortedSet<int> RelayIndices = new SortedSet<int>();
+            public HashSet<string> OldRelayIds = new HashSet<string>();
+        }
+
+        // Finds parts of the last profile touched by a delta, before it is applied. Returns null if whole profile has to be stored again.
+        private ProfileChanges FindProfileChanges(JArray patch)
+        {
+            var changes = new ProfileChanges();
+            var oldRelays = lastProfile["relays"] as JArray;
+            foreach (var operation in patch)
+            {
+                var path = ((string)operation["path"]).Split('/');
+                if (path.Length < 2)
+                    return null;
+
+                if (path[1] != "relays")
+                {
+                    changes.GatewayChanged = true;
+                    continue;
+                }
+
+                if (oldRelays is null || path.Length < 3)
+                    return null;
+
+                if (path[2] == "-")
+                    changes.AddedRelaysFrom = oldRelays.Count;
+                else if (int.TryParse(path[2], System.Globalization.NumberStyles.None, System.Globalization.CultureInfo.InvariantCulture, out var index))
+                {
+                    // Gateway diffs arrays by position, so indices of all operations point to relays of the last profile.
+                    changes.RelayIndices.Add(index);
+                    if (index < oldRelays.Count)
+                        changes.OldRelayIds.Add((string)oldRelays[index]["agentId"]);
+                }
+                else
+                    return null;
+            }
+
+            return changes;
+        }
+
+        // Copies parts found by FindProfileChanges out of the last profile, after the delta is applied.
+        private JObject CollectProfileChanges(ProfileChanges changes)
+        {
+            var relays = lastProfile["relays"] as JArray ?? new JArray();
+            var added = Enumerable.Range(Math.Min(changes.AddedRelaysFrom, relays.Count), Math.Max(relays.Count - changes.AddedRelaysFrom, 0));
+            var changedRelays = new JArray(changes.RelayIndices.TakeWhile(i => i < relays.Count).Union(added).Select(i => relays[i].DeepClone()));
+
+            // Relay that moved to another index is changed there, so it's only removed if it's gone from the whole profile.
+            var removedRelays = new HashSet<string>(changes.OldRelayIds);
+            if (removedRelays.Count != 0)
+                removedRelays.ExceptWith(relays.Select(r => (string)r["agentId"]));
+
+            var changed = new JObject
+            {
+                ["agentId"] = lastProfile["agentId"].DeepClone(),
+                ["relays"] = changedRelays,
+                ["removedRelays"] = new JArray(removedRelays),
+            };
+
+            if (changes.GatewayChanged)
+                changed["gateway"] = new JObject(((JObject)lastProfile).Properties().Where(p => p.Name != "relays").Select(p => new JProperty(p.Name, p.Value.DeepClone())));
+
+            return changed;
+        }
+
         private async Task BeginConnection(GatewayResponses.GatewayResponse response)
         {
             gatewayId = response.GetMessage().Gate.AgentId;
@@ -37,12 +37,13 @@ namespace FSecure.C3.WebController.Comms
 
         public async Task SendRequest(GatewayRequest action)
         {
-            await EncryptAndSend(System.Text.Encoding.ASCII.GetBytes(JsonConvert.SerializeObject(action)));
+            var message = System.Text.Encoding.ASCII.GetBytes(JsonConvert.SerializeObject(action));
+            await EncryptAndSend(useBatches ? BridgeBatch.Encode(new[] { message }) : message);
         }
 
         public async Task EncryptAndSend(byte[] data)
         {
-            var cipher = Crypto.KeyExchange.Encrypt(data, SessionKeys.Item2);
+            var cipher = Crypto.KeyExchange.Encrypt(data, SessionKeys.Item2, sessionCipher);
             await tcpClient.SendAsync(cipher);
         }
     }
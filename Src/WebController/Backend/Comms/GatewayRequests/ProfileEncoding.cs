@@ -0,0 +1,15 @@
+﻿namespace FSecure.C3.WebController.Comms.GatewayRequests
+{
+    /// <summary>
+    /// Asks Gateway to send Profile messages in given encoding. Sent only if Gateway listed it in the GetCapability message.
+    /// </summary>
+    public class ProfileEncoding
+    {
+        public string Encoding { get; set; }
+
+        public ProfileEncoding(string encoding)
+        {
+            Encoding = encoding;
+        }
+    }
+}
@@ -0,0 +1,30 @@
+﻿namespace FSecure.C3.WebController.Comms.GatewayRequests
+{
+    /// <summary>
+    /// Asks Gateway to keep only a part of the Profile in sync. Sent only if Gateway listed scopes in the GetCapability message. Until then, Gateway sends the whole Profile whenever it changes.
+    /// </summary>
+    public class ProfileSubscription
+    {
+        /// <summary>
+        /// "network", "agent", "counters" or "none".
+        /// </summary>
+        public string Scope { get; set; }
+
+        /// <summary>
+        /// Root of the subtree, if Scope is "agent".
+        /// </summary>
+        public string AgentId { get; set; }
+
+        /// <summary>
+        /// Minimal time between updates. Gateway doesn't send updates more often than every 300 ms anyway.
+        /// </summary>
+        public uint IntervalMs { get; set; }
+
+        public ProfileSubscription(string scope, string agentId = null, uint intervalMs = 0)
+        {
+            Scope = scope;
+            AgentId = agentId;
+            IntervalMs = intervalMs;
+        }
+    }
+}
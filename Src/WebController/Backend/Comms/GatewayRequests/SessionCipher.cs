@@ -0,0 +1,15 @@
+﻿namespace FSecure.C3.WebController.Comms.GatewayRequests
+{
+    /// <summary>
+    /// Asks Gateway to encrypt session messages with given cipher. Sent only if Gateway listed it in the GetCapability message.
+    /// </summary>
+    public class SessionCipher
+    {
+        public string Cipher { get; set; }
+
+        public SessionCipher(string cipher)
+        {
+            Cipher = cipher;
+        }
+    }
+}
@@ -14,6 +14,7 @@ namespace FSecure.C3.WebController.Comms
         // Generic version does nothing but prevents RuntimeBinderExceptions
         public async Task ProcessResponse(dynamic ignoreResponse) => await Task.CompletedTask;
         public async Task ProcessResponse(GatewayResponses.GetProfile response) => await UpdateGatewayState(response);
+        public async Task ProcessResponse(GatewayResponses.GetProfileChanges response) => await UpdateGatewayState(response);
         public async Task ProcessResponse(GatewayResponses.GetCapability response) => await AddGatewayBuild(response);
 
         public async Task MarkInactive(ulong gatewayAgentId)
@@ -44,6 +45,51 @@ namespace FSecure.C3.WebController.Comms
             }
         }
 
+        private async Task UpdateGatewayState(GatewayResponses.GetProfileChanges changes)
+        {
+            if (changes is null)
+                throw new ArgumentNullException(nameof(changes));
+
+            using (var transaction = await DbContext.Database.BeginTransactionAsync())
+            {
+                // Changes follow full profile of the same connection, so Gateway is already stored.
+                var gateway = DbContext.Gateways.Single(g => g.AgentId == changes.AgentId);
+
+                // Replaced Relays are removed whole, their Channels, Peripherals and Routes go with them. Gateway is kept, as removing it would cascade to all Relays.
+                var replacedRelays = changes.Relays.Select(r => r.AgentId).Concat(changes.RemovedRelays).ToList();
+                if (replacedRelays.Count != 0)
+                    DbContext.Relays.RemoveRange(DbContext.Relays.Where(r => r.GatewayAgentId == gateway.AgentId && replacedRelays.Contains(r.AgentId)));
+
+                if (changes.Gateway != null)
+                {
+                    DbContext.Channels.RemoveRange(DbContext.Channels.Where(c => c.AgentId == gateway.AgentId));
+                    DbContext.Peripherals.RemoveRange(DbContext.Peripherals.Where(p => p.AgentId == gateway.AgentId));
+                    DbContext.Connectors.RemoveRange(DbContext.Connectors.Where(c => c.AgentId == gateway.AgentId));
+                    DbContext.Set<Route>().RemoveRange(DbContext.Set<Route>().Where(r => r.AgentId == gateway.AgentId));
+                }
+
+                // Save to trigger cascading delete on foreign keys, and to stop tracking removed entities before new ones with the same keys are added.
+                await DbContext.SaveChangesAsync();
+
+                foreach (var relay in changes.Relays)
+                    relay.GatewayAgentId = gateway.AgentId;
+
+                DbContext.Relays.AddRange(changes.Relays);
+
+                if (changes.Gateway != null)
+                {
+                    DbContext.Entry(gateway).CurrentValues.SetValues(changes.Gateway);
+                    gateway.Channels = changes.Gateway.Channels;
+                    gateway.Peripherals = changes.Gateway.Peripherals;
+                    gateway.Connectors = changes.Gateway.Connectors;
+                    gateway.Routes = changes.Gateway.Routes;
+                }
+
+                await DbContext.SaveChangesAsync();
+                transaction.Commit();
+            }
+        }
+
         private async Task AddGatewayBuild(GatewayResponses.GetCapability capability)
         {
             if (capability is null)
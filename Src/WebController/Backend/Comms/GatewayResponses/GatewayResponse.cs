@@ -18,6 +18,11 @@ namespace FSecure.C3.WebController.Comms.GatewayResponses
     {
         public string MessageType { get; set; }
         public ulong SequenceNumber { get; set; }
+        public ulong ProfileVersion { get; set; }
+        public int BridgeProtocol { get; set; }
+        public List<string> ProfileEncodings { get; set; }
+        public List<string> ProfileScopes { get; set; }
+        public List<string> SessionCiphers { get; set; }
         public JToken MessageData { get; set; }
         public JToken Error { get; set; }
 
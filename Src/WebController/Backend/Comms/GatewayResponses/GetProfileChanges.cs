@@ -0,0 +1,30 @@
+﻿using System.Collections.Generic;
+using Newtonsoft.Json;
+
+namespace FSecure.C3.WebController.Comms.GatewayResponses
+{
+    /// <summary>
+    /// Parts of the Profile changed by a delta. Produced by the connection handler from GetProfileDelta, so that storing it costs as much as the change, not the whole network.
+    /// </summary>
+    public class GetProfileChanges
+    {
+        [JsonConverter(typeof(HexStringJsonConverter))]
+        public ulong AgentId { get; set; }
+
+        /// <summary>
+        /// New state of the Gateway without its Relays, or null if it didn't change.
+        /// </summary>
+        public Models.Gateway Gateway { get; set; }
+
+        /// <summary>
+        /// New state of Relays that were added or changed.
+        /// </summary>
+        public ICollection<Models.Relay> Relays { get; set; }
+
+        /// <summary>
+        /// Relays that are gone from the Profile.
+        /// </summary>
+        [JsonProperty(ItemConverterType = typeof(HexStringJsonConverter))]
+        public ICollection<ulong> RemovedRelays { get; set; }
+    }
+}
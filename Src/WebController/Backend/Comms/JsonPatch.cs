@@ -0,0 +1,112 @@
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.Linq;
+using Newtonsoft.Json.Linq;
+
+namespace FSecure.C3.WebController.Comms
+{
+    /// <summary>
+    /// Applies JSON patches (RFC 6902) produced by the Gateway when it sends profile deltas.
+    /// Only add, remove and replace operations are supported, as these are the only ones Gateway generates.
+    /// </summary>
+    public static class JsonPatch
+    {
+        public static JToken Apply(JToken document, JArray patch)
+        {
+            foreach (var operation in patch)
+            {
+                var op = (string)operation["op"];
+                var path = ParsePointer((string)operation["path"]);
+                switch (op)
+                {
+                    case "add":
+                        document = Add(document, path, operation["value"].DeepClone());
+                        break;
+                    case "remove":
+                        Remove(document, path);
+                        break;
+                    case "replace":
+                        document = Replace(document, path, operation["value"].DeepClone());
+                        break;
+                    default:
+                        throw new InvalidOperationException($"Unsupported JSON patch operation: {op}");
+                }
+            }
+
+            return document;
+        }
+
+        private static List<string> ParsePointer(string pointer)
+        {
+            if (pointer.Length == 0)
+                return new List<string>();
+
+            if (pointer[0] != '/')
+                throw new FormatException($"Invalid JSON pointer: {pointer}");
+
+            return pointer.Substring(1).Split('/').Select(t => t.Replace("~1", "/").Replace("~0", "~")).ToList();
+        }
+
+        private static int ParseIndex(string token) => int.Parse(token, NumberStyles.None, CultureInfo.InvariantCulture);
+
+        private static JToken Resolve(JToken document, IEnumerable<string> tokens)
+        {
+            foreach (var token in tokens)
+            {
+                var next = document is JArray array ? array[ParseIndex(token)] : ((JObject)document)[token];
+                document = next ?? throw new InvalidOperationException($"JSON patch path element not found: {token}");
+            }
+
+            return document;
+        }
+
+        private static JToken Add(JToken document, List<string> path, JToken value)
+        {
+            if (path.Count == 0)
+                return value;
+
+            var parent = Resolve(document, path.Take(path.Count - 1));
+            var key = path.Last();
+            if (parent is JArray array)
+            {
+                if (key == "-")
+                    array.Add(value);
+                else
+                    array.Insert(ParseIndex(key), value);
+            }
+            else
+                ((JObject)parent)[key] = value;
+
+            return document;
+        }
+
+        private static void Remove(JToken document, List<string> path)
+        {
+            if (path.Count == 0)
+                throw new InvalidOperationException("Cannot remove the whole document");
+
+            var parent = Resolve(document, path.Take(path.Count - 1));
+            var key = path.Last();
+            if (parent is JArray array)
+                array.RemoveAt(ParseIndex(key));
+            else if (!((JObject)parent).Remove(key))
+                throw new InvalidOperationException($"JSON patch path element not found: {key}");
+        }
+
+        private static JToken Replace(JToken document, List<string> path, JToken value)
+        {
+            if (path.Count == 0)
+                return value;
+
+            var parent = Resolve(document, path.Take(path.Count - 1));
+            var key = path.Last();
+            if (parent is JArray array)
+                array[ParseIndex(key)] = value;
+            else
+                ((JObject)parent)[key] = value;
+
+            return document;
+        }
+    }
+}
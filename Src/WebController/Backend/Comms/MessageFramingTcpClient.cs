@@ -43,9 +43,8 @@ namespace FSecure.C3.Comms
         /// <param name="data"></param>
         public void Send(byte[] data)
         {
-            var stream = mClient.GetStream();
-            stream.Write(BitConverter.GetBytes(IPAddress.HostToNetworkOrder(data.Length)), 0, sizeof(UInt32));
-            stream.Write(data, 0, data.Length);
+            var frame = Frame(data);
+            mClient.GetStream().Write(frame, 0, frame.Length);
         }
 
         /// <summary>
@@ -54,9 +53,8 @@ namespace FSecure.C3.Comms
         /// <param name="data"></param>
         public async Task SendAsync(byte[] data)
         {
-            var stream = mClient.GetStream();
-            await stream.WriteAsync(BitConverter.GetBytes(IPAddress.HostToNetworkOrder(data.Length)), 0, sizeof(UInt32));
-            await stream.WriteAsync(data, 0, data.Length);
+            var frame = Frame(data);
+            await mClient.GetStream().WriteAsync(frame, 0, frame.Length);
         }
 
         /// <summary>
@@ -78,6 +76,17 @@ namespace FSecure.C3.Comms
             mClient.Dispose();
         }
 
+        /// <summary>
+        /// Prefix data with its length, so that both are written with one call
+        /// </summary>
+        private static byte[] Frame(byte[] data)
+        {
+            var frame = new byte[sizeof(UInt32) + data.Length];
+            Buffer.BlockCopy(BitConverter.GetBytes(IPAddress.HostToNetworkOrder(data.Length)), 0, frame, 0, sizeof(UInt32));
+            Buffer.BlockCopy(data, 0, frame, sizeof(UInt32), data.Length);
+            return frame;
+        }
+
         private async Task<byte[]> ReadAsync(int size, CancellationToken ct)
         {
             var stream = mClient.GetStream();
@@ -99,6 +99,47 @@ namespace FSecure.C3.WebController.Controllers
             return new GatewayViewModel(gateway);
         }
 
+        // Gateways sharing the network key form a cluster. Every one of them tracks Relays of builds it issued, so their Profiles are merged here.
+        [HttpGet("cluster")]
+        [Produces("application/json")]
+        public IEnumerable<ClusterViewModel> ListClusters()
+        {
+            return GetClusters().ToList();
+        }
+
+        [HttpGet("cluster/{clusterId}")]
+        [Produces("application/json")]
+        public ActionResult<ClusterViewModel> GetCluster(string clusterId)
+        {
+            var cluster = GetClusters().FirstOrDefault(c => c.Id == clusterId.ToLower());
+            if (cluster is null)
+                return NotFound($"Cluster with id = {clusterId} not found");
+
+            return cluster;
+        }
+
+        private IEnumerable<ClusterViewModel> GetClusters()
+        {
+            return context.Gateways
+                .Include(g => g.Routes)
+                .Include(g => g.Channels)
+                .Include(g => g.Peripherals)
+                .Include(g => g.Connectors)
+                .Include(g => g.Build)
+                .Include(g => g.Relays)
+                    .ThenInclude(r => r.Routes)
+                .Include(g => g.Relays)
+                    .ThenInclude(r => r.Channels)
+                .Include(g => g.Relays)
+                    .ThenInclude(r => r.Peripherals)
+                .Include(g => g.Relays)
+                    .ThenInclude(r => r.Build)
+                .AsEnumerable()
+                .Where(g => ClusterViewModel.GetClusterId(g) != null)
+                .GroupBy(ClusterViewModel.GetClusterId)
+                .Select(group => new ClusterViewModel(group.Key, group.OrderBy(g => g.AgentId)));
+        }
+
         [HttpGet("{gatewayId}/capability")]
         public ActionResult<GatewayCapabilityView> GetGatewayCapability(HexId gatewayId)
         {
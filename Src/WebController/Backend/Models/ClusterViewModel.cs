@@ -0,0 +1,46 @@
+﻿using FSecure.C3.WebController.Comms;
+using Newtonsoft.Json;
+using System;
+using System.Collections.Generic;
+using System.Linq;
+
+namespace FSecure.C3.WebController.Models
+{
+    // Gateways sharing one network key, merged into a single view of the network.
+    public class ClusterViewModel
+    {
+        // Hex encoded public key shared by Gateways of the cluster.
+        public string Id { get; set; }
+
+        public ICollection<GatewayViewModel> Gateways { get; set; }
+
+        public ICollection<ClusterRelayViewModel> Relays { get; set; }
+
+        public int Timestamp { get; set; }
+
+        public ClusterViewModel(string id, IEnumerable<Gateway> gateways)
+        {
+            Id = id;
+            Gateways = gateways.Select(g => new GatewayViewModel(g) { Relays = null }).ToList();
+            Relays = gateways
+                .SelectMany(g => g.Relays ?? Enumerable.Empty<Relay>())
+                .Select(r => new ClusterRelayViewModel(r))
+                .ToList();
+            Timestamp = Gateways.Select(g => g.Timestamp).DefaultIfEmpty().Max();
+        }
+
+        public static string GetClusterId(Gateway gateway) => gateway.Build?.PublicKey is null ? null : BitConverter.ToString(gateway.Build.PublicKey).Replace("-", "").ToLower();
+    }
+
+    public class ClusterRelayViewModel : RelayViewModel
+    {
+        // Gateway that issued Relay's build and tracks it.
+        [JsonConverter(typeof(HexStringJsonConverter))]
+        public ulong GatewayAgentId { get; set; }
+
+        public ClusterRelayViewModel(Relay r) : base(r)
+        {
+            GatewayAgentId = r.GatewayAgentId;
+        }
+    }
+}